@@ -29,6 +29,8 @@ RCSID("$Id$")
 #include <freeradius-devel/server/base.h>
 #include <freeradius-devel/util/debug.h>
 #include <freeradius-devel/server/radmin.h>
+#include <freeradius-devel/tls/cache.h>
+#include <freeradius-devel/tls/session.h>
 
 #include <freeradius-devel/util/dict.h>
 #include <freeradius-devel/util/misc.h>
@@ -496,6 +498,94 @@ static int cmd_stats_memory(FILE *fp, FILE *fp_err, UNUSED void *ctx, fr_cmd_inf
 	return -1;
 }
 
+#ifdef HAVE_REGEX
+static int cmd_stats_regex(FILE *fp, UNUSED FILE *fp_err, UNUSED void *ctx, UNUSED fr_cmd_info_t const *info)
+{
+	fr_regex_cache_stats_t stats;
+
+	regex_cache_stats(&stats);
+
+	fprintf(fp, "hits\t\t%" PRIu64 "\n", stats.hits);
+	fprintf(fp, "misses\t\t%" PRIu64 "\n", stats.misses);
+	fprintf(fp, "evictions\t%" PRIu64 "\n", stats.evictions);
+
+	return 0;
+}
+#endif
+
+static int cmd_stats_xlat(FILE *fp, UNUSED FILE *fp_err, UNUSED void *ctx, UNUSED fr_cmd_info_t const *info)
+{
+	xlat_eval_stats_t stats;
+
+	xlat_eval_stats(&stats);
+
+	fprintf(fp, "streamed\t\t%" PRIu64 "\n", stats.streamed);
+	fprintf(fp, "streamed_allocs\t\t%" PRIu64 "\n", stats.streamed_allocs);
+	fprintf(fp, "interpreted\t\t%" PRIu64 "\n", stats.interpreted);
+	fprintf(fp, "interpreted_blocks\t%" PRIu64 "\n", stats.interpreted_blocks);
+
+	return 0;
+}
+
+static int cmd_stats_unlang(FILE *fp, UNUSED FILE *fp_err, UNUSED void *ctx, UNUSED fr_cmd_info_t const *info)
+{
+	unlang_interpret_stack_stats_t	stats;
+	size_t				i;
+
+	unlang_interpret_stack_stats(&stats);
+
+	fprintf(fp, "stacks\t\t\t%" PRIu64 "\n", stats.stacks);
+	fprintf(fp, "segments_alloced\t%" PRIu64 "\n", stats.segments_alloced);
+	fprintf(fp, "segments_reused\t\t%" PRIu64 "\n", stats.segments_reused);
+
+	for (i = 0; i < NUM_ELEMENTS(stats.depth); i++) {
+		fprintf(fp, "depth_%zu_%zu\t\t%" PRIu64 "\n",
+			i * UNLANG_STACK_SEGMENT, ((i + 1) * UNLANG_STACK_SEGMENT) - 1, stats.depth[i]);
+	}
+
+	return 0;
+}
+
+#ifdef WITH_TLS
+static int cmd_stats_tls(FILE *fp, UNUSED FILE *fp_err, UNUSED void *ctx, UNUSED fr_cmd_info_t const *info)
+{
+	fr_tls_cache_stats_t	stats;
+	fr_tls_session_stats_t	session;
+	uint64_t		total;
+
+	fr_tls_cache_stats(&stats);
+	fr_tls_session_stats(&session);
+
+	total = stats.handshakes_full + stats.handshakes_resumed;
+
+	fprintf(fp, "handshakes.full		%" PRIu64 "\n", stats.handshakes_full);
+	fprintf(fp, "handshakes.resumed	%" PRIu64 "\n", stats.handshakes_resumed);
+	fprintf(fp, "resumed.percent		%.1f\n", total ? ((double)stats.handshakes_resumed * 100) / total : 0.0);
+	fprintf(fp, "store.hits		%" PRIu64 "\n", stats.hits);
+	fprintf(fp, "store.misses		%" PRIu64 "\n", stats.misses);
+	fprintf(fp, "store.stores		%" PRIu64 "\n", stats.stores);
+	fprintf(fp, "store.evictions		%" PRIu64 "\n", stats.evictions);
+	fprintf(fp, "store.entries		%" PRIu64 "\n", stats.entries);
+	fprintf(fp, "ticket.key_rotations	%" PRIu64 "\n", stats.key_rotations);
+	fprintf(fp, "handshake.count		%" PRIu64 "\n", session.handshakes);
+	fprintf(fp, "handshake.avg_time_us	%.1f\n",
+		session.handshakes ? ((double)session.handshake_time / session.handshakes) / 1000 : 0.0);
+	fprintf(fp, "handshake.avg_ssl_us	%.1f\n",
+		session.handshakes ? ((double)session.handshake_ssl_time / session.handshakes) / 1000 : 0.0);
+	fprintf(fp, "async.waits		%" PRIu64 "\n", session.async_waits);
+	fprintf(fp, "async.avg_wait_us	%.1f\n",
+		session.async_waits ? ((double)session.async_wait_time / session.async_waits) / 1000 : 0.0);
+	fprintf(fp, "async.in_flight		%" PRIu64 "\n", session.async_in_flight);
+	fprintf(fp, "async.in_flight_max	%" PRIu64 "\n", session.async_in_flight_max);
+	fprintf(fp, "record.copied		%" PRIu64 "\n", session.record_copied);
+	fprintf(fp, "record.referenced	%" PRIu64 "\n", session.record_referenced);
+	fprintf(fp, "record.avg_copied	%.1f\n",
+		session.handshakes ? (double)session.record_copied / session.handshakes : 0.0);
+
+	return 0;
+}
+#endif
+
 static int cmd_set_debug_level(UNUSED FILE *fp, FILE *fp_err, UNUSED void *ctx, fr_cmd_info_t const *info)
 {
 	int level = atoi(info->argv[0]);
@@ -994,6 +1084,42 @@ static fr_cmd_table_t cmd_table[] = {
 		.read_only = true,
 	},
 
+#ifdef HAVE_REGEX
+	{
+		.parent = "stats",
+		.name = "regex",
+		.func = cmd_stats_regex,
+		.help = "Show statistics for the cache of runtime compiled regular expressions.",
+		.read_only = true,
+	},
+#endif
+
+	{
+		.parent = "stats",
+		.name = "xlat",
+		.func = cmd_stats_xlat,
+		.help = "Show how many synchronous expansions were streamed or interpreted, and the memory they used.",
+		.read_only = true,
+	},
+
+	{
+		.parent = "stats",
+		.name = "unlang",
+		.func = cmd_stats_unlang,
+		.help = "Show how deep unlang stacks grew, and how many stack segments were allocated or reused.",
+		.read_only = true,
+	},
+
+#ifdef WITH_TLS
+	{
+		.parent = "stats",
+		.name = "tls",
+		.func = cmd_stats_tls,
+		.help = "Show TLS handshake timings, how many handshakes resumed a session, and shared session store statistics.",
+		.read_only = true,
+	},
+#endif
+
 	{
 		.parent = "set",
 		.name = "debug",
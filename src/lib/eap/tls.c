@@ -1003,8 +1003,8 @@ unlang_action_t eap_tls_process(request_t *request, eap_session_t *eap_session)
 	 *	If the length included flag is set, we need to skip over the 4 byte
 	 *	message length field.
 	 *
-	 *	Next - Copy the fragment data into OpenSSL's dirty in buffer so that it
-	 *	can process it in a later call.
+	 *	Next - Queue the fragment for OpenSSL to read in a later call.  The
+	 *	fragment isn't copied, it's referenced in the EAP packet it arrived in.
 	 */
 	case EAP_TLS_RECORD_RECV_FIRST:
 	case EAP_TLS_RECORD_RECV_MORE:
@@ -1018,13 +1018,13 @@ unlang_action_t eap_tls_process(request_t *request, eap_session_t *eap_session)
 		}
 
 		/*
-		 *	Update the dirty_in buffer (data for reading by OpenSSL)
+		 *	Add the fragment to the chain OpenSSL reads from.
 		 *
-		 *	This buffer will contain partial data when M bit is set, and should
-		 * 	should only be reinitialized when M bit is not set.
+		 *	The chain will contain partial data when M bit is set,
+		 *	and is drained by OpenSSL once the record is complete.
 		 */
-		if ((tls_session->record_from_buff)(&tls_session->dirty_in, data, data_len) != data_len) {
-			REDEBUG("Exceeded maximum record size");
+		if (fr_tls_session_record_in_ref(tls_session, this_round->response->packet, data, data_len) < 0) {
+			RPEDEBUG("Failed queueing TLS data");
 			eap_tls_session->state = EAP_TLS_FAIL;
 			goto done;
 		}
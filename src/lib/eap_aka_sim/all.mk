@@ -1,5 +1,6 @@
 ifneq "$(OPENSSL_LIBS)" ""
 TARGET := libfreeradius-eap-aka-sim.a
+SUBMAKEFILES := vector_tests.mk
 endif
 
 SOURCES	:= \
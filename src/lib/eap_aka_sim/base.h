@@ -129,6 +129,18 @@ typedef struct {
 	size_t		xres_len;				//!< Length of res (it's variable).
 } fr_aka_sim_vector_umts_t;
 
+typedef struct fr_aka_sim_vector_cache_s fr_aka_sim_vector_cache_t;
+
+/** Limits for the cache of pre-generated vectors
+ *
+ */
+typedef struct {
+	uint32_t	max_entries;				//!< Maximum number of subscribers to hold
+								///< vectors for.  0 disables the cache.
+	uint32_t	batch_size;				//!< How many vectors to generate at once.
+	fr_time_delta_t	lifetime;				//!< How long pre-generated vectors remain usable.
+} fr_aka_sim_vector_cache_conf_t;
+
 /** Stores our checkcode state
  *
  * The checkcode is a hash of all identity packets exchanged
@@ -317,12 +329,19 @@ void		fr_aka_sim_crypto_keys_log(request_t *request, fr_aka_sim_keys_t *keys);
 /*
  *	vector.c
  */
-int		fr_aka_sim_vector_gsm_from_attrs(request_t *request, fr_pair_list_t *vps,
+extern CONF_PARSER const fr_aka_sim_vector_cache_config[];
+
+int		fr_aka_sim_vector_cache_alloc(TALLOC_CTX *ctx, fr_aka_sim_vector_cache_t **out,
+					      fr_aka_sim_vector_cache_conf_t const *conf);
+
+int		fr_aka_sim_vector_gsm_from_attrs(request_t *request, fr_aka_sim_vector_cache_t *cache,
+						 fr_pair_list_t *vps,
 						 int idx,
 						 fr_aka_sim_keys_t *keys,
 						 fr_aka_sim_vector_src_t *src);
 
-int		fr_aka_sim_vector_umts_from_attrs(request_t *request, fr_pair_list_t *vps,
+int		fr_aka_sim_vector_umts_from_attrs(request_t *request, fr_aka_sim_vector_cache_t *cache,
+						  fr_pair_list_t *vps,
 						  fr_aka_sim_keys_t *keys,
 						  fr_aka_sim_vector_src_t *src);
 
@@ -1747,6 +1747,55 @@ static void test_eap_aka_kdf_1_reauth(void)
 }
 
 
+/*
+ *	Compare generating vectors one at a time, with
+ *	generating them in batches for the vector cache.
+ */
+static void test_eap_aka_vector_generation_speed(void)
+{
+	uint8_t const		ki[] = { 0x46, 0x5b, 0x5c, 0xe8, 0xb1, 0x99, 0xb4, 0x9f,
+					 0xaa, 0x5f, 0x0a, 0x2e, 0xe2, 0x38, 0xa6, 0xbc };
+	uint8_t const		opc[] = { 0xcd, 0x63, 0xcb, 0x71, 0x95, 0x4a, 0x9f, 0x4e,
+					  0x48, 0xa5, 0x99, 0x4e, 0x37, 0xa0, 0x2b, 0xaf };
+	uint8_t const		amf[] = { 0x80, 0x00 };
+
+	milenage_vector_t	vectors[8];
+	fr_time_t		start;
+	fr_time_delta_t		single, batch;
+	int			reps = 100000, i;
+	size_t			j;
+
+	fr_time_start();
+
+	for (j = 0; j < NUM_ELEMENTS(vectors); j++) {
+		fr_rand_buffer(vectors[j].rand, sizeof(vectors[j].rand));
+		vectors[j].sqn = 2 + j;
+	}
+
+	start = fr_time();
+	for (i = 0; i < reps; i++) {
+		for (j = 0; j < NUM_ELEMENTS(vectors); j++) {
+			milenage_vector_t *v = &vectors[j];
+
+			TEST_CHECK(milenage_umts_generate(v->autn, v->ik, v->ck, v->ak, v->res,
+							  opc, amf, ki, v->sqn, v->rand) == 0);
+		}
+	}
+	single = fr_time_sub(fr_time(), start);
+
+	start = fr_time();
+	for (i = 0; i < reps; i++) {
+		TEST_CHECK(milenage_umts_generate_batch(vectors, NUM_ELEMENTS(vectors), opc, amf, ki) == 0);
+	}
+	batch = fr_time_sub(fr_time(), start);
+
+	TEST_MSG_ALWAYS("vectors=%zu", reps * NUM_ELEMENTS(vectors));
+	TEST_MSG_ALWAYS("single_per_sec=%0.0lf",
+			(reps * NUM_ELEMENTS(vectors)) / (fr_time_delta_unwrap(single) / (double)NSEC));
+	TEST_MSG_ALWAYS("batch_per_sec=%0.0lf",
+			(reps * NUM_ELEMENTS(vectors)) / (fr_time_delta_unwrap(batch) / (double)NSEC));
+}
+
 TEST_LIST = {
 	/*
 	 *	EAP-SIM
@@ -1770,6 +1819,11 @@ TEST_LIST = {
 	{ "test_eap_aka_derive_ck_ik",		test_eap_aka_derive_ck_ik	},
 	{ "test_eap_aka_kdf_1_reauth",		test_eap_aka_kdf_1_reauth	},
 
+	/*
+	 *	Performance tests
+	 */
+	{ "Speed Test - Vector generation",	test_eap_aka_vector_generation_speed },
+
 
 	{ NULL }
 };
@@ -2358,6 +2358,7 @@ STATE(aka_challenge)
  */
 RESUME(send_aka_challenge_request)
 {
+	eap_aka_sim_process_conf_t	*inst = talloc_get_type_abort(mctx->inst->data, eap_aka_sim_process_conf_t);
 	eap_aka_sim_session_t	*eap_aka_sim_session = talloc_get_type_abort(mctx->rctx, eap_aka_sim_session_t);
 	fr_pair_t		*vp;
 	fr_aka_sim_vector_src_t	src = AKA_SIM_VECTOR_SRC_AUTO;
@@ -2412,12 +2413,22 @@ RESUME(send_aka_challenge_request)
 	 *	Get vectors from attribute or generate
 	 *	them using COMP128-* or Milenage.
 	 */
-	if (fr_aka_sim_vector_umts_from_attrs(request, &request->control_pairs,
+	if (fr_aka_sim_vector_umts_from_attrs(request, inst->vector_cache, &request->control_pairs,
 					      &eap_aka_sim_session->keys, &src) != 0) {
 	    	REDEBUG("Failed retrieving UMTS vectors");
 		goto failure;
 	}
 
+	/*
+	 *	Pre-generated quintuplets may have a higher SQN
+	 *	than &control.SIM-SQN, so record the one we
+	 *	actually used, for policy to store.
+	 */
+	if (src == AKA_SIM_VECTOR_SRC_KI) {
+		MEM(pair_update_session_state(&vp, attr_sim_sqn) >= 0);
+		vp->vp_uint64 = eap_aka_sim_session->keys.sqn;
+	}
+
 	/*
 	 *	Don't leave the AMF hanging around
 	 */
@@ -2661,6 +2672,7 @@ STATE(sim_challenge)
  */
 RESUME(send_sim_challenge_request)
 {
+	eap_aka_sim_process_conf_t	*inst = talloc_get_type_abort(mctx->inst->data, eap_aka_sim_process_conf_t);
 	eap_aka_sim_session_t	*eap_aka_sim_session = talloc_get_type_abort(mctx->rctx, eap_aka_sim_session_t);
 
 	fr_pair_t		*vp;
@@ -2685,11 +2697,11 @@ RESUME(send_sim_challenge_request)
 	}
 
 	RDEBUG2("Acquiring GSM vector(s)");
-	if ((fr_aka_sim_vector_gsm_from_attrs(request, &request->control_pairs, 0,
+	if ((fr_aka_sim_vector_gsm_from_attrs(request, inst->vector_cache, &request->control_pairs, 0,
 					      &eap_aka_sim_session->keys, &src) != 0) ||
-	    (fr_aka_sim_vector_gsm_from_attrs(request, &request->control_pairs, 1,
+	    (fr_aka_sim_vector_gsm_from_attrs(request, inst->vector_cache, &request->control_pairs, 1,
 	    				      &eap_aka_sim_session->keys, &src) != 0) ||
-	    (fr_aka_sim_vector_gsm_from_attrs(request, &request->control_pairs, 2,
+	    (fr_aka_sim_vector_gsm_from_attrs(request, inst->vector_cache, &request->control_pairs, 2,
 	    				      &eap_aka_sim_session->keys, &src) != 0)) {
 	    	REDEBUG("Failed retrieving SIM vectors");
 		RETURN_MODULE_FAIL;
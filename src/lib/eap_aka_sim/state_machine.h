@@ -204,6 +204,10 @@ typedef struct {
 									///< EVP_sha1() for EAP-AKA, EVP_sha256()
 									///< for EAP-AKA'.
 
+	fr_aka_sim_vector_cache_conf_t	vector_cache_conf;		//!< Limits for pre-generated vectors.
+	fr_aka_sim_vector_cache_t	*vector_cache;			//!< Pre-generated vectors, or NULL if
+									///< vectors are generated per-request.
+
 	eap_aka_sim_actions_t		actions;			//!< Pre-compiled virtual server sections.
 } eap_aka_sim_process_conf_t;
 
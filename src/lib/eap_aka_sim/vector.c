@@ -39,6 +39,429 @@ RCSID("$Id$")
 #include "attrs.h"
 
 #include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/hash.h>
+#include <freeradius-devel/util/syserror.h>
+
+#include <openssl/crypto.h>
+#include <pthread.h>
+
+/** Pre-generated vectors for a single subscriber
+ *
+ */
+typedef struct {
+	fr_dlist_t			lru;			//!< Entry in the LRU list.
+
+	fr_aka_sim_vector_type_t	type;			//!< Either AKA_SIM_VECTOR_GSM or AKA_SIM_VECTOR_UMTS.
+	char const			*imsi;			//!< Permanent identity of the subscriber.
+	uint32_t			hash;			//!< Of the type and IMSI.
+
+	/*
+	 *	Inputs the vectors were generated with.  If the
+	 *	inputs for the current request don't match these
+	 *	the vectors are discarded.
+	 */
+	uint32_t			version;		//!< Algorithm used.
+	uint8_t				ki[MILENAGE_KI_SIZE];	//!< Subscriber key.
+	uint8_t				opc[MILENAGE_OPC_SIZE];	//!< Derived operator code.
+	uint8_t				amf[MILENAGE_AMF_SIZE];	//!< Authentication management field.
+
+	fr_time_t			expires;		//!< When the vectors should no longer be used.
+	uint32_t			next;			//!< Next unused vector.
+	uint32_t			num;			//!< Number of vectors generated.
+
+	union {
+		fr_aka_sim_vector_gsm_t	*gsm;			//!< Triplets.
+		milenage_vector_t	*umts;			//!< Quintuplets, with increasing SQNs.
+	};
+} aka_sim_vector_cache_entry_t;
+
+struct fr_aka_sim_vector_cache_s {
+	pthread_mutex_t			mutex;			//!< Serialises access to the cache, as all
+								///< workers share the same vectors.
+	fr_hash_table_t			*ht;			//!< Entries by type and IMSI.
+	fr_dlist_head_t			lru;			//!< Least recently used entry at the head.
+
+	fr_aka_sim_vector_cache_conf_t	conf;			//!< Limits for the cache.
+};
+
+CONF_PARSER const fr_aka_sim_vector_cache_config[] = {
+	{ FR_CONF_OFFSET("max_entries", FR_TYPE_UINT32, fr_aka_sim_vector_cache_conf_t, max_entries), .dflt = "0" },
+	{ FR_CONF_OFFSET("batch_size", FR_TYPE_UINT32, fr_aka_sim_vector_cache_conf_t, batch_size), .dflt = "8" },
+	{ FR_CONF_OFFSET("lifetime", FR_TYPE_TIME_DELTA, fr_aka_sim_vector_cache_conf_t, lifetime), .dflt = "300" },
+
+	CONF_PARSER_TERMINATOR
+};
+
+static uint32_t vector_cache_entry_hash(void const *data)
+{
+	aka_sim_vector_cache_entry_t const *entry = data;
+
+	return entry->hash;
+}
+
+static int8_t vector_cache_entry_cmp(void const *one, void const *two)
+{
+	aka_sim_vector_cache_entry_t const *a = one, *b = two;
+	int ret;
+
+	ret = CMP(a->type, b->type);
+	if (ret != 0) return ret;
+
+	ret = strcmp(a->imsi, b->imsi);
+	return CMP(ret, 0);
+}
+
+/** Wipe key material from an entry before it's freed
+ *
+ */
+static int _vector_cache_entry_free(aka_sim_vector_cache_entry_t *entry)
+{
+	OPENSSL_cleanse(entry->ki, sizeof(entry->ki));
+	OPENSSL_cleanse(entry->opc, sizeof(entry->opc));
+
+	switch (entry->type) {
+	case AKA_SIM_VECTOR_GSM:
+		OPENSSL_cleanse(entry->gsm, talloc_get_size(entry->gsm));
+		break;
+
+	case AKA_SIM_VECTOR_UMTS:
+		OPENSSL_cleanse(entry->umts, talloc_get_size(entry->umts));
+		break;
+
+	default:
+		break;
+	}
+
+	return 0;
+}
+
+/** Remove an entry from the cache and free it
+ *
+ * @note Must be called with the cache locked.
+ */
+static void vector_cache_entry_remove(fr_aka_sim_vector_cache_t *cache, aka_sim_vector_cache_entry_t *entry)
+{
+	(void) fr_hash_table_remove(cache->ht, entry);
+	fr_dlist_remove(&cache->lru, entry);
+	talloc_free(entry);
+}
+
+/** Generate a batch of vectors for a subscriber
+ *
+ * UMTS vectors are assigned consecutive sequence numbers starting at sqn,
+ * so they remain acceptable to the SIM when they're used in order.
+ *
+ * @param[in] entry	to populate.  Inputs must already be set.
+ * @param[in] sqn	of the first UMTS vector.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int vector_cache_entry_generate(aka_sim_vector_cache_entry_t *entry, uint64_t sqn)
+{
+	uint32_t	i;
+	size_t		j;
+
+	switch (entry->type) {
+	case AKA_SIM_VECTOR_UMTS:
+		MEM(entry->umts = talloc_array(entry, milenage_vector_t, entry->num));
+
+		for (i = 0; i < entry->num; i++) {
+			for (j = 0; j < sizeof(entry->umts[i].rand); j += sizeof(uint32_t)) {
+				uint32_t rand = fr_rand();
+				memcpy(&entry->umts[i].rand[j], &rand, sizeof(rand));
+			}
+			entry->umts[i].sqn = sqn + i;
+		}
+
+		return milenage_umts_generate_batch(entry->umts, entry->num, entry->opc, entry->amf, entry->ki);
+
+	case AKA_SIM_VECTOR_GSM:
+	{
+		milenage_vector_t *mv = NULL;
+
+		MEM(entry->gsm = talloc_array(entry, fr_aka_sim_vector_gsm_t, entry->num));
+
+		for (i = 0; i < entry->num; i++) {
+			for (j = 0; j < sizeof(entry->gsm[i].rand); j += sizeof(uint32_t)) {
+				uint32_t rand = fr_rand();
+				memcpy(&entry->gsm[i].rand[j], &rand, sizeof(rand));
+			}
+		}
+
+		switch (entry->version) {
+		case FR_SIM_ALGO_VERSION_VALUE_COMP128_1:
+			for (i = 0; i < entry->num; i++) {
+				comp128v1(entry->gsm[i].sres, entry->gsm[i].kc, entry->ki, entry->gsm[i].rand);
+			}
+			return 0;
+
+		case FR_SIM_ALGO_VERSION_VALUE_COMP128_2:
+		case FR_SIM_ALGO_VERSION_VALUE_COMP128_3:
+			for (i = 0; i < entry->num; i++) {
+				comp128v23(entry->gsm[i].sres, entry->gsm[i].kc, entry->ki, entry->gsm[i].rand,
+					   (entry->version == FR_SIM_ALGO_VERSION_VALUE_COMP128_2));
+			}
+			return 0;
+
+		/*
+		 *	f2-f4 don't depend on the SQN or AMF, so we
+		 *	can use the batched UMTS function, and
+		 *	convert the results.
+		 */
+		case FR_SIM_ALGO_VERSION_VALUE_COMP128_4:
+			MEM(mv = talloc_zero_array(entry, milenage_vector_t, entry->num));
+			for (i = 0; i < entry->num; i++) memcpy(mv[i].rand, entry->gsm[i].rand, sizeof(mv[i].rand));
+
+			if (milenage_umts_generate_batch(mv, entry->num, entry->opc, entry->amf, entry->ki) < 0) {
+				talloc_free(mv);
+				return -1;
+			}
+
+			for (i = 0; i < entry->num; i++) {
+				milenage_gsm_from_umts(entry->gsm[i].sres, entry->gsm[i].kc, mv[i].ik, mv[i].ck, mv[i].res);
+			}
+			OPENSSL_cleanse(mv, talloc_get_size(mv));
+			talloc_free(mv);
+			return 0;
+
+		default:
+			fr_strerror_printf("Unknown/unsupported algorithm %i", entry->version);
+			return -1;
+		}
+	}
+
+	default:
+		fr_assert(0);
+		return -1;
+	}
+}
+
+/** Retrieve a vector from the cache, generating a new batch of vectors if required
+ *
+ * Vectors are cached by &session-state.Permanent-Identity.  If the subscriber's
+ * Ki, OPc, AMF or algorithm change, any vectors generated with the old values
+ * are discarded.
+ *
+ * @param[in] request	The current request.
+ * @param[in] cache	to retrieve vectors from.
+ * @param[out] out	Where to write the vector.  Must point to a milenage_vector_t
+ *			for UMTS vectors, or a fr_aka_sim_vector_gsm_t for GSM vectors.
+ * @param[in] type	of vector to retrieve.
+ * @param[in] version	Algorithm to generate vectors with.
+ * @param[in] ki	Subscriber key.
+ * @param[in] opc	Derived operator code, or NULL if the algorithm doesn't use one.
+ * @param[in] amf	Authentication management field, or NULL for GSM vectors.
+ * @param[in] sqn	Lowest acceptable sequence number for UMTS vectors.
+ * @return
+ *	- 1 the vector can't be cached, the caller should generate it.
+ *	- 0 vector written to out.
+ *	- -1 on failure.
+ */
+static int vector_cache_take(request_t *request, fr_aka_sim_vector_cache_t *cache, void *out,
+			     fr_aka_sim_vector_type_t type, uint32_t version,
+			     uint8_t const ki[static MILENAGE_KI_SIZE], uint8_t const *opc, uint8_t const *amf,
+			     uint64_t sqn)
+{
+	aka_sim_vector_cache_entry_t	find, *entry;
+	fr_pair_t			*imsi_vp;
+	fr_time_t			now = fr_time();
+	uint32_t			remaining;
+
+	imsi_vp = fr_pair_find_by_da_idx(&request->session_state_pairs, attr_eap_aka_sim_permanent_identity, 0);
+	if (!imsi_vp) return 1;
+
+	/*
+	 *	Fill out everything we compare against
+	 */
+	memset(&find, 0, sizeof(find));
+	find.type = type;
+	find.imsi = imsi_vp->vp_strvalue;
+	find.hash = fr_hash_update(&type, sizeof(type), fr_hash_string(find.imsi));
+	find.version = version;
+	memcpy(find.ki, ki, sizeof(find.ki));
+	if (opc) memcpy(find.opc, opc, sizeof(find.opc));
+	if (amf) memcpy(find.amf, amf, sizeof(find.amf));
+
+	pthread_mutex_lock(&cache->mutex);
+	entry = fr_hash_table_find(cache->ht, &find);
+	if (entry) {
+		if (fr_time_gt(now, entry->expires) || (entry->version != find.version) ||
+		    (CRYPTO_memcmp(entry->ki, find.ki, sizeof(entry->ki)) != 0) ||
+		    (CRYPTO_memcmp(entry->opc, find.opc, sizeof(entry->opc)) != 0) ||
+		    (memcmp(entry->amf, find.amf, sizeof(entry->amf)) != 0)) {
+		stale:
+			vector_cache_entry_remove(cache, entry);
+			goto generate;
+		}
+
+		/*
+		 *	Skip any vectors the SIM would reject
+		 *	as replays.
+		 */
+		if (type == AKA_SIM_VECTOR_UMTS) {
+			while ((entry->next < entry->num) && (entry->umts[entry->next].sqn < sqn)) entry->next++;
+			if (entry->next == entry->num) goto stale;
+
+			memcpy(out, &entry->umts[entry->next], sizeof(entry->umts[entry->next]));
+		} else {
+			memcpy(out, &entry->gsm[entry->next], sizeof(entry->gsm[entry->next]));
+		}
+		entry->next++;
+		remaining = entry->num - entry->next;
+
+		if (remaining == 0) {
+			vector_cache_entry_remove(cache, entry);
+		} else {
+			fr_dlist_remove(&cache->lru, entry);
+			fr_dlist_insert_tail(&cache->lru, entry);
+		}
+		pthread_mutex_unlock(&cache->mutex);
+
+		RDEBUG2("Using pre-generated vector for \"%s\" (%u remaining)", find.imsi, remaining);
+
+		return 0;
+	}
+generate:
+	pthread_mutex_unlock(&cache->mutex);
+
+	/*
+	 *	Entries are parented by the NULL ctx as
+	 *	they're allocated by whichever worker
+	 *	happens to be authenticating the subscriber.
+	 */
+	MEM(entry = talloc_memdup(NULL, &find, sizeof(find)));
+	talloc_set_type(entry, aka_sim_vector_cache_entry_t);
+	talloc_set_destructor(entry, _vector_cache_entry_free);
+	OPENSSL_cleanse(find.ki, sizeof(find.ki));
+	OPENSSL_cleanse(find.opc, sizeof(find.opc));
+
+	MEM(entry->imsi = talloc_bstrndup(entry, imsi_vp->vp_strvalue, imsi_vp->vp_length));
+	entry->expires = fr_time_add(now, cache->conf.lifetime);
+	entry->num = cache->conf.batch_size;
+
+	RDEBUG2("Generating %u vectors for \"%s\"", entry->num, entry->imsi);
+
+	if (vector_cache_entry_generate(entry, sqn) < 0) {
+		RPEDEBUG("Failed generating vectors");
+		talloc_free(entry);
+		return -1;
+	}
+
+	if (type == AKA_SIM_VECTOR_UMTS) {
+		memcpy(out, &entry->umts[0], sizeof(entry->umts[0]));
+	} else {
+		memcpy(out, &entry->gsm[0], sizeof(entry->gsm[0]));
+	}
+	entry->next = 1;
+
+	if (entry->next == entry->num) {
+		talloc_free(entry);
+		return 0;
+	}
+
+	pthread_mutex_lock(&cache->mutex);
+
+	/*
+	 *	Another worker may have generated
+	 *	vectors for the same subscriber in
+	 *	the meantime.
+	 */
+	{
+		aka_sim_vector_cache_entry_t *old;
+
+		old = fr_hash_table_find(cache->ht, entry);
+		if (old) vector_cache_entry_remove(cache, old);
+	}
+
+	while (fr_dlist_num_elements(&cache->lru) >= cache->conf.max_entries) {
+		vector_cache_entry_remove(cache, fr_dlist_head(&cache->lru));
+	}
+
+	if (!fr_hash_table_insert(cache->ht, entry)) {
+		pthread_mutex_unlock(&cache->mutex);
+		talloc_free(entry);
+		return 0;	/* We still have our vector */
+	}
+	fr_dlist_insert_tail(&cache->lru, entry);
+	pthread_mutex_unlock(&cache->mutex);
+
+	return 0;
+}
+
+/** Free the entries in a vector cache
+ *
+ */
+static int _vector_cache_free(fr_aka_sim_vector_cache_t *cache)
+{
+	aka_sim_vector_cache_entry_t *entry;
+
+	if (!cache->ht) return 0;	/* Partially initialised */
+
+	while ((entry = fr_dlist_head(&cache->lru))) vector_cache_entry_remove(cache, entry);
+
+	talloc_free(cache->ht);
+	pthread_mutex_destroy(&cache->mutex);
+
+	return 0;
+}
+
+/** Allocate a cache of pre-generated vectors
+ *
+ * @param[in] ctx	to allocate the cache in.
+ * @param[out] out	Where to write the new cache.  Will be NULL if
+ *			the cache is disabled.
+ * @param[in] conf	Limits for the cache.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int fr_aka_sim_vector_cache_alloc(TALLOC_CTX *ctx, fr_aka_sim_vector_cache_t **out,
+				  fr_aka_sim_vector_cache_conf_t const *conf)
+{
+	fr_aka_sim_vector_cache_t *cache;
+
+	*out = NULL;
+
+	if (conf->max_entries == 0) return 0;
+
+	if (conf->batch_size < 1) {
+		fr_strerror_const("vector_cache.batch_size must be greater than 0");
+		return -1;
+	}
+
+	if (!fr_time_delta_ispos(conf->lifetime)) {
+		fr_strerror_const("vector_cache.lifetime must be greater than 0");
+		return -1;
+	}
+
+	MEM(cache = talloc_zero(ctx, fr_aka_sim_vector_cache_t));
+	cache->conf = *conf;
+
+	if (pthread_mutex_init(&cache->mutex, NULL) != 0) {
+		fr_strerror_printf("Failed initialising vector cache mutex: %s", fr_syserror(errno));
+		talloc_free(cache);
+		return -1;
+	}
+	fr_dlist_talloc_init(&cache->lru, aka_sim_vector_cache_entry_t, lru);
+
+	/*
+	 *	Parented from the NULL ctx, as it's
+	 *	modified by multiple threads.
+	 */
+	cache->ht = fr_hash_table_talloc_alloc(NULL, aka_sim_vector_cache_entry_t,
+					       vector_cache_entry_hash, vector_cache_entry_cmp, NULL);
+	if (!cache->ht) {
+		pthread_mutex_destroy(&cache->mutex);
+		talloc_free(cache);
+		return -1;
+	}
+	talloc_set_destructor(cache, _vector_cache_free);
+
+	*out = cache;
+
+	return 0;
+}
 
 static int vector_opc_from_op(request_t *request, uint8_t const **out, uint8_t opc_buff[MILENAGE_OPC_SIZE],
 			      fr_pair_list_t *list, uint8_t const ki[MILENAGE_KI_SIZE])
@@ -76,7 +499,8 @@ static int vector_opc_from_op(request_t *request, uint8_t const **out, uint8_t o
 	return 1;
 }
 
-static int vector_gsm_from_ki(request_t *request, fr_pair_list_t *vps, int idx, fr_aka_sim_keys_t *keys)
+static int vector_gsm_from_ki(request_t *request, fr_aka_sim_vector_cache_t *cache,
+			      fr_pair_list_t *vps, int idx, fr_aka_sim_keys_t *keys)
 {
 	fr_pair_t	*ki_vp, *version_vp;
 	uint8_t		opc_buff[MILENAGE_OPC_SIZE];
@@ -121,6 +545,23 @@ static int vector_gsm_from_ki(request_t *request, fr_pair_list_t *vps, int idx,
 		}
 	}
 
+	/*
+	 *	Use a pre-generated triplet if we can
+	 */
+	if (cache) {
+		switch (vector_cache_take(request, cache, &keys->gsm.vector[idx], AKA_SIM_VECTOR_GSM,
+					  version, ki_vp->vp_octets, opc_p, NULL, 0)) {
+		case 0:
+			goto done;
+
+		case 1:
+			break;
+
+		default:
+			return -1;
+		}
+	}
+
 	for (i = 0; i < AKA_SIM_VECTOR_GSM_RAND_SIZE; i += sizeof(uint32_t)) {
 		uint32_t rand = fr_rand();
 		memcpy(&keys->gsm.vector[idx].rand[i], &rand, sizeof(rand));
@@ -164,6 +605,7 @@ static int vector_gsm_from_ki(request_t *request, fr_pair_list_t *vps, int idx,
 		return -1;
 	}
 
+done:
 	/*
 	 *	Store for completeness...
 	 */
@@ -316,6 +758,7 @@ static int vector_gsm_from_quintuplets(request_t *request, fr_pair_list_t *vps,
  * Hunt for a source of SIM triplets
  *
  * @param[in] request		The current subrequest.
+ * @param[in] cache		of pre-generated triplets.  May be NULL.
  * @param[in] vps		List to hunt for triplets in.
  * @param[in] idx		To write EAP-SIM triplets to.
  * @param[in] keys		EAP session keys.
@@ -327,7 +770,7 @@ static int vector_gsm_from_quintuplets(request_t *request, fr_pair_list_t *vps,
  *	- 0	Vector was retrieved OK and written to the specified index.
  *	- -1	Error retrieving vector from the specified src.
  */
-int fr_aka_sim_vector_gsm_from_attrs(request_t *request, fr_pair_list_t *vps,
+int fr_aka_sim_vector_gsm_from_attrs(request_t *request, fr_aka_sim_vector_cache_t *cache, fr_pair_list_t *vps,
 				     int idx, fr_aka_sim_keys_t *keys, fr_aka_sim_vector_src_t *src)
 {
 	int		ret;
@@ -338,7 +781,7 @@ int fr_aka_sim_vector_gsm_from_attrs(request_t *request, fr_pair_list_t *vps,
 	switch (*src) {
 	default:
 	case AKA_SIM_VECTOR_SRC_KI:
-		ret = vector_gsm_from_ki(request, vps, idx, keys);
+		ret = vector_gsm_from_ki(request, cache, vps, idx, keys);
 		if (ret == 0) {
 			*src = AKA_SIM_VECTOR_SRC_KI;
 			break;
@@ -393,7 +836,8 @@ int fr_aka_sim_vector_gsm_from_attrs(request_t *request, fr_pair_list_t *vps,
 	return 0;
 }
 
-static int vector_umts_from_ki(request_t *request, fr_pair_list_t *vps, fr_aka_sim_keys_t *keys)
+static int vector_umts_from_ki(request_t *request, fr_aka_sim_vector_cache_t *cache,
+			       fr_pair_list_t *vps, fr_aka_sim_keys_t *keys)
 {
 	fr_pair_t	*ki_vp, *amf_vp, *sqn_vp, *version_vp;
 
@@ -503,6 +947,35 @@ static int vector_umts_from_ki(request_t *request, fr_pair_list_t *vps, fr_aka_s
 				 "AMF          :");
 		REXDENT();
 
+		/*
+		 *	Use a pre-generated quintuplet if we can.
+		 *	The SQN may be higher than requested if
+		 *	earlier vectors were skipped.
+		 */
+		if (cache) {
+			milenage_vector_t	mv;
+
+			switch (vector_cache_take(request, cache, &mv, AKA_SIM_VECTOR_UMTS,
+						  version, ki_vp->vp_octets, opc_p, amf_buff, keys->sqn)) {
+			case 0:
+				memcpy(keys->umts.vector.autn, mv.autn, sizeof(keys->umts.vector.autn));
+				memcpy(keys->umts.vector.ik, mv.ik, sizeof(keys->umts.vector.ik));
+				memcpy(keys->umts.vector.ck, mv.ck, sizeof(keys->umts.vector.ck));
+				memcpy(keys->umts.vector.ak, mv.ak, sizeof(keys->umts.vector.ak));
+				memcpy(keys->umts.vector.rand, mv.rand, sizeof(keys->umts.vector.rand));
+				memcpy(keys->umts.vector.xres, mv.res, sizeof(mv.res));
+				keys->sqn = mv.sqn;
+				OPENSSL_cleanse(&mv, sizeof(mv));
+				goto milenage_done;
+
+			case 1:
+				break;
+
+			default:
+				return -1;
+			}
+		}
+
 		if (milenage_umts_generate(keys->umts.vector.autn,
 					   keys->umts.vector.ik,
 					   keys->umts.vector.ck,
@@ -516,6 +989,7 @@ static int vector_umts_from_ki(request_t *request, fr_pair_list_t *vps, fr_aka_s
 			RPEDEBUG2("Failed deriving UMTS Quintuplet");
 			return -1;
 		}
+	milenage_done:
 		keys->umts.vector.xres_len = MILENAGE_RES_SIZE;
 
 		/*
@@ -743,6 +1217,7 @@ static int vector_umts_from_quintuplets(request_t *request, fr_pair_list_t *vps,
  * Hunt for a source of UMTS quintuplets
  *
  * @param request		The current request.
+ * @param cache			of pre-generated quintuplets.  May be NULL.
  * @param vps			List to hunt for triplets in.
  * @param keys			UMTS keys.
  * @param src			Forces quintuplets to be retrieved from a particular src.
@@ -752,7 +1227,7 @@ static int vector_umts_from_quintuplets(request_t *request, fr_pair_list_t *vps,
  *	- 0	Vector was retrieved OK and written to the specified index.
  *	- -1	Error retrieving vector from the specified src.
  */
-int fr_aka_sim_vector_umts_from_attrs(request_t *request, fr_pair_list_t *vps,
+int fr_aka_sim_vector_umts_from_attrs(request_t *request, fr_aka_sim_vector_cache_t *cache, fr_pair_list_t *vps,
 				      fr_aka_sim_keys_t *keys, fr_aka_sim_vector_src_t *src)
 {
 	int		ret;
@@ -762,7 +1237,7 @@ int fr_aka_sim_vector_umts_from_attrs(request_t *request, fr_pair_list_t *vps,
 	switch (*src) {
 	default:
 	case AKA_SIM_VECTOR_SRC_KI:
-		ret = vector_umts_from_ki(request, vps, keys);
+		ret = vector_umts_from_ki(request, cache, vps, keys);
 		if (ret == 0) {
 			*src = AKA_SIM_VECTOR_SRC_KI;
 			break;
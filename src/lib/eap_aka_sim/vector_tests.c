@@ -0,0 +1,291 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or (at
+ *   your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/** Tests for acquiring vectors through the cache of pre-generated vectors
+ *
+ * @file src/lib/eap_aka_sim/vector_tests.c
+ *
+ * @copyright 2022 The FreeRADIUS server project
+ */
+#define USE_CONSTRUCTOR
+
+/*
+ * It should be declared before include the "acutest.h"
+ */
+#ifdef USE_CONSTRUCTOR
+static void test_init(void) __attribute__((constructor));
+#else
+static void test_init(void);
+#  define TEST_INIT  test_init()
+#endif
+
+#include <freeradius-devel/util/acutest.h>
+#include <freeradius-devel/util/acutest_helpers.h>
+
+#include <freeradius-devel/server/base.h>
+
+#include "vector.c"
+
+static TALLOC_CTX	*autofree;
+static fr_dict_t	*dict_internal;
+
+static uint8_t const	test_ki[MILENAGE_KI_SIZE] = {
+				0x46, 0x5b, 0x5c, 0xe8, 0xb1, 0x99, 0xb4, 0x9f,
+				0xaa, 0x5f, 0x0a, 0x2e, 0xe2, 0x38, 0xa6, 0xbc };
+static uint8_t const	test_ki_new[MILENAGE_KI_SIZE] = {
+				0x0c, 0x4a, 0x9b, 0x4e, 0x50, 0x8c, 0xe4, 0x7d,
+				0x1d, 0x31, 0x44, 0x0c, 0x62, 0x12, 0x1b, 0x7a };
+static uint8_t const	test_opc[MILENAGE_OPC_SIZE] = {
+				0xcd, 0x63, 0xcb, 0x71, 0x95, 0x4a, 0x9f, 0x4e,
+				0x48, 0xa5, 0x99, 0x4e, 0x37, 0xa0, 0x2b, 0xaf };
+
+/** Global initialisation
+ */
+static void test_init(void)
+{
+	autofree = talloc_autofree_context();
+	if (!autofree) {
+	error:
+		fr_perror("eap_aka_sim_vector_tests");
+		fr_exit_now(EXIT_FAILURE);
+	}
+
+	/*
+	 *	Mismatch between the binary and the libraries it depends on
+	 */
+	if (fr_check_lib_magic(RADIUSD_MAGIC_NUMBER) < 0) goto error;
+
+	if (fr_time_start() < 0) goto error;
+
+	if (!fr_dict_global_ctx_init(autofree, "share/dictionary")) goto error;
+
+	if (fr_dict_internal_afrom_file(&dict_internal, FR_DICTIONARY_INTERNAL_DIR, __FILE__) < 0) goto error;
+
+	if (fr_aka_sim_init() < 0) goto error;
+
+	if (request_global_init() < 0) goto error;
+}
+
+static fr_aka_sim_vector_cache_t *test_cache_alloc(void)
+{
+	fr_aka_sim_vector_cache_t	*cache;
+
+	TEST_ASSERT(fr_aka_sim_vector_cache_alloc(autofree, &cache,
+						  &(fr_aka_sim_vector_cache_conf_t){
+							.max_entries = 16,
+							.batch_size = 4,
+							.lifetime = fr_time_delta_from_sec(60)
+						  }) == 0);
+	TEST_ASSERT(cache != NULL);
+
+	return cache;
+}
+
+static void test_pair_octets_set(request_t *request, fr_pair_list_t *list, fr_dict_attr_t const *da,
+				 uint8_t const *value, size_t len)
+{
+	fr_pair_t *vp;
+
+	vp = fr_pair_find_by_da_idx(list, da, 0);
+	if (!vp) {
+		MEM(vp = fr_pair_afrom_da(request, da));
+		fr_pair_append(list, vp);
+	}
+	TEST_CHECK(fr_pair_value_memdup(vp, value, len, false) == 0);
+}
+
+/** Allocate a request for a subscriber, with the control attributes an AuC policy would add
+ *
+ */
+static request_t *test_request_alloc(void)
+{
+	request_t	*request;
+	fr_pair_t	*vp;
+
+	MEM(request = request_alloc_external(NULL, NULL));
+
+	MEM(vp = fr_pair_afrom_da(request, attr_eap_aka_sim_permanent_identity));
+	fr_pair_value_strdup(vp, "001010000000001", false);
+	fr_pair_append(&request->session_state_pairs, vp);
+
+	test_pair_octets_set(request, &request->control_pairs, attr_sim_ki, test_ki, sizeof(test_ki));
+	test_pair_octets_set(request, &request->control_pairs, attr_sim_opc, test_opc, sizeof(test_opc));
+
+	MEM(vp = fr_pair_afrom_da(request, attr_sim_sqn));
+	vp->vp_uint64 = 3;
+	fr_pair_append(&request->control_pairs, vp);
+
+	return request;
+}
+
+/** Authenticate with a quintuplet, as a USIM would
+ *
+ * @param[out] keys	the quintuplet was written to.
+ * @param[in] request	containing the control attributes.
+ * @param[in] cache	to acquire the quintuplet from.
+ * @param[in] ki	held by the USIM.
+ * @param[in,out] sqn	Highest SQN accepted by the USIM.
+ */
+static void test_umts_auth(fr_aka_sim_keys_t *keys, request_t *request, fr_aka_sim_vector_cache_t *cache,
+			   uint8_t const ki[static MILENAGE_KI_SIZE], uint64_t *sqn)
+{
+	fr_aka_sim_vector_src_t	src = AKA_SIM_VECTOR_SRC_AUTO;
+	uint8_t			ik[MILENAGE_IK_SIZE], ck[MILENAGE_CK_SIZE], res[MILENAGE_RES_SIZE];
+	uint8_t			auts[MILENAGE_AUTS_SIZE];
+
+	memset(keys, 0, sizeof(*keys));
+	TEST_ASSERT(fr_aka_sim_vector_umts_from_attrs(request, cache, &request->control_pairs, keys, &src) == 0);
+	TEST_CHECK(src == AKA_SIM_VECTOR_SRC_KI);
+
+	/*
+	 *	-2 means the USIM saw a replayed SQN
+	 */
+	TEST_CHECK(milenage_check(ik, ck, res, auts, test_opc, ki, *sqn,
+				  keys->umts.vector.rand, keys->umts.vector.autn) == 0);
+	TEST_MSG("Expected SQN > %" PRIu64 ", got %" PRIu64, *sqn, keys->sqn);
+	TEST_CHECK(memcmp(res, keys->umts.vector.xres, sizeof(res)) == 0);
+	TEST_CHECK(memcmp(ck, keys->umts.vector.ck, sizeof(ck)) == 0);
+	TEST_CHECK(memcmp(ik, keys->umts.vector.ik, sizeof(ik)) == 0);
+
+	*sqn = keys->sqn;
+}
+
+/*
+ *	The second authentication of a subscriber uses
+ *	the next quintuplet from the batch, which has a
+ *	fresh SQN, even though &control.SIM-SQN hasn't
+ *	been incremented.
+ */
+static void test_umts_cache(void)
+{
+	fr_aka_sim_vector_cache_t	*cache = test_cache_alloc();
+	request_t			*request = test_request_alloc();
+	fr_aka_sim_keys_t		first, second;
+	uint64_t			sim_sqn = 2;
+	aka_sim_vector_cache_entry_t	*entry;
+
+	test_umts_auth(&first, request, cache, test_ki, &sim_sqn);
+	TEST_CHECK(first.sqn == 3);
+
+	entry = fr_dlist_head(&cache->lru);
+	TEST_ASSERT(entry != NULL);
+	TEST_CHECK(entry->next == 1);
+
+	test_umts_auth(&second, request, cache, test_ki, &sim_sqn);
+	TEST_CHECK(second.sqn == 4);
+	TEST_MSG("Expected SQN 4, got %" PRIu64, second.sqn);
+	TEST_CHECK(memcmp(first.umts.vector.rand, second.umts.vector.rand, sizeof(first.umts.vector.rand)) != 0);
+	TEST_CHECK(entry->next == 2);
+
+	talloc_free(request);
+	talloc_free(cache);
+}
+
+/*
+ *	Changing the Ki discards the batch generated with
+ *	the old one, instead of sending the subscriber
+ *	quintuplets it can't verify.
+ */
+static void test_umts_key_change(void)
+{
+	fr_aka_sim_vector_cache_t	*cache = test_cache_alloc();
+	request_t			*request = test_request_alloc();
+	fr_aka_sim_keys_t		keys;
+	uint64_t			sim_sqn = 2, new_sim_sqn = 2;
+	aka_sim_vector_cache_entry_t	*entry;
+
+	test_umts_auth(&keys, request, cache, test_ki, &sim_sqn);
+	test_umts_auth(&keys, request, cache, test_ki, &sim_sqn);
+	TEST_CHECK(keys.sqn == 4);
+
+	test_pair_octets_set(request, &request->control_pairs, attr_sim_ki, test_ki_new, sizeof(test_ki_new));
+
+	/*
+	 *	The batch starts again at &control.SIM-SQN
+	 */
+	test_umts_auth(&keys, request, cache, test_ki_new, &new_sim_sqn);
+	TEST_CHECK(keys.sqn == 3);
+	TEST_MSG("Expected SQN 3, got %" PRIu64, keys.sqn);
+
+	TEST_CHECK(fr_dlist_num_elements(&cache->lru) == 1);
+	entry = fr_dlist_head(&cache->lru);
+	TEST_ASSERT(entry != NULL);
+	TEST_CHECK(entry->next == 1);
+	TEST_CHECK(memcmp(entry->ki, test_ki_new, sizeof(entry->ki)) == 0);
+
+	talloc_free(request);
+	talloc_free(cache);
+}
+
+/** Authenticate with a triplet, as a SIM would
+ *
+ */
+static void test_gsm_auth(fr_aka_sim_keys_t *keys, request_t *request, fr_aka_sim_vector_cache_t *cache,
+			  uint8_t const ki[static MILENAGE_KI_SIZE])
+{
+	fr_aka_sim_vector_src_t	src = AKA_SIM_VECTOR_SRC_AUTO;
+	uint8_t			sres[MILENAGE_SRES_SIZE], kc[MILENAGE_KC_SIZE];
+
+	memset(keys, 0, sizeof(*keys));
+	TEST_ASSERT(fr_aka_sim_vector_gsm_from_attrs(request, cache, &request->control_pairs, 0, keys, &src) == 0);
+	TEST_CHECK(src == AKA_SIM_VECTOR_SRC_KI);
+
+	TEST_CHECK(milenage_gsm_generate(sres, kc, test_opc, ki, keys->gsm.vector[0].rand) == 0);
+	TEST_CHECK(memcmp(sres, keys->gsm.vector[0].sres, sizeof(sres)) == 0);
+	TEST_CHECK(memcmp(kc, keys->gsm.vector[0].kc, sizeof(kc)) == 0);
+}
+
+/*
+ *	Triplets (COMP128-4 here, as we have an OPc) are
+ *	taken from the batch in turn, and regenerated
+ *	when the Ki changes.
+ */
+static void test_gsm_cache(void)
+{
+	fr_aka_sim_vector_cache_t	*cache = test_cache_alloc();
+	request_t			*request = test_request_alloc();
+	fr_aka_sim_keys_t		first, second;
+	aka_sim_vector_cache_entry_t	*entry;
+
+	test_gsm_auth(&first, request, cache, test_ki);
+	test_gsm_auth(&second, request, cache, test_ki);
+	TEST_CHECK(memcmp(first.gsm.vector[0].rand, second.gsm.vector[0].rand,
+			  sizeof(first.gsm.vector[0].rand)) != 0);
+
+	entry = fr_dlist_head(&cache->lru);
+	TEST_ASSERT(entry != NULL);
+	TEST_CHECK(entry->next == 2);
+
+	test_pair_octets_set(request, &request->control_pairs, attr_sim_ki, test_ki_new, sizeof(test_ki_new));
+	test_gsm_auth(&first, request, cache, test_ki_new);
+
+	TEST_CHECK(fr_dlist_num_elements(&cache->lru) == 1);
+	entry = fr_dlist_head(&cache->lru);
+	TEST_ASSERT(entry != NULL);
+	TEST_CHECK(entry->next == 1);
+	TEST_CHECK(memcmp(entry->ki, test_ki_new, sizeof(entry->ki)) == 0);
+
+	talloc_free(request);
+	talloc_free(cache);
+}
+
+TEST_LIST = {
+	{ "umts_cache",		test_umts_cache },
+	{ "umts_key_change",	test_umts_key_change },
+	{ "gsm_cache",		test_gsm_cache },
+
+	{ NULL }
+};
@@ -0,0 +1,8 @@
+TARGET		:= eap_aka_sim_vector_tests
+
+SOURCES		:= vector_tests.c
+
+TGT_LDLIBS	:= $(LIBS) $(OPENSSL_LIBS) $(GPERFTOOLS_LIBS)
+TGT_LDFLAGS	:= $(LDFLAGS) $(OPENSSL_FLAGS) $(GPERFTOOLS_LDFLAGS)
+
+TGT_PREREQS	:= libfreeradius-eap-aka-sim.a libfreeradius-util.la $(LIBFREERADIUS_SERVER) libfreeradius-eap.a libfreeradius-sim.a
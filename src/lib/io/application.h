@@ -81,6 +81,20 @@ typedef int (*fr_app_open_t)(void *instance, fr_schedule_t *sc, CONF_SECTION *cs
  */
 typedef int (*fr_app_priority_get_t)(void const *instance, uint8_t const *buffer, size_t buflen);
 
+/** Find the worker which should process a packet
+ *
+ * Used to send every packet in a multi-round session to the worker
+ * which holds the session.
+ *
+ * @param[in] instance	of the #fr_app_t.
+ * @param[in] buffer	raw packet
+ * @param[in] buflen	length of the packet
+ * @return
+ *	-1 - the packet can be processed by any worker.
+ *	*  - the ID of the worker which should process the packet.
+ */
+typedef int (*fr_app_worker_affinity_t)(void const *instance, uint8_t const *buffer, size_t buflen);
+
 /** Called by the network thread to pass an event list for the module to use for timer events
  */
 typedef void (*fr_app_event_list_set_t)(fr_listen_t *li, fr_event_list_t *el, void *nr);
@@ -119,6 +133,9 @@ typedef struct {
 							///< to all #fr_app_io_t can be performed by the #fr_app_t.
 
 	fr_app_priority_get_t		priority;	//!< Assign a priority to the packet.
+
+	fr_app_worker_affinity_t	affinity;	//!< Find the worker which should process the packet.
+							///< May be NULL.
 } fr_app_t;
 
 /** Public structure describing an application (protocol) specialisation
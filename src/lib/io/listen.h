@@ -41,6 +41,8 @@ struct fr_listen {
 
 	bool			connected;		//!< is this for a connected socket?
 	bool			track_duplicates;	//!< do we track duplicate packets?
+	uint32_t		batch_size;		//!< How many requests the worker runs before
+							///< sending their replies.  0 disables batching.
 	size_t			default_message_size;	//!< copied from app_io, but may be changed
 	size_t			num_messages;		//!< for the message ring buffer
 };
@@ -2921,6 +2921,7 @@ int fr_master_io_listen(TALLOC_CTX *ctx, fr_io_instance_t *inst, fr_schedule_t *
 	li->app = inst->app;
 	li->app_instance = inst->app_instance;
 	li->server_cs = inst->server_cs;
+	li->batch_size = virtual_server_batch_size(inst->server_cs);
 
 	/*
 	 *	Set configurable parameters for message ring buffer.
@@ -67,6 +67,7 @@ typedef struct {
 
 	fr_channel_t		*channel;		//!< channel to the worker
 	fr_worker_t		*worker;		//!< worker pointer
+	int			id;			//!< ID of the worker.
 	fr_io_stats_t		stats;
 } fr_network_worker_t;
 
@@ -132,6 +133,9 @@ struct fr_network_s {
 
 	fr_io_stats_t		stats;
 
+	uint64_t		affinity_hit;		//!< Packets sent to the worker holding their session.
+	uint64_t		affinity_miss;		//!< Packets whose worker had exited or was too busy.
+
 	fr_rb_tree_t		*sockets;		//!< list of sockets we're managing, ordered by the listener
 	fr_rb_tree_t		*sockets_by_num;       	//!< ordered by number;
 
@@ -561,6 +565,56 @@ static void fr_network_channel_callback(void *ctx, void const *data, size_t data
 	}
 }
 
+/** Find the worker holding the session a packet belongs to
+ *
+ * @param[in] nr	the network
+ * @param[in] cd	the packet
+ * @return
+ *	- NULL if the packet can go to any worker.
+ *	- The worker which should process the packet.
+ */
+static fr_network_worker_t *fr_network_worker_affinity(fr_network_t *nr, fr_channel_data_t *cd)
+{
+	fr_app_t const	*app;
+	int		i, id;
+
+	if (!cd->listen) return NULL;
+
+	app = cd->listen->app;
+	if (!app || !app->affinity) return NULL;
+
+	id = app->affinity(cd->listen->app_instance, cd->m.data, cd->m.data_size);
+	if (id < 0) return NULL;
+
+	for (i = 0; i < nr->num_workers; i++) {
+		fr_network_worker_t *worker = nr->workers[i];
+
+		if (worker->id != id) continue;
+
+		/*
+		 *	The session is only held by this worker, so
+		 *	there's no point sending the packet anywhere
+		 *	else.  If the worker has reached
+		 *	max_outstanding the packet is dropped, and the
+		 *	client will retransmit it.
+		 *
+		 *	If the worker isn't reading its channel, the
+		 *	session will be lost whatever we do.
+		 */
+		if (worker->blocked) break;
+
+		nr->affinity_hit++;
+		return worker;
+	}
+
+	/*
+	 *	The worker has exited, and its sessions have been
+	 *	moved to the shared state tree.
+	 */
+	nr->affinity_miss++;
+	return NULL;
+}
+
 /** Send a message on the "best" channel.
  *
  * @param nr the network
@@ -583,6 +637,9 @@ retry:
 			return -1;
 		}
 
+	} else if ((worker = fr_network_worker_affinity(nr, cd)) != NULL) {
+		/* Continuation of a session, send it to the same worker */
+
 	} else if (nr->num_blocked == 0) {
 		uint32_t one, two;
 
@@ -1350,6 +1407,7 @@ static void fr_network_worker_started_callback(void *ctx, void const *data, size
 	MEM(w = talloc_zero(nr, fr_network_worker_t));
 
 	w->worker = worker;
+	w->id = fr_worker_id(worker);
 	w->channel = fr_worker_channel_create(worker, w, nr->control);
 	fr_fatal_assert_msg(w->channel, "Failed creating new channel");
 
@@ -1850,6 +1908,8 @@ static int cmd_stats_self(FILE *fp, UNUSED FILE *fp_err, void *ctx, UNUSED fr_cm
 	fprintf(fp, "count.dup\t%" PRIu64 "\n", nr->stats.dup);
 	fprintf(fp, "count.dropped\t%" PRIu64 "\n", nr->stats.dropped);
 	fprintf(fp, "count.sockets\t%u\n", fr_rb_num_elements(nr->sockets));
+	fprintf(fp, "affinity.hit\t%" PRIu64 "\n", nr->affinity_hit);
+	fprintf(fp, "affinity.miss\t%" PRIu64 "\n", nr->affinity_miss);
 
 	return 0;
 }
@@ -54,8 +54,10 @@ RCSID("$Id$")
 #include <freeradius-devel/io/channel.h>
 #include <freeradius-devel/io/listen.h>
 #include <freeradius-devel/io/message.h>
+#include <freeradius-devel/io/schedule.h>
 #include <freeradius-devel/io/time_tracking.h>
 #include <freeradius-devel/io/worker.h>
+#include <freeradius-devel/server/state.h>
 #include <freeradius-devel/unlang/base.h>
 #include <freeradius-devel/unlang/call.h>
 #include <freeradius-devel/unlang/interpret.h>
@@ -79,6 +81,7 @@ static alignas(CACHE_LINE_SIZE) atomic_uint64_t request_number = 0;
  */
 struct fr_worker_s {
 	char const		*name;		//!< name of this worker
+	int			id;		//!< ID of this worker, as assigned by the scheduler.
 	fr_worker_config_t	config;		//!< external configuration
 
 	unlang_interpret_t 	*intp;		//!< Worker's local interpreter.
@@ -110,6 +113,17 @@ struct fr_worker_s {
 	fr_time_delta_t		predicted;	//!< How long we predict a request will take to execute.
 	fr_time_tracking_t	tracking;	//!< how much time the worker has spent doing things.
 
+	fr_time_delta_t		decode_time;	//!< Total time spent decoding packets.
+	fr_time_delta_t		run_time;	//!< Total time spent running requests.
+	fr_time_delta_t		reply_time;	//!< Total time spent encoding and sending replies.
+
+	uint64_t		num_batches;	//!< Number of batches of requests which have been run.
+	uint64_t		num_batched;	//!< Number of requests run as part of a batch.
+
+	request_t		**reply;	//!< Completed requests waiting for the batch to finish.
+	int			num_replies;	//!< Number of entries in the reply array.
+	bool			batching;	//!< Are we running a batch of requests?
+
 	bool			was_sleeping;	//!< used to suppress multiple sleep signals in a row
 	bool			exiting;	//!< are we exiting?
 
@@ -498,6 +512,7 @@ static void worker_send_reply(fr_worker_t *worker, request_t *request, size_t si
 	fr_channel_data_t *reply;
 	fr_channel_t *ch;
 	fr_message_set_t *ms;
+	fr_time_t start = fr_time();
 
 	REQUEST_VERIFY(request);
 
@@ -599,6 +614,7 @@ static void worker_send_reply(fr_worker_t *worker, request_t *request, size_t si
 	}
 
 	worker->stats.out++;
+	worker->reply_time = fr_time_delta_add(worker->reply_time, fr_time_sub(fr_time(), start));
 
 	fr_assert(!fr_minmax_heap_entry_inserted(request->time_order_id));
 	fr_assert(!fr_heap_entry_inserted(request->runnable_id));
@@ -669,6 +685,7 @@ static void worker_request_bootstrap(fr_worker_t *worker, fr_channel_data_t *cd,
 	request_t		*request;
 	TALLOC_CTX		*ctx;
 	fr_listen_t const	*listen;
+	fr_time_t		decode_start;
 
 	if (fr_minmax_heap_num_elements(worker->time_order) >= (uint32_t) worker->config.max_requests) goto nak;
 
@@ -707,12 +724,15 @@ static void worker_request_bootstrap(fr_worker_t *worker, fr_channel_data_t *cd,
 	 *
 	 *	Note that this also sets the "async process" function.
 	 */
+	decode_start = fr_time();
 	if (listen->app->decode) {
 		ret = listen->app->decode(listen->app_instance, request, cd->m.data, cd->m.data_size);
 	} else if (listen->app_io->decode) {
 		ret = listen->app_io->decode(listen->app_io_instance, request, cd->m.data, cd->m.data_size);
 	}
 
+	worker->decode_time = fr_time_delta_add(worker->decode_time, fr_time_sub(fr_time(), decode_start));
+
 	if (ret < 0) {
 		talloc_free(ctx);
 nak:
@@ -910,6 +930,11 @@ void fr_worker_destroy(fr_worker_t *worker)
 		fr_channel_responder_ack_close(worker->channel[i]);
 	}
 
+	/*
+	 *	Let other workers pick up the sessions we hold.
+	 */
+	fr_state_worker_set(-1);
+
 	talloc_free(worker);
 }
 
@@ -990,6 +1015,15 @@ static void _worker_request_done_external(request_t *request, UNUSED rlm_rcode_t
 		return;
 	}
 
+	/*
+	 *	We're running a batch, so the reply is sent
+	 *	along with all the others when it finishes.
+	 */
+	if (worker->batching && (worker->num_replies < FR_WORKER_BATCH_MAX)) {
+		worker->reply[worker->num_replies++] = request;
+		return;
+	}
+
 	worker_send_reply(worker, request, request->master_state == REQUEST_STOP_PROCESSING ? 1 : 0, now);
 	talloc_free(request);
 }
@@ -1141,6 +1175,71 @@ static bool _worker_request_scheduled(request_t const *request, UNUSED void *uct
 	return fr_heap_entry_inserted(request->runnable_id);
 }
 
+/** Whether a request was received by a virtual server which batches requests
+ *
+ */
+static inline CC_HINT(always_inline) bool worker_request_batched(request_t const *request)
+{
+	return request->async->listen && (request->async->listen->batch_size > 0);
+}
+
+/** Run a batch of requests, and then send all of their replies
+ *
+ *  Running requests back to back means they share a warm cache for
+ *  the policy they're executing, and the replies are then encoded
+ *  and sent to the network thread in one burst.
+ *
+ * @param[in] worker	the worker
+ * @param[in] request	the first request in the batch.
+ */
+static void worker_run_batch(fr_worker_t *worker, request_t *request)
+{
+	uint32_t	batch_size = request->async->listen->batch_size;
+	uint32_t	i = 0;
+	int		j;
+	fr_time_t	start, now;
+
+	fr_assert(!worker->batching);
+	fr_assert(worker->num_replies == 0);
+
+	worker->batching = true;
+	worker->num_batches++;
+
+	start = fr_time();
+	for (;;) {
+		worker->num_batched++;
+		(void)unlang_interpret(request);
+
+		if (++i >= batch_size) break;
+
+		/*
+		 *	Only continue the batch with requests which
+		 *	also want to be batched.
+		 */
+		request = fr_heap_peek(worker->runnable);
+		if (!request || !worker_request_batched(request)) break;
+
+		(void) fr_heap_pop(worker->runnable);
+		REQUEST_VERIFY(request);
+
+		if (request->async->channel && !fr_channel_active(request->async->channel)) {
+			worker_stop_request(&request);
+			break;
+		}
+	}
+	now = fr_time();
+	worker->run_time = fr_time_delta_add(worker->run_time, fr_time_sub(now, start));
+	worker->batching = false;
+
+	for (j = 0; j < worker->num_replies; j++) {
+		request = worker->reply[j];
+
+		worker_send_reply(worker, request, request->master_state == REQUEST_STOP_PROCESSING ? 1 : 0, now);
+		talloc_free(request);
+	}
+	worker->num_replies = 0;
+}
+
 /** Run a request
  *
  *  Until it either yields, or is done.
@@ -1154,7 +1253,7 @@ static bool _worker_request_scheduled(request_t const *request, UNUSED void *uct
 static inline CC_HINT(always_inline) void worker_run_request(fr_worker_t *worker, fr_time_t start)
 {
 	request_t	*request;
-	fr_time_t	now;
+	fr_time_t	now, started;
 
 	WORKER_VERIFY;
 
@@ -1181,9 +1280,17 @@ static inline CC_HINT(always_inline) void worker_run_request(fr_worker_t *worker
 			return;
 		}
 
+		if (worker_request_batched(request)) {
+			worker_run_batch(worker, request);
+			now = fr_time();
+			continue;
+		}
+
+		started = now;
 		(void)unlang_interpret(request);
 
 		now = fr_time();
+		worker->run_time = fr_time_delta_add(worker->run_time, fr_time_sub(now, started));
 	}
 }
 
@@ -1213,6 +1320,13 @@ nomem:
 
 	worker->name = talloc_strdup(worker, name); /* thread locality */
 
+	/*
+	 *	State values created by this thread should
+	 *	bring the next round of the session back here.
+	 */
+	worker->id = fr_schedule_worker_id();
+	fr_state_worker_set(worker->id);
+
 	unlang_thread_instantiate(worker);
 
 	if (config) worker->config = *config;
@@ -1242,6 +1356,12 @@ nomem:
 		goto nomem;
 	}
 
+	worker->reply = talloc_array(worker, request_t *, FR_WORKER_BATCH_MAX);
+	if (!worker->reply) {
+		talloc_free(worker);
+		goto nomem;
+	}
+
 	worker->thread_id = pthread_self();
 	worker->el = el;
 	worker->log = logger;
@@ -1318,6 +1438,15 @@ nomem:
 }
 
 
+/** Return the ID of a worker
+ *
+ * @param[in] worker	to return the ID of.
+ */
+int fr_worker_id(fr_worker_t const *worker)
+{
+	return worker->id;
+}
+
 /** The main loop and entry point of the worker thread.
  *
  * @param[in] worker the worker data structure to manage
@@ -1541,6 +1670,20 @@ static int cmd_stats_worker(FILE *fp, UNUSED FILE *fp_err, void *ctx, fr_cmd_inf
 		fr_time_elapsed_fprint(fp, &worker->wall_clock, "time.requests", 4);
 	}
 
+	if ((info->argc == 0) || (strcmp(info->argv[0], "batch") == 0)) {
+		fprintf(fp, "batch.batches\t\t\t%" PRIu64 "\n", worker->num_batches);
+		fprintf(fp, "batch.requests\t\t\t%" PRIu64 "\n", worker->num_batched);
+
+		when = worker->decode_time;
+		fprintf(fp, "batch.decode\t\t\t%.6f\n", fr_time_delta_unwrap(when) / (double)NSEC);
+
+		when = worker->run_time;
+		fprintf(fp, "batch.run\t\t\t%.6f\n", fr_time_delta_unwrap(when) / (double)NSEC);
+
+		when = worker->reply_time;
+		fprintf(fp, "batch.reply\t\t\t%.6f\n", fr_time_delta_unwrap(when) / (double)NSEC);
+	}
+
 	return 0;
 }
 
@@ -1556,7 +1699,7 @@ fr_cmd_table_t cmd_worker_table[] = {
 		.parent = "stats worker",
 		.add_name = true,
 		.name = "self",
-		.syntax = "[(count|cpu)]",
+		.syntax = "[(count|cpu|batch)]",
 		.func = cmd_stats_worker,
 		.help = "Show statistics for a specific worker thread.",
 		.read_only = true
@@ -55,6 +55,8 @@ extern "C" {
 #endif
 extern fr_cmd_table_t cmd_worker_table[];
 
+#define FR_WORKER_BATCH_MAX (256)		//!< Maximum number of requests run in a single batch.
+
 typedef struct {
 	int		max_requests;		//!< max requests this worker will handle
 
@@ -73,6 +75,8 @@ fr_worker_t	*fr_worker_create(TALLOC_CTX *ctx, fr_event_list_t *el, char const *
 
 void		fr_worker_destroy(fr_worker_t *worker) CC_HINT(nonnull);
 
+int		fr_worker_id(fr_worker_t const *worker) CC_HINT(nonnull);
+
 void		fr_worker(fr_worker_t *worker) CC_HINT(nonnull);
 
 void		fr_worker_debug(fr_worker_t *worker, FILE *fp) CC_HINT(nonnull);
@@ -566,8 +566,13 @@ static void ldap_trunk_query_cancel(UNUSED request_t *request, fr_state_signal_t
 
 	if (action != FR_SIGNAL_CANCEL) return;
 
-	fr_trunk_request_signal_cancel(query->treq);
+	/*
+	 *	Queries using the results of a shared search
+	 *	have no trunk request of their own.
+	 */
+	if (!query->treq) return;
 
+	fr_trunk_request_signal_cancel(query->treq);
 }
 
 #define SET_LDAP_CTRLS(_dest, _src) \
@@ -584,58 +589,73 @@ do { \
 /** Hack to make code work with synchronous interpreter
  *
  */
-static unlang_action_t ldap_trunk_query_start(UNUSED rlm_rcode_t *p_result, UNUSED int *priority,
-					      UNUSED request_t *request, UNUSED void *uctx)
+static unlang_action_t ldap_trunk_query_start(rlm_rcode_t *p_result, int *priority,
+					      request_t *request, void *uctx)
 {
+	fr_ldap_query_t		*query = talloc_get_type_abort(uctx, fr_ldap_query_t);
+
+	/*
+	 *	Results may already be available from a shared search
+	 */
+	if (query->ret != LDAP_RESULT_PENDING) return ldap_trunk_query_results(p_result, priority, request, uctx);
+
 	return UNLANG_ACTION_YIELD;
 }
 
 /** Hack to add timeouts
  *
  * Here we send a cancellation signal to the trunk if the request hits the timeout limit.
+ * Queries waiting on a shared search stop waiting, leaving the search to complete
+ * for any other queries.
  */
 static void _ldap_search_sync_timeout(UNUSED fr_event_list_t *el, UNUSED fr_time_t now, void *uctx)
 {
-	fr_trunk_request_t *treq = talloc_get_type_abort(uctx, fr_trunk_request_t);
+	fr_ldap_query_t		*query = talloc_get_type_abort(uctx, fr_ldap_query_t);
+	request_t		*request = query->request;
 
-	fr_trunk_request_signal_cancel(treq);
+	if (query->shared) {
+		fr_ldap_search_shared_detach(query);
+		query->ret = LDAP_RESULT_TIMEOUT;
+		unlang_interpret_mark_runnable(request);
+		return;
+	}
+
+	if (query->treq) fr_trunk_request_signal_cancel(query->treq);
 }
 
-/** Run an async or sync search LDAP query on a trunk connection
+/** Run an async or sync search LDAP query on a trunk connection, possibly sharing results
  *
- * @param[out] p_result		from synchronous evaluation.
- * @param[in] ctx		to allocate the query in.
- * @param[out] out		that has been allocated.
- * @param[in] request		this query relates to.
- * @param[in] ttrunk		to submit the query to.
- * @param[in] base_dn		for the search.
- * @param[in] scope		of the search.
- * @param[in] filter		for the search.
- * @param[in] attrs		to be returned.
- * @param[in] serverctrls	specific to this query.
- * @param[in] clientctrls	specific to this query.
- * @param[in] is_async		If true, will return UNLANG_ACTION_YIELD
- *				and push a search onto the unlang stack
- *				for the current request.
- *				If false, will perform a synchronous search
- *				and provide the result in p_result.
- * @return
- *	- UNLANG_ACTION_FAIL on error.
- *	- UNLANG_ACTION_YIELD on success.
- *	- UNLANG_ACTION_CALCULATE_RESULT if the query was run synchronously.
+ * @param[in] cacheable		Whether results from, and for, the search cache may be used.
  */
-unlang_action_t fr_ldap_trunk_search(rlm_rcode_t *p_result,
-				     TALLOC_CTX *ctx,
-				     fr_ldap_query_t **out, request_t *request, fr_ldap_thread_trunk_t *ttrunk,
-				     char const *base_dn, int scope, char const *filter, char const * const *attrs,
-				     LDAPControl **serverctrls, LDAPControl **clientctrls,
-				     bool is_async)
+static unlang_action_t ldap_trunk_search(rlm_rcode_t *p_result,
+					 TALLOC_CTX *ctx,
+					 fr_ldap_query_t **out, request_t *request, fr_ldap_thread_trunk_t *ttrunk,
+					 char const *base_dn, int scope, char const *filter, char const * const *attrs,
+					 LDAPControl **serverctrls, LDAPControl **clientctrls,
+					 bool is_async, bool cacheable)
 {
 	unlang_action_t action;
 	fr_ldap_query_t *query;
 
 	query = fr_ldap_search_alloc(ctx, base_dn, scope, filter, attrs, serverctrls, clientctrls);
 
+	/*
+	 *	See if we can use the results of an identical search
+	 */
+	if (ttrunk->config.search_dedup ||
+	    (cacheable && fr_time_delta_ispos(ttrunk->config.search_cache_ttl))) {
+		switch (fr_ldap_search_shared_attach(ttrunk, request, query, cacheable)) {
+		case 0:
+			goto push;
+
+		case 1:
+			break;
+
+		default:
+			goto error;
+		}
+	}
+
 	switch (fr_trunk_request_enqueue(&query->treq, ttrunk->trunk, request, query, NULL)) {
 	case FR_TRUNK_ENQUEUE_OK:
 	case FR_TRUNK_ENQUEUE_IN_BACKLOG:
@@ -649,6 +669,7 @@ unlang_action_t fr_ldap_trunk_search(rlm_rcode_t *p_result,
 		return UNLANG_ACTION_FAIL;
 	}
 
+push:
 	action = unlang_function_push(request, is_async ? NULL : ldap_trunk_query_start, ldap_trunk_query_results,
 				      ldap_trunk_query_cancel, is_async ? UNLANG_SUB_FRAME : UNLANG_TOP_FRAME, query);
 
@@ -668,9 +689,9 @@ unlang_action_t fr_ldap_trunk_search(rlm_rcode_t *p_result,
 		 *	Add an event that'll send a cancellation request
 		 *	to the request.
 		 */
-		if (fr_time_delta_ispos(timeout)) {
+		if ((query->ret == LDAP_RESULT_PENDING) && fr_time_delta_ispos(timeout)) {
 			if (fr_event_timer_in(ctx, unlang_interpret_event_list(request), &ev, timeout,
-					      _ldap_search_sync_timeout, query->treq) < 0) goto error;
+					      _ldap_search_sync_timeout, query) < 0) goto error;
 		}
 
 		*p_result = unlang_interpret_synchronous(unlang_interpret_event_list(request), request);
@@ -683,6 +704,78 @@ unlang_action_t fr_ldap_trunk_search(rlm_rcode_t *p_result,
 	return UNLANG_ACTION_YIELD;
 }
 
+/** Run an async or sync search LDAP query on a trunk connection
+ *
+ * @param[out] p_result		from synchronous evaluation.
+ * @param[in] ctx		to allocate the query in.
+ * @param[out] out		that has been allocated.
+ * @param[in] request		this query relates to.
+ * @param[in] ttrunk		to submit the query to.
+ * @param[in] base_dn		for the search.
+ * @param[in] scope		of the search.
+ * @param[in] filter		for the search.
+ * @param[in] attrs		to be returned.
+ * @param[in] serverctrls	specific to this query.
+ * @param[in] clientctrls	specific to this query.
+ * @param[in] is_async		If true, will return UNLANG_ACTION_YIELD
+ *				and push a search onto the unlang stack
+ *				for the current request.
+ *				If false, will perform a synchronous search
+ *				and provide the result in p_result.
+ * @return
+ *	- UNLANG_ACTION_FAIL on error.
+ *	- UNLANG_ACTION_YIELD on success.
+ *	- UNLANG_ACTION_CALCULATE_RESULT if the query was run synchronously.
+ */
+unlang_action_t fr_ldap_trunk_search(rlm_rcode_t *p_result,
+				     TALLOC_CTX *ctx,
+				     fr_ldap_query_t **out, request_t *request, fr_ldap_thread_trunk_t *ttrunk,
+				     char const *base_dn, int scope, char const *filter, char const * const *attrs,
+				     LDAPControl **serverctrls, LDAPControl **clientctrls,
+				     bool is_async)
+{
+	return ldap_trunk_search(p_result, ctx, out, request, ttrunk, base_dn, scope, filter, attrs,
+				 serverctrls, clientctrls, is_async, false);
+}
+
+/** Run an async or sync search LDAP query on a trunk connection, using cached results if available
+ *
+ * Should be used for searches whose results change infrequently, such as
+ * user DN and group membership lookups.  If search_cache_ttl is set, the
+ * results may be up to search_cache_ttl old.
+ *
+ * @param[out] p_result		from synchronous evaluation.
+ * @param[in] ctx		to allocate the query in.
+ * @param[out] out		that has been allocated.
+ * @param[in] request		this query relates to.
+ * @param[in] ttrunk		to submit the query to.
+ * @param[in] base_dn		for the search.
+ * @param[in] scope		of the search.
+ * @param[in] filter		for the search.
+ * @param[in] attrs		to be returned.
+ * @param[in] serverctrls	specific to this query.
+ * @param[in] clientctrls	specific to this query.
+ * @param[in] is_async		If true, will return UNLANG_ACTION_YIELD
+ *				and push a search onto the unlang stack
+ *				for the current request.
+ *				If false, will perform a synchronous search
+ *				and provide the result in p_result.
+ * @return
+ *	- UNLANG_ACTION_FAIL on error.
+ *	- UNLANG_ACTION_YIELD on success.
+ *	- UNLANG_ACTION_CALCULATE_RESULT if the query was run synchronously.
+ */
+unlang_action_t fr_ldap_trunk_search_cached(rlm_rcode_t *p_result,
+					    TALLOC_CTX *ctx,
+					    fr_ldap_query_t **out, request_t *request, fr_ldap_thread_trunk_t *ttrunk,
+					    char const *base_dn, int scope, char const *filter, char const * const *attrs,
+					    LDAPControl **serverctrls, LDAPControl **clientctrls,
+					    bool is_async)
+{
+	return ldap_trunk_search(p_result, ctx, out, request, ttrunk, base_dn, scope, filter, attrs,
+				 serverctrls, clientctrls, is_async, true);
+}
+
 /** Run an async or sync modification LDAP query on a trunk connection
  *
  * @param[out] p_result		from synchronous evaluation.
@@ -797,6 +890,12 @@ static int _ldap_query_free(fr_ldap_query_t *query)
 {
 	int 	i;
 
+	/*
+	 *	The results and connection belong to the shared
+	 *	search, and are released by detaching from it.
+	 */
+	if (query->shared) fr_ldap_search_shared_detach(query);
+
 	/*
 	 *	Remove the query from the tree of outstanding queries
 	 */
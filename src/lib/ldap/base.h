@@ -13,6 +13,7 @@
 #include <freeradius-devel/server/connection.h>
 #include <freeradius-devel/server/map.h>
 #include <freeradius-devel/server/trunk.h>
+#include <freeradius-devel/util/stdatomic.h>
 
 #define LDAP_DEPRECATED 0	/* Quiet warnings about LDAP_DEPRECATED not being defined */
 
@@ -302,10 +303,34 @@ typedef struct {
 	fr_time_delta_t		reconnection_delay;	//!< How long to wait before attempting to reconnect.
 
 	fr_time_delta_t		idle_timeout;		//!< How long to wait before closing unused connections.
+
+	/*
+	 *	Search result sharing.
+	 */
+	bool			search_dedup;		//!< Share the results of identical in-flight searches.
+
+	fr_time_delta_t		search_cache_ttl;	//!< How long to keep the results of cacheable searches.
+
+	uint32_t		search_cache_max;	//!< Maximum number of cached search results per trunk.
 } fr_ldap_config_t;
 
 typedef struct fr_ldap_thread_trunk_s fr_ldap_thread_trunk_t;
 
+typedef struct fr_ldap_search_shared_s fr_ldap_search_shared_t;
+
+/** Search result sharing statistics
+ *
+ * Shared by all threads using a module instance.
+ */
+typedef struct {
+	atomic_uint_fast64_t	searches;		//!< Searches which could share results.
+	atomic_uint_fast64_t	sent;			//!< Searches sent to the directory.
+	atomic_uint_fast64_t	dedup;			//!< Searches which waited on an identical in-flight search.
+	atomic_uint_fast64_t	hits;			//!< Searches answered from the result cache.
+	atomic_uint_fast64_t	evicted;		//!< Cached results evicted before they expired.
+	atomic_int_fast64_t	in_flight;		//!< Shared searches currently awaiting results.
+} fr_ldap_search_stats_t;
+
 /** Tracks the state of a libldap connection handle
  *
  */
@@ -364,6 +389,7 @@ typedef struct {
 	fr_event_list_t		*el;		//!< Thread event list for callbacks / timeouts
 	fr_connection_t		*conn;		//!< LDAP connection used for bind auths
 	fr_rb_tree_t		*binds;		//!< Tree of outstanding bind auths
+	fr_ldap_search_stats_t	*search_stats;	//!< Module instance search sharing statistics.
 } fr_ldap_thread_t;
 
 /** Thread LDAP trunk structure
@@ -383,6 +409,9 @@ typedef struct fr_ldap_thread_trunk_s {
 	fr_trunk_t		*trunk;		//!< Connection trunk
 	fr_ldap_thread_t	*t;		//!< Thread this connection is associated with
 	fr_event_timer_t const	*ev;		//!< Event to close the thread when it has been idle.
+	fr_rb_tree_t		*searches;	//!< Shared searches, in-flight or cached.
+	fr_dlist_head_t		search_cache;	//!< Cached searches, oldest first.
+	unsigned int		search_refs;	//!< Queries using the results of shared searches.
 } fr_ldap_thread_trunk_t;
 
 typedef struct fr_ldap_referral_s fr_ldap_referral_t;
@@ -438,6 +467,12 @@ struct fr_ldap_query_s {
 	LDAPMessage		*result;	//!< Head of LDAP results list.
 
 	fr_ldap_result_code_t	ret;		//!< Result code
+
+	fr_ldap_search_shared_t	*shared;	//!< Search whose results this query is using.
+						///< If set, result and ldap_conn belong to the
+						///< shared search.
+	fr_dlist_t		shared_entry;	//!< Entry in the shared search's list of waiters.
+	request_t		*request;	//!< Request waiting on the shared search.
 };
 
 /** Parsed LDAP referral structure
@@ -597,6 +632,13 @@ unlang_action_t fr_ldap_trunk_search(rlm_rcode_t *p_result,
 				     LDAPControl **serverctrls, LDAPControl **clientctrls,
 				     bool is_async);
 
+unlang_action_t fr_ldap_trunk_search_cached(rlm_rcode_t *p_result,
+					    TALLOC_CTX *ctx,
+					    fr_ldap_query_t **out, request_t *request, fr_ldap_thread_trunk_t *ttrunk,
+					    char const *base_dn, int scope, char const *filter, char const * const *attrs,
+					    LDAPControl **serverctrls, LDAPControl **clientctrls,
+					    bool is_async);
+
 unlang_action_t fr_ldap_trunk_modify(rlm_rcode_t *p_result,
 				     TALLOC_CTX *ctx,
 				     fr_ldap_query_t **out, request_t *request, fr_ldap_thread_trunk_t *ttrunk,
@@ -770,6 +812,18 @@ uint8_t		*fr_ldap_berval_to_bin(TALLOC_CTX *ctx, struct berval const *in);
 
 int		fr_ldap_parse_url_extensions(LDAPControl **sss, size_t sss_len, char *extensions[]);
 
+/*
+ *	search.c - Sharing search results between queries
+ */
+void		fr_ldap_search_shared_init(fr_ldap_thread_trunk_t *ttrunk);
+
+int		fr_ldap_search_shared_attach(fr_ldap_thread_trunk_t *ttrunk, request_t *request,
+					     fr_ldap_query_t *query, bool cacheable);
+
+void		fr_ldap_search_shared_detach(fr_ldap_query_t *query);
+
+void		fr_ldap_search_shared_fail(fr_ldap_query_t *query);
+
 /*
  *	referral.c - Handle LDAP referrals
  */
@@ -490,7 +490,11 @@ static void _ldap_trunk_idle_timeout(fr_event_list_t *el, UNUSED fr_time_t now,
 {
 	fr_ldap_thread_trunk_t	*ttrunk = talloc_get_type_abort(uctx, fr_ldap_thread_trunk_t);
 
-	if (ttrunk->trunk->req_alloc == 0) {
+	/*
+	 *	Queries may still be using the results of
+	 *	shared searches, which the trunk owns.
+	 */
+	if ((ttrunk->trunk->req_alloc == 0) && (ttrunk->search_refs == 0)) {
 		DEBUG2("Removing idle LDAP trunk to \"%s\"", ttrunk->uri);
 		talloc_free(ttrunk->trunk);
 		talloc_free(ttrunk);
@@ -532,6 +536,19 @@ static void ldap_request_cancel_mux(UNUSED fr_event_list_t *el, fr_trunk_connect
 	}
 }
 
+/** Callback for LDAP queries the trunk failed to send
+ *
+ * Queries sent on behalf of shared searches have no request to resume,
+ * so the queries waiting on their results must be woken here.
+ */
+static void ldap_trunk_request_fail(UNUSED request_t *request, void *preq, UNUSED void *rctx,
+				    UNUSED fr_trunk_request_state_t state, UNUSED void *uctx)
+{
+	fr_ldap_query_t		*query = talloc_get_type_abort(preq, fr_ldap_query_t);
+
+	query->treq = NULL;
+	fr_ldap_search_shared_fail(query);
+}
 
 /** I/O read function
  *
@@ -933,6 +950,12 @@ static void ldap_trunk_request_demux(fr_event_list_t *el, fr_trunk_connection_t
 
 static int _thread_ldap_trunk_free(fr_ldap_thread_trunk_t *ttrunk)
 {
+	/*
+	 *	Free the trunk before any shared searches, so
+	 *	the queries they sent are cancelled first.
+	 */
+	TALLOC_FREE(ttrunk->trunk);
+
 	if (ttrunk->t && fr_rb_node_inline_in_tree(&ttrunk->node)) fr_rb_remove(ttrunk->t->trunks, ttrunk);
 
 	return 0;
@@ -987,7 +1010,8 @@ fr_ldap_thread_trunk_t *fr_thread_ldap_trunk_get(fr_ldap_thread_t *thread, char
 					      .connection_notify = ldap_trunk_connection_notify,
 					      .request_mux = ldap_trunk_request_mux,
 					      .request_demux = ldap_trunk_request_demux,
-					      .request_cancel_mux = ldap_request_cancel_mux
+					      .request_cancel_mux = ldap_request_cancel_mux,
+					      .request_fail = ldap_trunk_request_fail
 					},
 				      thread->trunk_conf,
 				      "rlm_ldap", found, false);
@@ -1001,6 +1025,8 @@ fr_ldap_thread_trunk_t *fr_thread_ldap_trunk_get(fr_ldap_thread_t *thread, char
 
 	found->t = thread;
 
+	fr_ldap_search_shared_init(found);
+
 	/*
 	 *  Insert event to close trunk if it becomes idle
 	 */
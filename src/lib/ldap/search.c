@@ -0,0 +1,524 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or (at
+ *   your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file lib/ldap/search.c
+ * @brief Share the results of identical searches between queries.
+ *
+ * Searches submitted to a trunk whilst an identical search is in-flight
+ * wait for its results, instead of being sent to the directory again.
+ * The results of searches marked as cacheable are kept for a short time
+ * after they're received, and used to answer identical searches.
+ *
+ * All structures here are per-trunk, and so per-thread.  No locking is
+ * required.
+ *
+ * @copyright 2022 The FreeRADIUS Server Project.
+ */
+RCSID("$Id$")
+
+USES_APPLE_DEPRECATED_API
+
+#include <freeradius-devel/ldap/base.h>
+#include <freeradius-devel/unlang/interpret.h>
+
+#ifdef TESTING_LDAP_SEARCH
+/*
+ *	Searches aren't sent, and waiting queries aren't
+ *	resumed, we just count how often we'd have done so.
+ */
+static fr_time_t	test_time_base = fr_time_wrap(1);
+static unsigned int	test_enqueued;
+static unsigned int	test_runnable;
+
+static fr_time_t test_time(void)
+{
+	return test_time_base;
+}
+
+static fr_trunk_enqueue_t test_enqueue(UNUSED fr_trunk_request_t **treq, UNUSED fr_trunk_t *trunk,
+				       UNUSED request_t *request, UNUSED void *preq, UNUSED void *rctx)
+{
+	test_enqueued++;
+	return FR_TRUNK_ENQUEUE_OK;
+}
+
+static void test_mark_runnable(UNUSED request_t *request)
+{
+	test_runnable++;
+}
+
+#define fr_time test_time
+#define fr_trunk_request_enqueue test_enqueue
+#define unlang_interpret_mark_runnable test_mark_runnable
+#endif
+
+/** A search being, or which has been, performed on behalf of one or more queries
+ *
+ */
+struct fr_ldap_search_shared_s {
+	fr_rb_node_t		node;		//!< Entry in the trunk's tree of shared searches.
+	fr_dlist_t		cache_entry;	//!< Entry in the trunk's list of cached searches.
+
+	fr_ldap_thread_trunk_t	*ttrunk;	//!< Trunk the search was sent on.
+	fr_ldap_query_t		*query;		//!< Query sent to the directory.  Always allocated
+						///< in the context of the shared search.
+
+	uint8_t const		*key;		//!< Normalised base DN, scope, filter, attributes
+						///< and controls.
+	size_t			key_len;	//!< Length of the key.
+
+	fr_dlist_head_t		waiters;	//!< Queries waiting for results.
+	unsigned int		refs;		//!< Queries using the results.
+
+	bool			complete;	//!< Results have been received.
+	bool			cacheable;	//!< Results may be kept for search_cache_ttl.
+	fr_time_t		expires;	//!< When cached results should no longer be used.
+
+	fr_event_timer_t const	*ev;		//!< Deferred free once no queries reference us.
+};
+
+#define SEARCH_STATS_INC(_ttrunk, _field) \
+do { \
+	if ((_ttrunk)->t->search_stats) atomic_fetch_add_explicit(&(_ttrunk)->t->search_stats->_field, 1, memory_order_relaxed); \
+} while (0)
+
+#define SEARCH_STATS_DEC(_ttrunk, _field) \
+do { \
+	if ((_ttrunk)->t->search_stats) atomic_fetch_sub_explicit(&(_ttrunk)->t->search_stats->_field, 1, memory_order_relaxed); \
+} while (0)
+
+static int8_t ldap_search_shared_cmp(void const *one, void const *two)
+{
+	fr_ldap_search_shared_t const *a = one, *b = two;
+
+	MEMCMP_RETURN(a, b, key, key_len);
+	return 0;
+}
+
+static int ldap_search_attr_cmp(void const *one, void const *two)
+{
+	char const * const *a = one, * const *b = two;
+
+	return strcmp(*a, *b);
+}
+
+/** Remove a shared search from the trunk's lookup structures
+ *
+ */
+static int _ldap_search_shared_free(fr_ldap_search_shared_t *shared)
+{
+	fr_ldap_thread_trunk_t	*ttrunk = shared->ttrunk;
+
+	if (fr_rb_node_inline_in_tree(&shared->node)) fr_rb_remove(ttrunk->searches, shared);
+	if (fr_dlist_entry_in_list(&shared->cache_entry)) fr_dlist_remove(&ttrunk->search_cache, shared);
+
+	return 0;
+}
+
+static void _ldap_search_shared_reap(UNUSED fr_event_list_t *el, UNUSED fr_time_t now, void *uctx)
+{
+	fr_ldap_search_shared_t	*shared = talloc_get_type_abort(uctx, fr_ldap_search_shared_t);
+
+	talloc_free(shared);
+}
+
+/** Stop cached results being used, freeing them if no queries reference them
+ *
+ */
+static void ldap_search_cache_evict(fr_ldap_search_shared_t *shared)
+{
+	fr_ldap_thread_trunk_t	*ttrunk = shared->ttrunk;
+
+	fr_dlist_remove(&ttrunk->search_cache, shared);
+	fr_rb_remove(ttrunk->searches, shared);
+
+	if (shared->refs == 0) talloc_free(shared);
+}
+
+/** Evict expired results, and the oldest results if there are too many
+ *
+ * Entries are appended as their results are received, and all have the
+ * same TTL, so the list is in expiry order.
+ */
+static void ldap_search_cache_trim(fr_ldap_thread_trunk_t *ttrunk, fr_time_t now)
+{
+	fr_ldap_search_shared_t	*shared;
+
+	while ((shared = fr_dlist_head(&ttrunk->search_cache))) {
+		if (fr_time_lt(now, shared->expires)) {
+			if (fr_dlist_num_elements(&ttrunk->search_cache) <= ttrunk->config.search_cache_max) break;
+			SEARCH_STATS_INC(ttrunk, evicted);
+		}
+		ldap_search_cache_evict(shared);
+	}
+}
+
+/** Build the key identifying a search
+ *
+ * Attributes are sorted, and escape sequences in the base DN normalised,
+ * so searches which differ only in those respects share results.
+ *
+ * @return
+ *	- >0 the number of bytes written.
+ *	- <=0 if the search couldn't be represented.
+ */
+static ssize_t ldap_search_key(fr_dbuff_t *dbuff, fr_ldap_query_t const *query)
+{
+	fr_dbuff_t		work_dbuff = FR_DBUFF(dbuff);
+	char			dn[LDAP_MAX_DN_STR_LEN];
+	char const		*attrs[LDAP_MAX_ATTRMAP + LDAP_MAP_RESERVED + 1];
+	size_t			len, num_attrs = 0, i;
+	fr_ldap_control_t const	*ctrls[] = { query->serverctrls, query->clientctrls };
+
+	len = query->dn ? strlen(query->dn) : 0;
+	if (len >= sizeof(dn)) return -1;
+	len = fr_ldap_util_normalise_dn(dn, query->dn ? query->dn : "");
+
+	FR_DBUFF_IN_RETURN(&work_dbuff, (uint8_t)query->search.scope);
+	FR_DBUFF_IN_RETURN(&work_dbuff, (uint32_t)len);
+	FR_DBUFF_IN_MEMCPY_RETURN(&work_dbuff, (uint8_t const *)dn, len);
+
+	/*
+	 *	Distinguish between no filter, and an empty one
+	 */
+	if (!query->search.filter) {
+		FR_DBUFF_IN_RETURN(&work_dbuff, (uint32_t)0);
+	} else {
+		len = strlen(query->search.filter);
+		FR_DBUFF_IN_RETURN(&work_dbuff, (uint32_t)(len + 1));
+		FR_DBUFF_IN_MEMCPY_RETURN(&work_dbuff, (uint8_t const *)query->search.filter, len);
+	}
+
+	if (query->search.attrs) {
+		while (query->search.attrs[num_attrs]) {
+			if (num_attrs >= NUM_ELEMENTS(attrs)) return -1;
+			attrs[num_attrs] = query->search.attrs[num_attrs];
+			num_attrs++;
+		}
+		qsort(attrs, num_attrs, sizeof(attrs[0]), ldap_search_attr_cmp);
+	}
+
+	FR_DBUFF_IN_RETURN(&work_dbuff, (uint16_t)num_attrs);
+	for (i = 0; i < num_attrs; i++) {
+		len = strlen(attrs[i]);
+		FR_DBUFF_IN_RETURN(&work_dbuff, (uint16_t)len);
+		FR_DBUFF_IN_MEMCPY_RETURN(&work_dbuff, (uint8_t const *)attrs[i], len);
+	}
+
+	/*
+	 *	Controls such as server side sorting change the
+	 *	results, so must be part of the key.
+	 */
+	for (i = 0; i < NUM_ELEMENTS(ctrls); i++) {
+		int j;
+
+		for (j = 0; (j < LDAP_MAX_CONTROLS) && ctrls[i][j].control; j++) {
+			LDAPControl const *ctrl = ctrls[i][j].control;
+
+			len = strlen(ctrl->ldctl_oid);
+			FR_DBUFF_IN_RETURN(&work_dbuff, (uint8_t)(i + 1));
+			FR_DBUFF_IN_RETURN(&work_dbuff, (uint16_t)len);
+			FR_DBUFF_IN_MEMCPY_RETURN(&work_dbuff, (uint8_t const *)ctrl->ldctl_oid, len);
+			FR_DBUFF_IN_RETURN(&work_dbuff, (uint8_t)ctrl->ldctl_iscritical);
+			FR_DBUFF_IN_RETURN(&work_dbuff, (uint32_t)ctrl->ldctl_value.bv_len);
+			FR_DBUFF_IN_MEMCPY_RETURN(&work_dbuff, (uint8_t const *)ctrl->ldctl_value.bv_val,
+						  ctrl->ldctl_value.bv_len);
+		}
+	}
+
+	return fr_dbuff_set(dbuff, &work_dbuff);
+}
+
+/** Point a query at the results of a shared search
+ *
+ */
+static inline CC_HINT(always_inline)
+void ldap_search_shared_result(fr_ldap_query_t *query, fr_ldap_query_t const *sent)
+{
+	query->ret = sent->ret;
+	query->result = sent->result;
+	query->ldap_conn = sent->ldap_conn;
+}
+
+/** Pass the results of a shared search to everything waiting for them
+ *
+ * Results are then either cached, or removed from the tree so no new
+ * queries use them.
+ */
+static void ldap_search_shared_complete(fr_ldap_search_shared_t *shared)
+{
+	fr_ldap_thread_trunk_t	*ttrunk = shared->ttrunk;
+	fr_ldap_query_t		*sent = shared->query;
+	fr_ldap_query_t		*query;
+	fr_time_t		now;
+
+	shared->complete = true;
+	SEARCH_STATS_DEC(ttrunk, in_flight);
+
+	while ((query = fr_dlist_pop_head(&shared->waiters))) {
+		ldap_search_shared_result(query, sent);
+		unlang_interpret_mark_runnable(query->request);
+	}
+
+	if (shared->cacheable && fr_time_delta_ispos(ttrunk->config.search_cache_ttl) &&
+	    (ttrunk->config.search_cache_max > 0)) {
+		switch (sent->ret) {
+		case LDAP_RESULT_SUCCESS:
+		case LDAP_RESULT_NO_RESULT:
+		case LDAP_RESULT_BAD_DN:
+			now = fr_time();
+			shared->expires = fr_time_add(now, ttrunk->config.search_cache_ttl);
+			fr_dlist_insert_tail(&ttrunk->search_cache, shared);
+			ldap_search_cache_trim(ttrunk, now);
+			return;
+
+		default:
+			break;
+		}
+	}
+
+	fr_rb_remove(ttrunk->searches, shared);
+
+	/*
+	 *	We're being called from within the trunk's
+	 *	handlers, which still reference the query
+	 *	we sent, so it can't be freed here.
+	 */
+	if (shared->refs == 0) {
+		if (fr_event_timer_in(shared, ttrunk->t->el, &shared->ev, fr_time_delta_wrap(0),
+				      _ldap_search_shared_reap, shared) < 0) {
+			PERROR("Failed inserting shared search cleanup event");
+		}
+	}
+}
+
+/** Results parser for searches sent on behalf of shared searches
+ *
+ */
+static void ldap_search_shared_parse(UNUSED LDAP *handle, fr_ldap_query_t *query,
+				     UNUSED LDAPMessage *head, UNUSED void *rctx)
+{
+	ldap_search_shared_complete(talloc_get_type_abort(talloc_parent(query), fr_ldap_search_shared_t));
+}
+
+/** Wake up queries waiting on a shared search which the trunk couldn't complete
+ *
+ * @param[in] query	which failed.  Ignored if it wasn't sent on behalf
+ *			of a shared search.
+ */
+void fr_ldap_search_shared_fail(fr_ldap_query_t *query)
+{
+	if (query->parser != ldap_search_shared_parse) return;
+	if (query->ret != LDAP_RESULT_PENDING) return;
+
+	query->ret = LDAP_RESULT_ERROR;
+	ldap_search_shared_complete(talloc_get_type_abort(talloc_parent(query), fr_ldap_search_shared_t));
+}
+
+/** Allocate a new shared search, and enqueue it on the trunk
+ *
+ * The query sent to the directory gets its own copy of the search
+ * parameters, as it may outlive the query which created it.
+ */
+static fr_ldap_search_shared_t *ldap_search_shared_alloc(fr_ldap_thread_trunk_t *ttrunk, fr_ldap_query_t const *query,
+							 uint8_t *key, size_t key_len, bool cacheable)
+{
+	fr_ldap_search_shared_t	*shared;
+	fr_ldap_query_t		*sent;
+	int			i;
+
+	MEM(shared = talloc_zero(ttrunk, fr_ldap_search_shared_t));
+	shared->ttrunk = ttrunk;
+	shared->key = talloc_steal(shared, key);
+	shared->key_len = key_len;
+	shared->cacheable = cacheable;
+	fr_dlist_talloc_init(&shared->waiters, fr_ldap_query_t, shared_entry);
+	talloc_set_destructor(shared, _ldap_search_shared_free);
+
+	sent = fr_ldap_search_alloc(shared, NULL, query->search.scope, NULL, NULL, NULL, NULL);
+	if (query->dn) MEM(sent->dn = talloc_typed_strdup(sent, query->dn));
+	if (query->search.filter) MEM(sent->search.filter = talloc_typed_strdup(sent, query->search.filter));
+	if (query->search.attrs) {
+		char const	**attrs;
+		size_t		num = 0, j;
+
+		while (query->search.attrs[num]) num++;
+
+		MEM(attrs = talloc_array(sent, char const *, num + 1));
+		for (j = 0; j < num; j++) MEM(attrs[j] = talloc_typed_strdup(attrs, query->search.attrs[j]));
+		attrs[num] = NULL;
+		sent->search.attrs = attrs;
+	}
+
+	for (i = 0; (i < LDAP_MAX_CONTROLS) && query->serverctrls[i].control; i++) {
+		MEM(sent->serverctrls[i].control = ldap_control_dup(query->serverctrls[i].control));
+		sent->serverctrls[i].freeit = true;
+	}
+	for (i = 0; (i < LDAP_MAX_CONTROLS) && query->clientctrls[i].control; i++) {
+		MEM(sent->clientctrls[i].control = ldap_control_dup(query->clientctrls[i].control));
+		sent->clientctrls[i].freeit = true;
+	}
+
+	sent->parser = ldap_search_shared_parse;
+	shared->query = sent;
+
+	switch (fr_trunk_request_enqueue(&sent->treq, ttrunk->trunk, NULL, sent, NULL)) {
+	case FR_TRUNK_ENQUEUE_OK:
+	case FR_TRUNK_ENQUEUE_IN_BACKLOG:
+		break;
+
+	default:
+		talloc_free(shared);
+		return NULL;
+	}
+
+	fr_rb_insert(ttrunk->searches, shared);
+
+	SEARCH_STATS_INC(ttrunk, sent);
+	SEARCH_STATS_INC(ttrunk, in_flight);
+
+	return shared;
+}
+
+/** Initialise the shared search structures for a trunk
+ *
+ */
+void fr_ldap_search_shared_init(fr_ldap_thread_trunk_t *ttrunk)
+{
+	MEM(ttrunk->searches = fr_rb_inline_talloc_alloc(ttrunk, fr_ldap_search_shared_t, node,
+							 ldap_search_shared_cmp, NULL));
+	fr_dlist_talloc_init(&ttrunk->search_cache, fr_ldap_search_shared_t, cache_entry);
+}
+
+/** Answer a search query with the results of an identical search
+ *
+ * If an identical search is in-flight, the query waits for its results.
+ * If cacheable is true, and the results of an identical search were
+ * received less than search_cache_ttl ago, they're used immediately.
+ * Otherwise a new search is sent, which later identical searches will share.
+ *
+ * @param[in] ttrunk	the query would be sent on.
+ * @param[in] request	the query is being performed for.
+ * @param[in] query	to answer.  Its ret field will be set if results
+ *			are available immediately.
+ * @param[in] cacheable	Whether the results of this search may be cached.
+ * @return
+ *	- 0 if the query is using the results of a shared search.
+ *	- 1 if the query can't be shared, and should be sent itself.
+ *	- -1 on error.
+ */
+int fr_ldap_search_shared_attach(fr_ldap_thread_trunk_t *ttrunk, request_t *request,
+				 fr_ldap_query_t *query, bool cacheable)
+{
+	fr_ldap_search_shared_t	*shared;
+	fr_dbuff_t		dbuff;
+	fr_dbuff_uctx_talloc_t	tctx;
+	ssize_t			slen;
+
+	fr_assert(query->type == LDAP_REQUEST_SEARCH);
+
+	if (!fr_dbuff_init_talloc(NULL, &dbuff, &tctx, 256, 65536)) return -1;
+
+	slen = ldap_search_key(&dbuff, query);
+	if (slen <= 0) {
+		talloc_free(fr_dbuff_buff(&dbuff));
+		return 1;
+	}
+
+	SEARCH_STATS_INC(ttrunk, searches);
+
+	shared = fr_rb_find(ttrunk->searches, &(fr_ldap_search_shared_t){
+					.key = fr_dbuff_start(&dbuff), .key_len = (size_t)slen
+				});
+
+	/*
+	 *	Complete searches in the tree are always cached
+	 *	ones.  Only use them if the caller is happy with
+	 *	cached results, and they're still valid.
+	 */
+	if (shared && shared->complete) {
+		if (!cacheable || fr_time_gteq(fr_time(), shared->expires)) {
+			ldap_search_cache_evict(shared);
+			shared = NULL;
+		}
+	}
+
+	if (shared) {
+		talloc_free(fr_dbuff_buff(&dbuff));
+
+		if (cacheable) shared->cacheable = true;
+
+		if (shared->complete) {
+			ROPTIONAL(RDEBUG2, DEBUG2, "Using cached search results");
+			SEARCH_STATS_INC(ttrunk, hits);
+			ldap_search_shared_result(query, shared->query);
+		} else {
+			ROPTIONAL(RDEBUG2, DEBUG2, "Waiting for results of identical in-flight search");
+			SEARCH_STATS_INC(ttrunk, dedup);
+			query->request = request;
+			fr_dlist_insert_tail(&shared->waiters, query);
+		}
+	} else {
+		shared = ldap_search_shared_alloc(ttrunk, query, fr_dbuff_buff(&dbuff), (size_t)slen, cacheable);
+		if (!shared) {
+			talloc_free(fr_dbuff_buff(&dbuff));
+			return -1;
+		}
+		query->request = request;
+		fr_dlist_insert_tail(&shared->waiters, query);
+	}
+
+	query->shared = shared;
+	shared->refs++;
+	ttrunk->search_refs++;
+
+	return 0;
+}
+
+/** Stop a query using the results of a shared search
+ *
+ * Called when the query is freed.
+ */
+void fr_ldap_search_shared_detach(fr_ldap_query_t *query)
+{
+	fr_ldap_search_shared_t	*shared = query->shared;
+
+	if (!shared) return;
+
+	if (fr_dlist_entry_in_list(&query->shared_entry)) fr_dlist_remove(&shared->waiters, query);
+
+	query->shared = NULL;
+	query->result = NULL;
+	query->ldap_conn = NULL;
+
+	shared->ttrunk->search_refs--;
+	if (--shared->refs > 0) return;
+
+	/*
+	 *	Still in-flight, the results will be cached or
+	 *	freed when they arrive.
+	 */
+	if (!shared->complete) return;
+
+	/*
+	 *	Still cached
+	 */
+	if (fr_rb_node_inline_in_tree(&shared->node)) return;
+
+	talloc_free(shared);
+}
@@ -0,0 +1,211 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or (at
+ *   your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/** Tests for sharing the results of identical LDAP searches
+ *
+ * @file src/lib/ldap/search_tests.c
+ *
+ * @copyright 2022 The FreeRADIUS server project
+ */
+#include <freeradius-devel/util/acutest.h>
+#include <freeradius-devel/util/acutest_helpers.h>
+
+#include "search.c"
+
+#define TEST_BASE_DN	"ou=people,dc=example,dc=com"
+
+static char const *test_attrs[] = { "uid", "cn", "memberOf", NULL };
+static char const *test_attrs_reordered[] = { "memberOf", "uid", "cn", NULL };
+
+static fr_ldap_thread_trunk_t *test_ttrunk_alloc(TALLOC_CTX *ctx, fr_time_delta_t ttl, uint32_t max)
+{
+	fr_ldap_thread_t	*t;
+	fr_ldap_thread_trunk_t	*ttrunk;
+
+	t = talloc_zero(ctx, fr_ldap_thread_t);
+	TEST_CHECK(t != NULL);
+	t->el = fr_event_list_alloc(t, NULL, NULL);
+	TEST_CHECK(t->el != NULL);
+	t->search_stats = talloc_zero(t, fr_ldap_search_stats_t);
+
+	ttrunk = talloc_zero(t, fr_ldap_thread_trunk_t);
+	TEST_CHECK(ttrunk != NULL);
+	ttrunk->t = t;
+	ttrunk->config.search_dedup = true;
+	ttrunk->config.search_cache_ttl = ttl;
+	ttrunk->config.search_cache_max = max;
+	fr_ldap_search_shared_init(ttrunk);
+
+	test_time_base = fr_time_wrap(1);
+	test_enqueued = 0;
+	test_runnable = 0;
+
+	return ttrunk;
+}
+
+static fr_ldap_query_t *test_search_attach(fr_ldap_thread_trunk_t *ttrunk, char const *filter,
+					   char const **attrs, bool cacheable)
+{
+	fr_ldap_query_t *query;
+
+	query = fr_ldap_search_alloc(ttrunk, TEST_BASE_DN, LDAP_SCOPE_SUB, filter, attrs, NULL, NULL);
+	TEST_CHECK(query != NULL);
+	TEST_CHECK(fr_ldap_search_shared_attach(ttrunk, NULL, query, cacheable) == 0);
+
+	return query;
+}
+
+/** Simulate the directory responding to a shared search
+ *
+ */
+static void test_search_complete(fr_ldap_query_t *query, fr_ldap_result_code_t ret)
+{
+	fr_ldap_query_t *sent;
+
+	TEST_ASSERT(query->shared != NULL);
+	sent = query->shared->query;
+	sent->ret = ret;
+	ldap_search_shared_parse(NULL, sent, NULL, NULL);
+}
+
+static uint64_t test_stat(atomic_uint_fast64_t *stat)
+{
+	return atomic_load_explicit(stat, memory_order_relaxed);
+}
+
+static void test_coalesce(void)
+{
+	TALLOC_CTX		*ctx = talloc_init_const("test");
+	fr_ldap_thread_trunk_t	*ttrunk = test_ttrunk_alloc(ctx, fr_time_delta_wrap(0), 0);
+	fr_ldap_search_stats_t	*stats = ttrunk->t->search_stats;
+	fr_ldap_query_t		*a, *b, *c;
+
+	a = test_search_attach(ttrunk, "(uid=bob)", test_attrs, false);
+	b = test_search_attach(ttrunk, "(uid=bob)", test_attrs_reordered, false);
+
+	TEST_CASE("Identical searches are sent once");
+	TEST_CHECK(test_enqueued == 1);
+	TEST_MSG("Expected 1 search sent, got %u", test_enqueued);
+	TEST_CHECK(a->shared == b->shared);
+	TEST_CHECK(test_stat(&stats->sent) == 1);
+	TEST_CHECK(test_stat(&stats->dedup) == 1);
+
+	TEST_CASE("Different searches are sent separately");
+	c = test_search_attach(ttrunk, "(uid=alice)", test_attrs, false);
+	TEST_CHECK(test_enqueued == 2);
+	TEST_CHECK(c->shared != a->shared);
+
+	TEST_CASE("Results are passed to every waiting query");
+	test_search_complete(a, LDAP_RESULT_SUCCESS);
+	TEST_CHECK(test_runnable == 2);
+	TEST_MSG("Expected 2 queries resumed, got %u", test_runnable);
+	TEST_CHECK(a->ret == LDAP_RESULT_SUCCESS);
+	TEST_CHECK(b->ret == LDAP_RESULT_SUCCESS);
+	TEST_CHECK(c->ret == LDAP_RESULT_PENDING);
+	TEST_CHECK(atomic_load(&stats->in_flight) == 1);
+
+	TEST_CASE("Uncached results aren't reused");
+	talloc_free(a);
+	talloc_free(b);
+	a = test_search_attach(ttrunk, "(uid=bob)", test_attrs, false);
+	TEST_CHECK(test_enqueued == 3);
+	TEST_CHECK(a->ret == LDAP_RESULT_PENDING);
+
+	talloc_free(a);
+	talloc_free(c);
+	talloc_free(ctx);
+}
+
+static void test_cache_hit(void)
+{
+	TALLOC_CTX		*ctx = talloc_init_const("test");
+	fr_ldap_thread_trunk_t	*ttrunk = test_ttrunk_alloc(ctx, fr_time_delta_from_sec(10), 10);
+	fr_ldap_search_stats_t	*stats = ttrunk->t->search_stats;
+	fr_ldap_query_t		*a, *b, *c;
+
+	a = test_search_attach(ttrunk, "(uid=bob)", test_attrs, true);
+	test_search_complete(a, LDAP_RESULT_SUCCESS);
+	TEST_CHECK(fr_dlist_num_elements(&ttrunk->search_cache) == 1);
+	talloc_free(a);
+
+	TEST_CASE("Cacheable searches are answered from the cache");
+	b = test_search_attach(ttrunk, "(uid=bob)", test_attrs_reordered, true);
+	TEST_CHECK(b->ret == LDAP_RESULT_SUCCESS);
+	TEST_CHECK(test_enqueued == 1);
+	TEST_CHECK(test_stat(&stats->hits) == 1);
+
+	TEST_CASE("Searches which aren't cacheable don't use the cache");
+	c = test_search_attach(ttrunk, "(uid=bob)", test_attrs, false);
+	TEST_CHECK(c->ret == LDAP_RESULT_PENDING);
+	TEST_CHECK(test_enqueued == 2);
+	TEST_CHECK(test_stat(&stats->hits) == 1);
+
+	/*
+	 *	The evicted entry is still referenced by b
+	 */
+	TEST_CHECK(b->ret == LDAP_RESULT_SUCCESS);
+	talloc_free(b);
+	talloc_free(c);
+
+	talloc_free(ctx);
+}
+
+static void test_cache_expiry(void)
+{
+	TALLOC_CTX		*ctx = talloc_init_const("test");
+	fr_ldap_thread_trunk_t	*ttrunk = test_ttrunk_alloc(ctx, fr_time_delta_from_sec(10), 10);
+	fr_ldap_search_stats_t	*stats = ttrunk->t->search_stats;
+	fr_ldap_query_t		*a, *b;
+
+	a = test_search_attach(ttrunk, "(uid=bob)", test_attrs, true);
+	test_search_complete(a, LDAP_RESULT_SUCCESS);
+	talloc_free(a);
+
+	TEST_CASE("Results are used before they expire");
+	test_time_base = fr_time_add(test_time_base, fr_time_delta_from_sec(9));
+	b = test_search_attach(ttrunk, "(uid=bob)", test_attrs, true);
+	TEST_CHECK(b->ret == LDAP_RESULT_SUCCESS);
+	TEST_CHECK(test_stat(&stats->hits) == 1);
+	talloc_free(b);
+
+	TEST_CASE("Expired results cause a new search");
+	test_time_base = fr_time_add(test_time_base, fr_time_delta_from_sec(2));
+	b = test_search_attach(ttrunk, "(uid=bob)", test_attrs, true);
+	TEST_CHECK(b->ret == LDAP_RESULT_PENDING);
+	TEST_CHECK(test_enqueued == 2);
+	TEST_CHECK(test_stat(&stats->hits) == 1);
+	TEST_CHECK(fr_dlist_num_elements(&ttrunk->search_cache) == 0);
+
+	TEST_CASE("Entries beyond search_cache_max are evicted");
+	ttrunk->config.search_cache_max = 1;
+	test_search_complete(b, LDAP_RESULT_SUCCESS);
+	talloc_free(b);
+	a = test_search_attach(ttrunk, "(uid=alice)", test_attrs, true);
+	test_search_complete(a, LDAP_RESULT_SUCCESS);
+	talloc_free(a);
+	TEST_CHECK(fr_dlist_num_elements(&ttrunk->search_cache) == 1);
+	TEST_CHECK(test_stat(&stats->evicted) == 1);
+
+	talloc_free(ctx);
+}
+
+TEST_LIST = {
+	{ "coalesce",		test_coalesce },
+	{ "cache_hit",		test_cache_hit },
+	{ "cache_expiry",	test_cache_expiry },
+
+	{ NULL }
+};
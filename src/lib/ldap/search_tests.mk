@@ -0,0 +1,9 @@
+TARGET		:= ldap_search_tests
+
+SOURCES		:= search_tests.c
+
+TGT_LDLIBS	:= $(LIBS) $(LDAP_LDFLAGS) $(GPERFTOOLS_LIBS)
+TGT_LDFLAGS	:= $(LDFLAGS) $(GPERFTOOLS_LDFLAGS)
+
+TGT_PREREQS	:= libfreeradius-ldap.a libfreeradius-util.la libfreeradius-server.a libfreeradius-unlang.a
+SRC_CFLAGS	:= $(LDAP_CFLAGS) -DTESTING_LDAP_SEARCH
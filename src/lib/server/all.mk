@@ -1,4 +1,6 @@
 SUBMAKEFILES := \
 	libfreeradius-server.mk \
 	pair_server_tests.mk \
+	state_tests.mk \
+	tmpl_eval_tests.mk \
 	trunk_tests.mk
@@ -1513,6 +1513,203 @@ alloc_section:
 	return cf_section_to_item(css);
 }
 
+/*
+ *	parallel [ <option> ... ] { ... }
+ *
+ *	The first option is name2, and any others are
+ *	recorded as additional arguments.
+ */
+static CONF_ITEM *process_parallel(cf_stack_t *stack)
+{
+	char const	*value = NULL;
+	CONF_SECTION	*css;
+	fr_token_t	token = T_INVALID;
+	char const	*ptr = stack->ptr;
+	cf_stack_frame_t *frame = &stack->frame[stack->depth];
+	CONF_SECTION	*parent = frame->current;
+	char		*buff[4];
+
+	/*
+	 *	Short names are nicer.
+	 */
+	buff[2] = stack->buff[2];
+
+	fr_skip_whitespace(ptr);
+	if (*ptr != '{') {
+		if (cf_get_token(parent, &ptr, &token, buff[2], stack->bufsize,
+				 frame->filename, frame->lineno) < 0) {
+			return NULL;
+		}
+		value = buff[2];
+	}
+
+	/*
+	 *	Allocate the section
+	 */
+	css = cf_section_alloc(parent, parent, "parallel", value);
+	if (!css) {
+		ERROR("%s[%d]: Failed allocating memory for section",
+		      frame->filename, frame->lineno);
+		return NULL;
+	}
+	cf_filename_set(css, frame->filename);
+	cf_lineno_set(css, frame->lineno);
+	css->name2_quote = token;
+
+	while (*ptr != '{') {
+		if (!*ptr || (*ptr == '#')) {
+			ERROR("%s[%d]: Expecting section start brace '{' in 'parallel' definition",
+			      frame->filename, frame->lineno);
+			return NULL;
+		}
+
+		if (cf_get_token(parent, &ptr, &token, buff[2], stack->bufsize,
+				 frame->filename, frame->lineno) < 0) {
+			return NULL;
+		}
+
+		MEM(css->argv = talloc_realloc(css, css->argv, char const *, css->argc + 1));
+		MEM(css->argv_quote = talloc_realloc(css, css->argv_quote, fr_token_t, css->argc + 1));
+		css->argv[css->argc] = talloc_typed_strdup(css->argv, buff[2]);
+		css->argv_quote[css->argc] = token;
+		css->argc++;
+	}
+	ptr++;
+
+	stack->ptr = ptr;
+
+	css->allow_unlang = true;
+	return cf_section_to_item(css);
+}
+
+/*
+ *	case { ... }
+ *	case <value> { ... }
+ *	case <value>* { ... }
+ *	case <low> .. <high> { ... }
+ *
+ *	Prefix and range cases are recorded as additional
+ *	arguments, which are "*", or ".." followed by the
+ *	end of the range.
+ */
+static CONF_ITEM *process_case(cf_stack_t *stack)
+{
+	char const	*value = NULL, *high = NULL, *marker = NULL;
+	CONF_SECTION	*css;
+	fr_token_t	token = T_INVALID, high_token = T_INVALID;
+	char const	*ptr = stack->ptr;
+	cf_stack_frame_t *frame = &stack->frame[stack->depth];
+	CONF_SECTION	*parent = frame->current;
+	char		*buff[4];
+	char		*p;
+
+	/*
+	 *	Short names are nicer.
+	 */
+	buff[2] = stack->buff[2];
+	buff[3] = stack->buff[3];
+
+	/*
+	 *	case { ... } is the default.
+	 */
+	fr_skip_whitespace(ptr);
+	if (*ptr == '{') {
+		ptr++;
+		goto alloc_section;
+	}
+
+	if (cf_get_token(parent, &ptr, &token, buff[2], stack->bufsize,
+			 frame->filename, frame->lineno) < 0) {
+		return NULL;
+	}
+	value = buff[2];
+
+	/*
+	 *	Bare words swallow '*' and '.', so the
+	 *	markers may be part of the value.
+	 */
+	if (token == T_BARE_WORD) {
+		size_t len = strlen(value);
+
+		if ((len > 1) && (value[len - 1] == '*')) {
+			buff[2][len - 1] = '\0';
+			marker = "*";
+
+		} else if ((p = strstr(buff[2], "..")) != NULL) {
+			*p = '\0';
+			strlcpy(buff[3], p + 2, stack->bufsize);
+			high = buff[3];
+			high_token = T_BARE_WORD;
+			marker = "..";
+		}
+	}
+
+	if (!marker) {
+		if (*ptr == '*') {
+			ptr++;
+			fr_skip_whitespace(ptr);
+			marker = "*";
+
+		} else if ((ptr[0] == '.') && (ptr[1] == '.')) {
+			ptr += 2;
+			fr_skip_whitespace(ptr);
+
+			if (cf_get_token(parent, &ptr, &high_token, buff[3], stack->bufsize,
+					 frame->filename, frame->lineno) < 0) {
+				return NULL;
+			}
+			high = buff[3];
+			marker = "..";
+		}
+	}
+
+	if (high && (!*value || !*high)) {
+		ERROR("%s[%d]: Invalid syntax for 'case' - ranges must have a start and an end",
+		      frame->filename, frame->lineno);
+		return NULL;
+	}
+
+	if (*ptr != '{') {
+		ERROR("%s[%d]: Expecting section start brace '{' in 'case' definition",
+		      frame->filename, frame->lineno);
+		return NULL;
+	}
+	ptr++;
+
+	/*
+	 *	Allocate the section
+	 */
+alloc_section:
+	css = cf_section_alloc(parent, parent, "case", value);
+	if (!css) {
+		ERROR("%s[%d]: Failed allocating memory for section",
+		      frame->filename, frame->lineno);
+		return NULL;
+	}
+	cf_filename_set(css, frame->filename);
+	cf_lineno_set(css, frame->lineno);
+	css->name2_quote = token;
+
+	if (marker) {
+		css->argc = high ? 2 : 1;
+		css->argv = talloc_array(css, char const *, css->argc);
+		css->argv_quote = talloc_array(css, fr_token_t, css->argc);
+
+		css->argv[0] = talloc_typed_strdup(css->argv, marker);
+		css->argv_quote[0] = T_BARE_WORD;
+
+		if (high) {
+			css->argv[1] = talloc_typed_strdup(css->argv, high);
+			css->argv_quote[1] = high_token;
+		}
+	}
+
+	stack->ptr = ptr;
+
+	css->allow_unlang = true;
+	return cf_section_to_item(css);
+}
+
 static int add_section_pair(CONF_SECTION **parent, char const **attr, char const *dot, char *buffer, size_t buffer_len, char const *filename, int lineno)
 {
 	CONF_SECTION *cs;
@@ -1651,9 +1848,11 @@ static int add_pair(CONF_SECTION *parent, char const *attr, char const *value,
 }
 
 static fr_table_ptr_sorted_t unlang_keywords[] = {
+	{ L("case"),		(void *) process_case },
 	{ L("elsif"),		(void *) process_if },
 	{ L("if"),		(void *) process_if },
 	{ L("map"),		(void *) process_map },
+	{ L("parallel"),	(void *) process_parallel },
 	{ L("subrequest"),	(void *) process_subrequest }
 };
 static int unlang_keywords_len = NUM_ELEMENTS(unlang_keywords);
@@ -1744,7 +1943,15 @@ static int parse_input(cf_stack_t *stack)
 			return -1;
 		}
 	} else {
-		process = (cf_process_func_t) fr_table_value_by_str(unlang_keywords, buff[1], NULL);
+		/*
+		 *	Keywords can still be used as the names of
+		 *	configuration items, e.g. "parallel = 25".
+		 */
+		if ((ptr[0] == '=') || ((ptr[0] == ':') && (ptr[1] == '='))) {
+			process = NULL;
+		} else {
+			process = (cf_process_func_t) fr_table_value_by_str(unlang_keywords, buff[1], NULL);
+		}
 		if (process) {
 			CONF_ITEM *ci;
 
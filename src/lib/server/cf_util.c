@@ -1094,7 +1094,7 @@ char const *cf_section_name(CONF_SECTION const *cs)
  */
 char const *cf_section_argv(CONF_SECTION const *cs, int argc)
 {
-	if (!cs || !cs->argv || (argc < 0) || (argc > cs->argc)) return NULL;
+	if (!cs || !cs->argv || (argc < 0) || (argc >= cs->argc)) return NULL;
 
 	return cs->argv[argc];
 }
@@ -1129,7 +1129,7 @@ fr_token_t cf_section_name2_quote(CONF_SECTION const *cs)
  */
 fr_token_t cf_section_argv_quote(CONF_SECTION const *cs, int argc)
 {
-	if (!cs || !cs->argv_quote || (argc < 0) || (argc > cs->argc)) return T_INVALID;
+	if (!cs || !cs->argv_quote || (argc < 0) || (argc >= cs->argc)) return T_INVALID;
 
 	return cs->argv_quote[argc];
 }
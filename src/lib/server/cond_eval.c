@@ -242,14 +242,11 @@ done:
  *
  * @param[in] request		The current request.
  * @param[in] subject		to executed regex against.
- * @param[in,out] preg		Pointer to pre-compiled or runtime-compiled
- *				regular expression.  In the case of runtime-compiled
- *				the pattern may be stolen by the `regex_sub_to_request`
- *				function as the original pattern is needed to resolve
- *				capture groups.
- *				The caller should only free the `regex_t *` if it
- *				compiled it, and the pointer has not been set to NULL
- *				when this function returns.
+ * @param[in,out] preg		Pointer to pre-compiled or cached
+ *				regular expression.  In the case of cached
+ *				expressions `regex_sub_to_request` takes a
+ *				reference to the pattern, as the original pattern
+ *				is needed to resolve capture groups.
  * @return
  *	- -1 on failure.
  *	- 0 for "no match".
@@ -613,7 +610,7 @@ static bool cond_eval_map(request_t *request, fr_cond_t const *c,
 
 	fr_value_box_t *lhs, *lhs_free;
 	fr_value_box_t *rhs, *rhs_free;
-	regex_t		*preg, *preg_free;
+	regex_t		*preg;
 
 #ifndef NDEBUG
 	/*
@@ -632,7 +629,7 @@ static bool cond_eval_map(request_t *request, fr_cond_t const *c,
 #endif
 
 	MAP_VERIFY(map);
-	preg = preg_free = NULL;
+	preg = NULL;
 
 	/*
 	 *	Realize the LHS of a condition.
@@ -663,14 +660,13 @@ static bool cond_eval_map(request_t *request, fr_cond_t const *c,
 
 			if (!fr_cond_assert(rhs && tmpl_contains_regex(map->rhs))) goto done;
 
-			slen = regex_compile(request, &preg_free, rhs->vb_strvalue, rhs->vb_length,
-					     tmpl_regex_flags(map->rhs), true, true);
+			slen = regex_compile_cached(&preg, rhs->vb_strvalue, rhs->vb_length,
+						    tmpl_regex_flags(map->rhs), true);
 			if (slen <= 0) {
 				REMARKER(rhs->vb_strvalue, -slen, "%s", fr_strerror());
 				EVAL_DEBUG("FAIL %d", __LINE__);
 				return false;
 			}
-			preg = preg_free;
 		}
 
 		/*
@@ -838,10 +834,9 @@ done:
 	talloc_free(rhs_free);
 
 	/*
-	 *	Capture groups may have grabbed preg and put it into
-	 *	request data, in which case we don't free it.
+	 *	preg is either precompiled, or owned by the regex
+	 *	cache, so there's nothing to free here.
 	 */
-	if (preg) talloc_free(preg_free);
 	return (rcode == 1);
 }
 
@@ -459,7 +459,8 @@ int fr_exec_fork_nowait(request_t *request, fr_value_box_list_t *args,
  * @param[out] stdin_fd		The stdin FD of the child.
  * @param[out] stdout_fd 	The stdout FD of the child.
  * @param[out] stderr_fd 	The stderr FD of the child.
- * @param[in] request		the request
+ * @param[in] request		the request.  May be NULL if the program
+ *				isn't being run on behalf of a request.
  * @param[in] args		as returned by xlat_frame_eval()
  * @param[in] env_pairs		env_pairs to put into into the environment.  May be NULL.
  * @param[in] env_escape	Wrap string values in double quotes, and apply doublequote
@@ -531,8 +532,8 @@ int fr_exec_fork_wait(pid_t *pid_p, int *stdin_fd, int *stdout_fd, int *stderr_f
 		int i;
 		char **env_p = env;
 
-		for (i = 0; i < argc; i++) RDEBUG3("arg[%d] %s", i, argv[i]);
-		while (*env_p) RDEBUG3("export %s", *env_p++);
+		for (i = 0; i < argc; i++) ROPTIONAL(RDEBUG3, DEBUG3, "arg[%d] %s", i, argv[i]);
+		while (*env_p) ROPTIONAL(RDEBUG3, DEBUG3, "export %s", *env_p++);
 	}
 
 	if (stdin_fd) {
@@ -589,9 +590,16 @@ int fr_exec_fork_wait(pid_t *pid_p, int *stdin_fd, int *stdout_fd, int *stderr_f
 	 */
 	*pid_p = pid;
 
+	/*
+	 *	The child has its own copy, and the request
+	 *	may be NULL, in which case nothing else would
+	 *	free it.
+	 */
+	talloc_free(argv);
+
 	if (stdin_fd) {
 		*stdin_fd = stdin_pipe[1];
-		close(stdout_pipe[0]);
+		close(stdin_pipe[0]);
 	}
 
 	if (stdout_fd) {
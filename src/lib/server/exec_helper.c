@@ -0,0 +1,732 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @file src/lib/server/exec_helper.c
+ * @brief Persistent helper processes, speaking a line based protocol over pipes.
+ *
+ * Forking the server, and starting an interpreter, for every request is
+ * expensive.  Helpers are started once, and then passed requests on
+ * stdin, responding on stdout.
+ *
+ * Requests and responses are framed the same way.  Each is zero or more
+ * lines terminated by '\\n', followed by a line containing only ".".
+ * This is compatible with the ntlm-server-1 protocol spoken by Samba's
+ * ntlm_auth, and is simple to implement in a script.
+ *
+ * Helpers must respond to requests in the order they were received, as
+ * requests may be pipelined.  Anything written to stderr is logged.
+ *
+ * Each helper is a trunk connection, so the trunk decides how many are
+ * running, how many requests each may have outstanding, and when they're
+ * recycled.  Helpers which exit, or take longer than the configured
+ * timeout to respond, are killed and restarted.
+ *
+ * @copyright 2022 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#define LOG_PREFIX helper->log_prefix
+
+#include <freeradius-devel/server/exec.h>
+#include <freeradius-devel/server/exec_helper.h>
+#include <freeradius-devel/server/log.h>
+#include <freeradius-devel/server/util.h>
+#include <freeradius-devel/unlang/interpret.h>
+#include <freeradius-devel/util/misc.h>
+#include <freeradius-devel/util/syserror.h>
+
+#include <signal.h>
+
+#define EXEC_HELPER_MAX_ARGV	(256)
+
+/** Configuration for a pool of helpers
+ *
+ */
+CONF_PARSER const fr_exec_helper_config[] = {
+	{ FR_CONF_OFFSET("program", FR_TYPE_STRING, fr_exec_helper_conf_t, program) },
+	{ FR_CONF_OFFSET("env_inherit", FR_TYPE_BOOL, fr_exec_helper_conf_t, env_inherit), .dflt = "no" },
+	{ FR_CONF_OFFSET("timeout", FR_TYPE_TIME_DELTA, fr_exec_helper_conf_t, timeout), .dflt = STRINGIFY(EXEC_TIMEOUT) },
+	{ FR_CONF_OFFSET("max_response", FR_TYPE_UINT32, fr_exec_helper_conf_t, max_response), .dflt = "65536" },
+	{ FR_CONF_OFFSET("pool", FR_TYPE_SUBSECTION, fr_exec_helper_conf_t, trunk_conf), .subcs = (void const *) fr_trunk_config },
+	CONF_PARSER_TERMINATOR
+};
+
+/** A pool of helpers, owned by a single thread
+ *
+ */
+struct fr_exec_helper_s {
+	fr_exec_helper_conf_t const	*conf;		//!< Helper configuration.
+	char const			*log_prefix;	//!< Prefix for log messages.
+	fr_value_box_list_t		args;		//!< Program and arguments, one group per argument,
+							///< as expected by #fr_exec_fork_wait.
+	fr_trunk_t			*trunk;		//!< Helpers, and requests waiting for one.
+};
+
+/** A frame written, or being written to a helper
+ *
+ * Owned by the helper, not the request, so the response to a
+ * cancelled request can still be matched, and discarded.
+ */
+struct fr_exec_helper_sent_s {
+	fr_dlist_t			entry;		//!< Entry in the helper's list of frames.
+	fr_exec_helper_request_t	*hreq;		//!< Request the frame is for, or NULL if the
+							///< request was cancelled.
+	char				*data;		//!< Copy of the frame.
+	size_t				data_len;	//!< Length of the frame.
+	size_t				written;	//!< How much of the frame has been written.
+	fr_time_t			when;		//!< When the frame was completely written.
+};
+
+/** A running helper
+ *
+ */
+typedef struct {
+	fr_exec_helper_t		*helper;	//!< Pool this helper belongs to.
+	fr_event_list_t			*el;		//!< Event list the helper's fds are in.
+
+	pid_t				pid;		//!< PID of the helper.
+	int				stdin_fd;	//!< For writing requests.
+	int				stdout_fd;	//!< For reading responses.
+	int				stderr_fd;	//!< For reading things to log.
+
+	fr_dlist_head_t			sent;		//!< Frames written, in the order they were written.
+	fr_exec_helper_sent_t		*partial;	//!< Frame which has only been partially written.
+	fr_event_timer_t const		*ev;		//!< Timeout for the oldest outstanding frame.
+
+	char				*buff;		//!< Response data.
+	size_t				used;		//!< How much of the response buffer is used.
+	size_t				scanned;	//!< How much of the response buffer we've
+							///< searched for complete lines.
+} exec_helper_conn_t;
+
+/** Split the program into arguments
+ *
+ * Arguments are split in the same way as the legacy exec functions do,
+ * so they may be quoted with single or double quotes.  The program isn't
+ * expanded, as it's only run when helpers are started, and not on behalf
+ * of any particular request.
+ */
+static int exec_helper_args(TALLOC_CTX *ctx, fr_value_box_list_t *out, char const *program)
+{
+	char const	*argv[EXEC_HELPER_MAX_ARGV];
+	char		argv_buf[4096];
+	int		argc, i;
+
+	fr_value_box_list_init(out);
+
+	if (!program || !*program) {
+	empty:
+		fr_strerror_const("No program specified");
+		return -1;
+	}
+
+	argc = rad_expand_xlat(NULL, program, NUM_ELEMENTS(argv), argv, false, sizeof(argv_buf), argv_buf);
+	if (argc < 0) return -1;
+
+	/*
+	 *	Trailing whitespace produces an empty argument
+	 */
+	while ((argc > 0) && !*argv[argc - 1]) argc--;
+	if (argc == 0) goto empty;
+
+	for (i = 0; i < argc; i++) {
+		fr_value_box_t	*group, *vb;
+
+		MEM(group = fr_value_box_alloc(ctx, FR_TYPE_GROUP, NULL, false));
+		MEM(vb = fr_value_box_alloc_null(group));
+		if (fr_value_box_strdup(vb, vb, NULL, argv[i], false) < 0) return -1;
+		fr_dlist_insert_tail(&group->vb_group, vb);
+		fr_dlist_insert_tail(out, group);
+	}
+
+	return 0;
+}
+
+/** Log anything the helper writes to stderr
+ *
+ */
+static void exec_helper_stderr(fr_event_list_t *el, int fd, UNUSED int flags, void *uctx)
+{
+	exec_helper_conn_t	*c = talloc_get_type_abort(uctx, exec_helper_conn_t);
+	fr_exec_helper_t	*helper = c->helper;
+	char			buff[1024];
+	char			*p, *end, *nl;
+	ssize_t			len;
+
+	len = read(fd, buff, sizeof(buff));
+	if (len == 0) {
+		(void) fr_event_fd_delete(el, fd, FR_EVENT_FILTER_IO);
+		return;
+	}
+	if (len < 0) {
+		if ((errno == EINTR) || (errno == EAGAIN) || (errno == EWOULDBLOCK)) return;
+
+		ERROR("Failed reading stderr from helper pid %u: %s", c->pid, fr_syserror(errno));
+		(void) fr_event_fd_delete(el, fd, FR_EVENT_FILTER_IO);
+		return;
+	}
+
+	for (p = buff, end = buff + len; p < end; p = nl + 1) {
+		nl = memchr(p, '\n', end - p);
+		if (!nl) nl = end;
+		if (nl > p) WARN("pid %u (stderr) - %pV", c->pid, fr_box_strvalue_len(p, nl - p));
+	}
+}
+
+/** Stop the helper, and free any frames it didn't respond to
+ *
+ */
+static int _exec_helper_conn_free(exec_helper_conn_t *c)
+{
+	fr_exec_helper_t	*helper = c->helper;
+	fr_exec_helper_sent_t	*sent;
+
+	if (c->stderr_fd >= 0) {
+		(void) fr_event_fd_delete(c->el, c->stderr_fd, FR_EVENT_FILTER_IO);
+		close(c->stderr_fd);
+	}
+
+	/*
+	 *	Closing stdin tells well behaved helpers to exit.
+	 */
+	if (c->stdin_fd >= 0) close(c->stdin_fd);
+	if (c->stdout_fd >= 0) close(c->stdout_fd);
+
+	if (c->pid > 0) {
+		kill(c->pid, SIGTERM);
+		if (fr_event_pid_reap(c->el, c->pid, NULL, NULL) < 0) {
+			PERROR("Failed setting up async reaper for helper pid %u", c->pid);
+		}
+	}
+
+	while ((sent = fr_dlist_pop_head(&c->sent))) {
+		if (sent->hreq) sent->hreq->sent = NULL;
+		talloc_free(sent);
+	}
+
+	return 0;
+}
+
+/** Start a helper
+ *
+ */
+static fr_connection_state_t _exec_helper_conn_init(void **h_out, fr_connection_t *conn, void *uctx)
+{
+	fr_exec_helper_t	*helper = talloc_get_type_abort(uctx, fr_exec_helper_t);
+	exec_helper_conn_t	*c;
+
+	MEM(c = talloc_zero(conn, exec_helper_conn_t));
+	c->helper = helper;
+	c->el = conn->el;
+	c->pid = -1;
+	c->stdin_fd = c->stdout_fd = c->stderr_fd = -1;
+	fr_dlist_init(&c->sent, fr_exec_helper_sent_t, entry);
+	talloc_set_destructor(c, _exec_helper_conn_free);
+
+	if (fr_exec_fork_wait(&c->pid, &c->stdin_fd, &c->stdout_fd, &c->stderr_fd,
+			      NULL, &helper->args, NULL, false, helper->conf->env_inherit) < 0) {
+		PERROR("Failed starting helper");
+	error:
+		talloc_free(c);
+		return FR_CONNECTION_STATE_FAILED;
+	}
+
+	if (fr_event_fd_insert(c, c->el, c->stderr_fd, exec_helper_stderr, NULL, NULL, c) < 0) {
+		PERROR("Failed inserting stderr event for helper pid %u", c->pid);
+		goto error;
+	}
+
+	DEBUG2("Started helper pid %u", c->pid);
+
+	*h_out = c;
+
+	/*
+	 *	The helper can be written to immediately,
+	 *	anything we write is buffered until it's
+	 *	ready to read it.
+	 */
+	fr_connection_signal_connected(conn);
+
+	return FR_CONNECTION_STATE_CONNECTING;
+}
+
+static void _exec_helper_conn_close(fr_event_list_t *el, void *h, UNUSED void *uctx)
+{
+	exec_helper_conn_t	*c = talloc_get_type_abort(h, exec_helper_conn_t);
+
+	(void) fr_event_fd_delete(el, c->stdin_fd, FR_EVENT_FILTER_IO);
+	(void) fr_event_fd_delete(el, c->stdout_fd, FR_EVENT_FILTER_IO);
+
+	talloc_free(c);
+}
+
+static fr_connection_t *exec_helper_trunk_connection_alloc(fr_trunk_connection_t *tconn, fr_event_list_t *el,
+							   fr_connection_conf_t const *conf,
+							   char const *log_prefix, void *uctx)
+{
+	return fr_connection_alloc(tconn, el,
+				   &(fr_connection_funcs_t){
+					.init = _exec_helper_conn_init,
+					.close = _exec_helper_conn_close
+				   },
+				   conf, log_prefix, uctx);
+}
+
+static void exec_helper_conn_readable(UNUSED fr_event_list_t *el, UNUSED int fd, UNUSED int flags, void *uctx)
+{
+	fr_trunk_connection_t	*tconn = talloc_get_type_abort(uctx, fr_trunk_connection_t);
+
+	fr_trunk_connection_signal_readable(tconn);
+}
+
+static void exec_helper_conn_writable(UNUSED fr_event_list_t *el, UNUSED int fd, UNUSED int flags, void *uctx)
+{
+	fr_trunk_connection_t	*tconn = talloc_get_type_abort(uctx, fr_trunk_connection_t);
+
+	fr_trunk_connection_signal_writable(tconn);
+}
+
+static void exec_helper_conn_error(UNUSED fr_event_list_t *el, UNUSED int fd, UNUSED int flags, int fd_errno, void *uctx)
+{
+	fr_trunk_connection_t	*tconn = talloc_get_type_abort(uctx, fr_trunk_connection_t);
+	exec_helper_conn_t	*c = talloc_get_type_abort(tconn->conn->h, exec_helper_conn_t);
+	fr_exec_helper_t	*helper = c->helper;
+
+	ERROR("Pipe to helper pid %u failed: %s", c->pid, fr_syserror(fd_errno));
+
+	fr_connection_signal_reconnect(tconn->conn, FR_CONNECTION_FAILED);
+}
+
+/** Watch the helper's stdin and stdout, as the trunk requires
+ *
+ */
+static void exec_helper_trunk_connection_notify(fr_trunk_connection_t *tconn, fr_connection_t *conn,
+						fr_event_list_t *el,
+						fr_trunk_connection_event_t notify_on, UNUSED void *uctx)
+{
+	exec_helper_conn_t	*c = talloc_get_type_abort(conn->h, exec_helper_conn_t);
+	fr_exec_helper_t	*helper = c->helper;
+	bool			read = false, write = false;
+
+	switch (notify_on) {
+	case FR_TRUNK_CONN_EVENT_NONE:
+		break;
+
+	case FR_TRUNK_CONN_EVENT_READ:
+		read = true;
+		break;
+
+	case FR_TRUNK_CONN_EVENT_WRITE:
+		write = true;
+		break;
+
+	case FR_TRUNK_CONN_EVENT_BOTH:
+		read = write = true;
+		break;
+	}
+
+	if (!read) {
+		(void) fr_event_fd_delete(el, c->stdout_fd, FR_EVENT_FILTER_IO);
+	} else if (fr_event_fd_insert(c, el, c->stdout_fd, exec_helper_conn_readable, NULL,
+				      exec_helper_conn_error, tconn) < 0) {
+		goto error;
+	}
+
+	if (!write) {
+		(void) fr_event_fd_delete(el, c->stdin_fd, FR_EVENT_FILTER_IO);
+	} else if (fr_event_fd_insert(c, el, c->stdin_fd, NULL, exec_helper_conn_writable,
+				      exec_helper_conn_error, tconn) < 0) {
+	error:
+		PERROR("Failed inserting events for helper pid %u", c->pid);
+		fr_trunk_connection_signal_reconnect(tconn, FR_CONNECTION_FAILED);
+	}
+}
+
+/** Fail the request the helper was processing when it stopped
+ *
+ * Any other requests it was sent are requeued when the helper is
+ * restarted.  The oldest is failed instead, so a request which hangs,
+ * or crashes helpers isn't passed to each of them in turn.
+ */
+static void exec_helper_fail_oldest(exec_helper_conn_t *c)
+{
+	fr_exec_helper_sent_t	*sent = fr_dlist_head(&c->sent);
+
+	if (!sent || (sent == c->partial) || !sent->hreq || !sent->hreq->treq) return;
+
+	fr_trunk_request_signal_fail(sent->hreq->treq);
+}
+
+/** Restart a helper which has stopped responding
+ *
+ */
+static void exec_helper_timeout(UNUSED fr_event_list_t *el, UNUSED fr_time_t now, void *uctx)
+{
+	fr_connection_t		*conn = talloc_get_type_abort(uctx, fr_connection_t);
+	exec_helper_conn_t	*c = talloc_get_type_abort(conn->h, exec_helper_conn_t);
+	fr_exec_helper_t	*helper = c->helper;
+
+	ERROR("Helper pid %u didn't respond within %pVs, restarting it",
+	      c->pid, fr_box_time_delta(helper->conf->timeout));
+
+	exec_helper_fail_oldest(c);
+	fr_connection_signal_reconnect(conn, FR_CONNECTION_FAILED);
+}
+
+/** (Re)arm the timeout for the oldest frame which has been completely written
+ *
+ */
+static void exec_helper_timeout_arm(fr_connection_t *conn, exec_helper_conn_t *c)
+{
+	fr_exec_helper_t	*helper = c->helper;
+	fr_exec_helper_sent_t	*sent = fr_dlist_head(&c->sent);
+
+	if (!sent || (sent == c->partial)) {
+		if (c->ev) fr_event_timer_delete(&c->ev);
+		return;
+	}
+
+	if (fr_event_timer_at(c, c->el, &c->ev, fr_time_add(sent->when, helper->conf->timeout),
+			      exec_helper_timeout, conn) < 0) {
+		PERROR("Failed inserting timeout for helper pid %u", c->pid);
+	}
+}
+
+/** Write as much of a frame as the pipe will take
+ *
+ * @return
+ *	- 1 if the frame was completely written.
+ *	- 0 if the pipe is full.
+ *	- -1 on error.
+ */
+static int exec_helper_write(exec_helper_conn_t *c, fr_exec_helper_sent_t *sent)
+{
+	ssize_t	len;
+
+	while (sent->written < sent->data_len) {
+		len = write(c->stdin_fd, sent->data + sent->written, sent->data_len - sent->written);
+		if (len < 0) {
+			if (errno == EINTR) continue;
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) return 0;
+			return -1;
+		}
+		sent->written += len;
+	}
+
+	sent->when = fr_time();
+
+	return 1;
+}
+
+/** Write pending requests to the helper
+ *
+ */
+static void exec_helper_trunk_request_mux(UNUSED fr_event_list_t *el, fr_trunk_connection_t *tconn,
+					  fr_connection_t *conn, UNUSED void *uctx)
+{
+	exec_helper_conn_t		*c = talloc_get_type_abort(conn->h, exec_helper_conn_t);
+	fr_exec_helper_t		*helper = c->helper;
+	fr_trunk_request_t		*treq;
+	fr_exec_helper_request_t	*hreq;
+	fr_exec_helper_sent_t		*sent;
+
+	/*
+	 *	Finish the frame we were part way through,
+	 *	whether or not its request is still around.
+	 */
+	if (c->partial) {
+		sent = c->partial;
+
+		switch (exec_helper_write(c, sent)) {
+		case 0:
+			return;
+
+		case 1:
+			break;
+
+		default:
+		error:
+			ERROR("Failed writing to helper pid %u: %s", c->pid, fr_syserror(errno));
+			fr_connection_signal_reconnect(conn, FR_CONNECTION_FAILED);
+			return;
+		}
+
+		c->partial = NULL;
+		if (sent->hreq) fr_trunk_request_signal_sent(sent->hreq->treq);
+		exec_helper_timeout_arm(conn, c);
+	}
+
+	while (fr_trunk_connection_pop_request(&treq, tconn) == 0) {
+		if (!treq) break;
+
+		hreq = talloc_get_type_abort(treq->pub.preq, fr_exec_helper_request_t);
+
+		MEM(sent = talloc_zero(c, fr_exec_helper_sent_t));
+		MEM(sent->data = talloc_memdup(sent, hreq->data, hreq->data_len));
+		sent->data_len = hreq->data_len;
+		sent->hreq = hreq;
+		hreq->sent = sent;
+		fr_dlist_insert_tail(&c->sent, sent);
+
+		switch (exec_helper_write(c, sent)) {
+		case 0:
+			c->partial = sent;
+			fr_trunk_request_signal_partial(treq);
+			return;
+
+		case 1:
+			break;
+
+		default:
+			goto error;
+		}
+
+		fr_trunk_request_signal_sent(treq);
+		if (!c->ev) exec_helper_timeout_arm(conn, c);
+	}
+}
+
+/** Complete the oldest outstanding request with a response
+ *
+ */
+static int exec_helper_response(fr_connection_t *conn, exec_helper_conn_t *c, char const *reply, size_t reply_len)
+{
+	fr_exec_helper_t		*helper = c->helper;
+	fr_exec_helper_request_t	*hreq;
+	fr_exec_helper_sent_t		*sent;
+
+	sent = fr_dlist_head(&c->sent);
+	if (!sent || (sent == c->partial)) {
+		ERROR("Helper pid %u responded to a request it hasn't been sent", c->pid);
+		return -1;
+	}
+	fr_dlist_remove(&c->sent, sent);
+
+	hreq = sent->hreq;
+	talloc_free(sent);
+
+	exec_helper_timeout_arm(conn, c);
+
+	/*
+	 *	The request was cancelled whilst the
+	 *	helper was processing it.
+	 */
+	if (!hreq) return 0;
+
+	hreq->sent = NULL;
+	hreq->done = true;
+	MEM(hreq->reply = talloc_bstrndup(hreq, reply, reply_len));
+	hreq->reply_len = reply_len;
+
+	unlang_interpret_mark_runnable(hreq->request);
+	fr_trunk_request_signal_complete(hreq->treq);
+
+	return 0;
+}
+
+/** Read responses from the helper
+ *
+ */
+static void exec_helper_trunk_request_demux(UNUSED fr_event_list_t *el, UNUSED fr_trunk_connection_t *tconn,
+					    fr_connection_t *conn, UNUSED void *uctx)
+{
+	exec_helper_conn_t	*c = talloc_get_type_abort(conn->h, exec_helper_conn_t);
+	fr_exec_helper_t	*helper = c->helper;
+	size_t			size = (size_t)helper->conf->max_response + 2;
+	ssize_t			len;
+	char			*line, *nl;
+
+	if (!c->buff) MEM(c->buff = talloc_array(c, char, size));
+
+	for (;;) {
+		if (c->used == size) {
+			ERROR("Response from helper pid %u exceeds max_response (%u bytes)",
+			      c->pid, helper->conf->max_response);
+		error:
+			fr_connection_signal_reconnect(conn, FR_CONNECTION_FAILED);
+			return;
+		}
+
+		len = read(c->stdout_fd, c->buff + c->used, size - c->used);
+		if (len < 0) {
+			if (errno == EINTR) continue;
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) return;
+
+			ERROR("Failed reading from helper pid %u: %s", c->pid, fr_syserror(errno));
+			goto error;
+		}
+		if (len == 0) {
+			ERROR("Helper pid %u exited", c->pid);
+			exec_helper_fail_oldest(c);
+			goto error;
+		}
+		c->used += len;
+
+		/*
+		 *	Look for lines containing only ".",
+		 *	which terminate responses.
+		 */
+		while ((nl = memchr(c->buff + c->scanned, '\n', c->used - c->scanned))) {
+			line = c->buff + c->scanned;
+			c->scanned = (nl - c->buff) + 1;
+
+			if ((nl > line) && (nl[-1] == '\r')) nl--;
+			if (((nl - line) != 1) || (*line != '.')) continue;
+
+			if (exec_helper_response(conn, c, c->buff, line - c->buff) < 0) goto error;
+
+			c->used -= c->scanned;
+			memmove(c->buff, c->buff + c->scanned, c->used);
+			c->scanned = 0;
+		}
+	}
+}
+
+/** Detach a frame from a request which is leaving the helper
+ *
+ * The helper may still respond to it, so the frame is kept until
+ * it does, or until the helper is restarted.
+ */
+static void exec_helper_trunk_request_conn_release(UNUSED fr_connection_t *conn, void *preq_to_reset,
+						   UNUSED void *uctx)
+{
+	fr_exec_helper_request_t	*hreq = talloc_get_type_abort(preq_to_reset, fr_exec_helper_request_t);
+
+	if (!hreq->sent) return;
+
+	hreq->sent->hreq = NULL;
+	hreq->sent = NULL;
+}
+
+static void exec_helper_trunk_request_fail(request_t *request, void *preq, UNUSED void *rctx,
+					   UNUSED fr_trunk_request_state_t state, UNUSED void *uctx)
+{
+	fr_exec_helper_request_t	*hreq = talloc_get_type_abort(preq, fr_exec_helper_request_t);
+
+	hreq->done = false;
+	unlang_interpret_mark_runnable(request);
+}
+
+static void exec_helper_trunk_request_free(UNUSED request_t *request, void *preq_to_free, UNUSED void *uctx)
+{
+	fr_exec_helper_request_t	*hreq = talloc_get_type_abort(preq_to_free, fr_exec_helper_request_t);
+
+	/*
+	 *	The request belongs to the caller,
+	 *	it's freed with the frame.
+	 */
+	hreq->treq = NULL;
+}
+
+/** Allocate a pool of helpers for a thread
+ *
+ * @param[in] ctx		to allocate the pool in.  Helpers are stopped when it's freed.
+ * @param[in] el		the thread's event list.
+ * @param[in] conf		helper configuration.  Must remain valid for the lifetime
+ *				of the pool.
+ * @param[in] log_prefix	prefix for log messages.
+ * @return
+ *	- A new pool of helpers.
+ *	- NULL on error.
+ */
+fr_exec_helper_t *fr_exec_helper_alloc(TALLOC_CTX *ctx, fr_event_list_t *el,
+				       fr_exec_helper_conf_t const *conf, char const *log_prefix)
+{
+	fr_exec_helper_t	*helper;
+
+	MEM(helper = talloc_zero(ctx, fr_exec_helper_t));
+	helper->conf = conf;
+	MEM(helper->log_prefix = talloc_strdup(helper, log_prefix));
+
+	if (exec_helper_args(helper, &helper->args, conf->program) < 0) {
+		PERROR("Invalid helper program");
+	error:
+		talloc_free(helper);
+		return NULL;
+	}
+
+	helper->trunk = fr_trunk_alloc(helper, el,
+				       &(fr_trunk_io_funcs_t){
+					       .connection_alloc = exec_helper_trunk_connection_alloc,
+					       .connection_notify = exec_helper_trunk_connection_notify,
+					       .request_mux = exec_helper_trunk_request_mux,
+					       .request_demux = exec_helper_trunk_request_demux,
+					       .request_conn_release = exec_helper_trunk_request_conn_release,
+					       .request_fail = exec_helper_trunk_request_fail,
+					       .request_free = exec_helper_trunk_request_free
+				       },
+				       &conf->trunk_conf, helper->log_prefix, helper, false);
+	if (!helper->trunk) goto error;
+
+	return helper;
+}
+
+/** Queue a request for a helper
+ *
+ * The caller should yield, and examine the request when resumed.
+ * If fr_exec_helper_request_t.done is false, no response was received.
+ *
+ * @param[out] out		Where to write the helper request.  Allocated in
+ *				the current frame's talloc ctx.
+ * @param[in] helper		pool of helpers.
+ * @param[in] request		the current request.
+ * @param[in] data		zero or more lines to send, each terminated by '\\n'.
+ *				The terminating "." line is added here.
+ * @param[in] data_len		length of data.
+ * @return
+ *	- 0 if the request was queued.
+ *	- -1 on failure.
+ */
+int fr_exec_helper_enqueue(fr_exec_helper_request_t **out, fr_exec_helper_t *helper,
+			   request_t *request, char const *data, size_t data_len)
+{
+	fr_exec_helper_request_t	*hreq;
+
+	MEM(hreq = talloc_zero(unlang_interpret_frame_talloc_ctx(request), fr_exec_helper_request_t));
+	hreq->request = request;
+
+	MEM(hreq->data = talloc_array(hreq, char, data_len + 2));
+	memcpy(hreq->data, data, data_len);
+	hreq->data[data_len] = '.';
+	hreq->data[data_len + 1] = '\n';
+	hreq->data_len = data_len + 2;
+
+	switch (fr_trunk_request_enqueue(&hreq->treq, helper->trunk, request, hreq, NULL)) {
+	case FR_TRUNK_ENQUEUE_OK:
+	case FR_TRUNK_ENQUEUE_IN_BACKLOG:
+		break;
+
+	default:
+		REDEBUG("Unable to queue request for helper");
+		talloc_free(hreq);
+		return -1;
+	}
+
+	*out = hreq;
+
+	return 0;
+}
+
+/** Stop waiting for a helper to respond
+ *
+ */
+void fr_exec_helper_cancel(fr_exec_helper_request_t *hreq)
+{
+	if (hreq->treq) fr_trunk_request_signal_cancel(hreq->treq);
+}
@@ -0,0 +1,86 @@
+#pragma once
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @file lib/server/exec_helper.h
+ * @brief Persistent helper processes, speaking a line based protocol over pipes.
+ *
+ * @copyright 2022 The FreeRADIUS server project
+ */
+RCSIDH(exec_helper_h, "$Id$")
+
+#include <freeradius-devel/server/cf_parse.h>
+#include <freeradius-devel/server/request.h>
+#include <freeradius-devel/server/trunk.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Configuration for a pool of helpers
+ *
+ */
+typedef struct {
+	char const		*program;	//!< Helper to run, and its arguments, separated by whitespace.
+						///< Arguments may be quoted.
+	bool			env_inherit;	//!< Run the helper with the server's environment.
+	fr_time_delta_t		timeout;	//!< How long a helper has to respond before it's restarted.
+	uint32_t		max_response;	//!< Largest response we'll accept from a helper.
+	fr_trunk_conf_t		trunk_conf;	//!< How many helpers to run, how many requests each may
+						///< have outstanding, and when they're recycled.
+} fr_exec_helper_conf_t;
+
+extern CONF_PARSER const fr_exec_helper_config[];
+
+typedef struct fr_exec_helper_s fr_exec_helper_t;
+typedef struct fr_exec_helper_sent_s fr_exec_helper_sent_t;
+
+/** A request being processed by a helper
+ *
+ * Used as the trunk's preq.  It's allocated in the request's frame
+ * context, and outlives the trunk request, so the response can be
+ * examined when the request is resumed.
+ */
+typedef struct {
+	request_t		*request;	//!< Request waiting on the response.
+	fr_trunk_request_t	*treq;		//!< Trunk request, NULL once complete or failed.
+	fr_exec_helper_sent_t	*sent;		//!< Frame written to a helper.
+
+	char			*data;		//!< Lines to send, each terminated by '\\n'.
+	size_t			data_len;	//!< Length of the lines to send.
+
+	bool			done;		//!< A helper responded.
+	char			*reply;		//!< Lines the helper responded with, excluding the
+						///< terminating "." line.
+	size_t			reply_len;	//!< Length of the reply.
+} fr_exec_helper_request_t;
+
+fr_exec_helper_t	*fr_exec_helper_alloc(TALLOC_CTX *ctx, fr_event_list_t *el,
+					      fr_exec_helper_conf_t const *conf, char const *log_prefix)
+					      CC_HINT(nonnull);
+
+int			fr_exec_helper_enqueue(fr_exec_helper_request_t **out, fr_exec_helper_t *helper,
+					       request_t *request, char const *data, size_t data_len)
+					       CC_HINT(nonnull);
+
+void			fr_exec_helper_cancel(fr_exec_helper_request_t *hreq) CC_HINT(nonnull);
+
+#ifdef __cplusplus
+}
+#endif
@@ -14,6 +14,7 @@ SOURCES	:= \
 	dependency.c \
 	dl_module.c \
 	exec.c \
+	exec_helper.c \
 	exec_legacy.c \
 	exfile.c \
 	log.c \
@@ -66,7 +67,7 @@ LOG_ID_LIB	:= 1
 # different pieces of this library
 $(call DEFINE_LOG_ID_SECTION,config,	1,cf_file.c cf_parse.c cf_util.c)
 $(call DEFINE_LOG_ID_SECTION,conditions,2,conf_eval.c cond_tokenize.c)
-$(call DEFINE_LOG_ID_SECTION,exec,	3,exec.c exec_legacy.c)
+$(call DEFINE_LOG_ID_SECTION,exec,	3,exec.c exec_helper.c exec_legacy.c)
 $(call DEFINE_LOG_ID_SECTION,modules,	4,dl_module.c module.c method.c)
 $(call DEFINE_LOG_ID_SECTION,map,	5,map.c map_proc.c map_async.c)
 $(call DEFINE_LOG_ID_SECTION,snmp,	6,snmp.c)
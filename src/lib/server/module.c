@@ -239,6 +239,14 @@ static fr_cmd_table_t cmd_table[] = {
 		.read_only = false,
 	},
 
+	{
+		.parent = "stats",
+		.name = "module",
+		.help = "Statistics for modules.",
+		.tab_expand = module_name_tab_expand,
+		.read_only = true,
+	},
+
 
 	CMD_TABLE_END
 };
@@ -45,6 +45,7 @@ typedef struct {
  * Allows use of %{n} expansions.
  *
  * @note If preg was runtime-compiled, it will be consumed and *preg will be set to NULL.
+ * @note If preg came from the regex cache, a reference will be taken and *preg left as is.
  * @note regmatch will be consumed and *regmatch will be set to NULL.
  * @note Their lifetimes will be bound to the match request data.
  *
@@ -82,10 +83,14 @@ void regex_sub_to_request(request_t *request, regex_t **preg, fr_regmatch_t **re
 	MEM(new_rc = talloc(request, fr_regcapture_t));
 
 	/*
-	 *	Steal runtime pregs, leave precompiled ones
+	 *	Steal runtime pregs, leave precompiled ones, and
+	 *	take a reference to cached ones so they survive
+	 *	eviction from the cache.
 	 */
 #if defined(HAVE_REGEX_PCRE) || defined(HAVE_REGEX_PCRE2)
-	if (!(*preg)->precompiled) {
+	if ((*preg)->cached) {
+		MEM(new_rc->preg = talloc_reference(new_rc, *preg));
+	} else if (!(*preg)->precompiled) {
 		new_rc->preg = talloc_steal(new_rc, *preg);
 		*preg = NULL;
 	} else {
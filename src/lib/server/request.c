@@ -397,10 +397,10 @@ static inline CC_HINT(always_inline) request_t *request_alloc_pool(TALLOC_CTX *c
 	 */
 	MEM(request = talloc_pooled_object(ctx, request_t,
 					   1 + 					/* Stack pool */
-					   UNLANG_STACK_MAX + 			/* Stack Frames */
+					   UNLANG_STACK_POOL_FRAMES + 		/* Stack Frames */
 					   2 + 					/* packets */
 					   10,					/* extra */
-					   (UNLANG_FRAME_PRE_ALLOC * UNLANG_STACK_MAX) +	/* Stack memory */
+					   (UNLANG_FRAME_PRE_ALLOC * UNLANG_STACK_POOL_FRAMES) +	/* Stack memory */
 					   (sizeof(fr_pair_t) * 5) +		/* pair lists and root*/
 					   (sizeof(fr_radius_packet_t) * 2) +	/* packets */
 					   128					/* extra */
@@ -54,16 +54,38 @@ RCSID("$Id$")
 
 #include <freeradius-devel/util/debug.h>
 #include <freeradius-devel/util/dlist.h>
+#include <freeradius-devel/util/hash.h>
 #include <freeradius-devel/util/md5.h>
 #include <freeradius-devel/util/misc.h>
 #include <freeradius-devel/util/rand.h>
+#include <freeradius-devel/util/stdatomic.h>
+
+#define STATE_SHARD_BITS	(4)				//!< How many bits of the hash select a shard.
+#define STATE_SHARDS		(1 << STATE_SHARD_BITS)		//!< Number of shards in a state tree.
+
+typedef struct fr_state_shard_s fr_state_shard_t;
+
+/** Worker ID to encode in state values created by this thread, plus one
+ */
+static _Thread_local uint8_t state_worker;
+
+/** Thread safe state trees
+ *
+ * Used to move the entries held by a worker to the shared shards
+ * when it exits.
+ */
+static fr_dlist_head_t	state_trees;
+static bool		state_trees_init;
+static pthread_mutex_t	state_trees_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 /** Holds a state value, and associated fr_pair_ts and data
  *
  */
 typedef struct {
 	uint64_t		id;				//!< State number within state heap.
-	fr_rb_node_t		node;				//!< Entry in the state rbtree.
+	uint32_t		hash;				//!< Hash of the state value.
+	fr_state_shard_t	*shard;				//!< Shard the entry is in, NULL if it isn't
+								///< in one.
 	union {
 		/** Server ID components
 		 *
@@ -88,7 +110,10 @@ typedef struct {
 								//!< to all virtual servers.
 
 			uint8_t		vx_0;			//!< Random component.
-			uint8_t		r_5;			//!< Random component.
+			uint8_t		worker;			//!< ID of the worker which created the state
+								//!< value, plus one.  Zero if unknown.  Used
+								//!< to route the next round of a session
+								//!< to the same worker.
 			uint8_t		vx_1;			//!< Random component.
 			uint8_t		r_6;			//!< Random component.
 
@@ -142,31 +167,121 @@ typedef struct {
 	request_t		*thawed;			//!< The request that thawed this entry.
 } state_child_entry_t;
 
+/** A subset of the state entries, with its own lock
+ *
+ * Entries are assigned to a shard using the top bits of the hash of
+ * their state value, so concurrent requests for different sessions
+ * rarely contend for the same lock.
+ *
+ * Each worker also has a local shard for the sessions it created.
+ * The network thread sends the next round of those sessions back to
+ * the same worker, so the local shard is never locked.
+ */
+struct fr_state_shard_s {
+	fr_hash_table_t		*ht;				//!< Hash table used to lookup state values.
+	fr_dlist_head_t		to_expire;			//!< Linked list of entries to free, ordered
+								///< by cleanup time.
+	pthread_mutex_t		mutex;				//!< Synchronisation mutex.
+
+	uint64_t		locked;				//!< How many times the shard has been locked.
+	uint64_t		contended;			//!< How many times the lock was already held.
+
+	bool			local;				//!< Only used by the worker which created it,
+								///< so isn't locked.
+};
+
 struct fr_state_tree_s {
-	uint64_t		id;				//!< Next ID to assign.
-	uint64_t		timed_out;			//!< Number of states that were cleaned up due to
+	atomic_uint_fast64_t	id;				//!< Next ID to assign.
+	atomic_uint_fast64_t	timed_out;			//!< Number of states that were cleaned up due to
 								//!< timeout.
 	uint32_t		max_sessions;			//!< Maximum number of sessions we track.
-	uint32_t		used_sessions;			//!< How many sessions are currently in progress.
-	fr_rb_tree_t		*tree;				//!< rbtree used to lookup state value.
-	fr_dlist_head_t		to_expire;			//!< Linked list of entries to free.
+	atomic_uint_fast32_t	used_sessions;			//!< How many sessions are currently in progress.
+
+	fr_state_shard_t	shard[STATE_SHARDS];		//!< Shards holding the state entries.
+
+	fr_state_shard_t	*local[UINT8_MAX];		//!< Per-worker shards, indexed by worker ID.
+	atomic_uint_fast32_t	local_tracked;			//!< Entries in the per-worker shards.
 
 	fr_time_delta_t		timeout;			//!< How long to wait before cleaning up state entires.
 
-	bool			thread_safe;			//!< Whether we lock the tree whilst modifying it.
-	pthread_mutex_t		mutex;				//!< Synchronisation mutex.
+	bool			thread_safe;			//!< Whether we lock the shards whilst modifying them.
 
 	uint8_t			server_id;			//!< ID to use for load balancing.
 	uint32_t		context_id;			//!< ID binding state values to a context such
 								///< as a virtual server.
 
 	fr_dict_attr_t const	*da;				//!< State attribute used.
+
+	fr_dlist_t		entry;				//!< Entry in the list of thread safe trees.
 };
 
-#define PTHREAD_MUTEX_LOCK if (state->thread_safe) pthread_mutex_lock
-#define PTHREAD_MUTEX_UNLOCK if (state->thread_safe) pthread_mutex_unlock
+static void state_entry_unlink(fr_state_entry_t *entry);
+
+/** Lock a shard, recording whether we had to wait for it
+ *
+ */
+static inline CC_HINT(always_inline)
+void state_shard_lock(fr_state_tree_t *state, fr_state_shard_t *shard)
+{
+	if (shard->local) return;
+
+	if (state->thread_safe && (pthread_mutex_trylock(&shard->mutex) != 0)) {
+		pthread_mutex_lock(&shard->mutex);
+		shard->contended++;
+	}
+	shard->locked++;
+}
+
+/** Unlock a shard
+ *
+ */
+static inline CC_HINT(always_inline)
+void state_shard_unlock(fr_state_tree_t *state, fr_state_shard_t *shard)
+{
+	if (state->thread_safe && !shard->local) pthread_mutex_unlock(&shard->mutex);
+}
+
+/** Return the ID of the worker which created a state value, plus one
+ *
+ * @return
+ *	- 0 if the value wasn't created by this server, or the worker isn't known.
+ *	- The worker ID plus one.
+ */
+static inline CC_HINT(always_inline)
+uint8_t state_comp_worker(struct state_comp const *comp)
+{
+	uint32_t version = HEXIFY(RADIUSD_VERSION);
+
+	/*
+	 *	Check it's a state value we generated.
+	 */
+	if ((comp->vx_0 != (comp->r_0 ^ ((version >> 16) & 0xff))) ||
+	    (comp->vx_1 != (comp->r_0 ^ ((version >> 8) & 0xff))) ||
+	    (comp->vx_2 != (comp->r_0 ^ (version & 0xff)))) return 0;
+
+	return comp->worker;
+}
+
+/** Return the shard an entry belongs in
+ *
+ */
+static inline CC_HINT(always_inline)
+fr_state_shard_t *state_shard(fr_state_tree_t *state, fr_state_entry_t *entry)
+{
+	entry->hash = fr_hash(entry->state, sizeof(entry->state));
+
+	return &state->shard[entry->hash >> (32 - STATE_SHARD_BITS)];
+}
+
+/** Return the hash of an entry's state value
+ *
+ */
+static uint32_t state_entry_hash(void const *data)
+{
+	fr_state_entry_t const *entry = data;
 
-static void state_entry_unlink(fr_state_tree_t *state, fr_state_entry_t *entry);
+	return entry->hash;
+}
 
 /** Compare two fr_state_entry_t based on their state value i.e. the value of the attribute
  *
@@ -180,27 +295,91 @@ static int8_t state_entry_cmp(void const *one, void const *two)
 	return CMP(ret, 0);
 }
 
+/** Return this worker's local shard, if an entry belongs in it
+ *
+ * Entries belong in the local shard if their state value was created
+ * by this worker.
+ *
+ * @param[in] state	tree the entry belongs to.
+ * @param[in] entry	to find the local shard for.
+ * @param[in] create	the local shard if this worker doesn't have one yet.
+ * @return
+ *	- The local shard.
+ *	- NULL if the entry belongs in a shared shard.
+ */
+static fr_state_shard_t *state_shard_local(fr_state_tree_t *state, fr_state_entry_t *entry, bool create)
+{
+	fr_state_shard_t *shard;
+
+	if (!state->thread_safe || !state_worker || (state_comp_worker(&entry->state_comp) != state_worker)) return NULL;
+
+	shard = state->local[state_worker - 1];
+	if (shard || !create) return shard;
+
+	/*
+	 *	Not parented by the tree, as other workers
+	 *	may be allocating their shards at the same time.
+	 */
+	MEM(shard = talloc_zero(NULL, fr_state_shard_t));
+	shard->local = true;
+	fr_dlist_talloc_init(&shard->to_expire, fr_state_entry_t, free_entry);
+	MEM(shard->ht = fr_hash_table_talloc_alloc(shard, fr_state_entry_t,
+						   state_entry_hash, state_entry_cmp, NULL));
+
+	state->local[state_worker - 1] = shard;
+
+	return shard;
+}
+
 /** Free the state tree
  *
  */
 static int _state_tree_free(fr_state_tree_t *state)
 {
-	fr_state_entry_t *entry;
-
-	if (state->thread_safe) pthread_mutex_destroy(&state->mutex);
+	fr_state_entry_t	*entry;
+	size_t			i;
 
 	DEBUG4("Freeing state tree %p", state);
 
-	while ((entry = fr_dlist_head(&state->to_expire))) {
-		DEBUG4("Freeing state entry %p (%"PRIu64")", entry, entry->id);
-		state_entry_unlink(state, entry);
-		talloc_free(entry);
+	if (fr_dlist_entry_in_list(&state->entry)) {
+		pthread_mutex_lock(&state_trees_mutex);
+		fr_dlist_remove(&state_trees, state);
+		pthread_mutex_unlock(&state_trees_mutex);
 	}
 
 	/*
-	 *	Free the rbtree
+	 *	Any workers which used the tree have exited
 	 */
-	talloc_free(state->tree);
+	for (i = 0; i < NUM_ELEMENTS(state->local); i++) {
+		fr_state_shard_t *shard = state->local[i];
+
+		if (!shard) continue;
+
+		while ((entry = fr_dlist_head(&shard->to_expire))) {
+			state_entry_unlink(entry);
+			talloc_free(entry);
+		}
+		talloc_free(shard);
+	}
+
+	for (i = 0; i < NUM_ELEMENTS(state->shard); i++) {
+		fr_state_shard_t *shard = &state->shard[i];
+
+		if (!shard->ht) continue;	/* Partially initialised */
+
+		while ((entry = fr_dlist_head(&shard->to_expire))) {
+			DEBUG4("Freeing state entry %p (%"PRIu64")", entry, entry->id);
+			state_entry_unlink(entry);
+			talloc_free(entry);
+		}
+
+		/*
+		 *	Free the hash table
+		 */
+		talloc_free(shard->ht);
+
+		if (state->thread_safe) pthread_mutex_destroy(&shard->mutex);
+	}
 
 	return 0;
 }
@@ -224,6 +403,7 @@ fr_state_tree_t *fr_state_tree_init(TALLOC_CTX *ctx, fr_dict_attr_t const *da, b
 				    uint8_t server_id, uint32_t context_id)
 {
 	fr_state_tree_t *state;
+	size_t		i;
 
 	state = talloc_zero(NULL, fr_state_tree_t);
 	if (!state) return 0;
@@ -240,51 +420,158 @@ fr_state_tree_t *fr_state_tree_init(TALLOC_CTX *ctx, fr_dict_attr_t const *da, b
 	 */
 	talloc_link_ctx(ctx, state);
 
-	if (thread_safe && (pthread_mutex_init(&state->mutex, NULL) != 0)) {
-		talloc_free(state);
-		return NULL;
-	}
+	state->thread_safe = thread_safe;
+	talloc_set_destructor(state, _state_tree_free);
 
-	fr_dlist_talloc_init(&state->to_expire, fr_state_entry_t, free_entry);
+	for (i = 0; i < NUM_ELEMENTS(state->shard); i++) {
+		fr_state_shard_t *shard = &state->shard[i];
 
-	/*
-	 *	We need to do controlled freeing of the
-	 *	rbtree, so that all the state entries
-	 *	are freed before it's destroyed.  Hence
-	 *	it being parented from the NULL ctx.
-	 */
-	state->tree = fr_rb_inline_talloc_alloc(NULL, fr_state_entry_t, node, state_entry_cmp, NULL);
-	if (!state->tree) {
-		talloc_free(state);
-		return NULL;
+		if (thread_safe && (pthread_mutex_init(&shard->mutex, NULL) != 0)) {
+		error:
+			talloc_free(state);
+			return NULL;
+		}
+
+		fr_dlist_talloc_init(&shard->to_expire, fr_state_entry_t, free_entry);
+
+		/*
+		 *	We need to do controlled freeing of the
+		 *	hash tables, so that all the state entries
+		 *	are freed before they're destroyed.  Hence
+		 *	them being parented from the NULL ctx.
+		 */
+		shard->ht = fr_hash_table_talloc_alloc(NULL, fr_state_entry_t, state_entry_hash, state_entry_cmp, NULL);
+		if (!shard->ht) {
+			if (thread_safe) pthread_mutex_destroy(&shard->mutex);
+			goto error;
+		}
 	}
-	talloc_set_destructor(state, _state_tree_free);
 
 	state->da = da;		/* Remember which attribute we use to load/store state */
 	state->server_id = server_id;
 	state->context_id = context_id;
-	state->thread_safe = thread_safe;
+
+	/*
+	 *	Workers may hold entries in local shards, which
+	 *	need to be found when they exit.
+	 */
+	if (thread_safe) {
+		pthread_mutex_lock(&state_trees_mutex);
+		if (!state_trees_init) {
+			fr_dlist_init(&state_trees, fr_state_tree_t, entry);
+			state_trees_init = true;
+		}
+		fr_dlist_insert_tail(&state_trees, state);
+		pthread_mutex_unlock(&state_trees_mutex);
+	}
 
 	return state;
 }
 
-/** Unlink an entry and remove if from the tree
+/** Unlink an entry and remove if from its shard
  *
+ * @note Called with the shard's mutex held, unless it's a local shard.
  */
 static inline CC_HINT(always_inline)
-void state_entry_unlink(fr_state_tree_t *state, fr_state_entry_t *entry)
+void state_entry_unlink(fr_state_entry_t *entry)
 {
+	fr_state_shard_t *shard;
+
 	/*
 	 *	Check the memory is still valid
 	 */
 	(void) talloc_get_type_abort(entry, fr_state_entry_t);
 
-	fr_dlist_remove(&state->to_expire, entry);
-	fr_rb_delete(state->tree, entry);
+	shard = entry->shard;
+	fr_dlist_remove(&shard->to_expire, entry);
+	fr_hash_table_remove(shard->ht, entry);
+	entry->shard = NULL;
+
+	if (shard->local) atomic_fetch_sub_explicit(&entry->state_tree->local_tracked, 1, memory_order_relaxed);
 
 	DEBUG4("State ID %" PRIu64 " unlinked", entry->id);
 }
 
+/** Move expired entries from a shard to a list of entries to free
+ *
+ * @note Called with the shard's mutex held.
+ */
+static uint64_t state_shard_expire(fr_state_shard_t *shard, fr_dlist_head_t *to_free, fr_time_t now)
+{
+	fr_state_entry_t	*entry, *next;
+	uint64_t		timed_out = 0;
+
+	for (entry = fr_dlist_head(&shard->to_expire);
+	     entry != NULL;
+	     entry = next) {
+ 		(void)talloc_get_type_abort(entry, fr_state_entry_t);	/* Allow examination */
+		next = fr_dlist_next(&shard->to_expire, entry);		/* Advance *before* potential unlinking */
+
+		/*
+		 *	The list is ordered by cleanup time, so
+		 *	everything after this is newer.
+		 */
+		if (!fr_time_lt(entry->cleanup, now)) break;
+
+		state_entry_unlink(entry);
+		fr_dlist_insert_tail(to_free, entry);
+		timed_out++;
+	}
+
+	return timed_out;
+}
+
+/** Free entries which were removed from the shards
+ *
+ * We do it outside of the mutex as freeing may involve significantly more
+ * work than just freeing the data.
+ *
+ * If there's request data that was persisted it will now be freed also,
+ * and it may have complex destructors associated with it.
+ */
+static void state_entries_free(fr_dlist_head_t *to_free)
+{
+	fr_state_entry_t *entry;
+
+	while ((entry = fr_dlist_head(to_free)) != NULL) {
+		fr_dlist_remove(to_free, entry);
+		talloc_free(entry);
+	}
+}
+
+/** Clean up expired entries in all shards
+ *
+ */
+static uint64_t state_expire(fr_state_tree_t *state, fr_time_t now)
+{
+	fr_dlist_head_t	to_free;
+	uint64_t	timed_out = 0;
+	size_t		i;
+
+	fr_dlist_init(&to_free, fr_state_entry_t, free_entry);
+
+	for (i = 0; i < NUM_ELEMENTS(state->shard); i++) {
+		fr_state_shard_t *shard = &state->shard[i];
+
+		state_shard_lock(state, shard);
+		timed_out += state_shard_expire(shard, &to_free, now);
+		state_shard_unlock(state, shard);
+	}
+
+	/*
+	 *	Only our own local shard can be cleaned up here.
+	 *	Other workers clean up theirs as they insert entries.
+	 */
+	if (state->thread_safe && state_worker && state->local[state_worker - 1]) {
+		timed_out += state_shard_expire(state->local[state_worker - 1], &to_free, now);
+	}
+
+	atomic_fetch_add_explicit(&state->timed_out, timed_out, memory_order_relaxed);
+	state_entries_free(&to_free);
+
+	return timed_out;
+}
+
 /** Frees any data associated with a state
  *
  */
@@ -320,14 +607,26 @@ static int _state_entry_free(fr_state_entry_t *entry)
 
 	DEBUG4("State ID %" PRIu64 " freed", entry->id);
 
-	entry->state_tree->used_sessions--;
+	atomic_fetch_sub_explicit(&entry->state_tree->used_sessions, 1, memory_order_relaxed);
 
 	return 0;
 }
 
+/** Reserve a session for a new entry, if we're not at max_sessions
+ *
+ */
+static inline CC_HINT(always_inline)
+bool state_session_reserve(fr_state_tree_t *state)
+{
+	if (atomic_fetch_add_explicit(&state->used_sessions, 1, memory_order_relaxed) < state->max_sessions) return true;
+
+	atomic_fetch_sub_explicit(&state->used_sessions, 1, memory_order_relaxed);
+	return false;
+}
+
 /** Create a new state entry
  *
- * @note Called with the mutex held.
+ * The entry isn't added to a shard until #state_entry_insert is called.
  */
 static fr_state_entry_t *state_entry_create(fr_state_tree_t *state, request_t *request,
 					    fr_pair_list_t *reply_list, fr_state_entry_t *old)
@@ -336,88 +635,41 @@ static fr_state_entry_t *state_entry_create(fr_state_tree_t *state, request_t *r
 	uint32_t		x;
 	fr_time_t		now = fr_time();
 	fr_pair_t		*vp;
-	fr_state_entry_t	*entry, *next;
+	fr_state_entry_t	*entry;
 
 	uint8_t			old_state[sizeof(old->state)];
 	int			old_tries = 0;
-	uint64_t		timed_out = 0;
-	bool			too_many = false;
-	fr_dlist_head_t		to_free;
 
 	/*
 	 *	Shouldn't be in any lists if it's being reused
 	 */
 	fr_assert(!old ||
-		  (!fr_dlist_entry_in_list(&old->expire_entry) &&
-		   !fr_rb_node_inline_in_tree(&old->node)));
-
-	fr_dlist_init(&to_free, fr_state_entry_t, free_entry);
-
-	/*
-	 *	Clean up expired entries
-	 */
-	for (entry = fr_dlist_head(&state->to_expire);
-	     entry != NULL;
-	     entry = next) {
- 		(void)talloc_get_type_abort(entry, fr_state_entry_t);	/* Allow examination */
-		next = fr_dlist_next(&state->to_expire, entry);		/* Advance *before* potential unlinking */
-
-		if (entry == old) continue;
+		  (!fr_dlist_entry_in_list(&old->expire_entry) && !old->shard));
 
+	if (!old) {
 		/*
-		 *	Too old, we can delete it.
+		 *	Expired entries are normally cleaned up as new
+		 *	entries are inserted into their shard.  If we're
+		 *	at the limit, clean up all the shards before
+		 *	giving up.
 		 */
-		if (fr_time_lt(entry->cleanup, now)) {
-			state_entry_unlink(state, entry);
-			fr_dlist_insert_tail(&to_free, entry);
-			timed_out++;
-			continue;
-		}
+		if (!state_session_reserve(state)) {
+			uint64_t timed_out;
 
-		break;
-	}
+			timed_out = state_expire(state, now);
+			if (timed_out > 0) RWDEBUG("Cleaning up %"PRIu64" timed out state entries", timed_out);
 
-	state->timed_out += timed_out;
-
-	if (!old) {
-		too_many = (state->used_sessions == (uint32_t) state->max_sessions);
-		if (!too_many) state->used_sessions++;	/* preemptively increment whilst we hold the mutex */
+			if (!state_session_reserve(state)) {
+				RERROR("Failed inserting state entry - At maximum ongoing session limit (%u)",
+				       state->max_sessions);
+				return NULL;
+			}
+		}
 	} else {
 		old_tries = old->tries;
 		memcpy(old_state, old->state, sizeof(old_state));
 	}
 
-	PTHREAD_MUTEX_UNLOCK(&state->mutex);
-
-	if (timed_out > 0) RWDEBUG("Cleaning up %"PRIu64" timed out state entries", timed_out);
-
-	/*
-	 *	Now free the unlinked entries.
-	 *
-	 *	We do it here as freeing may involve significantly more
-	 *	work than just freeing the data.
-	 *
-	 *	If there's request data that was persisted it will now
-	 *	be freed also, and it may have complex destructors associated
-	 *	with it.
-	 */
-	while ((entry = fr_dlist_head(&to_free)) != NULL) {
-		fr_dlist_remove(&to_free, entry);
-		talloc_free(entry);
-	}
-
-	/*
-	 *	Have to do this post-cleanup, else we end up returning with
-	 *	a list full of entries to free with none of them being
-	 *	freed which is bad...
-	 */
-	if (too_many) {
-		RERROR("Failed inserting state entry - At maximum ongoing session limit (%u)",
-		       state->max_sessions);
-		PTHREAD_MUTEX_LOCK(&state->mutex);	/* Caller expects this to be locked */
-		return NULL;
-	}
-
 	/*
 	 *	Allocation doesn't need to occur inside the critical region
 	 *	and would add significantly to contention.
@@ -435,13 +687,19 @@ static fr_state_entry_t *state_entry_create(fr_state_tree_t *state, request_t *r
 		talloc_free_children(old);
 		memset(old, 0, sizeof(*old));
 		entry = old;
+
+		/*
+		 *	The entry is still in use, so undo the
+		 *	decrement _state_entry_free did.
+		 */
+		atomic_fetch_add_explicit(&state->used_sessions, 1, memory_order_relaxed);
 	}
 
 	entry->state_tree = state;
 
 	request_data_list_init(&entry->data);
 
-	entry->id = state->id++;
+	entry->id = atomic_fetch_add_explicit(&state->id, 1, memory_order_relaxed);
 
 	/*
 	 *	Limit the lifetime of this entry based on how long the
@@ -520,6 +778,12 @@ static fr_state_entry_t *state_entry_create(fr_state_tree_t *state, request_t *r
 		 */
 		entry->state_comp.server_id = state->server_id;
 
+		/*
+		 *	Record which worker holds the session, so
+		 *	the next round can be sent to it.
+		 */
+		entry->state_comp.worker = state_worker;
+
 		MEM(vp = fr_pair_afrom_da(request->reply_ctx, state->da));
 		fr_pair_value_memdup(vp, entry->state, sizeof(entry->state), false);
 		fr_pair_append(reply_list, vp);
@@ -529,8 +793,6 @@ static fr_state_entry_t *state_entry_create(fr_state_tree_t *state, request_t *r
 	       entry->id, fr_box_octets(entry->state, sizeof(entry->state)),
 	       fr_box_time_delta(fr_time_sub(entry->cleanup, now)));
 
-	PTHREAD_MUTEX_LOCK(&state->mutex);
-
 	/*
 	 *	XOR the server hash with four bytes of random data.
 	 *	We XOR is again before resolving, to ensure state lookups
@@ -539,28 +801,69 @@ static fr_state_entry_t *state_entry_create(fr_state_tree_t *state, request_t *r
 	 */
 	*((uint32_t *)(&entry->state_comp.context_id)) ^= state->context_id;
 
-	if (!fr_rb_insert(state->tree, entry)) {
-		RERROR("Failed inserting state entry - Insertion into state tree failed");
-		fr_pair_delete_by_da(reply_list, state->da);
-		talloc_free(entry);
-		return NULL;
+	return entry;
+}
+
+/** Insert a state entry into its shard
+ *
+ * Entries with state values created by this worker go into its local
+ * shard, others go into a shared shard.  Expired entries in the same
+ * shard are cleaned up at the same time.
+ *
+ * @return
+ *	- 0 on success.
+ *	- -1 if an entry with the same state value already exists.
+ */
+static int state_entry_insert(fr_state_tree_t *state, request_t *request, fr_state_entry_t *entry)
+{
+	fr_state_shard_t	*shard = state_shard(state, entry), *local;
+	fr_dlist_head_t		to_free;
+	uint64_t		timed_out;
+	int			ret = 0;
+
+	local = state_shard_local(state, entry, true);
+	if (local) shard = local;
+
+	fr_dlist_init(&to_free, fr_state_entry_t, free_entry);
+
+	state_shard_lock(state, shard);
+
+	timed_out = state_shard_expire(shard, &to_free, fr_time());
+
+	if (!fr_hash_table_insert(shard->ht, entry)) {
+		ret = -1;
+	} else {
+		entry->shard = shard;
+
+		/*
+		 *	Link it to the end of the list, which is implicitely
+		 *	ordered by cleanup time.
+		 */
+		fr_dlist_insert_tail(&shard->to_expire, entry);
+
+		if (shard->local) atomic_fetch_add_explicit(&state->local_tracked, 1, memory_order_relaxed);
 	}
 
-	/*
-	 *	Link it to the end of the list, which is implicitely
-	 *	ordered by cleanup time.
-	 */
-	fr_dlist_insert_tail(&state->to_expire, entry);
+	state_shard_unlock(state, shard);
 
-	return entry;
+	if (timed_out > 0) {
+		atomic_fetch_add_explicit(&state->timed_out, timed_out, memory_order_relaxed);
+		RWDEBUG("Cleaning up %"PRIu64" timed out state entries", timed_out);
+	}
+	state_entries_free(&to_free);
+
+	if (ret < 0) RERROR("Failed inserting state entry - Insertion into state tree failed");
+
+	return ret;
 }
 
-/** Find the entry based on the State attribute and remove it from the state tree
+/** Find the entry based on the State attribute and remove it from its shard
  *
  */
 static fr_state_entry_t *state_entry_find_and_unlink(fr_state_tree_t *state, fr_value_box_t const *vb)
 {
-	fr_state_entry_t *entry, my_entry;
+	fr_state_entry_t	*entry, my_entry;
+	fr_state_shard_t	*shard, *local;
 
 	/*
 	 *	Assume our own State first.
@@ -589,11 +892,30 @@ static fr_state_entry_t *state_entry_find_and_unlink(fr_state_tree_t *state, fr_
 	 */
 	my_entry.state_comp.context_id ^= state->context_id;
 
-	entry = fr_rb_remove(state->tree, &my_entry);
+	shard = state_shard(state, &my_entry);
+
+	/*
+	 *	Sessions created by this worker are normally in its
+	 *	local shard.  They're only in a shared shard if a
+	 *	previous worker with the same ID exited.
+	 */
+	local = state_shard_local(state, &my_entry, false);
+	if (local) {
+		entry = fr_hash_table_find(local->ht, &my_entry);
+		if (entry) {
+			state_entry_unlink(entry);
+			return entry;
+		}
+	}
+
+	state_shard_lock(state, shard);
+	entry = fr_hash_table_remove(shard->ht, &my_entry);
 	if (entry) {
 		(void) talloc_get_type_abort(entry, fr_state_entry_t);
-		fr_dlist_remove(&state->to_expire, entry);
+		fr_dlist_remove(&shard->to_expire, entry);
+		entry->shard = NULL;
 	}
+	state_shard_unlock(state, shard);
 
 	return entry;
 }
@@ -609,13 +931,8 @@ void fr_state_discard(fr_state_tree_t *state, request_t *request)
 	vp = fr_pair_find_by_da_idx(&request->request_pairs, state->da, 0);
 	if (!vp) return;
 
-	PTHREAD_MUTEX_LOCK(&state->mutex);
 	entry = state_entry_find_and_unlink(state, &vp->data);
-	if (!entry) {
-		PTHREAD_MUTEX_UNLOCK(&state->mutex);
-		return;
-	}
-	PTHREAD_MUTEX_UNLOCK(&state->mutex);
+	if (!entry) return;
 
 	/*
 	 *	If fr_state_to_request was never called, this ensures
@@ -673,19 +990,15 @@ int fr_state_to_request(fr_state_tree_t *state, request_t *request)
 		return 1;
 	}
 
-	PTHREAD_MUTEX_LOCK(&state->mutex);
 	entry = state_entry_find_and_unlink(state, &vp->data);
 	if (!entry) {
-		PTHREAD_MUTEX_UNLOCK(&state->mutex);
 		RDEBUG2("No state entry matching &request.%pP found", vp);
 		return 2;
 	}
-   	PTHREAD_MUTEX_UNLOCK(&state->mutex);
 
 	/* Probably impossible in the current code */
 	if (unlikely(entry->thawed != NULL)) {
 		RERROR("State entry has already been thawed by a request %"PRIu64, entry->thawed->number);
-		PTHREAD_MUTEX_UNLOCK(&state->mutex);
 		return -2;
 	}
 	if (request->session_state_ctx) old_ctx = request->session_state_ctx;	/* Store for later freeing */
@@ -754,14 +1067,12 @@ int fr_request_to_state(fr_state_tree_t *state, request_t *request)
 		log_request_pair_list(L_DBG_LVL_2, request, NULL, &request->session_state_pairs, "&session-state.");
 	}
 
-	PTHREAD_MUTEX_LOCK(&state->mutex);
-
 	/*
 	 *	Reuses old if possible
 	 */
 	entry = state_entry_create(state, request, &request->reply_pairs, old);
 	if (!entry) {
-		PTHREAD_MUTEX_UNLOCK(&state->mutex);
+	error:
 		RERROR("Creating state entry failed");
 		request_data_restore(request, &data);	/* Put it back again */
 		return -1;
@@ -773,7 +1084,15 @@ int fr_request_to_state(fr_state_tree_t *state, request_t *request)
 	entry->seq_start = request->seq_start;
 	entry->ctx = request->session_state_ctx;
 	fr_dlist_move(&entry->data, &data);
-	PTHREAD_MUTEX_UNLOCK(&state->mutex);
+
+	if (state_entry_insert(state, request, entry) < 0) {
+		fr_pair_delete_by_da(&request->reply_pairs, state->da);
+
+		entry->ctx = NULL;			/* Still owned by the request */
+		fr_dlist_move(&data, &entry->data);
+		talloc_free(entry);
+		goto error;
+	}
 
 	MEM(request->session_state_ctx = fr_pair_afrom_da(NULL, request_attr_state));	/* fixme - should use a pool */
 
@@ -921,12 +1240,108 @@ void fr_state_discard_child(request_t *parent, void const *unique_ptr, int uniqu
 	talloc_free(child_entry);
 }
 
+/** Move the entries in this worker's local shards to the shared shards
+ *
+ * Once the worker has gone, the next round of its sessions can be
+ * processed by any worker.
+ */
+static void state_worker_local_move(void)
+{
+	fr_state_tree_t *state;
+
+	pthread_mutex_lock(&state_trees_mutex);
+	if (!state_trees_init) {
+		pthread_mutex_unlock(&state_trees_mutex);
+		return;
+	}
+
+	for (state = fr_dlist_head(&state_trees);
+	     state != NULL;
+	     state = fr_dlist_next(&state_trees, state)) {
+		fr_state_shard_t	*local = state->local[state_worker - 1];
+		fr_state_entry_t	*entry, *pos;
+
+		if (!local) continue;
+
+		while ((entry = fr_dlist_head(&local->to_expire))) {
+			fr_state_shard_t *shard;
+
+			state_entry_unlink(entry);
+			shard = state_shard(state, entry);
+
+			state_shard_lock(state, shard);
+			if (!fr_hash_table_insert(shard->ht, entry)) {
+				state_shard_unlock(state, shard);
+				talloc_free(entry);
+				continue;
+			}
+			entry->shard = shard;
+
+			/*
+			 *	Keep the list ordered by cleanup time.
+			 */
+			for (pos = fr_dlist_tail(&shard->to_expire);
+			     pos && fr_time_gt(pos->cleanup, entry->cleanup);
+			     pos = fr_dlist_prev(&shard->to_expire, pos));
+			fr_dlist_insert_after(&shard->to_expire, pos, entry);
+			state_shard_unlock(state, shard);
+		}
+
+		state->local[state_worker - 1] = NULL;
+		talloc_free(local);
+	}
+	pthread_mutex_unlock(&state_trees_mutex);
+}
+
+/** Set the ID of the worker running in this thread
+ *
+ * State values created by this thread will include the ID, so that
+ * the network thread can route the next round of the session back
+ * to the same worker, and the session will be kept in the worker's
+ * local shard.
+ *
+ * Sessions held by the thread's previous worker ID are moved to the
+ * shared shards, so this must be called with -1 when the worker exits.
+ *
+ * @param[in] id	of the worker, or -1 if this thread isn't a worker.
+ */
+void fr_state_worker_set(int id)
+{
+	if (state_worker) state_worker_local_move();
+
+	state_worker = ((id >= 0) && (id < UINT8_MAX)) ? (uint8_t)(id + 1) : 0;
+}
+
+/** Return the ID of the worker which created a state value
+ *
+ * @param[in] value	Raw State value from a packet.
+ * @param[in] len	Length of the State value.
+ * @return
+ *	- -1 if the state value wasn't created by this server, or doesn't
+ *	  contain a worker ID.
+ *	- The worker ID.
+ */
+int fr_state_worker(uint8_t const *value, size_t len)
+{
+	struct state_comp	comp;
+	uint8_t			worker;
+
+	if (len != sizeof(comp)) return -1;
+
+	memcpy(&comp, value, sizeof(comp));
+
+	worker = state_comp_worker(&comp);
+	if (!worker) return -1;
+
+	return worker - 1;
+}
+
 /** Return number of entries created
  *
  */
 uint64_t fr_state_entries_created(fr_state_tree_t *state)
 {
-	return state->id;
+	return atomic_load_explicit(&state->id, memory_order_relaxed);
 }
 
 /** Return number of entries that timed out
@@ -934,7 +1349,41 @@ uint64_t fr_state_entries_created(fr_state_tree_t *state)
  */
 uint64_t fr_state_entries_timeout(fr_state_tree_t *state)
 {
-	return state->timed_out;
+	return atomic_load_explicit(&state->timed_out, memory_order_relaxed);
+}
+
+/** Counters for a single shard
+ *
+ */
+typedef struct {
+	uint32_t		tracked;			//!< Entries in the shard.
+	uint64_t		locked;				//!< How many times the shard has been locked.
+	uint64_t		contended;			//!< How many times the lock was already held.
+} state_shard_stats_t;
+
+/** Read a shard's counters
+ *
+ * The counters are only modified with the shard's mutex held, so they're
+ * read with it held too.  This doesn't use state_shard_lock(), as
+ * reading the counters shouldn't change them.
+ */
+static void state_shard_stats(fr_state_tree_t *state, fr_state_shard_t *shard, state_shard_stats_t *stats)
+{
+	if (state->thread_safe) pthread_mutex_lock(&shard->mutex);
+	*stats = (state_shard_stats_t){
+		.tracked = fr_hash_table_num_elements(shard->ht),
+		.locked = shard->locked,
+		.contended = shard->contended
+	};
+	if (state->thread_safe) pthread_mutex_unlock(&shard->mutex);
+}
+
+/** Return number of entries held in workers' local shards
+ *
+ */
+uint64_t fr_state_entries_local(fr_state_tree_t *state)
+{
+	return atomic_load_explicit(&state->local_tracked, memory_order_relaxed);
 }
 
 /** Return number of entries we're currently tracking
@@ -942,5 +1391,62 @@ uint64_t fr_state_entries_timeout(fr_state_tree_t *state)
  */
 uint64_t fr_state_entries_tracked(fr_state_tree_t *state)
 {
-	return fr_rb_num_elements(state->tree);
+	state_shard_stats_t	stats;
+	uint64_t		tracked = fr_state_entries_local(state);
+	size_t			i;
+
+	for (i = 0; i < NUM_ELEMENTS(state->shard); i++) {
+		state_shard_stats(state, &state->shard[i], &stats);
+		tracked += stats.tracked;
+	}
+
+	return tracked;
 }
+
+static int cmd_stats_state(FILE *fp, UNUSED FILE *fp_err, void *ctx, fr_cmd_info_t const *info)
+{
+	fr_state_tree_t	*state = ctx;
+	size_t		i;
+
+	if ((info->argc == 0) || (strcmp(info->argv[0], "count") == 0)) {
+		fprintf(fp, "count.created\t\t\t%" PRIu64 "\n", fr_state_entries_created(state));
+		fprintf(fp, "count.timeout\t\t\t%" PRIu64 "\n", fr_state_entries_timeout(state));
+		fprintf(fp, "count.tracked\t\t\t%" PRIu64 "\n", fr_state_entries_tracked(state));
+		fprintf(fp, "count.local\t\t\t%" PRIu64 "\n", fr_state_entries_local(state));
+	}
+
+	if ((info->argc == 0) || (strcmp(info->argv[0], "shards") == 0)) {
+		for (i = 0; i < NUM_ELEMENTS(state->shard); i++) {
+			state_shard_stats_t stats;
+
+			state_shard_stats(state, &state->shard[i], &stats);
+
+			fprintf(fp, "shard.%zu.tracked\t\t%u\n", i, stats.tracked);
+			fprintf(fp, "shard.%zu.locked\t\t%" PRIu64 "\n", i, stats.locked);
+			fprintf(fp, "shard.%zu.contended\t\t%" PRIu64 "\n", i, stats.contended);
+		}
+	}
+
+	return 0;
+}
+
+fr_cmd_table_t cmd_state_table[] = {
+	{
+		.parent = "stats",
+		.name = "state",
+		.help = "Statistics for session state.",
+		.read_only = true
+	},
+
+	{
+		.parent = "stats state",
+		.add_name = true,
+		.name = "self",
+		.syntax = "[(count|shards)]",
+		.func = cmd_stats_state,
+		.help = "Show session state statistics for a virtual server.",
+		.read_only = true
+	},
+
+	CMD_TABLE_END
+};
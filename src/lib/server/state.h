@@ -31,10 +31,13 @@ extern "C" {
 #endif
 
 #include <freeradius-devel/util/dict.h>
+#include <freeradius-devel/server/command.h>
 #include <freeradius-devel/server/request.h>
 
 typedef struct fr_state_tree_s fr_state_tree_t;
 
+extern fr_cmd_table_t cmd_state_table[];
+
 fr_state_tree_t *fr_state_tree_init(TALLOC_CTX *ctx, fr_dict_attr_t const *da, bool thread_safe,
 				    uint32_t max_sessions, fr_time_delta_t timeout,
 				    uint8_t server_id, uint32_t context_id);
@@ -48,12 +51,16 @@ void	fr_state_store_in_parent(request_t *request, void const *unique_ptr, int un
 void	fr_state_restore_to_child(request_t *child, void const *unique_ptr, int unique_int);
 void	fr_state_discard_child(request_t *parent, void const *unique_ptr, int unique_int);
 
+void	fr_state_worker_set(int id);
+int	fr_state_worker(uint8_t const *value, size_t len) CC_HINT(nonnull);
+
 /*
  *	Stats
  */
 uint64_t fr_state_entries_created(fr_state_tree_t *state);
 uint64_t fr_state_entries_timeout(fr_state_tree_t *state);
 uint64_t fr_state_entries_tracked(fr_state_tree_t *state);
+uint64_t fr_state_entries_local(fr_state_tree_t *state);
 
 #ifdef __cplusplus
 }
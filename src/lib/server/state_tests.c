@@ -0,0 +1,382 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or (at
+ *   your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/** Tests for the sharded session state tree
+ *
+ * @file src/lib/server/state_tests.c
+ *
+ * @copyright 2022 The FreeRADIUS server project
+ */
+#define USE_CONSTRUCTOR
+
+/*
+ * It should be declared before include the "acutest.h"
+ */
+#ifdef USE_CONSTRUCTOR
+static void test_init(void) __attribute__((constructor));
+#else
+static void test_init(void);
+#  define TEST_INIT  test_init()
+#endif
+
+#include <freeradius-devel/util/acutest.h>
+#include <freeradius-devel/util/acutest_helpers.h>
+
+#include <freeradius-devel/util/dict_test.h>
+#include <freeradius-devel/io/listen.h>
+#include <freeradius-devel/server/pair.h>
+
+#include "state.c"
+
+#define TEST_THREADS		(4)
+#define TEST_SESSIONS		(256)		//!< Per thread.
+
+static TALLOC_CTX	*autofree;
+static fr_dict_t	*test_dict;
+
+/** Global initialisation
+ */
+static void test_init(void)
+{
+	autofree = talloc_autofree_context();
+	if (!autofree) {
+	error:
+		fr_perror("state_tests");
+		fr_exit_now(EXIT_FAILURE);
+	}
+
+	/*
+	 *	Mismatch between the binary and the libraries it depends on
+	 */
+	if (fr_check_lib_magic(RADIUSD_MAGIC_NUMBER) < 0) goto error;
+
+	if (fr_dict_test_init(autofree, &test_dict, NULL) < 0) goto error;
+
+	if (request_global_init() < 0) goto error;
+}
+
+/** Allocate a request to hold session-state
+ *
+ * This is called from multiple threads, so allocation failures
+ * are fatal rather than using TEST_CHECK.
+ */
+static request_t *request_fake_alloc(void)
+{
+	request_t	*request;
+
+	/*
+	 *	Not parented, as requests are allocated
+	 *	by multiple threads.
+	 */
+	MEM(request = request_alloc_external(NULL, NULL));
+	MEM(request->packet = fr_radius_packet_alloc(request, false));
+	MEM(request->reply = fr_radius_packet_alloc(request, false));
+	MEM(request->async = talloc_zero(request, fr_async_t));
+
+	return request;
+}
+
+/** Copy the State attribute from a reply into the next round of the session
+ *
+ */
+static request_t *request_next_alloc(fr_pair_t const *state_vp)
+{
+	request_t	*next = request_fake_alloc();
+	fr_pair_t	*vp;
+
+	MEM(vp = fr_pair_copy(next->request_ctx, state_vp));
+	fr_pair_append(&next->request_pairs, vp);
+
+	return next;
+}
+
+static fr_state_tree_t *state_fake_alloc(bool thread_safe)
+{
+	fr_state_tree_t *state;
+
+	state = fr_state_tree_init(autofree, fr_dict_attr_test_octets, thread_safe,
+				   TEST_THREADS * TEST_SESSIONS, fr_time_delta_from_sec(30), 0, 0);
+	TEST_CHECK(state != NULL);
+
+	return state;
+}
+
+/** Sum the counters for all shards
+ *
+ */
+static void state_stats_sum(state_shard_stats_t *out, fr_state_tree_t *state)
+{
+	state_shard_stats_t	stats;
+	size_t			i;
+
+	*out = (state_shard_stats_t){};
+
+	for (i = 0; i < NUM_ELEMENTS(state->shard); i++) {
+		state_shard_stats(state, &state->shard[i], &stats);
+		out->tracked += stats.tracked;
+		out->locked += stats.locked;
+		out->contended += stats.contended;
+
+		TEST_CHECK(stats.contended <= stats.locked);
+	}
+}
+
+/** Store a session, then restore and discard it, as the final round would
+ *
+ * Each session locks its shard twice, once to insert it and once to
+ * remove it.
+ *
+ * This is called from multiple threads, so it reports failures
+ * rather than using TEST_CHECK.
+ *
+ * @return
+ *	- 0 on success.
+ *	- -1 if the session wasn't restored.
+ */
+static int state_session_round_trip(fr_state_tree_t *state, uint32_t value)
+{
+	request_t	*request, *next;
+	fr_pair_t	*vp, *state_vp;
+	int		ret = -1;
+
+	request = request_fake_alloc();
+	if (pair_append_session_state(&vp, fr_dict_attr_test_uint32) < 0) goto finish;
+	vp->vp_uint32 = value;
+
+	if (fr_request_to_state(state, request) < 0) goto finish;
+
+	state_vp = fr_pair_find_by_da_idx(&request->reply_pairs, fr_dict_attr_test_octets, 0);
+	if (!state_vp) goto finish;
+
+	/*
+	 *	The next round of the session
+	 */
+	next = request_next_alloc(state_vp);
+
+	if (fr_state_to_request(state, next) == 0) {
+		vp = fr_pair_find_by_da_idx(&next->session_state_pairs, fr_dict_attr_test_uint32, 0);
+		if (vp && (vp->vp_uint32 == value)) ret = 0;
+	}
+
+	fr_state_discard(state, next);
+	talloc_free(next);
+
+finish:
+	talloc_free(request);
+
+	return ret;
+}
+
+static void test_shard_stats(void)
+{
+	fr_state_tree_t		*state = state_fake_alloc(false);
+	state_shard_stats_t	stats;
+	request_t		*request;
+	fr_pair_t		*vp;
+	unsigned int		i;
+
+	TEST_CASE("Stored sessions are tracked");
+	request = request_fake_alloc();
+	TEST_CHECK(pair_append_session_state(&vp, fr_dict_attr_test_uint32) == 0);
+	TEST_CHECK(fr_request_to_state(state, request) == 0);
+
+	state_stats_sum(&stats, state);
+	TEST_CHECK(stats.tracked == 1);
+	TEST_CHECK(fr_state_entries_tracked(state) == 1);
+	TEST_CHECK(stats.locked == 1);
+	TEST_MSG("Expected 1 lock, got %" PRIu64, stats.locked);
+	talloc_free(request);
+
+	TEST_CASE("Restored sessions are no longer tracked");
+	for (i = 0; i < TEST_SESSIONS; i++) TEST_CHECK(state_session_round_trip(state, i) == 0);
+
+	state_stats_sum(&stats, state);
+	TEST_CHECK(stats.tracked == 1);
+	TEST_CHECK(stats.locked == 1 + (TEST_SESSIONS * 2));
+	TEST_MSG("Expected %u locks, got %" PRIu64, 1 + (TEST_SESSIONS * 2), stats.locked);
+	TEST_CHECK(stats.contended == 0);
+
+	talloc_free(state);
+}
+
+typedef struct {
+	fr_state_tree_t		*state;
+	unsigned int		id;
+	bool			worker;		//!< Whether the thread should act as a worker.
+	unsigned int		failed;		//!< Sessions which weren't restored.
+} test_thread_ctx_t;
+
+static void *state_thread(void *uctx)
+{
+	test_thread_ctx_t	*ctx = uctx;
+	unsigned int		i;
+
+	if (ctx->worker) fr_state_worker_set(ctx->id);
+
+	for (i = 0; i < TEST_SESSIONS; i++) {
+		if (state_session_round_trip(ctx->state, (ctx->id * TEST_SESSIONS) + i) < 0) ctx->failed++;
+	}
+
+	if (ctx->worker) fr_state_worker_set(-1);
+
+	return NULL;
+}
+
+/** Read the counters whilst other threads are updating them
+ *
+ * Under a thread sanitizer, this will flag any counters which
+ * are read without the shard lock.
+ */
+static void test_shard_stats_threaded(void)
+{
+	fr_state_tree_t		*state = state_fake_alloc(true);
+	state_shard_stats_t	stats;
+	pthread_t		threads[TEST_THREADS];
+	test_thread_ctx_t	ctx[TEST_THREADS];
+	unsigned int		i;
+	uint64_t		prev = 0;
+
+	for (i = 0; i < TEST_THREADS; i++) {
+		ctx[i] = (test_thread_ctx_t){ .state = state, .id = i };
+		TEST_CHECK(pthread_create(&threads[i], NULL, state_thread, &ctx[i]) == 0);
+	}
+
+	/*
+	 *	Counters only ever go up
+	 */
+	for (i = 0; i < 1000; i++) {
+		state_stats_sum(&stats, state);
+		TEST_CHECK(stats.locked >= prev);
+		prev = stats.locked;
+	}
+
+	for (i = 0; i < TEST_THREADS; i++) {
+		pthread_join(threads[i], NULL);
+		TEST_CHECK(ctx[i].failed == 0);
+		TEST_MSG("Thread %u failed to restore %u sessions", i, ctx[i].failed);
+	}
+
+	state_stats_sum(&stats, state);
+	TEST_CHECK(stats.tracked == 0);
+	TEST_CHECK(stats.locked == TEST_THREADS * TEST_SESSIONS * 2);
+	TEST_MSG("Expected %u locks, got %" PRIu64, TEST_THREADS * TEST_SESSIONS * 2, stats.locked);
+
+	talloc_free(state);
+}
+
+static void test_worker_local(void)
+{
+	fr_state_tree_t		*state = state_fake_alloc(true);
+	state_shard_stats_t	stats;
+	request_t		*request, *next;
+	fr_pair_t		*vp, *state_vp;
+	uint8_t			foreign[16] = { 0 };
+
+	TEST_CASE("State values not created by a worker don't have a worker ID");
+	TEST_CHECK(fr_state_worker(foreign, sizeof(foreign)) == -1);
+	TEST_CHECK(fr_state_worker(foreign, 5) == -1);
+
+	fr_state_worker_set(0);
+
+	TEST_CASE("Sessions are held in the worker's local shard");
+	request = request_fake_alloc();
+	TEST_CHECK(pair_append_session_state(&vp, fr_dict_attr_test_uint32) == 0);
+	vp->vp_uint32 = 42;
+	TEST_CHECK(fr_request_to_state(state, request) == 0);
+
+	state_vp = fr_pair_find_by_da_idx(&request->reply_pairs, fr_dict_attr_test_octets, 0);
+	TEST_ASSERT(state_vp != NULL);
+	TEST_CHECK(fr_state_worker(state_vp->vp_octets, state_vp->vp_length) == 0);
+
+	state_stats_sum(&stats, state);
+	TEST_CHECK(stats.tracked == 0);
+	TEST_CHECK(stats.locked == 0);
+	TEST_CHECK(fr_state_entries_local(state) == 1);
+	TEST_CHECK(fr_state_entries_tracked(state) == 1);
+
+	TEST_CASE("Sessions are restored without locking a shard");
+	TEST_CHECK(state_session_round_trip(state, 1) == 0);
+
+	state_stats_sum(&stats, state);
+	TEST_CHECK(stats.locked == 0);
+	TEST_MSG("Expected 0 locks, got %" PRIu64, stats.locked);
+	TEST_CHECK(fr_state_entries_local(state) == 1);
+
+	TEST_CASE("Sessions are moved to the shared shards when the worker exits");
+	fr_state_worker_set(-1);
+
+	state_stats_sum(&stats, state);
+	TEST_CHECK(stats.tracked == 1);
+	TEST_CHECK(fr_state_entries_local(state) == 0);
+	TEST_CHECK(fr_state_entries_tracked(state) == 1);
+
+	TEST_CASE("Moved sessions can be restored by another worker");
+	fr_state_worker_set(1);
+
+	next = request_next_alloc(state_vp);
+	TEST_CHECK(fr_state_to_request(state, next) == 0);
+	vp = fr_pair_find_by_da_idx(&next->session_state_pairs, fr_dict_attr_test_uint32, 0);
+	TEST_CHECK(vp && (vp->vp_uint32 == 42));
+
+	fr_state_discard(state, next);
+	TEST_CHECK(fr_state_entries_tracked(state) == 0);
+
+	fr_state_worker_set(-1);
+
+	talloc_free(next);
+	talloc_free(request);
+	talloc_free(state);
+}
+
+/** Check workers don't lock shards for their own sessions
+ *
+ */
+static void test_worker_local_threaded(void)
+{
+	fr_state_tree_t		*state = state_fake_alloc(true);
+	state_shard_stats_t	stats;
+	pthread_t		threads[TEST_THREADS];
+	test_thread_ctx_t	ctx[TEST_THREADS];
+	unsigned int		i;
+
+	for (i = 0; i < TEST_THREADS; i++) {
+		ctx[i] = (test_thread_ctx_t){ .state = state, .id = i, .worker = true };
+		TEST_CHECK(pthread_create(&threads[i], NULL, state_thread, &ctx[i]) == 0);
+	}
+
+	for (i = 0; i < TEST_THREADS; i++) {
+		pthread_join(threads[i], NULL);
+		TEST_CHECK(ctx[i].failed == 0);
+		TEST_MSG("Thread %u failed to restore %u sessions", i, ctx[i].failed);
+	}
+
+	state_stats_sum(&stats, state);
+	TEST_CHECK(stats.tracked == 0);
+	TEST_CHECK(stats.locked == 0);
+	TEST_MSG("Expected 0 locks, got %" PRIu64, stats.locked);
+	TEST_CHECK(fr_state_entries_local(state) == 0);
+
+	talloc_free(state);
+}
+
+TEST_LIST = {
+	{ "shard_stats",		test_shard_stats },
+	{ "shard_stats_threaded",	test_shard_stats_threaded },
+	{ "worker_local",		test_worker_local },
+	{ "worker_local_threaded",	test_worker_local_threaded },
+
+	{ NULL }
+};
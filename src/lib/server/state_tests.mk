@@ -0,0 +1,12 @@
+TARGET		:= state_tests
+
+SOURCES		:= state_tests.c
+
+TGT_LDLIBS	:= $(LIBS) $(GPERFTOOLS_LIBS)
+TGT_LDFLAGS	:= $(LDFLAGS) $(GPERFTOOLS_LDFLAGS)
+
+ifneq ($(OPENSSL_LIBS),)
+TGT_PREREQS	:= libfreeradius-tls.a
+endif
+
+TGT_PREREQS	+= libfreeradius-util.la libfreeradius-server.a libfreeradius-unlang.a
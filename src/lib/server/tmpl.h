@@ -387,6 +387,20 @@ typedef enum {
 #define NUM_COUNT		(INT16_MIN + 2)
 #define NUM_LAST		(INT16_MIN + 3)
 
+/** Specialised evaluation strategies for attribute references
+ *
+ * Selected when the attribute reference is created or modified, and
+ * used at runtime to avoid the generic #tmpl_dcursor_init machinery
+ * for the most common shapes of attribute reference.
+ */
+typedef enum {
+	TMPL_ATTR_FAST_NONE = 0,			//!< Use the generic cursor.
+	TMPL_ATTR_FAST_FIRST,				//!< Single attribute in a list of the current request,
+							///< first instance.
+	TMPL_ATTR_FAST_COUNT				//!< Single attribute in a list of the current request,
+							///< count of instances.
+} tmpl_attr_fast_t;
+
 /** Define entry and head types for attribute reference lists
  *
  */
@@ -524,6 +538,12 @@ struct tmpl_s {
 
 			FR_DLIST_HEAD(tmpl_request_list)	rr;	//!< Request to search or insert in.
 			FR_DLIST_HEAD(tmpl_attr_list)		ar;	//!< Head of the attribute reference list.
+
+			tmpl_attr_fast_t	fast;		//!< Specialised evaluation strategy.
+			uint16_t		list_offset;	//!< Offset of the list's pair in the #request_t.
+								///< Only valid if fast != #TMPL_ATTR_FAST_NONE.
+			uint16_t		packet_offset;	//!< Offset of the packet which must be present
+								///< for the list to be available, or 0.
 		} attribute;
 
 		/*
@@ -693,6 +713,17 @@ static inline tmpl_pair_list_t tmpl_list(tmpl_t const *vpt)
 
 	return vpt->data.attribute.list;
 }
+
+/** Return the specialised evaluation strategy for a tmpl
+ *
+ * Any tmpl which isn't a #TMPL_TYPE_ATTR must use the generic code.
+ */
+static inline tmpl_attr_fast_t tmpl_attr_fast(tmpl_t const *vpt)
+{
+	if (!tmpl_is_attr(vpt)) return TMPL_ATTR_FAST_NONE;
+
+	return vpt->data.attribute.fast;
+}
 /** @} */
 
 /** @name Field accessors for #TMPL_TYPE_XLAT
@@ -1039,6 +1070,10 @@ int			tmpl_find_vp(fr_pair_t **out, request_t *request, tmpl_t const *vpt) CC_HI
 
 int			tmpl_find_or_add_vp(fr_pair_t **out, request_t *request, tmpl_t const *vpt) CC_HINT(nonnull);
 
+fr_pair_t		*tmpl_attr_fast_find(int *err, request_t *request, tmpl_t const *vpt) CC_HINT(nonnull(2,3));
+
+int			tmpl_attr_fast_count(uint32_t *out, request_t *request, tmpl_t const *vpt) CC_HINT(nonnull);
+
 int			tmpl_extents_find(TALLOC_CTX *ctx,
 		      			  fr_dlist_head_t *leaf, fr_dlist_head_t *interior,
 					  request_t *request, tmpl_t const *vpt) CC_HINT(nonnull(5));
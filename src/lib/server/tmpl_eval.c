@@ -917,6 +917,110 @@ done:
 }
 
 
+/** Return the list head for a tmpl with a specialised evaluation strategy
+ *
+ * Uses the offsets cached in the tmpl when it was created, instead of
+ * resolving the request and list references.
+ */
+static inline CC_HINT(always_inline)
+fr_pair_list_t *tmpl_attr_fast_list(int *err, request_t *request, tmpl_t const *vpt)
+{
+	uint8_t const	*p = (uint8_t const *)request;
+	fr_pair_t	*list;
+
+	if (vpt->rules.attr.list_as_attr) return &request->pair_root->vp_group;
+
+	if (vpt->data.attribute.packet_offset &&
+	    unlikely(!*(void * const *)(p + vpt->data.attribute.packet_offset))) {
+	not_available:
+		if (err) {
+			*err = -2;
+			fr_strerror_printf("List \"%s\" not available in this context",
+					   fr_table_str_by_value(pair_list_table, tmpl_list(vpt), "<INVALID>"));
+		}
+		return NULL;
+	}
+
+	list = *(fr_pair_t * const *)(p + vpt->data.attribute.list_offset);
+	if (unlikely(!list)) goto not_available;
+
+	return &list->vp_group;
+}
+
+/** Returns the first VP matching a tmpl with a specialised evaluation strategy
+ *
+ * Equivalent to #tmpl_find_vp, but doesn't use the generic cursor.
+ *
+ * @param[out] err	May be NULL if no error code is required.
+ *			Will be set to:
+ *			- 0 on success.
+ *			- -1 if no matching #fr_pair_t could be found.
+ *			- -2 if list could not be found (doesn't exist in current #request_t).
+ * @param[in] request	The current #request_t.
+ * @param[in] vpt	to evaluate.  Must have a #tmpl_attr_fast_t other than #TMPL_ATTR_FAST_NONE.
+ * @return
+ *	- The first matching #fr_pair_t.
+ *	- NULL if no matching #fr_pair_t was found, or on error.
+ */
+fr_pair_t *tmpl_attr_fast_find(int *err, request_t *request, tmpl_t const *vpt)
+{
+	fr_pair_list_t		*list;
+	fr_pair_t		*vp = NULL;
+	fr_dict_attr_t const	*da;
+
+	fr_assert(tmpl_attr_fast(vpt) != TMPL_ATTR_FAST_NONE);
+
+	list = tmpl_attr_fast_list(err, request, vpt);
+	if (!list) return NULL;
+
+	da = tmpl_da(vpt);
+	while ((vp = fr_pair_list_next(list, vp))) {
+		if (fr_dict_attr_cmp(da, vp->da) == 0) {
+			if (err) *err = 0;
+			return vp;
+		}
+	}
+
+	if (err) {
+		*err = -1;
+		fr_strerror_printf("No matching \"%s\" pairs found", da->name);
+	}
+
+	return NULL;
+}
+
+/** Count the VPs matching a tmpl with a specialised evaluation strategy
+ *
+ * @param[out] out	Where to write the number of matching pairs.
+ * @param[in] request	The current #request_t.
+ * @param[in] vpt	to evaluate.  Must have a #tmpl_attr_fast_t other than #TMPL_ATTR_FAST_NONE.
+ * @return
+ *	- 0 on success.
+ *	- -2 if list could not be found (doesn't exist in current #request_t).
+ */
+int tmpl_attr_fast_count(uint32_t *out, request_t *request, tmpl_t const *vpt)
+{
+	fr_pair_list_t		*list;
+	fr_pair_t		*vp = NULL;
+	fr_dict_attr_t const	*da;
+	uint32_t		count = 0;
+	int			err;
+
+	fr_assert(tmpl_attr_fast(vpt) != TMPL_ATTR_FAST_NONE);
+
+	*out = 0;
+
+	list = tmpl_attr_fast_list(&err, request, vpt);
+	if (!list) return err;
+
+	da = tmpl_da(vpt);
+	while ((vp = fr_pair_list_next(list, vp))) if (fr_dict_attr_cmp(da, vp->da) == 0) count++;
+
+	*out = count;
+
+	return 0;
+}
+
 /** Returns the first VP matching a #tmpl_t
  *
  * @param[out] out where to write the retrieved vp.
@@ -940,8 +1044,12 @@ int tmpl_find_vp(fr_pair_t **out, request_t *request, tmpl_t const *vpt)
 
 	TMPL_VERIFY(vpt);
 
-	vp = tmpl_dcursor_init(&err, request, &cc, &cursor, request, vpt);
-	tmpl_dursor_clear(&cc);
+	if (tmpl_attr_fast(vpt) != TMPL_ATTR_FAST_NONE) {
+		vp = tmpl_attr_fast_find(&err, request, vpt);
+	} else {
+		vp = tmpl_dcursor_init(&err, request, &cc, &cursor, request, vpt);
+		tmpl_dursor_clear(&cc);
+	}
 
 	if (out) *out = vp;
 
@@ -972,8 +1080,12 @@ int tmpl_find_or_add_vp(fr_pair_t **out, request_t *request, tmpl_t const *vpt)
 
 	*out = NULL;
 
-	vp = tmpl_dcursor_init(&err, NULL, &cc, &cursor, request, vpt);
-	tmpl_dursor_clear(&cc);
+	if (tmpl_attr_fast(vpt) != TMPL_ATTR_FAST_NONE) {
+		vp = tmpl_attr_fast_find(&err, request, vpt);
+	} else {
+		vp = tmpl_dcursor_init(&err, NULL, &cc, &cursor, request, vpt);
+		tmpl_dursor_clear(&cc);
+	}
 
 	switch (err) {
 	case 0:
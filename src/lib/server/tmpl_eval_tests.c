@@ -0,0 +1,292 @@
+/*
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Lesser General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2.1 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *   Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public
+ *   License along with this library; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/** Tests for the specialised attribute reference evaluation strategies
+ *
+ * @file src/lib/server/tmpl_eval_tests.c
+ *
+ * @copyright 2022 The FreeRADIUS server project
+ */
+
+/*
+ *	So we can force the generic evaluation code
+ *	for comparison.
+ */
+#define _TMPL_PRIVATE 1
+
+#define USE_CONSTRUCTOR
+
+/*
+ * It should be declared before include the "acutest.h"
+ */
+#ifdef USE_CONSTRUCTOR
+static void test_init(void) __attribute__((constructor));
+#else
+static void test_init(void);
+#  define TEST_INIT  test_init()
+#endif
+
+#include <freeradius-devel/util/acutest.h>
+#include <freeradius-devel/util/acutest_helpers.h>
+
+#include <freeradius-devel/util/dict.h>
+#include <freeradius-devel/util/dict_test.h>
+#include <freeradius-devel/util/pair.h>
+#include <freeradius-devel/util/talloc.h>
+
+#include <freeradius-devel/server/request.h>
+#include <freeradius-devel/server/tmpl.h>
+
+static TALLOC_CTX	*autofree;
+static fr_dict_t	*test_dict;
+
+/** Global initialisation
+ */
+static void test_init(void)
+{
+	autofree = talloc_autofree_context();
+	if (!autofree) {
+	error:
+		fr_perror("tmpl_eval_tests");
+		fr_exit_now(EXIT_FAILURE);
+	}
+
+	/*
+	 *	Mismatch between the binary and the libraries it depends on
+	 */
+	if (fr_check_lib_magic(RADIUSD_MAGIC_NUMBER) < 0) goto error;
+
+	if (fr_dict_test_init(autofree, &test_dict, NULL) < 0) goto error;
+
+	if (request_global_init() < 0) goto error;
+}
+
+static request_t *request_fake_alloc(void)
+{
+	request_t	*request;
+
+	request = request_local_alloc_external(autofree, NULL);
+
+	request->packet = fr_radius_packet_alloc(request, false);
+	TEST_CHECK(request->packet != NULL);
+
+	request->reply = fr_radius_packet_alloc(request, false);
+	TEST_CHECK(request->reply != NULL);
+
+	return request;
+}
+
+static tmpl_t *tmpl_fake_alloc(char const *name)
+{
+	tmpl_t		*vpt = NULL;
+	ssize_t		slen;
+
+	slen = tmpl_afrom_attr_str(autofree, NULL, &vpt, name,
+				   &(tmpl_rules_t){
+				   	.attr = {
+				   		.dict_def = test_dict,
+				   		.list_def = PAIR_LIST_REQUEST
+				   	}
+				   });
+	TEST_CHECK(slen > 0);
+	TEST_MSG("Failed parsing \"%s\": %s", name, fr_strerror());
+
+	return vpt;
+}
+
+/** Copy a tmpl, forcing it to use the generic cursor
+ *
+ */
+static tmpl_t *tmpl_generic_alloc(tmpl_t const *in)
+{
+	tmpl_t *vpt;
+
+	vpt = tmpl_copy(autofree, in);
+	TEST_CHECK(vpt != NULL);
+
+	vpt->data.attribute.fast = TMPL_ATTR_FAST_NONE;
+
+	return vpt;
+}
+
+static void test_tmpl_attr_fast_select(void)
+{
+	tmpl_t *vpt;
+
+	TEST_CASE("Single attribute, first instance");
+	vpt = tmpl_fake_alloc("&request.Test-Uint32");
+	TEST_CHECK(tmpl_attr_fast(vpt) == TMPL_ATTR_FAST_FIRST);
+
+	TEST_CASE("Single attribute, default list, explicit first instance");
+	vpt = tmpl_fake_alloc("&Test-Uint32[0]");
+	TEST_CHECK(tmpl_attr_fast(vpt) == TMPL_ATTR_FAST_FIRST);
+
+	TEST_CASE("Single attribute, count");
+	vpt = tmpl_fake_alloc("&reply.Test-Uint32[#]");
+	TEST_CHECK(tmpl_attr_fast(vpt) == TMPL_ATTR_FAST_COUNT);
+
+	TEST_CASE("Specific instance uses the generic cursor");
+	vpt = tmpl_fake_alloc("&control.Test-Uint32[1]");
+	TEST_CHECK(tmpl_attr_fast(vpt) == TMPL_ATTR_FAST_NONE);
+
+	TEST_CASE("All instances use the generic cursor");
+	vpt = tmpl_fake_alloc("&Test-Uint32[*]");
+	TEST_CHECK(tmpl_attr_fast(vpt) == TMPL_ATTR_FAST_NONE);
+
+	TEST_CASE("Other requests use the generic cursor");
+	vpt = tmpl_fake_alloc("&parent.request.Test-Uint32");
+	TEST_CHECK(tmpl_attr_fast(vpt) == TMPL_ATTR_FAST_NONE);
+
+	TEST_CASE("Lists use the generic cursor");
+	vpt = tmpl_fake_alloc("&request");
+	TEST_CHECK(tmpl_attr_fast(vpt) == TMPL_ATTR_FAST_NONE);
+
+	TEST_CASE("Changing the instance changes the strategy");
+	vpt = tmpl_fake_alloc("&request.Test-Uint32");
+	tmpl_attr_set_leaf_num(vpt, 2);
+	TEST_CHECK(tmpl_attr_fast(vpt) == TMPL_ATTR_FAST_NONE);
+	tmpl_attr_set_leaf_num(vpt, NUM_COUNT);
+	TEST_CHECK(tmpl_attr_fast(vpt) == TMPL_ATTR_FAST_COUNT);
+
+	TEST_CASE("Copies keep the strategy");
+	vpt = tmpl_copy(autofree, vpt);
+	TEST_CHECK(tmpl_attr_fast(vpt) == TMPL_ATTR_FAST_COUNT);
+}
+
+static void test_tmpl_attr_fast_find(void)
+{
+	request_t	*request = request_fake_alloc();
+	tmpl_t		*fast, *generic;
+	fr_pair_t	*vp, *first = NULL, *fast_vp, *generic_vp;
+	int		i;
+
+	for (i = 0; i < 3; i++) {
+		TEST_CHECK(fr_pair_append_by_da(request->request_ctx, &vp,
+						&request->request_pairs, fr_dict_attr_test_string) == 0);
+		TEST_CHECK(fr_pair_append_by_da(request->request_ctx, &vp,
+						&request->request_pairs, fr_dict_attr_test_uint32) == 0);
+		if (!first) first = vp;
+	}
+
+	TEST_CASE("First instance matches the generic cursor");
+	fast = tmpl_fake_alloc("&request.Test-Uint32");
+	generic = tmpl_generic_alloc(fast);
+
+	TEST_CHECK(tmpl_find_vp(&fast_vp, request, fast) == 0);
+	TEST_CHECK(tmpl_find_vp(&generic_vp, request, generic) == 0);
+	TEST_CHECK(fast_vp == first);
+	TEST_CHECK(fast_vp == generic_vp);
+
+	TEST_CASE("Missing attribute matches the generic cursor");
+	fast = tmpl_fake_alloc("&reply.Test-Uint32");
+	generic = tmpl_generic_alloc(fast);
+
+	TEST_CHECK(tmpl_find_vp(&fast_vp, request, fast) == -1);
+	TEST_CHECK(tmpl_find_vp(&generic_vp, request, generic) == -1);
+	TEST_CHECK(!fast_vp && !generic_vp);
+
+	TEST_CASE("Find or add creates the attribute in the right list");
+	TEST_CHECK(tmpl_find_or_add_vp(&fast_vp, request, fast) == 1);
+	TEST_CHECK(fast_vp && (fr_pair_list_head(&request->reply_pairs) == fast_vp));
+	TEST_CHECK(tmpl_find_or_add_vp(&generic_vp, request, generic) == 0);
+	TEST_CHECK(fast_vp == generic_vp);
+
+	TEST_CASE("Count matches the number of instances");
+	{
+		uint32_t count;
+
+		fast = tmpl_fake_alloc("&request.Test-Uint32[#]");
+		TEST_CHECK(tmpl_attr_fast_count(&count, request, fast) == 0);
+		TEST_CHECK(count == 3);
+		TEST_MSG("Expected 3, got %u", count);
+	}
+
+	TEST_CASE("Missing list is reported");
+	request->reply = NULL;
+	fast = tmpl_fake_alloc("&reply.Test-Uint32");
+	TEST_CHECK(tmpl_find_vp(&fast_vp, request, fast) == -2);
+
+	TEST_CHECK_RET(talloc_free(request), 0);
+}
+
+/** Time evaluating the same reference repeatedly
+ *
+ */
+static fr_time_delta_t tmpl_find_vp_time(request_t *request, tmpl_t const *vpt, size_t loops)
+{
+	fr_time_t	start;
+	fr_pair_t	*vp;
+	size_t		i;
+
+	start = fr_time();
+	for (i = 0; i < loops; i++) (void) tmpl_find_vp(&vp, request, vpt);
+
+	return fr_time_sub(fr_time(), start);
+}
+
+static void test_tmpl_attr_fast_speed(void)
+{
+	request_t	*request = request_fake_alloc();
+	fr_pair_t	*vp;
+	size_t		loops = 1000000;
+	int		i;
+	char const	*names[] = { "&request.Test-Uint32", "&request.Test-Uint32[#]", "&request.Test-Octets" };
+
+	/*
+	 *	Put the attribute we're looking for a little
+	 *	way into the list, as would be typical.
+	 */
+	for (i = 0; i < 10; i++) {
+		TEST_CHECK(fr_pair_append_by_da(request->request_ctx, &vp,
+						&request->request_pairs, fr_dict_attr_test_string) == 0);
+	}
+	TEST_CHECK(fr_pair_append_by_da(request->request_ctx, &vp,
+					&request->request_pairs, fr_dict_attr_test_uint32) == 0);
+
+	for (i = 0; i < (int)NUM_ELEMENTS(names); i++) {
+		tmpl_t		*fast, *generic;
+		fr_time_delta_t	fast_time, generic_time;
+
+		fast = tmpl_fake_alloc(names[i]);
+		generic = tmpl_generic_alloc(fast);
+
+		TEST_CASE(names[i]);
+
+		fast_time = tmpl_find_vp_time(request, fast, loops);
+		generic_time = tmpl_find_vp_time(request, generic, loops);
+
+		if (acutest_verbose_level_ >= 1) {
+			INFO("%s - specialised %.1f ns/ref, generic %.1f ns/ref",
+			     names[i],
+			     (double)fr_time_delta_unwrap(fast_time) / loops,
+			     (double)fr_time_delta_unwrap(generic_time) / loops);
+		}
+	}
+
+	TEST_CHECK_RET(talloc_free(request), 0);
+}
+
+TEST_LIST = {
+	{ "tmpl_attr_fast_select",	test_tmpl_attr_fast_select },
+	{ "tmpl_attr_fast_find",	test_tmpl_attr_fast_find },
+
+	/*
+	 *	Performance tests
+	 */
+	{ "Speed Test - Attribute references",	test_tmpl_attr_fast_speed },
+
+	{ NULL }
+};
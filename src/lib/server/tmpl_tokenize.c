@@ -729,6 +729,89 @@ static tmpl_attr_t *tmpl_attr_add(tmpl_t *vpt, tmpl_attr_type_t type)
 	return ar;
 }
 
+/** Determine which specialised evaluation strategy can be used for an attribute reference
+ *
+ * Only a single known attribute, in a list of the current request,
+ * can be evaluated without the generic cursor.
+ */
+static tmpl_attr_fast_t tmpl_attr_fast_select(tmpl_t const *vpt)
+{
+	tmpl_request_t const	*rr = NULL;
+	tmpl_attr_t const	*ar;
+
+	if (!tmpl_is_attr(vpt)) return TMPL_ATTR_FAST_NONE;
+
+	if (tmpl_attr_list_num_elements(&vpt->data.attribute.ar) != 1) return TMPL_ATTR_FAST_NONE;
+
+	while ((rr = tmpl_request_list_next(&vpt->data.attribute.rr, rr))) {
+		if (rr->request != REQUEST_CURRENT) return TMPL_ATTR_FAST_NONE;
+	}
+
+	switch (vpt->data.attribute.list) {
+	case PAIR_LIST_REQUEST:
+	case PAIR_LIST_REPLY:
+	case PAIR_LIST_CONTROL:
+	case PAIR_LIST_STATE:
+		break;
+
+	default:
+		return TMPL_ATTR_FAST_NONE;
+	}
+
+	ar = tmpl_attr_list_head(&vpt->data.attribute.ar);
+	if (!tmpl_attr_is_normal(ar)) return TMPL_ATTR_FAST_NONE;
+
+	switch (ar->ar_num) {
+	case NUM_ANY:
+	case 0:
+		return TMPL_ATTR_FAST_FIRST;
+
+	case NUM_COUNT:
+		return TMPL_ATTR_FAST_COUNT;
+
+	default:
+		return TMPL_ATTR_FAST_NONE;
+	}
+}
+
+/** Select a specialised evaluation strategy, and cache the location of the list head
+ *
+ * Must be called whenever the request, list, or attribute references
+ * of a tmpl are changed.
+ */
+static void tmpl_attr_fast_set(tmpl_t *vpt)
+{
+	vpt->data.attribute.fast = tmpl_attr_fast_select(vpt);
+	if (vpt->data.attribute.fast == TMPL_ATTR_FAST_NONE) return;
+
+	switch (vpt->data.attribute.list) {
+	case PAIR_LIST_REQUEST:
+		vpt->data.attribute.list_offset = offsetof(request_t, pair_list.request);
+		vpt->data.attribute.packet_offset = offsetof(request_t, packet);
+		break;
+
+	case PAIR_LIST_REPLY:
+		vpt->data.attribute.list_offset = offsetof(request_t, pair_list.reply);
+		vpt->data.attribute.packet_offset = offsetof(request_t, reply);
+		break;
+
+	case PAIR_LIST_CONTROL:
+		vpt->data.attribute.list_offset = offsetof(request_t, pair_list.control);
+		vpt->data.attribute.packet_offset = 0;
+		break;
+
+	case PAIR_LIST_STATE:
+		vpt->data.attribute.list_offset = offsetof(request_t, pair_list.state);
+		vpt->data.attribute.packet_offset = 0;
+		break;
+
+	default:
+		fr_assert(0);
+		vpt->data.attribute.fast = TMPL_ATTR_FAST_NONE;
+		break;
+	}
+}
+
 /** Create a #tmpl_t from a #fr_value_box_t
  *
  * @param[in,out] ctx	to allocate #tmpl_t in.
@@ -818,6 +901,7 @@ int tmpl_attr_copy(tmpl_t *dst, tmpl_t const *src)
 	 */
 	dst->data.attribute.list = src->data.attribute.list;
 
+	tmpl_attr_fast_set(dst);
 	TMPL_ATTR_VERIFY(dst);
 
 	return 0;
@@ -851,6 +935,7 @@ int tmpl_attr_set_da(tmpl_t *vpt, fr_dict_attr_t const *da)
 	}
 	ref->ar_parent = fr_dict_root(fr_dict_by_da(da));	/* Parent is the root of the dictionary */
 
+	tmpl_attr_fast_set(vpt);
 	TMPL_ATTR_VERIFY(vpt);
 
 	return 0;
@@ -906,6 +991,7 @@ int tmpl_attr_set_leaf_da(tmpl_t *vpt, fr_dict_attr_t const *da)
 	 */
 	ref->ar_parent = fr_dict_root(fr_dict_by_da(da));	/* Parent is the root of the dictionary */
 
+	tmpl_attr_fast_set(vpt);
 	TMPL_ATTR_VERIFY(vpt);
 
 	return 0;
@@ -925,6 +1011,7 @@ void tmpl_attr_set_leaf_num(tmpl_t *vpt, int16_t num)
 
 	ref->num = num;
 
+	tmpl_attr_fast_set(vpt);
 	TMPL_ATTR_VERIFY(vpt);
 }
 
@@ -942,6 +1029,7 @@ void tmpl_attr_rewrite_leaf_num(tmpl_t *vpt, int16_t from, int16_t to)
 	ref = tmpl_attr_list_tail(&vpt->data.attribute.ar);
 	if (ref->ar_num == from) ref->ar_num = to;
 
+	tmpl_attr_fast_set(vpt);
 	TMPL_ATTR_VERIFY(vpt);
 }
 
@@ -956,6 +1044,7 @@ void tmpl_attr_rewrite_num(tmpl_t *vpt, int16_t from, int16_t to)
 
 	while ((ref = tmpl_attr_list_next(&vpt->data.attribute.ar, ref))) if (ref->ar_num == from) ref->ar_num = to;
 
+	tmpl_attr_fast_set(vpt);
 	TMPL_ATTR_VERIFY(vpt);
 }
 
@@ -971,6 +1060,7 @@ void tmpl_attr_set_request(tmpl_t *vpt, tmpl_request_ref_t request)
 
 	tmpl_req_ref_add(vpt, request);
 
+	tmpl_attr_fast_set(vpt);
 	TMPL_ATTR_VERIFY(vpt);
 }
 
@@ -978,6 +1068,7 @@ void tmpl_attr_set_list(tmpl_t *vpt, tmpl_pair_list_t list)
 {
 	vpt->data.attribute.list = list;
 
+	tmpl_attr_fast_set(vpt);
 	TMPL_ATTR_VERIFY(vpt);
 }
 
@@ -1018,6 +1109,7 @@ int tmpl_attr_afrom_list(TALLOC_CTX *ctx, tmpl_t **out, tmpl_t const *list, fr_d
 	vpt->name = talloc_typed_strdup(vpt, attr);
 	vpt->quote = T_BARE_WORD;
 
+	tmpl_attr_fast_set(vpt);
 	TMPL_ATTR_VERIFY(vpt);
 
 	*out = vpt;
@@ -2059,6 +2151,7 @@ ssize_t tmpl_afrom_attr_substr(TALLOC_CTX *ctx, tmpl_attr_error_t *err,
 		goto error;
 	}
 
+	tmpl_attr_fast_set(vpt);
 	TMPL_VERIFY(vpt);	/* Because we want to ensure we produced something sane */
 
 	*out = vpt;
@@ -3543,6 +3636,7 @@ static inline CC_HINT(always_inline) int tmpl_attr_resolve(tmpl_t *vpt, tmpl_res
 	}
 
 	RESOLVED_SET(&vpt->type);
+	tmpl_attr_fast_set(vpt);
 	TMPL_VERIFY(vpt);
 
 	return 0;
@@ -3755,6 +3849,7 @@ static void attr_to_raw(tmpl_t *vpt, tmpl_attr_t *ref)
 		break;
 	}
 
+	tmpl_attr_fast_set(vpt);
 	TMPL_ATTR_VERIFY(vpt);
 }
 
@@ -3852,6 +3947,8 @@ int tmpl_attr_unknown_add(tmpl_t *vpt)
 		}
 	}
 
+	tmpl_attr_fast_set(vpt);
+
 	return 0;
 }
 
@@ -3908,6 +4005,7 @@ int tmpl_attr_unresolved_add(fr_dict_t *dict_def, tmpl_t *vpt,
 
 	tmpl_attr_set_da(vpt, da);
 	vpt->type = TMPL_TYPE_ATTR;
+	tmpl_attr_fast_set(vpt);
 
 	return 0;
 }
@@ -4422,6 +4520,15 @@ void tmpl_attr_verify(char const *file, int line, tmpl_t const *vpt)
 			break;
 		}
 	}
+
+	/*
+	 *	A stale evaluation strategy would produce the wrong pairs
+	 */
+	if (tmpl_attr_fast(vpt) != TMPL_ATTR_FAST_NONE) {
+		fr_fatal_assert_msg(tmpl_attr_fast(vpt) == tmpl_attr_fast_select(vpt),
+				    "CONSISTENCY CHECK FAILED %s[%u]: attr ref evaluation strategy "
+				    "does not match the attr ref list", file, line);
+	}
 }
 
 /** Verify fields of a tmpl_t make sense
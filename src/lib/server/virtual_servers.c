@@ -40,6 +40,7 @@ RCSID("$Id$")
 #include <freeradius-devel/io/application.h>
 #include <freeradius-devel/io/master.h>
 #include <freeradius-devel/io/listen.h>
+#include <freeradius-devel/io/worker.h>
 
 typedef struct {
 	dl_module_inst_t	*proto_module;		//!< The proto_* module for a listen section.
@@ -52,6 +53,8 @@ typedef struct {
 	fr_virtual_listen_t	**listener;		//!< Listeners in this virtual server.
 	dl_module_inst_t	*process_module;	//!< the process_* module for a virtual server
 	dl_module_inst_t	*dynamic_client_module;	//!< the process_* module for a dynamic client
+	uint32_t		batch_size;		//!< How many requests a worker runs before sending
+							///< their replies.
 } fr_virtual_server_t;
 
 static fr_dict_t const *dict_freeradius;
@@ -129,6 +132,8 @@ static const CONF_PARSER server_config[] = {
 	{ FR_CONF_OFFSET("namespace", FR_TYPE_STRING | FR_TYPE_REQUIRED, fr_virtual_server_t, namespace),
 			 .func = namespace_parse },
 
+	{ FR_CONF_OFFSET("batch_size", FR_TYPE_UINT32, fr_virtual_server_t, batch_size), .dflt = "0" },
+
 	{ FR_CONF_OFFSET("listen", FR_TYPE_SUBSECTION | FR_TYPE_MULTI | FR_TYPE_OK_MISSING,
 			 fr_virtual_server_t, listener),
 			 .ident2 = CF_IDENT_ANY,
@@ -465,6 +470,8 @@ static int server_parse(UNUSED TALLOC_CTX *ctx, void *out, UNUSED void *parent,
 	 */
 	if (cf_section_parse(out, server, server_cs) < 0) return -1;
 
+	FR_INTEGER_BOUND_CHECK("batch_size", server->batch_size, <=, FR_WORKER_BATCH_MAX);
+
 	/*
 	 *	And cache this struct for later referencing.
 	 */
@@ -538,6 +545,23 @@ int virtual_server_dynamic_clients_allow(CONF_SECTION *server_cs)
 	return 0;
 }
 
+/** Return how many requests a worker should run before sending their replies
+ *
+ * @param[in] server_cs	The virtual server.
+ * @return
+ *	- 0 if requests should not be batched.
+ *	- The maximum number of requests in a batch.
+ */
+uint32_t virtual_server_batch_size(CONF_SECTION *server_cs)
+{
+	CONF_DATA const *cd;
+
+	cd = cf_data_find(server_cs, fr_virtual_server_t, "vs");
+	if (!cd) return 0;
+
+	return ((fr_virtual_server_t const *) cf_data_value(cd))->batch_size;
+}
+
 /** Define a values for Auth-Type attributes by the sections present in a virtual-server
  *
  * The ident2 value of any sections found will be converted into values of the specified da.
@@ -767,6 +791,13 @@ int virtual_servers_instantiate(void)
 		return -1;
 	}
 
+#ifdef WITH_PERF
+	if (unlang_perf_command_register() < 0) {
+		PERROR("Failed registering radmin commands for unlang profiling");
+		return -1;
+	}
+#endif
+
 	for (i = 0; i < server_cnt; i++) {
 		fr_virtual_listen_t	**listener;
 		size_t			j, listen_cnt;
@@ -130,6 +130,8 @@ unlang_action_t	virtual_server_push(request_t *request, CONF_SECTION *server_cs,
 
 int		virtual_server_dynamic_clients_allow(CONF_SECTION *server_cs) CC_HINT(nonnull);
 
+uint32_t	virtual_server_batch_size(CONF_SECTION *server_cs) CC_HINT(nonnull);
+
 #ifdef __cplusplus
 }
 #endif
@@ -29,6 +29,12 @@
 #define MILENAGE_MAC_A_SIZE	8
 #define MILENAGE_MAC_S_SIZE	8
 
+/** How many vectors milenage_umts_generate_batch() processes per pass
+ *
+ * Each vector needs one block for TEMP, then four blocks for f1, f2/f5, f3 and f4.
+ */
+#define MILENAGE_BATCH_CHUNK	16
+
 static inline int aes_128_encrypt_block(EVP_CIPHER_CTX *evp_ctx,
 					uint8_t const key[16], uint8_t const in[16], uint8_t out[16])
 {
@@ -61,6 +67,25 @@ static inline int aes_128_encrypt_block(EVP_CIPHER_CTX *evp_ctx,
 	return 0;
 }
 
+/** Encrypt multiple blocks with a context that's already been keyed
+ *
+ * Passing all the blocks to OpenSSL in one call allows AES-NI and
+ * similar implementations to pipeline the blocks.
+ */
+static inline int aes_128_encrypt_blocks(EVP_CIPHER_CTX *evp_ctx,
+					 uint8_t const *in, uint8_t *out, size_t num)
+{
+	int len = 0;
+
+	if (unlikely(EVP_EncryptUpdate(evp_ctx, out, &len, in, (int)(num * 16)) != 1) ||
+	    unlikely((size_t)len != (num * 16))) {
+		fr_tls_log_strerror_printf("Failed encrypting data");
+		return -1;
+	}
+
+	return 0;
+}
+
 /** milenage_f1 - Milenage f1 and f1* algorithms
  *
  * @param[in] opc	128-bit value derived from OP and K.
@@ -315,6 +340,111 @@ int milenage_umts_generate(uint8_t autn[MILENAGE_AUTN_SIZE],
 	return 0;
 }
 
+/** Generate multiple AKA vectors for a single subscriber
+ *
+ * Produces the same output as calling milenage_umts_generate() for each
+ * vector, but the AES key schedule is only expanded once, and the blocks
+ * for each stage of the algorithm are encrypted together.
+ *
+ * @param[in,out] vectors	to populate.  rand and sqn must be set by the caller.
+ * @param[in] num		Number of vectors.
+ * @param[in] opc		128-bit operator variant algorithm configuration field (encr.).
+ * @param[in] amf		16-bit authentication management field.
+ * @param[in] ki		128-bit subscriber key.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int milenage_umts_generate_batch(milenage_vector_t *vectors, size_t num,
+				 uint8_t const opc[MILENAGE_OPC_SIZE],
+				 uint8_t const amf[MILENAGE_AMF_SIZE],
+				 uint8_t const ki[MILENAGE_KI_SIZE])
+{
+	uint8_t		temp[MILENAGE_BATCH_CHUNK][16];
+	uint8_t		in[MILENAGE_BATCH_CHUNK * 4][16];
+	uint8_t		out[MILENAGE_BATCH_CHUNK * 4][16];
+	EVP_CIPHER_CTX	*evp_ctx;
+	size_t		done, n, i, j;
+
+	evp_ctx = EVP_CIPHER_CTX_new();
+	if (!evp_ctx) {
+		fr_tls_log_strerror_printf("Failed allocating EVP context");
+		return -1;
+	}
+
+	if (unlikely(EVP_EncryptInit_ex(evp_ctx, EVP_aes_128_ecb(), NULL, ki, NULL) != 1)) {
+		fr_tls_log_strerror_printf("Failed initialising AES-128-ECB context");
+	error:
+		EVP_CIPHER_CTX_free(evp_ctx);
+		return -1;
+	}
+	EVP_CIPHER_CTX_set_padding(evp_ctx, 0);
+
+	for (done = 0; done < num; done += n) {
+		milenage_vector_t *v = vectors + done;
+
+		n = num - done;
+		if (n > MILENAGE_BATCH_CHUNK) n = MILENAGE_BATCH_CHUNK;
+
+		/* TEMP = E_K(RAND XOR OP_C) */
+		for (i = 0; i < n; i++) for (j = 0; j < 16; j++) in[i][j] = v[i].rand[j] ^ opc[j];
+		if (aes_128_encrypt_blocks(evp_ctx, in[0], temp[0], n) < 0) goto error;
+
+		for (i = 0; i < n; i++) {
+			uint8_t	*f1 = in[(i * 4)], *f25 = in[(i * 4) + 1], *f3 = in[(i * 4) + 2], *f4 = in[(i * 4) + 3];
+			uint8_t	in1[16];
+
+			/* IN1 = SQN || AMF || SQN || AMF */
+			uint48_to_buff(in1, v[i].sqn);
+			memcpy(in1 + 6, amf, 2);
+			memcpy(in1 + 8, in1, 8);
+
+			for (j = 0; j < 16; j++) {
+				uint8_t t = temp[i][j] ^ opc[j];
+
+				f1[(j + 8) % 16] = in1[j] ^ opc[j];	/* rotate by r1, c1 is NOP */
+				f25[j] = t;				/* rotate by r2 (NOP) */
+				f3[(j + 12) % 16] = t;			/* rotate by r3 */
+				f4[(j + 8) % 16] = t;			/* rotate by r4 */
+			}
+			for (j = 0; j < 16; j++) f1[j] ^= temp[i][j];
+			f25[15] ^= 1;	/* XOR c2 */
+			f3[15] ^= 2;	/* XOR c3 */
+			f4[15] ^= 4;	/* XOR c4 */
+		}
+		if (aes_128_encrypt_blocks(evp_ctx, in[0], out[0], n * 4) < 0) goto error;
+
+		for (i = 0; i < n; i++) {
+			uint8_t	*p = v[i].autn;
+			uint8_t	sqn_buff[MILENAGE_SQN_SIZE];
+
+			for (j = 0; j < 4; j++) {
+				size_t k;
+
+				for (k = 0; k < 16; k++) out[(i * 4) + j][k] ^= opc[k];
+			}
+
+			memcpy(v[i].res, out[(i * 4) + 1] + 8, MILENAGE_RES_SIZE);	/* f2 */
+			memcpy(v[i].ak, out[(i * 4) + 1], MILENAGE_AK_SIZE);		/* f5 */
+			memcpy(v[i].ck, out[(i * 4) + 2], MILENAGE_CK_SIZE);		/* f3 */
+			memcpy(v[i].ik, out[(i * 4) + 3], MILENAGE_IK_SIZE);		/* f4 */
+
+			/*
+			 *	AUTN = (SQN ^ AK) || AMF || MAC_A
+			 */
+			uint48_to_buff(sqn_buff, v[i].sqn);
+			for (j = 0; j < sizeof(sqn_buff); j++) *p++ = sqn_buff[j] ^ v[i].ak[j];
+			memcpy(p, amf, MILENAGE_AMF_SIZE);
+			p += MILENAGE_AMF_SIZE;
+			memcpy(p, out[i * 4], MILENAGE_MAC_A_SIZE);			/* f1 */
+		}
+	}
+
+	EVP_CIPHER_CTX_free(evp_ctx);
+
+	return 0;
+}
+
 /** Milenage AUTS validation
  *
  * @param[out] sqn	SQN = 48-bit sequence number (host byte order).
@@ -637,9 +767,46 @@ void test_set_19(void)
 	TEST_CHECK(memcmp(ak_resync, ak_resync, sizeof(ak_resync_out)) == 0);
 }
 
+void test_batch(void)
+{
+	uint8_t ki[]		= { 0x46, 0x5b, 0x5c, 0xe8, 0xb1, 0x99, 0xb4, 0x9f,
+				    0xaa, 0x5f, 0x0a, 0x2e, 0xe2, 0x38, 0xa6, 0xbc };
+	uint8_t amf[]		= { 0xb9, 0xb9 };
+	uint8_t opc[]		= { 0xcd, 0x63, 0xcb, 0x71, 0x95, 0x4a, 0x9f, 0x4e,
+				    0x48, 0xa5, 0x99, 0x4e, 0x37, 0xa0, 0x2b, 0xaf };
+
+	milenage_vector_t	vectors[MILENAGE_BATCH_CHUNK + 3];
+	size_t			i, j;
+
+	/*
+	 *	More than one chunk, so we test the chunk boundary
+	 */
+	for (i = 0; i < NUM_ELEMENTS(vectors); i++) {
+		for (j = 0; j < sizeof(vectors[i].rand); j++) vectors[i].rand[j] = (uint8_t)((i * 31) + j);
+		vectors[i].sqn = 0xff9bb4d0b607 + i;
+	}
+
+	TEST_CHECK(milenage_umts_generate_batch(vectors, NUM_ELEMENTS(vectors), opc, amf, ki) == 0);
+
+	for (i = 0; i < NUM_ELEMENTS(vectors); i++) {
+		uint8_t autn[MILENAGE_AUTN_SIZE], ik[MILENAGE_IK_SIZE], ck[MILENAGE_CK_SIZE];
+		uint8_t ak[MILENAGE_AK_SIZE], res[MILENAGE_RES_SIZE];
+
+		TEST_CHECK(milenage_umts_generate(autn, ik, ck, ak, res, opc, amf, ki,
+						  vectors[i].sqn, vectors[i].rand) == 0);
+		TEST_CHECK(memcmp(autn, vectors[i].autn, sizeof(autn)) == 0);
+		TEST_CHECK(memcmp(ik, vectors[i].ik, sizeof(ik)) == 0);
+		TEST_CHECK(memcmp(ck, vectors[i].ck, sizeof(ck)) == 0);
+		TEST_CHECK(memcmp(ak, vectors[i].ak, sizeof(ak)) == 0);
+		TEST_CHECK(memcmp(res, vectors[i].res, sizeof(res)) == 0);
+		TEST_MSG("Vector %zu differs", i);
+	}
+}
+
 TEST_LIST = {
 	{ "test_set_1",		test_set_1 },
 	{ "test_set_19",	test_set_19 },
+	{ "test_batch",		test_batch },
 	{ NULL }
 };
 #endif
@@ -46,6 +46,20 @@
 #define MILENAGE_SRES_SIZE	4
 #define MILENAGE_KC_SIZE	8
 
+/** A UMTS authentication vector produced by milenage_umts_generate_batch()
+ *
+ */
+typedef struct {
+	uint8_t		rand[MILENAGE_RAND_SIZE];	//!< Input - 128-bit random challenge.
+	uint64_t	sqn;				//!< Input - 48-bit sequence number (host byte order).
+
+	uint8_t		autn[MILENAGE_AUTN_SIZE];	//!< Output - Network authentication token.
+	uint8_t		ik[MILENAGE_IK_SIZE];		//!< Output - Integrity key (f4).
+	uint8_t		ck[MILENAGE_CK_SIZE];		//!< Output - Confidentiality key (f3).
+	uint8_t		ak[MILENAGE_AK_SIZE];		//!< Output - Anonymity key (f5).
+	uint8_t		res[MILENAGE_RES_SIZE];		//!< Output - Signed response (f2).
+} milenage_vector_t;
+
 int	milenage_opc_generate(uint8_t opc[MILENAGE_OPC_SIZE],
 			      uint8_t const op[MILENAGE_OP_SIZE],
 			      uint8_t const ki[MILENAGE_KI_SIZE]);
@@ -61,6 +75,11 @@ int	milenage_umts_generate(uint8_t autn[MILENAGE_AUTN_SIZE],
 			       uint64_t sqn,
 			       uint8_t const rand[MILENAGE_RAND_SIZE]);
 
+int	milenage_umts_generate_batch(milenage_vector_t *vectors, size_t num,
+				     uint8_t const opc[MILENAGE_OPC_SIZE],
+				     uint8_t const amf[MILENAGE_AMF_SIZE],
+				     uint8_t const ki[MILENAGE_KI_SIZE]);
+
 int	milenage_auts(uint64_t *sqn,
 		      uint8_t const opc[MILENAGE_OPC_SIZE],
 		      uint8_t const ki[MILENAGE_KI_SIZE],
@@ -2,6 +2,7 @@ TARGETNAME	:= libfreeradius-tls
 
 ifneq ($(OPENSSL_LIBS),)
 TARGET		:= $(TARGETNAME).a
+SUBMAKEFILES	:= bio_tests.mk cache_tests.mk session_tests.mk verify_tests.mk
 endif
 
 SOURCES	:= \
@@ -27,6 +27,8 @@ USES_APPLE_DEPRECATED_API	/* OpenSSL API has been deprecated by Apple */
 
 #ifdef WITH_TLS
 #include <freeradius-devel/util/atexit.h>
+#include <freeradius-devel/util/dlist.h>
+#include <freeradius-devel/util/stdatomic.h>
 
 #include "bio.h"
 
@@ -42,10 +44,36 @@ struct fr_tls_bio_dbuff_s {
 	bool			free_buff;	//!< Free the talloced buffer when this structure is freed.
 };
 
+/** A single fragment in a chain BIO
+ *
+ */
+typedef struct {
+	fr_dlist_t		entry;		//!< Entry in the chain.
+	uint8_t const		*data;		//!< Start of the data OpenSSL hasn't read yet.
+	size_t			len;		//!< How much data OpenSSL hasn't read yet.
+} fr_tls_bio_chain_frag_t;
+
+/** Holds the state of a scatter-gather 'read' BIO
+ *
+ * With these BIOs we're the producer, and OpenSSL is the consumer.
+ * Fragments reference the buffers they arrived in, so data is only
+ * copied once, into OpenSSL's own record buffer.
+ */
+struct fr_tls_bio_chain_s {
+	BIO			*bio;		//!< BIO OpenSSL reads from.
+	fr_dlist_head_t		frags;		//!< Fragments waiting to be read.
+	size_t			pending;	//!< Total data waiting to be read.
+	atomic_uint_fast64_t	*copied;	//!< Counter to add data copied into OpenSSL's buffers to.
+};
+
 /** Template for the thread local request log BIOs
  */
 static BIO_METHOD	*tls_bio_talloc_meth;
 
+/** Template for the fragment chain BIOs
+ */
+static BIO_METHOD	*tls_bio_chain_meth;
+
 /** Thread local aggregation BIO
  */
 static _Thread_local	fr_tls_bio_dbuff_t		*tls_bio_talloc_agg;
@@ -357,6 +385,198 @@ BIO *fr_tls_bio_dbuff_thread_local(TALLOC_CTX *ctx, size_t init, size_t max)
 	return tls_bio_talloc_agg->bio;
 }
 
+/** Serves BIO_read() from a chain of fragments
+ *
+ * Fragments are released as soon as they've been fully read.
+ *
+ * @param[in] bio	performing the read operation.
+ * @param[out] buf	to write data to.
+ * @param[in] size	of data to write (maximum).
+ * @return
+ *	- The amount of data written.
+ *	- -1 if no data is available (the retry flag is set).
+ */
+static int _tls_bio_chain_read_cb(BIO *bio, char *buf, int size)
+{
+	fr_tls_bio_chain_t	*bc = talloc_get_type_abort(BIO_get_data(bio), fr_tls_bio_chain_t);
+	fr_tls_bio_chain_frag_t	*frag;
+	size_t			copied = 0;
+
+	BIO_clear_retry_flags(bio);
+
+	if (!bc->pending) {
+		BIO_set_retry_read(bio);
+		return -1;
+	}
+
+	while ((copied < (size_t)size) && (frag = fr_dlist_head(&bc->frags))) {
+		size_t to_copy = frag->len;
+
+		if (to_copy > ((size_t)size - copied)) to_copy = (size_t)size - copied;
+
+		memcpy(buf + copied, frag->data, to_copy);
+		frag->data += to_copy;
+		frag->len -= to_copy;
+		copied += to_copy;
+
+		if (frag->len == 0) talloc_free(fr_dlist_pop_head(&bc->frags));
+	}
+	bc->pending -= copied;
+
+	if (bc->copied) atomic_fetch_add_explicit(bc->copied, copied, memory_order_relaxed);
+
+	return (int)copied;
+}
+
+/** Appends BIO_write() calls to a fragment chain
+ *
+ * Data written this way has to be copied, use #fr_tls_bio_chain_add
+ * to reference the data in place.  The copy isn't counted here, callers
+ * count what they write.
+ *
+ * @param[in] bio	that was written to.
+ * @param[in] in	data being written to BIO.
+ * @param[in] len	Length of data being written.
+ */
+static int _tls_bio_chain_write_cb(BIO *bio, char const *in, int len)
+{
+	fr_tls_bio_chain_t	*bc = talloc_get_type_abort(BIO_get_data(bio), fr_tls_bio_chain_t);
+	fr_tls_bio_chain_frag_t	*frag;
+
+	BIO_clear_retry_flags(bio);
+
+	if (len <= 0) return 0;
+
+	MEM(frag = talloc_zero(bc, fr_tls_bio_chain_frag_t));
+	MEM(frag->data = talloc_memdup(frag, in, (size_t)len));
+	frag->len = (size_t)len;
+
+	fr_dlist_insert_tail(&bc->frags, frag);
+	bc->pending += frag->len;
+
+	return len;
+}
+
+/** Answers the control requests OpenSSL makes of its read BIO
+ *
+ */
+static long _tls_bio_chain_ctrl_cb(BIO *bio, int cmd, UNUSED long num, UNUSED void *ptr)
+{
+	fr_tls_bio_chain_t	*bc = talloc_get_type_abort(BIO_get_data(bio), fr_tls_bio_chain_t);
+
+	switch (cmd) {
+	case BIO_CTRL_PENDING:
+		return (long)bc->pending;
+
+	case BIO_CTRL_RESET:
+		fr_tls_bio_chain_reset(bc);
+		return 1;
+
+	case BIO_CTRL_FLUSH:
+		return 1;
+
+	default:
+		return 0;
+	}
+}
+
+/** Frees the fragment chain when OpenSSL frees the BIO
+ *
+ */
+static int _tls_bio_chain_destroy_cb(BIO *bio)
+{
+	fr_tls_bio_chain_t	*bc = BIO_get_data(bio);
+
+	if (!bc) return 1;
+
+	BIO_set_data(bio, NULL);
+	talloc_free(bc);
+
+	return 1;
+}
+
+/** Add a fragment to the chain, without copying it
+ *
+ * A talloc reference to owner is held until OpenSSL has read the fragment,
+ * so the buffer remains valid even if the original owner is freed first.
+ *
+ * @param[in] bc	to add the fragment to.
+ * @param[in] owner	talloced chunk containing data.
+ * @param[in] data	to add.
+ * @param[in] len	of data.
+ * @return
+ *	- 0 on success.
+ *	- -1 if a reference to owner couldn't be created.
+ */
+int fr_tls_bio_chain_add(fr_tls_bio_chain_t *bc, void const *owner, uint8_t const *data, size_t len)
+{
+	fr_tls_bio_chain_frag_t	*frag;
+
+	if (len == 0) return 0;
+
+	MEM(frag = talloc_zero(bc, fr_tls_bio_chain_frag_t));
+	if (!talloc_reference(frag, owner)) {
+		fr_strerror_const("Failed referencing fragment buffer");
+		talloc_free(frag);
+		return -1;
+	}
+	frag->data = data;
+	frag->len = len;
+
+	fr_dlist_insert_tail(&bc->frags, frag);
+	bc->pending += len;
+
+	return 0;
+}
+
+/** Return how much data is waiting to be read from the chain
+ *
+ */
+size_t fr_tls_bio_chain_pending(fr_tls_bio_chain_t const *bc)
+{
+	return bc->pending;
+}
+
+/** Discard any fragments which haven't been read
+ *
+ */
+void fr_tls_bio_chain_reset(fr_tls_bio_chain_t *bc)
+{
+	fr_tls_bio_chain_frag_t	*frag;
+
+	while ((frag = fr_dlist_pop_head(&bc->frags))) talloc_free(frag);
+	bc->pending = 0;
+}
+
+/** Allocate a new scatter-gather BIO
+ *
+ * @param[out] out	Where to write a pointer to the #fr_tls_bio_chain_t.
+ *			The structure is freed when the BIO is freed. May be NULL.
+ * @param[in] copied	Counter to add the data OpenSSL reads to, as it's copied
+ *			into OpenSSL's own buffers.  May be NULL.
+ * @return
+ *	- A new BIO - Usually passed to SSL_set_bio, which takes ownership of it.
+ */
+BIO *fr_tls_bio_chain_alloc(fr_tls_bio_chain_t **out, atomic_uint_fast64_t *copied)
+{
+	fr_tls_bio_chain_t	*bc;
+
+	/*
+	 *	Lifetime is bound to the BIO, not to a talloc ctx
+	 */
+	MEM(bc = talloc_zero(NULL, fr_tls_bio_chain_t));
+	fr_dlist_talloc_init(&bc->frags, fr_tls_bio_chain_frag_t, entry);
+	bc->copied = copied;
+
+	MEM(bc->bio = BIO_new(tls_bio_chain_meth));
+	BIO_set_data(bc->bio, bc);
+	BIO_set_init(bc->bio, 1);
+
+	if (out) *out = bc;
+
+	return bc->bio;
+}
+
 /** Initialise the BIO logging meths which are used to create thread local logging BIOs
  *
  */
@@ -380,6 +600,14 @@ int fr_tls_bio_init(void)
 	BIO_meth_set_read(tls_bio_talloc_meth, _tls_bio_talloc_read_cb);
 	BIO_meth_set_gets(tls_bio_talloc_meth, _tls_bio_talloc_gets_cb);
 
+	tls_bio_chain_meth = BIO_meth_new(BIO_get_new_index() | BIO_TYPE_SOURCE_SINK, "fr_tls_bio_chain_t");
+	if (unlikely(!tls_bio_chain_meth)) return -1;
+
+	BIO_meth_set_write(tls_bio_chain_meth, _tls_bio_chain_write_cb);
+	BIO_meth_set_read(tls_bio_chain_meth, _tls_bio_chain_read_cb);
+	BIO_meth_set_ctrl(tls_bio_chain_meth, _tls_bio_chain_ctrl_cb);
+	BIO_meth_set_destroy(tls_bio_chain_meth, _tls_bio_chain_destroy_cb);
+
 	return 0;
 }
 
@@ -392,5 +620,10 @@ void fr_tls_bio_free(void)
 		BIO_meth_free(tls_bio_talloc_meth);
 		tls_bio_talloc_meth = NULL;
 	}
+
+	if (tls_bio_chain_meth) {
+		BIO_meth_free(tls_bio_chain_meth);
+		tls_bio_chain_meth = NULL;
+	}
 }
 #endif /* WITH_TLS */
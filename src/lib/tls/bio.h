@@ -29,9 +29,12 @@ RCSIDH(bio_h, "$Id$")
 
 #include <openssl/bio.h>
 #include <freeradius-devel/util/dbuff.h>
+#include <freeradius-devel/util/stdatomic.h>
 
 typedef struct fr_tls_bio_dbuff_s fr_tls_bio_dbuff_t;
 
+typedef struct fr_tls_bio_chain_s fr_tls_bio_chain_t;
+
 uint8_t		*fr_tls_bio_dbuff_finalise(fr_tls_bio_dbuff_t *bd);
 
 char		*fr_tls_bio_dbuff_finalise_bstr(fr_tls_bio_dbuff_t *bd);
@@ -53,6 +56,14 @@ void		fr_tls_bio_dbuff_thread_local_clear(void);
 
 BIO		*fr_tls_bio_dbuff_thread_local(TALLOC_CTX *ctx, size_t init, size_t max);
 
+int		fr_tls_bio_chain_add(fr_tls_bio_chain_t *bc, void const *owner, uint8_t const *data, size_t len);
+
+size_t		fr_tls_bio_chain_pending(fr_tls_bio_chain_t const *bc);
+
+void		fr_tls_bio_chain_reset(fr_tls_bio_chain_t *bc);
+
+BIO		*fr_tls_bio_chain_alloc(fr_tls_bio_chain_t **out, atomic_uint_fast64_t *copied);
+
 int		fr_tls_bio_init(void);
 
 void		fr_tls_bio_free(void);
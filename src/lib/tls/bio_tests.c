@@ -0,0 +1,205 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or (at
+ *   your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/** Tests for the scatter-gather BIO OpenSSL reads EAP-TLS fragments from
+ *
+ * @file src/lib/tls/bio_tests.c
+ *
+ * @copyright 2022 The FreeRADIUS server project
+ */
+#define USE_CONSTRUCTOR
+
+/*
+ * It should be declared before include the "acutest.h"
+ */
+#ifdef USE_CONSTRUCTOR
+static void test_init(void) __attribute__((constructor));
+#else
+static void test_init(void);
+#  define TEST_INIT  test_init()
+#endif
+
+#include <freeradius-devel/util/acutest.h>
+#include <freeradius-devel/util/acutest_helpers.h>
+
+#include <freeradius-devel/tls/base.h>
+#include <freeradius-devel/tls/bio.h>
+
+/** Global initialisation
+ */
+static void test_init(void)
+{
+	/*
+	 *	Mismatch between the binary and the libraries it depends on
+	 */
+	if (fr_check_lib_magic(RADIUSD_MAGIC_NUMBER) < 0) {
+	error:
+		fr_perror("tls_bio_tests");
+		fr_exit_now(EXIT_FAILURE);
+	}
+
+	if (fr_openssl_init() < 0) goto error;
+}
+
+/** Allocate a talloced buffer, as a fragment would arrive in
+ *
+ * Each byte is set to its offset plus start.
+ */
+static uint8_t *test_frag_alloc(TALLOC_CTX *ctx, size_t len, uint8_t start)
+{
+	uint8_t	*buff;
+	size_t	i;
+
+	MEM(buff = talloc_array(ctx, uint8_t, len));
+	for (i = 0; i < len; i++) buff[i] = (uint8_t)(start + i);
+
+	return buff;
+}
+
+static bool test_owner_freed;
+
+static int _test_owner_free(UNUSED uint8_t *buff)
+{
+	test_owner_freed = true;
+
+	return 0;
+}
+
+static void test_chain_read(void)
+{
+	TALLOC_CTX		*ctx = talloc_init_const("test");
+	fr_tls_bio_chain_t	*bc;
+	atomic_uint_fast64_t	copied = 0;
+	BIO			*bio = fr_tls_bio_chain_alloc(&bc, &copied);
+	uint8_t			*a, *b, *c, out[64];
+	size_t			i;
+
+	/*
+	 *	0..9, 10..29, 30..34
+	 */
+	a = test_frag_alloc(ctx, 10, 0);
+	b = test_frag_alloc(ctx, 20, 10);
+	c = test_frag_alloc(ctx, 5, 30);
+
+	TEST_CASE("Fragments are queued without being read");
+	TEST_CHECK(fr_tls_bio_chain_add(bc, a, a, 10) == 0);
+	TEST_CHECK(fr_tls_bio_chain_add(bc, b, b, 20) == 0);
+	TEST_CHECK(fr_tls_bio_chain_add(bc, c, c, 5) == 0);
+	TEST_CHECK(fr_tls_bio_chain_pending(bc) == 35);
+	TEST_CHECK(BIO_ctrl_pending(bio) == 35);
+	TEST_CHECK(atomic_load(&copied) == 0);
+
+	TEST_CASE("Reads span fragment boundaries");
+	TEST_CHECK(BIO_read(bio, out, 7) == 7);
+	TEST_CHECK(BIO_read(bio, out + 7, 20) == 20);
+	TEST_CHECK(BIO_read(bio, out + 27, sizeof(out) - 27) == 8);
+	for (i = 0; i < 35; i++) {
+		TEST_CHECK(out[i] == i);
+		TEST_MSG("Expected %zu at offset %zu, got %u", i, i, out[i]);
+	}
+
+	TEST_CASE("Data read by OpenSSL is counted as copied");
+	TEST_CHECK(atomic_load(&copied) == 35);
+	TEST_CHECK(fr_tls_bio_chain_pending(bc) == 0);
+
+	TEST_CASE("Reading an empty chain asks OpenSSL to retry");
+	TEST_CHECK(BIO_read(bio, out, sizeof(out)) < 0);
+	TEST_CHECK(BIO_should_retry(bio));
+	TEST_CHECK(BIO_should_read(bio));
+
+	BIO_free(bio);
+	talloc_free(ctx);
+}
+
+static void test_chain_reference(void)
+{
+	fr_tls_bio_chain_t	*bc;
+	BIO			*bio = fr_tls_bio_chain_alloc(&bc, NULL);
+	uint8_t			*owner, out[16];
+
+	owner = test_frag_alloc(NULL, sizeof(out), 0);
+	talloc_set_destructor(owner, _test_owner_free);
+	test_owner_freed = false;
+
+	TEST_CASE("Fragments outlive the buffer's original owner");
+	TEST_CHECK(fr_tls_bio_chain_add(bc, owner, owner + 4, 8) == 0);
+	talloc_free(owner);
+	TEST_CHECK(!test_owner_freed);
+
+	TEST_CHECK(BIO_read(bio, out, 4) == 4);
+	TEST_CHECK(!test_owner_freed);
+	TEST_CHECK(out[0] == 4);
+
+	TEST_CASE("Buffers are released once they've been read");
+	TEST_CHECK(BIO_read(bio, out, sizeof(out)) == 4);
+	TEST_CHECK(out[3] == 11);
+	TEST_CHECK(test_owner_freed);
+
+	TEST_CASE("Unread buffers are released when the chain is reset");
+	owner = test_frag_alloc(NULL, sizeof(out), 0);
+	talloc_set_destructor(owner, _test_owner_free);
+	test_owner_freed = false;
+
+	TEST_CHECK(fr_tls_bio_chain_add(bc, owner, owner, sizeof(out)) == 0);
+	talloc_free(owner);
+	TEST_CHECK(BIO_reset(bio) == 1);
+	TEST_CHECK(test_owner_freed);
+	TEST_CHECK(BIO_ctrl_pending(bio) == 0);
+
+	TEST_CASE("Unread buffers are released when the BIO is freed");
+	owner = test_frag_alloc(NULL, sizeof(out), 0);
+	talloc_set_destructor(owner, _test_owner_free);
+	test_owner_freed = false;
+
+	TEST_CHECK(fr_tls_bio_chain_add(bc, owner, owner, sizeof(out)) == 0);
+	talloc_free(owner);
+	BIO_free(bio);
+	TEST_CHECK(test_owner_freed);
+}
+
+static void test_chain_write(void)
+{
+	fr_tls_bio_chain_t	*bc;
+	BIO			*bio = fr_tls_bio_chain_alloc(&bc, NULL);
+	uint8_t			in[8] = { 1, 2, 3, 4, 5, 6, 7, 8 }, out[16];
+	uint8_t			*owner;
+
+	TEST_CASE("Written data is copied");
+	TEST_CHECK(BIO_write(bio, in, sizeof(in)) == sizeof(in));
+	memset(in, 0, sizeof(in));
+
+	TEST_CASE("Written and referenced data is read in order");
+	owner = test_frag_alloc(NULL, 4, 9);
+	TEST_CHECK(fr_tls_bio_chain_add(bc, owner, owner, 4) == 0);
+	TEST_CHECK(BIO_ctrl_pending(bio) == 12);
+
+	TEST_CHECK(BIO_read(bio, out, sizeof(out)) == 12);
+	TEST_CHECK(out[0] == 1);
+	TEST_CHECK(out[7] == 8);
+	TEST_CHECK(out[8] == 9);
+	TEST_CHECK(out[11] == 12);
+
+	talloc_free(owner);
+	BIO_free(bio);
+}
+
+TEST_LIST = {
+	{ "chain_read",		test_chain_read },
+	{ "chain_reference",	test_chain_reference },
+	{ "chain_write",	test_chain_write },
+
+	{ NULL }
+};
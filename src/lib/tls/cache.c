@@ -36,6 +36,10 @@ USES_APPLE_DEPRECATED_API	/* OpenSSL API has been deprecated by Apple */
 #include <freeradius-devel/unlang/subrequest.h>
 #include <freeradius-devel/unlang/interpret.h>
 #include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/dlist.h>
+#include <freeradius-devel/util/hash.h>
+#include <freeradius-devel/util/stdatomic.h>
+#include <freeradius-devel/util/syserror.h>
 
 #include "attrs.h"
 #include "base.h"
@@ -45,6 +49,87 @@ USES_APPLE_DEPRECATED_API	/* OpenSSL API has been deprecated by Apple */
 
 #include <openssl/ssl.h>
 #include <openssl/kdf.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#  include <openssl/core_names.h>
+#  define TLS_TICKET_MAC_CTX EVP_MAC_CTX
+#else
+#  include <openssl/hmac.h>
+#  define TLS_TICKET_MAC_CTX HMAC_CTX
+#endif
+
+#include <pthread.h>
+
+/** Number of bits of the session ID hash used to select a shard of the shared store
+ */
+#define TLS_CACHE_SHARD_BITS	4
+
+/** An entry in the shared session store
+ *
+ * The session ID and the serialized session are stored after
+ * the entry, so each session costs a single allocation.
+ */
+typedef struct {
+	fr_dlist_t		lru;		//!< Entry in the shard's LRU list.
+	uint32_t		hash;		//!< Hash of the session ID.
+	fr_time_t		expires;	//!< When the session can no longer be resumed.
+	uint8_t const		*id;		//!< Session ID.
+	size_t			id_len;		//!< Length of the session ID.
+	uint8_t const		*data;		//!< Serialized session.
+	size_t			data_len;	//!< Length of the serialized session.
+	uint8_t			buff[];		//!< Session ID followed by the serialized session.
+} tls_cache_entry_t;
+
+/** A shard of the shared session store
+ *
+ */
+typedef struct {
+	pthread_mutex_t		mutex;		//!< Serialises access to the shard.
+	fr_hash_table_t		*ht;		//!< Entries indexed by session ID.
+	fr_dlist_head_t		lru;		//!< Least recently used entries at the head.
+} tls_cache_shard_t;
+
+/** Stateful session data shared by all the SSL_CTXs created from a TLS configuration
+ *
+ */
+struct fr_tls_cache_store_s {
+	uint32_t		max_entries;	//!< Maximum number of entries in each shard.
+	tls_cache_shard_t	shard[1 << TLS_CACHE_SHARD_BITS];
+};
+
+/** A session ticket key
+ *
+ * Uses the same 80 byte layout as other TLS servers, so
+ * key files can be shared with them.
+ */
+typedef struct {
+	uint8_t			name[16];	//!< Identifies the key a ticket was encrypted with.
+	uint8_t			hmac_key[32];	//!< Authenticates the ticket.
+	uint8_t			aes_key[32];	//!< Encrypts the ticket.
+} tls_cache_ticket_key_t;
+
+/** Session ticket keys shared by all the SSL_CTXs created from a TLS configuration
+ *
+ */
+struct fr_tls_cache_ticket_keys_s {
+	pthread_mutex_t		mutex;		//!< Serialises rotation.
+	tls_cache_ticket_key_t	current;	//!< Encrypts new tickets.
+	tls_cache_ticket_key_t	previous;	//!< Still accepted when decrypting tickets.
+	bool			have_previous;	//!< Whether previous has been populated.
+	fr_time_t		rotated;	//!< When the keys were last rotated.
+	fr_time_delta_t		interval;	//!< How often the keys are rotated.
+	char const		*file;		//!< Where keys are read from.
+};
+
+static atomic_uint_fast64_t	tls_cache_stats_full;
+static atomic_uint_fast64_t	tls_cache_stats_resumed;
+static atomic_uint_fast64_t	tls_cache_stats_hits;
+static atomic_uint_fast64_t	tls_cache_stats_misses;
+static atomic_uint_fast64_t	tls_cache_stats_stores;
+static atomic_uint_fast64_t	tls_cache_stats_evictions;
+static atomic_uint_fast64_t	tls_cache_stats_entries;
+static atomic_uint_fast64_t	tls_cache_stats_rotations;
 
 /** Retrieve session ID (in binary form) from the session
  *
@@ -152,13 +237,381 @@ void _tls_cache_clear_state_reset(request_t *request, fr_tls_cache_t *cache, cha
 		if (ROPTIONAL_ENABLED(RDEBUG_ENABLED3, DEBUG_ENABLED3)) {
 			ROPTIONAL(RDEBUG3, DEBUG3, "Session ID %pV - Freeing session ID to clear in %s",
 				  fr_box_octets_buffer(cache->clear.id), func);
-			TALLOC_FREE(cache->clear.id);
 		}
+		TALLOC_FREE(cache->clear.id);
 	}
 	cache->clear.state = FR_TLS_CACHE_CLEAR_INIT;
 }
 #define tls_cache_clear_state_reset(_request, _cache) _tls_cache_clear_state_reset(_request, _cache, __FUNCTION__)
 
+/** Return the hash of an entry's session ID
+ *
+ */
+static uint32_t tls_cache_entry_hash(void const *data)
+{
+	tls_cache_entry_t const *entry = data;
+
+	return entry->hash;
+}
+
+/** Compare two entries by session ID
+ *
+ */
+static int8_t tls_cache_entry_cmp(void const *one, void const *two)
+{
+	tls_cache_entry_t const *a = one, *b = two;
+	int ret;
+
+	ret = CMP(a->id_len, b->id_len);
+	if (ret != 0) return ret;
+
+	ret = memcmp(a->id, b->id, a->id_len);
+	return CMP(ret, 0);
+}
+
+/** Return the shard an entry belongs in
+ *
+ */
+static inline CC_HINT(always_inline)
+tls_cache_shard_t *tls_cache_shard(fr_tls_cache_store_t *store, tls_cache_entry_t *entry, uint8_t const *id, size_t id_len)
+{
+	entry->id = id;
+	entry->id_len = id_len;
+	entry->hash = fr_hash(id, id_len);
+
+	return &store->shard[entry->hash >> (32 - TLS_CACHE_SHARD_BITS)];
+}
+
+/** Remove an entry from its shard and free it
+ *
+ * @note Must be called with the shard locked.
+ */
+static void tls_cache_entry_free(tls_cache_shard_t *shard, tls_cache_entry_t *entry)
+{
+	(void) fr_hash_table_remove(shard->ht, entry);
+	fr_dlist_remove(&shard->lru, entry);
+	talloc_free(entry);
+
+	atomic_fetch_sub_explicit(&tls_cache_stats_entries, 1, memory_order_relaxed);
+}
+
+/** Serialize a session into the shared store
+ *
+ * @param[in] request	The current request.
+ * @param[in] store	to write the session to.
+ * @param[in] sess	to serialize.
+ * @param[in] expires	When the session can no longer be resumed.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int tls_cache_shared_store(request_t *request, fr_tls_cache_store_t *store,
+				  SSL_SESSION *sess, fr_time_t expires)
+{
+	tls_cache_entry_t	*entry, *old;
+	tls_cache_shard_t	*shard;
+	unsigned int		id_len;
+	uint8_t const		*id;
+	uint8_t			*p;
+	int			len;
+
+	id = SSL_SESSION_get_id(sess, &id_len);
+	if (unlikely(!id || !id_len)) {
+		RWDEBUG("Error retrieving Session ID");
+		return -1;
+	}
+
+	len = i2d_SSL_SESSION(sess, NULL);	/* find out what length data we need */
+	if (len < 1) {
+		fr_tls_log_strerror_printf(NULL);	/* Drain the OpenSSL error stack */
+		RPWDEBUG("Session ID %pV - Serialisation failed, couldn't determine "
+			 "required buffer length", fr_box_octets(id, id_len));
+		return -1;
+	}
+
+	/*
+	 *	Serialize the session directly into the
+	 *	entry, so there are no intermediary copies.
+	 *
+	 *	Entries are parented by the NULL ctx as
+	 *	they're allocated by whichever worker
+	 *	happens to be storing the session.
+	 */
+	MEM(entry = talloc_zero_size(NULL, sizeof(*entry) + id_len + len));
+	talloc_set_type(entry, tls_cache_entry_t);
+
+	memcpy(entry->buff, id, id_len);
+	p = entry->buff + id_len;	/* openssl mutates &p */
+	entry->data = p;
+	entry->data_len = len;
+	entry->expires = expires;
+
+	if (i2d_SSL_SESSION(sess, &p) != len) {
+		fr_tls_log_strerror_printf(NULL);	/* Drain the OpenSSL error stack */
+		RPWDEBUG("Session ID %pV - Serialisation failed", fr_box_octets(id, id_len));
+		talloc_free(entry);
+		return -1;
+	}
+
+	shard = tls_cache_shard(store, entry, entry->buff, id_len);
+
+	pthread_mutex_lock(&shard->mutex);
+	old = fr_hash_table_find(shard->ht, entry);
+	if (old) tls_cache_entry_free(shard, old);
+
+	/*
+	 *	Make room by evicting the least
+	 *	recently used sessions.
+	 */
+	while (fr_dlist_num_elements(&shard->lru) >= store->max_entries) {
+		tls_cache_entry_free(shard, fr_dlist_head(&shard->lru));
+		atomic_fetch_add_explicit(&tls_cache_stats_evictions, 1, memory_order_relaxed);
+	}
+
+	if (!fr_hash_table_insert(shard->ht, entry)) {
+		pthread_mutex_unlock(&shard->mutex);
+		RWDEBUG("Session ID %pV - Failed inserting session into the shared store", fr_box_octets(id, id_len));
+		talloc_free(entry);
+		return -1;
+	}
+	fr_dlist_insert_tail(&shard->lru, entry);
+	pthread_mutex_unlock(&shard->mutex);
+
+	atomic_fetch_add_explicit(&tls_cache_stats_entries, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&tls_cache_stats_stores, 1, memory_order_relaxed);
+
+	RDEBUG3("Session ID %pV - Wrote %d bytes to the shared store", fr_box_octets(id, id_len), len);
+
+	return 0;
+}
+
+/** Remove a session from the shared store
+ *
+ * @param[in] store	to remove the session from.
+ * @param[in] id	of the session to remove.
+ */
+static void tls_cache_shared_clear(fr_tls_cache_store_t *store, uint8_t const *id)
+{
+	tls_cache_entry_t	find, *entry;
+	tls_cache_shard_t	*shard;
+
+	shard = tls_cache_shard(store, &find, id, talloc_array_length(id));
+
+	pthread_mutex_lock(&shard->mutex);
+	entry = fr_hash_table_find(shard->ht, &find);
+	if (entry) tls_cache_entry_free(shard, entry);
+	pthread_mutex_unlock(&shard->mutex);
+}
+
+/** Free the entries in the shared store
+ *
+ */
+static int _tls_cache_store_free(fr_tls_cache_store_t *store)
+{
+	tls_cache_entry_t	*entry;
+	size_t			i;
+
+	for (i = 0; i < NUM_ELEMENTS(store->shard); i++) {
+		tls_cache_shard_t *shard = &store->shard[i];
+
+		if (!shard->ht) continue;	/* Partially initialised */
+
+		while ((entry = fr_dlist_head(&shard->lru))) tls_cache_entry_free(shard, entry);
+
+		talloc_free(shard->ht);
+		pthread_mutex_destroy(&shard->mutex);
+	}
+
+	return 0;
+}
+
+/** Allocate a shared session store
+ *
+ * @param[in] ctx		to allocate the store in.
+ * @param[in] max_entries	Maximum number of sessions to store.
+ * @return
+ *	- A new store.
+ *	- NULL on failure.
+ */
+static fr_tls_cache_store_t *tls_cache_store_alloc(TALLOC_CTX *ctx, uint32_t max_entries)
+{
+	fr_tls_cache_store_t	*store;
+	size_t			i;
+
+	MEM(store = talloc_zero(ctx, fr_tls_cache_store_t));
+	talloc_set_destructor(store, _tls_cache_store_free);
+
+	store->max_entries = max_entries / NUM_ELEMENTS(store->shard);
+	if (store->max_entries == 0) store->max_entries = 1;
+
+	for (i = 0; i < NUM_ELEMENTS(store->shard); i++) {
+		tls_cache_shard_t *shard = &store->shard[i];
+
+		if (pthread_mutex_init(&shard->mutex, NULL) != 0) {
+			fr_strerror_printf("Failed initialising shared session store mutex: %s", fr_syserror(errno));
+		error:
+			talloc_free(store);
+			return NULL;
+		}
+
+		fr_dlist_talloc_init(&shard->lru, tls_cache_entry_t, lru);
+
+		/*
+		 *	Parented from the NULL ctx, as it's
+		 *	modified by multiple threads.
+		 */
+		shard->ht = fr_hash_table_talloc_alloc(NULL, tls_cache_entry_t,
+						       tls_cache_entry_hash, tls_cache_entry_cmp, NULL);
+		if (!shard->ht) {
+			pthread_mutex_destroy(&shard->mutex);
+			goto error;
+		}
+	}
+
+	return store;
+}
+
+/** Read one or two session ticket keys from a file
+ *
+ * The first key encrypts new tickets, the second, if present, is
+ * only used to decrypt them.
+ *
+ * @param[out] current		The key to encrypt tickets with.
+ * @param[out] previous		An older key still accepted for decryption.
+ * @param[out] have_previous	Whether the file contained an older key.
+ * @param[in] file		to read the keys from.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int tls_cache_ticket_keys_read(tls_cache_ticket_key_t *current, tls_cache_ticket_key_t *previous,
+				      bool *have_previous, char const *file)
+{
+	FILE	*fp;
+	uint8_t	buff[(sizeof(tls_cache_ticket_key_t) * 2) + 1];
+	size_t	len;
+
+	fp = fopen(file, "r");
+	if (!fp) {
+		fr_strerror_printf("Failed opening session ticket key file \"%s\": %s", file, fr_syserror(errno));
+		return -1;
+	}
+	len = fread(buff, 1, sizeof(buff), fp);
+	fclose(fp);
+
+	if ((len != sizeof(*current)) && (len != (sizeof(*current) * 2))) {
+		fr_strerror_printf("Session ticket key file \"%s\" must contain one or two %zu byte keys, "
+				   "got %zu bytes", file, sizeof(*current), len);
+		OPENSSL_cleanse(buff, sizeof(buff));
+		return -1;
+	}
+
+	memcpy(current, buff, sizeof(*current));
+	*have_previous = (len > sizeof(*current));
+	if (*have_previous) memcpy(previous, buff + sizeof(*current), sizeof(*previous));
+	OPENSSL_cleanse(buff, sizeof(buff));
+
+	return 0;
+}
+
+/** Replace the current session ticket key
+ *
+ * The current key becomes the previous key, so tickets issued before
+ * the rotation can still be decrypted, and are reissued.
+ *
+ * @note Must be called with the keys locked.
+ *
+ * @param[in] keys	to rotate.
+ * @param[in] now	The current time.
+ */
+static void tls_cache_ticket_keys_rotate(fr_tls_cache_ticket_keys_t *keys, fr_time_t now)
+{
+	tls_cache_ticket_key_t	current, previous;
+	bool			have_previous = false;
+
+	keys->rotated = now;
+
+	if (keys->file) {
+		if (tls_cache_ticket_keys_read(&current, &previous, &have_previous, keys->file) < 0) {
+			PWARN("Keeping existing session ticket keys");
+			return;
+		}
+
+		/*
+		 *	File hasn't been updated
+		 */
+		if (memcmp(current.name, keys->current.name, sizeof(current.name)) == 0) {
+			OPENSSL_cleanse(&current, sizeof(current));
+			OPENSSL_cleanse(&previous, sizeof(previous));
+			return;
+		}
+	} else if (RAND_bytes((uint8_t *)&current, sizeof(current)) != 1) {
+		fr_tls_log_strerror_printf(NULL);
+		PWARN("Failed generating session ticket key, keeping existing session ticket keys");
+		return;
+	}
+
+	keys->previous = have_previous ? previous : keys->current;
+	keys->current = current;
+	keys->have_previous = true;
+
+	OPENSSL_cleanse(&current, sizeof(current));
+	OPENSSL_cleanse(&previous, sizeof(previous));
+
+	atomic_fetch_add_explicit(&tls_cache_stats_rotations, 1, memory_order_relaxed);
+
+	DEBUG2("Rotated session ticket keys");
+}
+
+static int _tls_cache_ticket_keys_free(fr_tls_cache_ticket_keys_t *keys)
+{
+	pthread_mutex_destroy(&keys->mutex);
+	OPENSSL_cleanse(&keys->current, sizeof(keys->current));
+	OPENSSL_cleanse(&keys->previous, sizeof(keys->previous));
+
+	return 0;
+}
+
+/** Allocate the session ticket keys shared between SSL_CTXs
+ *
+ * @param[in] ctx		to allocate the keys in.
+ * @param[in] cache_conf	containing the key file and rotation interval.
+ * @return
+ *	- The new keys.
+ *	- NULL on failure.
+ */
+static fr_tls_cache_ticket_keys_t *tls_cache_ticket_keys_alloc(TALLOC_CTX *ctx, fr_tls_cache_conf_t const *cache_conf)
+{
+	fr_tls_cache_ticket_keys_t *keys;
+
+	MEM(keys = talloc_zero(ctx, fr_tls_cache_ticket_keys_t));
+	if (pthread_mutex_init(&keys->mutex, NULL) != 0) {
+		fr_strerror_printf("Failed initialising session ticket key mutex: %s", fr_syserror(errno));
+		talloc_free(keys);
+		return NULL;
+	}
+	talloc_set_destructor(keys, _tls_cache_ticket_keys_free);
+
+	keys->file = cache_conf->session_ticket_key_file;
+	keys->interval = cache_conf->session_ticket_key_rotate;
+	keys->rotated = fr_time();
+
+	if (keys->file) {
+		if (tls_cache_ticket_keys_read(&keys->current, &keys->previous,
+					       &keys->have_previous, keys->file) < 0) {
+		error:
+			talloc_free(keys);
+			return NULL;
+		}
+	} else if (RAND_bytes((uint8_t *)&keys->current, sizeof(keys->current)) != 1) {
+		fr_tls_log_strerror_printf(NULL);
+		fr_strerror_const_push("Failed generating session ticket key");
+		goto error;
+	}
+
+	return keys;
+}
+
 /** Serialize the session-state list and store it in the SSL_SESSION *
  *
  */
@@ -337,45 +790,38 @@ static void tls_cache_delete_request(SSL_SESSION *sess)
 	if (tls_session->can_pause) ASYNC_pause_job();
 }
 
-/** Process the result of `session load { ... }`
+/** De-serialise loaded session data, and record it for tls_cache_load_cb
+ *
+ * @param[in] request		The current request.
+ * @param[in] tls_session	The current TLS session.
+ * @param[in] data		Serialized session.
+ * @param[in] data_len		Length of the serialized session.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
  */
-static unlang_action_t tls_cache_load_result(UNUSED rlm_rcode_t *p_result, UNUSED int *priority,
-					     request_t *request, void *uctx)
+static int tls_cache_load_data(request_t *request, fr_tls_session_t *tls_session,
+			       uint8_t const *data, size_t data_len)
 {
-	fr_tls_session_t	*tls_session = talloc_get_type_abort(uctx, fr_tls_session_t);
 	fr_tls_cache_t		*tls_cache = tls_session->cache;
-	fr_pair_t		*vp;
 	uint8_t const		*q, **p;
 	SSL_SESSION		*sess;
 
-	vp = fr_pair_find_by_da_idx(&request->reply_pairs, attr_tls_packet_type, 0);
-	if (!vp || (vp->vp_uint32 != enum_tls_packet_type_success->vb_uint32)) {
-		RWDEBUG("Failed acquiring session data");
-	error:
-		tls_cache->load.state = FR_TLS_CACHE_LOAD_FAILED;
-		return UNLANG_ACTION_CALCULATE_RESULT;
-	}
-
-	vp = fr_pair_find_by_da_idx(&request->reply_pairs, attr_tls_session_data, 0);
-	if (!vp) {
-		RWDEBUG("No cached session found");
-		goto error;
-	}
-
-	q = vp->vp_octets;	/* openssl will mutate q, so we can't use vp_octets directly */
+	q = data;	/* openssl will mutate q, so we can't use data directly */
 	p = (unsigned char const **)&q;
 
-	sess = d2i_SSL_SESSION(NULL, p, vp->vp_length);
+	sess = d2i_SSL_SESSION(NULL, p, data_len);
 	if (!sess) {
 		fr_tls_log_error(request, "Failed loading persisted session");
-		goto error;
+		tls_cache->load.state = FR_TLS_CACHE_LOAD_FAILED;
+		return -1;
 	}
 
 	if (RDEBUG_ENABLED3) {
 		SESSION_ID(sess_id, sess);
 
 		RDEBUG3("Session ID %pV - Read %zu bytes of data.  "
-			"Session de-serialized successfully", &sess_id, vp->vp_length);
+			"Session de-serialized successfully", &sess_id, data_len);
 		SSL_SESSION_print(fr_tls_request_log_bio(request, L_DBG, L_DBG_LVL_3), sess);
 	}
 
@@ -393,9 +839,82 @@ static unlang_action_t tls_cache_load_result(UNUSED rlm_rcode_t *p_result, UNUSE
 	tls_cache->load.state = FR_TLS_CACHE_LOAD_RETRIEVED;
 	tls_cache->load.sess = sess;	/* This is consumed in tls_cache_load_cb */
 
+	return 0;
+}
+
+/** Process the result of `session load { ... }`
+ */
+static unlang_action_t tls_cache_load_result(UNUSED rlm_rcode_t *p_result, UNUSED int *priority,
+					     request_t *request, void *uctx)
+{
+	fr_tls_session_t	*tls_session = talloc_get_type_abort(uctx, fr_tls_session_t);
+	fr_tls_cache_t		*tls_cache = tls_session->cache;
+	fr_pair_t		*vp;
+
+	vp = fr_pair_find_by_da_idx(&request->reply_pairs, attr_tls_packet_type, 0);
+	if (!vp || (vp->vp_uint32 != enum_tls_packet_type_success->vb_uint32)) {
+		RWDEBUG("Failed acquiring session data");
+	error:
+		tls_cache->load.state = FR_TLS_CACHE_LOAD_FAILED;
+		return UNLANG_ACTION_CALCULATE_RESULT;
+	}
+
+	vp = fr_pair_find_by_da_idx(&request->reply_pairs, attr_tls_session_data, 0);
+	if (!vp) {
+		RWDEBUG("No cached session found");
+		goto error;
+	}
+
+	(void) tls_cache_load_data(request, tls_session, vp->vp_octets, vp->vp_length);
+
 	return UNLANG_ACTION_CALCULATE_RESULT;
 }
 
+/** Load a session from the shared store
+ *
+ * The store is in memory, so unlike the `session load { ... }`
+ * section, there's no need to yield.
+ *
+ * @param[in] request		The current request.
+ * @param[in] tls_session	The current TLS session.
+ * @param[in] store		to load the session from.
+ */
+static void tls_cache_shared_load(request_t *request, fr_tls_session_t *tls_session, fr_tls_cache_store_t *store)
+{
+	fr_tls_cache_t		*tls_cache = tls_session->cache;
+	tls_cache_entry_t	find, *entry;
+	tls_cache_shard_t	*shard;
+
+	shard = tls_cache_shard(store, &find, tls_cache->load.id, talloc_array_length(tls_cache->load.id));
+
+	pthread_mutex_lock(&shard->mutex);
+	entry = fr_hash_table_find(shard->ht, &find);
+	if (entry && fr_time_lteq(entry->expires, fr_time())) {
+		tls_cache_entry_free(shard, entry);
+		entry = NULL;
+	}
+	if (entry) {
+		fr_dlist_remove(&shard->lru, entry);
+		fr_dlist_insert_tail(&shard->lru, entry);
+
+		/*
+		 *	De-serialising copies the data, so the
+		 *	entry can be evicted as soon as we unlock.
+		 */
+		(void) tls_cache_load_data(request, tls_session, entry->data, entry->data_len);
+	}
+	pthread_mutex_unlock(&shard->mutex);
+
+	if (!entry) {
+		atomic_fetch_add_explicit(&tls_cache_stats_misses, 1, memory_order_relaxed);
+		RWDEBUG("No cached session found");
+		tls_cache->load.state = FR_TLS_CACHE_LOAD_FAILED;
+		return;
+	}
+
+	atomic_fetch_add_explicit(&tls_cache_stats_hits, 1, memory_order_relaxed);
+}
+
 /** Push a `session load { ... }` call into the current request, using a subrequest
  *
  * @param[in] request		The current request.
@@ -417,6 +936,11 @@ static unlang_action_t tls_cache_load_push(request_t *request, fr_tls_session_t
 
 	fr_assert(tls_cache->load.id);
 
+	if (conf->cache.store) {
+		tls_cache_shared_load(request, tls_session, conf->cache.store);
+		return UNLANG_ACTION_CALCULATE_RESULT;
+	}
+
 	MEM(child = unlang_subrequest_alloc(request, dict_tls));
 	request = child;
 
@@ -511,6 +1035,16 @@ unlang_action_t tls_cache_store_push(request_t *request, fr_tls_conf_t *conf, fr
 	 */
 	if (tls_cache_app_data_set(request, sess) < 0) return UNLANG_ACTION_FAIL;
 
+	if (conf->cache.store) {
+		if (tls_cache_shared_store(request, conf->cache.store, sess, expires) < 0) {
+			tls_cache_store_state_reset(request, tls_cache);
+			return UNLANG_ACTION_FAIL;
+		}
+		tls_cache_store_state_reset(request, tls_cache);
+		tls_cache->store.state = FR_TLS_CACHE_STORE_PERSISTED;	/* Avoid spurious clear calls */
+		return UNLANG_ACTION_CALCULATE_RESULT;
+	}
+
 	MEM(child = unlang_subrequest_alloc(request, dict_tls));
 	request = child;
 
@@ -622,6 +1156,12 @@ unlang_action_t tls_cache_clear_push(request_t *request, fr_tls_conf_t *conf, fr
 	fr_assert(tls_cache->clear.state == FR_TLS_CACHE_CLEAR_REQUESTED);
 	fr_assert(tls_cache->clear.id);
 
+	if (conf->cache.store) {
+		tls_cache_shared_clear(conf->cache.store, tls_cache->clear.id);
+		tls_cache_clear_state_reset(request, tls_cache);
+		return UNLANG_ACTION_CALCULATE_RESULT;
+	}
+
 	MEM(child = unlang_subrequest_alloc(request, dict_tls));
 	request = child;
 
@@ -664,6 +1204,7 @@ unlang_action_t fr_tls_cache_pending_push(request_t *request, fr_tls_session_t *
 {
 	fr_tls_cache_t *tls_cache = tls_session->cache;
 	fr_tls_conf_t *conf = fr_tls_session_conf(tls_session->ssl);
+	unlang_action_t ua;
 
 	if (!tls_cache) return UNLANG_ACTION_CALCULATE_RESULT;	/* No caching allowed */
 
@@ -695,7 +1236,12 @@ unlang_action_t fr_tls_cache_pending_push(request_t *request, fr_tls_session_t *
 			}
 		}
 
-		return tls_cache_clear_push(request, conf, tls_session);
+		/*
+		 *	Clearing the shared store doesn't yield
+		 *	so we can go on to any pending store.
+		 */
+		ua = tls_cache_clear_push(request, conf, tls_session);
+		if (ua != UNLANG_ACTION_CALCULATE_RESULT) return ua;
 	}
 
 	if (tls_cache->store.state == FR_TLS_CACHE_STORE_REQUESTED) {
@@ -1176,6 +1722,83 @@ void tls_cache_disable_statefull_resumption(SSL_CTX *ctx)
 	SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
 }
 
+/** Select the key used to encrypt or decrypt a session ticket
+ *
+ * Rotates the keys if they're due to be rotated, so that all
+ * SSL_CTXs sharing the keys switch to the new key together.
+ *
+ * @param[in] ssl		session state.
+ * @param[in,out] key_name	Name of the key the ticket was, or will be, encrypted with.
+ * @param[in,out] iv		for the ticket cipher.
+ * @param[in] cipher_ctx	to initialise with the key.
+ * @param[in] mac_ctx		to initialise with the key.
+ * @param[in] enc		Whether we're encrypting or decrypting a ticket.
+ * @return
+ *	- 2 if the ticket was decrypted with the previous key, and should be reissued.
+ *	- 1 on success.
+ *	- 0 if the ticket's key is unknown, and a full handshake is required.
+ *	- -1 on error.
+ */
+static int tls_cache_ticket_key_cb(SSL *ssl, unsigned char key_name[16], unsigned char *iv,
+				   EVP_CIPHER_CTX *cipher_ctx, TLS_TICKET_MAC_CTX *mac_ctx, int enc)
+{
+	fr_tls_conf_t			*conf = talloc_get_type_abort(SSL_get_ex_data(ssl, FR_TLS_EX_INDEX_CONF),
+								      fr_tls_conf_t);
+	fr_tls_cache_ticket_keys_t	*keys = conf->cache.ticket_keys;
+	tls_cache_ticket_key_t		key;
+	int				ret = 1;
+
+	pthread_mutex_lock(&keys->mutex);
+	if (enc) {
+		fr_time_t now = fr_time();
+
+		if (fr_time_delta_ispos(keys->interval) &&
+		    fr_time_gteq(now, fr_time_add(keys->rotated, keys->interval))) {
+			tls_cache_ticket_keys_rotate(keys, now);
+		}
+		key = keys->current;
+	} else if (memcmp(key_name, keys->current.name, sizeof(keys->current.name)) == 0) {
+		key = keys->current;
+	} else if (keys->have_previous && (memcmp(key_name, keys->previous.name, sizeof(keys->previous.name)) == 0)) {
+		key = keys->previous;
+		ret = 2;
+	} else {
+		ret = 0;
+	}
+	pthread_mutex_unlock(&keys->mutex);
+
+	if (ret == 0) return 0;
+
+	if (enc) {
+		memcpy(key_name, key.name, sizeof(key.name));
+		if ((RAND_bytes(iv, EVP_CIPHER_iv_length(EVP_aes_256_cbc())) != 1) ||
+		    (EVP_EncryptInit_ex(cipher_ctx, EVP_aes_256_cbc(), NULL, key.aes_key, iv) != 1)) {
+		error:
+			OPENSSL_cleanse(&key, sizeof(key));
+			return -1;
+		}
+	} else if (EVP_DecryptInit_ex(cipher_ctx, EVP_aes_256_cbc(), NULL, key.aes_key, iv) != 1) {
+		goto error;
+	}
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	{
+		OSSL_PARAM params[3];
+
+		params[0] = OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, key.hmac_key, sizeof(key.hmac_key));
+		params[1] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, UNCONST(char *, "sha256"), 0);
+		params[2] = OSSL_PARAM_construct_end();
+
+		if (EVP_MAC_CTX_set_params(mac_ctx, params) != 1) goto error;
+	}
+#else
+	if (HMAC_Init_ex(mac_ctx, key.hmac_key, sizeof(key.hmac_key), EVP_sha256(), NULL) != 1) goto error;
+#endif
+	OPENSSL_cleanse(&key, sizeof(key));
+
+	return ret;
+}
+
 /** Called when new tickets are being generated
  *
  * This adds additional application data to the session ticket to
@@ -1347,6 +1970,67 @@ static SSL_TICKET_RETURN tls_cache_session_ticket_app_data_get(SSL *ssl, SSL_SES
 	return (status == SSL_TICKET_SUCCESS_RENEW) ? SSL_TICKET_RETURN_USE_RENEW : SSL_TICKET_RETURN_USE;
 }
 
+/** Allocate the cache structures shared by all SSL_CTXs created from a TLS configuration
+ *
+ * @param[in] ctx		to allocate the structures in.
+ * @param[in] cache_conf	to allocate the structures for.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int fr_tls_cache_conf_init(TALLOC_CTX *ctx, fr_tls_cache_conf_t *cache_conf)
+{
+	if ((cache_conf->mode & FR_TLS_CACHE_STATEFUL) && cache_conf->shared) {
+		cache_conf->store = tls_cache_store_alloc(ctx, cache_conf->max_entries);
+		if (!cache_conf->store) {
+			PERROR("Failed allocating shared session store");
+			return -1;
+		}
+	}
+
+	if ((cache_conf->mode & FR_TLS_CACHE_STATELESS) &&
+	    (cache_conf->session_ticket_key_file || fr_time_delta_ispos(cache_conf->session_ticket_key_rotate))) {
+		cache_conf->ticket_keys = tls_cache_ticket_keys_alloc(ctx, cache_conf);
+		if (!cache_conf->ticket_keys) {
+			PERROR("Failed loading session ticket keys");
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/** Record whether a completed handshake resumed a session
+ *
+ * @param[in] ssl	session state, after the handshake has completed.
+ */
+void fr_tls_cache_handshake_done(SSL *ssl)
+{
+	if (SSL_session_reused(ssl)) {
+		atomic_fetch_add_explicit(&tls_cache_stats_resumed, 1, memory_order_relaxed);
+		return;
+	}
+	atomic_fetch_add_explicit(&tls_cache_stats_full, 1, memory_order_relaxed);
+}
+
+/** Return session resumption statistics
+ *
+ * @param[out] stats	Where to write the statistics.
+ */
+void fr_tls_cache_stats(fr_tls_cache_stats_t *stats)
+{
+	*stats = (fr_tls_cache_stats_t) {
+		.handshakes_full = atomic_load_explicit(&tls_cache_stats_full, memory_order_relaxed),
+		.handshakes_resumed = atomic_load_explicit(&tls_cache_stats_resumed, memory_order_relaxed),
+		.hits = atomic_load_explicit(&tls_cache_stats_hits, memory_order_relaxed),
+		.misses = atomic_load_explicit(&tls_cache_stats_misses, memory_order_relaxed),
+		.stores = atomic_load_explicit(&tls_cache_stats_stores, memory_order_relaxed),
+		.evictions = atomic_load_explicit(&tls_cache_stats_evictions, memory_order_relaxed),
+		.entries = atomic_load_explicit(&tls_cache_stats_entries, memory_order_relaxed),
+		.key_rotations = atomic_load_explicit(&tls_cache_stats_rotations, memory_order_relaxed)
+	};
+}
+
 /** Sets callbacks and flags on a SSL_CTX to enable/disable session resumption
  *
  * @param[in] ctx			to modify.
@@ -1403,6 +2087,24 @@ int fr_tls_cache_ctx_init(SSL_CTX *ctx, fr_tls_cache_conf_t const *cache_conf)
 
 		if (!(cache_conf->mode & FR_TLS_CACHE_STATEFUL)) tls_cache_disable_statefull_resumption(ctx);
 
+		/*
+		 *	Rotating keys are selected per-ticket, so
+		 *	every SSL_CTX picks up new keys as soon
+		 *	as they're rotated.
+		 */
+		if (cache_conf->ticket_keys) {
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+			if (unlikely(SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx, tls_cache_ticket_key_cb) != 1)) {
+#else
+			if (unlikely(SSL_CTX_set_tlsext_ticket_key_cb(ctx, tls_cache_ticket_key_cb) != 1)) {
+#endif
+				fr_tls_log_strerror_printf(NULL);
+				PERROR("Failed setting session ticket key callback");
+				return -1;
+			}
+			goto ticket_app_data;
+		}
+
 		/*
 		 *	If keys is NULL, then OpenSSL returns the expected
 		 *	key length, which may be different across diferent
@@ -1475,6 +2177,7 @@ int fr_tls_cache_ctx_init(SSL_CTX *ctx, fr_tls_cache_conf_t const *cache_conf)
 		HEXDUMP3(key_buff, key_len, NULL);
 		talloc_free(key_buff);
 
+	ticket_app_data:
 		/*
 		 *	These callbacks embed and extract the
 		 *	session-state list from the session-ticket.
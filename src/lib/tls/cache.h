@@ -91,6 +91,20 @@ typedef struct {
 	} clear;
 } fr_tls_cache_t;
 
+/** Session resumption statistics
+ *
+ */
+typedef struct {
+	uint64_t	handshakes_full;		//!< Handshakes which didn't resume a session.
+	uint64_t	handshakes_resumed;		//!< Handshakes which resumed a session.
+	uint64_t	hits;				//!< Sessions found in a shared store.
+	uint64_t	misses;				//!< Sessions not found in a shared store.
+	uint64_t	stores;				//!< Sessions written to a shared store.
+	uint64_t	evictions;			//!< Sessions evicted from a shared store to make room.
+	uint64_t	entries;			//!< Sessions currently in shared stores.
+	uint64_t	key_rotations;			//!< Session ticket key rotations.
+} fr_tls_cache_stats_t;
+
 #ifdef __cplusplus
 }
 #endif
@@ -111,8 +125,14 @@ int		fr_tls_cache_disable_cb(SSL *ssl, int is_forward_secure);
 
 void		fr_tls_cache_session_alloc(fr_tls_session_t *tls_session);
 
+int		fr_tls_cache_conf_init(TALLOC_CTX *ctx, fr_tls_cache_conf_t *cache_conf);
+
 int		fr_tls_cache_ctx_init(SSL_CTX *ctx, fr_tls_cache_conf_t const *cache_conf);
 
+void		fr_tls_cache_handshake_done(SSL *ssl);
+
+void		fr_tls_cache_stats(fr_tls_cache_stats_t *stats);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,453 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or (at
+ *   your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/** Tests for the shared TLS session store and session ticket keys
+ *
+ * @file src/lib/tls/cache_tests.c
+ *
+ * @copyright 2022 The FreeRADIUS server project
+ */
+#define USE_CONSTRUCTOR
+
+/*
+ * It should be declared before include the "acutest.h"
+ */
+#ifdef USE_CONSTRUCTOR
+static void test_init(void) __attribute__((constructor));
+#else
+static void test_init(void);
+#  define TEST_INIT  test_init()
+#endif
+
+#include <freeradius-devel/util/acutest.h>
+#include <freeradius-devel/util/acutest_helpers.h>
+
+#include "cache.c"
+
+static TALLOC_CTX	*autofree;
+static SSL_CTX		*test_ssl_ctx;
+
+/** Global initialisation
+ */
+static void test_init(void)
+{
+	autofree = talloc_autofree_context();
+	if (!autofree) {
+	error:
+		fr_perror("tls_cache_tests");
+		fr_exit_now(EXIT_FAILURE);
+	}
+
+	/*
+	 *	Mismatch between the binary and the libraries it depends on
+	 */
+	if (fr_check_lib_magic(RADIUSD_MAGIC_NUMBER) < 0) goto error;
+
+	if (fr_openssl_init() < 0) goto error;
+
+	if (request_global_init() < 0) goto error;
+
+	test_ssl_ctx = SSL_CTX_new(TLS_method());
+	if (!test_ssl_ctx) goto error;
+}
+
+/** Allocate a session whose ID is filled with id_byte
+ *
+ */
+static SSL_SESSION *test_session_alloc(uint8_t id_byte)
+{
+	SSL_SESSION	*sess;
+	SSL		*ssl;
+	uint8_t		id[SSL_MAX_SSL_SESSION_ID_LENGTH], master_key[SSL_MAX_MASTER_KEY_LENGTH];
+
+	memset(id, id_byte, sizeof(id));
+	memset(master_key, 0x42, sizeof(master_key));
+
+	MEM(ssl = SSL_new(test_ssl_ctx));
+	MEM(sess = SSL_SESSION_new());
+
+	TEST_CHECK(SSL_SESSION_set1_id(sess, id, sizeof(id)) == 1);
+	TEST_CHECK(SSL_SESSION_set1_master_key(sess, master_key, sizeof(master_key)) == 1);
+	TEST_CHECK(SSL_SESSION_set_protocol_version(sess, TLS1_2_VERSION) == 1);
+	TEST_CHECK(SSL_SESSION_set_cipher(sess, sk_SSL_CIPHER_value(SSL_get_ciphers(ssl), 0)) == 1);
+
+	SSL_free(ssl);
+
+	return sess;
+}
+
+static void test_session_store(request_t *request, fr_tls_cache_store_t *store, uint8_t id_byte, fr_time_t expires)
+{
+	SSL_SESSION *sess = test_session_alloc(id_byte);
+
+	TEST_CHECK(tls_cache_shared_store(request, store, sess, expires) == 0);
+	TEST_MSG("Failed storing session %u", id_byte);
+
+	SSL_SESSION_free(sess);
+}
+
+static int _test_tls_session_free(fr_tls_session_t *tls_session)
+{
+	SSL_free(tls_session->ssl);
+
+	return 0;
+}
+
+static fr_tls_session_t *test_tls_session_alloc(TALLOC_CTX *ctx)
+{
+	fr_tls_session_t *tls_session;
+
+	MEM(tls_session = talloc_zero(ctx, fr_tls_session_t));
+	MEM(tls_session->ssl = SSL_new(test_ssl_ctx));
+	SSL_set_ex_data(tls_session->ssl, FR_TLS_EX_INDEX_TLS_SESSION, tls_session);
+	MEM(tls_session->cache = talloc_zero(tls_session, fr_tls_cache_t));
+	talloc_set_destructor(tls_session, _test_tls_session_free);
+
+	return tls_session;
+}
+
+/** Load a session from the shared store, as a resumption attempt would
+ *
+ * @return
+ *	- true if the session was found, and had the expected ID.
+ *	- false if the session wasn't found.
+ */
+static bool test_session_load(request_t *request, fr_tls_session_t *tls_session,
+			      fr_tls_cache_store_t *store, uint8_t id_byte)
+{
+	fr_tls_cache_t	*tls_cache = tls_session->cache;
+	uint8_t		id[SSL_MAX_SSL_SESSION_ID_LENGTH];
+	uint8_t const	*sess_id;
+	unsigned int	sess_id_len;
+	bool		found = false;
+
+	memset(id, id_byte, sizeof(id));
+	MEM(tls_cache->load.id = talloc_memdup(tls_cache, id, sizeof(id)));
+	tls_cache->load.state = FR_TLS_CACHE_LOAD_REQUESTED;
+
+	tls_cache_shared_load(request, tls_session, store);
+
+	if (tls_cache->load.state == FR_TLS_CACHE_LOAD_RETRIEVED) {
+		TEST_ASSERT(tls_cache->load.sess != NULL);
+
+		sess_id = SSL_SESSION_get_id(tls_cache->load.sess, &sess_id_len);
+		TEST_CHECK((sess_id_len == sizeof(id)) && (memcmp(sess_id, id, sizeof(id)) == 0));
+		found = true;
+
+		SSL_SESSION_free(tls_cache->load.sess);
+		tls_cache->load.sess = NULL;
+	}
+
+	TALLOC_FREE(tls_cache->load.id);
+	tls_cache->load.state = FR_TLS_CACHE_LOAD_INIT;
+
+	return found;
+}
+
+/** Number of sessions in all the shards of a store
+ *
+ */
+static size_t test_store_entries(fr_tls_cache_store_t *store)
+{
+	size_t	i, entries = 0;
+
+	for (i = 0; i < NUM_ELEMENTS(store->shard); i++) entries += fr_dlist_num_elements(&store->shard[i].lru);
+
+	return entries;
+}
+
+static void test_shared_store(void)
+{
+	TALLOC_CTX		*ctx = talloc_init_const("test");
+	request_t		*request = request_alloc_external(ctx, NULL);
+	fr_tls_session_t	*tls_session = test_tls_session_alloc(ctx);
+	fr_tls_conf_t		*conf;
+	fr_tls_cache_store_t	*store;
+	fr_tls_cache_stats_t	before, after;
+	fr_time_t		expires = fr_time_add(fr_time(), fr_time_delta_from_sec(60));
+	uint8_t			id[SSL_MAX_SSL_SESSION_ID_LENGTH];
+
+	TEST_CASE("A store is only allocated for stateful, shared, caching");
+	MEM(conf = talloc_zero(ctx, fr_tls_conf_t));
+	conf->cache.mode = FR_TLS_CACHE_STATEFUL;
+	conf->cache.max_entries = 4096;
+	TEST_CHECK(fr_tls_cache_conf_init(conf, &conf->cache) == 0);
+	TEST_CHECK(conf->cache.store == NULL);
+
+	conf->cache.shared = true;
+	TEST_CHECK(fr_tls_cache_conf_init(conf, &conf->cache) == 0);
+	TEST_ASSERT(conf->cache.store != NULL);
+	store = conf->cache.store;
+
+	fr_tls_cache_stats(&before);
+
+	TEST_CASE("Stored sessions can be loaded");
+	test_session_store(request, store, 1, expires);
+	TEST_CHECK(test_session_load(request, tls_session, store, 1));
+
+	TEST_CASE("Unknown sessions aren't found");
+	TEST_CHECK(!test_session_load(request, tls_session, store, 2));
+
+	fr_tls_cache_stats(&after);
+	TEST_CHECK(after.stores - before.stores == 1);
+	TEST_CHECK(after.hits - before.hits == 1);
+	TEST_CHECK(after.misses - before.misses == 1);
+
+	TEST_CASE("Storing a session again replaces it");
+	test_session_store(request, store, 1, expires);
+	TEST_CHECK(test_store_entries(store) == 1);
+	TEST_CHECK(test_session_load(request, tls_session, store, 1));
+
+	TEST_CASE("Cleared sessions aren't found");
+	memset(id, 1, sizeof(id));
+	tls_cache_shared_clear(store, talloc_memdup(ctx, id, sizeof(id)));
+	TEST_CHECK(test_store_entries(store) == 0);
+	TEST_CHECK(!test_session_load(request, tls_session, store, 1));
+
+	TEST_CASE("Expired sessions aren't found, and are removed");
+	test_session_store(request, store, 3, fr_time_wrap(1));
+	TEST_CHECK(test_store_entries(store) == 1);
+	TEST_CHECK(!test_session_load(request, tls_session, store, 3));
+	TEST_CHECK(test_store_entries(store) == 0);
+
+	talloc_free(ctx);
+}
+
+static void test_shared_store_evict(void)
+{
+	TALLOC_CTX		*ctx = talloc_init_const("test");
+	request_t		*request = request_alloc_external(ctx, NULL);
+	fr_tls_session_t	*tls_session = test_tls_session_alloc(ctx);
+	fr_tls_cache_store_t	*store;
+	fr_tls_cache_stats_t	before, after;
+	fr_time_t		expires = fr_time_add(fr_time(), fr_time_delta_from_sec(60));
+	unsigned int		i;
+
+	/*
+	 *	One entry per shard
+	 */
+	store = tls_cache_store_alloc(ctx, NUM_ELEMENTS(store->shard));
+	TEST_ASSERT(store != NULL);
+
+	fr_tls_cache_stats(&before);
+
+	TEST_CASE("The store is bounded by max_entries");
+	for (i = 0; i < 64; i++) test_session_store(request, store, i, expires);
+
+	TEST_CHECK(test_store_entries(store) <= NUM_ELEMENTS(store->shard));
+	TEST_MSG("Expected at most %zu entries, got %zu", NUM_ELEMENTS(store->shard), test_store_entries(store));
+
+	fr_tls_cache_stats(&after);
+	TEST_CHECK((after.evictions - before.evictions) == (64 - test_store_entries(store)));
+
+	TEST_CASE("The most recently stored session is kept");
+	TEST_CHECK(test_session_load(request, tls_session, store, 63));
+
+	talloc_free(ctx);
+}
+
+/** Call the ticket key callback, as OpenSSL would when encrypting or decrypting a ticket
+ *
+ */
+static int test_ticket_key(SSL *ssl, uint8_t key_name[16], int enc)
+{
+	EVP_CIPHER_CTX		*cipher_ctx;
+	TLS_TICKET_MAC_CTX	*mac_ctx;
+	uint8_t			iv[EVP_MAX_IV_LENGTH] = { 0 };
+	int			ret;
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	EVP_MAC			*mac;
+
+	MEM(mac = EVP_MAC_fetch(NULL, "HMAC", NULL));
+	MEM(mac_ctx = EVP_MAC_CTX_new(mac));
+#else
+	MEM(mac_ctx = HMAC_CTX_new());
+#endif
+	MEM(cipher_ctx = EVP_CIPHER_CTX_new());
+
+	ret = tls_cache_ticket_key_cb(ssl, key_name, iv, cipher_ctx, mac_ctx, enc);
+
+	EVP_CIPHER_CTX_free(cipher_ctx);
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	EVP_MAC_CTX_free(mac_ctx);
+	EVP_MAC_free(mac);
+#else
+	HMAC_CTX_free(mac_ctx);
+#endif
+
+	return ret;
+}
+
+/** Allocate a session for an SSL_CTX of its own, using the given configuration
+ *
+ */
+static SSL *test_ssl_alloc(fr_tls_conf_t *conf)
+{
+	SSL_CTX	*ssl_ctx;
+	SSL	*ssl;
+
+	MEM(ssl_ctx = SSL_CTX_new(TLS_method()));
+	MEM(ssl = SSL_new(ssl_ctx));
+	SSL_CTX_free(ssl_ctx);		/* Reference held by ssl */
+
+	SSL_set_ex_data(ssl, FR_TLS_EX_INDEX_CONF, conf);
+
+	return ssl;
+}
+
+/** Make the keys due for rotation when the next ticket is encrypted
+ *
+ */
+static void test_ticket_keys_expire(fr_tls_cache_ticket_keys_t *keys)
+{
+	keys->interval = fr_time_delta_wrap(1);
+	keys->rotated = fr_time_wrap(0);
+}
+
+static void test_ticket_keys_shared(void)
+{
+	TALLOC_CTX			*ctx = talloc_init_const("test");
+	fr_tls_conf_t			*conf;
+	fr_tls_cache_ticket_keys_t	*keys;
+	fr_tls_cache_stats_t		before, after;
+	SSL				*a, *b;
+	uint8_t				name[16], old_name[16];
+
+	MEM(conf = talloc_zero(ctx, fr_tls_conf_t));
+	conf->cache.mode = FR_TLS_CACHE_STATELESS;
+	conf->cache.session_ticket_key_rotate = fr_time_delta_from_sec(3600);
+	TEST_CHECK(fr_tls_cache_conf_init(conf, &conf->cache) == 0);
+	TEST_ASSERT(conf->cache.ticket_keys != NULL);
+	keys = conf->cache.ticket_keys;
+
+	a = test_ssl_alloc(conf);
+	b = test_ssl_alloc(conf);
+
+	TEST_CASE("Tickets encrypted by one SSL_CTX are decrypted by another");
+	TEST_CHECK(test_ticket_key(a, name, 1) == 1);
+	TEST_CHECK(test_ticket_key(b, name, 0) == 1);
+
+	TEST_CASE("Tickets with unknown keys require a full handshake");
+	memset(old_name, 0xff, sizeof(old_name));
+	TEST_CHECK(test_ticket_key(b, old_name, 0) == 0);
+
+	TEST_CASE("Rotated keys are used by every SSL_CTX");
+	fr_tls_cache_stats(&before);
+	memcpy(old_name, name, sizeof(old_name));
+	test_ticket_keys_expire(keys);
+
+	TEST_CHECK(test_ticket_key(b, name, 1) == 1);
+	keys->interval = fr_time_delta_from_sec(3600);
+	TEST_CHECK(memcmp(name, old_name, sizeof(name)) != 0);
+	TEST_CHECK(test_ticket_key(a, name, 0) == 1);
+
+	fr_tls_cache_stats(&after);
+	TEST_CHECK(after.key_rotations - before.key_rotations == 1);
+
+	TEST_CASE("Tickets encrypted with the previous key are accepted, and reissued");
+	TEST_CHECK(test_ticket_key(a, old_name, 0) == 2);
+
+	SSL_free(a);
+	SSL_free(b);
+	talloc_free(ctx);
+}
+
+/** Write session ticket keys to a file
+ *
+ * Each key is filled with the corresponding byte in key_bytes.
+ */
+static void test_key_file_write(char const *file, uint8_t const *key_bytes, size_t num_keys)
+{
+	tls_cache_ticket_key_t	key;
+	FILE			*fp;
+	size_t			i;
+
+	fp = fopen(file, "w");
+	TEST_ASSERT(fp != NULL);
+
+	for (i = 0; i < num_keys; i++) {
+		memset(&key, key_bytes[i], sizeof(key));
+		TEST_CHECK(fwrite(&key, sizeof(key), 1, fp) == 1);
+	}
+
+	fclose(fp);
+}
+
+static void test_ticket_keys_file(void)
+{
+	TALLOC_CTX			*ctx = talloc_init_const("test");
+	fr_tls_conf_t			*conf;
+	fr_tls_cache_ticket_keys_t	*keys;
+	char				file[] = "/tmp/tls_cache_tests.XXXXXX";
+	uint8_t				name[16];
+	SSL				*ssl;
+	int				fd;
+
+	fd = mkstemp(file);
+	TEST_ASSERT(fd >= 0);
+	close(fd);
+
+	MEM(conf = talloc_zero(ctx, fr_tls_conf_t));
+	conf->cache.mode = FR_TLS_CACHE_STATELESS;
+	conf->cache.session_ticket_key_file = file;
+
+	TEST_CASE("Key files must contain one or two keys");
+	test_key_file_write(file, (uint8_t[]){ 0x01, 0x02, 0x03 }, 3);
+	TEST_CHECK(tls_cache_ticket_keys_alloc(ctx, &conf->cache) == NULL);
+
+	TEST_CASE("The first key encrypts tickets, the second only decrypts them");
+	test_key_file_write(file, (uint8_t[]){ 0x01, 0x02 }, 2);
+	TEST_CHECK(fr_tls_cache_conf_init(conf, &conf->cache) == 0);
+	TEST_ASSERT(conf->cache.ticket_keys != NULL);
+	keys = conf->cache.ticket_keys;
+
+	ssl = test_ssl_alloc(conf);
+
+	TEST_CHECK(test_ticket_key(ssl, name, 1) == 1);
+	TEST_CHECK(name[0] == 0x01);
+	memset(name, 0x02, sizeof(name));
+	TEST_CHECK(test_ticket_key(ssl, name, 0) == 2);
+
+	TEST_CASE("Keys are only rotated when the file changes");
+	test_ticket_keys_expire(keys);
+	TEST_CHECK(test_ticket_key(ssl, name, 1) == 1);
+	TEST_CHECK(name[0] == 0x01);
+
+	test_key_file_write(file, (uint8_t[]){ 0x03 }, 1);
+	test_ticket_keys_expire(keys);
+	TEST_CHECK(test_ticket_key(ssl, name, 1) == 1);
+	TEST_CHECK(name[0] == 0x03);
+	keys->interval = fr_time_delta_wrap(0);
+
+	TEST_CASE("The key from before the file changed is still accepted");
+	memset(name, 0x01, sizeof(name));
+	TEST_CHECK(test_ticket_key(ssl, name, 0) == 2);
+	memset(name, 0x02, sizeof(name));
+	TEST_CHECK(test_ticket_key(ssl, name, 0) == 0);
+
+	SSL_free(ssl);
+	unlink(file);
+	talloc_free(ctx);
+}
+
+TEST_LIST = {
+	{ "shared_store",		test_shared_store },
+	{ "shared_store_evict",		test_shared_store_evict },
+	{ "ticket_keys_shared",		test_ticket_keys_shared },
+	{ "ticket_keys_file",		test_ticket_keys_file },
+
+	{ NULL }
+};
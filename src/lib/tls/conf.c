@@ -96,12 +96,16 @@ static CONF_PARSER tls_cache_config[] = {
 #endif
 
 	{ FR_CONF_OFFSET("session_ticket_key", FR_TYPE_OCTETS, fr_tls_cache_conf_t, session_ticket_key) },
+	{ FR_CONF_OFFSET("session_ticket_key_file", FR_TYPE_FILE_INPUT, fr_tls_cache_conf_t, session_ticket_key_file) },
+	{ FR_CONF_OFFSET("session_ticket_key_rotate", FR_TYPE_TIME_DELTA, fr_tls_cache_conf_t, session_ticket_key_rotate), .dflt = "0" },
+
+	{ FR_CONF_OFFSET("shared", FR_TYPE_BOOL, fr_tls_cache_conf_t, shared), .dflt = "no" },
+	{ FR_CONF_OFFSET("max_entries", FR_TYPE_UINT32, fr_tls_cache_conf_t, max_entries), .dflt = "4096" },
 
 	/*
 	 *	Deprecated
 	 */
 	{ FR_CONF_DEPRECATED("enable", FR_TYPE_BOOL, fr_tls_cache_conf_t, NULL) },
-	{ FR_CONF_DEPRECATED("max_entries", FR_TYPE_UINT32, fr_tls_cache_conf_t, NULL) },
 	{ FR_CONF_DEPRECATED("persist_dir", FR_TYPE_STRING, fr_tls_cache_conf_t, NULL) },
 
 	CONF_PARSER_TERMINATOR
@@ -405,6 +409,14 @@ fr_tls_conf_t *fr_tls_conf_parse_server(CONF_SECTION *cs)
 		break;
 
 	case FR_TLS_CACHE_STATEFUL:
+		if (conf->cache.shared) {
+			if (conf->tls_min_version >= (float)1.3) {
+				ERROR("cache.mode = \"stateful\" is not supported with tls_min_version >= 1.3");
+				goto error;
+			}
+			break;
+		}
+
 		if (!conf->virtual_server) {
 			ERROR("A virtual_server must be set when cache.mode = \"stateful\"");
 			goto error;
@@ -435,6 +447,12 @@ fr_tls_conf_t *fr_tls_conf_parse_server(CONF_SECTION *cs)
 		break;
 
 	case FR_TLS_CACHE_AUTO:
+		/*
+		 *	The shared store doesn't need any
+		 *	cache sections.
+		 */
+		if (conf->cache.shared) break;
+
 		if (!conf->virtual_server) {
 			WARN("A virtual_server must be provided for stateful caching. "
 			     "cache.mode = \"auto\" rewritten to cache.mode = \"stateless\"");
@@ -484,6 +502,15 @@ fr_tls_conf_t *fr_tls_conf_parse_server(CONF_SECTION *cs)
 		}
 	}
 
+	/*
+	 *	Allocate the structures shared between
+	 *	all the SSL_CTXs created from this conf.
+	 */
+	if (fr_tls_cache_conf_init(conf, &conf->cache) < 0) goto error;
+
+	if (conf->verify.check_crl && conf->ca_file &&
+	    (fr_tls_verify_crl_index_alloc(conf, &conf->verify.crl_index, conf->ca_file) < 0)) goto error;
+
 	/*
 	 *	Cache conf in cs in case we're asked to parse this again.
 	 */
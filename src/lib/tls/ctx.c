@@ -608,7 +608,6 @@ int tls_ctx_version_set(
 SSL_CTX *fr_tls_ctx_alloc(fr_tls_conf_t const *conf, bool client)
 {
 	SSL_CTX		*ctx;
-	X509_STORE	*cert_vpstore;
 	X509_STORE	*verify_store;
 	int		verify_mode = SSL_VERIFY_NONE;
 	int		ctx_options = 0;
@@ -953,26 +952,7 @@ post_ca:
 	/*
 	 *	Check the certificates for revocation.
 	 */
-#ifdef X509_V_FLAG_CRL_CHECK_ALL
-	if (conf->verify.check_crl) {
-		cert_vpstore = SSL_CTX_get_cert_store(ctx);
-		if (cert_vpstore == NULL) {
-			fr_tls_log_error(NULL, "Error reading Certificate Store");
-	    		goto error;
-		}
-		X509_STORE_set_flags(cert_vpstore, X509_V_FLAG_CRL_CHECK | X509_V_FLAG_CRL_CHECK_ALL);
-#ifdef X509_V_FLAG_USE_DELTAS
-		/*
-		 *	If set, delta CRLs (if present) are used to
-		 *	determine certificate status. If not set
-		 *	deltas are ignored.
-		 *
-		 *	So it's safe to always set this flag.
-		 */
-		X509_STORE_set_flags(cert_vpstore, X509_V_FLAG_USE_DELTAS);
-#endif
-	}
-#endif
+	if (conf->verify.check_crl && (fr_tls_verify_crl_store_init(verify_store, &conf->verify) < 0)) goto error;
 
 	/*
 	 *	Set verify modes
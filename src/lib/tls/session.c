@@ -33,6 +33,7 @@
 #include <freeradius-devel/util/base16.h>
 #include <freeradius-devel/util/misc.h>
 #include <freeradius-devel/util/pair_legacy.h>
+#include <freeradius-devel/util/stdatomic.h>
 
 #include <freeradius-devel/protocol/freeradius/freeradius.internal.h>
 
@@ -49,6 +50,16 @@
 #include <openssl/x509v3.h>
 #include <openssl/ssl.h>
 
+static atomic_uint_fast64_t	tls_stats_handshakes;
+static atomic_uint_fast64_t	tls_stats_handshake_time;
+static atomic_uint_fast64_t	tls_stats_handshake_ssl_time;
+static atomic_uint_fast64_t	tls_stats_async_waits;
+static atomic_uint_fast64_t	tls_stats_async_wait_time;
+static atomic_uint_fast64_t	tls_stats_async_in_flight;
+static atomic_uint_fast64_t	tls_stats_async_in_flight_max;
+static atomic_uint_fast64_t	tls_stats_record_copied;
+static atomic_uint_fast64_t	tls_stats_record_referenced;
+
 static char const *tls_version_str[] = {
 	[SSL2_VERSION]				= "SSL 2.0",
 	[SSL3_VERSION]				= "SSL 3.0",
@@ -186,6 +197,7 @@ static char const *tls_handshake_type_str[] = {
 inline static void record_init(fr_tls_record_t *record)
 {
 	record->used = 0;
+	record->offset = 0;
 }
 
 /** Destroy a record buffer
@@ -195,6 +207,7 @@ inline static void record_init(fr_tls_record_t *record)
 inline static void record_close(fr_tls_record_t *record)
 {
 	record->used = 0;
+	record->offset = 0;
 }
 
 /** Copy data to the intermediate buffer, before we send it somewhere
@@ -211,8 +224,19 @@ inline static unsigned int record_from_buff(fr_tls_record_t *record, void const
 	if (added > inlen) added = inlen;
 	if (added == 0) return 0;
 
-	memcpy(record->data + record->used, in, added);
+	/*
+	 *	Only shift unread data down when
+	 *	there's no room left at the end.
+	 */
+	if ((record->offset + record->used + added) > FR_TLS_MAX_RECORD_SIZE) {
+		memmove(record->data, record->data + record->offset, record->used);
+		atomic_fetch_add_explicit(&tls_stats_record_copied, record->used, memory_order_relaxed);
+		record->offset = 0;
+	}
+
+	memcpy(record->data + record->offset + record->used, in, added);
 	record->used += added;
+	atomic_fetch_add_explicit(&tls_stats_record_copied, added, memory_order_relaxed);
 
 	return added;
 }
@@ -230,14 +254,17 @@ inline static unsigned int record_to_buff(fr_tls_record_t *record, void *out, un
 
 	if (taken > outlen) taken = outlen;
 	if (taken == 0) return 0;
-	if (out) memcpy(out, record->data, taken);
-
-	record->used -= taken;
+	if (out) {
+		memcpy(out, record->data + record->offset, taken);
+		atomic_fetch_add_explicit(&tls_stats_record_copied, taken, memory_order_relaxed);
+	}
 
 	/*
-	 *	This is pretty bad...
+	 *	Slice the buffer in place, the remaining
+	 *	data is left where it is.
 	 */
-	if (record->used > 0) memmove(record->data, record->data + taken, record->used);
+	record->used -= taken;
+	record->offset = record->used ? record->offset + taken : 0;
 
 	return taken;
 }
@@ -948,12 +975,14 @@ int fr_tls_session_recv(request_t *request, fr_tls_session_t *tls_session)
 	 *	Decrypt the complete record.
 	 */
 	if (tls_session->dirty_in.used) {
-		ret = BIO_write(tls_session->into_ssl, tls_session->dirty_in.data, tls_session->dirty_in.used);
+		ret = BIO_write(tls_session->into_ssl, tls_session->dirty_in.data + tls_session->dirty_in.offset,
+				tls_session->dirty_in.used);
 		if (ret != (int) tls_session->dirty_in.used) {
 			record_init(&tls_session->dirty_in);
 			REDEBUG("Failed writing %zd bytes to SSL BIO: %d", tls_session->dirty_in.used, ret);
 			goto error;
 		}
+		atomic_fetch_add_explicit(&tls_stats_record_copied, ret, memory_order_relaxed);
 
 		record_init(&tls_session->dirty_in);
 	}
@@ -1058,7 +1087,8 @@ int fr_tls_session_send(request_t *request, fr_tls_session_t *tls_session)
 			RDEBUG2("TLS application data to encrypt (%zu bytes)", tls_session->clean_in.used);
 		}
 
-		ret = SSL_write(tls_session->ssl, tls_session->clean_in.data, tls_session->clean_in.used);
+		ret = SSL_write(tls_session->ssl, tls_session->clean_in.data + tls_session->clean_in.offset,
+				tls_session->clean_in.used);
 		record_to_buff(&tls_session->clean_in, NULL, ret);
 
 		/* Get the dirty data from Bio to send it */
@@ -1066,6 +1096,7 @@ int fr_tls_session_send(request_t *request, fr_tls_session_t *tls_session)
 			       sizeof(tls_session->dirty_out.data));
 		if (ret > 0) {
 			tls_session->dirty_out.used = ret;
+			tls_session->dirty_out.offset = 0;
 			ret = 0;
 		} else {
 			if (fr_tls_log_io_error(request, SSL_get_error(tls_session->ssl, ret),
@@ -1117,6 +1148,7 @@ static void fr_tls_session_alert_send(request_t *request, fr_tls_session_t *sess
 	session->dirty_out.data[6] = session->pending_alert_description;
 
 	session->dirty_out.used = 7;
+	session->dirty_out.offset = 0;
 
 	session->pending_alert = false;
 	session->alerts_sent++;
@@ -1213,6 +1245,16 @@ static unlang_action_t tls_session_async_handshake_done_round(UNUSED rlm_rcode_t
 				fr_tls_session_request_unbind(tls_session->ssl);
 				return UNLANG_ACTION_CALCULATE_RESULT;
 			}
+
+			fr_tls_cache_handshake_done(tls_session->ssl);
+
+			atomic_fetch_add_explicit(&tls_stats_handshakes, 1, memory_order_relaxed);
+			if (fr_time_ispos(tls_session->handshake_start)) {
+				atomic_fetch_add_explicit(&tls_stats_handshake_time,
+							  fr_time_delta_unwrap(fr_time_sub(fr_time(),
+							  				   tls_session->handshake_start)),
+							  memory_order_relaxed);
+			}
 		}
 
 		if (RDEBUG_ENABLED3) {
@@ -1244,6 +1286,7 @@ static unlang_action_t tls_session_async_handshake_done_round(UNUSED rlm_rcode_t
 			       sizeof(tls_session->dirty_out.data));
 		if (ret > 0) {
 			tls_session->dirty_out.used = ret;
+			tls_session->dirty_out.offset = 0;
 		} else if (BIO_should_retry(tls_session->from_ssl)) {
 			record_init(&tls_session->dirty_in);
 			RDEBUG2("Asking for more data in tunnel");
@@ -1276,6 +1319,177 @@ static unlang_action_t tls_session_async_handshake_done_round(UNUSED rlm_rcode_t
 	return UNLANG_ACTION_CALCULATE_RESULT;
 }
 
+/** Stop waiting for an asynchronous crypto operation
+ *
+ * @param[in] request		The current request.
+ * @param[in] tls_session	that was waiting.
+ */
+static void tls_session_async_fd_clear(request_t *request, fr_tls_session_t *tls_session)
+{
+	fr_event_list_t	*el = unlang_interpret_event_list(request);
+	size_t		i;
+
+	if (!tls_session->async_fds) return;
+
+	for (i = 0; i < talloc_array_length(tls_session->async_fds); i++) {
+		if (el) (void) fr_event_fd_delete(el, tls_session->async_fds[i], FR_EVENT_FILTER_IO);
+	}
+	TALLOC_FREE(tls_session->async_fds);
+
+	atomic_fetch_sub_explicit(&tls_stats_async_in_flight, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&tls_stats_async_wait_time,
+				  fr_time_delta_unwrap(fr_time_sub(fr_time(), tls_session->async_start)),
+				  memory_order_relaxed);
+}
+
+/** An asynchronous crypto operation completed, so continue the handshake
+ *
+ */
+static void tls_session_async_fd_ready(UNUSED fr_event_list_t *el, UNUSED int fd, UNUSED int flags, void *uctx)
+{
+	fr_tls_session_t	*tls_session = talloc_get_type_abort(uctx, fr_tls_session_t);
+	request_t		*request = fr_tls_session_request(tls_session->ssl);
+
+	tls_session_async_fd_clear(request, tls_session);
+	unlang_interpret_mark_runnable(request);
+}
+
+/** Error on a file descriptor for an asynchronous crypto operation
+ *
+ * Continue the handshake anyway, and let libssl report the failure.
+ */
+static void tls_session_async_fd_error(fr_event_list_t *el, int fd, int flags,
+				       UNUSED int fd_errno, void *uctx)
+{
+	tls_session_async_fd_ready(el, fd, flags, uctx);
+}
+
+/** Yield until an asynchronous crypto operation completes
+ *
+ * When the private key operations are performed by an asynchronous
+ * engine, or provider, libssl pauses the handshake job and hands us
+ * file descriptors which become readable when the operation completes.
+ *
+ * Rather than calling SSL_read() repeatedly until the operation
+ * completes, we insert those file descriptors into the request's event
+ * list and yield, so the worker can process other requests.
+ *
+ * @param[in] request		The current request.
+ * @param[in] tls_session	waiting on the operation.
+ * @return
+ *	- UNLANG_ACTION_YIELD if we're waiting for the operation to complete.
+ *	- UNLANG_ACTION_CALCULATE_RESULT if there's nothing to wait on, and
+ *	  SSL_read() should be called again.
+ */
+static unlang_action_t tls_session_async_fd_wait(request_t *request, fr_tls_session_t *tls_session)
+{
+	fr_event_list_t	*el = unlang_interpret_event_list(request);
+	OSSL_ASYNC_FD	*fds;
+	size_t		i, num = 0;
+	uint64_t	in_flight, max;
+
+	if (!el || (SSL_get_all_async_fds(tls_session->ssl, NULL, &num) != 1) || (num == 0)) {
+		return UNLANG_ACTION_CALCULATE_RESULT;
+	}
+
+	MEM(fds = talloc_array(tls_session, OSSL_ASYNC_FD, num));
+	if (SSL_get_all_async_fds(tls_session->ssl, fds, &num) != 1) {
+		talloc_free(fds);
+		return UNLANG_ACTION_CALCULATE_RESULT;
+	}
+
+	for (i = 0; i < num; i++) {
+		if (fr_event_fd_insert(fds, el, fds[i],
+				       tls_session_async_fd_ready, NULL, tls_session_async_fd_error,
+				       tls_session) < 0) {
+			RPWDEBUG("Failed waiting for asynchronous crypto operation, retrying immediately");
+			while (i-- > 0) (void) fr_event_fd_delete(el, fds[i], FR_EVENT_FILTER_IO);
+			talloc_free(fds);
+			return UNLANG_ACTION_CALCULATE_RESULT;
+		}
+	}
+
+	tls_session->async_fds = fds;
+	tls_session->async_start = fr_time();
+
+	atomic_fetch_add_explicit(&tls_stats_async_waits, 1, memory_order_relaxed);
+	in_flight = atomic_fetch_add_explicit(&tls_stats_async_in_flight, 1, memory_order_relaxed) + 1;
+	max = atomic_load_explicit(&tls_stats_async_in_flight_max, memory_order_relaxed);
+	while ((in_flight > max) &&
+	       !atomic_compare_exchange_weak_explicit(&tls_stats_async_in_flight_max, &max, in_flight,
+						      memory_order_relaxed, memory_order_relaxed));
+
+	RDEBUG3("Waiting on %zu fd(s) for asynchronous crypto operation", num);
+
+	return UNLANG_ACTION_YIELD;
+}
+
+/** Whether a paused handshake is waiting on our own callbacks
+ *
+ * Our cache and certificate validation callbacks pause the handshake
+ * job after recording the operation they want performed.  If none
+ * are recorded, the job was paused by libssl's crypto code.
+ */
+static inline CC_HINT(always_inline)
+bool tls_session_async_pending(fr_tls_session_t const *tls_session)
+{
+	fr_tls_cache_t const *tls_cache = tls_session->cache;
+
+	if (tls_session->validate.state == FR_TLS_VALIDATION_REQUESTED) return true;
+	if (!tls_cache) return false;
+
+	return (tls_cache->load.state == FR_TLS_CACHE_LOAD_REQUESTED) ||
+	       (tls_cache->store.state == FR_TLS_CACHE_STORE_REQUESTED) ||
+	       (tls_cache->clear.state == FR_TLS_CACHE_CLEAR_REQUESTED);
+}
+
+/** Return handshake statistics
+ *
+ * @param[out] stats	to populate.
+ */
+void fr_tls_session_stats(fr_tls_session_stats_t *stats)
+{
+	stats->handshakes = atomic_load_explicit(&tls_stats_handshakes, memory_order_relaxed);
+	stats->handshake_time = atomic_load_explicit(&tls_stats_handshake_time, memory_order_relaxed);
+	stats->handshake_ssl_time = atomic_load_explicit(&tls_stats_handshake_ssl_time, memory_order_relaxed);
+	stats->async_waits = atomic_load_explicit(&tls_stats_async_waits, memory_order_relaxed);
+	stats->async_wait_time = atomic_load_explicit(&tls_stats_async_wait_time, memory_order_relaxed);
+	stats->async_in_flight = atomic_load_explicit(&tls_stats_async_in_flight, memory_order_relaxed);
+	stats->async_in_flight_max = atomic_load_explicit(&tls_stats_async_in_flight_max, memory_order_relaxed);
+	stats->record_copied = atomic_load_explicit(&tls_stats_record_copied, memory_order_relaxed);
+	stats->record_referenced = atomic_load_explicit(&tls_stats_record_referenced, memory_order_relaxed);
+}
+
+/** Queue encrypted data for OpenSSL to read, without copying it
+ *
+ * This is the scatter-gather alternative to record_from_buff(&tls_session->dirty_in, ...).
+ * The fragment is referenced in place, and OpenSSL reads it directly from owner the
+ * next time the handshake is advanced or application data is decrypted.
+ *
+ * @param[in] tls_session	to queue data for.
+ * @param[in] owner		talloced buffer containing data.  A reference is held
+ *				until OpenSSL has read the data.
+ * @param[in] data		to queue.
+ * @param[in] data_len		Length of data.
+ * @return
+ *	- 0 on success.
+ *	- -1 if the maximum record size would be exceeded.
+ */
+int fr_tls_session_record_in_ref(fr_tls_session_t *tls_session,
+				 void const *owner, uint8_t const *data, size_t data_len)
+{
+	if ((fr_tls_bio_chain_pending(tls_session->into_ssl_chain) + data_len) > FR_TLS_MAX_RECORD_SIZE) {
+		fr_strerror_const("Exceeded maximum record size");
+		return -1;
+	}
+
+	if (fr_tls_bio_chain_add(tls_session->into_ssl_chain, owner, data, data_len) < 0) return -1;
+
+	atomic_fetch_add_explicit(&tls_stats_record_referenced, data_len, memory_order_relaxed);
+
+	return 0;
+}
+
 /** Try very hard to get the SSL * into a consistent state where it's not yielded
  *
  * ...because if it's yielded, we'll probably leak thread contexts and all kinds of memory.
@@ -1284,13 +1498,15 @@ static unlang_action_t tls_session_async_handshake_done_round(UNUSED rlm_rcode_t
  * @param[in] action	we're being signalled with.
  * @param[in] uctx	the SSL * to cancell.
  */
-static void tls_session_async_handshake_signal(UNUSED request_t *request, fr_state_signal_t action, void *uctx)
+static void tls_session_async_handshake_signal(request_t *request, fr_state_signal_t action, void *uctx)
 {
 	fr_tls_session_t	*tls_session = talloc_get_type_abort(uctx, fr_tls_session_t);
 	int			ret;
 
 	if (action != FR_SIGNAL_CANCEL) return;
 
+	tls_session_async_fd_clear(request, tls_session);
+
 	/*
 	 *	We might want to set can_pause = false here
 	 *	but that would trigger asserts in the
@@ -1337,6 +1553,7 @@ static unlang_action_t tls_session_async_handshake_cont(rlm_rcode_t *p_result, i
 {
 	fr_tls_session_t	*tls_session = talloc_get_type_abort(uctx, fr_tls_session_t);
 	int			err;
+	fr_time_t		start;
 
 	RDEBUG3("(re-)entered state %s", __FUNCTION__);
 
@@ -1360,10 +1577,14 @@ static unlang_action_t tls_session_async_handshake_cont(rlm_rcode_t *p_result, i
 	 *	If acting as a server SSL_set_accept_state must have
 	 *	been called before this function.
 	 */
+again:
+	start = fr_time();
 	tls_session->can_pause = true;
 	tls_session->last_ret = SSL_read(tls_session->ssl, tls_session->clean_out.data + tls_session->clean_out.used,
 					 sizeof(tls_session->clean_out.data) - tls_session->clean_out.used);
 	tls_session->can_pause = false;
+	atomic_fetch_add_explicit(&tls_stats_handshake_ssl_time,
+				  fr_time_delta_unwrap(fr_time_sub(fr_time(), start)), memory_order_relaxed);
 	if (tls_session->last_ret > 0) {
 		tls_session->clean_out.used += tls_session->last_ret;
 
@@ -1424,22 +1645,34 @@ DIAG_ON(used-but-marked-unused)
 	 *	asynchronously.
 	 */
 	switch (err = SSL_get_error(tls_session->ssl, tls_session->last_ret)) {
-	case SSL_ERROR_WANT_ASYNC:	/* Certification validation or cache loads */
+	case SSL_ERROR_WANT_ASYNC:	/* Certification validation, cache loads, or crypto operations */
 	{
 		unlang_action_t ua;
 
 		RDEBUG3("Performing async action for libssl");
 
+		/*
+		 *	Paused by an asynchronous engine or provider
+		 *	performing crypto operations.  If it gave us
+		 *	nothing to wait on, continue the job straight
+		 *	away, as we won't be called again otherwise.
+		 */
+		if (!tls_session_async_pending(tls_session) &&
+		    (tls_session_async_fd_wait(request, tls_session) != UNLANG_ACTION_YIELD)) goto again;
+
 		/*
 		 *	Call this function again once we're done
 		 *	asynchronously satisfying the load request.
 		 */
 		if (unlikely(unlang_function_repeat_set(request, tls_session_async_handshake_cont) < 0)) {
 		error:
+			tls_session_async_fd_clear(request, tls_session);
 			tls_session->result = FR_TLS_RESULT_ERROR;
 			goto finish;
 		}
 
+		if (tls_session->async_fds) return UNLANG_ACTION_YIELD;
+
 		/*
 		 *	First service any pending cache actions
 		 */
@@ -1515,6 +1748,8 @@ static unlang_action_t tls_session_async_handshake(rlm_rcode_t *p_result, int *p
 
 	fr_tls_session_request_bind(tls_session->ssl, request);		/* May be unbound in this function or asynchronously */
 
+	if (!fr_time_ispos(tls_session->handshake_start)) tls_session->handshake_start = fr_time();
+
 	/*
 	 *	This is a logic error.  fr_tls_session_async_handshake
 	 *	must not be called if the handshake is
@@ -1540,12 +1775,14 @@ static unlang_action_t tls_session_async_handshake(rlm_rcode_t *p_result, int *p
 	 *	or continue the TLS handshake.
 	 */
 	if (tls_session->dirty_in.used) {
-		ret = BIO_write(tls_session->into_ssl, tls_session->dirty_in.data, tls_session->dirty_in.used);
+		ret = BIO_write(tls_session->into_ssl, tls_session->dirty_in.data + tls_session->dirty_in.offset,
+				tls_session->dirty_in.used);
 		if (ret != (int)tls_session->dirty_in.used) {
 			REDEBUG("Failed writing %zd bytes to TLS BIO: %d", tls_session->dirty_in.used, ret);
 			record_init(&tls_session->dirty_in);
 			goto error;
 		}
+		atomic_fetch_add_explicit(&tls_stats_record_copied, ret, memory_order_relaxed);
 		record_init(&tls_session->dirty_in);
 	}
 
@@ -1735,7 +1972,7 @@ fr_tls_session_t *fr_tls_session_alloc_server(TALLOC_CTX *ctx, SSL_CTX *ssl_ctx,
 	 *	and we can update those BIOs from the packets we've
 	 *	received.
 	 */
-	MEM(tls_session->into_ssl = BIO_new(BIO_s_mem()));
+	MEM(tls_session->into_ssl = fr_tls_bio_chain_alloc(&tls_session->into_ssl_chain, &tls_stats_record_copied));
 	MEM(tls_session->from_ssl = BIO_new(BIO_s_mem()));
 	SSL_set_bio(tls_session->ssl, tls_session->into_ssl, tls_session->from_ssl);
 
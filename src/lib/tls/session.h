@@ -32,6 +32,7 @@ RCSIDH(session_h, "$Id$")
 
 typedef struct fr_tls_session_s fr_tls_session_t;
 
+#include "bio.h"
 #include "cache.h"
 #include "conf.h"
 #include "index.h"
@@ -63,7 +64,9 @@ extern "C" {
  */
 typedef struct {
 	uint8_t		data[FR_TLS_MAX_RECORD_SIZE];
-	size_t 		used;
+	size_t 		used;		//!< How much data is in the buffer, starting at offset.
+	size_t		offset;		//!< Where unread data starts.  Reads advance this
+					///< instead of shifting the remaining data down.
 } fr_tls_record_t;
 
 typedef enum {
@@ -94,6 +97,25 @@ typedef enum {
 	FR_TLS_RESULT_SUCCESS		= 0x02		//!< Handshake round succeed.
 } fr_tls_result_t;
 
+/** Handshake statistics
+ *
+ * All times are in nanoseconds.
+ */
+typedef struct {
+	uint64_t	handshakes;			//!< Completed handshakes.
+	uint64_t	handshake_time;			//!< Time from the first handshake round to completion.
+	uint64_t	handshake_ssl_time;		//!< Time spent in libssl during handshake rounds.
+	uint64_t	async_waits;			//!< Times a handshake yielded for an asynchronous
+							///< crypto operation.
+	uint64_t	async_wait_time;		//!< Time spent waiting for asynchronous crypto operations.
+	uint64_t	async_in_flight;		//!< Handshakes currently waiting.
+	uint64_t	async_in_flight_max;		//!< Most handshakes waiting at once.
+	uint64_t	record_copied;			//!< Bytes copied in and out of record buffers,
+							///< and into OpenSSL's buffers.
+	uint64_t	record_referenced;		//!< Bytes queued for OpenSSL in the packets they
+							///< arrived in, rather than in a record buffer.
+} fr_tls_session_stats_t;
+
 /** Tracks the state of a TLS session
  *
  * Currently used for RADSEC and EAP-TLS + dependents (EAP-TTLS, EAP-PEAP etc...).
@@ -109,6 +131,7 @@ struct fr_tls_session_s {
 	fr_tls_info_t		info;				//!< Information about the state of the TLS session.
 
 	BIO 			*into_ssl;			//!< Basic I/O input to OpenSSL.
+	fr_tls_bio_chain_t	*into_ssl_chain;		//!< Fragments waiting to be read through into_ssl.
 	BIO 			*from_ssl;			//!< Basic I/O output from OpenSSL.
 	fr_tls_record_t 	clean_in;			//!< Cleartext data that needs to be encrypted.
 	fr_tls_record_t 	clean_out;			//!< Cleartext data that's been encrypted.
@@ -116,6 +139,11 @@ struct fr_tls_session_s {
 	fr_tls_record_t 	dirty_out;			//!< Encrypted data that's been decrypted.
 	int			last_ret;			//!< Last result returned by SSL_read().
 
+	fr_time_t		handshake_start;		//!< When the first handshake round started.
+	OSSL_ASYNC_FD		*async_fds;			//!< File descriptors we're waiting on for an
+								///< asynchronous crypto operation to complete.
+	fr_time_t		async_start;			//!< When we started waiting.
+
 	void 			(*record_init)(fr_tls_record_t *buf);
 	void 			(*record_close)(fr_tls_record_t *buf);
 	unsigned int 		(*record_from_buff)(fr_tls_record_t *buf, void const *ptr, unsigned int size);
@@ -309,6 +337,11 @@ int 		fr_tls_session_alert(request_t *request, fr_tls_session_t *tls_session, ui
 
 unlang_action_t	fr_tls_session_async_handshake_push(request_t *request, fr_tls_session_t *tls_session);
 
+void		fr_tls_session_stats(fr_tls_session_stats_t *stats);
+
+int		fr_tls_session_record_in_ref(fr_tls_session_t *tls_session,
+					     void const *owner, uint8_t const *data, size_t data_len);
+
 fr_tls_session_t *fr_tls_session_alloc_client(TALLOC_CTX *ctx, SSL_CTX *ssl_ctx);
 
 fr_tls_session_t *fr_tls_session_alloc_server(TALLOC_CTX *ctx, SSL_CTX *ssl_ctx, request_t *request, bool client_cert);
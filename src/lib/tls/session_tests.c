@@ -0,0 +1,444 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or (at
+ *   your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/** Tests for asynchronous crypto waits, and handshake statistics
+ *
+ * @file src/lib/tls/session_tests.c
+ *
+ * @copyright 2022 The FreeRADIUS server project
+ */
+#define USE_CONSTRUCTOR
+
+/*
+ * It should be declared before include the "acutest.h"
+ */
+#ifdef USE_CONSTRUCTOR
+static void test_init(void) __attribute__((constructor));
+#else
+static void test_init(void);
+#  define TEST_INIT  test_init()
+#endif
+
+#include <freeradius-devel/util/acutest.h>
+#include <freeradius-devel/util/acutest_helpers.h>
+
+#include <freeradius-devel/unlang/interpret.h>
+
+#include <openssl/async.h>
+#include <openssl/pem.h>
+#include <openssl/ssl.h>
+
+/*
+ *	There's no asynchronous engine or interpreter here, so
+ *	substitute the file descriptors libssl would hand us, and
+ *	the event list of the interpreter running the request.
+ */
+static fr_event_list_t	*test_el;
+static OSSL_ASYNC_FD	test_async_fds[1];
+static size_t		test_async_fds_num;
+static int		test_runnable;
+
+static int test_get_all_async_fds(UNUSED SSL *ssl, OSSL_ASYNC_FD *fds, size_t *numfds)
+{
+	if (fds) memcpy(fds, test_async_fds, sizeof(test_async_fds[0]) * test_async_fds_num);
+	*numfds = test_async_fds_num;
+
+	return 1;
+}
+
+static fr_event_list_t *test_event_list(UNUSED request_t *request)
+{
+	return test_el;
+}
+
+static void test_mark_runnable(UNUSED request_t *request)
+{
+	test_runnable++;
+}
+
+#define SSL_get_all_async_fds		test_get_all_async_fds
+#define unlang_interpret_event_list	test_event_list
+#define unlang_interpret_mark_runnable	test_mark_runnable
+
+#include "session.c"
+
+static TALLOC_CTX	*autofree;
+static SSL_CTX		*test_client_ctx;
+static fr_dict_t	*dict_internal;
+static char		test_cert_file[] = "/tmp/tls_session_tests.XXXXXX";
+static int		test_pauses;
+
+/** Write a self-signed certificate and its key to a temporary file
+ *
+ */
+static int test_cert_file_write(void)
+{
+	EVP_PKEY_CTX	*pctx;
+	EVP_PKEY	*key = NULL;
+	X509		*cert;
+	X509_NAME	*name;
+	FILE		*fp;
+	int		fd, ret = -1;
+
+	pctx = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, NULL);
+	if (!pctx) return -1;
+	if ((EVP_PKEY_keygen_init(pctx) != 1) ||
+	    (EVP_PKEY_CTX_set_ec_paramgen_curve_nid(pctx, NID_X9_62_prime256v1) != 1) ||
+	    (EVP_PKEY_keygen(pctx, &key) != 1)) {
+		EVP_PKEY_CTX_free(pctx);
+		return -1;
+	}
+	EVP_PKEY_CTX_free(pctx);
+
+	cert = X509_new();
+	if (!cert) goto finish;
+
+	ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+	X509_gmtime_adj(X509_getm_notBefore(cert), -3600);
+	X509_gmtime_adj(X509_getm_notAfter(cert), 86400);
+	name = X509_get_subject_name(cert);
+	X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, (unsigned char const *)"server", -1, -1, 0);
+	X509_set_issuer_name(cert, name);
+	X509_set_pubkey(cert, key);
+	if (X509_sign(cert, key, EVP_sha256()) <= 0) goto finish;
+
+	fd = mkstemp(test_cert_file);
+	if (fd < 0) goto finish;
+
+	fp = fdopen(fd, "w");
+	if (!fp) {
+		close(fd);
+		goto finish;
+	}
+	if ((PEM_write_X509(fp, cert) == 1) &&
+	    (PEM_write_PrivateKey(fp, key, NULL, NULL, 0, NULL, NULL) == 1)) ret = 0;
+	fclose(fp);
+
+finish:
+	X509_free(cert);
+	EVP_PKEY_free(key);
+
+	return ret;
+}
+
+static void test_cert_file_unlink(void)
+{
+	unlink(test_cert_file);
+}
+
+/** Global initialisation
+ */
+static void test_init(void)
+{
+	autofree = talloc_autofree_context();
+	if (!autofree) {
+	error:
+		fr_perror("tls_session_tests");
+		fr_exit_now(EXIT_FAILURE);
+	}
+
+	/*
+	 *	Mismatch between the binary and the libraries it depends on
+	 */
+	if (fr_check_lib_magic(RADIUSD_MAGIC_NUMBER) < 0) goto error;
+
+	if (fr_openssl_init() < 0) goto error;
+
+	if (!fr_dict_global_ctx_init(autofree, "share/dictionary")) goto error;
+
+	if (fr_dict_internal_afrom_file(&dict_internal, FR_DICTIONARY_INTERNAL_DIR, __FILE__) < 0) goto error;
+
+	if (fr_tls_dict_init() < 0) goto error;
+
+	if (request_global_init() < 0) goto error;
+
+	test_el = fr_event_list_alloc(autofree, NULL, NULL);
+	if (!test_el) goto error;
+
+	test_client_ctx = SSL_CTX_new(TLS_client_method());
+	if (!test_client_ctx) goto error;
+
+	if (test_cert_file_write() < 0) goto error;
+	atexit(test_cert_file_unlink);
+}
+
+static int _test_tls_session_free(fr_tls_session_t *tls_session)
+{
+	SSL_free(tls_session->ssl);
+
+	return 0;
+}
+
+/** Allocate a session with no BIOs, for exercising the async fd code in isolation
+ *
+ */
+static fr_tls_session_t *test_tls_session_alloc(TALLOC_CTX *ctx)
+{
+	fr_tls_session_t *tls_session;
+
+	MEM(tls_session = talloc_zero(ctx, fr_tls_session_t));
+	MEM(tls_session->ssl = SSL_new(test_client_ctx));
+	SSL_set_ex_data(tls_session->ssl, FR_TLS_EX_INDEX_TLS_SESSION, tls_session);
+	talloc_set_destructor(tls_session, _test_tls_session_free);
+
+	return tls_session;
+}
+
+/** Pause the handshake job the way an engine does, but without giving us anything to wait on
+ *
+ */
+static int test_client_hello_pause(UNUSED SSL *ssl, UNUSED int *al, UNUSED void *arg)
+{
+	if (ASYNC_get_current_job()) {
+		test_pauses++;
+		ASYNC_pause_job();
+	}
+
+	return SSL_CLIENT_HELLO_SUCCESS;
+}
+
+static SSL_CTX *test_server_ctx_alloc(TALLOC_CTX *ctx, bool async)
+{
+	SSL_CTX		*ssl_ctx;
+	fr_tls_conf_t	*conf;
+
+	MEM(conf = talloc_zero(ctx, fr_tls_conf_t));
+	conf->cache.mode = FR_TLS_CACHE_DISABLED;
+	conf->fragment_size = FR_TLS_MAX_RECORD_SIZE;
+
+	MEM(ssl_ctx = SSL_CTX_new(TLS_server_method()));
+	SSL_CTX_set_ex_data(ssl_ctx, FR_TLS_EX_INDEX_CONF, conf);
+
+	if (async) {
+		SSL_CTX_set_mode(ssl_ctx, SSL_MODE_ASYNC);
+		SSL_CTX_set_client_hello_cb(ssl_ctx, test_client_hello_pause, NULL);
+	}
+
+	return ssl_ctx;
+}
+
+/** Run a full handshake between an OpenSSL client and a server session
+ *
+ * Each round feeds the client's output to the server session, and the
+ * server session's output back to the client, as EAP-TLS would.
+ */
+static void test_handshake(bool async)
+{
+	TALLOC_CTX		*ctx = talloc_init_const("test");
+	request_t		*request = request_alloc_external(ctx, NULL);
+	SSL_CTX			*ssl_ctx = test_server_ctx_alloc(ctx, async);
+	fr_tls_session_t	*tls_session;
+	fr_pair_t		*vp;
+	SSL			*client;
+	BIO			*client_in, *client_out;
+	fr_tls_session_stats_t	before, after;
+	rlm_rcode_t		rcode;
+	int			priority, i, len;
+	uint8_t			buff[FR_TLS_MAX_RECORD_SIZE];
+
+	MEM(pair_append_control(&vp, attr_tls_session_cert_file) >= 0);
+	fr_pair_value_strdup(vp, test_cert_file, false);
+
+	tls_session = fr_tls_session_alloc_server(ctx, ssl_ctx, request, false);
+	TEST_ASSERT(tls_session != NULL);
+
+	MEM(client = SSL_new(test_client_ctx));
+	MEM(client_in = BIO_new(BIO_s_mem()));
+	MEM(client_out = BIO_new(BIO_s_mem()));
+	SSL_set_bio(client, client_in, client_out);
+	SSL_set_connect_state(client);
+
+	fr_tls_session_stats(&before);
+	test_pauses = 0;
+	test_async_fds_num = 0;
+
+	for (i = 0; (i < 10) && !(SSL_is_init_finished(client) && SSL_is_init_finished(tls_session->ssl)); i++) {
+		(void) SSL_do_handshake(client);
+
+		len = BIO_read(client_out, buff, sizeof(buff));
+		if (len > 0) TEST_CHECK(tls_session->record_from_buff(&tls_session->dirty_in, buff, len) == (unsigned int)len);
+
+		if (!SSL_is_init_finished(tls_session->ssl)) {
+			TEST_CHECK(tls_session_async_handshake(&rcode, &priority,
+							       request, tls_session) == UNLANG_ACTION_CALCULATE_RESULT);
+			TEST_CHECK(tls_session->result == FR_TLS_RESULT_SUCCESS);
+			TEST_MSG("Handshake round %i left result %i", i, tls_session->result);
+		}
+
+		if (tls_session->dirty_out.used) {
+			TEST_CHECK(BIO_write(client_in, tls_session->dirty_out.data + tls_session->dirty_out.offset,
+					     tls_session->dirty_out.used) == (int)tls_session->dirty_out.used);
+			record_init(&tls_session->dirty_out);
+		}
+	}
+	TEST_CHECK(SSL_is_init_finished(client));
+	TEST_CHECK(SSL_is_init_finished(tls_session->ssl));
+	TEST_MSG("Handshake did not complete after %i rounds", i);
+
+	/*
+	 *	The request must have been unbound, even if the
+	 *	handshake job was paused.
+	 */
+	TEST_CHECK(SSL_get_ex_data(tls_session->ssl, FR_TLS_EX_INDEX_REQUEST) == NULL);
+
+	fr_tls_session_stats(&after);
+	TEST_CHECK(after.handshakes == before.handshakes + 1);
+	TEST_CHECK(after.handshake_time > before.handshake_time);
+	TEST_CHECK(after.handshake_ssl_time > before.handshake_ssl_time);
+	TEST_CHECK(after.async_waits == before.async_waits);
+	TEST_CHECK(after.async_in_flight == before.async_in_flight);
+
+	TEST_CHECK(test_pauses == (async ? 1 : 0));
+	TEST_MSG("Expected %i pauses, got %i", async ? 1 : 0, test_pauses);
+
+	SSL_free(client);
+	talloc_free(ctx);
+	SSL_CTX_free(ssl_ctx);
+}
+
+static void test_async_wait(void)
+{
+	TALLOC_CTX		*ctx = talloc_init_const("test");
+	request_t		*request = request_alloc_external(ctx, NULL);
+	fr_tls_session_t	*tls_session = test_tls_session_alloc(ctx);
+	fr_tls_session_stats_t	before, after;
+	int			fds[2];
+	char			c = 0;
+
+	TEST_ASSERT(pipe(fds) == 0);
+	test_async_fds[0] = fds[0];
+	test_async_fds_num = 1;
+	test_runnable = 0;
+
+	fr_tls_session_request_bind(tls_session->ssl, request);
+	fr_tls_session_stats(&before);
+
+	TEST_CHECK(tls_session_async_fd_wait(request, tls_session) == UNLANG_ACTION_YIELD);
+	TEST_CHECK(tls_session->async_fds != NULL);
+	TEST_CHECK(fr_event_list_num_fds(test_el) == 1);
+
+	fr_tls_session_stats(&after);
+	TEST_CHECK(after.async_waits == before.async_waits + 1);
+	TEST_CHECK(after.async_in_flight == before.async_in_flight + 1);
+	TEST_CHECK(after.async_in_flight_max >= after.async_in_flight);
+
+	/*
+	 *	Nothing happens until the operation completes
+	 */
+	TEST_CHECK(fr_event_corral(test_el, fr_time(), false) == 0);
+	TEST_CHECK(test_runnable == 0);
+
+	TEST_CHECK(write(fds[1], &c, sizeof(c)) == sizeof(c));
+	TEST_CHECK(fr_event_corral(test_el, fr_time(), true) > 0);
+	fr_event_service(test_el);
+
+	TEST_CHECK(test_runnable == 1);
+	TEST_CHECK(tls_session->async_fds == NULL);
+	TEST_CHECK(fr_event_list_num_fds(test_el) == 0);
+
+	fr_tls_session_stats(&after);
+	TEST_CHECK(after.async_in_flight == before.async_in_flight);
+	TEST_CHECK(after.async_wait_time > before.async_wait_time);
+
+	fr_tls_session_request_unbind(tls_session->ssl);
+	close(fds[0]);
+	close(fds[1]);
+	talloc_free(ctx);
+}
+
+static void test_async_cancel(void)
+{
+	TALLOC_CTX		*ctx = talloc_init_const("test");
+	request_t		*request = request_alloc_external(ctx, NULL);
+	fr_tls_session_t	*tls_session = test_tls_session_alloc(ctx);
+	fr_tls_session_stats_t	before, after;
+	int			fds[2];
+
+	TEST_ASSERT(pipe(fds) == 0);
+	test_async_fds[0] = fds[0];
+	test_async_fds_num = 1;
+	test_runnable = 0;
+
+	fr_tls_session_stats(&before);
+
+	TEST_CHECK(tls_session_async_fd_wait(request, tls_session) == UNLANG_ACTION_YIELD);
+	TEST_CHECK(fr_event_list_num_fds(test_el) == 1);
+
+	/*
+	 *	As the signal handler does when the request is cancelled
+	 */
+	tls_session_async_fd_clear(request, tls_session);
+	TEST_CHECK(tls_session->async_fds == NULL);
+	TEST_CHECK(fr_event_list_num_fds(test_el) == 0);
+	TEST_CHECK(test_runnable == 0);
+
+	fr_tls_session_stats(&after);
+	TEST_CHECK(after.async_waits == before.async_waits + 1);
+	TEST_CHECK(after.async_in_flight == before.async_in_flight);
+
+	/*
+	 *	Clearing twice must not count the wait twice
+	 */
+	tls_session_async_fd_clear(request, tls_session);
+	fr_tls_session_stats(&after);
+	TEST_CHECK(after.async_in_flight == before.async_in_flight);
+
+	close(fds[0]);
+	close(fds[1]);
+	talloc_free(ctx);
+}
+
+static void test_async_no_fds(void)
+{
+	TALLOC_CTX		*ctx = talloc_init_const("test");
+	request_t		*request = request_alloc_external(ctx, NULL);
+	fr_tls_session_t	*tls_session = test_tls_session_alloc(ctx);
+	fr_tls_session_stats_t	before, after;
+
+	test_async_fds_num = 0;
+
+	fr_tls_session_stats(&before);
+
+	TEST_CHECK(tls_session_async_fd_wait(request, tls_session) == UNLANG_ACTION_CALCULATE_RESULT);
+	TEST_CHECK(tls_session->async_fds == NULL);
+	TEST_CHECK(fr_event_list_num_fds(test_el) == 0);
+
+	fr_tls_session_stats(&after);
+	TEST_CHECK(after.async_waits == before.async_waits);
+	TEST_CHECK(after.async_in_flight == before.async_in_flight);
+
+	talloc_free(ctx);
+}
+
+static void test_handshake_sync(void)
+{
+	test_handshake(false);
+}
+
+static void test_handshake_paused(void)
+{
+	test_handshake(true);
+}
+
+TEST_LIST = {
+	{ "async_wait",			test_async_wait },
+	{ "async_cancel",		test_async_cancel },
+	{ "async_no_fds",		test_async_no_fds },
+	{ "handshake_sync",		test_handshake_sync },
+	{ "handshake_paused",		test_handshake_paused },
+
+	{ NULL }
+};
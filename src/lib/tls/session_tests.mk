@@ -0,0 +1,8 @@
+TARGET		:= tls_session_tests
+
+SOURCES		:= session_tests.c
+
+TGT_LDLIBS	:= $(LIBS) $(OPENSSL_LIBS) $(GPERFTOOLS_LIBS)
+TGT_LDFLAGS	:= $(LDFLAGS) $(OPENSSL_FLAGS) $(GPERFTOOLS_LDFLAGS)
+
+TGT_PREREQS	:= libfreeradius-tls.a libfreeradius-util.la libfreeradius-server.a libfreeradius-unlang.a
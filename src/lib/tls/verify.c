@@ -41,6 +41,34 @@
 #include "attrs.h"
 #include "base.h"
 
+#include <openssl/pem.h>
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#  define CRL_LOOKUP_CONST const
+#else
+#  define CRL_LOOKUP_CONST
+#endif
+
+/** CRLs issued by a single issuer
+ *
+ */
+typedef struct {
+	uint8_t const		*der;		//!< DER encoded issuer name.  Points into the first CRL.
+	size_t			der_len;	//!< Length of the issuer name.
+	uint32_t		hash;		//!< Hash of the issuer name.
+	STACK_OF(X509_CRL)	*crls;		//!< CRLs issued by this issuer.
+} tls_crl_issuer_t;
+
+/** CRLs indexed by issuer
+ *
+ * Built once, when the configuration is parsed, and only read
+ * afterwards, so it's shared between threads without locking.
+ */
+struct fr_tls_crl_index_s {
+	tls_crl_issuer_t	*issuer;	//!< Sorted by hash, then issuer name.
+	size_t			num;		//!< Number of issuers.
+};
+
 /** Check to see if a verification operation should apply to a certificate
  *
  * @param[in] depth	starting at 0.
@@ -540,4 +568,227 @@ unlang_action_t fr_tls_verify_cert_pending_push(request_t *request, fr_tls_sessi
 
 	return UNLANG_ACTION_CALCULATE_RESULT;
 }
+
+/** Order issuers by name hash, then by name
+ *
+ */
+static int tls_crl_issuer_cmp(void const *one, void const *two)
+{
+	tls_crl_issuer_t const *a = one, *b = two;
+	int ret;
+
+	ret = CMP(a->hash, b->hash);
+	if (ret != 0) return ret;
+
+	ret = CMP(a->der_len, b->der_len);
+	if (ret != 0) return ret;
+
+	return memcmp(a->der, b->der, a->der_len);
+}
+
+static int _tls_crl_index_free(fr_tls_crl_index_t *index)
+{
+	size_t i;
+
+	for (i = 0; i < index->num; i++) sk_X509_CRL_pop_free(index->issuer[i].crls, X509_CRL_free);
+
+	return 0;
+}
+
+/** Index the CRLs in a file by issuer
+ *
+ * OpenSSL finds the CRLs for an issuer by searching the X509_STORE, which
+ * means taking the store's lock, and for a ca_path, going back to disk.
+ * Indexing the CRLs once lets every thread find them with a binary search.
+ *
+ * @param[in] ctx	to allocate the index in.
+ * @param[out] out	Where to write the index.  NULL if the file contained no CRLs.
+ * @param[in] file	to read CRLs from.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int fr_tls_verify_crl_index_alloc(TALLOC_CTX *ctx, fr_tls_crl_index_t **out, char const *file)
+{
+	fr_tls_crl_index_t	*index;
+	tls_crl_issuer_t	*crls;
+	STACK_OF(X509_INFO)	*info;
+	ASN1_INTEGER		*serial;
+	BIO			*in;
+	size_t			i, num = 0;
+
+	*out = NULL;
+
+	in = BIO_new_file(file, "r");
+	if (!in) {
+		fr_tls_log_error(NULL, "Failed opening \"%s\" to index CRLs", file);
+		return -1;
+	}
+	info = PEM_X509_INFO_read_bio(in, NULL, NULL, NULL);
+	BIO_free(in);
+	if (!info) {
+		fr_tls_log_error(NULL, "Failed reading CRLs from \"%s\"", file);
+		return -1;
+	}
+
+	MEM(crls = talloc_array(NULL, tls_crl_issuer_t, sk_X509_INFO_num(info)));
+	MEM(serial = ASN1_INTEGER_new());
+
+	for (i = 0; i < (size_t)sk_X509_INFO_num(info); i++) {
+		X509_INFO		*item = sk_X509_INFO_value(info, (int)i);
+		X509_REVOKED		*revoked;
+
+		if (!item->crl) continue;
+
+		if (X509_NAME_get0_der(X509_CRL_get_issuer(item->crl), &crls[num].der, &crls[num].der_len) != 1) {
+			fr_tls_log_error(NULL, "Failed encoding CRL issuer from \"%s\"", file);
+		error:
+			while (num > 0) sk_X509_CRL_pop_free(crls[--num].crls, X509_CRL_free);
+			talloc_free(crls);
+			ASN1_INTEGER_free(serial);
+			sk_X509_INFO_pop_free(info, X509_INFO_free);
+			return -1;
+		}
+		crls[num].hash = fr_hash(crls[num].der, crls[num].der_len);
+
+		/*
+		 *	OpenSSL sorts the revoked certificates the
+		 *	first time they're searched, taking a write
+		 *	lock on the CRL.  Do that now, so worker
+		 *	threads only ever read.
+		 */
+		(void) X509_CRL_get0_by_serial(item->crl, &revoked, serial);
+
+		/*
+		 *	Temporarily use the stack to carry the
+		 *	CRL, it's replaced when we merge issuers.
+		 */
+		X509_CRL_up_ref(item->crl);
+		MEM(crls[num].crls = sk_X509_CRL_new_null());
+		if (!sk_X509_CRL_push(crls[num].crls, item->crl)) {
+			X509_CRL_free(item->crl);
+			sk_X509_CRL_free(crls[num].crls);
+			goto error;
+		}
+		num++;
+	}
+	ASN1_INTEGER_free(serial);
+
+	if (num == 0) {
+		talloc_free(crls);
+		sk_X509_INFO_pop_free(info, X509_INFO_free);
+		return 0;
+	}
+
+	qsort(crls, num, sizeof(crls[0]), tls_crl_issuer_cmp);
+
+	MEM(index = talloc_zero(ctx, fr_tls_crl_index_t));
+	MEM(index->issuer = talloc_array(index, tls_crl_issuer_t, num));
+	talloc_set_destructor(index, _tls_crl_index_free);
+
+	/*
+	 *	Merge CRLs from the same issuer
+	 */
+	for (i = 0; i < num; i++) {
+		if ((index->num > 0) && (tls_crl_issuer_cmp(&index->issuer[index->num - 1], &crls[i]) == 0)) {
+			X509_CRL *crl = sk_X509_CRL_pop(crls[i].crls);
+
+			sk_X509_CRL_free(crls[i].crls);
+			if (!sk_X509_CRL_push(index->issuer[index->num - 1].crls, crl)) X509_CRL_free(crl);
+			continue;
+		}
+		index->issuer[index->num++] = crls[i];
+	}
+	talloc_free(crls);
+	sk_X509_INFO_pop_free(info, X509_INFO_free);	/* CRLs we use have been up-ref'd */
+
+	DEBUG2("Indexed %zu CRL(s) from %zu issuer(s) in \"%s\"", num, index->num, file);
+
+	*out = index;
+
+	return 0;
+}
+
+/** Find the CRLs for an issuer
+ *
+ * Uses the index built from the ca_file, falling back to OpenSSL's
+ * lookup for issuers whose CRLs weren't indexed.
+ */
+static STACK_OF(X509_CRL) *tls_verify_crl_lookup(CRL_LOOKUP_CONST X509_STORE_CTX *x509_ctx,
+						 CRL_LOOKUP_CONST X509_NAME *name)
+{
+	SSL			*ssl;
+	fr_tls_conf_t		*conf;
+	tls_crl_issuer_t	find, *issuer;
+	STACK_OF(X509_CRL)	*crls;
+	int			i;
+
+	ssl = X509_STORE_CTX_get_ex_data(UNCONST(X509_STORE_CTX *, x509_ctx), SSL_get_ex_data_X509_STORE_CTX_idx());
+	if (!ssl) goto fallback;
+
+	conf = fr_tls_session_conf(ssl);
+	if (!conf->verify.crl_index ||
+	    (X509_NAME_get0_der(UNCONST(X509_NAME *, name), &find.der, &find.der_len) != 1)) {
+	fallback:
+		return X509_STORE_CTX_get1_crls(x509_ctx, name);
+	}
+	find.hash = fr_hash(find.der, find.der_len);
+
+	issuer = bsearch(&find, conf->verify.crl_index->issuer, conf->verify.crl_index->num,
+			 sizeof(find), tls_crl_issuer_cmp);
+	if (!issuer) goto fallback;
+
+	/*
+	 *	OpenSSL frees the stack and its
+	 *	contents, so hand it references.
+	 */
+	crls = sk_X509_CRL_new_null();
+	if (!crls) return NULL;
+
+	for (i = 0; i < sk_X509_CRL_num(issuer->crls); i++) {
+		X509_CRL *crl = sk_X509_CRL_value(issuer->crls, i);
+
+		X509_CRL_up_ref(crl);
+		if (!sk_X509_CRL_push(crls, crl)) {
+			X509_CRL_free(crl);
+			sk_X509_CRL_pop_free(crls, X509_CRL_free);
+			return NULL;
+		}
+	}
+
+	return crls;
+}
+
+/** Enable CRL checks for a verification store
+ *
+ * @param[in] store	to enable CRL checks for.
+ * @param[in] conf	verification configuration.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int fr_tls_verify_crl_store_init(X509_STORE *store, fr_tls_verify_conf_t const *conf)
+{
+#ifdef X509_V_FLAG_CRL_CHECK_ALL
+	/*
+	 *	If set, delta CRLs (if present) are used to
+	 *	determine certificate status. If not set
+	 *	deltas are ignored.
+	 *
+	 *	So it's safe to always set this flag.
+	 */
+	if (X509_STORE_set_flags(store, X509_V_FLAG_CRL_CHECK | X509_V_FLAG_CRL_CHECK_ALL
+#ifdef X509_V_FLAG_USE_DELTAS
+				 | X509_V_FLAG_USE_DELTAS
+#endif
+				 ) != 1) {
+		fr_tls_log_error(NULL, "Failed enabling CRL checks");
+		return -1;
+	}
+#endif
+
+	if (conf->crl_index) X509_STORE_set_lookup_crls(store, tls_verify_crl_lookup);
+
+	return 0;
+}
 #endif /* WITH_TLS */
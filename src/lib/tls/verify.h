@@ -88,6 +88,10 @@ void		fr_tls_verify_cert_request(fr_tls_session_t *tls_session, bool resumed);
 
 unlang_action_t fr_tls_verify_cert_pending_push(request_t *request, fr_tls_session_t *tls_session);
 
+int		fr_tls_verify_crl_index_alloc(TALLOC_CTX *ctx, fr_tls_crl_index_t **out, char const *file);
+
+int		fr_tls_verify_crl_store_init(X509_STORE *store, fr_tls_verify_conf_t const *conf);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,359 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or (at
+ *   your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/** Tests for checking peer certificates against CRLs from the ca_file
+ *
+ * @file src/lib/tls/verify_tests.c
+ *
+ * @copyright 2022 The FreeRADIUS server project
+ */
+#define USE_CONSTRUCTOR
+
+/*
+ * It should be declared before include the "acutest.h"
+ */
+#ifdef USE_CONSTRUCTOR
+static void test_init(void) __attribute__((constructor));
+#else
+static void test_init(void);
+#  define TEST_INIT  test_init()
+#endif
+
+#include <freeradius-devel/util/acutest.h>
+#include <freeradius-devel/util/acutest_helpers.h>
+
+#include <freeradius-devel/tls/base.h>
+#include <freeradius-devel/tls/index.h>
+#include <freeradius-devel/tls/verify.h>
+
+#include <openssl/pem.h>
+#include <openssl/x509v3.h>
+
+/** A CA, one certificate it's revoked, one it hasn't, and its CRL
+ *
+ */
+typedef struct {
+	EVP_PKEY	*key;			//!< Shared by all the certificates, to save time.
+	X509		*ca;
+	X509		*revoked;
+	X509		*good;
+	X509_CRL	*crl;
+} test_pki_t;
+
+static TALLOC_CTX	*autofree;
+static SSL_CTX		*test_ssl_ctx;
+
+/** Global initialisation
+ */
+static void test_init(void)
+{
+	autofree = talloc_autofree_context();
+	if (!autofree) {
+	error:
+		fr_perror("tls_verify_tests");
+		fr_exit_now(EXIT_FAILURE);
+	}
+
+	/*
+	 *	Mismatch between the binary and the libraries it depends on
+	 */
+	if (fr_check_lib_magic(RADIUSD_MAGIC_NUMBER) < 0) goto error;
+
+	if (fr_openssl_init() < 0) goto error;
+
+	test_ssl_ctx = SSL_CTX_new(TLS_method());
+	if (!test_ssl_ctx) goto error;
+}
+
+static EVP_PKEY *test_key_alloc(void)
+{
+	EVP_PKEY_CTX	*pctx;
+	EVP_PKEY	*pkey = NULL;
+
+	MEM(pctx = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, NULL));
+	TEST_ASSERT(EVP_PKEY_keygen_init(pctx) == 1);
+	TEST_ASSERT(EVP_PKEY_CTX_set_ec_paramgen_curve_nid(pctx, NID_X9_62_prime256v1) == 1);
+	TEST_ASSERT(EVP_PKEY_keygen(pctx, &pkey) == 1);
+	EVP_PKEY_CTX_free(pctx);
+
+	return pkey;
+}
+
+static void test_cert_ext_add(X509 *cert, int nid, char const *value)
+{
+	X509V3_CTX	v3;
+	X509_EXTENSION	*ext;
+
+	X509V3_set_ctx_nodb(&v3);
+	X509V3_set_ctx(&v3, cert, cert, NULL, NULL, 0);
+	MEM(ext = X509V3_EXT_conf_nid(NULL, &v3, nid, UNCONST(char *, value)));
+	TEST_ASSERT(X509_add_ext(cert, ext, -1) == 1);
+	X509_EXTENSION_free(ext);
+}
+
+/** Allocate a certificate, self-signed if there's no issuer
+ *
+ */
+static X509 *test_cert_alloc(char const *cn, long serial, EVP_PKEY *key, X509 *issuer)
+{
+	X509		*cert;
+	X509_NAME	*name;
+
+	MEM(cert = X509_new());
+	TEST_ASSERT(X509_set_version(cert, 2) == 1);
+	TEST_ASSERT(ASN1_INTEGER_set(X509_get_serialNumber(cert), serial) == 1);
+	MEM(X509_gmtime_adj(X509_getm_notBefore(cert), -3600));
+	MEM(X509_gmtime_adj(X509_getm_notAfter(cert), 86400));
+
+	MEM(name = X509_NAME_new());
+	TEST_ASSERT(X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, (unsigned char const *)cn, -1, -1, 0) == 1);
+	TEST_ASSERT(X509_set_subject_name(cert, name) == 1);
+	TEST_ASSERT(X509_set_issuer_name(cert, issuer ? X509_get_subject_name(issuer) : name) == 1);
+	X509_NAME_free(name);
+
+	TEST_ASSERT(X509_set_pubkey(cert, key) == 1);
+
+	if (!issuer) {
+		test_cert_ext_add(cert, NID_basic_constraints, "critical,CA:TRUE");
+		test_cert_ext_add(cert, NID_key_usage, "critical,keyCertSign,cRLSign");
+	}
+
+	TEST_ASSERT(X509_sign(cert, key, EVP_sha256()) > 0);
+
+	return cert;
+}
+
+/** Allocate a CRL revoking a single certificate
+ *
+ */
+static X509_CRL *test_crl_alloc(X509 *ca, EVP_PKEY *key, X509 *revoked_cert)
+{
+	X509_CRL	*crl;
+	X509_REVOKED	*revoked;
+	ASN1_TIME	*when;
+
+	MEM(crl = X509_CRL_new());
+	TEST_ASSERT(X509_CRL_set_version(crl, 1) == 1);
+	TEST_ASSERT(X509_CRL_set_issuer_name(crl, X509_get_subject_name(ca)) == 1);
+
+	MEM(when = X509_gmtime_adj(NULL, -60));
+	TEST_ASSERT(X509_CRL_set1_lastUpdate(crl, when) == 1);
+
+	MEM(revoked = X509_REVOKED_new());
+	TEST_ASSERT(X509_REVOKED_set_serialNumber(revoked, X509_get_serialNumber(revoked_cert)) == 1);
+	TEST_ASSERT(X509_REVOKED_set_revocationDate(revoked, when) == 1);
+	TEST_ASSERT(X509_CRL_add0_revoked(crl, revoked) == 1);
+
+	MEM(X509_gmtime_adj(when, 86400));
+	TEST_ASSERT(X509_CRL_set1_nextUpdate(crl, when) == 1);
+	ASN1_TIME_free(when);
+
+	TEST_ASSERT(X509_CRL_sort(crl) == 1);
+	TEST_ASSERT(X509_CRL_sign(crl, key, EVP_sha256()) > 0);
+
+	return crl;
+}
+
+static void test_pki_init(test_pki_t *pki, char const *ca_cn)
+{
+	pki->key = test_key_alloc();
+	pki->ca = test_cert_alloc(ca_cn, 1, pki->key, NULL);
+	pki->revoked = test_cert_alloc("revoked", 2, pki->key, pki->ca);
+	pki->good = test_cert_alloc("good", 3, pki->key, pki->ca);
+	pki->crl = test_crl_alloc(pki->ca, pki->key, pki->revoked);
+}
+
+static void test_pki_free(test_pki_t *pki)
+{
+	X509_CRL_free(pki->crl);
+	X509_free(pki->good);
+	X509_free(pki->revoked);
+	X509_free(pki->ca);
+	EVP_PKEY_free(pki->key);
+}
+
+/** Write a ca_file containing a CA, and optionally its CRL
+ *
+ */
+static void test_ca_file_write(char *path, test_pki_t *pki, bool with_crl)
+{
+	int	fd;
+	FILE	*fp;
+
+	fd = mkstemp(path);
+	TEST_ASSERT(fd >= 0);
+	MEM(fp = fdopen(fd, "w"));
+	TEST_ASSERT(PEM_write_X509(fp, pki->ca) == 1);
+	if (with_crl) TEST_ASSERT(PEM_write_X509_CRL(fp, pki->crl) == 1);
+	fclose(fp);
+}
+
+/** Build a verify store for the CA, as fr_tls_ctx_alloc() does with check_crl enabled
+ *
+ */
+static X509_STORE *test_store_alloc(fr_tls_conf_t *conf, test_pki_t *pki)
+{
+	X509_STORE *store;
+
+	MEM(store = X509_STORE_new());
+	TEST_ASSERT(X509_STORE_add_cert(store, pki->ca) == 1);
+	TEST_ASSERT(fr_tls_verify_crl_store_init(store, &conf->verify) == 0);
+
+	return store;
+}
+
+/** Verify a certificate, as OpenSSL does during a handshake
+ *
+ * @return X509_V_OK, or the reason verification failed.
+ */
+static int test_verify(X509_STORE *store, fr_tls_conf_t *conf, X509 *cert)
+{
+	X509_STORE_CTX	*x509_ctx;
+	SSL		*ssl;
+	int		ret;
+
+	MEM(ssl = SSL_new(test_ssl_ctx));
+	SSL_set_ex_data(ssl, FR_TLS_EX_INDEX_CONF, conf);
+
+	MEM(x509_ctx = X509_STORE_CTX_new());
+	TEST_ASSERT(X509_STORE_CTX_init(x509_ctx, store, cert, NULL) == 1);
+	TEST_ASSERT(X509_STORE_CTX_set_ex_data(x509_ctx, SSL_get_ex_data_X509_STORE_CTX_idx(), ssl) == 1);
+
+	ret = (X509_verify_cert(x509_ctx) == 1) ? X509_V_OK : X509_STORE_CTX_get_error(x509_ctx);
+
+	X509_STORE_CTX_free(x509_ctx);
+	SSL_free(ssl);
+
+	return ret;
+}
+
+static void test_crl_index(void)
+{
+	TALLOC_CTX		*ctx = talloc_init_const("test");
+	fr_tls_conf_t		*conf;
+	fr_tls_crl_index_t	*index;
+	test_pki_t		pki;
+	char			path[] = "/tmp/tls_verify_tests.XXXXXX";
+
+	MEM(conf = talloc_zero(ctx, fr_tls_conf_t));
+	conf->verify.check_crl = true;
+	test_pki_init(&pki, "ca");
+
+	TEST_CASE("A ca_file without CRLs produces no index");
+	test_ca_file_write(path, &pki, false);
+	TEST_CHECK(fr_tls_verify_crl_index_alloc(ctx, &index, path) == 0);
+	TEST_CHECK(index == NULL);
+	unlink(path);
+
+	TEST_CASE("CRLs in the ca_file are indexed");
+	strcpy(path, "/tmp/tls_verify_tests.XXXXXX");
+	test_ca_file_write(path, &pki, true);
+	TEST_CHECK(fr_tls_verify_crl_index_alloc(ctx, &conf->verify.crl_index, path) == 0);
+	TEST_CHECK(conf->verify.crl_index != NULL);
+	unlink(path);
+
+	TEST_CASE("A missing ca_file is an error");
+	TEST_CHECK(fr_tls_verify_crl_index_alloc(ctx, &index, path) < 0);
+
+	test_pki_free(&pki);
+	talloc_free(ctx);
+}
+
+static void test_crl_revoked(void)
+{
+	TALLOC_CTX	*ctx = talloc_init_const("test");
+	fr_tls_conf_t	*conf;
+	X509_STORE	*store;
+	test_pki_t	pki;
+	char		path[] = "/tmp/tls_verify_tests.XXXXXX";
+	int		ret;
+
+	MEM(conf = talloc_zero(ctx, fr_tls_conf_t));
+	conf->verify.check_crl = true;
+	test_pki_init(&pki, "ca");
+	test_ca_file_write(path, &pki, true);
+	TEST_ASSERT(fr_tls_verify_crl_index_alloc(conf, &conf->verify.crl_index, path) == 0);
+	unlink(path);
+
+	store = test_store_alloc(conf, &pki);
+
+	TEST_CASE("Certificates which haven't been revoked are accepted");
+	ret = test_verify(store, conf, pki.good);
+	TEST_CHECK(ret == X509_V_OK);
+	TEST_MSG("Expected X509_V_OK, got %s", X509_verify_cert_error_string(ret));
+
+	TEST_CASE("Revoked certificates are rejected");
+	ret = test_verify(store, conf, pki.revoked);
+	TEST_CHECK(ret == X509_V_ERR_CERT_REVOKED);
+	TEST_MSG("Expected X509_V_ERR_CERT_REVOKED, got %s", X509_verify_cert_error_string(ret));
+
+	X509_STORE_free(store);
+	test_pki_free(&pki);
+	talloc_free(ctx);
+}
+
+static void test_crl_fallback(void)
+{
+	TALLOC_CTX	*ctx = talloc_init_const("test");
+	fr_tls_conf_t	*conf;
+	X509_STORE	*store;
+	test_pki_t	indexed, other;
+	char		path[] = "/tmp/tls_verify_tests.XXXXXX";
+	int		ret;
+
+	MEM(conf = talloc_zero(ctx, fr_tls_conf_t));
+	conf->verify.check_crl = true;
+	test_pki_init(&indexed, "indexed ca");
+	test_pki_init(&other, "other ca");
+	test_ca_file_write(path, &indexed, true);
+	TEST_ASSERT(fr_tls_verify_crl_index_alloc(conf, &conf->verify.crl_index, path) == 0);
+	unlink(path);
+
+	store = test_store_alloc(conf, &indexed);
+	TEST_ASSERT(X509_STORE_add_cert(store, other.ca) == 1);
+
+	TEST_CASE("Certificates from issuers without a CRL are rejected");
+	ret = test_verify(store, conf, other.good);
+	TEST_CHECK(ret == X509_V_ERR_UNABLE_TO_GET_CRL);
+	TEST_MSG("Expected X509_V_ERR_UNABLE_TO_GET_CRL, got %s", X509_verify_cert_error_string(ret));
+
+	TEST_CASE("CRLs for issuers which aren't indexed are found in the store");
+	TEST_ASSERT(X509_STORE_add_crl(store, other.crl) == 1);
+	ret = test_verify(store, conf, other.good);
+	TEST_CHECK(ret == X509_V_OK);
+	TEST_MSG("Expected X509_V_OK, got %s", X509_verify_cert_error_string(ret));
+	ret = test_verify(store, conf, other.revoked);
+	TEST_CHECK(ret == X509_V_ERR_CERT_REVOKED);
+	TEST_MSG("Expected X509_V_ERR_CERT_REVOKED, got %s", X509_verify_cert_error_string(ret));
+
+	TEST_CASE("Indexed issuers are still checked");
+	ret = test_verify(store, conf, indexed.revoked);
+	TEST_CHECK(ret == X509_V_ERR_CERT_REVOKED);
+	TEST_MSG("Expected X509_V_ERR_CERT_REVOKED, got %s", X509_verify_cert_error_string(ret));
+
+	X509_STORE_free(store);
+	test_pki_free(&other);
+	test_pki_free(&indexed);
+	talloc_free(ctx);
+}
+
+TEST_LIST = {
+	{ "crl_index",		test_crl_index },
+	{ "crl_revoked",	test_crl_revoked },
+	{ "crl_fallback",	test_crl_fallback },
+
+	{ NULL }
+};
@@ -238,7 +238,7 @@ CONF_SECTION *unlang_call_current(request_t *request)
 	 *	looking for modules.
 	 */
 	for (depth = stack_depth_current(request); depth > 0; depth--) {
-		unlang_stack_frame_t	*frame = &stack->frame[depth];
+		unlang_stack_frame_t	*frame = stack_frame(stack, depth);
 
 		/*
 		 *	Look at the module frames,
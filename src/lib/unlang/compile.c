@@ -27,6 +27,9 @@ RCSID("$Id$")
 #include <freeradius-devel/server/base.h>
 #include <freeradius-devel/server/modpriv.h>
 #include <freeradius-devel/protocol/freeradius/freeradius.internal.h>
+#include <freeradius-devel/util/stdatomic.h>
+
+#include <pthread.h>
 
 #include "call_priv.h"
 #include "caller_priv.h"
@@ -2139,6 +2142,25 @@ static bool compile_action_subsection(unlang_t *c, CONF_SECTION *cs, CONF_SECTIO
 }
 
 
+/** Set the jump target for each "if" / "elsif" in a group
+ *
+ * @param[in] g		whose children should be processed.
+ */
+static void compile_cond_chains(unlang_group_t *g)
+{
+	unlang_t	*c, *next;
+
+	for (c = g->children; c; c = c->next) {
+		if ((c->type != UNLANG_TYPE_IF) && (c->type != UNLANG_TYPE_ELSIF)) continue;
+
+		for (next = c->next;
+		     next && ((next->type == UNLANG_TYPE_ELSE) || (next->type == UNLANG_TYPE_ELSIF));
+		     next = next->next);
+
+		unlang_group_to_cond(unlang_generic_to_group(c))->chain_next = next;
+	}
+}
+
 static unlang_t *compile_children(unlang_group_t *g, unlang_compile_t *unlang_ctx)
 {
 	CONF_ITEM	*ci = NULL;
@@ -2356,6 +2378,13 @@ static unlang_t *compile_children(unlang_group_t *g, unlang_compile_t *unlang_ct
 		}
 	}
 
+	/*
+	 *	Resolve where execution continues when an "if" or
+	 *	"elsif" is taken, so the interpreter can jump
+	 *	straight there.
+	 */
+	compile_cond_chains(g);
+
 	/*
 	 *	Set the default actions, if they haven't already been
 	 *	set by an "actions" section above.
@@ -2444,8 +2473,95 @@ static int case_to_key(uint8_t **out, size_t *outlen, void const *data)
 	return fr_value_box_to_key(out, outlen, tmpl_value(a->vpt));
 }
 
+static int case_range_cmp(void const *one, void const *two)
+{
+	unlang_case_t const *a = *(unlang_case_t * const *) one;
+	unlang_case_t const *b = *(unlang_case_t * const *) two;
+
+	return fr_value_box_cmp(tmpl_value(a->vpt), tmpl_value(b->vpt));
+}
+
+/** Sort the ranges of a 'switch' statement, and check that none of them overlap
+ *
+ * @param[in] g		the switch group.
+ * @return
+ *	- 0 on success.
+ *	- -1 if two ranges overlap.
+ */
+static int compile_switch_ranges(unlang_group_t *g)
+{
+	unlang_switch_t		*gext = unlang_group_to_switch(g);
+	size_t			i;
+
+	if (gext->num_ranges < 2) return 0;
+
+	qsort(gext->ranges, gext->num_ranges, sizeof(gext->ranges[0]), case_range_cmp);
+
+	for (i = 1; i < gext->num_ranges; i++) {
+		if (fr_value_box_cmp(tmpl_value(gext->ranges[i]->vpt), tmpl_value(gext->ranges[i - 1]->high)) > 0) continue;
+
+		cf_log_err(unlang_case_to_group(gext->ranges[i])->cs, "'case' range overlaps with a previous range");
+		cf_log_err(unlang_case_to_group(gext->ranges[i - 1])->cs, "Overlapping range is here.");
+		return -1;
+	}
+
+	return 0;
+}
+
 static unlang_t *compile_case(unlang_t *parent, unlang_compile_t *unlang_ctx, CONF_SECTION *cs);
 
+/** Resolve a 'switch' over constant data to the single 'case' which can match
+ *
+ * All other 'case' statements are dead code, and are removed from the tree.
+ * The matching 'case' becomes the default, which is all the interpreter
+ * looks at for constant 'switch' statements.
+ *
+ * @param[in] g		the switch group.
+ * @return
+ *	- The switch, with a single child.
+ *	- NULL if no 'case' matches, in which case the switch has been freed.
+ */
+static unlang_t *compile_switch_constant(unlang_group_t *g)
+{
+	unlang_switch_t		*gext = unlang_group_to_switch(g);
+	unlang_t		*c = unlang_group_to_generic(g);
+	unlang_t		*found, *child, *next;
+
+	found = unlang_switch_find(gext, tmpl_value(gext->vpt));
+	if (!found) found = gext->default_case;
+
+	if (!found) {
+		cf_log_debug_prefix(g->cs, "Skipping '%s' as no 'case' matches its constant value",
+				    c->debug_name);
+		talloc_free(g);
+		return NULL;
+	}
+
+	cf_log_debug_prefix(g->cs, "Folding '%s' to '%s' as its value is constant",
+			    c->debug_name, found->debug_name);
+
+	/*
+	 *	The indexes point to cases we're about to free.
+	 */
+	TALLOC_FREE(gext->ht);
+	TALLOC_FREE(gext->prefix);
+	TALLOC_FREE(gext->ranges);
+	gext->num_ranges = 0;
+
+	for (child = g->children; child; child = next) {
+		next = child->next;
+		if (child != found) talloc_free(child);
+	}
+
+	found->next = NULL;
+	g->children = found;
+	g->tail = &found->next;
+	g->num_children = 1;
+	gext->default_case = found;
+
+	return c;
+}
+
 static unlang_t *compile_switch(unlang_t *parent, unlang_compile_t *unlang_ctx, CONF_SECTION *cs)
 {
 	CONF_ITEM		*ci;
@@ -2545,12 +2661,13 @@ static unlang_t *compile_switch(unlang_t *parent, unlang_compile_t *unlang_ctx,
 		goto error;
 	}
 
-	if (tmpl_is_data(gext->vpt)) {
-		cf_log_err(cs, "Cannot use constant data for 'switch' statement");
-		goto error;
-	}
-
-	if (!tmpl_is_attr(gext->vpt)) {
+	/*
+	 *	Constant data is usually the result of a
+	 *	${...} expansion.  The matching 'case' is
+	 *	resolved below, once all the cases have been
+	 *	compiled.
+	 */
+	if (!tmpl_is_attr(gext->vpt) && !tmpl_is_data(gext->vpt)) {
 		if (tmpl_cast_set(gext->vpt, FR_TYPE_STRING) < 0) {
 			cf_log_perr(cs, "Failed setting cast type");
 			goto error;
@@ -2563,6 +2680,9 @@ static unlang_t *compile_switch(unlang_t *parent, unlang_compile_t *unlang_ctx,
 
 	} else if (tmpl_is_attr(gext->vpt)) {
 		type = tmpl_da(gext->vpt)->type;
+
+	} else if (tmpl_is_data(gext->vpt)) {
+		type = tmpl_value_type(gext->vpt);
 	}
 
 	htype = fr_htrie_hint(type);
@@ -2644,6 +2764,32 @@ static unlang_t *compile_switch(unlang_t *parent, unlang_compile_t *unlang_ctx,
 		if (!case_gext->vpt) {
 			gext->default_case = single;
 
+		/*
+		 *	Ranges are sorted once all of the cases
+		 *	have been compiled.
+		 */
+		} else if (case_gext->match == UNLANG_CASE_MATCH_RANGE) {
+			MEM(gext->ranges = talloc_realloc(gext, gext->ranges, unlang_case_t *, gext->num_ranges + 1));
+			gext->ranges[gext->num_ranges++] = case_gext;
+
+		/*
+		 *	IP prefixes go into the htrie, which is
+		 *	already a prefix trie for IP addresses.
+		 */
+		} else if ((case_gext->match == UNLANG_CASE_MATCH_PREFIX) && (htype != FR_HTRIE_TRIE)) {
+			if (!gext->prefix) {
+				MEM(gext->prefix = fr_trie_alloc(gext, (fr_trie_key_t) case_to_key, NULL));
+			}
+
+			if (!fr_trie_insert(gext->prefix, single)) {
+				cf_log_err(ci, "Failed inserting 'case' statement.  Is there a duplicate prefix?");
+
+				single = fr_trie_match(gext->prefix, single);
+				if (single) cf_log_err(unlang_generic_to_group(single)->cs, "Duplicate may be here.");
+
+				goto error;
+			}
+
 		} else if (!fr_htrie_insert(gext->ht, single)) {
 			single = fr_htrie_find(gext->ht, single);
 
@@ -2662,11 +2808,71 @@ static unlang_t *compile_switch(unlang_t *parent, unlang_compile_t *unlang_ctx,
 		g->num_children++;
 	}
 
+	if (compile_switch_ranges(g) < 0) goto error;
+
+	if (tmpl_is_data(gext->vpt)) {
+		c = compile_switch_constant(g);
+		if (!c) return UNLANG_IGNORE;
+	}
+
 	compile_action_defaults(c, unlang_ctx);
 
 	return c;
 }
 
+/** Parse one of the values of a 'case' statement
+ *
+ * The value is cast to the data type of the 'switch'.
+ */
+static tmpl_t *compile_case_value(CONF_SECTION *cs, char const *name, fr_token_t quote,
+				  fr_type_t cast_type, fr_dict_attr_t const *da, tmpl_rules_t const *t_rules)
+{
+	ssize_t		slen;
+	tmpl_t		*vpt = NULL;
+
+	slen = tmpl_afrom_substr(cs, &vpt,
+				 &FR_SBUFF_IN(name, strlen(name)),
+				 quote,
+				 NULL,
+				 t_rules);
+	if (!vpt) {
+		char *spaces, *text;
+
+		fr_canonicalize_error(cs, &spaces, &text, slen, fr_strerror());
+
+		cf_log_err(cs, "Syntax error");
+		cf_log_err(cs, "%s", name);
+		cf_log_err(cs, "%s^ %s", spaces, text);
+
+		talloc_free(spaces);
+		talloc_free(text);
+
+		return NULL;
+	}
+
+	/*
+	 *      This "case" statement is unresolved, or is data
+	 *      of the wrong type.  Try to resolve it to the data
+	 *      type of the parent "switch" tmpl.
+	 */
+	if (tmpl_is_unresolved(vpt) ||
+	    (tmpl_is_data(vpt) && !fr_type_is_null(cast_type) && (tmpl_value_type(vpt) != cast_type))) {
+		if (tmpl_cast_in_place(vpt, cast_type, da) < 0) {
+			cf_log_perr(cs, "Invalid argument for 'case' statement");
+			talloc_free(vpt);
+			return NULL;
+		}
+	}
+
+	if (!tmpl_is_data(vpt)) {
+		talloc_free(vpt);
+		cf_log_err(cs, "arguments to 'case' statements MUST be static data.");
+		return NULL;
+	}
+
+	return vpt;
+}
+
 static unlang_t *compile_case(unlang_t *parent, unlang_compile_t *unlang_ctx, CONF_SECTION *cs)
 {
 	int			i;
@@ -2674,8 +2880,9 @@ static unlang_t *compile_case(unlang_t *parent, unlang_compile_t *unlang_ctx, CO
 	unlang_t		*c;
 	unlang_group_t		*case_g;
 	unlang_case_t		*case_gext;
-	tmpl_t			*vpt = NULL;
+	tmpl_t			*vpt = NULL, *high = NULL;
 	tmpl_rules_t		t_rules;
+	unlang_case_match_t	match = UNLANG_CASE_MATCH_EXACT;
 
 	static unlang_ext_t const case_ext = {
 		.type = UNLANG_TYPE_CASE,
@@ -2697,65 +2904,106 @@ static unlang_t *compile_case(unlang_t *parent, unlang_compile_t *unlang_ctx, CO
 
 	/*
 	 *	case THING means "match THING"
+	 *	case THING* means "match anything starting with THING"
+	 *	case LOW .. HIGH means "match anything from LOW to HIGH"
 	 *	case       means "match anything"
 	 */
 	name2 = cf_section_name2(cs);
 	if (name2) {
-		ssize_t			slen;
-		fr_token_t		type;
+		char const		*marker;
+		fr_type_t		cast_type;
+		fr_dict_attr_t const	*da = NULL;
 		unlang_group_t		*switch_g;
-		unlang_switch_t	*switch_gext;
-
-		type = cf_section_name2_quote(cs);
-
-		slen = tmpl_afrom_substr(cs, &vpt,
-					 &FR_SBUFF_IN(name2, strlen(name2)),
-					 type,
-					 NULL,
-					 &t_rules);
-		if (!vpt) {
-			char *spaces, *text;
+		unlang_switch_t		*switch_gext;
 
-			fr_canonicalize_error(cs, &spaces, &text, slen, fr_strerror());
-
-			cf_log_err(cs, "Syntax error");
-			cf_log_err(cs, "%s", name2);
-			cf_log_err(cs, "%s^ %s", spaces, text);
+		switch_g = unlang_generic_to_group(parent);
+		switch_gext = unlang_group_to_switch(switch_g);
+		fr_assert(switch_gext->vpt != NULL);
 
-			talloc_free(spaces);
-			talloc_free(text);
+		cast_type = tmpl_rules_cast(switch_gext->vpt);
+		if (tmpl_is_attr(switch_gext->vpt)) da = tmpl_da(switch_gext->vpt);
 
-			return NULL;
+		if (fr_type_is_null(cast_type) && da) cast_type = da->type;
+		if (fr_type_is_null(cast_type) && tmpl_is_data(switch_gext->vpt)) {
+			cast_type = tmpl_value_type(switch_gext->vpt);
 		}
 
-		switch_g = unlang_generic_to_group(parent);
-		switch_gext = unlang_group_to_switch(switch_g);
-		fr_assert(switch_gext->vpt != NULL);
+		marker = cf_section_argv(cs, 0);
+		if (marker) match = (*marker == '*') ? UNLANG_CASE_MATCH_PREFIX : UNLANG_CASE_MATCH_RANGE;
 
+		switch (match) {
 		/*
-		 *      This "case" statement is unresolved.  Try to
-		 *      resolve it to the data type of the parent
-		 *      "switch" tmpl.
+		 *	case 192.0.2.0/24 matches every address
+		 *	in the network.
 		 */
-		if (tmpl_is_unresolved(vpt)) {
-			fr_type_t cast_type = tmpl_rules_cast(switch_gext->vpt);
-			fr_dict_attr_t const *da = NULL;
+		case UNLANG_CASE_MATCH_EXACT:
+			if (!strchr(name2, '/')) break;
 
- 			if (tmpl_is_attr(switch_gext->vpt)) da = tmpl_da(switch_gext->vpt);
+			if (cast_type == FR_TYPE_IPV4_ADDR) {
+				cast_type = FR_TYPE_IPV4_PREFIX;
 
-			if (fr_type_is_null(cast_type) && da) cast_type = da->type;
+			} else if (cast_type == FR_TYPE_IPV6_ADDR) {
+				cast_type = FR_TYPE_IPV6_PREFIX;
 
-			if (tmpl_cast_in_place(vpt, cast_type, da) < 0) {
-				cf_log_perr(cs, "Invalid argument for 'case' statement");
-				talloc_free(vpt);
+			} else if (cast_type == FR_TYPE_COMBO_IP_ADDR) {
+				cast_type = FR_TYPE_COMBO_IP_PREFIX;
+
+			} else {
+				break;
+			}
+
+			match = UNLANG_CASE_MATCH_PREFIX;
+			da = NULL;
+			break;
+
+		case UNLANG_CASE_MATCH_PREFIX:
+			if ((cast_type != FR_TYPE_STRING) && (cast_type != FR_TYPE_OCTETS)) {
+				cf_log_err(cs, "Prefix 'case' statements can only be used with 'string' or 'octets' data types, "
+					   "not '%s'.  Use <address>/<prefix> for IP networks",
+					   fr_type_to_str(cast_type));
+				return NULL;
+			}
+			break;
+
+		case UNLANG_CASE_MATCH_RANGE:
+			if (!fr_type_is_numeric(cast_type)) {
+				cf_log_err(cs, "Range 'case' statements can only be used with numeric data types, not '%s'",
+					   fr_type_to_str(cast_type));
 				return NULL;
 			}
+			break;
 		}
 
-		if (!tmpl_is_data(vpt)) {
-			talloc_free(vpt);
-			cf_log_err(cs, "arguments to 'case' statements MUST be static data.");
-			return NULL;
+		vpt = compile_case_value(cs, name2, cf_section_name2_quote(cs), cast_type, da, &t_rules);
+		if (!vpt) return NULL;
+
+		switch (match) {
+		case UNLANG_CASE_MATCH_EXACT:
+			break;
+
+		case UNLANG_CASE_MATCH_PREFIX:
+			if (fr_type_is_ip(tmpl_value_type(vpt))) break;
+
+			if ((tmpl_value(vpt)->vb_length == 0) || (tmpl_value(vpt)->vb_length > UNLANG_CASE_PREFIX_MAX)) {
+				cf_log_err(cs, "Prefix for 'case' statement must be between 1 and %i bytes long",
+					   UNLANG_CASE_PREFIX_MAX);
+			error:
+				talloc_free(vpt);
+				talloc_free(high);
+				return NULL;
+			}
+			break;
+
+		case UNLANG_CASE_MATCH_RANGE:
+			high = compile_case_value(cs, cf_section_argv(cs, 1), cf_section_argv_quote(cs, 1),
+						  cast_type, da, &t_rules);
+			if (!high) goto error;
+
+			if (fr_value_box_cmp(tmpl_value(vpt), tmpl_value(high)) > 0) {
+				cf_log_err(cs, "Start of 'case' range must not be after its end");
+				goto error;
+			}
+			break;
 		}
 	} /* else it's a default 'case' statement */
 
@@ -2768,12 +3016,29 @@ static unlang_t *compile_case(unlang_t *parent, unlang_compile_t *unlang_ctx, CO
 	c = compile_section(parent, unlang_ctx, cs, &case_ext);
 	if (!c) {
 		talloc_free(vpt);
+		talloc_free(high);
 		return NULL;
 	}
 
 	case_g = unlang_generic_to_group(c);
 	case_gext = unlang_group_to_case(case_g);
 	case_gext->vpt = talloc_steal(case_gext, vpt);
+	case_gext->high = talloc_steal(case_gext, high);
+	case_gext->match = match;
+
+	switch (match) {
+	case UNLANG_CASE_MATCH_EXACT:
+		break;
+
+	case UNLANG_CASE_MATCH_PREFIX:
+		if (fr_type_is_ip(tmpl_value_type(vpt))) break;
+		c->debug_name = talloc_typed_asprintf(c, "case %s*", name2);
+		break;
+
+	case UNLANG_CASE_MATCH_RANGE:
+		c->debug_name = talloc_typed_asprintf(c, "case %s .. %s", name2, cf_section_argv(cs, 1));
+		break;
+	}
 
 	/*
 	 *	Set all of it's codes to return, so that
@@ -3343,13 +3608,16 @@ static unlang_t *compile_redundant_load_balance(unlang_t *parent, unlang_compile
 static unlang_t *compile_parallel(unlang_t *parent, unlang_compile_t *unlang_ctx, CONF_SECTION *cs)
 {
 	unlang_t			*c;
-	char const			*name2;
+	char const			*arg, *value;
+	int				i;
 
 	unlang_group_t			*g;
 	unlang_parallel_t		*gext;
 
 	bool				clone = true;
 	bool				detach = false;
+	int				quorum = 0;
+	fr_time_delta_t			hedge = fr_time_delta_wrap(0);
 
 	static unlang_ext_t const 	parallel_ext = {
 						.type = UNLANG_TYPE_PARALLEL,
@@ -3364,20 +3632,66 @@ static unlang_t *compile_parallel(unlang_t *parent, unlang_compile_t *unlang_ctx
 	 *	admin demands it.  Otherwise, the principle of least
 	 *	surprise is to copy the whole request, reply, and
 	 *	config items.
+	 *
+	 *	The children can also be raced against each other,
+	 *	finishing as soon as enough of them have succeeded,
+	 *	and optionally starting them one at a time.
 	 */
-	name2 = cf_section_name2(cs);
-	if (name2) {
-		if (strcmp(name2, "empty") == 0) {
+	for (i = 0, arg = cf_section_name2(cs); arg; arg = cf_section_argv(cs, i++)) {
+		if (strcmp(arg, "empty") == 0) {
 			clone = false;
 
-		} else if (strcmp(name2, "detach") == 0) {
+		} else if (strcmp(arg, "detach") == 0) {
 			detach = true;
 
+		} else if (strcmp(arg, "first") == 0) {
+			quorum = 1;
+
+		} else if (strcmp(arg, "quorum") == 0) {
+			unsigned long	num;
+			char		*end;
+
+			value = cf_section_argv(cs, i++);
+			if (!value) {
+				cf_log_err(cs, "Missing value for 'quorum'");
+				return NULL;
+			}
+
+			num = strtoul(value, &end, 10);
+			if (*end || (num == 0) || (num > INT_MAX)) {
+				cf_log_err(cs, "Invalid value '%s' for 'quorum'", value);
+				return NULL;
+			}
+			quorum = num;
+
+		} else if (strcmp(arg, "hedge") == 0) {
+			value = cf_section_argv(cs, i++);
+			if (!value) {
+				cf_log_err(cs, "Missing value for 'hedge'");
+				return NULL;
+			}
+
+			if ((fr_time_delta_from_str(&hedge, value, strlen(value), FR_TIME_RES_SEC) < 0) ||
+			    !fr_time_delta_ispos(hedge)) {
+				cf_log_perr(cs, "Invalid value '%s' for 'hedge'", value);
+				return NULL;
+			}
+
 		} else {
-			cf_log_err(cs, "Invalid argument '%s'", name2);
+			cf_log_err(cs, "Invalid argument '%s'", arg);
 			return NULL;
 		}
+	}
 
+	/*
+	 *	Hedging only makes sense if we stop once we have an
+	 *	answer.
+	 */
+	if (fr_time_delta_ispos(hedge) && !quorum) quorum = 1;
+
+	if (detach && quorum) {
+		cf_log_err(cs, "Cannot use 'detach' with 'first', 'quorum', or 'hedge'");
+		return NULL;
 	}
 
 	/*
@@ -3395,6 +3709,14 @@ static unlang_t *compile_parallel(unlang_t *parent, unlang_compile_t *unlang_ctx
 	gext = unlang_group_to_parallel(g);
 	gext->clone = clone;
 	gext->detach = detach;
+	gext->quorum = quorum;
+	gext->hedge = hedge;
+
+	if (quorum > g->num_children) {
+		cf_log_err(cs, "'quorum' of %d is more than the number of children (%d)", quorum, g->num_children);
+		talloc_free(c);
+		return NULL;
+	}
 
 	return c;
 }
@@ -4083,6 +4405,16 @@ static fr_table_ptr_sorted_t unlang_pair_keywords[] = {
 static int unlang_pair_keywords_len = NUM_ELEMENTS(unlang_pair_keywords);
 
 
+/** Remove an instruction from the instruction tree when it's freed
+ *
+ */
+static int _unlang_instruction_free(unlang_t *instruction)
+{
+	if (unlang_instruction_tree) fr_rb_remove(unlang_instruction_tree, instruction);
+
+	return 0;
+}
+
 /*
  *	Compile one unlang instruction
  */
@@ -4111,6 +4443,16 @@ static unlang_t *compile_item(unlang_t *parent, unlang_compile_t *unlang_ctx, CO
 			if (c == UNLANG_IGNORE) return UNLANG_IGNORE;
 
 			c->number = unlang_number++;
+			c->ci = ci;
+
+			/*
+			 *	Track the instruction so that per-thread
+			 *	data can be allocated for it.
+			 */
+			if (unlang_instruction_tree) {
+				fr_rb_insert(unlang_instruction_tree, c);
+				talloc_set_destructor(c, _unlang_instruction_free);
+			}
 			return c;
 		}
 
@@ -4338,7 +4680,12 @@ int unlang_compile(CONF_SECTION *cs, rlm_components_t component, tmpl_rules_t co
 			    cs, &group_ext);
 	if (!c) return -1;
 
-	if (DEBUG_ENABLED4) unlang_dump(c, 2);
+	/*
+	 *	Show the tree after optimisations have been applied,
+	 *	which lets "radiusd -C -xxx" be used to check what
+	 *	will actually be executed.
+	 */
+	if (DEBUG_ENABLED4 || (check_config && DEBUG_ENABLED3)) unlang_dump(c, 2);
 
 	/*
 	 *	Associate the unlang with the configuration section,
@@ -4368,6 +4715,76 @@ bool unlang_compile_is_keyword(const char *name)
 	return (fr_table_value_by_str(unlang_pair_keywords, name, NULL) != NULL);
 }
 
+#ifdef WITH_PERF
+/*
+ *	Profiling counters live in each thread's unlang_thread_array.
+ *	The arrays are registered here, so that radmin can aggregate
+ *	them across all threads.
+ */
+typedef struct {
+	fr_dlist_t		entry;		//!< Entry in the list of registered threads.
+	unlang_thread_t		*array;		//!< The thread's unlang_thread_array.
+	uint32_t		generation;	//!< Counters were last reset at this generation.
+} unlang_perf_thread_t;
+
+static fr_dlist_head_t		unlang_perf_threads;
+static pthread_mutex_t		unlang_perf_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static _Thread_local unlang_perf_thread_t *unlang_perf_thread;
+
+/** One in this many executions of an instruction is timed.  0 disables timing
+ *
+ */
+static atomic_uint_fast32_t	unlang_perf_sample_rate = 1;
+
+/** Incremented to ask all threads to clear their counters
+ *
+ */
+static atomic_uint_fast32_t	unlang_perf_generation;
+
+/** Aggregated counters for an instruction
+ *
+ */
+typedef struct {
+	uint64_t		use_count;
+	uint64_t		sampled;
+	uint64_t		yielded;
+	fr_time_delta_t		cpu_time;
+	fr_time_delta_t		yielded_time;
+	fr_time_delta_t		self_time;	//!< Estimated time spent in the instruction itself.
+} unlang_perf_stats_t;
+
+static int _unlang_perf_thread_free(unlang_perf_thread_t *pt)
+{
+	pthread_mutex_lock(&unlang_perf_mutex);
+	fr_dlist_remove(&unlang_perf_threads, pt);
+	pthread_mutex_unlock(&unlang_perf_mutex);
+
+	if (unlang_perf_thread == pt) unlang_perf_thread = NULL;
+
+	return 0;
+}
+
+/** Register this thread's counters so they can be read by radmin
+ *
+ */
+static void unlang_perf_thread_register(void)
+{
+	unlang_perf_thread_t *pt;
+
+	MEM(pt = talloc_zero(unlang_thread_array, unlang_perf_thread_t));
+	pt->array = unlang_thread_array;
+	pt->generation = atomic_load_explicit(&unlang_perf_generation, memory_order_relaxed);
+	talloc_set_destructor(pt, _unlang_perf_thread_free);
+
+	pthread_mutex_lock(&unlang_perf_mutex);
+	fr_dlist_insert_tail(&unlang_perf_threads, pt);
+	pthread_mutex_unlock(&unlang_perf_mutex);
+
+	unlang_perf_thread = pt;
+}
+#endif
+
 static int8_t instruction_cmp(void const *one, void const *two)
 {
 	unlang_t const *a = one;
@@ -4379,7 +4796,14 @@ static int8_t instruction_cmp(void const *one, void const *two)
 
 void unlang_compile_init()
 {
-	unlang_instruction_tree = fr_rb_talloc_alloc(NULL, unlang_t, instruction_cmp, NULL);
+	/*
+	 *	Instructions are allocated as their specialisations,
+	 *	so the talloc type can't be checked.
+	 */
+	unlang_instruction_tree = fr_rb_alloc(NULL, instruction_cmp, NULL);
+#ifdef WITH_PERF
+	fr_dlist_talloc_init(&unlang_perf_threads, unlang_perf_thread_t, entry);
+#endif
 }
 
 void unlang_compile_free()
@@ -4430,62 +4854,391 @@ int unlang_thread_instantiate(TALLOC_CTX *ctx)
 		}
 	}
 
+#ifdef WITH_PERF
+	unlang_perf_thread_register();
+#endif
+
 	return 0;
 }
 
 #ifdef WITH_PERF
-void unlang_frame_perf_init(unlang_t const *instruction)
+/** Clear this thread's counters if a reset has been requested
+ *
+ * Counters are only ever written by the thread which owns them,
+ * so other threads signal a reset by bumping the generation.
+ */
+static inline CC_HINT(always_inline) void unlang_perf_reset_check(void)
 {
-	unlang_thread_t *t;
+	uint32_t	generation;
+	unsigned int	i;
+
+	if (!unlang_perf_thread) return;
+
+	generation = atomic_load_explicit(&unlang_perf_generation, memory_order_relaxed);
+	if (likely(generation == unlang_perf_thread->generation)) return;
+
+	for (i = 0; i <= unlang_number; i++) {
+		unlang_thread_t *t = &unlang_thread_array[i];
+
+		t->use_count = 0;
+		t->sampled = 0;
+		t->yielded = 0;
+		t->cpu_time = fr_time_delta_wrap(0);
+		t->yielded_time = fr_time_delta_wrap(0);
+	}
+
+	unlang_perf_thread->generation = generation;
+}
+
+void unlang_frame_perf_init(unlang_stack_t *stack, unlang_stack_frame_t *frame)
+{
+	unlang_t const	*instruction = frame->instruction;
+	unlang_thread_t	*t;
+	uint32_t	rate;
+
+	frame->perf_enter = fr_time_wrap(0);
 
 	if (!instruction->number || !unlang_thread_array) return;
 
 	fr_assert(instruction->number <= unlang_number);
 
+	unlang_perf_reset_check();
+
 	t = &unlang_thread_array[instruction->number];
 
 	t->use_count++;
 
-	t->enter = fr_time();
+	/*
+	 *	Only time a subset of executions, as getting the
+	 *	time is the expensive part.
+	 */
+	rate = atomic_load_explicit(&unlang_perf_sample_rate, memory_order_relaxed);
+	if (!rate || ((t->use_count % rate) != 0)) return;
+
+	t->sampled++;
+
+	frame->perf_enter = fr_time();
+	frame->perf_yielded = stack->perf_yielded;
 }
 
-void unlang_frame_perf_cleanup(unlang_t const *instruction)
+void unlang_frame_perf_cleanup(unlang_stack_t *stack, unlang_stack_frame_t *frame)
 {
-	unlang_thread_t *t;
+	unlang_t const	*instruction = frame->instruction;
+	unlang_thread_t	*t;
+	fr_time_t	now;
+	fr_time_delta_t	yielded;
 
 	if (!instruction || !instruction->number || !unlang_thread_array) return;
+	if (!fr_time_ispos(frame->perf_enter)) return;
 
 	fr_assert(instruction->number <= unlang_number);
 
 	t = &unlang_thread_array[instruction->number];
 
-	t->cpu_time = fr_time_add(t->cpu_time, fr_time_sub(fr_time(), t->enter));
+	now = fr_time();
+
+	/*
+	 *	Don't count time the request spent yielded,
+	 *	including any yield which is still in progress
+	 *	because the request is being cancelled.
+	 */
+	yielded = fr_time_delta_sub(stack->perf_yielded, frame->perf_yielded);
+	if (fr_time_ispos(stack->perf_yield_start)) {
+		yielded = fr_time_delta_add(yielded, fr_time_sub(now, stack->perf_yield_start));
+	}
+
+	t->cpu_time = fr_time_delta_add(t->cpu_time, fr_time_delta_sub(fr_time_sub(now, frame->perf_enter), yielded));
+	frame->perf_enter = fr_time_wrap(0);
 }
 
+/** Find the counters for the deepest instruction which is being profiled
+ *
+ */
+static unlang_thread_t *unlang_perf_stack_thread(unlang_stack_t *stack)
+{
+	int i;
+
+	if (!unlang_thread_array) return NULL;
 
-static void unlang_perf_dump(fr_log_t *log, unlang_t const *instruction, int depth)
+	for (i = stack->depth; i > 0; i--) {
+		unlang_t const *instruction = stack_frame(stack, i)->instruction;
+
+		if (instruction && instruction->number) return &unlang_thread_array[instruction->number];
+	}
+
+	return NULL;
+}
+
+/** Record that the request is yielding
+ *
+ */
+void unlang_perf_yield(unlang_stack_t *stack)
 {
-	unlang_group_t const *g;
 	unlang_thread_t *t;
-	char const *file;
-	int line;
 
-	if (!instruction || !instruction->number) return;
+	stack->perf_yield_start = fr_time();
+
+	t = unlang_perf_stack_thread(stack);
+	if (t) t->yielded++;
+}
+
+/** Record that the request has been resumed, and how long it was yielded for
+ *
+ */
+void unlang_perf_resume(unlang_stack_t *stack)
+{
+	unlang_thread_t *t;
+	fr_time_delta_t	delta;
+
+	if (!fr_time_ispos(stack->perf_yield_start)) return;
+
+	delta = fr_time_sub(fr_time(), stack->perf_yield_start);
+	stack->perf_yield_start = fr_time_wrap(0);
+	stack->perf_yielded = fr_time_delta_add(stack->perf_yielded, delta);
+
+	t = unlang_perf_stack_thread(stack);
+	if (t) t->yielded_time = fr_time_delta_add(t->yielded_time, delta);
+}
+
+/** Sum the counters for all threads
+ *
+ * Each thread only writes its own counters, so we may read values
+ * which are slightly stale.  That's fine for profiling.
+ */
+static unlang_perf_stats_t *unlang_perf_aggregate(TALLOC_CTX *ctx)
+{
+	unlang_perf_stats_t	*stats;
+	unlang_perf_thread_t	*pt = NULL;
+	uint32_t		generation;
+	unsigned int		i;
+	fr_rb_iter_inorder_t	iter;
+	unlang_t		*instruction;
+
+	MEM(stats = talloc_zero_array(ctx, unlang_perf_stats_t, unlang_number + 1));
+
+	generation = atomic_load_explicit(&unlang_perf_generation, memory_order_relaxed);
+
+	pthread_mutex_lock(&unlang_perf_mutex);
+	while ((pt = fr_dlist_next(&unlang_perf_threads, pt))) {
+		/*
+		 *	Thread hasn't yet noticed the reset.
+		 */
+		if (pt->generation != generation) continue;
+
+		for (i = 1; i <= unlang_number; i++) {
+			unlang_thread_t const *t = &pt->array[i];
+
+			stats[i].use_count += t->use_count;
+			stats[i].sampled += t->sampled;
+			stats[i].yielded += t->yielded;
+			stats[i].cpu_time = fr_time_delta_add(stats[i].cpu_time, t->cpu_time);
+			stats[i].yielded_time = fr_time_delta_add(stats[i].yielded_time, t->yielded_time);
+		}
+	}
+	pthread_mutex_unlock(&unlang_perf_mutex);
 
 	/*
-	 *	These are generally pushed onto the stack, and therefore ignored.
+	 *	Scale the sampled time up to cover all executions,
+	 *	then subtract each instruction's time from its
+	 *	parent, to get the time spent in the parent itself.
 	 */
-	if (instruction->type == UNLANG_TYPE_TMPL) return;
+	for (i = 1; i <= unlang_number; i++) {
+		if (!stats[i].sampled) continue;
+
+		stats[i].cpu_time = fr_time_delta_wrap(fr_time_delta_unwrap(stats[i].cpu_time) *
+						       (double) stats[i].use_count / stats[i].sampled);
+		stats[i].self_time = fr_time_delta_add(stats[i].self_time, stats[i].cpu_time);
+	}
+
+	if (!unlang_instruction_tree) return stats;
+
+	for (instruction = fr_rb_iter_init_inorder(&iter, unlang_instruction_tree);
+	     instruction;
+	     instruction = fr_rb_iter_next_inorder(&iter)) {
+		if (!instruction->parent || !instruction->parent->number) continue;
+
+		stats[instruction->parent->number].self_time = fr_time_delta_sub(stats[instruction->parent->number].self_time,
+										stats[instruction->number].cpu_time);
+	}
+
+	return stats;
+}
+
+/** Print the name of an instruction as a frame in a folded stack
+ *
+ * Semicolons separate frames, so they're replaced.
+ */
+static void unlang_perf_folded_frame(FILE *fp, unlang_t const *instruction)
+{
+	char const		*p;
+	CONF_ITEM const		*ci = instruction->ci;
 
 	/*
-	 *	Everything else is an unlang_group_t;
+	 *	Top level sections are compiled directly, and
+	 *	are prefixed by the name of the virtual server.
 	 */
-	g = unlang_generic_to_group(instruction);
+	if (!instruction->parent) {
+		CONF_SECTION *cs = unlang_generic_to_group(instruction)->cs;
+		CONF_SECTION *server_cs = cf_item_to_section(cf_parent(cs));
+
+		if (server_cs && (strcmp(cf_section_name1(server_cs), "server") == 0)) {
+			fprintf(fp, "server %s;", cf_section_name2(server_cs));
+		}
+		ci = cf_section_to_item(cs);
+	}
+
+	for (p = instruction->debug_name; *p; p++) fputc((*p == ';') ? ',' : *p, fp);
+
+	if (ci) fprintf(fp, " (%s:%d)", cf_filename(ci), cf_lineno(ci));
+}
+
+static void unlang_perf_folded_stack(FILE *fp, unlang_t const *instruction)
+{
+	if (instruction->parent) {
+		unlang_perf_folded_stack(fp, instruction->parent);
+		fputc(';', fp);
+	}
+
+	unlang_perf_folded_frame(fp, instruction);
+}
+
+static int cmd_show_unlang_profile(FILE *fp, UNUSED FILE *fp_err, UNUSED void *ctx, fr_cmd_info_t const *info)
+{
+	unlang_perf_stats_t	*stats;
+	fr_rb_iter_inorder_t	iter;
+	unlang_t		*instruction;
+	bool			folded = ((info->argc > 0) && (strcmp(info->argv[0], "folded") == 0));
+
+	if (!unlang_instruction_tree) return 0;
+
+	stats = unlang_perf_aggregate(NULL);
+
+	if (!folded) fprintf(fp, "location\tinstruction\tcount\tsampled\tcpu_usec\tyields\tyielded_usec\n");
+
+	for (instruction = fr_rb_iter_init_inorder(&iter, unlang_instruction_tree);
+	     instruction;
+	     instruction = fr_rb_iter_next_inorder(&iter)) {
+		unlang_perf_stats_t *s = &stats[instruction->number];
 
-	if (!g->cs) return;
+		if (!s->use_count) continue;
 
-	file = cf_filename(g->cs);
-	line = cf_lineno(g->cs);
+		/*
+		 *	Folded stacks, as used by flamegraph.pl and
+		 *	similar tools.  One line per instruction, with
+		 *	the time spent in the instruction itself.
+		 */
+		if (folded) {
+			if (!fr_time_delta_ispos(s->self_time)) continue;
+
+			unlang_perf_folded_stack(fp, instruction);
+			fprintf(fp, " %" PRId64 "\n", fr_time_delta_to_usec(s->self_time));
+			continue;
+		}
+
+		fprintf(fp, "%s:%d\t%s\t%" PRIu64 "\t%" PRIu64 "\t%" PRId64 "\t%" PRIu64 "\t%" PRId64 "\n",
+			instruction->ci ? cf_filename(instruction->ci) : "<internal>",
+			instruction->ci ? cf_lineno(instruction->ci) : 0,
+			instruction->debug_name,
+			s->use_count, s->sampled, fr_time_delta_to_usec(s->cpu_time),
+			s->yielded, fr_time_delta_to_usec(s->yielded_time));
+	}
+
+	talloc_free(stats);
+
+	return 0;
+}
+
+static int cmd_set_unlang_profile_sample(UNUSED FILE *fp, FILE *fp_err, UNUSED void *ctx, fr_cmd_info_t const *info)
+{
+	int rate = atoi(info->argv[0]);
+
+	if (rate < 0) {
+		fprintf(fp_err, "Invalid sample rate '%s'\n", info->argv[0]);
+		return -1;
+	}
+
+	atomic_store_explicit(&unlang_perf_sample_rate, (uint32_t) rate, memory_order_relaxed);
+
+	return 0;
+}
+
+static int cmd_set_unlang_profile_reset(UNUSED FILE *fp, UNUSED FILE *fp_err, UNUSED void *ctx, UNUSED fr_cmd_info_t const *info)
+{
+	atomic_fetch_add_explicit(&unlang_perf_generation, 1, memory_order_relaxed);
+
+	return 0;
+}
+
+static fr_cmd_table_t cmd_unlang_perf_table[] = {
+	{
+		.parent = "show",
+		.name = "unlang",
+		.help = "Show unlang interpreter information.",
+		.read_only = true
+	},
+
+	{
+		.parent = "show unlang",
+		.name = "profile",
+		.syntax = "[(table|folded)]",
+		.func = cmd_show_unlang_profile,
+		.help = "Show per-instruction profiling counters, as a table, or as folded stacks for flame graphs.",
+		.read_only = true
+	},
+
+	{
+		.parent = "set",
+		.name = "unlang",
+		.help = "Change unlang interpreter settings.",
+		.read_only = false
+	},
+
+	{
+		.parent = "set unlang",
+		.name = "profile",
+		.help = "Change profiling settings.",
+		.read_only = false
+	},
+
+	{
+		.parent = "set unlang profile",
+		.name = "sample",
+		.syntax = "INTEGER",
+		.func = cmd_set_unlang_profile_sample,
+		.help = "Time one in every N executions of each instruction.  0 disables timing.",
+		.read_only = false
+	},
+
+	{
+		.parent = "set unlang profile",
+		.name = "reset",
+		.func = cmd_set_unlang_profile_reset,
+		.help = "Clear all profiling counters.",
+		.read_only = false
+	},
+
+	CMD_TABLE_END
+};
+
+/** Register radmin commands for unlang profiling
+ *
+ */
+int unlang_perf_command_register(void)
+{
+	return fr_command_register_hook(NULL, NULL, NULL, cmd_unlang_perf_table);
+}
+
+static void unlang_perf_dump(fr_log_t *log, unlang_t const *instruction, int depth)
+{
+	unlang_group_t const *g;
+	unlang_thread_t *t;
+	char const *file;
+	int line;
+
+	if (!instruction || !instruction->number || !instruction->ci) return;
+
+	file = cf_filename(instruction->ci);
+	line = cf_lineno(instruction->ci);
 
 	if (depth) {
 		fr_log(log, L_DBG, file, line, "%.*s", depth, unlang_spaces);
@@ -4502,9 +5255,14 @@ static void unlang_perf_dump(fr_log_t *log, unlang_t const *instruction, int dep
 	fr_log(log, L_DBG, file, line, "count=%" PRIu64 " cpu_time=%" PRIu64,
 	       t->use_count, fr_time_delta_unwrap(t->cpu_time));
 
-	if (g->children) {
+	/*
+	 *	Only groups have children.
+	 */
+	if ((instruction->type > UNLANG_TYPE_MODULE) && (instruction->type <= UNLANG_TYPE_POLICY)) {
 		unlang_t *child;
 
+		g = unlang_generic_to_group(instruction);
+
 		for (child = g->children; child != NULL; child = child->next) {
 			unlang_perf_dump(log, child, depth + 1);
 		}
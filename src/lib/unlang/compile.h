@@ -48,6 +48,10 @@ bool		unlang_compile_is_keyword(const char *name);
 
 bool		unlang_compile_actions(unlang_actions_t *actions, CONF_SECTION *parent, bool module_retry);
 
+#ifdef WITH_PERF
+int		unlang_perf_command_register(void);
+#endif
+
 #ifdef __cplusplus
 }
 #endif
@@ -27,34 +27,90 @@ RCSID("$Id$")
 #include "condition_priv.h"
 #include "group_priv.h"
 
+/** Switch the current frame to another member of an "if" / "elsif" / "else" chain
+ *
+ * The frame continues at the end of the chain once the new instruction completes.
+ */
+static inline CC_HINT(always_inline)
+void cond_chain_jump(unlang_stack_t *stack, unlang_stack_frame_t *frame, unlang_t const *instruction,
+		     unlang_t *chain_next)
+{
+	frame_cleanup(stack, frame);
+	frame->instruction = instruction;
+	frame->next = chain_next;
+	frame_state_init(stack, frame);
+}
+
+/** Evaluate an "if" / "elsif" chain
+ *
+ * Rather than returning to the interpreter once for every condition
+ * which doesn't match, the remaining "elsif" conditions are evaluated
+ * here, and the frame jumps directly to the branch which was taken, or
+ * to the first instruction after the chain if none were.
+ *
+ * The chain is only walked if the frame is executing the siblings of this
+ * instruction.  If it's not, the trailing "elsif" and "else" blocks would
+ * never be reached.
+ */
 static unlang_action_t unlang_if(rlm_rcode_t *p_result, request_t *request, unlang_stack_frame_t *frame)
 {
-	unlang_group_t		*g = unlang_generic_to_group(frame->instruction);
-	unlang_cond_t		*gext = unlang_group_to_cond(g);
+	unlang_stack_t		*stack = request->stack;
+	unlang_t const		*instruction = frame->instruction;
+	unlang_cond_t		*gext = unlang_group_to_cond(unlang_generic_to_group(instruction));
+	unlang_t		*chain_next = gext->chain_next;
 
-	fr_assert(gext->cond != NULL);
+	for (;;) {
+		fr_assert(gext->cond != NULL);
 
-	/*
-	 *	Didn't pass.  Remember that.
-	 */
-	if (!cond_eval(request, *p_result, gext->cond)) {
+		/*
+		 *	We took the "if" or "elsif".  Tell the
+		 *	main interpreter to skip over the else /
+		 *	elsif blocks, and go recurse into its'
+		 *	children.
+		 */
+		if (cond_eval(request, *p_result, gext->cond)) {
+			if (frame->next) frame->next = chain_next;
+			break;
+		}
+
+		/*
+		 *	Didn't pass.  Remember that.
+		 */
 		RDEBUG2("...");
-		return UNLANG_ACTION_EXECUTE_NEXT;
-	}
 
-	/*
-	 *	Tell the main interpreter to skip over the else /
-	 *	elsif blocks, as this "if" condition was taken.
-	 */
-	while (frame->next &&
-	       ((frame->next->type == UNLANG_TYPE_ELSE) ||
-		(frame->next->type == UNLANG_TYPE_ELSIF))) {
-		frame->next = frame->next->next;
+		if (!frame->next) return UNLANG_ACTION_EXECUTE_NEXT;
+
+		instruction = frame->next;
+		switch (instruction->type) {
+		case UNLANG_TYPE_ELSIF:
+			gext = unlang_group_to_cond(unlang_generic_to_group(instruction));
+			break;
+
+		case UNLANG_TYPE_ELSE:
+			gext = NULL;
+			break;
+
+		/*
+		 *	Nothing matched, continue after the chain.
+		 */
+		default:
+			return UNLANG_ACTION_EXECUTE_NEXT;
+		}
+
+		/*
+		 *	Emit the same debug output as if
+		 *	the interpreter had stepped through
+		 *	the chain.
+		 */
+		REXDENT();
+		RDEBUG2("}");
+		RDEBUG2("%s {", instruction->debug_name);
+		RINDENT();
+
+		cond_chain_jump(stack, frame, instruction, chain_next);
+		if (!gext) break;
 	}
 
-	/*
-	 *	We took the "if".  Go recurse into its' children.
-	 */
 	return unlang_group(p_result, request, frame);
 }
 
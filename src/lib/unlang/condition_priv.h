@@ -32,6 +32,11 @@ extern "C" {
 typedef struct {
 	unlang_group_t	group;
 	fr_cond_t	*cond;
+	unlang_t	*chain_next;	//!< First instruction after any trailing
+					///< "elsif" / "else" blocks.  Set at compile
+					///< time so the interpreter doesn't need
+					///< to walk the chain each time the condition
+					///< is taken.
 } unlang_cond_t;
 
 /** Cast a group structure to the cond keyword extension
@@ -31,10 +31,29 @@ RCSID("$Id$")
 #include "module_priv.h"
 #include "parallel_priv.h"
 
+#include <freeradius-devel/util/stdatomic.h>
+
 /** The default interpreter instance for this thread
  */
 static _Thread_local unlang_interpret_t *intp_thread_default;
 
+#define UNLANG_STACK_SEGMENT_CACHE (64)	//!< Maximum number of segments cached per thread.
+
+/** Stack segments released by stacks which grew past their first segment
+ *
+ */
+typedef struct {
+	int			num;					//!< Number of cached segments.
+	unlang_stack_frame_t	*segment[UNLANG_STACK_SEGMENT_CACHE];	//!< Segments available for reuse.
+} unlang_stack_segment_cache_t;
+
+static _Thread_local unlang_stack_segment_cache_t *stack_segment_cache;
+
+static atomic_uint_fast64_t	stack_stats_stacks;
+static atomic_uint_fast64_t	stack_stats_segments_alloced;
+static atomic_uint_fast64_t	stack_stats_segments_reused;
+static atomic_uint_fast64_t	stack_stats_depth[UNLANG_STACK_MAX / UNLANG_STACK_SEGMENT];
+
 static fr_table_num_ordered_t const unlang_action_table[] = {
 	{ L("unwind"), 			UNLANG_ACTION_UNWIND },
 	{ L("calculate-result"),	UNLANG_ACTION_CALCULATE_RESULT },
@@ -129,7 +148,7 @@ static void stack_dump(request_t *request)
 
 	RDEBUG2("----- Begin stack debug [depth %i, %s] -----", stack->depth, stack_unwind_flag_dump(stack->unwind));
 	for (i = stack->depth; i >= 0; i--) {
-		unlang_stack_frame_t *frame = &stack->frame[i];
+		unlang_stack_frame_t *frame = stack_frame(stack, i);
 
 		RDEBUG2("[%d] Frame contents", i);
 		frame_dump(request, frame);
@@ -141,6 +160,57 @@ static void stack_dump(request_t *request)
 #define DUMP_STACK
 #endif
 
+static int _stack_segment_cache_free(void *uctx)
+{
+	unlang_stack_segment_cache_t *cache = talloc_get_type_abort(uctx, unlang_stack_segment_cache_t);
+
+	while (cache->num > 0) talloc_free(cache->segment[--cache->num]);
+	talloc_free(cache);
+	stack_segment_cache = NULL;
+
+	return 0;
+}
+
+/** Get a segment of stack frames, preferring ones cached by this thread
+ *
+ */
+static inline CC_HINT(always_inline) unlang_stack_frame_t *stack_segment_alloc(void)
+{
+	unlang_stack_frame_t *segment;
+
+	if (stack_segment_cache && (stack_segment_cache->num > 0)) {
+		atomic_fetch_add_explicit(&stack_stats_segments_reused, 1, memory_order_relaxed);
+		return stack_segment_cache->segment[--stack_segment_cache->num];
+	}
+
+	atomic_fetch_add_explicit(&stack_stats_segments_alloced, 1, memory_order_relaxed);
+	MEM(segment = talloc_array(NULL, unlang_stack_frame_t, UNLANG_STACK_SEGMENT));
+
+	return segment;
+}
+
+/** Return a segment of stack frames to this thread's cache
+ *
+ */
+static inline CC_HINT(always_inline) void stack_segment_release(unlang_stack_frame_t *segment)
+{
+	unlang_stack_segment_cache_t *cache;
+
+	if (unlikely(!stack_segment_cache)) {
+		MEM(cache = talloc_zero(NULL, unlang_stack_segment_cache_t));
+		fr_atexit_thread_local(stack_segment_cache, _stack_segment_cache_free, cache);
+	} else {
+		cache = stack_segment_cache;
+	}
+
+	if (cache->num >= UNLANG_STACK_SEGMENT_CACHE) {
+		talloc_free(segment);
+		return;
+	}
+
+	cache->segment[cache->num++] = segment;
+}
+
 /** Push a new frame onto the stack
  *
  * @param[in] request		to push the frame onto.
@@ -181,10 +251,19 @@ int unlang_interpret_push(request_t *request, unlang_t const *instruction,
 
 	stack->depth++;
 
+	/*
+	 *	Grow the stack if we've moved into a segment
+	 *	which hasn't been used yet.
+	 */
+	if (unlikely(!stack->segment[stack->depth / UNLANG_STACK_SEGMENT])) {
+		stack->segment[stack->depth / UNLANG_STACK_SEGMENT] = stack_segment_alloc();
+	}
+	if (stack->depth > stack->depth_max) stack->depth_max = stack->depth;
+
 	/*
 	 *	Initialize the next stack frame.
 	 */
-	frame = &stack->frame[stack->depth];
+	frame = stack_frame(stack, stack->depth);
 	memset(frame, 0, sizeof(*frame));
 
 	frame->instruction = instruction;
@@ -537,7 +616,7 @@ unlang_frame_action_t frame_eval(request_t *request, unlang_stack_frame_t *frame
 		 *	now continue at the deepest frame.
 		 */
 		case UNLANG_ACTION_PUSHED_CHILD:
-			fr_assert(&stack->frame[stack->depth] > frame);
+			fr_assert(stack->depth > stack_frame_depth(stack, frame));
 			*result = frame->result;
 			return UNLANG_FRAME_ACTION_NEXT;
 
@@ -657,7 +736,7 @@ CC_HINT(hot) rlm_rcode_t unlang_interpret(request_t *request)
 	 */
 	unlang_stack_t		*stack = request->stack;
 	unlang_interpret_t	*intp = stack->intp;
-	unlang_stack_frame_t	*frame = &stack->frame[stack->depth];	/* Quiet static analysis */
+	unlang_stack_frame_t	*frame = stack_frame(stack, stack->depth);	/* Quiet static analysis */
 
 	stack->priority = -1;	/* Reset */
 
@@ -671,6 +750,7 @@ CC_HINT(hot) rlm_rcode_t unlang_interpret(request_t *request)
 
 	RDEBUG4("** [%i] %s - interpret entered", stack->depth, __FUNCTION__);
 	intp->funcs.resume(request, intp->uctx);
+	unlang_perf_resume(stack);
 
 	for (;;) {
 		RDEBUG4("** [%i] %s - frame action %s", stack->depth, __FUNCTION__,
@@ -680,7 +760,7 @@ CC_HINT(hot) rlm_rcode_t unlang_interpret(request_t *request)
 			fr_assert(stack->depth > 0);
 			fr_assert(stack->depth < UNLANG_STACK_MAX);
 
-			frame = &stack->frame[stack->depth];
+			frame = stack_frame(stack, stack->depth);
 			fa = frame_eval(request, frame, &stack->result, &stack->priority);
 
 			/*
@@ -713,7 +793,7 @@ CC_HINT(hot) rlm_rcode_t unlang_interpret(request_t *request)
 			 *	Head on back up the stack
 			 */
 			frame_pop(request, stack);
-			frame = &stack->frame[stack->depth];
+			frame = stack_frame(stack, stack->depth);
 			DUMP_STACK;
 
 			/*
@@ -778,6 +858,7 @@ CC_HINT(hot) rlm_rcode_t unlang_interpret(request_t *request)
 
 		case UNLANG_FRAME_ACTION_YIELD:
 			RDEBUG4("** [%i] %s - interpret yielding", stack->depth, __FUNCTION__);
+			unlang_perf_yield(stack);
 			intp->funcs.yield(request, intp->uctx);
 			return stack->result;
 
@@ -907,7 +988,38 @@ int unlang_interpret_push_instruction(request_t *request, void *instruction, rlm
 	return 0;
 }
 
+/** Record how deep the stack got, and release any additional segments
+ *
+ */
+static int _unlang_interpret_stack_free(unlang_stack_t *stack)
+{
+	size_t i;
+
+	atomic_fetch_add_explicit(&stack_stats_stacks, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&stack_stats_depth[stack->depth_max / UNLANG_STACK_SEGMENT], 1,
+				  memory_order_relaxed);
+
+	/*
+	 *	Frame state may still point back into the
+	 *	segments, so free it before we give them away.
+	 */
+	talloc_free_children(stack);
+
+	for (i = 1; i < NUM_ELEMENTS(stack->segment); i++) {
+		if (!stack->segment[i]) continue;
+
+		stack_segment_release(stack->segment[i]);
+		stack->segment[i] = NULL;
+	}
+
+	return 0;
+}
+
 /** Allocate a new unlang stack
+ *
+ * Only the first #UNLANG_STACK_SEGMENT frames are allocated with the
+ * stack.  Further segments are allocated when the stack grows into
+ * them, and are returned to a per-thread cache when the stack is freed.
  *
  * @param[in] ctx	to allocate stack in.
  * @return
@@ -921,8 +1033,8 @@ void *unlang_interpret_stack_alloc(TALLOC_CTX *ctx)
 	/*
 	 *	If we have talloc_pooled_object allocate the
 	 *	stack as a combined chunk/pool, with memory
-	 *	to hold at mutable data for at least a quarter
-	 *	of the maximum number of stack frames.
+	 *	to hold the mutable data for the frames most
+	 *	requests will use.
 	 *
 	 *	Having a dedicated pool for mutable stack data
 	 *	means we don't have memory fragmentations issues
@@ -931,12 +1043,36 @@ void *unlang_interpret_stack_alloc(TALLOC_CTX *ctx)
 	 *	This number is pretty arbitrary, but it seems
 	 *	like too low level to make into a tuneable.
 	 */
-	stack = talloc_zero_pooled_object(ctx, unlang_stack_t, UNLANG_STACK_MAX, 128);	/* 128 bytes per state */
+	stack = talloc_zero_pooled_object(ctx, unlang_stack_t, UNLANG_STACK_POOL_FRAMES,
+					  UNLANG_STACK_POOL_FRAMES * UNLANG_FRAME_PRE_ALLOC);
+	if (unlikely(!stack)) return NULL;
+
+	stack->segment[0] = stack->base;
 	stack->result = RLM_MODULE_NOT_SET;
+	talloc_set_destructor(stack, _unlang_interpret_stack_free);
 
 	return stack;
 }
 
+/** Return the counters for unlang stack allocation
+ *
+ * @param[out] stats	Where to write the counters.
+ */
+void unlang_interpret_stack_stats(unlang_interpret_stack_stats_t *stats)
+{
+	size_t i;
+
+	*stats = (unlang_interpret_stack_stats_t){
+		.stacks = atomic_load_explicit(&stack_stats_stacks, memory_order_relaxed),
+		.segments_alloced = atomic_load_explicit(&stack_stats_segments_alloced, memory_order_relaxed),
+		.segments_reused = atomic_load_explicit(&stack_stats_segments_reused, memory_order_relaxed)
+	};
+
+	for (i = 0; i < NUM_ELEMENTS(stats->depth); i++) {
+		stats->depth[i] = atomic_load_explicit(&stack_stats_depth[i], memory_order_relaxed);
+	}
+}
+
 /** Indicate to the caller of the interpreter that this request is complete
  *
  */
@@ -1024,9 +1160,9 @@ static inline CC_HINT(always_inline) void frame_signal(request_t *request, fr_st
 	 */
 	if (action == FR_SIGNAL_CANCEL) {
 		for (i = depth; i > limit; i--) {
-			frame = &stack->frame[i];
+			frame = stack_frame(stack, i);
 			if (frame->signal) frame->signal(request, frame, action);
-			frame_cleanup(frame);
+			frame_cleanup(stack, frame);
 		}
 		stack->depth = i;
 		return;
@@ -1042,7 +1178,7 @@ static inline CC_HINT(always_inline) void frame_signal(request_t *request, fr_st
 	 *	calls.
 	 */
 	for (i = depth; i > limit; i--) {
-		frame = &stack->frame[i];
+		frame = stack_frame(stack, i);
 		if (frame->signal) frame->signal(request, frame, action);
 	}
 }
@@ -1178,7 +1314,7 @@ bool unlang_request_is_cancelled(request_t const *request)
 bool unlang_interpret_is_resumable(request_t *request)
 {
 	unlang_stack_t			*stack = request->stack;
-	unlang_stack_frame_t		*frame = &stack->frame[stack->depth];
+	unlang_stack_frame_t		*frame = stack_frame(stack, stack->depth);
 
 	return is_yielded(frame);
 }
@@ -1197,7 +1333,7 @@ void unlang_interpret_mark_runnable(request_t *request)
 {
 	unlang_stack_t			*stack = request->stack;
 	unlang_interpret_t		*intp = stack->intp;
-	unlang_stack_frame_t		*frame = &stack->frame[stack->depth];
+	unlang_stack_frame_t		*frame = stack_frame(stack, stack->depth);
 
 	bool 				scheduled = unlang_request_is_scheduled(request);
 
@@ -1240,7 +1376,7 @@ void unlang_interpret_mark_runnable(request_t *request)
 TALLOC_CTX *unlang_interpret_frame_talloc_ctx(request_t *request)
 {
 	unlang_stack_t			*stack = request->stack;
-	unlang_stack_frame_t		*frame = &stack->frame[stack->depth];
+	unlang_stack_frame_t		*frame = stack_frame(stack, stack->depth);
 
 	switch (frame->instruction->type) {
 	default:
@@ -1300,7 +1436,7 @@ static xlat_action_t unlang_interpret_xlat(TALLOC_CTX *ctx, fr_dcursor_t *out,
 	/*
 	 *	Get the current instruction.
 	 */
-	frame = &stack->frame[depth];
+	frame = stack_frame(stack, depth);
 	instruction = frame->instruction;
 
 	/*
@@ -35,7 +35,20 @@ extern "C" {
 #define UNLANG_SUB_FRAME (false)
 
 #define UNLANG_STACK_MAX (64)		//!< The maximum depth of the stack.
+#define UNLANG_STACK_SEGMENT (8)	//!< How many frames are allocated at a time.
 #define UNLANG_FRAME_PRE_ALLOC (128)	//!< How much memory we pre-alloc for each frame.
+#define UNLANG_STACK_POOL_FRAMES (16)	//!< How many frames worth of state memory we pre-alloc.
+
+/** Counters for unlang stack allocation
+ *
+ */
+typedef struct {
+	uint64_t		stacks;					//!< Stacks which have been freed.
+	uint64_t		segments_alloced;			//!< Segments allocated from the heap.
+	uint64_t		segments_reused;			//!< Segments taken from a thread's cache.
+	uint64_t		depth[UNLANG_STACK_MAX / UNLANG_STACK_SEGMENT];	//!< How many stacks had a peak
+										///< depth within each segment.
+} unlang_interpret_stack_stats_t;
 
 /** Interpreter handle
  *
@@ -147,6 +160,8 @@ rlm_rcode_t		unlang_interpret_synchronous(fr_event_list_t *el, request_t *reques
 
 void			*unlang_interpret_stack_alloc(TALLOC_CTX *ctx);
 
+void			unlang_interpret_stack_stats(unlang_interpret_stack_stats_t *stats) CC_HINT(nonnull);
+
 bool			unlang_request_is_scheduled(request_t const *request);
 
 bool			unlang_request_is_cancelled(request_t const *request);
@@ -73,7 +73,7 @@ typedef struct {
 static unlang_action_t list_mod_apply(rlm_rcode_t *p_result, request_t *request)
 {
 	unlang_stack_t			*stack = request->stack;
-	unlang_stack_frame_t		*frame = &stack->frame[stack->depth];
+	unlang_stack_frame_t		*frame = stack_frame(stack, stack->depth);
 	unlang_frame_state_update_t	*update_state = frame->state;
 	vp_list_mod_t const		*vlm = NULL;
 
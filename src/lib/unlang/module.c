@@ -127,7 +127,7 @@ int unlang_module_timeout_add(request_t *request, unlang_module_timeout_t callba
 			      void const *rctx, fr_time_t when)
 {
 	unlang_stack_t			*stack = request->stack;
-	unlang_stack_frame_t		*frame = &stack->frame[stack->depth];
+	unlang_stack_frame_t		*frame = stack_frame(stack, stack->depth);
 	unlang_module_event_t		*ev;
 	unlang_module_t			*mc;
 	unlang_frame_state_module_t	*state = talloc_get_type_abort(frame->state, unlang_frame_state_module_t);
@@ -246,7 +246,7 @@ int unlang_module_fd_add(request_t *request,
 			void const *rctx, int fd)
 {
 	unlang_stack_t			*stack = request->stack;
-	unlang_stack_frame_t		*frame = &stack->frame[stack->depth];
+	unlang_stack_frame_t		*frame = stack_frame(stack, stack->depth);
 	unlang_module_event_t		*ev;
 	unlang_module_t			*mc;
 	unlang_frame_state_module_t	*state = talloc_get_type_abort(frame->state,
@@ -364,7 +364,7 @@ int unlang_module_push(rlm_rcode_t *p_result, request_t *request,
 		return -1;
 	}
 
-	frame = &stack->frame[stack->depth];
+	frame = stack_frame(stack, stack->depth);
 	state = frame->state;
 	*state = (unlang_frame_state_module_t){
 		.p_result = p_result,
@@ -396,7 +396,7 @@ int unlang_module_push(rlm_rcode_t *p_result, request_t *request,
 int unlang_module_set_resume(request_t *request, unlang_module_resume_t resume)
 {
 	unlang_stack_t			*stack = request->stack;
-	unlang_stack_frame_t		*frame = &stack->frame[stack->depth];
+	unlang_stack_frame_t		*frame = stack_frame(stack, stack->depth);
 	unlang_frame_state_module_t	*state;
 
 	/*
@@ -517,7 +517,7 @@ unlang_action_t unlang_module_yield_to_section(rlm_rcode_t *p_result,
 {
 	if (!subcs) {
 		unlang_stack_t		*stack = request->stack;
-		unlang_stack_frame_t	*frame = &stack->frame[stack->depth];
+		unlang_stack_frame_t	*frame = stack_frame(stack, stack->depth);
 		unlang_module_t		*mc;
 
 		fr_assert(frame->instruction->type == UNLANG_TYPE_MODULE);
@@ -568,7 +568,7 @@ unlang_action_t unlang_module_yield(request_t *request,
 				    unlang_module_resume_t resume, unlang_module_signal_t signal, void *rctx)
 {
 	unlang_stack_t			*stack = request->stack;
-	unlang_stack_frame_t		*frame = &stack->frame[stack->depth];
+	unlang_stack_frame_t		*frame = stack_frame(stack, stack->depth);
 	unlang_frame_state_module_t	*state = talloc_get_type_abort(frame->state, unlang_frame_state_module_t);
 
 	REQUEST_VERIFY(request);	/* Check the yielded request is sane */
@@ -811,7 +811,7 @@ static void unlang_module_event_retry_handler(UNUSED fr_event_list_t *el, fr_tim
 {
 	request_t			*request = talloc_get_type_abort(ctx, request_t);
 	unlang_stack_t			*stack = request->stack;
-	unlang_stack_frame_t		*frame = &stack->frame[stack->depth];
+	unlang_stack_frame_t		*frame = stack_frame(stack, stack->depth);
 	unlang_frame_state_module_t	*state = talloc_get_type_abort(frame->state, unlang_frame_state_module_t);
 
 	/*
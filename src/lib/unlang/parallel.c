@@ -31,13 +31,32 @@ RCSID("$Id$")
 #include "subrequest_priv.h"
 
 
+/** Whether enough children have succeeded for the parallel section to finish early
+ *
+ */
+static inline CC_HINT(always_inline) bool unlang_parallel_quorum(unlang_parallel_state_t const *state)
+{
+	return (state->quorum > 0) && (state->num_success >= state->quorum);
+}
+
+/** Mark the parent runnable, if it hasn't been already
+ *
+ */
+static inline CC_HINT(always_inline) void unlang_parallel_wake(request_t *parent, unlang_parallel_state_t *state)
+{
+	if (state->woken) return;
+
+	state->woken = true;
+	unlang_interpret_mark_runnable(parent);
+}
+
 /** Cancel a specific child
  *
  */
-static inline CC_HINT(always_inline) void unlang_parallel_cancel_child(unlang_parallel_state_t *state, int i)
+static inline CC_HINT(always_inline) void unlang_parallel_cancel_child(request_t *request,
+								      unlang_parallel_state_t *state, int i)
 {
 	request_t *child = state->children[i].request;
-	request_t *request = child->parent;	/* For debug messages */
 
 	switch (state->children[i].state) {
 	case CHILD_INIT:
@@ -51,6 +70,12 @@ static inline CC_HINT(always_inline) void unlang_parallel_cancel_child(unlang_pa
 		break;
 
 	case CHILD_RUNNABLE:	/* Don't check runnable_id, may be yielded */
+		/*
+		 *	Change the state first, so that the child
+		 *	doesn't tell us it's exited.
+		 */
+		state->children[i].state = CHILD_CANCELLED;
+
 		/*
 		 *	Signal the child to stop
 		 *
@@ -81,7 +106,7 @@ static inline CC_HINT(always_inline) void unlang_parallel_cancel_child(unlang_pa
 	}
 
 	RDEBUG3("parallel - child %s (%d/%d) CANCELLED",
-		state->children[i].name,
+		state->children[i].name ? state->children[i].name : "<not started>",
 		i + 1, state->num_children);
 	state->children[i].state = CHILD_CANCELLED;
 }
@@ -94,14 +119,14 @@ static inline CC_HINT(always_inline) void unlang_parallel_cancel_child(unlang_pa
 static void unlang_parallel_cancel_siblings(request_t *request)
 {
 	unlang_stack_t		*stack = request->parent->stack;
-	unlang_stack_frame_t	*frame = &stack->frame[stack->depth];
+	unlang_stack_frame_t	*frame = stack_frame(stack, stack->depth);
 	unlang_parallel_state_t	*state = talloc_get_type_abort(frame->state, unlang_parallel_state_t);
 	int i;
 
 	for (i = 0; i < state->num_children; i++) {
 		if (state->children[i].request == request) continue;	/* Don't cancel this one */
 
-		unlang_parallel_cancel_child(state, i);
+		unlang_parallel_cancel_child(request->parent, state, i);
 	}
 }
 #endif
@@ -130,11 +155,11 @@ static void unlang_parallel_child_signal(request_t *request, fr_state_signal_t a
 	state->num_complete++;
 
 	/*
-	 *	All children exited, resume the parent
+	 *	All started children exited, resume the parent
 	 */
-	if (state->num_complete == state->num_children) {
+	if (state->num_complete == state->num_started) {
 		RDEBUG3("Signalling parent %s that all children have EXITED or DETACHED", request->parent->name);
-		unlang_interpret_mark_runnable(request->parent);
+		unlang_parallel_wake(request->parent, state);
 	}
 
 	return;
@@ -143,7 +168,7 @@ static void unlang_parallel_child_signal(request_t *request, fr_state_signal_t a
 /** When the chld is done, tell the parent that we've exited.
  *
  */
-static unlang_action_t unlang_parallel_child_done(UNUSED rlm_rcode_t *p_result, UNUSED int *p_priority, request_t *request, void *uctx)
+static unlang_action_t unlang_parallel_child_done(rlm_rcode_t *p_result, UNUSED int *p_priority, request_t *request, void *uctx)
 {
 	unlang_parallel_child_t *child = uctx;
 
@@ -169,14 +194,23 @@ static unlang_action_t unlang_parallel_child_done(UNUSED rlm_rcode_t *p_result,
 			child->num + 1, state->num_children);
 
 		child->state = CHILD_EXITED;
+		child->result = *p_result;
 		state->num_complete++;
+		if ((*p_result == RLM_MODULE_OK) || (*p_result == RLM_MODULE_UPDATED)) state->num_success++;
 
 		/*
-		 *	All children exited, resume the parent
+		 *	Enough children succeeded, or all the started
+		 *	children exited.  Resume the parent, which
+		 *	cancels or starts the remaining children.
 		 */
-		if (state->num_complete == state->num_children) {
+		if (unlang_parallel_quorum(state)) {
+			RDEBUG3("Signalling parent %s that %d children have succeeded",
+				request->parent->name, state->num_success);
+			unlang_parallel_wake(request->parent, state);
+
+		} else if (state->num_complete == state->num_started) {
 			RDEBUG3("Signalling parent %s that all children have EXITED or DETACHED", request->parent->name);
-			unlang_interpret_mark_runnable(request->parent);
+			unlang_parallel_wake(request->parent, state);
 		}
 	}
 
@@ -186,17 +220,223 @@ static unlang_action_t unlang_parallel_child_done(UNUSED rlm_rcode_t *p_result,
 	return UNLANG_ACTION_CALCULATE_RESULT;
 }
 
+/** Create a child request, and push the instruction it should run
+ *
+ * @param[in] request	The parent request.
+ * @param[in] state	of the parallel section.
+ * @param[in] i		Index of the child to start.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int unlang_parallel_child_start(request_t *request, unlang_parallel_state_t *state, int i)
+{
+	request_t			*child;
+
+	fr_assert(state->children[i].instruction != NULL);
+	child = unlang_io_subrequest_alloc(request,
+					   request->dict, state->detach);
+	child->packet->code = request->packet->code;
+
+	RDEBUG3("parallel - child %s (%d/%d) INIT",
+		child->name,
+		i + 1, state->num_children);
+
+	if (state->clone) {
+		/*
+		 *	Note that we do NOT copy the
+		 *	Session-State list!  That
+		 *	contains state information for
+		 *	the parent.
+		 */
+		if ((fr_pair_list_copy(child->request_ctx,
+				       &child->request_pairs,
+				       &request->request_pairs) < 0) ||
+		    (fr_pair_list_copy(child->reply_ctx,
+				       &child->reply_pairs,
+				       &request->reply_pairs) < 0) ||
+		    (fr_pair_list_copy(child->control_ctx,
+				       &child->control_pairs,
+				       &request->control_pairs) < 0)) {
+			REDEBUG("failed copying lists to clone");
+		error:
+			/*
+			 *	Detached children which have
+			 *	already been created are
+			 *	allowed to continue.
+			 */
+			if (!state->detach) {
+				state->children[i].request = NULL;
+				state->children[i].state = CHILD_CANCELLED;
+
+				/*
+				 *	Remove the current child
+				 */
+				unlang_interpret_request_done(child);
+			}
+
+			return -1;
+		}
+	}
+
+	/*
+	 *	Child starts detached, the parent knows
+	 *	and can exit immediately once all
+	 *	the children are initialised.
+	 */
+	if (state->detach) {
+		if (RDEBUG_ENABLED3) {
+			request_t *parent = request;
+
+			request = child;
+			RDEBUG3("parallel - child %s (%d/%d) DETACHED",
+				request->name,
+				i + 1, state->num_children);
+			request = parent;
+		}
+
+		state->children[i].state = CHILD_DETACHED;
+
+		/*
+		 *	Detach the child, and insert
+		 *	it into the backlog.
+		 */
+		if ((unlang_subrequest_lifetime_set(child) < 0) || (request_detach(child) < 0)) {
+			request = child;
+			RPEDEBUG("Failed detaching request");
+			talloc_free(child);
+
+			return -1;
+		}
+	/*
+	 *	If the children don't start detached
+	 *	push a function onto the stack to
+	 *	notify the parent when the child is
+	 *	done.
+	 */
+	} else {
+		unlang_stack_frame_t *child_frame;
+
+		if (unlang_function_push(child,
+	    				 NULL,
+	    				 unlang_parallel_child_done,
+	    				 unlang_parallel_child_signal,
+	    				 UNLANG_TOP_FRAME,
+	    				 &state->children[i]) < 0) goto error;
+		child_frame = frame_current(child);
+		return_point_set(child_frame);		/* Don't unwind this frame */
+
+		state->children[i].num = i;
+		state->children[i].name = talloc_bstrdup(state, child->name);
+		state->children[i].request = child;
+		state->children[i].state = CHILD_RUNNABLE;
+
+	}
+	interpret_child_init(child);
+
+	/*
+	 *	Push the first instruction for
+	 *      the child to run.
+	 */
+	if (unlang_interpret_push(child,
+				  state->children[i].instruction, RLM_MODULE_FAIL,
+				  UNLANG_NEXT_STOP,
+				  state->detach ? UNLANG_TOP_FRAME : UNLANG_SUB_FRAME) < 0) goto error;
+
+	state->num_started++;
+
+	return 0;
+}
+
+/** The hedge delay expired without enough children succeeding
+ *
+ */
+static void unlang_parallel_hedge_timeout(UNUSED fr_event_list_t *el, UNUSED fr_time_t now, void *uctx)
+{
+	request_t			*request = talloc_get_type_abort(uctx, request_t);
+	unlang_stack_frame_t		*frame = frame_current(request);
+	unlang_parallel_state_t		*state = talloc_get_type_abort(frame->state, unlang_parallel_state_t);
+
+	RDEBUG3("parallel - no result after %pVs, starting the next child", fr_box_time_delta(state->hedge));
+
+	unlang_parallel_wake(request, state);
+}
+
+/** Start the next child of a hedged parallel section
+ *
+ * Children are started when the hedge timer fires, or
+ * as soon as all of the children which were started
+ * have exited without reaching the quorum.
+ *
+ * @param[in] request	The parent request.
+ * @param[in] state	of the parallel section.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int unlang_parallel_hedge_next(request_t *request, unlang_parallel_state_t *state)
+{
+	if (state->num_started > 0) {
+		if (state->num_started == state->num_children) return 0;
+
+		/*
+		 *	The timer is still pending, and there are
+		 *	children running.  Keep waiting.
+		 */
+		if (state->ev && (state->num_complete < state->num_started)) return 0;
+
+		if (state->ev) fr_event_timer_delete(&state->ev);
+	}
+
+	if (unlang_parallel_child_start(request, state, state->num_started) < 0) return -1;
+
+	if (state->num_started == state->num_children) return 0;
+
+	if (fr_event_timer_in(state, unlang_interpret_event_list(request), &state->ev, state->hedge,
+			      unlang_parallel_hedge_timeout, request) < 0) {
+		RPEDEBUG("Failed inserting hedge timer");
+		return -1;
+	}
+
+	return 0;
+}
+
 static unlang_action_t unlang_parallel_resume(rlm_rcode_t *p_result, request_t *request, unlang_stack_frame_t *frame)
 {
 	unlang_parallel_state_t		*state = talloc_get_type_abort(frame->state, unlang_parallel_state_t);
 
 	int				i, priority;
 	rlm_rcode_t			result;
+	bool				quorum = unlang_parallel_quorum(state);
+
+	state->woken = false;
+
+	/*
+	 *	We were woken up to start the next child of a
+	 *	hedged section.
+	 */
+	if (!quorum && (state->num_complete < state->num_children)) {
+		fr_assert(fr_time_delta_ispos(state->hedge));
+
+		if (unlang_parallel_hedge_next(request, state) < 0) {
+			for (i = 0; i < state->num_children; i++) unlang_parallel_cancel_child(request, state, i);
+
+			RETURN_MODULE_FAIL;
+		}
+
+		return UNLANG_ACTION_YIELD;
+	}
+
+	if (state->ev) fr_event_timer_delete(&state->ev);
+
+	if (quorum && (state->num_complete < state->num_children)) {
+		RDEBUG2("parallel - %d of %d children succeeded, cancelling the rest",
+			state->num_success, state->num_children);
+	}
 
 	for (i = 0; i < state->num_children; i++) {
-		if (!state->children[i].request) continue;
+		if (state->children[i].state != CHILD_EXITED) continue;
 
-		fr_assert(state->children[i].state == CHILD_EXITED);
 		REQUEST_VERIFY(state->children[i].request);
 
 		RDEBUG3("parallel - child %s (%d/%d) DONE",
@@ -205,6 +445,14 @@ static unlang_action_t unlang_parallel_resume(rlm_rcode_t *p_result, request_t *
 
 		state->children[i].state = CHILD_DONE;
 
+		/*
+		 *	Once the quorum is reached, the result comes
+		 *	only from the children which succeeded.
+		 */
+		if (quorum &&
+		    (state->children[i].result != RLM_MODULE_OK) &&
+		    (state->children[i].result != RLM_MODULE_UPDATED)) continue;
+
 		priority = ((unlang_stack_t *)state->children[i].request->stack)->priority;
 		result = ((unlang_stack_t *)state->children[i].request->stack)->result;
 
@@ -236,13 +484,25 @@ static unlang_action_t unlang_parallel_resume(rlm_rcode_t *p_result, request_t *
 	}
 
 	/*
-	 *	Reap the children....
+	 *	Reap the children....  Any which are still
+	 *	running, or which haven't been started, are
+	 *	cancelled.
 	 */
 	for (i = 0; i < state->num_children; i++) {
-		if (!state->children[i].request) continue;
-
-		fr_assert(!fr_heap_entry_inserted(state->children[i].request->runnable_id));
-		TALLOC_FREE(state->children[i].request);
+		switch (state->children[i].state) {
+		case CHILD_DONE:
+			fr_assert(!fr_heap_entry_inserted(state->children[i].request->runnable_id));
+			TALLOC_FREE(state->children[i].request);
+			break;
+
+		case CHILD_INIT:
+		case CHILD_RUNNABLE:
+			unlang_parallel_cancel_child(request, state, i);
+			break;
+
+		default:
+			break;
+		}
 	}
 
 	*p_result = state->result;
@@ -255,7 +515,6 @@ static unlang_action_t unlang_parallel_resume(rlm_rcode_t *p_result, request_t *
 static unlang_action_t unlang_parallel_process(rlm_rcode_t *p_result, request_t *request, unlang_stack_frame_t *frame)
 {
 	unlang_parallel_state_t		*state = talloc_get_type_abort(frame->state, unlang_parallel_state_t);
-	request_t			*child;
 	int				i;
 
 	/*
@@ -268,6 +527,20 @@ static unlang_action_t unlang_parallel_process(rlm_rcode_t *p_result, request_t
 		state->result = RLM_MODULE_NOOP;
 	}
 
+	/*
+	 *	Hedged sections start with one child.  The others
+	 *	are started later, and only if they're needed.
+	 */
+	if (fr_time_delta_ispos(state->hedge)) {
+		if (unlang_parallel_hedge_next(request, state) < 0) {
+			for (i = 0; i < state->num_children; i++) unlang_parallel_cancel_child(request, state, i);
+
+			RETURN_MODULE_FAIL;
+		}
+
+		goto yield;
+	}
+
 	/*
 	 *	Loop over all the children.
 	 *
@@ -275,120 +548,18 @@ static unlang_action_t unlang_parallel_process(rlm_rcode_t *p_result, request_t
 	 *	bottom, and we always service all of it.
 	 */
 	for (i = 0; i < state->num_children; i++) {
-		fr_assert(state->children[i].instruction != NULL);
-		child = unlang_io_subrequest_alloc(request,
-						   request->dict, state->detach);
-		child->packet->code = request->packet->code;
-
-		RDEBUG3("parallel - child %s (%d/%d) INIT",
-			child->name,
-			i + 1, state->num_children);
-
-		if (state->clone) {
-			/*
-			 *	Note that we do NOT copy the
-			 *	Session-State list!  That
-			 *	contains state information for
-			 *	the parent.
-			 */
-			if ((fr_pair_list_copy(child->request_ctx,
-					       &child->request_pairs,
-					       &request->request_pairs) < 0) ||
-			    (fr_pair_list_copy(child->reply_ctx,
-					       &child->reply_pairs,
-					       &request->reply_pairs) < 0) ||
-			    (fr_pair_list_copy(child->control_ctx,
-					       &child->control_pairs,
-					       &request->control_pairs) < 0)) {
-				REDEBUG("failed copying lists to clone");
-			error:
-				/*
-				 *	Detached children which have
-				 *	already been created are
-				 *	allowed to continue.
-				 */
-				if (!state->detach) {
-					/*
-					 *	Remove the current child
-					 *
-					 *	Should also free detached children
-					 */
-					unlang_interpret_request_done(child);
-
-					/*
-					 *	Remove all previously
-					 *	spawned children.
-					 */
-					for (--i; i >= 0; i--) unlang_interpret_request_done(child);
-				}
-
-				RETURN_MODULE_FAIL;
-			}
-		}
-
-		/*
-		 *	Child starts detached, the parent knows
-		 *	and can exit immediately once all
-		 *	the children are initialised.
-		 */
-		if (state->detach) {
-			if (RDEBUG_ENABLED3) {
-				request_t *parent = request;
-
-				request = child;
-				RDEBUG3("parallel - child %s (%d/%d) DETACHED",
-					request->name,
-					i + 1, state->num_children);
-				request = parent;
-			}
-
-			state->children[i].state = CHILD_DETACHED;
-
+		if (unlang_parallel_child_start(request, state, i) < 0) {
 			/*
-			 *	Detach the child, and insert
-			 *	it into the backlog.
+			 *	Remove all previously spawned
+			 *	children.  Detached children are
+			 *	allowed to continue.
 			 */
-			if ((unlang_subrequest_lifetime_set(child) < 0) || (request_detach(child) < 0)) {
-				request = child;
-				RPEDEBUG("Failed detaching request");
-				talloc_free(child);
-
-			        RETURN_MODULE_FAIL;
+			if (!state->detach) {
+				for (--i; i >= 0; i--) unlang_parallel_cancel_child(request, state, i);
 			}
-		/*
-		 *	If the children don't start detached
-		 *	push a function onto the stack to
-		 *	notify the parent when the child is
-		 *	done.
-		 */
-		} else {
-			unlang_stack_frame_t *child_frame;
-
-			if (unlang_function_push(child,
-		    				 NULL,
-		    				 unlang_parallel_child_done,
-		    				 unlang_parallel_child_signal,
-		    				 UNLANG_TOP_FRAME,
-		    				 &state->children[i]) < 0) goto error;
-			child_frame = frame_current(child);
-			return_point_set(child_frame);		/* Don't unwind this frame */
-
-			state->children[i].num = i;
-			state->children[i].name = talloc_bstrdup(state, child->name);
-			state->children[i].request = child;
-			state->children[i].state = CHILD_RUNNABLE;
 
+			RETURN_MODULE_FAIL;
 		}
-		interpret_child_init(child);
-
-		/*
-		 *	Push the first instruction for
-		 *      the child to run.
-		 */
-		if (unlang_interpret_push(child,
-					  state->children[i].instruction, RLM_MODULE_FAIL,
-					  UNLANG_NEXT_STOP,
-					  state->detach ? UNLANG_TOP_FRAME : UNLANG_SUB_FRAME) < 0) goto error;
 	}
 
 	/*
@@ -397,6 +568,7 @@ static unlang_action_t unlang_parallel_process(rlm_rcode_t *p_result, request_t
 	 */
 	if (state->detach) return UNLANG_ACTION_CALCULATE_RESULT;
 
+yield:
 	/*
 	 *	Don't call this function again when
 	 *      the parent resumes, instead call
@@ -419,14 +591,16 @@ static unlang_action_t unlang_parallel_process(rlm_rcode_t *p_result, request_t
 /** Send a signal from parent request to all of it's children
  *
  */
-static void unlang_parallel_signal(UNUSED request_t *request,
+static void unlang_parallel_signal(request_t *request,
 				   unlang_stack_frame_t *frame, fr_state_signal_t action)
 {
 	unlang_parallel_state_t	*state = talloc_get_type_abort(frame->state, unlang_parallel_state_t);
 	int			i;
 
 	if (action == FR_SIGNAL_CANCEL) {
-		for (i = 0; i < state->num_children; i++) unlang_parallel_cancel_child(state, i);
+		if (state->ev) fr_event_timer_delete(&state->ev);
+
+		for (i = 0; i < state->num_children; i++) unlang_parallel_cancel_child(request, state, i);
 
 		return;
 	}
@@ -477,6 +651,8 @@ static unlang_action_t unlang_parallel(rlm_rcode_t *p_result, request_t *request
 	state->priority = -1;				/* as-yet unset */
 	state->detach = gext->detach;
 	state->clone = gext->clone;
+	state->quorum = gext->quorum;
+	state->hedge = gext->hedge;
 	state->num_children = g->num_children;
 
 	/*
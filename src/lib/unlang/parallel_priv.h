@@ -54,6 +54,7 @@ typedef struct {
 	request_t			*request; 	//!< Child request.
 	char				*name;		//!< Cache the request name.
 	unlang_t const			*instruction;	//!< broken out of g->children
+	rlm_rcode_t			result;		//!< Result of the child, once it has exited.
 } unlang_parallel_child_t;
 
 typedef struct {
@@ -61,10 +62,17 @@ typedef struct {
 	int				priority;
 
 	int				num_children;	//!< How many children are executing.
+	int				num_started;	//!< How many children have been started.
 	int				num_complete;	//!< How many children are complete.
+	int				num_success;	//!< How many children returned ok or updated.
 
 	bool				detach;		//!< are we creating the child detached
 	bool				clone;		//!< are the children cloned
+	bool				woken;		//!< The parent has been marked runnable.
+
+	int				quorum;		//!< Successful children needed to finish early.
+	fr_time_delta_t			hedge;		//!< Delay before starting the next child.
+	fr_event_timer_t const		*ev;		//!< Hedge timer.
 
 	unlang_parallel_child_t		children[];	//!< Array of children.
 } unlang_parallel_state_t;
@@ -73,6 +81,9 @@ typedef struct {
 	unlang_group_t			group;
 	bool				detach;		//!< are we creating the child detached
 	bool				clone;
+	int				quorum;		//!< Finish once this many children succeed.
+							///< 0 means wait for all of them.
+	fr_time_delta_t			hedge;		//!< Start children one at a time, this far apart.
 } unlang_parallel_t;
 
 /** Cast a group structure to the parallel keyword extension
@@ -27,17 +27,23 @@ RCSID("$Id$")
 #include "group_priv.h"
 #include "switch_priv.h"
 
-static unlang_action_t unlang_switch(rlm_rcode_t *p_result, request_t *request, unlang_stack_frame_t *frame)
+/** Find the 'case' statement matching a value
+ *
+ * Exact matches are checked first.  IP prefixes are stored
+ * with the exact matches, as the prefix trie always returns
+ * the longest matching prefix.  String and octets prefixes
+ * are checked next, followed by the ranges.
+ *
+ * @param[in] gext	the switch to search.
+ * @param[in] box	the value being switched over.
+ * @return
+ *	- The matching 'case'.
+ *	- NULL if no 'case' matches.
+ */
+unlang_t *unlang_switch_find(unlang_switch_t const *gext, fr_value_box_t const *box)
 {
 	unlang_t		*found;
-
-	unlang_group_t		*switch_g;
-	unlang_switch_t		*switch_gext;
-
-	tmpl_t			vpt;
-	fr_value_box_t const	*box = NULL;
-
-	fr_pair_t		*vp;
+	size_t			lo, hi, mid;
 
 	/*
 	 *	Mock up an unlang_cast_t.  Note that these on-stack
@@ -57,11 +63,81 @@ static unlang_action_t unlang_switch(rlm_rcode_t *p_result, request_t *request,
 					.vpt = &case_vpt,
 				};
 
+	/*
+	 *	case_gext->vpt.data.literal is an in-line box, so we
+	 *	have to make a shallow copy of its contents.
+	 *
+	 *	Note: We do not pass a ctx here as we don't want to
+	 *	create a reference.
+	 */
+	fr_value_box_copy_shallow(NULL, &case_vpt.data.literal, box);
+	found = fr_htrie_find(gext->ht, &my_case);
+	if (found) return found;
+
+	if (gext->prefix && box->vb_length && ((box->type == FR_TYPE_STRING) || (box->type == FR_TYPE_OCTETS))) {
+		size_t len = box->vb_length;
+
+		/*
+		 *	Prefixes are limited in length, so anything
+		 *	past the limit can't change the result.
+		 */
+		if (len > UNLANG_CASE_PREFIX_MAX) len = UNLANG_CASE_PREFIX_MAX;
+
+		found = fr_trie_lookup_by_key(gext->prefix, box->vb_octets, len * 8);
+		if (found) return found;
+	}
+
+	if (!gext->num_ranges || (box->type != tmpl_value_type(gext->ranges[0]->vpt))) return NULL;
+
+	/*
+	 *	Find the last range which starts at or before the
+	 *	value.  Ranges don't overlap, so it's the only one
+	 *	which can contain the value.
+	 */
+	lo = 0;
+	hi = gext->num_ranges;
+	while (lo < hi) {
+		mid = lo + ((hi - lo) / 2);
+
+		if (fr_value_box_cmp(tmpl_value(gext->ranges[mid]->vpt), box) <= 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	if (lo == 0) return NULL;
+
+	if (fr_value_box_cmp(box, tmpl_value(gext->ranges[lo - 1]->high)) > 0) return NULL;
+
+	return unlang_group_to_generic(unlang_case_to_group(gext->ranges[lo - 1]));
+}
+
+static unlang_action_t unlang_switch(rlm_rcode_t *p_result, request_t *request, unlang_stack_frame_t *frame)
+{
+	unlang_t		*found;
+
+	unlang_group_t		*switch_g;
+	unlang_switch_t		*switch_gext;
+
+	tmpl_t			vpt;
+	fr_value_box_t const	*box = NULL;
+
+	fr_pair_t		*vp;
+
 	switch_g = unlang_generic_to_group(frame->instruction);
 	switch_gext = unlang_group_to_switch(switch_g);
 
 	found = NULL;
 
+	/*
+	 *	Switch over constant data.  The matching 'case'
+	 *	was resolved when the switch was compiled.
+	 */
+	if (tmpl_is_data(switch_gext->vpt)) {
+		found = switch_gext->default_case;
+		goto do_null_case;
+	}
+
 	/*
 	 *	The attribute doesn't exist.  We can skip
 	 *	directly to the default 'case' statement.
@@ -95,15 +171,7 @@ static unlang_action_t unlang_switch(rlm_rcode_t *p_result, request_t *request,
 		return UNLANG_ACTION_FAIL;
 	}
 
-	/*
-	 *	case_gext->vpt.data.literal is an in-line box, so we
-	 *	have to make a shallow copy of its contents.
-	 *
-	 *	Note: We do not pass a ctx here as we don't want to
-	 *	create a reference.
-	 */
-	fr_value_box_copy_shallow(NULL, &case_vpt.data.literal, box);
-	found = fr_htrie_find(switch_gext->ht, &my_case);
+	found = unlang_switch_find(switch_gext, box);
 	if (!found) {
 	find_null_case:
 		found = switch_gext->default_case;
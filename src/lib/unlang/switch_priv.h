@@ -29,11 +29,31 @@ extern "C" {
 #include <freeradius-devel/server/tmpl.h>
 #include <freeradius-devel/util/htrie.h>
 
+/** Longest string or octets prefix a 'case' may match
+ *
+ * Must not be more than the maximum key length of the prefix trie.
+ */
+#define UNLANG_CASE_PREFIX_MAX	(255)
+
+/** How a 'case' statement matches the value being switched over
+ *
+ */
+typedef enum {
+	UNLANG_CASE_MATCH_EXACT = 0,		//!< case <value>
+	UNLANG_CASE_MATCH_PREFIX,		//!< case <string>* or case <ipaddr>/<len>
+	UNLANG_CASE_MATCH_RANGE			//!< case <low> .. <high>
+} unlang_case_match_t;
+
+typedef struct unlang_case_s unlang_case_t;
+
 typedef struct {
 	unlang_group_t	group;
 	unlang_t	*default_case;
 	tmpl_t		*vpt;
-	fr_htrie_t	*ht;
+	fr_htrie_t	*ht;			//!< Exact matches, and IP prefixes.
+	fr_trie_t	*prefix;		//!< String and octets prefixes.
+	unlang_case_t	**ranges;		//!< Ranges, sorted by their start.
+	size_t		num_ranges;		//!< Number of entries in the range array.
 } unlang_switch_t;
 
 /** Cast a group structure to the switch keyword extension
@@ -52,10 +72,12 @@ static inline unlang_group_t *unlang_switch_to_group(unlang_switch_t *sw)
 	return (unlang_group_t *)sw;
 }
 
-typedef struct {
-	unlang_group_t	group;
-	tmpl_t		*vpt;
-} unlang_case_t;
+struct unlang_case_s {
+	unlang_group_t		group;
+	tmpl_t			*vpt;		//!< Value, prefix, or the start of the range.
+	tmpl_t			*high;		//!< End of the range (inclusive).
+	unlang_case_match_t	match;		//!< How the case matches.
+};
 
 /** Cast a group structure to the case keyword extension
  *
@@ -73,6 +95,8 @@ static inline unlang_group_t *unlang_case_to_group(unlang_case_t *sw)
 	return (unlang_group_t *)sw;
 }
 
+unlang_t *unlang_switch_find(unlang_switch_t const *gext, fr_value_box_t const *box);
+
 #ifdef __cplusplus
 }
 #endif
@@ -125,6 +125,7 @@ struct unlang_s {
 	bool			closed;		//!< whether or not this section is closed to new statements
 	unsigned int		number;		//!< unique node number
 	unlang_actions_t	actions;	//!< Priorities, etc. for the various return codes.
+	CONF_ITEM const		*ci;		//!< Configuration item the node was compiled from.
 };
 
 /** Describes how to allocate an #unlang_group_t with additional memory keyword specific data
@@ -231,22 +232,16 @@ typedef struct {
 	unlang_t const		*instruction;			//!< instruction which we're executing
 	void			*thread_inst;			//!< thread-specific instance data
 #ifdef WITH_PERF
-	uint64_t		use_count;
-	fr_time_t		enter;
+	uint64_t		use_count;			//!< How many times the instruction was executed.
+	uint64_t		sampled;			//!< How many executions were timed.
+	uint64_t		yielded;			//!< How many times the instruction yielded.
 
-	fr_time_delta_t		cpu_time;
+	fr_time_delta_t		cpu_time;			//!< Time spent in sampled executions, including
+								///< children, but excluding time spent yielded.
+	fr_time_delta_t		yielded_time;			//!< Time spent yielded.
 #endif
 } unlang_thread_t;
 
-#ifdef WITH_PERF
-void		unlang_frame_perf_init(unlang_t const *instruction);
-
-void		unlang_frame_perf_cleanup(unlang_t const *instruction);
-#else
-#define		unlang_frame_perf_init(_x)
-#define		unlang_frame_perf_cleanup(_x)
-#endif
-
 typedef struct {
 	request_t		*request;
 	int			depth;				//!< of this retry structure
@@ -295,6 +290,12 @@ struct unlang_stack_frame_s {
 								///< result stored in the lower stack frame should
 								///< be replaced.
 	uint8_t			uflags;				//!< Unwind markers
+
+#ifdef WITH_PERF
+	fr_time_t		perf_enter;			//!< When this frame started executing.
+								///< Zero if the execution isn't being timed.
+	fr_time_delta_t		perf_yielded;			//!< Stack yield time when the frame started.
+#endif
 };
 
 /** An unlang stack associated with a request
@@ -308,9 +309,69 @@ typedef struct {
 	int			depth;				//!< Current depth we're executing at.
 	uint8_t			unwind;				//!< Unwind to this frame if it exists.
 								///< This is used for break and return.
-	unlang_stack_frame_t	frame[UNLANG_STACK_MAX];	//!< The stack...
+#ifdef WITH_PERF
+	fr_time_t		perf_yield_start;		//!< When the request last yielded.
+	fr_time_delta_t		perf_yielded;			//!< Total time the request has spent yielded.
+#endif
+	int			depth_max;			//!< Deepest frame used by this stack.
+	unlang_stack_frame_t	*segment[UNLANG_STACK_MAX / UNLANG_STACK_SEGMENT];	//!< The stack...
+								///< Segments past the first are only
+								///< allocated when the stack grows into them,
+								///< and are never moved once allocated.
+	unlang_stack_frame_t	base[UNLANG_STACK_SEGMENT];	//!< First segment, allocated with the stack.
 } unlang_stack_t;
 
+/** Return the frame at a given depth
+ *
+ * The segment containing the frame must already have been allocated.
+ */
+static inline unlang_stack_frame_t *stack_frame(unlang_stack_t *stack, int depth)
+{
+	return &stack->segment[depth / UNLANG_STACK_SEGMENT][depth % UNLANG_STACK_SEGMENT];
+}
+
+/** Return the depth of a frame
+ *
+ * Frames in different segments can't be ordered by address, so find
+ * the segment the frame is in.
+ *
+ * @return
+ *	- The depth of the frame.
+ *	- -1 if the frame isn't on this stack.
+ */
+static inline int stack_frame_depth(unlang_stack_t *stack, unlang_stack_frame_t const *frame)
+{
+	size_t i;
+
+	for (i = 0; i < NUM_ELEMENTS(stack->segment); i++) {
+		if (!stack->segment[i]) continue;
+
+		if ((frame >= stack->segment[i]) && (frame < (stack->segment[i] + UNLANG_STACK_SEGMENT))) {
+			return (i * UNLANG_STACK_SEGMENT) + (frame - stack->segment[i]);
+		}
+	}
+
+	return -1;
+}
+
+#ifdef WITH_PERF
+void		unlang_frame_perf_init(unlang_stack_t *stack, unlang_stack_frame_t *frame);
+
+void		unlang_frame_perf_cleanup(unlang_stack_t *stack, unlang_stack_frame_t *frame);
+
+void		unlang_perf_yield(unlang_stack_t *stack);
+
+void		unlang_perf_resume(unlang_stack_t *stack);
+#else
+static inline void unlang_frame_perf_init(UNUSED unlang_stack_t *stack, UNUSED unlang_stack_frame_t *frame) {}
+
+static inline void unlang_frame_perf_cleanup(UNUSED unlang_stack_t *stack, UNUSED unlang_stack_frame_t *frame) {}
+
+static inline void unlang_perf_yield(UNUSED unlang_stack_t *stack) {}
+
+static inline void unlang_perf_resume(UNUSED unlang_stack_t *stack) {}
+#endif
+
 /** Different operations the interpreter can execute
  */
 extern unlang_op_t unlang_ops[];
@@ -376,7 +437,7 @@ static inline unlang_stack_frame_t *frame_current(request_t *request)
 {
 	unlang_stack_t *stack = request->stack;
 
-	return &stack->frame[stack->depth];
+	return stack_frame(stack, stack->depth);
 }
 
 static inline int stack_depth_current(request_t *request)
@@ -392,7 +453,7 @@ static inline void frame_state_init(unlang_stack_t *stack, unlang_stack_frame_t
 	unlang_op_t	*op;
 	char const	*name;
 
-	unlang_frame_perf_init(instruction);
+	unlang_frame_perf_init(stack, frame);
 
 	op = &unlang_ops[instruction->type];
 	name = op->frame_state_type ? op->frame_state_type : __location__;
@@ -434,7 +495,7 @@ static inline void frame_state_init(unlang_stack_t *stack, unlang_stack_frame_t
 /** Cleanup any lingering frame state
  *
  */
-static inline void frame_cleanup(unlang_stack_frame_t *frame)
+static inline void frame_cleanup(unlang_stack_t *stack, unlang_stack_frame_t *frame)
 {
 	/*
 	 *	Don't clear top_frame flag, bad things happen...
@@ -445,7 +506,7 @@ static inline void frame_cleanup(unlang_stack_frame_t *frame)
 		TALLOC_FREE(frame->state);
 	}
 
-	unlang_frame_perf_cleanup(frame->instruction);
+	unlang_frame_perf_cleanup(stack, frame);
 }
 
 /** Advance to the next sibling instruction
@@ -453,7 +514,7 @@ static inline void frame_cleanup(unlang_stack_frame_t *frame)
  */
 static inline void frame_next(unlang_stack_t *stack, unlang_stack_frame_t *frame)
 {
-	frame_cleanup(frame);
+	frame_cleanup(stack, frame);
 	frame->instruction = frame->next;
 
 	if (!frame->instruction) return;
@@ -474,7 +535,7 @@ static inline void frame_pop(request_t *request, unlang_stack_t *stack)
 
 	fr_assert(stack->depth > 1);
 
-	frame = &stack->frame[stack->depth];
+	frame = stack_frame(stack, stack->depth);
 
 	/*
 	 *	We clean up the retries when we pop the frame, not
@@ -485,9 +546,9 @@ static inline void frame_pop(request_t *request, unlang_stack_t *stack)
 	 */
 	talloc_free(frame->retry);
 
-	frame_cleanup(frame);
+	frame_cleanup(stack, frame);
 
-	frame = &stack->frame[--stack->depth];
+	frame = stack_frame(stack, --stack->depth);
 
 	/*
 	 *	Signal the frame to get it back into a consistent state
@@ -138,7 +138,7 @@ int unlang_xlat_timeout_add(request_t *request,
 			    fr_unlang_xlat_timeout_t callback, void const *rctx, fr_time_t when)
 {
 	unlang_stack_t			*stack = request->stack;
-	unlang_stack_frame_t		*frame = &stack->frame[stack->depth];
+	unlang_stack_frame_t		*frame = stack_frame(stack, stack->depth);
 	unlang_xlat_event_t		*ev;
 	unlang_frame_state_xlat_t	*state = talloc_get_type_abort(frame->state, unlang_frame_state_xlat_t);
 
@@ -218,7 +218,7 @@ int unlang_xlat_push(TALLOC_CTX *ctx, bool *p_success, fr_value_box_list_t *out,
 	 */
 	if (unlang_interpret_push(request, &xlat_instruction,
 				  RLM_MODULE_NOT_SET, UNLANG_NEXT_STOP, top_frame) < 0) return -1;
-	frame = &stack->frame[stack->depth];
+	frame = stack_frame(stack, stack->depth);
 
 	/*
 	 *	Allocate its state, and setup a cursor for the xlat nodes
@@ -457,7 +457,7 @@ xlat_action_t unlang_xlat_yield(request_t *request,
 				void *rctx)
 {
 	unlang_stack_t			*stack = request->stack;
-	unlang_stack_frame_t		*frame = &stack->frame[stack->depth];
+	unlang_stack_frame_t		*frame = stack_frame(stack, stack->depth);
 	unlang_frame_state_xlat_t	*state = talloc_get_type_abort(frame->state, unlang_frame_state_xlat_t);
 
 	frame->process = unlang_xlat_resume;
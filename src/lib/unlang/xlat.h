@@ -266,6 +266,18 @@ typedef int (*xlat_thread_detach_t)(xlat_thread_inst_ctx_t const *xctx);
 
 typedef size_t (*xlat_escape_legacy_t)(request_t *request, char *out, size_t outlen, char const *in, void *arg);
 
+/** Counters for synchronous expansions
+ *
+ */
+typedef struct {
+	uint64_t		streamed;		//!< Expansions printed directly to a buffer.
+	uint64_t		streamed_allocs;	//!< Allocations made by streamed expansions.
+	uint64_t		interpreted;		//!< Expansions evaluated by the interpreter.
+	uint64_t		interpreted_blocks;	//!< Talloc blocks still held by interpreted expansions
+							///< when they completed.  Intermediate allocations
+							///< which were freed during evaluation aren't counted.
+} xlat_eval_stats_t;
+
 int		xlat_fmt_get_vp(fr_pair_t **out, request_t *request, char const *name);
 
 ssize_t		xlat_eval(char *out, size_t outlen, request_t *request, char const *fmt, xlat_escape_legacy_t escape,
@@ -291,6 +303,8 @@ int		xlat_flatten_compiled_argv(TALLOC_CTX *ctx, xlat_exp_t const ***argv, xlat_
 
 bool		xlat_async_required(xlat_exp_t const *xlat);
 
+void		xlat_eval_stats(xlat_eval_stats_t *stats) CC_HINT(nonnull);
+
 
 ssize_t		xlat_tokenize_expression(TALLOC_CTX *ctx, xlat_exp_t **head, xlat_flags_t *flags, fr_sbuff_t *in,
 					 fr_sbuff_parse_rules_t const *p_rules, tmpl_rules_t const *t_rules);
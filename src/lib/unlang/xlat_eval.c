@@ -31,6 +31,7 @@ RCSID("$Id$")
 #include <freeradius-devel/server/tmpl_dcursor.h>
 #include <freeradius-devel/unlang/xlat_priv.h>
 #include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/stdatomic.h>
 
 #include <freeradius-devel/unlang/unlang_priv.h>	/* Remove when everything uses new xlat API */
 
@@ -828,6 +829,45 @@ xlat_eval_pair_real(TALLOC_CTX *ctx, fr_value_box_list_t *out, request_t *reques
 
 	fr_assert(tmpl_is_attr(vpt) || tmpl_is_list(vpt));
 
+	/*
+	 *	Single attribute in a list of the current request,
+	 *	which doesn't need the cursor.
+	 */
+	switch (tmpl_attr_fast(vpt)) {
+	case TMPL_ATTR_FAST_FIRST:
+		vp = tmpl_attr_fast_find(NULL, request, vpt);
+		if (!vp) {
+			if (tmpl_da(vpt)->flags.virtual) return xlat_eval_pair_virtual(ctx, out, request, vpt);
+			return XLAT_ACTION_DONE;
+		}
+
+		value = fr_value_box_alloc(ctx, vp->data.type, vp->da, vp->data.tainted);
+		if (!value) {
+			fr_strerror_const("Out of memory");
+			return XLAT_ACTION_FAIL;
+		}
+
+		fr_value_box_copy(value, value, &vp->data);	/* Also dups taint */
+		fr_dlist_insert_tail(out, value);
+		return XLAT_ACTION_DONE;
+
+	case TMPL_ATTR_FAST_COUNT:
+	{
+		uint32_t count;
+
+		(void) tmpl_attr_fast_count(&count, request, vpt);
+		if (!count && tmpl_da(vpt)->flags.virtual) return xlat_eval_pair_virtual(ctx, out, request, vpt);
+
+		MEM(value = fr_value_box_alloc(ctx, FR_TYPE_UINT32, NULL, false));
+		value->datum.uint32 = count;
+		fr_dlist_insert_tail(out, value);
+		return XLAT_ACTION_DONE;
+	}
+
+	case TMPL_ATTR_FAST_NONE:
+		break;
+	}
+
 	/*
 	 *	See if we're dealing with an attribute in the request
 	 *
@@ -1369,6 +1409,144 @@ finish:
 	return xa;
 }
 
+/** Maximum length of an expansion which will be printed directly to a buffer
+ *
+ * Longer expansions fall back to the interpreter.
+ */
+#define XLAT_STREAM_MAX	65536
+
+/*
+ *	Counters for synchronous expansions
+ */
+static atomic_uint_fast64_t	xlat_eval_streamed;
+static atomic_uint_fast64_t	xlat_eval_streamed_allocs;
+static atomic_uint_fast64_t	xlat_eval_interpreted;
+static atomic_uint_fast64_t	xlat_eval_interpreted_blocks;
+
+/** Whether an expansion can be printed directly to a buffer
+ *
+ * Only literals and simple attribute references qualify.  Everything
+ * else either needs the interpreter, or produces lists of values.
+ */
+static bool xlat_eval_streamable(xlat_exp_t const *head)
+{
+	xlat_exp_t const *node;
+
+	for (node = head; node; node = node->next) {
+		switch (node->type) {
+		case XLAT_BOX:
+			continue;
+
+		case XLAT_TMPL:
+			if (tmpl_is_data(node->vpt)) continue;
+
+			if ((tmpl_attr_fast(node->vpt) != TMPL_ATTR_FAST_NONE) &&
+			    !tmpl_da(node->vpt)->flags.virtual) continue;
+
+			return false;
+
+		default:
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/** Print a single value to the output buffer, escaping it if it's tainted
+ *
+ */
+static int xlat_eval_stream_value(fr_sbuff_t *out, request_t *request, fr_value_box_t const *vb,
+				  xlat_escape_legacy_t escape, void const *escape_ctx)
+{
+	fr_sbuff_t	*unescaped;
+	size_t		len;
+
+	if (!escape || !vb->tainted) return (fr_value_box_print(out, vb, NULL) < 0) ? -1 : 0;
+
+	FR_SBUFF_TALLOC_THREAD_LOCAL(&unescaped, 256, XLAT_STREAM_MAX);
+
+	if (fr_value_box_print(unescaped, vb, NULL) < 0) return -1;
+	fr_sbuff_terminate(unescaped);
+
+	/*
+	 *	Same worst case as the interpreted path
+	 */
+	len = (fr_sbuff_used(unescaped) * 3) + 1;
+	if (fr_sbuff_extend_lowat(NULL, out, len) < len) return -1;
+
+	len = escape(request, fr_sbuff_current(out), len, fr_sbuff_start(unescaped), UNCONST(void *, escape_ctx));
+	(void) fr_sbuff_advance(out, len);
+
+	return 0;
+}
+
+/** Print an expansion directly to a buffer
+ *
+ * This avoids allocating value boxes for every node in the expansion,
+ * and concatenating them afterwards.
+ *
+ * @param[out] out		to write the expansion to.
+ * @param[in] request		The current request.
+ * @param[in] head		of the expansion.  Must have been checked
+ *				with #xlat_eval_streamable.
+ * @param[in] escape		function to escape tainted values.
+ * @param[in] escape_ctx	pointer to pass to escape function.
+ * @return
+ *	- 0 on success.
+ *	- -1 if the expansion didn't fit in the buffer.
+ */
+static int xlat_eval_stream(fr_sbuff_t *out, request_t *request, xlat_exp_t const *head,
+			    xlat_escape_legacy_t escape, void const *escape_ctx)
+{
+	xlat_exp_t const	*node;
+	fr_pair_t		*vp;
+	uint32_t		count;
+
+	for (node = head; node; node = node->next) {
+		if (node->type == XLAT_BOX) {
+			if (xlat_eval_stream_value(out, request, &node->data, escape, escape_ctx) < 0) return -1;
+			continue;
+		}
+
+		fr_assert(node->type == XLAT_TMPL);
+
+		if (tmpl_is_data(node->vpt)) {
+			if (xlat_eval_stream_value(out, request, tmpl_value(node->vpt), escape, escape_ctx) < 0) return -1;
+			continue;
+		}
+
+		if (tmpl_attr_fast(node->vpt) == TMPL_ATTR_FAST_COUNT) {
+			(void) tmpl_attr_fast_count(&count, request, node->vpt);
+			if (fr_value_box_print(out, fr_box_uint32(count), NULL) < 0) return -1;
+			continue;
+		}
+
+		vp = tmpl_attr_fast_find(NULL, request, node->vpt);
+		if (!vp) continue;
+
+		if (xlat_eval_stream_value(out, request, &vp->data, escape, escape_ctx) < 0) return -1;
+	}
+
+	fr_sbuff_terminate(out);
+
+	return 0;
+}
+
+/** Return the counters for synchronous expansions
+ *
+ * @param[out] stats	Where to write the counters.
+ */
+void xlat_eval_stats(xlat_eval_stats_t *stats)
+{
+	*stats = (xlat_eval_stats_t){
+		.streamed = atomic_load_explicit(&xlat_eval_streamed, memory_order_relaxed),
+		.streamed_allocs = atomic_load_explicit(&xlat_eval_streamed_allocs, memory_order_relaxed),
+		.interpreted = atomic_load_explicit(&xlat_eval_interpreted, memory_order_relaxed),
+		.interpreted_blocks = atomic_load_explicit(&xlat_eval_interpreted_blocks, memory_order_relaxed)
+	};
+}
+
 static ssize_t xlat_eval_sync(TALLOC_CTX *ctx, char **out, request_t *request, xlat_exp_t const * const head,
 			      xlat_escape_legacy_t escape, void const *escape_ctx)
 {
@@ -1449,6 +1627,15 @@ static ssize_t xlat_eval_sync(TALLOC_CTX *ctx, char **out, request_t *request, x
 	} else {
 		str = talloc_strdup(ctx, "");
 	}
+
+	/*
+	 *	This isn't the number of allocations, as anything
+	 *	freed during evaluation is no longer in the pool.
+	 *	It's what the expansion was still holding on to.
+	 */
+	atomic_fetch_add_explicit(&xlat_eval_interpreted, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&xlat_eval_interpreted_blocks, talloc_total_blocks(pool), memory_order_relaxed);
+
 	talloc_free(pool);	/* Memory should be in new ctx */
 
 	*out = str;
@@ -1477,6 +1664,36 @@ static ssize_t _xlat_eval_compiled(TALLOC_CTX *ctx, char **out, size_t outlen, r
 
 	fr_assert(node != NULL);
 
+	/*
+	 *	Simple expansions are printed directly to a
+	 *	per-thread buffer.  If debugging is enabled, we
+	 *	use the interpreter so that the expansion is logged.
+	 */
+	if (!RDEBUG_ENABLED2 && xlat_eval_streamable(node)) {
+		fr_sbuff_t *sbuff;
+
+		FR_SBUFF_TALLOC_THREAD_LOCAL(&sbuff, 1024, XLAT_STREAM_MAX);
+
+		if (xlat_eval_stream(sbuff, request, node, escape, escape_ctx) == 0) {
+			slen = fr_sbuff_used(sbuff);
+
+			atomic_fetch_add_explicit(&xlat_eval_streamed, 1, memory_order_relaxed);
+
+			if (!*out) {
+				MEM(*out = talloc_bstrndup(ctx, fr_sbuff_start(sbuff), slen));
+				atomic_fetch_add_explicit(&xlat_eval_streamed_allocs, 1, memory_order_relaxed);
+				return slen;
+			}
+
+			strlcpy(*out, fr_sbuff_start(sbuff), outlen);
+			return slen;
+		}
+
+		/*
+		 *	Too long, fall back to the interpreter.
+		 */
+	}
+
 	slen = xlat_eval_sync(ctx, &buff, request, node, escape, escape_ctx);
 	if (slen < 0) {
 		fr_assert(buff == NULL);
@@ -27,6 +27,9 @@ RCSID("$Id$")
 
 #include <freeradius-devel/util/regex.h>
 #include <freeradius-devel/util/atexit.h>
+#include <freeradius-devel/util/dlist.h>
+#include <freeradius-devel/util/rb.h>
+#include <freeradius-devel/util/stdatomic.h>
 
 #if defined(HAVE_REGEX_PCRE) || (defined(HAVE_REGEX_PCRE2) && defined(PCRE2_CONFIG_JIT))
 #ifndef FR_PCRE_JIT_STACK_MIN
@@ -1333,4 +1336,223 @@ ssize_t regex_flags_print(fr_sbuff_t *sbuff, fr_regex_flags_t const *flags)
 
 	return fr_sbuff_set(sbuff, &our_sbuff);
 }
+
+/*
+ *########################################
+ *#        COMPILED REGEX CACHE          #
+ *########################################
+ */
+
+/** A compiled expression held in the thread local cache
+ *
+ */
+typedef struct {
+	fr_rb_node_t		node;		//!< Entry in the lookup tree.
+	fr_dlist_t		entry;		//!< Entry in the LRU list.
+
+	uint8_t			opts;		//!< Compile time flags, and whether subcaptures are enabled.
+	char			*pattern;	//!< Pattern the expression was compiled from.
+	size_t			len;		//!< Length of the pattern.
+
+	regex_t			*preg;		//!< The compiled expression.
+} regex_cache_entry_t;
+
+/** Thread local cache of runtime compiled expressions
+ *
+ */
+typedef struct {
+	fr_rb_tree_t		*tree;		//!< Entries indexed by pattern and options.
+	fr_dlist_head_t		lru;		//!< Entries ordered by last use, most recent at the head.
+} regex_cache_t;
+
+static _Thread_local regex_cache_t *regex_cache;
+
+static atomic_uint_fast64_t regex_cache_hits;
+static atomic_uint_fast64_t regex_cache_misses;
+static atomic_uint_fast64_t regex_cache_evictions;
+
+/** Pack the flags which alter compilation into a single value
+ *
+ * 'g' is implemented by the substitution function, so doesn't change the compiled
+ * expression, and isn't included.
+ */
+static inline CC_HINT(always_inline) uint8_t regex_cache_opts(fr_regex_flags_t const *flags, bool subcaptures)
+{
+	uint8_t opts = subcaptures;
+
+	if (!flags) return opts;
+
+	opts |= flags->ignore_case << 1;
+	opts |= flags->multiline << 2;
+	opts |= flags->dot_all << 3;
+	opts |= flags->unicode << 4;
+	opts |= flags->extended << 5;
+
+	return opts;
+}
+
+static int8_t regex_cache_cmp(void const *one, void const *two)
+{
+	regex_cache_entry_t const *a = one, *b = two;
+
+	CMP_RETURN(a, b, opts);
+	MEMCMP_RETURN(a, b, pattern, len);
+
+	return 0;
+}
+
+/** Release the cache's hold on the compiled expression
+ *
+ * If the expression is still referenced by subcapture data, ownership passes to the
+ * subcapture data, and the expression is freed along with it.
+ */
+static int _regex_cache_entry_free(regex_cache_entry_t *entry)
+{
+	if (entry->preg) talloc_unlink(entry, entry->preg);
+
+	return 0;
+}
+
+static void _regex_cache_free_on_exit(void *arg)
+{
+	talloc_free(arg);
+}
+
+static int regex_cache_init(void)
+{
+	regex_cache_t *cache;
+
+	cache = talloc_zero(NULL, regex_cache_t);
+	if (unlikely(!cache)) {
+	oom:
+		fr_strerror_const("Out of memory");
+		talloc_free(cache);
+		return -1;
+	}
+
+	cache->tree = fr_rb_inline_talloc_alloc(cache, regex_cache_entry_t, node, regex_cache_cmp, NULL);
+	if (unlikely(!cache->tree)) goto oom;
+	fr_dlist_talloc_init(&cache->lru, regex_cache_entry_t, entry);
+
+	/*
+	 *	Free on thread exit
+	 */
+	fr_atexit_thread_local(regex_cache, _regex_cache_free_on_exit, cache);
+
+	return 0;
+}
+
+/** Compile an expression, or return a previously compiled copy from the thread local cache
+ *
+ * Intended for patterns produced by expansions at runtime, which would otherwise be
+ * recompiled on every evaluation.
+ *
+ * The cache is bounded to #REGEX_CACHE_MAX_ENTRIES per thread, with the least recently
+ * used expression being evicted when it's full.
+ *
+ * @note The compiled expression is owned by the cache and must NOT be freed by the caller.
+ *	It remains valid until the next call to this function from the same thread,
+ *	or for as long as subcapture data referencing it exists.
+ *
+ * @param[out] out		Where to write out a pointer to the compiled expression.
+ * @param[in] pattern		to compile.
+ * @param[in] len		of pattern.
+ * @param[in] flags		controlling matching. May be NULL.
+ * @param[in] subcaptures	Whether to compile the regular expression to store subcapture
+ *				data.
+ * @return
+ *	- >= 1 on success.
+ *	- <= 0 on error. Negative value is offset of parse error.
+ */
+ssize_t regex_compile_cached(regex_t **out, char const *pattern, size_t len,
+			     fr_regex_flags_t const *flags, bool subcaptures)
+{
+	regex_cache_t		*cache;
+	regex_cache_entry_t	*entry, *oldest;
+	ssize_t			slen;
+
+	*out = NULL;
+
+	/*
+	 *	Thread local initialisation
+	 */
+	if (unlikely(!regex_cache) && (regex_cache_init() < 0)) return -1;
+	cache = regex_cache;
+
+	entry = fr_rb_find(cache->tree, &(regex_cache_entry_t){
+					.opts = regex_cache_opts(flags, subcaptures),
+					.pattern = UNCONST(char *, pattern),
+					.len = len
+				  });
+	if (entry) {
+		atomic_fetch_add_explicit(&regex_cache_hits, 1, memory_order_relaxed);
+
+		fr_dlist_remove(&cache->lru, entry);
+		fr_dlist_insert_head(&cache->lru, entry);
+
+		*out = entry->preg;
+		return len;
+	}
+	atomic_fetch_add_explicit(&regex_cache_misses, 1, memory_order_relaxed);
+
+	entry = talloc_zero(cache, regex_cache_entry_t);
+	if (unlikely(!entry)) {
+	oom:
+		fr_strerror_const("Out of memory");
+		talloc_free(entry);
+		return -1;
+	}
+
+	slen = regex_compile(entry, &entry->preg, pattern, len, flags, subcaptures, true);
+	if (slen <= 0) {
+		talloc_free(entry);
+		return slen;
+	}
+
+	entry->pattern = talloc_memdup(entry, pattern, len);
+	if (unlikely(!entry->pattern)) goto oom;
+	entry->len = len;
+	entry->opts = regex_cache_opts(flags, subcaptures);
+
+#if defined(HAVE_REGEX_PCRE) || defined(HAVE_REGEX_PCRE2)
+	entry->preg->cached = true;
+#endif
+	talloc_set_destructor(entry, _regex_cache_entry_free);
+
+	/*
+	 *	Make room by evicting the least recently used expressions
+	 */
+	while (fr_rb_num_elements(cache->tree) >= REGEX_CACHE_MAX_ENTRIES) {
+		oldest = fr_dlist_tail(&cache->lru);
+		if (!oldest) break;
+
+		fr_dlist_remove(&cache->lru, oldest);
+		fr_rb_remove(cache->tree, oldest);
+		talloc_free(oldest);
+
+		atomic_fetch_add_explicit(&regex_cache_evictions, 1, memory_order_relaxed);
+	}
+
+	if (unlikely(!fr_rb_insert(cache->tree, entry))) {
+		fr_strerror_const("Failed inserting expression into cache");
+		talloc_free(entry);
+		return -1;
+	}
+	fr_dlist_insert_head(&cache->lru, entry);
+
+	*out = entry->preg;
+
+	return len;
+}
+
+/** Return counters for the compiled regex cache, aggregated over all threads
+ *
+ * @param[out] stats	to populate.
+ */
+void regex_cache_stats(fr_regex_cache_stats_t *stats)
+{
+	stats->hits = atomic_load_explicit(&regex_cache_hits, memory_order_relaxed);
+	stats->misses = atomic_load_explicit(&regex_cache_misses, memory_order_relaxed);
+	stats->evictions = atomic_load_explicit(&regex_cache_evictions, memory_order_relaxed);
+}
 #endif
@@ -68,6 +68,8 @@ typedef struct {
 	bool			precompiled;	//!< Whether this regex was precompiled,
 						///< or compiled for one off evaluation.
 	bool			jitd;		//!< Whether JIT data is available.
+	bool			cached;		//!< Owned by the thread local regex cache, must not be freed
+						///< by the caller.
 } regex_t;
 /*
  *######################################
@@ -113,6 +115,8 @@ typedef struct {
 
 	bool			precompiled;	//!< Whether this regex was precompiled, or compiled for one off evaluation.
 	bool			jitd;		//!< Whether JIT data is available.
+	bool			cached;		//!< Owned by the thread local regex cache, must not be freed
+						///< by the caller.
 } regex_t;
 /*
  *######################################
@@ -168,6 +172,22 @@ typedef struct {
 
 #define REGEX_FLAG_BUFF_SIZE	7
 
+/** Maximum number of runtime compiled expressions held per thread
+ *
+ */
+#ifndef REGEX_CACHE_MAX_ENTRIES
+#  define REGEX_CACHE_MAX_ENTRIES	256
+#endif
+
+/** Counters for the compiled regex cache
+ *
+ */
+typedef struct {
+	uint64_t	hits;				//!< Lookups which returned a compiled expression.
+	uint64_t	misses;				//!< Lookups which required a compilation.
+	uint64_t	evictions;			//!< Expressions evicted to make room for new ones.
+} fr_regex_cache_stats_t;
+
 ssize_t		regex_flags_parse(int *err, fr_regex_flags_t *out, fr_sbuff_t *in,
 				  fr_sbuff_term_t const *terminals, bool err_on_dup);
 
@@ -175,6 +195,9 @@ ssize_t		regex_flags_print(fr_sbuff_t *sbuff, fr_regex_flags_t const *flags);
 
 ssize_t		regex_compile(TALLOC_CTX *ctx, regex_t **out, char const *pattern, size_t len,
 			      fr_regex_flags_t const *flags, bool subcaptures, bool runtime);
+ssize_t		regex_compile_cached(regex_t **out, char const *pattern, size_t len,
+				     fr_regex_flags_t const *flags, bool subcaptures);
+void		regex_cache_stats(fr_regex_cache_stats_t *stats);
 int		regex_exec(regex_t *preg, char const *subject, size_t len, fr_regmatch_t *regmatch);
 #ifdef HAVE_REGEX_PCRE2
 int		regex_substitute(TALLOC_CTX *ctx, char **out, size_t max_out, regex_t *preg, fr_regex_flags_t *flags,
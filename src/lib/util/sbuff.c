@@ -417,17 +417,20 @@ int fr_sbuff_reset_talloc(fr_sbuff_t *sbuff)
 
 	fr_sbuff_set_to_start(sbuff);	/* Clear data */
 
-	if (fr_sbuff_used(sbuff) != tctx->init) {
+	/*
+	 *	Only shrink the buffer if it's grown, so
+	 *	that reusing a buffer doesn't allocate.
+	 */
+	if (talloc_array_length(sbuff->buff) != (tctx->init + 1)) {
 		char *new_buff;
 
-		new_buff = talloc_realloc(tctx->ctx, sbuff->buff, char, tctx->init);
+		new_buff = talloc_realloc(tctx->ctx, sbuff->buff, char, tctx->init + 1);
 		if (!new_buff) {
 			fr_strerror_printf("Failed reallocing from %zu to %zu",
-					   talloc_array_length(sbuff->buff), tctx->init);
+					   talloc_array_length(sbuff->buff), tctx->init + 1);
 			return -1;
 		}
-		sbuff->buff = new_buff;
-		fr_sbuff_update(sbuff, new_buff, tctx->init - 1);
+		fr_sbuff_update(sbuff, new_buff, tctx->init);
 	}
 
 	return 0;
@@ -25,6 +25,7 @@
 #include <freeradius-devel/radius/radius.h>
 #include <freeradius-devel/io/listen.h>
 #include <freeradius-devel/server/module.h>
+#include <freeradius-devel/server/state.h>
 #include "proto_radius.h"
 
 extern fr_app_t proto_radius;
@@ -441,6 +442,30 @@ static int mod_priority_set(void const *instance, uint8_t const *buffer, UNUSED
 	return inst->priorities[buffer[0]];
 }
 
+/** Send the next round of a multi-round session to the worker holding it
+ *
+ */
+static int mod_worker_affinity(UNUSED void const *instance, uint8_t const *buffer, size_t buflen)
+{
+	uint8_t const *attr, *end;
+
+	if (buflen <= RADIUS_HEADER_LENGTH) return -1;
+
+	attr = buffer + RADIUS_HEADER_LENGTH;
+	end = buffer + buflen;
+
+	while ((attr + 2) <= end) {
+		if (attr[1] < 2) return -1;
+		if ((attr + attr[1]) > end) return -1;
+
+		if (attr[0] == FR_STATE) return fr_state_worker(attr + 2, attr[1] - 2);
+
+		attr += attr[1];
+	}
+
+	return -1;
+}
+
 /** Open listen sockets/connect to external event source
  *
  * @param[in] instance	Ctx data for this application.
@@ -595,5 +620,6 @@ fr_app_t proto_radius = {
 	.open			= mod_open,
 	.decode			= mod_decode,
 	.encode			= mod_encode,
-	.priority		= mod_priority_set
+	.priority		= mod_priority_set,
+	.affinity		= mod_worker_affinity
 };
@@ -0,0 +1,349 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or (at
+ *   your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/** Tests for coalescing cache fills, and serving stale entries
+ *
+ * @file src/modules/rlm_cache/coalesce_tests.c
+ *
+ * @copyright 2022 The FreeRADIUS server project
+ */
+#define USE_CONSTRUCTOR
+
+/*
+ * It should be declared before include the "acutest.h"
+ */
+#ifdef USE_CONSTRUCTOR
+static void test_init(void) __attribute__((constructor));
+#else
+static void test_init(void);
+#  define TEST_INIT  test_init()
+#endif
+
+#include <freeradius-devel/util/acutest.h>
+#include <freeradius-devel/util/acutest_helpers.h>
+
+#include <freeradius-devel/util/dict_test.h>
+
+#include "rlm_cache.c"
+
+#define TEST_KEY	"bob"
+#define TEST_KEY_LEN	(sizeof(TEST_KEY) - 1)
+
+static TALLOC_CTX		*autofree;
+static fr_dict_t		*test_dict;
+
+/** What the fake driver returns, NULL for a miss
+ *
+ */
+static rlm_cache_entry_t	*test_entry;
+
+/** Global initialisation
+ */
+static void test_init(void)
+{
+	autofree = talloc_autofree_context();
+	if (!autofree) {
+	error:
+		fr_perror("rlm_cache_coalesce_tests");
+		fr_exit_now(EXIT_FAILURE);
+	}
+
+	/*
+	 *	Mismatch between the binary and the libraries it depends on
+	 */
+	if (fr_check_lib_magic(RADIUSD_MAGIC_NUMBER) < 0) goto error;
+
+	if (fr_time_start() < 0) goto error;
+
+	if (fr_dict_test_init(autofree, &test_dict, NULL) < 0) goto error;
+
+	if (request_global_init() < 0) goto error;
+}
+
+static cache_status_t test_driver_find(rlm_cache_entry_t **out, UNUSED rlm_cache_config_t const *config,
+				       UNUSED void *instance, UNUSED request_t *request, UNUSED void *handle,
+				       UNUSED uint8_t const *key, UNUSED size_t key_len)
+{
+	if (!test_entry) return CACHE_MISS;
+
+	*out = test_entry;
+	return CACHE_OK;
+}
+
+static rlm_cache_driver_t const test_driver = {
+	.name	= "test",
+	.find	= test_driver_find
+};
+
+/** Allocate an instance backed by the fake driver
+ *
+ */
+static rlm_cache_t *test_inst_alloc(TALLOC_CTX *ctx, fr_time_delta_t lock_timeout, fr_time_delta_t stale_ttl)
+{
+	rlm_cache_t		*inst;
+	module_instance_t	*driver_inst;
+
+	MEM(inst = talloc_zero(ctx, rlm_cache_t));
+	inst->config.ttl = fr_time_delta_from_sec(10);
+	inst->config.lock_timeout = lock_timeout;
+	inst->config.stale_ttl = stale_ttl;
+
+	MEM(driver_inst = talloc_zero(inst, module_instance_t));
+	MEM(driver_inst->dl_inst = talloc_zero(driver_inst, dl_module_inst_t));
+	inst->driver_inst = driver_inst;
+	inst->driver = &test_driver;
+
+	MEM(inst->coalesce = talloc_zero(inst, rlm_cache_coalesce_t));
+	MEM(inst->coalesce->leases = fr_rb_inline_talloc_alloc(inst->coalesce, rlm_cache_lease_t, node,
+							       cache_lease_cmp, NULL));
+	TEST_CHECK(pthread_mutex_init(&inst->coalesce->mutex, NULL) == 0);
+
+	test_entry = NULL;
+
+	return inst;
+}
+
+static request_t *request_fake_alloc(void)
+{
+	request_t	*request;
+
+	MEM(request = request_alloc_external(NULL, NULL));
+	MEM(request->packet = fr_radius_packet_alloc(request, false));
+	MEM(request->reply = fr_radius_packet_alloc(request, false));
+	request->packet->timestamp = fr_time();
+
+	return request;
+}
+
+/** Allocate an entry which was created age ago
+ *
+ */
+static rlm_cache_entry_t *test_entry_alloc(TALLOC_CTX *ctx, rlm_cache_t const *inst, request_t *request,
+					   fr_time_delta_t age)
+{
+	rlm_cache_entry_t *c;
+
+	MEM(c = talloc_zero(ctx, rlm_cache_entry_t));
+	c->key = (uint8_t const *)TEST_KEY;
+	c->key_len = TEST_KEY_LEN;
+	c->created = fr_unix_time_sub(fr_time_to_unix_time(request->packet->timestamp), age);
+	c->expires = fr_unix_time_add(c->created, fr_time_delta_add(inst->config.ttl, inst->config.stale_ttl));
+	map_list_init(&c->maps);
+
+	return c;
+}
+
+static rlm_rcode_t test_find(rlm_cache_t const *inst, request_t *request, rlm_cache_fill_t *fill)
+{
+	rlm_rcode_t		rcode = RLM_MODULE_NOOP;
+	rlm_cache_entry_t	*c;
+	rlm_cache_handle_t	*handle = NULL;
+
+	cache_find(&rcode, &c, inst, request, &handle, (uint8_t const *)TEST_KEY, TEST_KEY_LEN, fill);
+
+	return rcode;
+}
+
+static uint64_t test_stat(atomic_uint_fast64_t *stat)
+{
+	return atomic_load_explicit(stat, memory_order_relaxed);
+}
+
+static void test_fill_wait(void)
+{
+	TALLOC_CTX		*ctx = talloc_init_const("test");
+	rlm_cache_t		*inst = test_inst_alloc(ctx, fr_time_delta_from_sec(1), fr_time_delta_wrap(0));
+	rlm_cache_coalesce_t	*coalesce = inst->coalesce;
+	request_t		*a = request_fake_alloc(), *b = request_fake_alloc();
+	rlm_cache_fill_t	fill_a = { .yield = false }, fill_b = { .yield = false };
+
+	TEST_CASE("The first request to miss fills the entry");
+	TEST_CHECK(test_find(inst, a, &fill_a) == RLM_MODULE_NOTFOUND);
+	TEST_CHECK(!fill_a.yield);
+	TEST_CHECK(test_stat(&coalesce->fills) == 1);
+
+	TEST_CASE("The lease holder doesn't wait on itself");
+	TEST_CHECK(test_find(inst, a, &fill_a) == RLM_MODULE_NOTFOUND);
+	TEST_CHECK(!fill_a.yield);
+	TEST_CHECK(test_stat(&coalesce->fills) == 1);
+
+	TEST_CASE("Other requests missing the same key wait");
+	TEST_CHECK(test_find(inst, b, &fill_b) == RLM_MODULE_NOTFOUND);
+	TEST_CHECK(fill_b.yield);
+	TEST_CHECK(fr_time_ispos(fill_b.deadline));
+	TEST_CHECK(test_stat(&coalesce->waits) == 1);
+
+	TEST_CASE("Polling again doesn't count as another wait");
+	fill_b.yield = false;
+	TEST_CHECK(test_find(inst, b, &fill_b) == RLM_MODULE_NOTFOUND);
+	TEST_CHECK(fill_b.yield);
+	TEST_CHECK(test_stat(&coalesce->waits) == 1);
+
+	TEST_CASE("Lookups which won't fill the entry don't wait");
+	TEST_CHECK(test_find(inst, b, NULL) == RLM_MODULE_NOTFOUND);
+	TEST_CHECK(test_stat(&coalesce->waits) == 1);
+
+	TEST_CASE("Waiting requests find the entry once it's filled");
+	test_entry = test_entry_alloc(ctx, inst, a, fr_time_delta_wrap(0));
+	cache_lease_release(inst, a, (uint8_t const *)TEST_KEY, TEST_KEY_LEN);
+	fill_b.yield = false;
+	TEST_CHECK(test_find(inst, b, &fill_b) == RLM_MODULE_OK);
+	TEST_CHECK(!fill_b.yield);
+	TEST_CHECK(test_stat(&coalesce->wait_hits) == 1);
+	TEST_CHECK(test_stat(&coalesce->wait_timeouts) == 0);
+	TEST_CHECK(test_stat(&coalesce->stale_served) == 0);
+
+	talloc_free(a);
+	talloc_free(b);
+	talloc_free(ctx);
+}
+
+static void test_fill_timeout(void)
+{
+	TALLOC_CTX		*ctx = talloc_init_const("test");
+	rlm_cache_t		*inst = test_inst_alloc(ctx, fr_time_delta_from_sec(1), fr_time_delta_wrap(0));
+	rlm_cache_coalesce_t	*coalesce = inst->coalesce;
+	request_t		*a = request_fake_alloc(), *b = request_fake_alloc(), *c = request_fake_alloc();
+	rlm_cache_fill_t	fill_a = { .yield = false }, fill_b = { .yield = false }, fill_c = { .yield = false };
+
+	TEST_CHECK(test_find(inst, a, &fill_a) == RLM_MODULE_NOTFOUND);
+	TEST_CHECK(test_find(inst, b, &fill_b) == RLM_MODULE_NOTFOUND);
+	TEST_CHECK(fill_b.yield);
+
+	TEST_CASE("Waiting past lock_timeout falls through to a fill");
+	fill_b.yield = false;
+	fill_b.deadline = fr_time_wrap(1);
+	TEST_CHECK(test_find(inst, b, &fill_b) == RLM_MODULE_NOTFOUND);
+	TEST_CHECK(!fill_b.yield);
+	TEST_CHECK(test_stat(&coalesce->wait_timeouts) == 1);
+	TEST_CHECK(test_stat(&coalesce->wait_hits) == 0);
+
+	TEST_CASE("Giving up doesn't take the lease from its holder");
+	TEST_CHECK(test_stat(&coalesce->fills) == 1);
+	TEST_CHECK(test_find(inst, c, &fill_c) == RLM_MODULE_NOTFOUND);
+	TEST_CHECK(fill_c.yield);
+
+	TEST_CASE("Releasing a lease we don't hold does nothing");
+	cache_lease_release(inst, b, (uint8_t const *)TEST_KEY, TEST_KEY_LEN);
+	TEST_CHECK(fr_rb_num_elements(coalesce->leases) == 1);
+
+	TEST_CASE("The lease is released if its holder is freed");
+	talloc_free(a);
+	TEST_CHECK(fr_rb_num_elements(coalesce->leases) == 0);
+	fill_c.yield = false;
+	TEST_CHECK(test_find(inst, c, &fill_c) == RLM_MODULE_NOTFOUND);
+	TEST_CHECK(!fill_c.yield);
+	TEST_CHECK(test_stat(&coalesce->fills) == 2);
+
+	talloc_free(b);
+	talloc_free(c);
+	talloc_free(ctx);
+}
+
+static void test_stale(void)
+{
+	TALLOC_CTX		*ctx = talloc_init_const("test");
+	rlm_cache_t		*inst = test_inst_alloc(ctx, fr_time_delta_wrap(0), fr_time_delta_from_sec(5));
+	rlm_cache_coalesce_t	*coalesce = inst->coalesce;
+	request_t		*a = request_fake_alloc(), *b = request_fake_alloc();
+	rlm_cache_fill_t	fill_a = { .yield = false }, fill_b = { .yield = false };
+
+	/*
+	 *	Past its 10s TTL, but within stale_ttl
+	 */
+	test_entry = test_entry_alloc(ctx, inst, a, fr_time_delta_from_sec(12));
+
+	TEST_CASE("Lookups which won't refresh the entry are served it without being counted");
+	TEST_CHECK(test_find(inst, a, NULL) == RLM_MODULE_OK);
+	TEST_CHECK(test_stat(&coalesce->stale_served) == 0);
+	TEST_CHECK(test_stat(&coalesce->fills) == 0);
+
+	TEST_CASE("The first request to find a stale entry refreshes it");
+	TEST_CHECK(test_find(inst, a, &fill_a) == RLM_MODULE_NOTFOUND);
+	TEST_CHECK(!fill_a.yield);
+	TEST_CHECK(test_stat(&coalesce->fills) == 1);
+
+	TEST_CASE("Other requests are served the stale entry whilst it's refreshed");
+	TEST_CHECK(test_find(inst, b, &fill_b) == RLM_MODULE_OK);
+	TEST_CHECK(!fill_b.yield);
+	TEST_CHECK(test_stat(&coalesce->stale_served) == 1);
+	TEST_CHECK(test_stat(&coalesce->waits) == 0);
+
+	TEST_CASE("Stale entries are still served without being counted whilst refreshed");
+	TEST_CHECK(test_find(inst, b, NULL) == RLM_MODULE_OK);
+	TEST_CHECK(test_stat(&coalesce->stale_served) == 1);
+
+	TEST_CASE("Misses don't wait when only stale_ttl is set");
+	test_entry = NULL;
+	TEST_CHECK(test_find(inst, b, &fill_b) == RLM_MODULE_NOTFOUND);
+	TEST_CHECK(!fill_b.yield);
+	TEST_CHECK(test_stat(&coalesce->waits) == 0);
+
+	TEST_CASE("Fresh entries aren't refreshed");
+	cache_lease_release(inst, a, (uint8_t const *)TEST_KEY, TEST_KEY_LEN);
+	test_entry = test_entry_alloc(ctx, inst, a, fr_time_delta_from_sec(1));
+	TEST_CHECK(test_find(inst, b, &fill_b) == RLM_MODULE_OK);
+	TEST_CHECK(test_stat(&coalesce->fills) == 1);
+	TEST_CHECK(test_stat(&coalesce->stale_served) == 1);
+
+	talloc_free(a);
+	talloc_free(b);
+	talloc_free(ctx);
+}
+
+static void test_stats(void)
+{
+	TALLOC_CTX		*ctx = talloc_init_const("test");
+	rlm_cache_t		*inst = test_inst_alloc(ctx, fr_time_delta_from_sec(1), fr_time_delta_from_sec(5));
+	rlm_cache_coalesce_t	*coalesce = inst->coalesce;
+	FILE			*fp;
+	char			buffer[1024];
+	size_t			len;
+
+	atomic_store(&coalesce->fills, 5);
+	atomic_store(&coalesce->waits, 4);
+	atomic_store(&coalesce->wait_hits, 3);
+	atomic_store(&coalesce->wait_timeouts, 2);
+	atomic_store(&coalesce->stale_served, 1);
+
+	TEST_CASE("Counters are reported by radmin");
+	fp = tmpfile();
+	TEST_ASSERT(fp != NULL);
+	TEST_CHECK(cmd_stats_coalesce(fp, NULL, coalesce, NULL) == 0);
+	rewind(fp);
+	len = fread(buffer, 1, sizeof(buffer) - 1, fp);
+	buffer[len] = '\0';
+	fclose(fp);
+
+	TEST_CHECK(strcmp(buffer,
+			  "coalesce.fills			5\n"
+			  "coalesce.waits			4\n"
+			  "coalesce.wait_hits		3\n"
+			  "coalesce.wait_timeouts		2\n"
+			  "coalesce.stale_served		1\n") == 0);
+	TEST_MSG("Got\n%s", buffer);
+
+	talloc_free(ctx);
+}
+
+TEST_LIST = {
+	{ "fill_wait",		test_fill_wait },
+	{ "fill_timeout",	test_fill_timeout },
+	{ "stale",		test_stale },
+	{ "stats",		test_stats },
+
+	{ NULL }
+};
@@ -39,11 +39,13 @@ typedef struct {
 
 typedef struct {
 	char const 		*options;	//!< Connection options
+	bool			binary;		//!< Store entries in binary format.
 	fr_pool_t	*pool;
 } rlm_cache_memcached_t;
 
 static const CONF_PARSER driver_config[] = {
 	{ FR_CONF_OFFSET("options", FR_TYPE_STRING | FR_TYPE_REQUIRED, rlm_cache_memcached_t, options), .dflt = "--SERVER=localhost" },
+	{ FR_CONF_OFFSET("binary", FR_TYPE_BOOL, rlm_cache_memcached_t, binary), .dflt = "yes" },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -180,10 +182,20 @@ static cache_status_t cache_entry_find(rlm_cache_entry_t **out,
 		return CACHE_ERROR;
 	}
 	RDEBUG2("Retrieved %zu bytes from memcached", len);
-	RDEBUG2("%s", from_store);
 
 	c = talloc_zero(NULL, rlm_cache_entry_t);
-	ret = cache_deserialize(c, request->dict, from_store, len);
+	map_list_init(&c->maps);
+
+	/*
+	 *	Entries may have been written by a server
+	 *	configured for either format.
+	 */
+	if (cache_serialized_is_binary((uint8_t *)from_store, len)) {
+		ret = cache_deserialize_binary(c, (uint8_t *)from_store, len);
+	} else {
+		RDEBUG2("%s", from_store);
+		ret = cache_deserialize(c, request->dict, from_store, len);
+	}
 	free(from_store);
 	if (ret < 0) {
 		RPERROR("Invalid entry");
@@ -202,28 +214,46 @@ static cache_status_t cache_entry_find(rlm_cache_entry_t **out,
  *
  * @copydetails cache_entry_insert_t
  */
-static cache_status_t cache_entry_insert(UNUSED rlm_cache_config_t const *config, UNUSED void *instance,
+static cache_status_t cache_entry_insert(UNUSED rlm_cache_config_t const *config, void *instance,
 					 request_t *request, void *handle, const rlm_cache_entry_t *c)
 {
-	rlm_cache_memcached_handle_t *mandle = handle;
+	rlm_cache_memcached_t		*driver = instance;
+	rlm_cache_memcached_handle_t	*mandle = handle;
 
 	memcached_return_t ret;
 
 	TALLOC_CTX *pool;
 	char *to_store;
+	size_t to_store_len;
 
 	pool = talloc_pool(NULL, 1024);
 	if (!pool) return CACHE_ERROR;
 
-	if (cache_serialize(pool, &to_store, c) < 0) {
-		talloc_free(pool);
-
-		return CACHE_ERROR;
+	if (driver->binary) {
+		fr_dbuff_t		dbuff;
+		fr_dbuff_uctx_talloc_t	tctx;
+
+		if (!fr_dbuff_init_talloc(pool, &dbuff, &tctx, 512, SIZE_MAX) ||
+		    (cache_serialize_binary(&dbuff, c) < 0)) {
+			RPERROR("Failed serializing entry");
+			talloc_free(pool);
+
+			return CACHE_ERROR;
+		}
+		to_store = (char *)fr_dbuff_start(&dbuff);
+		to_store_len = fr_dbuff_used(&dbuff);
+	} else {
+		if (cache_serialize(pool, &to_store, c) < 0) {
+			talloc_free(pool);
+
+			return CACHE_ERROR;
+		}
+		to_store_len = to_store ? talloc_array_length(to_store) - 1 : 0;
 	}
 
 	ret = memcached_set(mandle->handle, (char const *)c->key, c->key_len,
 		            to_store ? to_store : "",
-		            to_store ? talloc_array_length(to_store) - 1 : 0, fr_unix_time_to_sec(c->expires), 0);
+		            to_store_len, fr_unix_time_to_sec(c->expires), 0);
 	talloc_free(pool);
 	if (ret != MEMCACHED_SUCCESS) {
 		RERROR("Failed storing entry: %s: %s", memcached_strerror(mandle->handle, ret),
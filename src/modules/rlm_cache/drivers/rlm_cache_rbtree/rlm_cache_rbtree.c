@@ -19,27 +19,70 @@
  * @file rlm_cache_rbtree.c
  * @brief Simple rbtree based cache.
  *
+ * The key space is hash partitioned into a power of two number of shards,
+ * each with its own rbtree, CLOCK eviction list and mutex, so that workers
+ * looking up different keys don't serialise on a single lock.
+ *
+ * Entries are expired lazily, either when they're found during a lookup,
+ * or when the CLOCK hand passes over them during an insert.
+ *
  * @copyright 2014 The FreeRADIUS server project
  */
+#include <stdalign.h>
+
 #include <freeradius-devel/server/base.h>
-#include <freeradius-devel/util/heap.h>
 #include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/hash.h>
+#include <freeradius-devel/util/stdatomic.h>
 #include "../../rlm_cache.h"
 
+#define CACHE_LINE_SIZE	64
+
+/** A single partition of the key space
+ *
+ */
 typedef struct {
+	alignas(CACHE_LINE_SIZE) pthread_mutex_t mutex;	//!< Protect the shard from multiple readers/writers.
+							///< Aligned so that shard locks don't share
+							///< cache lines.
 	fr_rb_tree_t		*cache;		//!< Tree for looking up cache keys.
-	fr_heap_t		*heap;		//!< For managing entry expiry.
+	fr_dlist_head_t		clock;		//!< Entries in CLOCK order.  The head of the list
+						///< is the position of the clock hand.
+} rlm_cache_rb_shard_t;
 
-	pthread_mutex_t		mutex;		//!< Protect the tree from multiple readers/writers.
+typedef struct {
+	uint32_t		num_shards;	//!< How many shards to partition the key space into.
+	uint32_t		shard_mask;	//!< num_shards - 1.
+
+	uint32_t		shard_max;	//!< Maximum entries per shard, 0 for unlimited.
+
+	atomic_uint_fast64_t	num_entries;	//!< Total number of entries across all shards.
+
+	TALLOC_CTX		*shard_array;	//!< Talloc chunk the shards are allocated in.
+	rlm_cache_rb_shard_t	*shards;	//!< Array of shards, aligned to a cache line.
 } rlm_cache_rbtree_t;
 
 typedef struct {
 	rlm_cache_entry_t	fields;		//!< Entry data.
 
 	fr_rb_node_t		node;		//!< Entry used for lookups.
-	fr_heap_index_t		heap_id;	//!< Offset used for expiry heap.
+	fr_dlist_t		clock_entry;	//!< Entry in the shard's CLOCK list.
+	bool			referenced;	//!< Entry was retrieved since the clock hand last passed.
 } rlm_cache_rb_entry_t;
 
+/** Per-call handle, records which shard (if any) is locked
+ *
+ */
+typedef struct {
+	rlm_cache_rbtree_t	*driver;	//!< Driver the handle belongs to.
+	rlm_cache_rb_shard_t	*locked;	//!< Shard we currently hold the lock for.
+} rlm_cache_rb_handle_t;
+
+static const CONF_PARSER driver_config[] = {
+	{ FR_CONF_OFFSET("shards", FR_TYPE_UINT32, rlm_cache_rbtree_t, num_shards), .dflt = "16" },
+	CONF_PARSER_TERMINATOR
+};
+
 /** Compare two entries by key
  *
  * There may only be one entry with the same key.
@@ -52,15 +95,71 @@ static int8_t cache_entry_cmp(void const *one, void const *two)
 	return 0;
 }
 
-/** Compare two entries by expiry time
+/** Lock the shard responsible for a key
+ *
+ * If the handle already holds the lock for a different shard, that
+ * lock is released first.
  *
- * There may be multiple entries with the same expiry time.
+ * @param[in] h		Handle to record the locked shard in.
+ * @param[in] key	to find the shard for.
+ * @param[in] key_len	Length of the key.
+ * @return the (locked) shard.
  */
-static int8_t cache_heap_cmp(void const *one, void const *two)
+static rlm_cache_rb_shard_t *cache_shard_lock(rlm_cache_rb_handle_t *h, uint8_t const *key, size_t key_len)
 {
-	rlm_cache_entry_t const *a = one, *b = two;
+	rlm_cache_rb_shard_t *shard = &h->driver->shards[fr_hash(key, key_len) & h->driver->shard_mask];
+
+	if (h->locked == shard) return shard;
+	if (h->locked) pthread_mutex_unlock(&h->locked->mutex);
+
+	pthread_mutex_lock(&shard->mutex);
+	h->locked = shard;
 
-	return fr_unix_time_cmp(a->expires, b->expires);
+	return shard;
+}
+
+/** Unlink an entry from its shard and free it
+ *
+ */
+static void cache_shard_remove(rlm_cache_rbtree_t *driver, rlm_cache_rb_shard_t *shard, rlm_cache_rb_entry_t *c)
+{
+	fr_rb_delete(shard->cache, c);
+	fr_dlist_remove(&shard->clock, c);
+	atomic_fetch_sub_explicit(&driver->num_entries, 1, memory_order_relaxed);
+	talloc_free(c);
+}
+
+/** Advance the clock hand
+ *
+ * Entries under the hand which have expired are always reclaimed.  If the
+ * shard is full, live entries which have been referenced since the hand last
+ * passed are given a second chance, and the first unreferenced entry is evicted.
+ *
+ * @param[in] driver	the shard belongs to.
+ * @param[in] shard	to sweep.  Must be locked.
+ * @param[in] now	Current time, used to determine if entries have expired.
+ */
+static void cache_shard_sweep(rlm_cache_rbtree_t *driver, rlm_cache_rb_shard_t *shard, fr_unix_time_t now)
+{
+	rlm_cache_rb_entry_t *c;
+
+	while ((c = fr_dlist_head(&shard->clock))) {
+		if (fr_unix_time_lt(c->fields.expires, now)) {
+			cache_shard_remove(driver, shard, c);
+			continue;
+		}
+
+		if ((driver->shard_max == 0) || (fr_rb_num_elements(shard->cache) < driver->shard_max)) break;
+
+		if (c->referenced) {
+			c->referenced = false;
+			fr_dlist_remove(&shard->clock, c);
+			fr_dlist_insert_tail(&shard->clock, c);
+			continue;
+		}
+
+		cache_shard_remove(driver, shard, c);
+	}
 }
 
 /** Cleanup a cache_rbtree instance
@@ -68,21 +167,27 @@ static int8_t cache_heap_cmp(void const *one, void const *two)
  */
 static int mod_detach(module_detach_ctx_t const *mctx)
 {
-	rlm_cache_rbtree_t *driver = talloc_get_type_abort(mctx->inst->data, rlm_cache_rbtree_t);
+	rlm_cache_rbtree_t	*driver = talloc_get_type_abort(mctx->inst->data, rlm_cache_rbtree_t);
+	uint32_t		i;
+
+	if (!driver->shards) return 0;
 
-	if (driver->cache) {
+	for (i = 0; i < driver->num_shards; i++) {
+		rlm_cache_rb_shard_t	*shard = &driver->shards[i];
 		fr_rb_iter_inorder_t	iter;
 		void			*data;
 
-		for (data = fr_rb_iter_init_inorder(&iter, driver->cache);
+		if (!shard->cache) continue;
+
+		for (data = fr_rb_iter_init_inorder(&iter, shard->cache);
 		     data;
 		     data = fr_rb_iter_next_inorder(&iter)) {
 			fr_rb_iter_delete_inorder(&iter);
 			talloc_free(data);
 		}
-	}
 
-	pthread_mutex_destroy(&driver->mutex);
+		pthread_mutex_destroy(&shard->mutex);
+	}
 
 	return 0;
 }
@@ -96,29 +201,56 @@ static int mod_detach(module_detach_ctx_t const *mctx)
  */
 static int mod_instantiate(module_inst_ctx_t const *mctx)
 {
-	rlm_cache_rbtree_t *driver = talloc_get_type_abort(mctx->inst->data, rlm_cache_rbtree_t);
+	rlm_cache_rbtree_t		*driver = talloc_get_type_abort(mctx->inst->data, rlm_cache_rbtree_t);
+	rlm_cache_config_t const	*config = (rlm_cache_config_t const *)mctx->inst->parent->data;
+	uint32_t			i;
+
+	FR_INTEGER_BOUND_CHECK("shards", driver->num_shards, >=, 1);
+	FR_INTEGER_BOUND_CHECK("shards", driver->num_shards, <=, 1024);
 
 	/*
-	 *	The cache.
+	 *	Shards are selected with a mask, so we need
+	 *	a power of two.  Round down so that we never
+	 *	create more than were asked for.
 	 */
-	driver->cache = fr_rb_inline_talloc_alloc(driver, rlm_cache_rb_entry_t, node, cache_entry_cmp, NULL);
-	if (!driver->cache) {
-		ERROR("Failed to create cache");
-		return -1;
-	}
+	while (driver->num_shards & (driver->num_shards - 1)) driver->num_shards &= (driver->num_shards - 1);
 
 	/*
-	 *	The heap of entries to expire.
+	 *	Don't create shards which could never hold
+	 *	an entry.
 	 */
-	driver->heap = fr_heap_talloc_alloc(driver, cache_heap_cmp, rlm_cache_rb_entry_t, heap_id, 0);
-	if (!driver->heap) {
-		ERROR("Failed to create heap for the cache");
-		return -1;
+	if (config->max_entries > 0) {
+		while (driver->num_shards > config->max_entries) driver->num_shards >>= 1;
+		driver->shard_max = config->max_entries / driver->num_shards;
 	}
+	driver->shard_mask = driver->num_shards - 1;
 
-	if (pthread_mutex_init(&driver->mutex, NULL) < 0) {
-		ERROR("Failed initializing mutex: %s", fr_syserror(errno));
-		return -1;
+	/*
+	 *	talloc makes no alignment guarantees beyond those
+	 *	of malloc, so the alignas() on the shard struct is
+	 *	only honoured if we align the start of the array.
+	 *	The struct's size is a multiple of its alignment,
+	 *	so every shard then starts on its own cache line.
+	 */
+	MEM(driver->shard_array = talloc_aligned_array(driver, (void **)&driver->shards, CACHE_LINE_SIZE,
+						       sizeof(rlm_cache_rb_shard_t) * driver->num_shards));
+	memset(driver->shards, 0, sizeof(rlm_cache_rb_shard_t) * driver->num_shards);
+	for (i = 0; i < driver->num_shards; i++) {
+		rlm_cache_rb_shard_t *shard = &driver->shards[i];
+
+		shard->cache = fr_rb_inline_talloc_alloc(driver->shard_array, rlm_cache_rb_entry_t, node,
+							 cache_entry_cmp, NULL);
+		if (!shard->cache) {
+			ERROR("Failed to create cache");
+			return -1;
+		}
+
+		fr_dlist_talloc_init(&shard->clock, rlm_cache_rb_entry_t, clock_entry);
+
+		if (pthread_mutex_init(&shard->mutex, NULL) < 0) {
+			ERROR("Failed initializing mutex: %s", fr_syserror(errno));
+			return -1;
+		}
 	}
 
 	return 0;
@@ -146,142 +278,134 @@ static rlm_cache_entry_t *cache_entry_alloc(UNUSED rlm_cache_config_t const *con
 
 /** Locate a cache entry
  *
- * @note handle not used except for sanity checks.
+ * Expired entries are removed here, instead of being tracked on a
+ * global expiry heap.
  *
  * @copydetails cache_entry_find_t
  */
 static cache_status_t cache_entry_find(rlm_cache_entry_t **out,
 				       UNUSED rlm_cache_config_t const *config, void *instance,
-				       request_t *request, UNUSED void *handle, uint8_t const *key, size_t key_len)
+				       request_t *request, void *handle, uint8_t const *key, size_t key_len)
 {
-	rlm_cache_rbtree_t *driver = talloc_get_type_abort(instance, rlm_cache_rbtree_t);
-
-	rlm_cache_entry_t *c;
+	rlm_cache_rbtree_t	*driver = talloc_get_type_abort(instance, rlm_cache_rbtree_t);
+	rlm_cache_rb_handle_t	*h = talloc_get_type_abort(handle, rlm_cache_rb_handle_t);
+	rlm_cache_rb_shard_t	*shard;
+	rlm_cache_rb_entry_t	*c;
 
-	fr_assert(driver->cache);
-
-	/*
-	 *	Clear out old entries
-	 */
-	c = fr_heap_peek(driver->heap);
-	if (c && (fr_unix_time_lt(c->expires, fr_time_to_unix_time(request->packet->timestamp)))) {
-		fr_heap_extract(driver->heap, c);
-		fr_rb_delete(driver->cache, c);
-		talloc_free(c);
-	}
+	shard = cache_shard_lock(h, key, key_len);
 
 	/*
 	 *	Is there an entry for this key?
 	 */
-	c = fr_rb_find(driver->cache, &(rlm_cache_entry_t){ .key = key, .key_len = key_len });
+	c = fr_rb_find(shard->cache, &(rlm_cache_entry_t){ .key = key, .key_len = key_len });
 	if (!c) {
 		*out = NULL;
 		return CACHE_MISS;
 	}
-	*out = c;
+
+	if (fr_unix_time_lt(c->fields.expires, fr_time_to_unix_time(request->packet->timestamp))) {
+		cache_shard_remove(driver, shard, c);
+		*out = NULL;
+		return CACHE_MISS;
+	}
+
+	c->referenced = true;
+	*out = &c->fields;
 
 	return CACHE_OK;
 }
 
 /** Free an entry and remove it from the data store
- *
- * @note handle not used except for sanity checks.
  *
  * @copydetails cache_entry_expire_t
  */
 static cache_status_t cache_entry_expire(UNUSED rlm_cache_config_t const *config, void *instance,
-					 request_t *request, UNUSED void *handle,
+					 request_t *request, void *handle,
 					 uint8_t const *key, size_t key_len)
 {
-	rlm_cache_rbtree_t *driver = talloc_get_type_abort(instance, rlm_cache_rbtree_t);
-	rlm_cache_entry_t *c;
+	rlm_cache_rbtree_t	*driver = talloc_get_type_abort(instance, rlm_cache_rbtree_t);
+	rlm_cache_rb_handle_t	*h = talloc_get_type_abort(handle, rlm_cache_rb_handle_t);
+	rlm_cache_rb_shard_t	*shard;
+	rlm_cache_rb_entry_t	*c;
 
 	if (!request) return CACHE_ERROR;
 
-	c = fr_rb_find(driver->cache, &(rlm_cache_entry_t){ .key = key, .key_len = key_len });
+	shard = cache_shard_lock(h, key, key_len);
+
+	c = fr_rb_find(shard->cache, &(rlm_cache_entry_t){ .key = key, .key_len = key_len });
 	if (!c) return CACHE_MISS;
 
-	fr_heap_extract(driver->heap, c);
-	fr_rb_delete(driver->cache, c);
-	talloc_free(c);
+	cache_shard_remove(driver, shard, c);
 
 	return CACHE_OK;
 }
 
 /** Insert a new entry into the data store
  *
- * @note handle not used except for sanity checks.
+ * If the shard is full, the CLOCK hand is advanced until an entry is evicted.
  *
  * @copydetails cache_entry_insert_t
  */
-static cache_status_t cache_entry_insert(rlm_cache_config_t const *config, void *instance,
+static cache_status_t cache_entry_insert(UNUSED rlm_cache_config_t const *config, void *instance,
 					 request_t *request, void *handle,
 					 rlm_cache_entry_t const *c)
 {
-	cache_status_t status;
-
-	rlm_cache_rbtree_t *driver = talloc_get_type_abort(instance, rlm_cache_rbtree_t);
-
-	fr_assert(handle == request);
+	rlm_cache_rbtree_t	*driver = talloc_get_type_abort(instance, rlm_cache_rbtree_t);
+	rlm_cache_rb_handle_t	*h = talloc_get_type_abort(handle, rlm_cache_rb_handle_t);
+	rlm_cache_rb_shard_t	*shard;
+	rlm_cache_rb_entry_t	*old;
 
 	if (!request) return CACHE_ERROR;
 
+	shard = cache_shard_lock(h, c->key, c->key_len);
+
 	/*
 	 *	Allow overwriting
 	 */
-	if (!fr_rb_insert(driver->cache, c)) {
-		status = cache_entry_expire(config, instance, request, handle, c->key, c->key_len);
-		if ((status != CACHE_OK) && !fr_cond_assert(0)) return CACHE_ERROR;
-
-		if (!fr_rb_insert(driver->cache, c)) {
-			RERROR("Failed adding entry");
-
-			return CACHE_ERROR;
-		}
-	}
+	old = fr_rb_find(shard->cache, c);
+	if (old == c) return CACHE_OK;
+	if (old) cache_shard_remove(driver, shard, old);
 
-	if (fr_heap_insert(driver->heap, UNCONST(rlm_cache_entry_t *, c)) < 0) {
-		fr_rb_delete(driver->cache, c);
-		RERROR("Failed adding entry to expiry heap");
+	cache_shard_sweep(driver, shard, fr_time_to_unix_time(request->packet->timestamp));
 
+	if (!fr_rb_insert(shard->cache, c)) {
+		RERROR("Failed adding entry");
 		return CACHE_ERROR;
 	}
+	fr_dlist_insert_tail(&shard->clock, UNCONST(rlm_cache_rb_entry_t *, c));
+	atomic_fetch_add_explicit(&driver->num_entries, 1, memory_order_relaxed);
 
 	return CACHE_OK;
 }
 
 /** Update the TTL of an entry
  *
- * @note handle not used except for sanity checks.
+ * As expiry is lazy, there's nothing to reorder here.  The entry's
+ * expiry time was already updated by the caller.
  *
  * @copydetails cache_entry_set_ttl_t
  */
-static cache_status_t cache_entry_set_ttl(UNUSED rlm_cache_config_t const *config, void *instance,
-					  request_t *request, UNUSED void *handle,
+static cache_status_t cache_entry_set_ttl(UNUSED rlm_cache_config_t const *config, UNUSED void *instance,
+					  request_t *request, void *handle,
 					  rlm_cache_entry_t *c)
 {
-	rlm_cache_rbtree_t *driver = talloc_get_type_abort(instance, rlm_cache_rbtree_t);
+	rlm_cache_rb_handle_t	*h = talloc_get_type_abort(handle, rlm_cache_rb_handle_t);
 
 #ifdef NDEBUG
 	if (!request) return CACHE_ERROR;
 #endif
 
-	if (!fr_cond_assert(fr_heap_extract(driver->heap, c) == 0)) {
-		RERROR("Entry not in heap");
+	if (!fr_cond_assert(h->locked)) {
+		RERROR("Entry's shard is not locked");
 		return CACHE_ERROR;
 	}
 
-	if (fr_heap_insert(driver->heap, c) < 0) {
-		fr_rb_delete(driver->cache, c);	/* make sure we don't leak entries... */
-		RERROR("Failed updating entry TTL.  Entry was forcefully expired");
-		return CACHE_ERROR;
-	}
+	((rlm_cache_rb_entry_t *)c)->referenced = true;
+
 	return CACHE_OK;
 }
 
 /** Return the number of entries in the cache
- *
- * @note handle not used except for sanity checks.
  *
  * @copydetails cache_entry_count_t
  */
@@ -292,49 +416,51 @@ static uint64_t cache_entry_count(UNUSED rlm_cache_config_t const *config, void
 
 	if (!request) return CACHE_ERROR;
 
-	return fr_rb_num_elements(driver->cache);
+	return atomic_load_explicit(&driver->num_entries, memory_order_relaxed);
 }
 
-/** Lock the rbtree
+/** Allocate a handle
  *
- * @note handle not used except for sanity checks.
+ * Shards are locked lazily, once we know the key.
  *
  * @copydetails cache_acquire_t
  */
 static int cache_acquire(void **handle, UNUSED rlm_cache_config_t const *config, void *instance,
 			 request_t *request)
 {
-	rlm_cache_rbtree_t *driver = talloc_get_type_abort(instance, rlm_cache_rbtree_t);
-
-	pthread_mutex_lock(&driver->mutex);
+	rlm_cache_rbtree_t	*driver = talloc_get_type_abort(instance, rlm_cache_rbtree_t);
+	rlm_cache_rb_handle_t	*h;
 
-	*handle = request;		/* handle is unused, this is just for sanity checking */
+	MEM(h = talloc(request, rlm_cache_rb_handle_t));
+	*h = (rlm_cache_rb_handle_t){ .driver = driver };
 
-	RDEBUG3("Mutex acquired");
+	*handle = h;
 
 	return 0;
 }
 
-/** Release an entry unlocking any mutexes
- *
- * @note handle not used except for sanity checks.
+/** Release a handle unlocking any shard it holds
  *
  * @copydetails cache_release_t
  */
-static void cache_release(UNUSED rlm_cache_config_t const *config, void *instance, request_t *request,
-			  UNUSED rlm_cache_handle_t *handle)
+static void cache_release(UNUSED rlm_cache_config_t const *config, UNUSED void *instance, request_t *request,
+			  rlm_cache_handle_t *handle)
 {
-	rlm_cache_rbtree_t *driver = talloc_get_type_abort(instance, rlm_cache_rbtree_t);
+	rlm_cache_rb_handle_t	*h = talloc_get_type_abort(handle, rlm_cache_rb_handle_t);
 
-	pthread_mutex_unlock(&driver->mutex);
+	if (h->locked) {
+		pthread_mutex_unlock(&h->locked->mutex);
+		RDEBUG3("Mutex released");
+	}
 
-	RDEBUG3("Mutex released");
+	talloc_free(h);
 }
 
 extern rlm_cache_driver_t rlm_cache_rbtree;
 rlm_cache_driver_t rlm_cache_rbtree = {
 	.name		= "rlm_cache_rbtree",
 	.magic		= RLM_MODULE_INIT,
+	.config		= driver_config,
 	.instantiate	= mod_instantiate,
 	.detach		= mod_detach,
 	.inst_size	= sizeof(rlm_cache_rbtree_t),
@@ -0,0 +1,370 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or (at
+ *   your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/** Tests for CLOCK eviction, and the throughput of the sharded rbtree cache
+ *
+ * @file src/modules/rlm_cache/drivers/rlm_cache_rbtree/rlm_cache_rbtree_tests.c
+ *
+ * @copyright 2022 The FreeRADIUS server project
+ */
+#define USE_CONSTRUCTOR
+
+/*
+ * It should be declared before include the "acutest.h"
+ */
+#ifdef USE_CONSTRUCTOR
+static void test_init(void) __attribute__((constructor));
+#else
+static void test_init(void);
+#  define TEST_INIT  test_init()
+#endif
+
+#include <freeradius-devel/util/acutest.h>
+#include <freeradius-devel/util/acutest_helpers.h>
+
+#include <pthread.h>
+
+#include "rlm_cache_rbtree.c"
+
+#define TEST_THREADS	4
+
+static TALLOC_CTX	*autofree;
+
+/** Per-thread state for the speed test
+ *
+ */
+typedef struct {
+	rlm_cache_rbtree_t	*driver;
+	request_t		*request;
+	uint32_t		key_space;	//!< Keys are chosen from [0, key_space).
+	size_t			ops;		//!< How many lookups to perform.
+	uint64_t		seed;
+	size_t			hits;
+	size_t			errors;		//!< acutest's checks aren't thread safe, so count
+						///< failures and check them in the main thread.
+	pthread_t		thread;
+} test_thread_t;
+
+/** Global initialisation
+ */
+static void test_init(void)
+{
+	autofree = talloc_autofree_context();
+	if (!autofree) {
+	error:
+		fr_perror("rlm_cache_rbtree_tests");
+		fr_exit_now(EXIT_FAILURE);
+	}
+
+	/*
+	 *	Mismatch between the binary and the libraries it depends on
+	 */
+	if (fr_check_lib_magic(RADIUSD_MAGIC_NUMBER) < 0) goto error;
+
+	if (fr_time_start() < 0) goto error;
+
+	if (request_global_init() < 0) goto error;
+}
+
+static request_t *request_fake_alloc(void)
+{
+	request_t	*request;
+
+	MEM(request = request_alloc_external(NULL, NULL));
+	MEM(request->packet = fr_radius_packet_alloc(request, false));
+	request->packet->timestamp = fr_time();
+
+	return request;
+}
+
+/** Instantiate the driver as rlm_cache would
+ *
+ */
+static rlm_cache_rbtree_t *test_driver_alloc(TALLOC_CTX *ctx, uint32_t num_shards, uint32_t max_entries)
+{
+	rlm_cache_rbtree_t	*driver;
+	rlm_cache_config_t	*config;
+
+	MEM(config = talloc_zero(ctx, rlm_cache_config_t));
+	config->max_entries = max_entries;
+
+	MEM(driver = talloc_zero(ctx, rlm_cache_rbtree_t));
+	driver->num_shards = num_shards;
+
+	TEST_CHECK(mod_instantiate(&(module_inst_ctx_t){
+					.inst = &(dl_module_inst_t){
+						.data = driver,
+						.parent = &(dl_module_inst_t){ .data = config }
+					}
+				   }) == 0);
+
+	return driver;
+}
+
+static void test_driver_free(rlm_cache_rbtree_t *driver)
+{
+	mod_detach(&(module_detach_ctx_t){ .inst = &(dl_module_inst_t){ .data = driver } });
+	talloc_free(driver);
+}
+
+/** Look up a key, optionally inserting an entry for it if there isn't one
+ *
+ * @return
+ *	- 1 if the key was found.
+ *	- 0 if it wasn't.
+ *	- -1 on error.
+ */
+static int test_find(rlm_cache_rbtree_t *driver, request_t *request, uint64_t key, bool insert)
+{
+	void			*handle;
+	rlm_cache_entry_t	*c;
+	int			ret = 1;
+
+	if (cache_acquire(&handle, NULL, driver, request) < 0) return -1;
+
+	if (cache_entry_find(&c, NULL, driver, request, handle, (uint8_t *)&key, sizeof(key)) == CACHE_OK) goto finish;
+
+	ret = 0;
+	if (!insert) goto finish;
+
+	c = cache_entry_alloc(NULL, driver, request);
+	if (!c) {
+		ret = -1;
+		goto finish;
+	}
+	c->key = talloc_memdup(c, &key, sizeof(key));
+	c->key_len = sizeof(key);
+	c->expires = fr_unix_time_add(fr_time_to_unix_time(request->packet->timestamp), fr_time_delta_from_sec(3600));
+
+	if (cache_entry_insert(NULL, driver, request, handle, c) != CACHE_OK) {
+		talloc_free(c);
+		ret = -1;
+	}
+
+finish:
+	cache_release(NULL, driver, request, handle);
+
+	return ret;
+}
+
+static uint64_t test_count(rlm_cache_rbtree_t *driver, request_t *request)
+{
+	return cache_entry_count(NULL, driver, request, NULL);
+}
+
+/*
+ *	Entries which were looked up since the clock hand
+ *	last passed get a second chance.
+ */
+static void test_clock_eviction(void)
+{
+	request_t		*request = request_fake_alloc();
+	rlm_cache_rbtree_t	*driver = test_driver_alloc(autofree, 1, 4);
+	uint64_t		i;
+
+	for (i = 0; i < 4; i++) TEST_CHECK(test_find(driver, request, i, true) == 0);
+	TEST_CHECK(test_count(driver, request) == 4);
+
+	TEST_CHECK(test_find(driver, request, 0, false) == 1);
+
+	/*
+	 *	0 is under the hand, but was referenced, so
+	 *	the next entry (1) is evicted instead.
+	 */
+	TEST_CHECK(test_find(driver, request, 4, true) == 0);
+	TEST_CHECK(test_count(driver, request) == 4);
+
+	TEST_CHECK(test_find(driver, request, 0, false) == 1);
+	TEST_CHECK(test_find(driver, request, 1, false) == 0);
+	TEST_CHECK(test_find(driver, request, 2, false) == 1);
+	TEST_CHECK(test_find(driver, request, 4, false) == 1);
+
+	test_driver_free(driver);
+	talloc_free(request);
+}
+
+/*
+ *	Expired entries are reclaimed by lookups, and by the
+ *	clock hand passing over them.
+ */
+static void test_clock_expiry(void)
+{
+	request_t		*request = request_fake_alloc();
+	rlm_cache_rbtree_t	*driver = test_driver_alloc(autofree, 1, 0);
+	fr_time_t		now = request->packet->timestamp;
+
+	TEST_CHECK(test_find(driver, request, 0, true) == 0);
+	TEST_CHECK(test_find(driver, request, 1, true) == 0);
+	TEST_CHECK(test_count(driver, request) == 2);
+
+	request->packet->timestamp = fr_time_add(now, fr_time_delta_from_sec(7200));
+
+	TEST_CHECK(test_find(driver, request, 0, false) == 0);
+	TEST_CHECK(test_count(driver, request) == 1);
+
+	/*
+	 *	Unlimited shards still sweep expired entries
+	 *	from under the hand.
+	 */
+	TEST_CHECK(test_find(driver, request, 2, true) == 0);
+	TEST_CHECK(test_count(driver, request) == 1);
+
+	test_driver_free(driver);
+	talloc_free(request);
+}
+
+/*
+ *	max_entries is divided between the shards, and each
+ *	shard is kept within its share.
+ */
+static void test_shard_max(void)
+{
+	request_t		*request = request_fake_alloc();
+	rlm_cache_rbtree_t	*driver = test_driver_alloc(autofree, 16, 64);
+	uint64_t		i;
+
+	TEST_CHECK(driver->num_shards == 16);
+	TEST_CHECK(driver->shard_max == 4);
+
+	for (i = 0; i < 1000; i++) TEST_CHECK(test_find(driver, request, i, true) == 0);
+	TEST_CHECK(test_count(driver, request) <= 64);
+	TEST_MSG("Expected at most 64 entries, got %" PRIu64, test_count(driver, request));
+
+	for (i = 0; i < driver->num_shards; i++) {
+		TEST_CHECK(fr_rb_num_elements(driver->shards[i].cache) <= driver->shard_max);
+	}
+
+	test_driver_free(driver);
+	talloc_free(request);
+}
+
+static inline uint64_t test_rand(uint64_t *state)
+{
+	uint64_t x = *state;
+
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+
+	return *state = x;
+}
+
+static void *test_thread(void *uctx)
+{
+	test_thread_t	*t = uctx;
+	size_t		i;
+
+	for (i = 0; i < t->ops; i++) {
+		switch (test_find(t->driver, t->request, test_rand(&t->seed) % t->key_space, true)) {
+		case 1:
+			t->hits++;
+			break;
+
+		case 0:
+			break;
+
+		default:
+			t->errors++;
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+/** Run lookups from several threads at once
+ *
+ * @return lookups per second, across all threads.
+ */
+static double test_throughput(uint32_t num_shards, uint32_t max_entries, uint32_t key_space, size_t ops,
+			      double *hit_rate)
+{
+	rlm_cache_rbtree_t	*driver = test_driver_alloc(autofree, num_shards, max_entries);
+	test_thread_t		threads[TEST_THREADS];
+	fr_time_t		start;
+	fr_time_delta_t		elapsed;
+	size_t			i, hits = 0;
+
+	for (i = 0; i < NUM_ELEMENTS(threads); i++) {
+		threads[i] = (test_thread_t){
+			.driver = driver,
+			.request = request_fake_alloc(),
+			.key_space = key_space,
+			.ops = ops,
+			.seed = 0x9e3779b97f4a7c15ULL * (i + 1)
+		};
+	}
+
+	start = fr_time();
+	for (i = 0; i < NUM_ELEMENTS(threads); i++) {
+		TEST_ASSERT(pthread_create(&threads[i].thread, NULL, test_thread, &threads[i]) == 0);
+	}
+	for (i = 0; i < NUM_ELEMENTS(threads); i++) pthread_join(threads[i].thread, NULL);
+	elapsed = fr_time_sub(fr_time(), start);
+
+	for (i = 0; i < NUM_ELEMENTS(threads); i++) {
+		TEST_CHECK(threads[i].errors == 0);
+		hits += threads[i].hits;
+		talloc_free(threads[i].request);
+	}
+
+	if (max_entries) TEST_CHECK(atomic_load(&driver->num_entries) <= max_entries);
+
+	test_driver_free(driver);
+
+	*hit_rate = (double)hits / (ops * NUM_ELEMENTS(threads));
+
+	return (ops * NUM_ELEMENTS(threads)) / (fr_time_delta_unwrap(elapsed) / (double)NSEC);
+}
+
+/*
+ *	Compare a single shard (equivalent to the old single
+ *	mutex) with the default number of shards, when the
+ *	working set fits in the cache, and when every insert
+ *	has to evict an entry.
+ */
+static void test_sharding_speed(void)
+{
+	uint32_t const	shards[] = { 1, 16 };
+	size_t		ops = 250000, i;
+
+	for (i = 0; i < NUM_ELEMENTS(shards); i++) {
+		double hit_rate, lookup, evict;
+
+		TEST_CASE_("shards=%u", shards[i]);
+
+		lookup = test_throughput(shards[i], 0, 16384, ops, &hit_rate);
+		TEST_MSG_ALWAYS("shards=%u threads=%u lookup_per_sec=%0.0lf hit_rate=%0.2lf",
+				shards[i], TEST_THREADS, lookup, hit_rate);
+
+		evict = test_throughput(shards[i], 1024, 1 << 20, ops, &hit_rate);
+		TEST_MSG_ALWAYS("shards=%u threads=%u evict_per_sec=%0.0lf hit_rate=%0.2lf",
+				shards[i], TEST_THREADS, evict, hit_rate);
+	}
+}
+
+TEST_LIST = {
+	{ "clock_eviction",		test_clock_eviction },
+	{ "clock_expiry",		test_clock_expiry },
+	{ "shard_max",			test_shard_max },
+
+	/*
+	 *	Performance tests
+	 */
+	{ "Speed Test - Sharding",	test_sharding_speed },
+
+	{ NULL }
+};
@@ -0,0 +1,6 @@
+TARGET      := rlm_cache_rbtree_tests
+SOURCES     := rlm_cache_rbtree_tests.c
+
+TGT_LDLIBS  := $(LIBS) $(GPERFTOOLS_LIBS)
+TGT_LDFLAGS := $(LDFLAGS) $(GPERFTOOLS_LDFLAGS)
+TGT_PREREQS := libfreeradius-util.la libfreeradius-radius.a libfreeradius-server.a libfreeradius-unlang.a
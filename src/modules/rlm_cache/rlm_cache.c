@@ -29,12 +29,39 @@ RCSID("$Id$")
 #include <freeradius-devel/server/module.h>
 #include <freeradius-devel/server/modpriv.h>
 #include <freeradius-devel/server/dl_module.h>
+#include <freeradius-devel/unlang/module.h>
 #include <freeradius-devel/util/debug.h>
 
 #include "rlm_cache.h"
 
+/** How often a request waiting on another to fill an entry checks if it's done
+ *
+ */
+#define CACHE_FILL_POLL_INTERVAL	fr_time_delta_from_msec(10)
+
 extern module_t rlm_cache;
 
+/** A request's claim on filling a cache entry
+ *
+ * Lives in the context of the request that holds it, so if the request
+ * is freed before it fills the entry, the lease is released automatically.
+ */
+typedef struct {
+	fr_rb_node_t		node;			//!< Entry in the lease tree.
+	rlm_cache_coalesce_t	*coalesce;		//!< Tree the lease was inserted into.
+	request_t		*request;		//!< Request filling the entry.
+	uint8_t const		*key;			//!< Key being filled.
+	size_t			key_len;		//!< Length of the key.
+} rlm_cache_lease_t;
+
+/** Tracks a request waiting for another to fill an entry
+ *
+ */
+typedef struct {
+	fr_time_t		deadline;		//!< When we stop waiting.  Zero if we've not waited yet.
+	bool			yield;			//!< Set by cache_find if another request holds the lease.
+} rlm_cache_fill_t;
+
 static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("driver", FR_TYPE_STRING, rlm_cache_config_t, driver_name), .dflt = "rlm_cache_rbtree" },
 	{ FR_CONF_OFFSET("key", FR_TYPE_TMPL | FR_TYPE_REQUIRED, rlm_cache_config_t, key) },
@@ -44,6 +71,8 @@ static const CONF_PARSER module_config[] = {
 	/* Should be a type which matches time_t, @fixme before 2038 */
 	{ FR_CONF_OFFSET("epoch", FR_TYPE_INT32, rlm_cache_config_t, epoch), .dflt = "0" },
 	{ FR_CONF_OFFSET("add_stats", FR_TYPE_BOOL, rlm_cache_config_t, stats), .dflt = "no" },
+	{ FR_CONF_OFFSET("lock_timeout", FR_TYPE_TIME_DELTA, rlm_cache_config_t, lock_timeout), .dflt = "0" },
+	{ FR_CONF_OFFSET("stale_ttl", FR_TYPE_TIME_DELTA, rlm_cache_config_t, stale_ttl), .dflt = "0" },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -145,6 +174,125 @@ static void cache_free(rlm_cache_t const *inst, rlm_cache_entry_t **c)
 	*c = NULL;
 }
 
+static int8_t cache_lease_cmp(void const *one, void const *two)
+{
+	rlm_cache_lease_t const *a = one, *b = two;
+
+	MEMCMP_RETURN(a, b, key, key_len);
+	return 0;
+}
+
+static int _cache_lease_free(rlm_cache_lease_t *lease)
+{
+	rlm_cache_coalesce_t *coalesce = lease->coalesce;
+
+	pthread_mutex_lock(&coalesce->mutex);
+	fr_rb_delete(coalesce->leases, lease);
+	pthread_mutex_unlock(&coalesce->mutex);
+
+	return 0;
+}
+
+/** Take the lease to fill an entry
+ *
+ * @return
+ *	- true if this request holds the lease.
+ *	- false if another request is filling the entry.
+ */
+static bool cache_lease_acquire(rlm_cache_t const *inst, request_t *request, uint8_t const *key, size_t key_len)
+{
+	rlm_cache_coalesce_t	*coalesce = inst->coalesce;
+	rlm_cache_lease_t	*lease;
+
+	pthread_mutex_lock(&coalesce->mutex);
+	lease = fr_rb_find(coalesce->leases, &(rlm_cache_lease_t){ .key = key, .key_len = key_len });
+	if (lease) {
+		bool ours = (lease->request == request);
+
+		pthread_mutex_unlock(&coalesce->mutex);
+		return ours;
+	}
+
+	MEM(lease = talloc_zero(request, rlm_cache_lease_t));
+	lease->coalesce = coalesce;
+	lease->request = request;
+	MEM(lease->key = talloc_memdup(lease, key, key_len));
+	lease->key_len = key_len;
+	fr_rb_insert(coalesce->leases, lease);
+	talloc_set_destructor(lease, _cache_lease_free);
+	pthread_mutex_unlock(&coalesce->mutex);
+
+	atomic_fetch_add_explicit(&coalesce->fills, 1, memory_order_relaxed);
+	RDEBUG3("Acquired fill lease for \"%pV\"", fr_box_strvalue_len((char const *)key, key_len));
+
+	return true;
+}
+
+/** Release the lease to fill an entry, if this request holds it
+ *
+ */
+static void cache_lease_release(rlm_cache_t const *inst, request_t *request, uint8_t const *key, size_t key_len)
+{
+	rlm_cache_coalesce_t	*coalesce = inst->coalesce;
+	rlm_cache_lease_t	*lease;
+
+	if (!coalesce) return;
+
+	pthread_mutex_lock(&coalesce->mutex);
+	lease = fr_rb_find(coalesce->leases, &(rlm_cache_lease_t){ .key = key, .key_len = key_len });
+	if (lease && (lease->request != request)) lease = NULL;
+	pthread_mutex_unlock(&coalesce->mutex);
+
+	if (!lease) return;
+
+	RDEBUG3("Releasing fill lease for \"%pV\"", fr_box_strvalue_len((char const *)key, key_len));
+	talloc_free(lease);
+}
+
+/** Decide whether this request should fill a missing entry, or wait for another request to do so
+ *
+ * Sets fill->yield if the caller should wait.  If we've been waiting longer
+ * than lock_timeout, we give up, and the caller fills the entry itself.
+ */
+static void cache_fill_miss(rlm_cache_t const *inst, request_t *request, rlm_cache_fill_t *fill,
+			    uint8_t const *key, size_t key_len)
+{
+	rlm_cache_coalesce_t	*coalesce = inst->coalesce;
+	fr_time_t		now;
+
+	if (!coalesce || cache_lease_acquire(inst, request, key, key_len)) return;
+
+	/*
+	 *	Leases are only being used for stale entries
+	 */
+	if (!fr_time_delta_ispos(inst->config.lock_timeout)) return;
+
+	now = fr_time();
+	if (!fr_time_ispos(fill->deadline)) {
+		fill->deadline = fr_time_add(now, inst->config.lock_timeout);
+		atomic_fetch_add_explicit(&coalesce->waits, 1, memory_order_relaxed);
+	} else if (fr_time_gteq(now, fill->deadline)) {
+		RWDEBUG("Timed out waiting for another request to fill entry for \"%pV\"",
+			fr_box_strvalue_len((char const *)key, key_len));
+		atomic_fetch_add_explicit(&coalesce->wait_timeouts, 1, memory_order_relaxed);
+		return;
+	}
+
+	RDEBUG2("Another request is filling entry for \"%pV\", waiting", fr_box_strvalue_len((char const *)key, key_len));
+	fill->yield = true;
+}
+
+/** Calculate when an entry should be removed from the datastore
+ *
+ * Entries are kept for stale_ttl past their TTL, so they can be served
+ * whilst another request refreshes them.
+ */
+static inline fr_unix_time_t cache_expires(rlm_cache_t const *inst, request_t *request, fr_time_delta_t ttl)
+{
+	return fr_unix_time_add(fr_time_to_unix_time(request->packet->timestamp),
+				fr_time_delta_add(ttl, inst->config.stale_ttl));
+}
+
 /** Merge a cached entry into a #request_t
  *
  * @return
@@ -192,6 +340,12 @@ static rlm_rcode_t cache_merge(rlm_cache_t const *inst, request_t *request, rlm_
 }
 
 /** Find a cached entry.
+ *
+ * If fill is not NULL, the caller will create the entry if it's missing.
+ * If another request is already doing that, fill->yield is set, and the
+ * caller should wait for it.  If the entry is stale, and no other request
+ * is refreshing it, we return #RLM_MODULE_NOTFOUND so the caller
+ * refreshes it.
  *
  * @return
  *	- #RLM_MODULE_OK on cache hit.
@@ -200,7 +354,8 @@ static rlm_rcode_t cache_merge(rlm_cache_t const *inst, request_t *request, rlm_
  */
 static unlang_action_t cache_find(rlm_rcode_t *p_result, rlm_cache_entry_t **out,
 				  rlm_cache_t const *inst, request_t *request,
-				  rlm_cache_handle_t **handle, uint8_t const *key, size_t key_len)
+				  rlm_cache_handle_t **handle, uint8_t const *key, size_t key_len,
+				  rlm_cache_fill_t *fill)
 {
 	cache_status_t ret;
 
@@ -221,7 +376,7 @@ static unlang_action_t cache_find(rlm_rcode_t *p_result, rlm_cache_entry_t **out
 
 		case CACHE_MISS:
 			RDEBUG2("No cache entry found for \"%pV\"", fr_box_strvalue_len((char const *)key, key_len));
-			RETURN_MODULE_NOTFOUND;
+			goto miss;
 
 		default:
 			RETURN_MODULE_FAIL;
@@ -243,8 +398,11 @@ static unlang_action_t cache_find(rlm_rcode_t *p_result, rlm_cache_entry_t **out
 			fr_box_time(request->packet->timestamp));
 
 	expired:
-		inst->driver->expire(&inst->config, inst->driver_inst->dl_inst->data, request, handle, c->key, c->key_len);
+		inst->driver->expire(&inst->config, inst->driver_inst->dl_inst->data, request, *handle, c->key, c->key_len);
 		cache_free(inst, &c);
+
+	miss:
+		if (fill) cache_fill_miss(inst, request, fill, key, key_len);
 		RETURN_MODULE_NOTFOUND;	/* Couldn't find a non-expired entry */
 	}
 
@@ -253,7 +411,34 @@ static unlang_action_t cache_find(rlm_rcode_t *p_result, rlm_cache_entry_t **out
 			fr_box_strvalue_len((char const *)key, key_len));
 		goto expired;
 	}
-	RDEBUG2("Found entry for \"%pV\"", fr_box_strvalue_len((char const *)key, key_len));
+
+	/*
+	 *	Past its TTL, but within stale_ttl.  The first request
+	 *	to get here refreshes it, everyone else gets the stale
+	 *	entry.
+	 */
+	if (inst->coalesce && fr_time_delta_ispos(inst->config.stale_ttl) &&
+	    fr_unix_time_lt(fr_unix_time_sub(c->expires, inst->config.stale_ttl),
+			    fr_time_to_unix_time(request->packet->timestamp))) {
+		if (!fill) {
+			RDEBUG2("Found stale entry for \"%pV\"", fr_box_strvalue_len((char const *)key, key_len));
+		} else if (cache_lease_acquire(inst, request, key, key_len)) {
+			RDEBUG2("Found stale entry for \"%pV\", refreshing it",
+				fr_box_strvalue_len((char const *)key, key_len));
+			cache_free(inst, &c);
+			RETURN_MODULE_NOTFOUND;
+		} else {
+			RDEBUG2("Found stale entry for \"%pV\", another request is refreshing it",
+				fr_box_strvalue_len((char const *)key, key_len));
+			atomic_fetch_add_explicit(&inst->coalesce->stale_served, 1, memory_order_relaxed);
+		}
+	} else {
+		RDEBUG2("Found entry for \"%pV\"", fr_box_strvalue_len((char const *)key, key_len));
+	}
+
+	if (fill && fr_time_ispos(fill->deadline)) {
+		atomic_fetch_add_explicit(&inst->coalesce->wait_hits, 1, memory_order_relaxed);
+	}
 
 	c->hits++;
 	*out = c;
@@ -311,7 +496,7 @@ static unlang_action_t cache_insert(rlm_rcode_t *p_result,
 	TALLOC_CTX		*pool;
 
 	if ((inst->config.max_entries > 0) && inst->driver->count &&
-	    (inst->driver->count(&inst->config, inst->driver_inst->dl_inst->data, request, handle) > inst->config.max_entries)) {
+	    (inst->driver->count(&inst->config, inst->driver_inst->dl_inst->data, request, *handle) > inst->config.max_entries)) {
 		RWDEBUG("Cache is full: %d entries", inst->config.max_entries);
 		RETURN_MODULE_FAIL;
 	}
@@ -327,8 +512,8 @@ static unlang_action_t cache_insert(rlm_rcode_t *p_result,
 	/*
 	 *	All in NSEC resolution
 	 */
-	c->created = c->expires = fr_time_to_unix_time(request->packet->timestamp);
-	c->expires = fr_unix_time_add(c->expires, ttl);
+	c->created = fr_time_to_unix_time(request->packet->timestamp);
+	c->expires = cache_expires(inst, request, ttl);
 
 	RDEBUG2("Creating new cache entry");
 
@@ -530,6 +715,58 @@ static int cache_verify(map_t *map, void *ctx)
 	return 0;
 }
 
+/** Wake up a request waiting for an entry to be filled, so it can check again
+ *
+ */
+static void _cache_fill_poll(UNUSED module_ctx_t const *mctx, request_t *request, UNUSED fr_time_t fired)
+{
+	unlang_interpret_mark_runnable(request);
+}
+
+static void mod_cache_fill_signal(module_ctx_t const *mctx, request_t *request, fr_state_signal_t action)
+{
+	if (action != FR_SIGNAL_CANCEL) return;
+
+	RDEBUG2("Cancelling wait for cache entry");
+
+	(void) unlang_module_timeout_delete(request, mctx->rctx);
+}
+
+/** Yield until another request has filled the entry, or we reach our deadline
+ *
+ * There's no way to signal requests being processed by other workers, so
+ * waiting requests wake up periodically and look for the entry again.
+ */
+static unlang_action_t cache_fill_wait(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request,
+				       rlm_cache_fill_t *fill, unlang_module_resume_t resume)
+{
+	rlm_cache_fill_t	*rctx = fill;
+	fr_time_t		when;
+
+	/*
+	 *	First time we've waited, the fill state
+	 *	needs to outlive the current call.
+	 */
+	if (rctx != mctx->rctx) {
+		MEM(rctx = talloc(request, rlm_cache_fill_t));
+		*rctx = *fill;
+	}
+	rctx->yield = false;
+
+	when = fr_time_add(fr_time(), CACHE_FILL_POLL_INTERVAL);
+	if (fr_time_gt(when, rctx->deadline)) when = rctx->deadline;
+
+	if (unlang_module_timeout_add(request, _cache_fill_poll, rctx, when) < 0) {
+		RPEDEBUG("Failed adding cache fill timeout");
+		if (rctx != mctx->rctx) talloc_free(rctx);
+		RETURN_MODULE_FAIL;
+	}
+
+	return unlang_module_yield(request, resume, mod_cache_fill_signal, rctx);
+}
+
+static unlang_action_t CC_HINT(nonnull) mod_cache_it_resume(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request);
+
 /** Do caching checks
  *
  * Since we can update ANY VP list, we do exactly the same thing for all sections
@@ -538,7 +775,9 @@ static int cache_verify(map_t *map, void *ctx)
  * If you want to cache something different in different sections, configure
  * another cache module.
  */
-static unlang_action_t CC_HINT(nonnull) mod_cache_it(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
+
+static unlang_action_t cache_it(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request,
+				rlm_cache_fill_t *fill)
 {
 	rlm_cache_entry_t	*c = NULL;
 	rlm_cache_t const	*inst = talloc_get_type_abort_const(mctx->inst->data, rlm_cache_t);
@@ -583,7 +822,7 @@ static unlang_action_t CC_HINT(nonnull) mod_cache_it(rlm_rcode_t *p_result, modu
 			RETURN_MODULE_FAIL;
 		}
 
-		cache_find(&rcode, &c, inst, request, &handle, key, key_len);
+		cache_find(&rcode, &c, inst, request, &handle, key, key_len, NULL);
 		if (rcode == RLM_MODULE_FAIL) goto finish;
 		fr_assert(!inst->driver->acquire || handle);
 
@@ -630,7 +869,9 @@ static unlang_action_t CC_HINT(nonnull) mod_cache_it(rlm_rcode_t *p_result, modu
 	 *	recording whether the entry existed.
 	 */
 	if (merge) {
-		cache_find(&rcode, &c, inst, request, &handle, key, key_len);
+		cache_find(&rcode, &c, inst, request, &handle, key, key_len, insert ? fill : NULL);
+		if (fill->yield) goto wait;
+
 		switch (rcode) {
 		case RLM_MODULE_FAIL:
 			goto finish;
@@ -695,7 +936,9 @@ static unlang_action_t CC_HINT(nonnull) mod_cache_it(rlm_rcode_t *p_result, modu
 	if ((exists < 0) && (insert || set_ttl)) {
 		rlm_rcode_t tmp;
 
-		cache_find(&tmp, &c, inst, request, &handle, key, key_len);
+		cache_find(&tmp, &c, inst, request, &handle, key, key_len, insert ? fill : NULL);
+		if (fill->yield) goto wait;
+
 		switch (tmp) {
 		case RLM_MODULE_FAIL:
 			rcode = RLM_MODULE_FAIL;
@@ -724,7 +967,7 @@ static unlang_action_t CC_HINT(nonnull) mod_cache_it(rlm_rcode_t *p_result, modu
 
 		fr_assert(c);
 
-		c->expires = fr_unix_time_add(fr_time_to_unix_time(request->packet->timestamp), ttl);
+		c->expires = cache_expires(inst, request, ttl);
 
 		cache_set_ttl(&tmp, inst, request, &handle, c);
 		switch (tmp) {
@@ -776,6 +1019,7 @@ static unlang_action_t CC_HINT(nonnull) mod_cache_it(rlm_rcode_t *p_result, modu
 finish:
 	cache_free(inst, &c);
 	cache_release(inst, request, &handle);
+	cache_lease_release(inst, request, key, key_len);
 
 	/*
 	 *	Clear control attributes
@@ -802,6 +1046,32 @@ finish:
 	}
 
 	RETURN_MODULE_RCODE(rcode);
+
+	/*
+	 *	Another request is filling the entry.  Control
+	 *	attributes are left in place, as we'll be back.
+	 */
+wait:
+	cache_free(inst, &c);
+	cache_release(inst, request, &handle);
+
+	return cache_fill_wait(p_result, mctx, request, fill, mod_cache_it_resume);
+}
+
+static unlang_action_t CC_HINT(nonnull) mod_cache_it_resume(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
+{
+	rlm_cache_fill_t	*fill = talloc_get_type_abort(mctx->rctx, rlm_cache_fill_t);
+	unlang_action_t		ua;
+
+	ua = cache_it(p_result, mctx, request, fill);
+	if (ua != UNLANG_ACTION_YIELD) talloc_free(fill);
+
+	return ua;
+}
+
+static unlang_action_t CC_HINT(nonnull) mod_cache_it(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
+{
+	return cache_it(p_result, mctx, request, &(rlm_cache_fill_t){ .yield = false });
 }
 
 static xlat_arg_parser_t const cache_xlat_args[] = {
@@ -857,16 +1127,14 @@ xlat_action_t cache_xlat(TALLOC_CTX *ctx, fr_dcursor_t *out,
 		return XLAT_ACTION_FAIL;
 	}
 
-	cache_find(&rcode, &c, inst, request, &handle, key, key_len);
+	cache_find(&rcode, &c, inst, request, &handle, key, key_len, NULL);
 	switch (rcode) {
 	case RLM_MODULE_OK:		/* found */
 		break;
 
-	case RLM_MODULE_NOTFOUND:	/* not found */
-		return XLAT_ACTION_FAIL;
-
 	default:
 		talloc_free(target);
+		cache_release(inst, request, &handle);
 		return XLAT_ACTION_FAIL;
 	}
 
@@ -882,14 +1150,14 @@ xlat_action_t cache_xlat(TALLOC_CTX *ctx, fr_dcursor_t *out,
 
 	talloc_free(target);
 
+	cache_free(inst, &c);
+	cache_release(inst, request, &handle);
+
 	/*
 	 *	Check if we found a matching map
 	 */
 	if (!map) return XLAT_ACTION_FAIL;
 
-	cache_free(inst, &c);
-	cache_release(inst, request, &handle);
-
 	return XLAT_ACTION_DONE;
 }
 
@@ -932,6 +1200,32 @@ static void cache_unref(request_t *request, rlm_cache_t const *inst, rlm_cache_e
 	}
 }
 
+static int cmd_stats_coalesce(FILE *fp, UNUSED FILE *fp_err, void *ctx, UNUSED fr_cmd_info_t const *info)
+{
+	rlm_cache_coalesce_t *coalesce = ctx;
+
+	fprintf(fp, "coalesce.fills			%" PRIu64 "\n", (uint64_t)atomic_load(&coalesce->fills));
+	fprintf(fp, "coalesce.waits			%" PRIu64 "\n", (uint64_t)atomic_load(&coalesce->waits));
+	fprintf(fp, "coalesce.wait_hits		%" PRIu64 "\n", (uint64_t)atomic_load(&coalesce->wait_hits));
+	fprintf(fp, "coalesce.wait_timeouts		%" PRIu64 "\n", (uint64_t)atomic_load(&coalesce->wait_timeouts));
+	fprintf(fp, "coalesce.stale_served		%" PRIu64 "\n", (uint64_t)atomic_load(&coalesce->stale_served));
+
+	return 0;
+}
+
+static fr_cmd_table_t cmd_table[] = {
+	{
+		.parent = "stats module",
+		.add_name = true,
+		.name = "coalesce",
+		.func = cmd_stats_coalesce,
+		.help = "Show statistics for requests waiting on cache entries to be filled.",
+		.read_only = true
+	},
+
+	CMD_TABLE_END
+};
+
 /** Free any memory allocated under the instance
  *
  */
@@ -939,6 +1233,8 @@ static int mod_detach(module_detach_ctx_t const *mctx)
 {
 	rlm_cache_t *inst = talloc_get_type_abort(mctx->inst->data, rlm_cache_t);
 
+	if (inst->coalesce) pthread_mutex_destroy(&inst->coalesce->mutex);
+
 	/*
 	 *	We need to explicitly free all children, so if the driver
 	 *	parented any memory off the instance, their destructors
@@ -1061,6 +1357,29 @@ static int mod_instantiate(module_inst_ctx_t const *mctx)
 		return -1;
 	}
 
+	/*
+	 *	Track which requests are filling which entries,
+	 *	so that concurrent misses can wait for them, and
+	 *	stale entries are only refreshed once.
+	 */
+	if (fr_time_delta_ispos(inst->config.lock_timeout) || fr_time_delta_ispos(inst->config.stale_ttl)) {
+		int ret;
+
+		MEM(inst->coalesce = talloc_zero(inst, rlm_cache_coalesce_t));
+		MEM(inst->coalesce->leases = fr_rb_inline_talloc_alloc(inst->coalesce, rlm_cache_lease_t, node,
+								       cache_lease_cmp, NULL));
+		ret = pthread_mutex_init(&inst->coalesce->mutex, NULL);
+		if (ret != 0) {
+			cf_log_err(conf, "Failed initialising lease mutex: %s", fr_syserror(ret));
+			return -1;
+		}
+
+		if (fr_command_register_hook(NULL, mctx->inst->name, inst->coalesce, cmd_table) < 0) {
+			cf_log_perr(conf, "Failed registering radmin commands");
+			return -1;
+		}
+	}
+
 	return 0;
 }
 
@@ -1101,7 +1420,7 @@ static unlang_action_t CC_HINT(nonnull) mod_method_status(rlm_rcode_t *p_result,
 
 	fr_assert(!inst->driver->acquire || handle);
 
-	cache_find(&rcode, &entry, inst, request, &handle, key, key_len);
+	cache_find(&rcode, &entry, inst, request, &handle, key, key_len, NULL);
 	if (rcode == RLM_MODULE_FAIL) goto finish;
 
 	rcode = (entry) ? RLM_MODULE_OK : RLM_MODULE_NOTFOUND;
@@ -1112,14 +1431,16 @@ finish:
 	RETURN_MODULE_RCODE(rcode);
 }
 
+static unlang_action_t CC_HINT(nonnull) mod_method_load_resume(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request);
+
 /** Load the avps by ${key}.
  *
- * @return
- *	- #RLM_MODULE_UPDATED on success.
- *	- #RLM_MODULE_NOTFOUND on cache miss.
- *	- #RLM_MODULE_FAIL on failure.
+ * On a miss, this request takes the lease to fill the entry, which is
+ * released when the entry is stored, or the request is freed.  Other
+ * requests loading the same key wait for the store.
  */
-static unlang_action_t CC_HINT(nonnull) mod_method_load(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
+static unlang_action_t cache_load(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request,
+				  rlm_cache_fill_t *fill)
 {
 	rlm_cache_t const	*inst = talloc_get_type_abort(mctx->inst->data, rlm_cache_t);
 	rlm_rcode_t		rcode = RLM_MODULE_NOOP;
@@ -1147,7 +1468,11 @@ static unlang_action_t CC_HINT(nonnull) mod_method_load(rlm_rcode_t *p_result, m
 		RETURN_MODULE_FAIL;
 	}
 
-	cache_find(&rcode, &entry, inst, request, &handle, key, key_len);
+	cache_find(&rcode, &entry, inst, request, &handle, key, key_len, fill);
+	if (fill->yield) {
+		cache_release(inst, request, &handle);
+		return cache_fill_wait(p_result, mctx, request, fill, mod_method_load_resume);
+	}
 	if (rcode == RLM_MODULE_FAIL) goto finish;
 
 	if (!entry) {
@@ -1164,6 +1489,29 @@ finish:
 	RETURN_MODULE_RCODE(rcode);
 }
 
+static unlang_action_t CC_HINT(nonnull) mod_method_load_resume(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
+{
+	rlm_cache_fill_t	*fill = talloc_get_type_abort(mctx->rctx, rlm_cache_fill_t);
+	unlang_action_t		ua;
+
+	ua = cache_load(p_result, mctx, request, fill);
+	if (ua != UNLANG_ACTION_YIELD) talloc_free(fill);
+
+	return ua;
+}
+
+/** Load the avps by ${key}.
+ *
+ * @return
+ *	- #RLM_MODULE_UPDATED on success.
+ *	- #RLM_MODULE_NOTFOUND on cache miss.
+ *	- #RLM_MODULE_FAIL on failure.
+ */
+static unlang_action_t CC_HINT(nonnull) mod_method_load(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
+{
+	return cache_load(p_result, mctx, request, &(rlm_cache_fill_t){ .yield = false });
+}
+
 /** Create and insert a cache entry
  *
  * @return
@@ -1221,7 +1569,7 @@ static unlang_action_t CC_HINT(nonnull) mod_method_store(rlm_rcode_t *p_result,
 	/*
 	 *	We can only alter the TTL on an entry if it exists.
 	 */
-	cache_find(&rcode, &entry, inst, request, &handle, key, key_len);
+	cache_find(&rcode, &entry, inst, request, &handle, key, key_len, NULL);
 	if (rcode == RLM_MODULE_FAIL) goto finish;
 
 	if (rcode == RLM_MODULE_OK) {
@@ -1229,7 +1577,7 @@ static unlang_action_t CC_HINT(nonnull) mod_method_store(rlm_rcode_t *p_result,
 
 		DEBUG3("Updating the TTL -> %pV", fr_box_time_delta(ttl));
 
-		entry->expires = fr_unix_time_add(fr_time_to_unix_time(request->packet->timestamp), ttl);
+		entry->expires = cache_expires(inst, request, ttl);
 
 		cache_set_ttl(&rcode, inst, request, &handle, entry);
 		if (rcode == RLM_MODULE_FAIL) goto finish;
@@ -1260,6 +1608,7 @@ static unlang_action_t CC_HINT(nonnull) mod_method_store(rlm_rcode_t *p_result,
 
 finish:
 	cache_unref(request, inst, entry, handle);
+	cache_lease_release(inst, request, key, key_len);
 
 	RETURN_MODULE_RCODE(rcode);
 }
@@ -1299,7 +1648,7 @@ static unlang_action_t CC_HINT(nonnull) mod_method_clear(rlm_rcode_t *p_result,
 		RETURN_MODULE_FAIL;
 	}
 
-	cache_find(&rcode, &entry, inst, request, &handle, key, key_len);
+	cache_find(&rcode, &entry, inst, request, &handle, key, key_len, NULL);
 	if (rcode == RLM_MODULE_FAIL) goto finish;
 
 	if (!entry) {
@@ -1370,7 +1719,7 @@ static unlang_action_t CC_HINT(nonnull) mod_method_ttl(rlm_rcode_t *p_result, mo
 	/*
 	 *	We can only alter the TTL on an entry if it exists.
 	 */
-	cache_find(&rcode, &entry, inst, request, &handle, key, key_len);
+	cache_find(&rcode, &entry, inst, request, &handle, key, key_len, NULL);
 	if (rcode == RLM_MODULE_FAIL) goto finish;
 
 	if (rcode == RLM_MODULE_OK) {
@@ -1378,7 +1727,7 @@ static unlang_action_t CC_HINT(nonnull) mod_method_ttl(rlm_rcode_t *p_result, mo
 
 		DEBUG3("Updating the TTL -> %pV", fr_box_time_delta(ttl));
 
-		entry->expires = fr_unix_time_add(fr_time_to_unix_time(request->packet->timestamp), ttl);
+		entry->expires = cache_expires(inst, request, ttl);
 
 		cache_set_ttl(&rcode, inst, request, &handle, entry);
 		if (rcode == RLM_MODULE_FAIL) goto finish;
@@ -29,6 +29,7 @@ RCSIDH(cache_h, "$Id$")
 #include <freeradius-devel/server/dl_module.h>
 #include <freeradius-devel/server/map.h>
 #include <freeradius-devel/protocol/freeradius/freeradius.internal.h>
+#include <freeradius-devel/util/stdatomic.h>
 
 typedef struct rlm_cache_driver_s rlm_cache_driver_t;
 
@@ -55,8 +56,28 @@ typedef struct {
 	uint32_t		max_entries;		//!< Maximum entries allowed.
 	int32_t			epoch;			//!< Time after which entries are considered valid.
 	bool			stats;			//!< Generate statistics.
+
+	fr_time_delta_t		lock_timeout;		//!< How long to wait for another request to fill
+							///< a missing entry.  Zero disables coalescing.
+	fr_time_delta_t		stale_ttl;		//!< How long an entry may be served after it's
+							///< expired, whilst another request refreshes it.
 } rlm_cache_config_t;
 
+/** Tracks which keys are currently being filled
+ *
+ * Shared between all workers using the module instance.
+ */
+typedef struct {
+	pthread_mutex_t		mutex;			//!< Protects the lease tree.
+	fr_rb_tree_t		*leases;		//!< Keys being filled, and the requests filling them.
+
+	atomic_uint_fast64_t	fills;			//!< Leases granted.
+	atomic_uint_fast64_t	waits;			//!< Requests which waited for another to fill an entry.
+	atomic_uint_fast64_t	wait_hits;		//!< Waiting requests which found the entry filled.
+	atomic_uint_fast64_t	wait_timeouts;		//!< Waiting requests which gave up.
+	atomic_uint_fast64_t	stale_served;		//!< Stale entries served whilst being refreshed.
+} rlm_cache_coalesce_t;
+
 /*
  *	Define a structure for our module configuration.
  *
@@ -72,6 +93,8 @@ typedef struct {
 
 	map_list_t		maps;			//!< Attribute map applied to users.
 							//!< and profiles.
+
+	rlm_cache_coalesce_t	*coalesce;		//!< Fill leases and coalescing statistics.
 } rlm_cache_t;
 
 typedef struct {
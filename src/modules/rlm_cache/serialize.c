@@ -25,9 +25,31 @@
  */
 RCSID("$Id$")
 
+#include <freeradius-devel/util/hash.h>
+
 #include "rlm_cache.h"
 #include "serialize.h"
 
+/** Magic prefix for binary entries
+ *
+ * Text entries always start with a printable character, so the leading
+ * NUL lets the two formats be told apart.
+ */
+static uint8_t const cache_binary_magic[] = { 0x00, 'F', 'R', 'C' };
+
+#define CACHE_BINARY_VERSION	2
+#define CACHE_BINARY_MAX_DEPTH	8
+
+/** Which dictionary an attribute's numbers are relative to
+ *
+ * The internal dictionary isn't registered by protocol number,
+ * so it needs its own tag.
+ */
+typedef enum {
+	CACHE_BINARY_DICT_PROTOCOL = 0,		//!< Protocol dictionary, protocol number follows.
+	CACHE_BINARY_DICT_INTERNAL = 1		//!< The internal dictionary.
+} cache_binary_dict_t;
+
 /** Serialize a cache entry as a humanly readable string
  *
  * @param ctx to alloc new string in. Should be a talloc pool a little bigger
@@ -177,3 +199,288 @@ int cache_deserialize(rlm_cache_entry_t *c, fr_dict_t const *dict, char *in, ssi
 
 	return 0;
 }
+
+/** Mix an attribute's identity into an entry fingerprint
+ *
+ * The fingerprint lets us detect entries written with a dictionary where
+ * the same attribute numbers had different names or data types.
+ */
+static inline uint32_t cache_fingerprint_update(uint32_t hash, fr_dict_attr_t const *da)
+{
+	uint8_t type = da->type;
+
+	hash = fr_hash_update(da->name, strlen(da->name), hash);
+	return fr_hash_update(&type, sizeof(type), hash);
+}
+
+/** Determine whether a serialized entry uses the binary format
+ *
+ * @param[in] in	Serialized entry.
+ * @param[in] inlen	Length of the serialized entry.
+ * @return
+ *	- true if the entry was produced by #cache_serialize_binary.
+ *	- false if the entry should be passed to #cache_deserialize.
+ */
+bool cache_serialized_is_binary(uint8_t const *in, size_t inlen)
+{
+	if (inlen < sizeof(cache_binary_magic)) return false;
+
+	return (memcmp(in, cache_binary_magic, sizeof(cache_binary_magic)) == 0);
+}
+
+/** Serialize a cache entry in a compact binary format
+ *
+ * Attributes are encoded as their dictionary (internal, or a protocol number)
+ * and the numbers of each attribute from the root of the dictionary to the
+ * leaf, followed by the
+ * value in network format.  A fingerprint of the attribute names and types
+ * used is appended so that entries written with a different dictionary can
+ * be rejected on retrieval.
+ *
+ * @param[out] dbuff	to write the serialized entry to.
+ * @param[in] c		Cache entry to serialize.
+ * @return
+ *	- >0 the number of bytes written.
+ *	- <0 on failure.  If the error is due to insufficient space, the
+ *	  negative number of bytes we would have needed.
+ */
+ssize_t cache_serialize_binary(fr_dbuff_t *dbuff, rlm_cache_entry_t const *c)
+{
+	fr_dbuff_t	work_dbuff = FR_DBUFF(dbuff);
+	map_t		*map = NULL;
+	uint32_t	fingerprint = 0;
+	size_t		num = map_list_num_elements(&c->maps);
+
+	if (num > UINT16_MAX) {
+		fr_strerror_printf("Too many maps in entry, got %zu, max %u", num, UINT16_MAX);
+		return -1;
+	}
+
+	FR_DBUFF_IN_MEMCPY_RETURN(&work_dbuff, cache_binary_magic, sizeof(cache_binary_magic));
+	FR_DBUFF_IN_RETURN(&work_dbuff, (uint8_t)CACHE_BINARY_VERSION);
+	FR_DBUFF_IN_RETURN(&work_dbuff, (int64_t)fr_unix_time_unwrap(c->created));
+	FR_DBUFF_IN_RETURN(&work_dbuff, (int64_t)fr_unix_time_unwrap(c->expires));
+	FR_DBUFF_IN_RETURN(&work_dbuff, (uint16_t)num);
+
+	while ((map = map_list_next(&c->maps, map))) {
+		fr_dict_attr_t const	*da, *p;
+		fr_dict_attr_t const	*path[CACHE_BINARY_MAX_DEPTH];
+		fr_value_box_t const	*value;
+		fr_dbuff_marker_t	len_m;
+		unsigned int		depth = 0;
+		ssize_t			slen;
+
+		if (!tmpl_is_attr(map->lhs) || !tmpl_is_data(map->rhs) || (tmpl_request_ref_count(map->lhs) > 1)) {
+			fr_strerror_printf("Can't serialize map \"%s\" in binary format", map->lhs->name);
+			return -1;
+		}
+
+		da = tmpl_da(map->lhs);
+		if (da->flags.is_unknown || da->flags.is_raw) {
+			fr_strerror_printf("Can't serialize unknown attribute \"%s\" in binary format", da->name);
+			return -1;
+		}
+		value = tmpl_value(map->rhs);
+
+		for (p = da; !p->flags.is_root; p = p->parent) {
+			if (depth == NUM_ELEMENTS(path)) {
+				fr_strerror_printf("Attribute \"%s\" nested too deeply", da->name);
+				return -1;
+			}
+			path[depth++] = p;
+		}
+
+		FR_DBUFF_IN_RETURN(&work_dbuff, (uint8_t)map->op);
+		FR_DBUFF_IN_RETURN(&work_dbuff, (uint8_t)tmpl_request(map->lhs));
+		FR_DBUFF_IN_RETURN(&work_dbuff, (uint8_t)tmpl_list(map->lhs));
+		FR_DBUFF_IN_RETURN(&work_dbuff, (int16_t)tmpl_num(map->lhs));
+		if (fr_dict_by_da(da) == fr_dict_internal()) {
+			FR_DBUFF_IN_RETURN(&work_dbuff, (uint8_t)CACHE_BINARY_DICT_INTERNAL);
+		} else {
+			FR_DBUFF_IN_RETURN(&work_dbuff, (uint8_t)CACHE_BINARY_DICT_PROTOCOL);
+			FR_DBUFF_IN_RETURN(&work_dbuff, (uint32_t)fr_dict_root(fr_dict_by_da(da))->attr);
+		}
+		FR_DBUFF_IN_RETURN(&work_dbuff, (uint8_t)depth);
+		while (depth > 0) {
+			p = path[--depth];
+			FR_DBUFF_IN_RETURN(&work_dbuff, (uint32_t)p->attr);
+			fingerprint = cache_fingerprint_update(fingerprint, p);
+		}
+
+		FR_DBUFF_IN_RETURN(&work_dbuff, (uint8_t)value->type);
+
+		fr_dbuff_marker(&len_m, &work_dbuff);
+		FR_DBUFF_ADVANCE_RETURN(&work_dbuff, sizeof(uint32_t));
+
+		slen = fr_value_box_to_network(&work_dbuff, value);
+		if (slen < 0) {
+			fr_dbuff_marker_release(&len_m);
+			return slen;
+		}
+		fr_dbuff_in(&len_m, (uint32_t)slen);
+		fr_dbuff_marker_release(&len_m);
+	}
+
+	FR_DBUFF_IN_RETURN(&work_dbuff, fingerprint);
+
+	return fr_dbuff_set(dbuff, &work_dbuff);
+}
+
+/** Converts a binary serialized cache entry back into a structure
+ *
+ * Maps are built directly from the attribute references and values, without
+ * going through the tmpl or map tokenizers.
+ *
+ * @param[in] c		Cache entry to populate (should already be allocated).
+ * @param[in] in	Binary representation of cache entry.
+ * @param[in] inlen	Length of the binary representation.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int cache_deserialize_binary(rlm_cache_entry_t *c, uint8_t const *in, size_t inlen)
+{
+	fr_dbuff_t	dbuff = FR_DBUFF_TMP(in, inlen);
+	uint8_t		version;
+	int64_t		created, expires;
+	uint16_t	num, i;
+	uint32_t	fingerprint = 0, expected;
+	map_list_t	head;
+
+	map_list_init(&head);
+
+	if (!cache_serialized_is_binary(in, inlen)) {
+		fr_strerror_const("Entry is not in binary format");
+		return -1;
+	}
+	fr_dbuff_advance(&dbuff, sizeof(cache_binary_magic));
+
+	if ((fr_dbuff_out(&version, &dbuff) <= 0) ||
+	    (fr_dbuff_out(&created, &dbuff) <= 0) ||
+	    (fr_dbuff_out(&expires, &dbuff) <= 0) ||
+	    (fr_dbuff_out(&num, &dbuff) <= 0)) {
+	truncated:
+		fr_strerror_const("Entry truncated");
+	error:
+		map_list_talloc_free(&head);
+		return -1;
+	}
+
+	if (version != CACHE_BINARY_VERSION) {
+		fr_strerror_printf("Unsupported entry version %u, expected %u", version, CACHE_BINARY_VERSION);
+		goto error;
+	}
+
+	for (i = 0; i < num; i++) {
+		uint8_t			op, request_ref, list, dict_tag, depth, type;
+		int16_t			idx;
+		uint32_t		proto, attr, len;
+		fr_dict_t const		*dict;
+		fr_dict_attr_t const	*da;
+		map_t			*map;
+
+		if ((fr_dbuff_out(&op, &dbuff) <= 0) ||
+		    (fr_dbuff_out(&request_ref, &dbuff) <= 0) ||
+		    (fr_dbuff_out(&list, &dbuff) <= 0) ||
+		    (fr_dbuff_out(&idx, &dbuff) <= 0) ||
+		    (fr_dbuff_out(&dict_tag, &dbuff) <= 0)) goto truncated;
+
+		/*
+		 *	Don't trust the entry to contain values
+		 *	we'd have written.
+		 */
+		if ((op >= T_TOKEN_LAST) || (!fr_assignment_op[op] && !fr_equality_op[op])) {
+			fr_strerror_printf("Invalid operator %u in entry", op);
+			goto error;
+		}
+
+		if (request_ref >= REQUEST_UNKNOWN) {
+			fr_strerror_printf("Invalid request reference %u in entry", request_ref);
+			goto error;
+		}
+
+		if (list >= PAIR_LIST_UNKNOWN) {
+			fr_strerror_printf("Invalid list %u in entry", list);
+			goto error;
+		}
+
+		switch (dict_tag) {
+		case CACHE_BINARY_DICT_INTERNAL:
+			dict = fr_dict_internal();
+			break;
+
+		case CACHE_BINARY_DICT_PROTOCOL:
+			if (fr_dbuff_out(&proto, &dbuff) <= 0) goto truncated;
+
+			dict = fr_dict_by_protocol_num(proto);
+			if (!dict) {
+				fr_strerror_printf("No dictionary loaded for protocol %u", proto);
+				goto error;
+			}
+			break;
+
+		default:
+			fr_strerror_printf("Invalid dictionary type %u in entry", dict_tag);
+			goto error;
+		}
+
+		if (fr_dbuff_out(&depth, &dbuff) <= 0) goto truncated;
+
+		da = fr_dict_root(dict);
+		while (depth-- > 0) {
+			if (fr_dbuff_out(&attr, &dbuff) <= 0) goto truncated;
+
+			da = fr_dict_attr_child_by_num(da, attr);
+			if (!da) {
+				fr_strerror_printf("Unknown attribute %u in entry", attr);
+				goto error;
+			}
+			fingerprint = cache_fingerprint_update(fingerprint, da);
+		}
+
+		if ((fr_dbuff_out(&type, &dbuff) <= 0) ||
+		    (fr_dbuff_out(&len, &dbuff) <= 0)) goto truncated;
+
+		if ((type != da->type) || !fr_type_is_leaf(da->type)) {
+			fr_strerror_printf("Attribute \"%s\" has type %s, but entry contains a %s",
+					   da->name, fr_type_to_str(da->type), fr_type_to_str(type));
+			goto error;
+		}
+
+		if (fr_dbuff_remaining(&dbuff) < len) goto truncated;
+
+		MEM(map = talloc_zero(c, map_t));
+		map->op = op;
+		map_list_init(&map->child);
+
+		MEM(map->lhs = tmpl_alloc(map, TMPL_TYPE_ATTR, T_BARE_WORD, NULL, 0));
+		tmpl_attr_set_leaf_da(map->lhs, da);
+		tmpl_attr_set_leaf_num(map->lhs, idx);
+		tmpl_attr_set_request(map->lhs, request_ref);
+		tmpl_attr_set_list(map->lhs, list);
+		tmpl_set_name_shallow(map->lhs, T_BARE_WORD, da->name, -1);
+
+		MEM(map->rhs = tmpl_alloc(map, TMPL_TYPE_DATA, T_BARE_WORD, NULL, 0));
+		if (fr_value_box_from_network(map->rhs, tmpl_value(map->rhs), da->type, da,
+					      &FR_DBUFF_TMP(fr_dbuff_current(&dbuff), (size_t)len), len, true) < 0) {
+			talloc_free(map);
+			goto error;
+		}
+		fr_dbuff_advance(&dbuff, len);
+
+		MAP_VERIFY(map);
+		map_list_insert_tail(&head, map);
+	}
+
+	if (fr_dbuff_out(&expected, &dbuff) <= 0) goto truncated;
+	if (expected != fingerprint) {
+		fr_strerror_const("Entry was written with a different dictionary");
+		goto error;
+	}
+
+	c->created = fr_unix_time_wrap(created);
+	c->expires = fr_unix_time_wrap(expires);
+	map_list_move(&c->maps, &head);
+
+	return 0;
+}
@@ -28,3 +28,7 @@ RCSIDH(serialize_h, "$Id$")
 
 int cache_serialize(TALLOC_CTX *ctx, char **out, rlm_cache_entry_t const *c);
 int cache_deserialize(rlm_cache_entry_t *c, fr_dict_t const *dict, char *in, ssize_t inlen);
+
+bool	cache_serialized_is_binary(uint8_t const *in, size_t inlen);
+ssize_t	cache_serialize_binary(fr_dbuff_t *dbuff, rlm_cache_entry_t const *c);
+int	cache_deserialize_binary(rlm_cache_entry_t *c, uint8_t const *in, size_t inlen);
@@ -0,0 +1,259 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or (at
+ *   your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/** Tests for the binary cache entry serialization format
+ *
+ * @file src/modules/rlm_cache/serialize_tests.c
+ *
+ * @copyright 2022 The FreeRADIUS server project
+ */
+#define USE_CONSTRUCTOR
+
+/*
+ * It should be declared before include the "acutest.h"
+ */
+#ifdef USE_CONSTRUCTOR
+static void test_init(void) __attribute__((constructor));
+#else
+static void test_init(void);
+#  define TEST_INIT  test_init()
+#endif
+
+#include <freeradius-devel/util/acutest.h>
+#include <freeradius-devel/util/acutest_helpers.h>
+
+#include <freeradius-devel/util/dict.h>
+#include <freeradius-devel/util/talloc.h>
+
+#include "rlm_cache.h"
+#include "serialize.h"
+
+/*
+ *	Offsets of the fields of the first map
+ *	in an entry.
+ */
+#define MAP_OP_OFFSET		23
+#define MAP_REQUEST_OFFSET	24
+#define MAP_LIST_OFFSET		25
+#define MAP_DICT_OFFSET		28
+
+static TALLOC_CTX	*autofree;
+static fr_dict_t	*dict_internal;
+static fr_dict_t	*dict_radius;
+
+/** Global initialisation
+ */
+static void test_init(void)
+{
+	autofree = talloc_autofree_context();
+	if (!autofree) {
+	error:
+		fr_perror("rlm_cache_serialize_tests");
+		fr_exit_now(EXIT_FAILURE);
+	}
+
+	/*
+	 *	Mismatch between the binary and the libraries it depends on
+	 */
+	if (fr_check_lib_magic(RADIUSD_MAGIC_NUMBER) < 0) goto error;
+
+	if (!fr_dict_global_ctx_init(autofree, "share/dictionary")) goto error;
+
+	if (fr_dict_internal_afrom_file(&dict_internal, FR_DICTIONARY_INTERNAL_DIR, __FILE__) < 0) goto error;
+	if (fr_dict_protocol_afrom_file(&dict_radius, "radius", NULL, __FILE__) < 0) goto error;
+}
+
+static map_t *map_fake_alloc(TALLOC_CTX *ctx, fr_dict_t const *dict, char const *attr,
+			     fr_token_t op, fr_value_box_t const *value)
+{
+	map_t *map;
+
+	map = talloc_zero(ctx, map_t);
+	TEST_CHECK(map != NULL);
+	map->op = op;
+	map_list_init(&map->child);
+
+	TEST_CHECK(tmpl_afrom_attr_str(map, NULL, &map->lhs, attr,
+				       &(tmpl_rules_t){
+				       		.attr = {
+				       			.dict_def = dict,
+				       			.list_def = PAIR_LIST_REQUEST
+				       		}
+				       }) > 0);
+	TEST_MSG("Failed parsing \"%s\": %s", attr, fr_strerror());
+
+	TEST_CHECK(tmpl_afrom_value_box(map, &map->rhs, UNCONST(fr_value_box_t *, value), false) == 0);
+
+	return map;
+}
+
+static rlm_cache_entry_t *entry_fake_alloc(void)
+{
+	rlm_cache_entry_t *c;
+
+	c = talloc_zero(autofree, rlm_cache_entry_t);
+	TEST_CHECK(c != NULL);
+	map_list_init(&c->maps);
+	c->created = fr_unix_time_from_sec(1000);
+	c->expires = fr_unix_time_from_sec(2000);
+
+	return c;
+}
+
+static ssize_t entry_serialize(uint8_t *buff, size_t len, rlm_cache_entry_t const *c)
+{
+	ssize_t slen;
+
+	slen = cache_serialize_binary(&FR_DBUFF_TMP(buff, len), c);
+	TEST_CHECK(slen > 0);
+	TEST_MSG("Failed serializing entry: %s", fr_strerror());
+
+	return slen;
+}
+
+static void test_round_trip(void)
+{
+	rlm_cache_entry_t	*in, *out;
+	uint8_t			buff[1024];
+	ssize_t			slen;
+	map_t			*a = NULL, *b = NULL;
+
+	in = entry_fake_alloc();
+	map_list_insert_tail(&in->maps, map_fake_alloc(in, dict_radius, "reply.Reply-Message",
+						       T_OP_SET, fr_box_strvalue("hello")));
+	map_list_insert_tail(&in->maps, map_fake_alloc(in, dict_radius, "Session-Timeout",
+						       T_OP_EQ, fr_box_uint32(3600)));
+	map_list_insert_tail(&in->maps, map_fake_alloc(in, dict_internal, "control.Tmp-String-0",
+						       T_OP_ADD_EQ, fr_box_strvalue("internal")));
+	map_list_insert_tail(&in->maps, map_fake_alloc(in, dict_internal, "Tmp-Integer-0",
+						       T_OP_SET, fr_box_uint32(42)));
+
+	slen = entry_serialize(buff, sizeof(buff), in);
+	TEST_CHECK(cache_serialized_is_binary(buff, slen));
+
+	out = entry_fake_alloc();
+	out->created = out->expires = fr_unix_time_wrap(0);
+	TEST_CHECK(cache_deserialize_binary(out, buff, slen) == 0);
+	TEST_MSG("Failed deserializing entry: %s", fr_strerror());
+
+	TEST_CHECK(fr_unix_time_unwrap(out->created) == fr_unix_time_unwrap(in->created));
+	TEST_CHECK(fr_unix_time_unwrap(out->expires) == fr_unix_time_unwrap(in->expires));
+	TEST_CHECK(map_list_num_elements(&out->maps) == map_list_num_elements(&in->maps));
+
+	while ((a = map_list_next(&in->maps, a)) && (b = map_list_next(&out->maps, b))) {
+		TEST_CASE(a->lhs->name);
+		TEST_CHECK(tmpl_da(a->lhs) == tmpl_da(b->lhs));
+		TEST_CHECK(fr_dict_by_da(tmpl_da(a->lhs)) == fr_dict_by_da(tmpl_da(b->lhs)));
+		TEST_CHECK(a->op == b->op);
+		TEST_CHECK(tmpl_request(a->lhs) == tmpl_request(b->lhs));
+		TEST_CHECK(tmpl_list(a->lhs) == tmpl_list(b->lhs));
+		TEST_CHECK(fr_value_box_cmp(tmpl_value(a->rhs), tmpl_value(b->rhs)) == 0);
+	}
+
+	talloc_free(in);
+	talloc_free(out);
+}
+
+/** Check the internal dictionary is tagged, rather than identified by protocol number
+ *
+ */
+static void test_internal_dict(void)
+{
+	rlm_cache_entry_t	*in, *out;
+	uint8_t			buff[256];
+	ssize_t			slen;
+	map_t			*map;
+
+	in = entry_fake_alloc();
+	map_list_insert_tail(&in->maps, map_fake_alloc(in, dict_internal, "control.Cache-TTL",
+						       T_OP_SET, fr_box_int32(30)));
+
+	slen = entry_serialize(buff, sizeof(buff), in);
+	TEST_CHECK(buff[MAP_DICT_OFFSET] == 1);
+
+	out = entry_fake_alloc();
+	TEST_CHECK(cache_deserialize_binary(out, buff, slen) == 0);
+	TEST_MSG("Failed deserializing entry: %s", fr_strerror());
+
+	map = map_list_head(&out->maps);
+	TEST_CHECK(map != NULL);
+	if (map) TEST_CHECK(fr_dict_by_da(tmpl_da(map->lhs)) == fr_dict_internal());
+
+	talloc_free(in);
+	talloc_free(out);
+}
+
+/** Corrupt a single byte of a serialized entry, and check it's rejected
+ *
+ */
+static void entry_corrupt_check(uint8_t const *in, size_t inlen, size_t offset, uint8_t value)
+{
+	rlm_cache_entry_t	*out;
+	uint8_t			buff[256];
+
+	TEST_ASSERT(inlen <= sizeof(buff));
+	memcpy(buff, in, inlen);
+	buff[offset] = value;
+
+	out = entry_fake_alloc();
+	TEST_CHECK(cache_deserialize_binary(out, buff, inlen) < 0);
+	TEST_MSG("Entry with byte %zu set to %u was accepted", offset, value);
+	TEST_CHECK(map_list_num_elements(&out->maps) == 0);
+
+	talloc_free(out);
+}
+
+static void test_invalid(void)
+{
+	rlm_cache_entry_t	*in, *out;
+	uint8_t			buff[256];
+	ssize_t			slen;
+
+	in = entry_fake_alloc();
+	map_list_insert_tail(&in->maps, map_fake_alloc(in, dict_radius, "reply.Reply-Message",
+						       T_OP_SET, fr_box_strvalue("hello")));
+	slen = entry_serialize(buff, sizeof(buff), in);
+
+	TEST_CASE("Invalid operator");
+	entry_corrupt_check(buff, slen, MAP_OP_OFFSET, 0xff);
+	entry_corrupt_check(buff, slen, MAP_OP_OFFSET, T_LCBRACE);
+
+	TEST_CASE("Invalid request reference");
+	entry_corrupt_check(buff, slen, MAP_REQUEST_OFFSET, REQUEST_UNKNOWN);
+	entry_corrupt_check(buff, slen, MAP_REQUEST_OFFSET, 0xff);
+
+	TEST_CASE("Invalid list");
+	entry_corrupt_check(buff, slen, MAP_LIST_OFFSET, PAIR_LIST_UNKNOWN);
+	entry_corrupt_check(buff, slen, MAP_LIST_OFFSET, 0xff);
+
+	TEST_CASE("Invalid dictionary");
+	entry_corrupt_check(buff, slen, MAP_DICT_OFFSET, 0xff);
+
+	TEST_CASE("Truncated");
+	out = entry_fake_alloc();
+	TEST_CHECK(cache_deserialize_binary(out, buff, slen - 1) < 0);
+
+	talloc_free(in);
+	talloc_free(out);
+}
+
+TEST_LIST = {
+	{ "round_trip",		test_round_trip },
+	{ "internal_dict",	test_internal_dict },
+	{ "invalid",		test_invalid },
+
+	{ NULL }
+};
@@ -0,0 +1,6 @@
+TARGET      := rlm_cache_serialize_tests
+SOURCES     := serialize_tests.c serialize.c
+
+TGT_LDLIBS  := $(LIBS) $(GPERFTOOLS_LIBS)
+TGT_LDFLAGS := $(LDFLAGS) $(GPERFTOOLS_LDFLAGS)
+TGT_PREREQS := libfreeradius-util.la libfreeradius-radius.a libfreeradius-server.a libfreeradius-unlang.a
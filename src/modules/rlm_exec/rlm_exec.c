@@ -27,6 +27,7 @@ RCSID("$Id$")
 #define LOG_PREFIX mctx->inst->name
 
 #include <freeradius-devel/server/base.h>
+#include <freeradius-devel/server/exec_helper.h>
 #include <freeradius-devel/server/module.h>
 #include <freeradius-devel/unlang/interpret.h>
 #include <freeradius-devel/util/debug.h>
@@ -45,10 +46,16 @@ typedef struct {
 	bool			env_inherit;
 	fr_time_delta_t		timeout;
 	bool			timeout_is_set;
+	fr_exec_helper_conf_t	helper;		//!< Persistent helpers to pass requests to,
+						///< instead of running program.
 
 	tmpl_t	*tmpl;
 } rlm_exec_t;
 
+typedef struct {
+	fr_exec_helper_t	*helper;	//!< This thread's helpers.
+} rlm_exec_thread_t;
+
 static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("wait", FR_TYPE_BOOL, rlm_exec_t, wait), .dflt = "yes" },
 	{ FR_CONF_OFFSET("program", FR_TYPE_STRING | FR_TYPE_XLAT, rlm_exec_t, program) },
@@ -57,6 +64,7 @@ static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("shell_escape", FR_TYPE_BOOL, rlm_exec_t, shell_escape), .dflt = "yes" },
 	{ FR_CONF_OFFSET("env_inherit", FR_TYPE_BOOL, rlm_exec_t, env_inherit), .dflt = "no" },
 	{ FR_CONF_OFFSET_IS_SET("timeout", FR_TYPE_TIME_DELTA, rlm_exec_t, timeout) },
+	{ FR_CONF_OFFSET("helper", FR_TYPE_SUBSECTION, rlm_exec_t, helper), .subcs = (void const *) fr_exec_helper_config },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -237,6 +245,29 @@ static int mod_instantiate(module_inst_ctx_t const *mctx)
 	CONF_SECTION		*conf = mctx->inst->conf;
 	ssize_t			slen;
 
+	if (inst->helper.program) {
+		if (inst->program) {
+			cf_log_err(conf, "Only one of 'program' and 'helper.program' may be set");
+			return -1;
+		}
+
+		if (!inst->wait) {
+			cf_log_err(conf, "Cannot use a helper if wait = no");
+			return -1;
+		}
+
+		if (fr_time_delta_lt(inst->helper.timeout, fr_time_delta_from_sec(1))) {
+			cf_log_err(conf, "Helper timeout '%pVs' is too small (minimum: 1s)",
+				   fr_box_time_delta(inst->helper.timeout));
+			return -1;
+		}
+
+		FR_INTEGER_BOUND_CHECK("helper.max_response", inst->helper.max_response, >=, 64);
+		FR_INTEGER_BOUND_CHECK("helper.pool.request.per_connection_max",
+				       inst->helper.trunk_conf.max_req_per_conn, >=, 1);
+		return 0;
+	}
+
 	if (!inst->program) return 0;
 
 	slen = tmpl_afrom_substr(inst, &inst->tmpl,
@@ -406,6 +437,132 @@ static unlang_action_t mod_exec_wait_resume(rlm_rcode_t *p_result, module_ctx_t
 	RETURN_MODULE_RCODE(rcode);
 }
 
+/** Resume a request after a helper has responded
+ *
+ * The first line of the response is the status, interpreted in the
+ * same way as the exit code of a program.  Any remaining lines are
+ * attributes to add to the output list.
+ */
+static unlang_action_t mod_exec_helper_resume(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
+{
+	rlm_exec_t const       		*inst = talloc_get_type_abort_const(mctx->inst->data, rlm_exec_t);
+	fr_exec_helper_request_t	*hreq = talloc_get_type_abort(mctx->rctx, fr_exec_helper_request_t);
+	char				*p, *end, *nl;
+	unsigned long			status;
+	rlm_rcode_t			rcode;
+
+	if (!hreq->done) {
+		REDEBUG("No response from helper");
+		RETURN_MODULE_FAIL;
+	}
+
+	p = hreq->reply;
+	end = p + hreq->reply_len;
+
+	nl = memchr(p, '\n', end - p);
+	if (!nl) nl = end;
+
+	status = strtoul(p, &end, 10);
+	if ((end == p) || (end != nl) || (status > INT_MAX)) {
+		REDEBUG("Helper returned an invalid status line: %pV",
+			fr_box_strvalue_len(p, nl - p));
+		RETURN_MODULE_FAIL;
+	}
+	p = (nl < hreq->reply + hreq->reply_len) ? nl + 1 : nl;
+	end = hreq->reply + hreq->reply_len;
+
+	/*
+	 *	Also prints the rest of the response as an error if there was any...
+	 */
+	rcode = rlm_exec_status2rcode(request, (p < end) ? fr_box_strvalue_len(p, end - p) : NULL, (int)status);
+	switch (rcode) {
+	case RLM_MODULE_OK:
+	case RLM_MODULE_UPDATED:
+		if (inst->output && (p < end)) {
+			TALLOC_CTX	*ctx;
+			fr_pair_list_t	vps, *output_pairs;
+			fr_value_box_t	box;
+
+			fr_pair_list_init(&vps);
+			output_pairs = tmpl_list_head(request, inst->output_list);
+			if (!output_pairs) RETURN_MODULE_INVALID;
+
+			ctx = tmpl_list_ctx(request, inst->output_list);
+
+			fr_value_box_init(&box, FR_TYPE_STRING, NULL, true);
+			if (fr_value_box_bstrndup(hreq, &box, NULL, p, end - p, true) < 0) RETURN_MODULE_FAIL;
+
+			fr_pair_list_afrom_box(ctx, &vps, request->dict, &box);
+			if (!fr_pair_list_empty(&vps)) fr_pair_list_move_op(output_pairs, &vps, T_OP_ADD_EQ);
+
+			fr_value_box_clear(&box);
+		}
+		break;
+
+	default:
+		break;
+	}
+
+	RETURN_MODULE_RCODE(rcode);
+}
+
+/** Stop waiting on the helper if the request is cancelled
+ *
+ */
+static void mod_exec_helper_signal(module_ctx_t const *mctx, UNUSED request_t *request, fr_state_signal_t action)
+{
+	fr_exec_helper_request_t	*hreq = talloc_get_type_abort(mctx->rctx, fr_exec_helper_request_t);
+
+	if (action != FR_SIGNAL_CANCEL) return;
+
+	fr_exec_helper_cancel(hreq);
+}
+
+/** Pass the input pairs to a persistent helper
+ *
+ * The request is one line per attribute, in the same format as
+ * output_pairs.
+ */
+static unlang_action_t mod_exec_helper(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
+{
+	rlm_exec_t const       		*inst = talloc_get_type_abort_const(mctx->inst->data, rlm_exec_t);
+	rlm_exec_thread_t		*t = talloc_get_type_abort(mctx->thread, rlm_exec_thread_t);
+	fr_exec_helper_request_t	*hreq;
+	fr_pair_list_t			*input_pairs = NULL;
+	fr_sbuff_t			sbuff;
+	fr_sbuff_uctx_talloc_t		tctx;
+	int				ret;
+
+	if (inst->input) {
+		input_pairs = tmpl_list_head(request, inst->input_list);
+		if (!input_pairs) RETURN_MODULE_INVALID;
+	}
+
+	if (inst->output && !tmpl_list_head(request, inst->output_list)) RETURN_MODULE_INVALID;
+
+	MEM(fr_sbuff_init_talloc(unlang_interpret_frame_talloc_ctx(request), &sbuff, &tctx, 256, SIZE_MAX));
+
+	if (input_pairs) {
+		fr_pair_t *vp;
+
+		for (vp = fr_pair_list_head(input_pairs);
+		     vp;
+		     vp = fr_pair_list_next(input_pairs, vp)) {
+			if ((fr_pair_print(&sbuff, NULL, vp) < 0) || (fr_sbuff_in_char(&sbuff, '\n') < 0)) {
+				RPEDEBUG("Failed serialising input pairs");
+				talloc_free(fr_sbuff_buff(&sbuff));
+				RETURN_MODULE_FAIL;
+			}
+		}
+	}
+
+	ret = fr_exec_helper_enqueue(&hreq, t->helper, request, fr_sbuff_start(&sbuff), fr_sbuff_used(&sbuff));
+	talloc_free(fr_sbuff_buff(&sbuff));
+	if (ret < 0) RETURN_MODULE_FAIL;
+
+	return unlang_module_yield(request, mod_exec_helper_resume, mod_exec_helper_signal, hreq);
+}
+
 /*
  *  Dispatch an async exec method
  */
@@ -416,6 +573,8 @@ static unlang_action_t CC_HINT(nonnull) mod_exec_dispatch(rlm_rcode_t *p_result,
 	fr_pair_list_t		*env_pairs = NULL;
 	TALLOC_CTX		*ctx;
 
+	if (inst->helper.program) return mod_exec_helper(p_result, mctx, request);
+
 	if (!inst->tmpl) {
 		RDEBUG("This module requires 'program' to be set.");
 		RETURN_MODULE_FAIL;
@@ -460,6 +619,36 @@ static unlang_action_t CC_HINT(nonnull) mod_exec_dispatch(rlm_rcode_t *p_result,
 					   NULL, &m->box);
 }
 
+/** Start the helpers for this worker
+ *
+ */
+static int mod_thread_instantiate(module_thread_inst_ctx_t const *mctx)
+{
+	rlm_exec_t const	*inst = talloc_get_type_abort_const(mctx->inst->data, rlm_exec_t);
+	rlm_exec_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_exec_thread_t);
+
+	if (!inst->helper.program) return 0;
+
+	t->helper = fr_exec_helper_alloc(t, mctx->el, &inst->helper, mctx->inst->name);
+	if (!t->helper) {
+		ERROR("Unable to create helper pool");
+		return -1;
+	}
+
+	return 0;
+}
+
+/** Stop the helpers for this worker
+ *
+ */
+static int mod_thread_detach(module_thread_inst_ctx_t const *mctx)
+{
+	rlm_exec_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_exec_thread_t);
+
+	TALLOC_FREE(t->helper);
+
+	return 0;
+}
 
 /*
  *	The module name should be the only globally exported symbol.
@@ -479,6 +668,10 @@ module_t rlm_exec = {
 	.config		= module_config,
 	.bootstrap	= mod_bootstrap,
 	.instantiate	= mod_instantiate,
+	.thread_inst_size	= sizeof(rlm_exec_thread_t),
+	.thread_inst_type	= "rlm_exec_thread_t",
+	.thread_instantiate	= mod_thread_instantiate,
+	.thread_detach		= mod_thread_detach,
 	.methods = {
 		[MOD_AUTHENTICATE]	= mod_exec_dispatch,
 		[MOD_AUTHORIZE]		= mod_exec_dispatch,
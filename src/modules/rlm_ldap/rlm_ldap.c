@@ -184,6 +184,15 @@ static CONF_PARSER option_config[] = {
 
 	{ FR_CONF_OFFSET("idle_timeout", FR_TYPE_TIME_DELTA, rlm_ldap_t, handle_config.idle_timeout), .dflt = "300" },
 
+	/*
+	 *	Sharing search results between queries
+	 */
+	{ FR_CONF_OFFSET("search_dedup", FR_TYPE_BOOL, rlm_ldap_t, handle_config.search_dedup), .dflt = "no" },
+
+	{ FR_CONF_OFFSET("search_cache_ttl", FR_TYPE_TIME_DELTA, rlm_ldap_t, handle_config.search_cache_ttl), .dflt = "0" },
+
+	{ FR_CONF_OFFSET("search_cache_max", FR_TYPE_UINT32, rlm_ldap_t, handle_config.search_cache_max), .dflt = "1024" },
+
 	CONF_PARSER_TERMINATOR
 };
 
@@ -1746,6 +1755,33 @@ static int parse_sub_section(module_inst_ctx_t const *mctx,
 	return 0;
 }
 
+static int cmd_stats_search(FILE *fp, UNUSED FILE *fp_err, void *ctx, UNUSED fr_cmd_info_t const *info)
+{
+	fr_ldap_search_stats_t *stats = ctx;
+
+	fprintf(fp, "search.searches		%" PRIu64 "\n", (uint64_t)atomic_load(&stats->searches));
+	fprintf(fp, "search.sent		%" PRIu64 "\n", (uint64_t)atomic_load(&stats->sent));
+	fprintf(fp, "search.dedup		%" PRIu64 "\n", (uint64_t)atomic_load(&stats->dedup));
+	fprintf(fp, "search.hits		%" PRIu64 "\n", (uint64_t)atomic_load(&stats->hits));
+	fprintf(fp, "search.evicted		%" PRIu64 "\n", (uint64_t)atomic_load(&stats->evicted));
+	fprintf(fp, "search.in_flight	%" PRId64 "\n", (int64_t)atomic_load(&stats->in_flight));
+
+	return 0;
+}
+
+static fr_cmd_table_t cmd_table[] = {
+	{
+		.parent = "stats module",
+		.add_name = true,
+		.name = "search",
+		.func = cmd_stats_search,
+		.help = "Show statistics for searches sharing results.",
+		.read_only = true
+	},
+
+	CMD_TABLE_END
+};
+
 /** Initialise thread specific data structure
  *
  */
@@ -1763,6 +1799,7 @@ static int mod_thread_instatiate(module_thread_inst_ctx_t const *mctx)
 	t->config = &inst->handle_config;
 	t->trunk_conf = &inst->trunk_conf;
 	t->el = mctx->el;
+	t->search_stats = &inst->search_stats;
 
 	/*
 	 *	Launch trunk for module default connection
@@ -2334,6 +2371,13 @@ if (inst->handle_config.tls_min_version_str) {
 
 	fr_ldap_global_config(inst->ldap_debug, inst->tls_random_file);
 
+	if (inst->handle_config.search_dedup || fr_time_delta_ispos(inst->handle_config.search_cache_ttl)) {
+		if (fr_command_register_hook(NULL, mctx->inst->name, &inst->search_stats, cmd_table) < 0) {
+			cf_log_perr(conf, "Failed registering radmin commands");
+			goto error;
+		}
+	}
+
 	return 0;
 
 error:
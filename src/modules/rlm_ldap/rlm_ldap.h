@@ -137,6 +137,8 @@ typedef struct {
 	fr_ldap_config_t handle_config;			//!< Connection configuration instance.
 	fr_trunk_conf_t	trunk_conf;			//!< Trunk configuration
 
+	fr_ldap_search_stats_t	search_stats;		//!< Search result sharing statistics.
+
 	/*
 	 *	Global config
 	 */
@@ -115,9 +115,9 @@ char const *rlm_ldap_find_user(rlm_ldap_t const *inst, request_t *request, fr_ld
 		return NULL;
 	}
 
-	if (fr_ldap_trunk_search(rcode,
-				 unlang_interpret_frame_talloc_ctx(request), &query ,request, ttrunk, base_dn,
-				 inst->userobj_scope, filter, attrs, serverctrls, NULL, false) < 0) {
+	if (fr_ldap_trunk_search_cached(rcode,
+					unlang_interpret_frame_talloc_ctx(request), &query ,request, ttrunk, base_dn,
+					inst->userobj_scope, filter, attrs, serverctrls, NULL, false) < 0) {
 		*rcode = RLM_MODULE_FAIL;
 		return NULL;
 	}
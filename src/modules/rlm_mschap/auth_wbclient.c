@@ -25,15 +25,36 @@
 RCSID("$Id$")
 
 #include <freeradius-devel/server/base.h>
+#include <freeradius-devel/io/schedule.h>
+#include <freeradius-devel/unlang/interpret.h>
 #include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/stdatomic.h>
 
 #include <wbclient.h>
 #include <core/ntstatus.h>
 
+#include <pthread.h>
+#include <sys/socket.h>
+
 #include "rlm_mschap.h"
 #include "mschap.h"
 #include "auth_wbclient.h"
 
+#ifdef TESTING_MSCHAP_WBCLIENT
+/*
+ *	There's no interpreter, we just count how
+ *	many requests would have been resumed.
+ */
+static unsigned int	test_runnable;
+
+static void test_mark_runnable(UNUSED request_t *request)
+{
+	test_runnable++;
+}
+
+#define unlang_interpret_mark_runnable test_mark_runnable
+#endif
+
 /* Samba does not export this constant yet */
 #ifndef WBC_MSV1_0_ALLOW_MSVCHAPV2
 #define WBC_MSV1_0_ALLOW_MSVCHAPV2 0x00010000
@@ -41,6 +62,70 @@ RCSID("$Id$")
 
 #define NT_LENGTH 24
 
+/** A winbind authentication passed to a helper thread
+ *
+ * Jobs aren't parented by the request, so they remain valid if the
+ * request is cancelled whilst a helper thread is processing them.
+ * The helper thread only reads the input fields, and writes the output
+ * fields.  Everything else is touched only by the worker which owns
+ * the connection.
+ */
+struct mschap_wb_job_s {
+	fr_dlist_t		entry;				//!< Entry in the connection's list of jobs.
+	mschap_wb_auth_t	*auth;				//!< Authentication this job is for, or NULL
+								///< if the authentication was cancelled.
+
+	char			*account_name;			//!< Username to authenticate.
+	char			*domain_name;			//!< Domain to authenticate in.
+	uint8_t			challenge[MSCHAP_CHALLENGE_LENGTH];
+	uint8_t			response[NT_LENGTH];
+	bool			can_retry;			//!< Retry with the normalised username.
+	uint8_t			peer_challenge[MSCHAP_PEER_CHALLENGE_LENGTH];
+	uint8_t			auth_challenge[MSCHAP_PEER_AUTHENTICATOR_CHALLENGE_LENGTH];
+
+	wbcErr			err;				//!< Result of wbcCtxAuthenticateUserEx.
+	uint32_t		nt_status;			//!< NT_STATUS code, if authentication failed.
+	char			*display_string;		//!< Human readable version of nt_status.
+	uint8_t			nthashhash[NT_DIGEST_LENGTH];	//!< From the user session key.
+	char			*normalised_name;		//!< Username we retried with.
+
+	fr_time_t		queued;				//!< When the job was passed to the helper thread.
+	fr_time_t		started;			//!< When the helper thread picked the job up.
+	fr_time_t		finished;			//!< When libwbclient returned.
+};
+
+/** State shared by a worker and the helper thread it started
+ *
+ * libwbclient only offers blocking calls, so each trunk "connection"
+ * is a thread which makes those calls on behalf of a worker.  Jobs are
+ * pipelined to it over a sequenced packet socketpair, one pointer per
+ * packet, so they can't be partially written.
+ *
+ * The helper thread is detached, and exits when the worker closes its
+ * end of the socketpair.  It may still be inside libwbclient when that
+ * happens, so the worker and the helper thread each hold a reference,
+ * and whichever releases the last one frees the winbind context, and
+ * any jobs which were never returned.
+ */
+typedef struct {
+	int			fd;				//!< Helper thread's end of the socketpair.
+	struct wbcContext	*wb_ctx;			//!< Only used by the helper thread.
+	atomic_bool		stop;				//!< Worker has gone, don't start any more jobs.
+	atomic_uint_fast32_t	refs;				//!< Held by the worker and the helper thread.
+
+	fr_dlist_head_t		jobs;				//!< Jobs passed to the helper thread, and not
+								///< yet returned.  Only used by the worker,
+								///< until the last reference is released.
+} mschap_wb_helper_t;
+
+/** A worker's connection to a helper thread
+ *
+ */
+typedef struct {
+	int			fd;				//!< Worker's end of the socketpair.
+	mschap_wb_helper_t	*helper;			//!< Shared with the helper thread.
+} mschap_wb_conn_t;
+
 /** Use Winbind to normalise a username
  *
  * @param[in] ctx	The talloc context where the result is parented from
@@ -77,145 +162,647 @@ static char *wbclient_normalise_username(TALLOC_CTX *ctx, struct wbcContext *wb_
 	return res;
 }
 
-/** Check NTLM authentication direct to winbind via Samba's libwbclient library
+/** Authenticate a job against winbind, retrying with a normalised username if required
  *
- * @return
- *	- 0 success.
- *	- -1 auth failure.
- *	- -648 password expired.
+ * Runs in a helper thread.
  */
-int do_auth_wbclient(rlm_mschap_t const *inst, request_t *request,
-		     uint8_t const *challenge, uint8_t const *response,
-		     uint8_t nthashhash[NT_DIGEST_LENGTH])
+static void mschap_wb_job_exec(struct wbcContext *wb_ctx, mschap_wb_job_t *job)
 {
-	int				ret = -1;
-	struct wbcContext		*wb_ctx = NULL;
-	struct wbcAuthUserParams	*authparams;
-	wbcErr				err;
-	ssize_t				slen;
+	struct wbcAuthUserParams	authparams = {
+						.account_name = job->account_name,
+						.domain_name = job->domain_name,
+						.level = WBC_AUTH_USER_LEVEL_RESPONSE
+					};
 	struct wbcAuthUserInfo		*info = NULL;
 	struct wbcAuthErrorInfo		*error = NULL;
-	uint8_t				resp[NT_LENGTH];
 
+	job->started = fr_time();
+
+	authparams.password.response.nt_length = NT_LENGTH;
+	authparams.password.response.nt_data = job->response;
+	memcpy(authparams.password.response.challenge, job->challenge, sizeof(authparams.password.response.challenge));
+
+	authparams.parameter_control |= WBC_MSV1_0_ALLOW_MSVCHAPV2 |
+					WBC_MSV1_0_ALLOW_WORKSTATION_TRUST_ACCOUNT |
+					WBC_MSV1_0_ALLOW_SERVER_TRUST_ACCOUNT;
+
+	job->err = wbcCtxAuthenticateUserEx(wb_ctx, &authparams, &info, &error);
+	if ((job->err == WBC_ERR_AUTH_ERROR) && job->can_retry) {
+		char *normalised_username;
+
+		normalised_username = wbclient_normalise_username(job, wb_ctx, job->domain_name, job->account_name);
+		if (normalised_username && (strcmp(job->account_name, normalised_username) != 0)) {
+			job->normalised_name = normalised_username;
+			authparams.account_name = normalised_username;
+
+			/* Recalculate hash */
+			mschap_challenge_hash(authparams.password.response.challenge,
+					      job->peer_challenge, job->auth_challenge,
+					      normalised_username, strlen(normalised_username));
+
+			if (error) {
+				wbcFreeMemory(error);
+				error = NULL;
+			}
+			job->err = wbcCtxAuthenticateUserEx(wb_ctx, &authparams, &info, &error);
+		} else {
+			talloc_free(normalised_username);
+		}
+	}
+
+	switch (job->err) {
+	case WBC_ERR_SUCCESS:
+		/* Grab the nthashhash from the result */
+		memcpy(job->nthashhash, info->user_session_key, NT_DIGEST_LENGTH);
+		break;
+
+	case WBC_ERR_AUTH_ERROR:
+		if (error) job->nt_status = error->nt_status;
+		FALL_THROUGH;
+
+	default:
+		if (error && error->display_string) {
+			MEM(job->display_string = talloc_strdup(job, error->display_string));
+		}
+		break;
+	}
+
+	if (info) wbcFreeMemory(info);
+	if (error) wbcFreeMemory(error);
+
+	job->finished = fr_time();
+}
+
+/** Release a reference to the state shared with a helper thread
+ *
+ * Called by the worker and the helper thread, the last one to call it frees
+ * the shared state.
+ */
+static void mschap_wb_helper_release(mschap_wb_helper_t *helper)
+{
+	mschap_wb_job_t	*job;
+
+	if (atomic_fetch_sub_explicit(&helper->refs, 1, memory_order_acq_rel) > 1) return;
+
+	if (helper->fd >= 0) close(helper->fd);
+	if (helper->wb_ctx) wbcCtxFree(helper->wb_ctx);
+
+	while ((job = fr_dlist_pop_head(&helper->jobs))) talloc_free(job);
+
+	talloc_free(helper);
+}
+
+/** Helper thread
+ *
+ * Reads jobs from the socketpair, performs them, and writes them back.
+ * Exits when the worker closes its end of the socketpair.
+ */
+static void *mschap_wb_thread(void *arg)
+{
+	mschap_wb_helper_t	*helper = arg;
+	mschap_wb_job_t		*job;
+	ssize_t			len;
+
+	for (;;) {
+		len = read(helper->fd, &job, sizeof(job));
+		if (len < 0) {
+			if (errno == EINTR) continue;
+			break;
+		}
+		if ((len == 0) || atomic_load(&helper->stop)) break;
+		if ((len != sizeof(job)) || !job) continue;
+
+		mschap_wb_job_exec(helper->wb_ctx, job);
+
+		while (write(helper->fd, &job, sizeof(job)) < 0) {
+			if (errno == EINTR) continue;
+
+			/*
+			 *	The worker closed its end whilst we were
+			 *	processing the job.  It's still in the
+			 *	list of jobs, and is freed with the rest.
+			 */
+			goto done;
+		}
+	}
+
+done:
 	/*
-	 *	wb_username must be set for this function to be called
+	 *	Closing our end here, rather than when the last
+	 *	reference is released, lets the worker see we've
+	 *	gone if we exited for any other reason.
 	 */
-	fr_assert(inst->wb_username);
+	close(helper->fd);
+	helper->fd = -1;
+
+	mschap_wb_helper_release(helper);
+
+	return NULL;
+}
+
+/** Record how long something took in a latency histogram
+ *
+ */
+static inline CC_HINT(always_inline)
+void mschap_wb_latency_record(atomic_uint_fast64_t histogram[MSCHAP_WB_LATENCY_BUCKETS], fr_time_delta_t delta)
+{
+	int64_t		usec = fr_time_delta_to_usec(delta);
+	unsigned int	i;
+
+	for (i = 0; i < (MSCHAP_WB_LATENCY_BUCKETS - 1); i++) if (usec < ((int64_t)1 << i)) break;
+
+	atomic_fetch_add_explicit(&histogram[i], 1, memory_order_relaxed);
+}
+
+/** Tell the helper thread to exit, and release our reference to the state it shares
+ *
+ * The helper thread isn't joined.  It may be waiting on winbind, and
+ * the worker shouldn't wait with it.
+ */
+static int _mschap_wb_conn_free(mschap_wb_conn_t *c)
+{
+	mschap_wb_helper_t	*helper = c->helper;
+	mschap_wb_job_t		*job = NULL;
+
+	if (!helper) return 0;
 
-	MEM(authparams = talloc_zero_pooled_object(NULL, struct wbcAuthUserParams, 2, 1024));
 	/*
-	 *	Domain first so we don't leave holes in the pool
+	 *	The helper thread sees the stop flag, or EOF,
+	 *	on its next read, and fails any write it's
+	 *	blocked on.
 	 */
-	if (inst->wb_domain) {
-		slen = tmpl_aexpand(authparams, &authparams->domain_name, request, inst->wb_domain, NULL, NULL);
-		if (slen < 0) {
-			REDEBUG2("Unable to expand winbind_domain");
-			goto finish;
-		}
-	} else {
-		RWDEBUG2("No domain specified; authentication may fail because of this");
+	atomic_store(&helper->stop, true);
+	if (c->fd >= 0) close(c->fd);
+	c->fd = -1;
+
+	/*
+	 *	The authentications belong to requests,
+	 *	the jobs may still be being processed.
+	 */
+	while ((job = fr_dlist_next(&helper->jobs, job))) {
+		if (!job->auth) continue;
+
+		job->auth->job = NULL;
+		job->auth = NULL;
 	}
 
+	mschap_wb_helper_release(helper);
+
+	return 0;
+}
+
+/** Create a winbind context, and start a helper thread to use it
+ *
+ */
+static fr_connection_state_t _mschap_wb_conn_init(void **h_out, fr_connection_t *conn, UNUSED void *uctx)
+{
+	mschap_wb_conn_t	*c;
+	mschap_wb_helper_t	*helper;
+	pthread_t		thread;
+	int			sockets[2];
+
+	MEM(c = talloc_zero(conn, mschap_wb_conn_t));
+	c->fd = -1;
+	talloc_set_destructor(c, _mschap_wb_conn_free);
+
 	/*
-	 *	Get the username and domain from the configuration
+	 *	Not parented by the connection,
+	 *	as it may outlive it.
 	 */
-	slen = tmpl_aexpand(authparams, &authparams->account_name, request, inst->wb_username, NULL, NULL);
-	if (slen < 0) {
-		REDEBUG2("Unable to expand winbind_username");
-		goto finish;
+	MEM(c->helper = helper = talloc_zero(NULL, mschap_wb_helper_t));
+	helper->fd = -1;
+	atomic_init(&helper->refs, 1);
+	fr_dlist_init(&helper->jobs, mschap_wb_job_t, entry);
+
+	helper->wb_ctx = wbcCtxCreate();
+	if (!helper->wb_ctx) {
+		ERROR("Failed to create winbind context");
+	error:
+		talloc_free(c);
+		return FR_CONNECTION_STATE_FAILED;
 	}
 
 	/*
-	 * Build the wbcAuthUserParams structure with what we know
+	 *	Sequenced packets, rather than datagrams, so each
+	 *	side sees EOF, or EPIPE, when the other closes.
 	 */
-	authparams->level = WBC_AUTH_USER_LEVEL_RESPONSE;
-	authparams->password.response.nt_length = NT_LENGTH;
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sockets) < 0) {
+		ERROR("Failed creating winbind helper socketpair: %s", fr_syserror(errno));
+		goto error;
+	}
+	c->fd = sockets[0];
+	helper->fd = sockets[1];
 
-	memcpy(resp, response, NT_LENGTH);
-	authparams->password.response.nt_data = resp;
+#ifdef SO_NOSIGPIPE
+	{
+		int set = 1;
 
-	memcpy(authparams->password.response.challenge, challenge, sizeof(authparams->password.response.challenge));
+		setsockopt(c->fd, SOL_SOCKET, SO_NOSIGPIPE, (void *)&set, sizeof(int));
+		setsockopt(helper->fd, SOL_SOCKET, SO_NOSIGPIPE, (void *)&set, sizeof(int));
+	}
+#endif
 
-	authparams->parameter_control |= WBC_MSV1_0_ALLOW_MSVCHAPV2 |
-					WBC_MSV1_0_ALLOW_WORKSTATION_TRUST_ACCOUNT |
-					WBC_MSV1_0_ALLOW_SERVER_TRUST_ACCOUNT;
+	if (fr_nonblock(c->fd) < 0) {
+		PERROR("Failed setting winbind helper socket to non-blocking");
+		goto error;
+	}
+
+	atomic_fetch_add_explicit(&helper->refs, 1, memory_order_relaxed);
+	if (fr_schedule_pthread_create(&thread, mschap_wb_thread, helper) < 0) {
+		atomic_fetch_sub_explicit(&helper->refs, 1, memory_order_relaxed);
+		PERROR("Failed starting winbind helper thread");
+		goto error;
+	}
+	pthread_detach(thread);
+
+	*h_out = c;
 
 	/*
-	 * Send auth request across to winbind
+	 *	Nothing to wait for, the helper thread
+	 *	connects to winbind when it's first used.
 	 */
-	wb_ctx = fr_pool_connection_get(inst->wb_pool, request);
-	if (wb_ctx == NULL) {
-		RERROR("Unable to get winbind connection from pool");
-		goto finish;
-	}
+	fr_connection_signal_connected(conn);
 
-	RDEBUG2("Sending authentication request user \"%pV\" domain \"%pV\"",
-		fr_box_strvalue_buffer(authparams->account_name),
-		fr_box_strvalue_buffer(authparams->domain_name));
+	return FR_CONNECTION_STATE_CONNECTING;
+}
 
-	err = wbcCtxAuthenticateUserEx(wb_ctx, authparams, &info, &error);
-	if (err == WBC_ERR_AUTH_ERROR && inst->wb_retry_with_normalised_username) {
-		fr_pair_t 	*vp_response;
-		fr_pair_t	*vp_challenge;
-		fr_pair_t	*vp_chap_user_name;
-		char		*normalised_username = NULL;
+static void _mschap_wb_conn_close(fr_event_list_t *el, void *h, UNUSED void *uctx)
+{
+	mschap_wb_conn_t	*c = talloc_get_type_abort(h, mschap_wb_conn_t);
 
-		normalised_username = wbclient_normalise_username(authparams, wb_ctx, authparams->domain_name,
-								  authparams->account_name);
-		if (!normalised_username) goto release;
+	(void) fr_event_fd_delete(el, c->fd, FR_EVENT_FILTER_IO);
 
-		RDEBUG2("Starting retry, normalised username \"%pV\" -> \"%pV\"",
-			fr_box_strvalue_buffer(authparams->account_name),
-			fr_box_strvalue_buffer(normalised_username));
+	talloc_free(c);
+}
 
-		if (talloc_memcmp_bstr(authparams->account_name, normalised_username) == 0) goto release;
+static fr_connection_t *mschap_wb_trunk_connection_alloc(fr_trunk_connection_t *tconn, fr_event_list_t *el,
+							 fr_connection_conf_t const *conf,
+							 char const *log_prefix, void *uctx)
+{
+	return fr_connection_alloc(tconn, el,
+				   &(fr_connection_funcs_t){
+					.init = _mschap_wb_conn_init,
+					.close = _mschap_wb_conn_close
+				   },
+				   conf, log_prefix, uctx);
+}
 
-		talloc_const_free(authparams->account_name);
-		authparams->account_name = normalised_username;
+static void mschap_wb_conn_readable(UNUSED fr_event_list_t *el, UNUSED int fd, UNUSED int flags, void *uctx)
+{
+	fr_trunk_connection_t	*tconn = talloc_get_type_abort(uctx, fr_trunk_connection_t);
 
-		/* Set MS-CHAP-USER-NAME */
-		MEM(pair_update_request(&vp_chap_user_name, attr_ms_chap_user_name) >= 0);
-		fr_pair_value_bstrdup_buffer(vp_chap_user_name, normalised_username, true);
+	fr_trunk_connection_signal_readable(tconn);
+}
+
+static void mschap_wb_conn_writable(UNUSED fr_event_list_t *el, UNUSED int fd, UNUSED int flags, void *uctx)
+{
+	fr_trunk_connection_t	*tconn = talloc_get_type_abort(uctx, fr_trunk_connection_t);
+
+	fr_trunk_connection_signal_writable(tconn);
+}
+
+static void mschap_wb_conn_error(UNUSED fr_event_list_t *el, UNUSED int fd, UNUSED int flags, int fd_errno, void *uctx)
+{
+	fr_trunk_connection_t	*tconn = talloc_get_type_abort(uctx, fr_trunk_connection_t);
+
+	ERROR("Winbind helper socket failed: %s", fr_syserror(fd_errno));
+
+	fr_connection_signal_reconnect(tconn->conn, FR_CONNECTION_FAILED);
+}
+
+static void mschap_wb_trunk_connection_notify(fr_trunk_connection_t *tconn, fr_connection_t *conn,
+					      fr_event_list_t *el,
+					      fr_trunk_connection_event_t notify_on, UNUSED void *uctx)
+{
+	mschap_wb_conn_t	*c = talloc_get_type_abort(conn->h, mschap_wb_conn_t);
+	fr_event_fd_cb_t	read_fn = NULL;
+	fr_event_fd_cb_t	write_fn = NULL;
+
+	switch (notify_on) {
+	case FR_TRUNK_CONN_EVENT_NONE:
+		fr_event_fd_delete(el, c->fd, FR_EVENT_FILTER_IO);
+		return;
+
+	case FR_TRUNK_CONN_EVENT_READ:
+		read_fn = mschap_wb_conn_readable;
+		break;
+
+	case FR_TRUNK_CONN_EVENT_WRITE:
+		write_fn = mschap_wb_conn_writable;
+		break;
+
+	case FR_TRUNK_CONN_EVENT_BOTH:
+		read_fn = mschap_wb_conn_readable;
+		write_fn = mschap_wb_conn_writable;
+		break;
+	}
 
-		RDEBUG2("Retrying authentication request user \"%pV\" domain \"%pV\"",
-			fr_box_strvalue_buffer(authparams->account_name),
-			fr_box_strvalue_buffer(normalised_username));
+	if (fr_event_fd_insert(c, el, c->fd, read_fn, write_fn, mschap_wb_conn_error, tconn) < 0) {
+		PERROR("Failed inserting winbind helper socket event");
+		fr_trunk_connection_signal_reconnect(tconn, FR_CONNECTION_FAILED);
+	}
+}
 
-		/* Recalculate hash */
-		vp_challenge = fr_pair_find_by_da_idx(&request->request_pairs, attr_ms_chap_challenge, 0);
-		if (!vp_challenge) {
-			RERROR("Unable to get MS-CHAP-Challenge");
-			goto release;
+/** Pass pending authentications to the helper thread
+ *
+ */
+static void mschap_wb_trunk_request_mux(UNUSED fr_event_list_t *el, fr_trunk_connection_t *tconn,
+					fr_connection_t *conn, UNUSED void *uctx)
+{
+	mschap_wb_conn_t	*c = talloc_get_type_abort(conn->h, mschap_wb_conn_t);
+	fr_trunk_request_t	*treq;
+	mschap_wb_auth_t	*auth;
+	mschap_wb_job_t		*job;
+
+	while (fr_trunk_connection_pop_request(&treq, tconn) == 0) {
+		if (!treq) break;
+
+		auth = talloc_get_type_abort(treq->pub.preq, mschap_wb_auth_t);
+
+		MEM(job = talloc_zero(NULL, mschap_wb_job_t));
+		MEM(job->account_name = talloc_strdup(job, auth->account_name));
+		if (auth->domain_name) MEM(job->domain_name = talloc_strdup(job, auth->domain_name));
+		memcpy(job->challenge, auth->challenge, sizeof(job->challenge));
+		memcpy(job->response, auth->response, sizeof(job->response));
+		job->can_retry = auth->can_retry;
+		memcpy(job->peer_challenge, auth->peer_challenge, sizeof(job->peer_challenge));
+		memcpy(job->auth_challenge, auth->auth_challenge, sizeof(job->auth_challenge));
+		job->auth = auth;
+		job->queued = fr_time();
+		fr_dlist_insert_tail(&c->helper->jobs, job);
+
+		if (write(c->fd, &job, sizeof(job)) < 0) {
+			fr_dlist_remove(&c->helper->jobs, job);
+			talloc_free(job);
+
+			/*
+			 *	Helper thread is busy, and its queue
+			 *	is full.  Try again when it drains.
+			 */
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR)) return;
+
+			ERROR("Failed passing authentication to winbind helper thread: %s", fr_syserror(errno));
+			fr_connection_signal_reconnect(conn, FR_CONNECTION_FAILED);
+			return;
 		}
 
-		vp_response = fr_pair_find_by_da_idx(&request->request_pairs, attr_ms_chap2_response, 0);
-		if (!vp_response) {
-			RERROR("Unable to get MS-CHAP2-Response");
-			goto release;
+		auth->job = job;
+		fr_trunk_request_signal_sent(treq);
+	}
+}
+
+/** Read authentications the helper thread has completed
+ *
+ */
+static void mschap_wb_trunk_request_demux(UNUSED fr_event_list_t *el, UNUSED fr_trunk_connection_t *tconn,
+					  fr_connection_t *conn, void *uctx)
+{
+	mschap_wb_conn_t	*c = talloc_get_type_abort(conn->h, mschap_wb_conn_t);
+	rlm_mschap_thread_t	*t = talloc_get_type_abort(uctx, rlm_mschap_thread_t);
+	mschap_wb_stats_t	*stats = t->inst->wb_stats;
+	mschap_wb_auth_t	*auth;
+	mschap_wb_job_t		*job;
+	ssize_t			len;
+
+	for (;;) {
+		len = read(c->fd, &job, sizeof(job));
+		if (len < 0) {
+			if (errno == EINTR) continue;
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) return;
+
+			ERROR("Failed reading results from winbind helper thread: %s", fr_syserror(errno));
+			fr_connection_signal_reconnect(conn, FR_CONNECTION_FAILED);
+			return;
+		}
+		if (len == 0) {
+			ERROR("Winbind helper thread exited");
+			fr_connection_signal_reconnect(conn, FR_CONNECTION_FAILED);
+			return;
 		}
+		if (len != sizeof(job)) continue;
 
-		mschap_challenge_hash(authparams->password.response.challenge,
-				      vp_response->vp_octets + 2,
-				      vp_challenge->vp_octets,
-				      vp_chap_user_name->vp_strvalue, vp_chap_user_name->vp_length);
+		fr_dlist_remove(&c->helper->jobs, job);
 
-		err = wbcCtxAuthenticateUserEx(wb_ctx, authparams, &info, &error);
-release:
-		talloc_free(normalised_username);
+		mschap_wb_latency_record(stats->queue_wait, fr_time_sub(job->started, job->queued));
+		mschap_wb_latency_record(stats->latency, fr_time_sub(job->finished, job->started));
+		if (job->normalised_name) atomic_fetch_add_explicit(&stats->retried, 1, memory_order_relaxed);
+
+		/*
+		 *	The request was cancelled whilst the
+		 *	helper thread was processing the job.
+		 */
+		auth = job->auth;
+		if (!auth) {
+			talloc_free(job);
+			continue;
+		}
+
+		auth->job = NULL;
+		auth->done = true;
+		auth->err = job->err;
+		auth->nt_status = job->nt_status;
+		memcpy(auth->nthashhash, job->nthashhash, sizeof(auth->nthashhash));
+		if (job->display_string) MEM(auth->display_string = talloc_strdup(auth, job->display_string));
+		if (job->normalised_name) MEM(auth->normalised_name = talloc_strdup(auth, job->normalised_name));
+		talloc_free(job);
+
+		unlang_interpret_mark_runnable(auth->request);
+		fr_trunk_request_signal_complete(auth->treq);
 	}
+}
+
+/** Detach a job from an authentication which is leaving the connection
+ *
+ * The helper thread may still be processing it, so it's freed when
+ * it's returned, or with the state shared with the helper thread.
+ */
+static void mschap_wb_trunk_request_conn_release(UNUSED fr_connection_t *conn, void *preq_to_reset,
+						 UNUSED void *uctx)
+{
+	mschap_wb_auth_t	*auth = talloc_get_type_abort(preq_to_reset, mschap_wb_auth_t);
 
-	fr_pool_connection_release(inst->wb_pool, request, wb_ctx);
+	if (!auth->job) return;
+
+	auth->job->auth = NULL;
+	auth->job = NULL;
+}
+
+static void mschap_wb_trunk_request_fail(request_t *request, void *preq, UNUSED void *rctx,
+					 UNUSED fr_trunk_request_state_t state, void *uctx)
+{
+	mschap_wb_auth_t	*auth = talloc_get_type_abort(preq, mschap_wb_auth_t);
+	rlm_mschap_thread_t	*t = talloc_get_type_abort(uctx, rlm_mschap_thread_t);
+
+	atomic_fetch_add_explicit(&t->inst->wb_stats->failed, 1, memory_order_relaxed);
+
+	auth->done = false;
+	unlang_interpret_mark_runnable(request);
+}
+
+static void mschap_wb_trunk_request_free(UNUSED request_t *request, void *preq_to_free, void *uctx)
+{
+	mschap_wb_auth_t	*auth = talloc_get_type_abort(preq_to_free, mschap_wb_auth_t);
+	rlm_mschap_thread_t	*t = talloc_get_type_abort(uctx, rlm_mschap_thread_t);
+
+	atomic_fetch_sub_explicit(&t->inst->wb_stats->in_flight, 1, memory_order_relaxed);
+
+	/*
+	 *	The authentication belongs to the request,
+	 *	it's freed with the frame.
+	 */
+	auth->treq = NULL;
+}
+
+/** Allocate a trunk of winbind helper threads for a worker
+ *
+ */
+fr_trunk_t *mschap_wb_trunk_alloc(rlm_mschap_thread_t *t)
+{
+	return fr_trunk_alloc(t, t->el,
+			      &(fr_trunk_io_funcs_t){
+				      .connection_alloc = mschap_wb_trunk_connection_alloc,
+				      .connection_notify = mschap_wb_trunk_connection_notify,
+				      .request_mux = mschap_wb_trunk_request_mux,
+				      .request_demux = mschap_wb_trunk_request_demux,
+				      .request_conn_release = mschap_wb_trunk_request_conn_release,
+				      .request_fail = mschap_wb_trunk_request_fail,
+				      .request_free = mschap_wb_trunk_request_free
+			      },
+			      &t->inst->wb_trunk_conf, "rlm_mschap (winbind)", t, false);
+}
+
+/** Queue an MS-CHAP authentication for a winbind helper thread
+ *
+ * The caller should yield, and call #mschap_wb_auth_result when resumed.
+ *
+ * @param[out] out		Where to write the authentication.
+ * @param[in] t			Thread instance, holding the trunk.
+ * @param[in] request		The current request.
+ * @param[in] challenge		MS-CHAPv1 challenge.
+ * @param[in] response		NT-Response.
+ * @param[in] peer_challenge	MS-CHAPv2 peer challenge, used if we retry with a
+ *				normalised username.  May be NULL.
+ * @param[in] auth_challenge	MS-CHAPv2 authenticator challenge.  May be NULL.
+ * @return
+ *	- 0 if the authentication was queued.
+ *	- -1 on failure.
+ */
+int mschap_wb_auth_enqueue(mschap_wb_auth_t **out, rlm_mschap_thread_t *t, request_t *request,
+			   uint8_t const challenge[static MSCHAP_CHALLENGE_LENGTH],
+			   uint8_t const response[static NT_LENGTH],
+			   uint8_t const *peer_challenge, uint8_t const *auth_challenge)
+{
+	rlm_mschap_t const	*inst = t->inst;
+	mschap_wb_auth_t	*auth;
+	ssize_t			slen;
+
+	/*
+	 *	wb_username must be set for this function to be called
+	 */
+	fr_assert(inst->wb_username);
+
+	MEM(auth = talloc_zero(unlang_interpret_frame_talloc_ctx(request), mschap_wb_auth_t));
+	auth->request = request;
+
+	if (inst->wb_domain) {
+		slen = tmpl_aexpand(auth, &auth->domain_name, request, inst->wb_domain, NULL, NULL);
+		if (slen < 0) {
+			REDEBUG2("Unable to expand winbind_domain");
+		error:
+			talloc_free(auth);
+			return -1;
+		}
+	} else {
+		RWDEBUG2("No domain specified; authentication may fail because of this");
+	}
+
+	/*
+	 *	Get the username from the configuration
+	 */
+	slen = tmpl_aexpand(auth, &auth->account_name, request, inst->wb_username, NULL, NULL);
+	if (slen < 0) {
+		REDEBUG2("Unable to expand winbind_username");
+		goto error;
+	}
+
+	memcpy(auth->challenge, challenge, sizeof(auth->challenge));
+	memcpy(auth->response, response, sizeof(auth->response));
+
+	if (inst->wb_retry_with_normalised_username && peer_challenge && auth_challenge) {
+		auth->can_retry = true;
+		memcpy(auth->peer_challenge, peer_challenge, sizeof(auth->peer_challenge));
+		memcpy(auth->auth_challenge, auth_challenge, sizeof(auth->auth_challenge));
+	}
+
+	RDEBUG2("Sending authentication request user \"%pV\" domain \"%pV\"",
+		fr_box_strvalue_buffer(auth->account_name),
+		fr_box_strvalue_buffer(auth->domain_name));
+
+	switch (fr_trunk_request_enqueue(&auth->treq, t->wb_trunk, request, auth, NULL)) {
+	case FR_TRUNK_ENQUEUE_OK:
+	case FR_TRUNK_ENQUEUE_IN_BACKLOG:
+		break;
+
+	default:
+		RERROR("Unable to queue authentication for winbind");
+		atomic_fetch_add_explicit(&inst->wb_stats->failed, 1, memory_order_relaxed);
+		goto error;
+	}
+
+	atomic_fetch_add_explicit(&inst->wb_stats->requests, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&inst->wb_stats->in_flight, 1, memory_order_relaxed);
+
+	*out = auth;
+
+	return 0;
+}
+
+/** Stop waiting for an authentication
+ *
+ */
+void mschap_wb_auth_cancel(mschap_wb_auth_t *auth)
+{
+	if (auth->treq) fr_trunk_request_signal_cancel(auth->treq);
+}
+
+/** Convert the result of a winbind authentication into an MS-CHAP result
+ *
+ * @return
+ *	- 0 success.
+ *	- -1 auth failure.
+ *	- -648 password expired.
+ */
+int mschap_wb_auth_result(request_t *request, mschap_wb_auth_t *auth, uint8_t nthashhash[static NT_DIGEST_LENGTH])
+{
+	int ret = -1;
+
+	if (!auth->done) {
+		RERROR("Failed getting a response from winbind");
+		return -1;
+	}
+
+	if (auth->normalised_name) {
+		fr_pair_t *vp_chap_user_name;
+
+		RDEBUG2("Retried authentication request, normalised username \"%pV\" -> \"%pV\"",
+			fr_box_strvalue_buffer(auth->account_name),
+			fr_box_strvalue_buffer(auth->normalised_name));
+
+		/* Set MS-CHAP-USER-NAME */
+		MEM(pair_update_request(&vp_chap_user_name, attr_ms_chap_user_name) >= 0);
+		fr_pair_value_bstrdup_buffer(vp_chap_user_name, auth->normalised_name, true);
+	}
 
 	/*
 	 * Try and give some useful feedback on what happened. There are only
 	 * a few errors that can actually be returned from wbcCtxAuthenticateUserEx.
 	 */
-	switch (err) {
+	switch (auth->err) {
 	case WBC_ERR_SUCCESS:
 		ret = 0;
 		RDEBUG2("Authenticated successfully");
 		/* Grab the nthashhash from the result */
-		memcpy(nthashhash, info->user_session_key, NT_DIGEST_LENGTH);
+		memcpy(nthashhash, auth->nthashhash, NT_DIGEST_LENGTH);
 		break;
 
 	case WBC_ERR_WINBIND_NOT_AVAILABLE:
@@ -229,7 +816,7 @@ release:
 		break;
 
 	case WBC_ERR_AUTH_ERROR:
-		if (!error) {
+		if (!auth->nt_status) {
 			REDEBUG2("Authentication failed");
 			break;
 		}
@@ -237,18 +824,18 @@ release:
 		/*
 		 * The password needs to be changed, so set ret appropriately.
 		 */
-		if (error->nt_status == NT_STATUS_PASSWORD_EXPIRED ||
-		    error->nt_status == NT_STATUS_PASSWORD_MUST_CHANGE) {
+		if (auth->nt_status == NT_STATUS_PASSWORD_EXPIRED ||
+		    auth->nt_status == NT_STATUS_PASSWORD_MUST_CHANGE) {
 			ret = -648;
 		}
 
 		/*
 		 * Return the NT_STATUS human readable error string, if there is one.
 		 */
-		if (error->display_string) {
-			REDEBUG2("%s [0x%X]", error->display_string, error->nt_status);
+		if (auth->display_string) {
+			REDEBUG2("%s [0x%X]", auth->display_string, auth->nt_status);
 		} else {
-			REDEBUG2("Authentication failed [0x%X]", error->nt_status);
+			REDEBUG2("Authentication failed [0x%X]", auth->nt_status);
 		}
 		break;
 
@@ -259,19 +846,13 @@ release:
 		 *   WBC_ERR_NO_MEMORY
 		 * neither of which are particularly likely.
 		 */
-		if (error && error->display_string) {
-			REDEBUG2("libwbclient error: wbcErr %d (%s)", err, error->display_string);
+		if (auth->display_string) {
+			REDEBUG2("libwbclient error: wbcErr %d (%s)", auth->err, auth->display_string);
 		} else {
-			REDEBUG2("libwbclient error: wbcErr %d", err);
+			REDEBUG2("libwbclient error: wbcErr %d", auth->err);
 		}
 		break;
 	}
 
-finish:
-	talloc_free(authparams);
-	if (info) wbcFreeMemory(info);
-	if (error) wbcFreeMemory(error);
-
 	return ret;
 }
-
@@ -2,6 +2,48 @@
 /* @copyright 2015 The FreeRADIUS server project */
 RCSIDH(auth_wbclient_h, "$Id$")
 
-int do_auth_wbclient(rlm_mschap_t const *inst, request_t *request,
-		     uint8_t const *challenge, uint8_t const *response,
-		     uint8_t nthashhash[NT_DIGEST_LENGTH]);
+#include <freeradius-devel/server/trunk.h>
+
+typedef struct mschap_wb_job_s mschap_wb_job_t;
+
+/** An MS-CHAP authentication being performed by winbind on behalf of a request
+ *
+ * Used as the trunk's preq.  It's allocated in the request's frame
+ * context, and outlives the trunk request, so the result can be
+ * examined when the request is resumed.
+ */
+typedef struct {
+	request_t		*request;			//!< Request waiting on the result.
+	fr_trunk_request_t	*treq;				//!< Trunk request, NULL once complete or failed.
+	mschap_wb_job_t		*job;				//!< Job being processed by a helper thread.
+
+	char			*account_name;			//!< Expansion of winbind.username.
+	char			*domain_name;			//!< Expansion of winbind.domain.
+	uint8_t			challenge[MSCHAP_CHALLENGE_LENGTH];	//!< MS-CHAPv1 challenge.
+	uint8_t			response[24];			//!< NT-Response.
+
+	bool			can_retry;			//!< Retry with the normalised username.
+	uint8_t			peer_challenge[MSCHAP_PEER_CHALLENGE_LENGTH];	//!< For recalculating the
+									///< challenge on retry.
+	uint8_t			auth_challenge[MSCHAP_PEER_AUTHENTICATOR_CHALLENGE_LENGTH];
+
+	bool			done;				//!< A helper thread returned a result.
+	wbcErr			err;				//!< Result of wbcCtxAuthenticateUserEx.
+	uint32_t		nt_status;			//!< NT_STATUS code, if authentication failed.
+	char			*display_string;		//!< Human readable version of nt_status.
+	uint8_t			nthashhash[NT_DIGEST_LENGTH];	//!< From the user session key.
+	char			*normalised_name;		//!< What winbind normalised the account name to,
+								///< if we retried.
+} mschap_wb_auth_t;
+
+fr_trunk_t	*mschap_wb_trunk_alloc(rlm_mschap_thread_t *t);
+
+int		mschap_wb_auth_enqueue(mschap_wb_auth_t **out, rlm_mschap_thread_t *t, request_t *request,
+				       uint8_t const challenge[static MSCHAP_CHALLENGE_LENGTH],
+				       uint8_t const response[static 24],
+				       uint8_t const *peer_challenge, uint8_t const *auth_challenge);
+
+void		mschap_wb_auth_cancel(mschap_wb_auth_t *auth);
+
+int		mschap_wb_auth_result(request_t *request, mschap_wb_auth_t *auth,
+				      uint8_t nthashhash[static NT_DIGEST_LENGTH]);
@@ -0,0 +1,439 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or (at
+ *   your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/** Tests for passing winbind authentications to helper threads through a trunk
+ *
+ * libwbclient is replaced with stubs, so no winbind server is needed.
+ *
+ * @file src/modules/rlm_mschap/auth_wbclient_tests.c
+ *
+ * @copyright 2022 The FreeRADIUS server project
+ */
+#define USE_CONSTRUCTOR
+
+/*
+ * It should be declared before include the "acutest.h"
+ */
+#ifdef USE_CONSTRUCTOR
+static void test_init(void) __attribute__((constructor));
+#else
+static void test_init(void);
+#  define TEST_INIT  test_init()
+#endif
+
+#include <freeradius-devel/util/acutest.h>
+#include <freeradius-devel/util/acutest_helpers.h>
+
+#include <signal.h>
+
+#include "auth_wbclient.c"
+
+/*
+ *	Normally defined by rlm_mschap.c
+ */
+fr_dict_attr_t const *attr_ms_chap_user_name;
+
+static int			test_block[2] = { -1, -1 };	//!< Authentications for "slow" wait
+								///< for a byte to be written to this.
+static atomic_uint_fast32_t	test_ctx_created;		//!< Winbind contexts created.
+static atomic_uint_fast32_t	test_ctx_freed;			//!< Winbind contexts freed, by whichever
+								///< of the worker and helper thread was last.
+
+/** Global initialisation
+ */
+static void test_init(void)
+{
+	/*
+	 *	Mismatch between the binary and the libraries it depends on
+	 */
+	if (fr_check_lib_magic(RADIUSD_MAGIC_NUMBER) < 0) {
+	error:
+		fr_perror("rlm_mschap_wbclient_tests");
+		fr_exit_now(EXIT_FAILURE);
+	}
+
+	if (fr_time_start() < 0) goto error;
+
+	if (pipe(test_block) < 0) {
+		fr_strerror_printf("Failed creating pipe: %s", fr_syserror(errno));
+		goto error;
+	}
+
+	/*
+	 *	As the server does, so writes to a helper
+	 *	thread which has exited fail with EPIPE.
+	 */
+	signal(SIGPIPE, SIG_IGN);
+}
+
+/*
+ *	libwbclient stubs
+ */
+struct wbcContext *wbcCtxCreate(void)
+{
+	static char	ctx;
+
+	atomic_fetch_add(&test_ctx_created, 1);
+
+	return (struct wbcContext *)&ctx;
+}
+
+void wbcCtxFree(UNUSED struct wbcContext *ctx)
+{
+	atomic_fetch_add(&test_ctx_freed, 1);
+}
+
+void wbcFreeMemory(void *p)
+{
+	free(p);
+}
+
+/** Authenticate a user
+ *
+ * - "slow" blocks until #test_unblock is called, then succeeds.
+ * - "expired" fails, because the password has expired.
+ * - "BOB" fails, only the normalised name "bob" exists.
+ * - Anyone else succeeds, with a session key filled with the first letter of their name.
+ */
+wbcErr wbcCtxAuthenticateUserEx(UNUSED struct wbcContext *ctx, const struct wbcAuthUserParams *params,
+				struct wbcAuthUserInfo **info, struct wbcAuthErrorInfo **error)
+{
+	char const	*name = params->account_name;
+	char		c;
+
+	if ((strcmp(name, "slow") == 0) && (read(test_block[0], &c, 1) != 1)) return WBC_ERR_UNKNOWN_FAILURE;
+
+	if (strcmp(name, "expired") == 0) {
+		MEM(*error = calloc(1, sizeof(**error)));
+		(*error)->nt_status = NT_STATUS_PASSWORD_EXPIRED;
+		(*error)->display_string = UNCONST(char *, "Password expired");
+		return WBC_ERR_AUTH_ERROR;
+	}
+
+	if (strcmp(name, "BOB") == 0) {
+		MEM(*error = calloc(1, sizeof(**error)));
+		return WBC_ERR_AUTH_ERROR;
+	}
+
+	MEM(*info = calloc(1, sizeof(**info)));
+	memset((*info)->user_session_key, name[0], sizeof((*info)->user_session_key));
+
+	return WBC_ERR_SUCCESS;
+}
+
+wbcErr wbcCtxLookupName(UNUSED struct wbcContext *ctx, UNUSED const char *dom_name, const char *name,
+			struct wbcDomainSid *sid, enum wbcSidType *name_type)
+{
+	if (strcasecmp(name, "bob") != 0) return WBC_ERR_UNKNOWN_USER;
+
+	memset(sid, 0, sizeof(*sid));
+	*name_type = WBC_SID_NAME_USER;
+
+	return WBC_ERR_SUCCESS;
+}
+
+wbcErr wbcCtxLookupSid(UNUSED struct wbcContext *ctx, UNUSED const struct wbcDomainSid *sid,
+		       char **domain, char **name, enum wbcSidType *name_type)
+{
+	MEM(*domain = strdup("EXAMPLE"));
+	MEM(*name = strdup("bob"));
+	*name_type = WBC_SID_NAME_USER;
+
+	return WBC_ERR_SUCCESS;
+}
+
+/** Let blocked "slow" authentications continue
+ *
+ */
+static void test_unblock(unsigned int count)
+{
+	unsigned int i;
+
+	for (i = 0; i < count; i++) TEST_CHECK(write(test_block[1], "x", 1) == 1);
+}
+
+/** Wait for helper threads to exit, and free their winbind contexts
+ *
+ */
+static bool test_ctx_wait_freed(uint32_t count)
+{
+	unsigned int i;
+
+	for (i = 0; (i < 100) && (atomic_load(&test_ctx_freed) < count); i++) {
+		struct timespec ts = { .tv_nsec = 10 * 1000 * 1000 };
+
+		nanosleep(&ts, NULL);
+	}
+
+	return atomic_load(&test_ctx_freed) >= count;
+}
+
+/** Allocate a thread instance with a trunk of one helper thread
+ *
+ */
+static rlm_mschap_thread_t *test_thread_alloc(TALLOC_CTX *ctx, uint32_t per_connection_max)
+{
+	rlm_mschap_t		*inst;
+	rlm_mschap_thread_t	*t;
+	fr_connection_conf_t	*conn_conf;
+
+	MEM(inst = talloc_zero(ctx, rlm_mschap_t));
+	MEM(inst->wb_stats = talloc_zero(inst, mschap_wb_stats_t));
+	inst->wb_retry_with_normalised_username = true;
+
+	MEM(conn_conf = talloc_zero(inst, fr_connection_conf_t));
+	conn_conf->connection_timeout = fr_time_delta_from_sec(1);
+	conn_conf->reconnection_delay = fr_time_delta_from_sec(1);
+
+	inst->wb_trunk_conf = (fr_trunk_conf_t){
+		.conn_conf = conn_conf,
+		.start = 1,
+		.min = 1,
+		.max = 1,
+		.max_req_per_conn = per_connection_max,
+		.manage_interval = fr_time_delta_from_msec(100)
+	};
+
+	MEM(t = talloc_zero(ctx, rlm_mschap_thread_t));
+	t->inst = inst;
+	MEM(t->el = fr_event_list_alloc(t, NULL, NULL));
+	MEM(t->wb_trunk = mschap_wb_trunk_alloc(t));
+
+	test_runnable = 0;
+
+	return t;
+}
+
+/** Queue an authentication, as #mschap_wb_auth_enqueue does, but without a request
+ *
+ */
+static fr_trunk_enqueue_t test_auth_enqueue(mschap_wb_auth_t **out, rlm_mschap_thread_t *t, char const *name)
+{
+	mschap_wb_auth_t	*auth;
+	fr_trunk_enqueue_t	rcode;
+
+	MEM(auth = talloc_zero(t, mschap_wb_auth_t));
+	MEM(auth->account_name = talloc_strdup(auth, name));
+	auth->can_retry = true;
+
+	rcode = fr_trunk_request_enqueue(&auth->treq, t->wb_trunk, NULL, auth, NULL);
+	switch (rcode) {
+	case FR_TRUNK_ENQUEUE_OK:
+	case FR_TRUNK_ENQUEUE_IN_BACKLOG:
+		atomic_fetch_add(&t->inst->wb_stats->requests, 1);
+		atomic_fetch_add(&t->inst->wb_stats->in_flight, 1);
+		*out = auth;
+		break;
+
+	default:
+		talloc_free(auth);
+		*out = NULL;
+		break;
+	}
+
+	return rcode;
+}
+
+static bool test_sent(rlm_mschap_thread_t *t, unsigned int count)
+{
+	return fr_trunk_request_count_by_state(t->wb_trunk, FR_TRUNK_CONN_ALL, FR_TRUNK_REQUEST_STATE_SENT) >= count;
+}
+
+static bool test_resumed(UNUSED rlm_mschap_thread_t *t, unsigned int count)
+{
+	return test_runnable >= count;
+}
+
+static uint64_t test_histogram_total(atomic_uint_fast64_t histogram[MSCHAP_WB_LATENCY_BUCKETS])
+{
+	uint64_t	total = 0;
+	unsigned int	i;
+
+	for (i = 0; i < MSCHAP_WB_LATENCY_BUCKETS; i++) total += atomic_load(&histogram[i]);
+
+	return total;
+}
+
+static bool test_returned(rlm_mschap_thread_t *t, unsigned int count)
+{
+	return test_histogram_total(t->inst->wb_stats->latency) >= count;
+}
+
+/** Run the event loop until a condition is met, or we give up
+ *
+ */
+static bool test_service(rlm_mschap_thread_t *t, bool (*done)(rlm_mschap_thread_t *t, unsigned int count),
+			 unsigned int count)
+{
+	unsigned int i;
+
+	for (i = 0; (i < 50) && !done(t, count); i++) {
+		fr_event_corral(t->el, fr_time(), true);
+		fr_event_service(t->el);
+	}
+
+	return done(t, count);
+}
+
+static void test_pipelined(void)
+{
+	TALLOC_CTX		*ctx = talloc_init_const("test");
+	rlm_mschap_thread_t	*t = test_thread_alloc(ctx, 0);
+	mschap_wb_stats_t	*stats = t->inst->wb_stats;
+	char const		*names[] = { "slow", "alice", "carol" };
+	mschap_wb_auth_t	*auth[NUM_ELEMENTS(names)];
+	size_t			i;
+
+	for (i = 0; i < NUM_ELEMENTS(names); i++) TEST_CHECK(test_auth_enqueue(&auth[i], t, names[i]) >= 0);
+
+	TEST_CASE("Authentications are passed to a busy helper thread");
+	TEST_CHECK(test_service(t, test_sent, NUM_ELEMENTS(names)));
+	TEST_CHECK(fr_trunk_connection_count_by_state(t->wb_trunk, FR_TRUNK_CONN_ALL) == 1);
+	TEST_CHECK(test_runnable == 0);
+
+	TEST_CASE("Each request is resumed with its own result");
+	test_unblock(1);
+	TEST_CHECK(test_service(t, test_resumed, NUM_ELEMENTS(names)));
+	for (i = 0; i < NUM_ELEMENTS(names); i++) {
+		TEST_CHECK(auth[i]->done);
+		TEST_CHECK(auth[i]->err == WBC_ERR_SUCCESS);
+		TEST_CHECK(auth[i]->nthashhash[0] == (uint8_t)names[i][0]);
+		TEST_MSG("Expected session key for \"%s\"", names[i]);
+		TEST_CHECK(auth[i]->treq == NULL);
+	}
+
+	TEST_CASE("Queue wait and latency are recorded");
+	TEST_CHECK(test_histogram_total(stats->queue_wait) == NUM_ELEMENTS(names));
+	TEST_CHECK(test_histogram_total(stats->latency) == NUM_ELEMENTS(names));
+	TEST_CHECK(atomic_load(&stats->in_flight) == 0);
+
+	talloc_free(ctx);
+}
+
+static void test_results(void)
+{
+	TALLOC_CTX		*ctx = talloc_init_const("test");
+	rlm_mschap_thread_t	*t = test_thread_alloc(ctx, 0);
+	mschap_wb_stats_t	*stats = t->inst->wb_stats;
+	mschap_wb_auth_t	*expired, *bob;
+
+	TEST_CHECK(test_auth_enqueue(&expired, t, "expired") >= 0);
+	TEST_CHECK(test_auth_enqueue(&bob, t, "BOB") >= 0);
+	TEST_CHECK(test_service(t, test_resumed, 2));
+
+	TEST_CASE("Failures carry the NT_STATUS code and message");
+	TEST_CHECK(expired->done);
+	TEST_CHECK(expired->err == WBC_ERR_AUTH_ERROR);
+	TEST_CHECK(expired->nt_status == NT_STATUS_PASSWORD_EXPIRED);
+	TEST_CHECK(expired->display_string && (strcmp(expired->display_string, "Password expired") == 0));
+
+	TEST_CASE("Failed authentications are retried with the normalised username");
+	TEST_CHECK(bob->done);
+	TEST_CHECK(bob->err == WBC_ERR_SUCCESS);
+	TEST_CHECK(bob->normalised_name && (strcmp(bob->normalised_name, "bob") == 0));
+	TEST_CHECK(bob->nthashhash[0] == 'b');
+	TEST_CHECK(atomic_load(&stats->retried) == 1);
+
+	talloc_free(ctx);
+}
+
+static void test_per_connection_max(void)
+{
+	TALLOC_CTX		*ctx = talloc_init_const("test");
+	rlm_mschap_thread_t	*t = test_thread_alloc(ctx, 2);
+	mschap_wb_auth_t	*a, *b, *c;
+
+	TEST_CASE("Authentications beyond the in-flight limit are refused");
+	TEST_CHECK(test_auth_enqueue(&a, t, "slow") >= 0);
+	TEST_CHECK(test_auth_enqueue(&b, t, "slow") >= 0);
+	TEST_CHECK(test_auth_enqueue(&c, t, "slow") == FR_TRUNK_ENQUEUE_NO_CAPACITY);
+	TEST_CHECK(c == NULL);
+
+	TEST_CHECK(test_service(t, test_sent, 2));
+
+	TEST_CASE("Authentications in flight complete");
+	test_unblock(2);
+	TEST_CHECK(test_service(t, test_resumed, 2));
+	TEST_CHECK(a->done && (a->err == WBC_ERR_SUCCESS));
+	TEST_CHECK(b->done && (b->err == WBC_ERR_SUCCESS));
+
+	talloc_free(ctx);
+}
+
+static void test_cancel(void)
+{
+	TALLOC_CTX		*ctx = talloc_init_const("test");
+	rlm_mschap_thread_t	*t = test_thread_alloc(ctx, 0);
+	mschap_wb_auth_t	*auth;
+
+	TEST_CHECK(test_auth_enqueue(&auth, t, "slow") >= 0);
+	TEST_CHECK(test_service(t, test_sent, 1));
+	TEST_CHECK(auth->job != NULL);
+
+	TEST_CASE("Cancelled authentications are detached from their job");
+	mschap_wb_auth_cancel(auth);
+	TEST_CHECK(auth->job == NULL);
+	TEST_CHECK(auth->treq == NULL);
+
+	TEST_CASE("The result of a cancelled authentication is discarded");
+	test_unblock(1);
+	TEST_CHECK(test_service(t, test_returned, 1));
+	TEST_CHECK(!auth->done);
+	TEST_CHECK(test_runnable == 0);
+
+	talloc_free(ctx);
+}
+
+static void test_close_busy(void)
+{
+	TALLOC_CTX		*ctx = talloc_init_const("test");
+	rlm_mschap_thread_t	*t;
+	mschap_wb_auth_t	*auth;
+	uint32_t		freed;
+
+	/*
+	 *	Helper threads from earlier tests
+	 *	may still be exiting.
+	 */
+	TEST_CHECK(test_ctx_wait_freed(atomic_load(&test_ctx_created)));
+
+	t = test_thread_alloc(ctx, 0);
+	TEST_CHECK(test_auth_enqueue(&auth, t, "slow") >= 0);
+	TEST_CHECK(test_service(t, test_sent, 1));
+
+	TEST_CASE("Closing the trunk doesn't wait for a busy helper thread");
+	freed = atomic_load(&test_ctx_freed);
+	TALLOC_FREE(t->wb_trunk);
+	TEST_CHECK(auth->job == NULL);
+	TEST_CHECK(!auth->done);
+	TEST_CHECK(atomic_load(&test_ctx_freed) == freed);
+
+	TEST_CASE("The helper thread frees the shared state once winbind returns");
+	test_unblock(1);
+	TEST_CHECK(test_ctx_wait_freed(freed + 1));
+
+	talloc_free(ctx);
+}
+
+TEST_LIST = {
+	{ "pipelined",			test_pipelined },
+	{ "results",			test_results },
+	{ "per_connection_max",		test_per_connection_max },
+	{ "cancel",			test_cancel },
+	{ "close_busy",			test_close_busy },
+
+	{ NULL }
+};
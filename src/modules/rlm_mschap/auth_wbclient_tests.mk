@@ -0,0 +1,13 @@
+TARGET		:= rlm_mschap_wbclient_tests
+
+SOURCES		:= auth_wbclient_tests.c mschap.c smbdes.c
+
+TGT_LDLIBS	:= $(LIBS) $(GPERFTOOLS_LIBS)
+TGT_LDFLAGS	:= $(LDFLAGS) $(GPERFTOOLS_LDFLAGS)
+
+ifneq ($(OPENSSL_LIBS),)
+TGT_PREREQS	:= libfreeradius-tls.a
+endif
+
+TGT_PREREQS	+= libfreeradius-util.la libfreeradius-server.a libfreeradius-unlang.a libfreeradius-io.a
+SRC_CFLAGS	:= $(MSCHAP_WBCLIENT_CFLAGS) -DTESTING_MSCHAP_WBCLIENT
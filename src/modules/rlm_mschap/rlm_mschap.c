@@ -32,10 +32,13 @@ RCSID("$Id$")
 #include <freeradius-devel/server/module.h>
 #include <freeradius-devel/server/password.h>
 #include <freeradius-devel/tls/log.h>
+#include <freeradius-devel/unlang/interpret.h>
+#include <freeradius-devel/unlang/module.h>
 #include <freeradius-devel/util/debug.h>
 #include <freeradius-devel/radius/defs.h>
 
 #include <freeradius-devel/util/base16.h>
+#include <freeradius-devel/util/base64.h>
 #include <freeradius-devel/util/md4.h>
 #include <freeradius-devel/util/md5.h>
 #include <freeradius-devel/util/misc.h>
@@ -105,6 +108,7 @@ static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("with_ntdomain_hack", FR_TYPE_BOOL, rlm_mschap_t, with_ntdomain_hack), .dflt = "yes" },
 	{ FR_CONF_OFFSET("ntlm_auth", FR_TYPE_STRING | FR_TYPE_XLAT, rlm_mschap_t, ntlm_auth) },
 	{ FR_CONF_OFFSET("ntlm_auth_timeout", FR_TYPE_TIME_DELTA, rlm_mschap_t, ntlm_auth_timeout) },
+	{ FR_CONF_OFFSET("ntlm_auth_helper", FR_TYPE_SUBSECTION, rlm_mschap_t, ntlm_helper), .subcs = (void const *) fr_exec_helper_config },
 
 	{ FR_CONF_POINTER("passchange", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) passchange_config },
 	{ FR_CONF_OFFSET("allow_retry", FR_TYPE_BOOL, rlm_mschap_t, allow_retry), .dflt = "yes" },
@@ -124,6 +128,8 @@ static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("winbind_domain", FR_TYPE_TMPL | FR_TYPE_DEPRECATED, rlm_mschap_t, wb_domain) },
 #ifdef WITH_AUTH_WINBIND
 	{ FR_CONF_OFFSET("winbind_retry_with_normalised_username", FR_TYPE_BOOL | FR_TYPE_DEPRECATED, rlm_mschap_t, wb_retry_with_normalised_username) },
+
+	{ FR_CONF_OFFSET("pool", FR_TYPE_SUBSECTION, rlm_mschap_t, wb_trunk_conf), .subcs = (void const *) fr_trunk_config },
 #endif
 	CONF_PARSER_TERMINATOR
 };
@@ -698,40 +704,6 @@ static xlat_action_t mschap_xlat(TALLOC_CTX *ctx, fr_dcursor_t *out,
 }
 
 
-#ifdef WITH_AUTH_WINBIND
-/*
- *	Free connection pool winbind context
- */
-static int _mod_conn_free(struct wbcContext **wb_ctx)
-{
-	wbcCtxFree(*wb_ctx);
-
-	return 0;
-}
-
-/*
- *	Create connection pool winbind context
- */
-static void *mod_conn_create(TALLOC_CTX *ctx, void *instance, UNUSED fr_time_delta_t timeout)
-{
-	struct wbcContext	**wb_ctx;
-	module_inst_ctx_t	*mctx =  MODULE_INST_CTX(dl_module_instance_by_data(instance));
-
-	wb_ctx = talloc_zero(ctx, struct wbcContext *);
-	*wb_ctx = wbcCtxCreate();
-
-	if (*wb_ctx == NULL) {
-		ERROR("failed to create winbind context");
-		talloc_free(wb_ctx);
-		return NULL;
-	}
-
-	talloc_set_destructor(wb_ctx, _mod_conn_free);
-
-	return *wb_ctx;
-}
-#endif
-
 /*
  *	Add MPPE attributes to the reply.
  */
@@ -1310,13 +1282,10 @@ static int CC_HINT(nonnull (1, 2, 4, 5, 6)) do_mschap(rlm_mschap_t const *inst,
 
 		break;
 		}
-#ifdef WITH_AUTH_WINBIND
-	case AUTH_WBCLIENT:
 	/*
-	 *	Process auth via the wbclient library
+	 *	AUTH_NTLMAUTH_HELPER and AUTH_WBCLIENT are handled
+	 *	asynchronously by mod_authenticate, and never get here.
 	 */
-		return do_auth_wbclient(inst, request, challenge, response, nthashhash);
-#endif
 	default:
 		/* We should never reach this line */
 		RERROR("Internal error: Unknown mschap auth method (%d)", method);
@@ -1784,21 +1753,43 @@ static unlang_action_t CC_HINT(nonnull) mschap_process_cpw_request(rlm_rcode_t *
 	RETURN_MODULE_OK;
 }
 
-static CC_HINT(nonnull(1,2,3,4,5,8,9)) unlang_action_t mschap_process_response(rlm_rcode_t *p_result,
-									       int *mschap_version,
-									       uint8_t nthashhash[static NT_DIGEST_LENGTH],
-									       rlm_mschap_t const *inst,
-									       request_t *request,
-									       fr_pair_t *smb_ctrl,
-									       fr_pair_t *nt_password,
-									       fr_pair_t *challenge,
-									       fr_pair_t *response,
-									       MSCHAP_AUTH_METHOD method)
+/** State carried from preparing an MS-CHAP authentication to finishing it
+ *
+ * Authentications performed by winbind yield, so this can't live on
+ * the stack.
+ */
+typedef struct {
+	fr_pair_t		*nt_password;		//!< Known good password, may be NULL.
+	bool			ephemeral;		//!< nt_password was generated, and must be freed.
+	fr_pair_t		*smb_ctrl;		//!< Account control flags.
+	fr_pair_t		*challenge;		//!< MS-CHAP-Challenge.
+	fr_pair_t		*response;		//!< MS-CHAP-Response or MS-CHAP2-Response.
+	MSCHAP_AUTH_METHOD	method;			//!< How we're authenticating this request.
+
+	int			mschap_version;		//!< 1 or 2.
+	uint8_t			mschap_challenge[MSCHAP_CHALLENGE_LENGTH];	//!< Challenge the NT-Response
+										///< is checked against.
+	char			*username;		//!< MS-CHAPv2 username, without the domain.
+	uint8_t const		*peer_challenge;	//!< MS-CHAPv2 peer challenge.
+	uint8_t			nthashhash[NT_DIGEST_LENGTH];
+#ifdef __APPLE__
+	bool			od_authenticated;	//!< OpenDirectory has already authenticated the user.
+#endif
+	fr_exec_helper_request_t *ntlm;			//!< Authentication being performed by an
+							///< ntlm_auth helper.
+#ifdef WITH_AUTH_WINBIND
+	mschap_wb_auth_t	*wb;			//!< Authentication being performed by winbind.
+#endif
+} mschap_auth_ctx_t;
+
+static CC_HINT(nonnull) unlang_action_t mschap_process_response(rlm_rcode_t *p_result,
+								 mschap_auth_ctx_t *auth_ctx,
+								 request_t *request)
 {
-	int			offset;
-	rlm_rcode_t		mschap_result;
+	fr_pair_t	*challenge = auth_ctx->challenge;
+	fr_pair_t	*response = auth_ctx->response;
 
-	*mschap_version = 1;
+	auth_ctx->mschap_version = 1;
 
 	RDEBUG2("Processing MS-CHAPv1 response");
 
@@ -1827,41 +1818,23 @@ static CC_HINT(nonnull(1,2,3,4,5,8,9)) unlang_action_t mschap_process_response(r
 		RETURN_MODULE_FAIL;
 	}
 
-	offset = 26;
-
-	/*
-	 *	Do the MS-CHAP authentication.
-	 */
-	mschap_result = do_mschap(inst, request, nt_password, challenge->vp_octets,
-				  response->vp_octets + offset, nthashhash, method);
+	memcpy(auth_ctx->mschap_challenge, challenge->vp_octets, MSCHAP_CHALLENGE_LENGTH);
 
-	/*
-	 *	Check for errors, and add MSCHAP-Error if necessary.
-	 */
-	return mschap_error(p_result, inst, request, *response->vp_octets, mschap_result, *mschap_version, smb_ctrl);
+	RETURN_MODULE_OK;
 }
 
-static unlang_action_t CC_HINT(nonnull(1,2,3,4,5,8,9)) mschap_process_v2_response(rlm_rcode_t *p_result,
-										  int *mschap_version,
-									    	  uint8_t nthashhash[static NT_DIGEST_LENGTH],
-									    	  rlm_mschap_t const *inst,
-									    	  request_t *request,
-									    	  fr_pair_t *smb_ctrl,
-									   	  fr_pair_t *nt_password,
-									    	  fr_pair_t *challenge,
-									    	  fr_pair_t *response,
-									    	  MSCHAP_AUTH_METHOD method)
+static unlang_action_t CC_HINT(nonnull) mschap_process_v2_response(rlm_rcode_t *p_result,
+								    rlm_mschap_t const *inst,
+								    mschap_auth_ctx_t *auth_ctx,
+								    request_t *request)
 {
-		uint8_t		mschap_challenge[16];
+		fr_pair_t	*challenge = auth_ctx->challenge;
+		fr_pair_t	*response = auth_ctx->response;
 		fr_pair_t	*user_name, *name_vp, *response_name, *peer_challenge_attr;
-		uint8_t const	*peer_challenge;
 		char const	*username_str;
 		size_t		username_len;
-		int		mschap_result;
-		rlm_rcode_t	rcode;
-		char		msch2resp[42];
 
-		*mschap_version = 2;
+		auth_ctx->mschap_version = 2;
 
 		RDEBUG2("Processing MS-CHAPv2 response");
 
@@ -1919,6 +1892,12 @@ static unlang_action_t CC_HINT(nonnull(1,2,3,4,5,8,9)) mschap_process_v2_respons
 			RWDEBUG("%pP is not the same as %pP from EAP-MSCHAPv2", user_name, response_name);
 		}
 
+		/*
+		 *	Copied, as winbind may replace MS-CHAP-User-Name
+		 *	with a normalised version before we're done.
+		 */
+		MEM(auth_ctx->username = talloc_bstrndup(auth_ctx, username_str, username_len));
+
 #ifdef __APPLE__
 		/*
 		 *  No "known good" NT-Password attribute.  Try to do
@@ -1928,18 +1907,23 @@ static unlang_action_t CC_HINT(nonnull(1,2,3,4,5,8,9)) mschap_process_v2_respons
 		 *  indicates the auth process should continue directly to AD.
 		 *  Otherwise OD will determine auth success/fail.
 		 */
-		if (!nt_password && inst->open_directory) {
+		if (!auth_ctx->nt_password && inst->open_directory) {
+			rlm_rcode_t rcode;
+
 			RDEBUG2("No NT-Password available. Trying OpenDirectory Authentication");
 			rcode = od_mschap_auth(request, challenge, user_name);
-			if (rcode != RLM_MODULE_NOOP) RETURN_MODULE_RCODE(rcode);
+			if (rcode != RLM_MODULE_NOOP) {
+				auth_ctx->od_authenticated = true;
+				RETURN_MODULE_RCODE(rcode);
+			}
 		}
 #endif
-		peer_challenge = response->vp_octets + 2;
+		auth_ctx->peer_challenge = response->vp_octets + 2;
 
 		peer_challenge_attr = fr_pair_find_by_da_idx(&request->control_pairs, attr_ms_chap_peer_challenge, 0);
 		if (peer_challenge_attr) {
 			RDEBUG2("Overriding peer challenge");
-			peer_challenge = peer_challenge_attr->vp_octets;
+			auth_ctx->peer_challenge = peer_challenge_attr->vp_octets;
 		}
 
 		/*
@@ -1951,23 +1935,92 @@ static unlang_action_t CC_HINT(nonnull(1,2,3,4,5,8,9)) mschap_process_v2_respons
 		 */
 		RDEBUG2("Creating challenge with username \"%pV\"",
 			fr_box_strvalue_len(username_str, username_len));
-		mschap_challenge_hash(mschap_challenge,		/* resulting challenge */
-				      peer_challenge,			/* peer challenge */
+		mschap_challenge_hash(auth_ctx->mschap_challenge,	/* resulting challenge */
+				      auth_ctx->peer_challenge,		/* peer challenge */
 				      challenge->vp_octets,		/* our challenge */
 				      username_str, username_len);	/* user name */
 
-		mschap_result = do_mschap(inst, request, nt_password, mschap_challenge,
-					  response->vp_octets + 26, nthashhash, method);
+		RETURN_MODULE_OK;
+}
+
+/*
+ *	Add MPPE attributes to the reply.
+ */
+static void mschap_add_mppe(rlm_mschap_t const *inst, request_t *request, mschap_auth_ctx_t *auth_ctx)
+{
+	fr_pair_t	*vp;
+	uint8_t		mppe_sendkey[34];
+	uint8_t		mppe_recvkey[34];
+
+	switch (auth_ctx->mschap_version) {
+	case 1:
+		RDEBUG2("Generating MS-CHAPv1 MPPE keys");
+		memset(mppe_sendkey, 0, 32);
 
 		/*
-		 *	Check for errors, and add MSCHAP-Error if necessary.
+		 *	According to RFC 2548 we
+		 *	should send NT hash.  But in
+		 *	practice it doesn't work.
+		 *	Instead, we should send nthashhash
+		 *
+		 *	This is an error in RFC 2548.
+		 */
+		/*
+		 *	do_mschap cares to zero nthashhash if NT hash
+		 *	is not available.
 		 */
-		mschap_error(&rcode, inst, request, *response->vp_octets,
-			     mschap_result, *mschap_version, smb_ctrl);
-		if (rcode != RLM_MODULE_OK) RETURN_MODULE_RCODE(rcode);
+		memcpy(mppe_sendkey + 8, auth_ctx->nthashhash, NT_DIGEST_LENGTH);
+		mppe_add_reply(inst, request, attr_ms_chap_mppe_keys, mppe_sendkey, 24);	//-V666
+		break;
+
+	case 2:
+		RDEBUG2("Generating MS-CHAPv2 MPPE keys");
+		mppe_chap2_gen_keys128(auth_ctx->nthashhash, auth_ctx->response->vp_octets + 26,
+				       mppe_sendkey, mppe_recvkey);
+
+		mppe_add_reply(inst, request, attr_ms_mppe_recv_key, mppe_recvkey, 16);
+		mppe_add_reply(inst, request, attr_ms_mppe_send_key, mppe_sendkey, 16);
+		break;
+
+	default:
+		fr_assert(0);
+		break;
+	}
+
+	MEM(pair_update_reply(&vp, attr_ms_mppe_encryption_policy) >= 0);
+	vp->vp_uint32 = inst->require_encryption ? 2 : 1;
+
+	MEM(pair_update_reply(&vp, attr_ms_mppe_encryption_types) >= 0);
+	vp->vp_uint32 = inst->require_strong ? 4 : 6;
+}
+
+/** Act on the result of checking the NT-Response
+ *
+ * Adds MS-CHAP-Error on failure, or MS-CHAP2-Success and the MPPE
+ * keys on success.
+ */
+static unlang_action_t mschap_auth_finish(rlm_rcode_t *p_result, rlm_mschap_t const *inst, request_t *request,
+					  mschap_auth_ctx_t *auth_ctx, int mschap_result)
+{
+	fr_pair_t	*response = auth_ctx->response;
+	rlm_rcode_t	rcode;
+
+	/*
+	 *	Check for errors, and add MSCHAP-Error if necessary.
+	 */
+	mschap_error(&rcode, inst, request, *response->vp_octets,
+		     mschap_result, auth_ctx->mschap_version, auth_ctx->smb_ctrl);
+	if (rcode != RLM_MODULE_OK) goto finish;
+
+	if (auth_ctx->mschap_version == 2) {
+		char const	*username_str = auth_ctx->username;
+		size_t		username_len = talloc_array_length(auth_ctx->username) - 1;
+		char		msch2resp[42];
 
 #ifdef WITH_AUTH_WINBIND
 		if (inst->wb_retry_with_normalised_username) {
+			fr_pair_t *response_name;
+
 			response_name = fr_pair_find_by_da_idx(&request->request_pairs, attr_ms_chap_user_name, 0);
 			if (response_name) {
 				if (strcmp(username_str, response_name->vp_strvalue)) {
@@ -1975,6 +2028,7 @@ static unlang_action_t CC_HINT(nonnull(1,2,3,4,5,8,9)) mschap_process_v2_respons
 						fr_box_strvalue_len(username_str, username_len),
 						&response_name->data);
 					username_str = response_name->vp_strvalue;
+					username_len = response_name->vp_length;
 				}
 			}
 		}
@@ -1982,14 +2036,216 @@ static unlang_action_t CC_HINT(nonnull(1,2,3,4,5,8,9)) mschap_process_v2_respons
 
 		mschap_auth_response(username_str,		/* without the domain */
 				     username_len,		/* Length of username str */
-				     nthashhash,		/* nt-hash-hash */
+				     auth_ctx->nthashhash,	/* nt-hash-hash */
 				     response->vp_octets + 26,	/* peer response */
-				     peer_challenge,		/* peer challenge */
-				     challenge->vp_octets,	/* our challenge */
+				     auth_ctx->peer_challenge,	/* peer challenge */
+				     auth_ctx->challenge->vp_octets,	/* our challenge */
 				     msch2resp);		/* calculated MPPE key */
 		mschap_add_reply(request, *response->vp_octets, attr_ms_chap2_success, msch2resp, 42);
+	}
 
-		RETURN_MODULE_OK;
+	/* now create MPPE attributes */
+	if (inst->use_mppe) mschap_add_mppe(inst, request, auth_ctx);
+
+finish:
+	if (auth_ctx->ephemeral) TALLOC_FREE(auth_ctx->nt_password);
+
+	RETURN_MODULE_RCODE(rcode);
+}
+
+#ifdef WITH_AUTH_WINBIND
+static unlang_action_t mod_authenticate_resume(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
+{
+	rlm_mschap_t const	*inst = talloc_get_type_abort_const(mctx->inst->data, rlm_mschap_t);
+	mschap_auth_ctx_t	*auth_ctx = talloc_get_type_abort(mctx->rctx, mschap_auth_ctx_t);
+	int			mschap_result;
+
+	mschap_result = mschap_wb_auth_result(request, auth_ctx->wb, auth_ctx->nthashhash);
+	TALLOC_FREE(auth_ctx->wb);
+
+	return mschap_auth_finish(p_result, inst, request, auth_ctx, mschap_result);
+}
+
+/** Stop waiting on winbind if the request is cancelled
+ *
+ */
+static void mod_authenticate_signal(module_ctx_t const *mctx, UNUSED request_t *request, fr_state_signal_t action)
+{
+	mschap_auth_ctx_t	*auth_ctx = talloc_get_type_abort(mctx->rctx, mschap_auth_ctx_t);
+
+	if (action != FR_SIGNAL_CANCEL) return;
+
+	mschap_wb_auth_cancel(auth_ctx->wb);
+}
+#endif
+
+/** Errors returned by ntlm_auth helpers, and the MS-CHAP errors they map to
+ *
+ */
+static fr_table_num_sorted_t const ntlm_helper_errors[] = {
+	{ L("NT_STATUS_ACCOUNT_DISABLED"),	-691 },
+	{ L("NT_STATUS_ACCOUNT_LOCKED_OUT"),	-647 },
+	{ L("NT_STATUS_NO_LOGON_SERVERS"),	-2 },
+	{ L("NT_STATUS_PASSWORD_EXPIRED"),	-648 },
+	{ L("NT_STATUS_PASSWORD_MUST_CHANGE"),	-648 }
+};
+static size_t ntlm_helper_errors_len = NUM_ELEMENTS(ntlm_helper_errors);
+
+/** Pass an MS-CHAP authentication to an ntlm_auth helper
+ *
+ * Uses ntlm_auth's ntlm-server-1 helper protocol.  The username and
+ * domain are base64 encoded, so nothing in them can break the framing.
+ */
+static int mschap_ntlm_helper_enqueue(rlm_mschap_t const *inst, rlm_mschap_thread_t *t, request_t *request,
+				      mschap_auth_ctx_t *auth_ctx)
+{
+	TALLOC_CTX		*ctx = unlang_interpret_frame_talloc_ctx(request);
+	char			*username = NULL, *domain = NULL;
+	fr_sbuff_t		sbuff;
+	fr_sbuff_uctx_talloc_t	tctx;
+	int			ret = -1;
+
+	if (tmpl_aexpand(ctx, &username, request, inst->wb_username, NULL, NULL) < 0) {
+		REDEBUG2("Unable to expand winbind.username");
+		return -1;
+	}
+
+	if (inst->wb_domain) {
+		if (tmpl_aexpand(ctx, &domain, request, inst->wb_domain, NULL, NULL) < 0) {
+			REDEBUG2("Unable to expand winbind.domain");
+			talloc_free(username);
+			return -1;
+		}
+	} else {
+		RWDEBUG2("No domain specified; authentication may fail because of this");
+	}
+
+	MEM(fr_sbuff_init_talloc(ctx, &sbuff, &tctx, 256, SIZE_MAX));
+
+	if ((fr_sbuff_in_strcpy_literal(&sbuff, "Username:: ") < 0) ||
+	    (fr_base64_encode(&sbuff, &FR_DBUFF_TMP((uint8_t const *)username, strlen(username)), true) < 0) ||
+	    (fr_sbuff_in_char(&sbuff, '\n') < 0)) goto error;
+
+	if (domain &&
+	    ((fr_sbuff_in_strcpy_literal(&sbuff, "NT-Domain:: ") < 0) ||
+	     (fr_base64_encode(&sbuff, &FR_DBUFF_TMP((uint8_t const *)domain, strlen(domain)), true) < 0) ||
+	     (fr_sbuff_in_char(&sbuff, '\n') < 0))) goto error;
+
+	if ((fr_sbuff_in_strcpy_literal(&sbuff, "LANMAN-Challenge: ") < 0) ||
+	    (fr_base16_encode(&sbuff, &FR_DBUFF_TMP(auth_ctx->mschap_challenge, MSCHAP_CHALLENGE_LENGTH)) < 0) ||
+	    (fr_sbuff_in_strcpy_literal(&sbuff, "\nNT-Response: ") < 0) ||
+	    (fr_base16_encode(&sbuff, &FR_DBUFF_TMP(auth_ctx->response->vp_octets + 26, 24)) < 0) ||
+	    (fr_sbuff_in_strcpy_literal(&sbuff, "\nRequest-User-Session-Key: Yes\n") < 0)) {
+	error:
+		REDEBUG("Failed building ntlm_auth helper request");
+		goto finish;
+	}
+
+	RDEBUG2("Sending authentication request user \"%pV\" domain \"%pV\" to ntlm_auth helper",
+		fr_box_strvalue_buffer(username), fr_box_strvalue_buffer(domain));
+
+	ret = fr_exec_helper_enqueue(&auth_ctx->ntlm, t->ntlm_helper, request,
+				     fr_sbuff_start(&sbuff), fr_sbuff_used(&sbuff));
+
+finish:
+	talloc_free(fr_sbuff_buff(&sbuff));
+	talloc_free(username);
+	talloc_free(domain);
+
+	return ret;
+}
+
+/** Convert the response from an ntlm_auth helper into an MS-CHAP result
+ *
+ * @return
+ *	- 0 success.
+ *	- -1 auth failure.
+ *	- < -1 one of the MS-CHAP error codes.
+ */
+static int mschap_ntlm_helper_result(request_t *request, fr_exec_helper_request_t *hreq,
+				     uint8_t nthashhash[static NT_DIGEST_LENGTH])
+{
+	char const	*p, *end, *nl, *value;
+	char const	*error = NULL;
+	size_t		name_len, value_len, error_len = 0;
+	bool		authenticated = false, have_key = false;
+
+	if (!hreq->done) {
+		REDEBUG("Failed getting a response from ntlm_auth helper");
+		return -1;
+	}
+
+	for (p = hreq->reply, end = p + hreq->reply_len; p < end; p = nl + 1) {
+		nl = memchr(p, '\n', end - p);
+		if (!nl) nl = end;
+
+		value = memchr(p, ':', nl - p);
+		if (!value) continue;
+		name_len = value - p;
+
+		for (value++; (value < nl) && (*value == ' '); value++);
+		value_len = nl - value;
+		if (value_len && (value[value_len - 1] == '\r')) value_len--;
+
+#define NAME_IS(_name) ((name_len == (sizeof(_name) - 1)) && (strncasecmp(p, _name, name_len) == 0))
+		if (NAME_IS("Authenticated")) {
+			authenticated = ((value_len == 3) && (strncasecmp(value, "Yes", 3) == 0));
+
+		} else if (NAME_IS("User-Session-Key")) {
+			have_key = (fr_base16_decode(NULL, &FR_DBUFF_TMP(nthashhash, NT_DIGEST_LENGTH),
+						     &FR_SBUFF_IN(value, value_len), true) == NT_DIGEST_LENGTH);
+
+		} else if (NAME_IS("Authentication-Error")) {
+			error = value;
+			error_len = value_len;
+		}
+#undef NAME_IS
+	}
+
+	if (authenticated) {
+		if (!have_key) {
+			REDEBUG("Invalid output from ntlm_auth helper: missing or malformed User-Session-Key");
+			return -1;
+		}
+
+		RDEBUG2("Authenticated successfully");
+		return 0;
+	}
+
+	if (!error) {
+		REDEBUG2("Authentication failed");
+		return -1;
+	}
+
+	REDEBUG2("ntlm_auth helper says: %pV", fr_box_strvalue_len(error, error_len));
+
+	return fr_table_value_by_substr(ntlm_helper_errors, error, error_len, -1);
+}
+
+static unlang_action_t mod_authenticate_ntlm_helper_resume(rlm_rcode_t *p_result, module_ctx_t const *mctx,
+							   request_t *request)
+{
+	rlm_mschap_t const	*inst = talloc_get_type_abort_const(mctx->inst->data, rlm_mschap_t);
+	mschap_auth_ctx_t	*auth_ctx = talloc_get_type_abort(mctx->rctx, mschap_auth_ctx_t);
+	int			mschap_result;
+
+	mschap_result = mschap_ntlm_helper_result(request, auth_ctx->ntlm, auth_ctx->nthashhash);
+	TALLOC_FREE(auth_ctx->ntlm);
+
+	return mschap_auth_finish(p_result, inst, request, auth_ctx, mschap_result);
+}
+
+/** Stop waiting on the ntlm_auth helper if the request is cancelled
+ *
+ */
+static void mod_authenticate_ntlm_helper_signal(module_ctx_t const *mctx, UNUSED request_t *request,
+						fr_state_signal_t action)
+{
+	mschap_auth_ctx_t	*auth_ctx = talloc_get_type_abort(mctx->rctx, mschap_auth_ctx_t);
+
+	if (action != FR_SIGNAL_CANCEL) return;
+
+	fr_exec_helper_cancel(auth_ctx->ntlm);
 }
 
 /*
@@ -2007,34 +2263,36 @@ static unlang_action_t CC_HINT(nonnull(1,2,3,4,5,8,9)) mschap_process_v2_respons
  *	In case of password mismatch or locked account we MAY return
  *	MS-CHAP-Error for MS-CHAP or MS-CHAP v2
  *	If MS-CHAP2 succeeds we MUST return MS-CHAP2-Success
+ *
+ *	Authentications performed by winbind are handed to a helper
+ *	thread, and mod_authenticate_resume() finishes up.  Those
+ *	performed by ntlm_auth helpers are finished by
+ *	mod_authenticate_ntlm_helper_resume().
  */
 static unlang_action_t CC_HINT(nonnull) mod_authenticate(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
 {
 	rlm_mschap_t const	*inst = talloc_get_type_abort_const(mctx->inst->data, rlm_mschap_t);
-	fr_pair_t		*challenge = NULL;
-	fr_pair_t		*response = NULL;
+	mschap_auth_ctx_t	*auth_ctx;
 	fr_pair_t		*cpw = NULL;
-	fr_pair_t		*nt_password = NULL, *smb_ctrl;
-	uint8_t			nthashhash[NT_DIGEST_LENGTH];
-	int			mschap_version = 0;
+	fr_pair_t		*smb_ctrl;
 
-	MSCHAP_AUTH_METHOD	method;
-	bool			ephemeral = false;
 	rlm_rcode_t		rcode = RLM_MODULE_OK;
 
+	MEM(auth_ctx = talloc_zero(unlang_interpret_frame_talloc_ctx(request), mschap_auth_ctx_t));
+
 	/*
 	 *	If we have ntlm_auth configured, use it unless told
 	 *	otherwise
 	 */
-	method = inst->method;
+	auth_ctx->method = inst->method;
 
 	/*
 	 *	If we have an ntlm_auth configuration, then we may
 	 *	want to suppress it.
 	 */
-	if (method != AUTH_INTERNAL) {
+	if (auth_ctx->method != AUTH_INTERNAL) {
 		fr_pair_t *vp = fr_pair_find_by_da_idx(&request->control_pairs, attr_ms_chap_use_ntlm_auth, 0);
-		if (vp && vp->vp_bool == false) method = AUTH_INTERNAL;
+		if (vp && vp->vp_bool == false) auth_ctx->method = AUTH_INTERNAL;
 	}
 
 	/*
@@ -2051,6 +2309,7 @@ static unlang_action_t CC_HINT(nonnull) mod_authenticate(rlm_rcode_t *p_result,
 			smb_ctrl->vp_uint32 = pdb_decode_acct_ctrl(smb_account_ctrl_text->vp_strvalue);
 		}
 	}
+	auth_ctx->smb_ctrl = smb_ctrl;
 
 	/*
 	 *	We're configured to do MS-CHAP authentication.
@@ -2073,7 +2332,9 @@ static unlang_action_t CC_HINT(nonnull) mod_authenticate(rlm_rcode_t *p_result,
 	 *	input attribute, and we're calling out to an
 	 *	external password store.
 	 */
-	if (nt_password_find(&ephemeral, &nt_password, mctx->inst->data, request) < 0) RETURN_MODULE_FAIL;
+	if (nt_password_find(&auth_ctx->ephemeral, &auth_ctx->nt_password, mctx->inst->data, request) < 0) {
+		RETURN_MODULE_FAIL;
+	}
 
 	/*
 	 *	Check to see if this is a change password request, and process
@@ -2083,7 +2344,7 @@ static unlang_action_t CC_HINT(nonnull) mod_authenticate(rlm_rcode_t *p_result,
 	if (cpw) {
 		uint8_t		*p;
 
-		mschap_process_cpw_request(&rcode, mctx->inst->data, request, cpw, nt_password);
+		mschap_process_cpw_request(&rcode, mctx->inst->data, request, cpw, auth_ctx->nt_password);
 		if (rcode != RLM_MODULE_OK) goto finish;
 
 		/*
@@ -2101,8 +2362,8 @@ static unlang_action_t CC_HINT(nonnull) mod_authenticate(rlm_rcode_t *p_result,
 		 *	password change, add them into the request and then
 		 *	continue with the authentication.
 		 */
-		MEM(pair_update_request(&response, attr_ms_chap2_response) >= 0);
-		MEM(fr_pair_value_mem_alloc(response, &p, 50, cpw->vp_tainted) == 0);
+		MEM(pair_update_request(&auth_ctx->response, attr_ms_chap2_response) >= 0);
+		MEM(fr_pair_value_mem_alloc(auth_ctx->response, &p, 50, cpw->vp_tainted) == 0);
 
 		/* ident & flags */
 		p[0] = cpw->vp_octets[1];
@@ -2111,8 +2372,8 @@ static unlang_action_t CC_HINT(nonnull) mod_authenticate(rlm_rcode_t *p_result,
 		memcpy(p + 2, cpw->vp_octets + 18, 48);
 	}
 
-	challenge = fr_pair_find_by_da_idx(&request->request_pairs, attr_ms_chap_challenge, 0);
-	if (!challenge) {
+	auth_ctx->challenge = fr_pair_find_by_da_idx(&request->request_pairs, attr_ms_chap_challenge, 0);
+	if (!auth_ctx->challenge) {
 		REDEBUG("&control.Auth-Type = %s set for a request that does not contain &%s",
 			mctx->inst->name, attr_ms_chap_challenge->name);
 		rcode = RLM_MODULE_INVALID;
@@ -2122,21 +2383,11 @@ static unlang_action_t CC_HINT(nonnull) mod_authenticate(rlm_rcode_t *p_result,
 	/*
 	 *	We also require an MS-CHAP-Response.
 	 */
-	if ((response = fr_pair_find_by_da_idx(&request->request_pairs, attr_ms_chap_response, 0))) {
-		mschap_process_response(&rcode,
-					&mschap_version, nthashhash,
-					inst, request,
-					smb_ctrl, nt_password,
-					challenge, response,
-					method);
+	if ((auth_ctx->response = fr_pair_find_by_da_idx(&request->request_pairs, attr_ms_chap_response, 0))) {
+		mschap_process_response(&rcode, auth_ctx, request);
 		if (rcode != RLM_MODULE_OK) goto finish;
-	} else if ((response = fr_pair_find_by_da_idx(&request->request_pairs, attr_ms_chap2_response, 0))) {
-		mschap_process_v2_response(&rcode,
-					   &mschap_version, nthashhash,
-					   inst, request,
-					   smb_ctrl, nt_password,
-					   challenge, response,
-					   method);
+	} else if ((auth_ctx->response = fr_pair_find_by_da_idx(&request->request_pairs, attr_ms_chap2_response, 0))) {
+		mschap_process_v2_response(&rcode, inst, auth_ctx, request);
 		if (rcode != RLM_MODULE_OK) goto finish;
 	} else {		/* Neither CHAPv1 or CHAPv2 response: die */
 		REDEBUG("&control.Auth-Type = %s set for a request that does not contain &%s or &%s attributes",
@@ -2145,59 +2396,110 @@ static unlang_action_t CC_HINT(nonnull) mod_authenticate(rlm_rcode_t *p_result,
 		goto finish;
 	}
 
-	/* now create MPPE attributes */
-	if (inst->use_mppe) {
-		fr_pair_t	*vp;
-		uint8_t		mppe_sendkey[34];
-		uint8_t		mppe_recvkey[34];
-
-		switch (mschap_version) {
-		case 1:
-			RDEBUG2("Generating MS-CHAPv1 MPPE keys");
-			memset(mppe_sendkey, 0, 32);
+#ifdef __APPLE__
+	if (auth_ctx->od_authenticated) {
+		if (inst->use_mppe) mschap_add_mppe(inst, request, auth_ctx);
+		goto finish;
+	}
+#endif
 
-			/*
-			 *	According to RFC 2548 we
-			 *	should send NT hash.  But in
-			 *	practice it doesn't work.
-			 *	Instead, we should send nthashhash
-			 *
-			 *	This is an error in RFC 2548.
-			 */
-			/*
-			 *	do_mschap cares to zero nthashhash if NT hash
-			 *	is not available.
-			 */
-			memcpy(mppe_sendkey + 8, nthashhash, NT_DIGEST_LENGTH);
-			mppe_add_reply(inst, request, attr_ms_chap_mppe_keys, mppe_sendkey, 24);	//-V666
-			break;
+	if (auth_ctx->method == AUTH_NTLMAUTH_HELPER) {
+		rlm_mschap_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_mschap_thread_t);
 
-		case 2:
-			RDEBUG2("Generating MS-CHAPv2 MPPE keys");
-			mppe_chap2_gen_keys128(nthashhash, response->vp_octets + 26, mppe_sendkey, mppe_recvkey);
+		if (mschap_ntlm_helper_enqueue(inst, t, request, auth_ctx) < 0) {
+			return mschap_auth_finish(p_result, inst, request, auth_ctx, -1);
+		}
 
-			mppe_add_reply(inst, request, attr_ms_mppe_recv_key, mppe_recvkey, 16);
-			mppe_add_reply(inst, request, attr_ms_mppe_send_key, mppe_sendkey, 16);
-			break;
+		return unlang_module_yield(request, mod_authenticate_ntlm_helper_resume,
+					   mod_authenticate_ntlm_helper_signal, auth_ctx);
+	}
 
-		default:
-			fr_assert(0);
-			break;
+#ifdef WITH_AUTH_WINBIND
+	/*
+	 *	libwbclient blocks, so the authentication is
+	 *	performed by a helper thread whilst we yield.
+	 */
+	if (auth_ctx->method == AUTH_WBCLIENT) {
+		rlm_mschap_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_mschap_thread_t);
+		bool			v2 = (auth_ctx->mschap_version == 2);
+
+		if (mschap_wb_auth_enqueue(&auth_ctx->wb, t, request,
+					   auth_ctx->mschap_challenge, auth_ctx->response->vp_octets + 26,
+					   v2 ? auth_ctx->response->vp_octets + 2 : NULL,
+					   v2 ? auth_ctx->challenge->vp_octets : NULL) < 0) {
+			return mschap_auth_finish(p_result, inst, request, auth_ctx, -1);
 		}
 
-		MEM(pair_update_reply(&vp, attr_ms_mppe_encryption_policy) >= 0);
-		vp->vp_uint32 = inst->require_encryption ? 2 : 1;
+		return unlang_module_yield(request, mod_authenticate_resume, mod_authenticate_signal, auth_ctx);
+	}
+#endif
 
-		MEM(pair_update_reply(&vp, attr_ms_mppe_encryption_types) >= 0);
-		vp->vp_uint32 = inst->require_strong ? 4 : 6;
-	} /* else we weren't asked to use MPPE */
+	/*
+	 *	Do the MS-CHAP authentication.
+	 */
+	return mschap_auth_finish(p_result, inst, request, auth_ctx,
+				  do_mschap(inst, request, auth_ctx->nt_password, auth_ctx->mschap_challenge,
+					    auth_ctx->response->vp_octets + 26, auth_ctx->nthashhash, auth_ctx->method));
 
 finish:
-	if (ephemeral) TALLOC_FREE(nt_password);
+	if (auth_ctx->ephemeral) TALLOC_FREE(auth_ctx->nt_password);
 
 	RETURN_MODULE_RCODE(rcode);
 }
 
+#ifdef WITH_AUTH_WINBIND
+static int cmd_stats_winbind(FILE *fp, UNUSED FILE *fp_err, void *ctx, UNUSED fr_cmd_info_t const *info)
+{
+	mschap_wb_stats_t	*stats = ctx;
+	unsigned int		i;
+
+	fprintf(fp, "requests			%" PRIu64 "\n", (uint64_t)atomic_load(&stats->requests));
+	fprintf(fp, "retried			%" PRIu64 "\n", (uint64_t)atomic_load(&stats->retried));
+	fprintf(fp, "failed			%" PRIu64 "\n", (uint64_t)atomic_load(&stats->failed));
+	fprintf(fp, "in_flight			%" PRId64 "\n", (int64_t)atomic_load(&stats->in_flight));
+
+	/*
+	 *	Empty buckets are omitted to keep the output readable
+	 */
+	for (i = 0; i < MSCHAP_WB_LATENCY_BUCKETS; i++) {
+		uint64_t count = atomic_load(&stats->queue_wait[i]);
+
+		if (!count) continue;
+		if (i == (MSCHAP_WB_LATENCY_BUCKETS - 1)) {
+			fprintf(fp, "queue_wait.inf		%" PRIu64 "\n", count);
+		} else {
+			fprintf(fp, "queue_wait.lt_%" PRIu64 "us	%" PRIu64 "\n", (uint64_t)1 << i, count);
+		}
+	}
+
+	for (i = 0; i < MSCHAP_WB_LATENCY_BUCKETS; i++) {
+		uint64_t count = atomic_load(&stats->latency[i]);
+
+		if (!count) continue;
+		if (i == (MSCHAP_WB_LATENCY_BUCKETS - 1)) {
+			fprintf(fp, "latency.inf		%" PRIu64 "\n", count);
+		} else {
+			fprintf(fp, "latency.lt_%" PRIu64 "us	%" PRIu64 "\n", (uint64_t)1 << i, count);
+		}
+	}
+
+	return 0;
+}
+
+static fr_cmd_table_t cmd_table[] = {
+	{
+		.parent = "stats module",
+		.add_name = true,
+		.name = "winbind",
+		.func = cmd_stats_winbind,
+		.help = "Show statistics for authentications performed by winbind.",
+		.read_only = true
+	},
+
+	CMD_TABLE_END
+};
+#endif
+
 /*
  *	Create instance for our module. Allocate space for
  *	instance structure and read configuration parameters
@@ -2218,15 +2520,15 @@ static int mod_instantiate(module_inst_ctx_t const *mctx)
 	 */
 	inst->method = AUTH_INTERNAL;
 
-	if (inst->wb_username) {
-#ifdef WITH_AUTH_WINBIND
-		inst->method = AUTH_WBCLIENT;
-
-		inst->wb_pool = module_connection_pool_init(conf, inst, mod_conn_create, NULL, NULL, NULL, NULL);
-		if (!inst->wb_pool) {
-			cf_log_err(conf, "Unable to initialise winbind connection pool");
+	if (inst->ntlm_helper.program) {
+		if (!inst->wb_username) {
+			cf_log_err(conf, "'ntlm_auth_helper' requires 'winbind.username' to be set");
 			return -1;
 		}
+		inst->method = AUTH_NTLMAUTH_HELPER;
+	} else if (inst->wb_username) {
+#ifdef WITH_AUTH_WINBIND
+		inst->method = AUTH_WBCLIENT;
 #else
 		cf_log_err(conf, "'winbind' auth not enabled at compiled time");
 		return -1;
@@ -2245,9 +2547,30 @@ static int mod_instantiate(module_inst_ctx_t const *mctx)
 	case AUTH_NTLMAUTH_EXEC:
 		DEBUG("Authenticating by calling 'ntlm_auth'");
 		break;
+	case AUTH_NTLMAUTH_HELPER:
+		DEBUG("Authenticating by passing requests to persistent 'ntlm_auth' helpers");
+
+		if (fr_time_delta_lt(inst->ntlm_helper.timeout, fr_time_delta_from_sec(1))) {
+			cf_log_err(conf, "ntlm_auth_helper.timeout '%pVs' is too small (minimum: 1s)",
+				   fr_box_time_delta(inst->ntlm_helper.timeout));
+			return -1;
+		}
+
+		FR_INTEGER_BOUND_CHECK("ntlm_auth_helper.max_response", inst->ntlm_helper.max_response, >=, 64);
+		FR_INTEGER_BOUND_CHECK("ntlm_auth_helper.pool.request.per_connection_max",
+				       inst->ntlm_helper.trunk_conf.max_req_per_conn, >=, 1);
+		break;
 #ifdef WITH_AUTH_WINBIND
 	case AUTH_WBCLIENT:
 		DEBUG("Authenticating directly to winbind");
+
+		FR_INTEGER_BOUND_CHECK("pool.request.per_connection_max", inst->wb_trunk_conf.max_req_per_conn, >=, 1);
+
+		MEM(inst->wb_stats = talloc_zero(inst, mschap_wb_stats_t));
+		if (fr_command_register_hook(NULL, mctx->inst->name, inst->wb_stats, cmd_table) < 0) {
+			cf_log_perr(conf, "Failed registering radmin commands");
+			return -1;
+		}
 		break;
 #endif
 	}
@@ -2283,19 +2606,49 @@ static int mod_bootstrap(module_inst_ctx_t const *mctx)
 	return 0;
 }
 
-/*
- *	Tidy up instance
+/** Start the ntlm_auth helpers, or winbind helper threads, for this worker
+ *
  */
-static int mod_detach(
-#ifndef WITH_AUTH_WINBIND
-		      UNUSED
-#endif
-		      module_detach_ctx_t const *mctx)
+static int mod_thread_instantiate(module_thread_inst_ctx_t const *mctx)
 {
+	rlm_mschap_t const	*inst = talloc_get_type_abort_const(mctx->inst->data, rlm_mschap_t);
+	rlm_mschap_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_mschap_thread_t);
+
+	t->inst = inst;
+	t->el = mctx->el;
+
+	if (inst->method == AUTH_NTLMAUTH_HELPER) {
+		t->ntlm_helper = fr_exec_helper_alloc(t, t->el, &inst->ntlm_helper, mctx->inst->name);
+		if (!t->ntlm_helper) {
+			ERROR("Unable to create ntlm_auth helper pool");
+			return -1;
+		}
+		return 0;
+	}
+
 #ifdef WITH_AUTH_WINBIND
-	rlm_mschap_t *inst = talloc_get_type_abort(mctx->inst->data, rlm_mschap_t);
+	if (inst->method != AUTH_WBCLIENT) return 0;
+
+	t->wb_trunk = mschap_wb_trunk_alloc(t);
+	if (!t->wb_trunk) {
+		ERROR("Unable to create winbind trunk");
+		return -1;
+	}
+#endif
 
-	fr_pool_free(inst->wb_pool);
+	return 0;
+}
+
+/*
+ *	Tidy up thread instance
+ */
+static int mod_thread_detach(module_thread_inst_ctx_t const *mctx)
+{
+	rlm_mschap_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_mschap_thread_t);
+
+	TALLOC_FREE(t->ntlm_helper);
+#ifdef WITH_AUTH_WINBIND
+	TALLOC_FREE(t->wb_trunk);
 #endif
 
 	return 0;
@@ -2311,7 +2664,10 @@ module_t rlm_mschap = {
 	.config		= module_config,
 	.bootstrap	= mod_bootstrap,
 	.instantiate	= mod_instantiate,
-	.detach		= mod_detach,
+	.thread_inst_size	= sizeof(rlm_mschap_thread_t),
+	.thread_inst_type	= "rlm_mschap_thread_t",
+	.thread_instantiate	= mod_thread_instantiate,
+	.thread_detach		= mod_thread_detach,
 	.methods = {
 		[MOD_AUTHENTICATE]	= mod_authenticate,
 		[MOD_AUTHORIZE]		= mod_authorize
@@ -4,18 +4,22 @@ RCSIDH(rlm_mschap_h, "$Id$")
 
 #include "config.h"
 
+#include <freeradius-devel/server/exec_helper.h>
+
 #ifdef WITH_AUTH_WINBIND
 #  include <wbclient.h>
 
-#include <freeradius-devel/server/pool.h>
+#include <freeradius-devel/server/trunk.h>
+#include <freeradius-devel/util/stdatomic.h>
 #endif
 
 /* Method of authentication we are going to use */
 typedef enum {
 	AUTH_INTERNAL		= 0,
-	AUTH_NTLMAUTH_EXEC	= 1
+	AUTH_NTLMAUTH_EXEC	= 1,
+	AUTH_NTLMAUTH_HELPER	= 2
 #ifdef WITH_AUTH_WINBIND
-	,AUTH_WBCLIENT       	= 2
+	,AUTH_WBCLIENT       	= 3
 #endif
 } MSCHAP_AUTH_METHOD;
 
@@ -49,6 +53,32 @@ extern HIDDEN fr_dict_attr_t const *attr_ms_mppe_send_key;
 extern HIDDEN fr_dict_attr_t const *attr_ms_mppe_encryption_types;
 extern HIDDEN fr_dict_attr_t const *attr_ms_chap2_cpw;
 
+#ifdef WITH_AUTH_WINBIND
+/** Number of winbind latency histogram buckets
+ *
+ * Bucket n counts authentications which took less than 2^n microseconds.
+ * The last bucket counts everything else.
+ */
+#define MSCHAP_WB_LATENCY_BUCKETS	24
+
+/** Statistics for authentications performed by winbind
+ *
+ * Shared by all threads using a module instance.
+ */
+typedef struct {
+	atomic_uint_fast64_t	requests;					//!< Authentications sent to winbind.
+	atomic_uint_fast64_t	retried;					//!< Authentications retried with a
+										///< normalised username.
+	atomic_uint_fast64_t	failed;						//!< Authentications which couldn't be
+										///< sent, or got no response.
+	atomic_int_fast64_t	in_flight;					//!< Authentications currently queued
+										///< for, or being processed by, winbind.
+	atomic_uint_fast64_t	queue_wait[MSCHAP_WB_LATENCY_BUCKETS];		//!< Time spent waiting for a
+										///< helper thread.
+	atomic_uint_fast64_t	latency[MSCHAP_WB_LATENCY_BUCKETS];		//!< Time spent in libwbclient.
+} mschap_wb_stats_t;
+#endif
+
 typedef struct {
 	fr_dict_enum_value_t	*auth_type;
 
@@ -61,6 +91,7 @@ typedef struct {
 
 	char const		*ntlm_auth;
 	fr_time_delta_t		ntlm_auth_timeout;
+	fr_exec_helper_conf_t	ntlm_helper;		//!< Persistent ntlm_auth helpers.
 	char const		*ntlm_cpw;
 	char const		*ntlm_cpw_username;
 	char const		*ntlm_cpw_domain;
@@ -72,10 +103,25 @@ typedef struct {
 	tmpl_t		*wb_username;
 	tmpl_t		*wb_domain;
 #ifdef WITH_AUTH_WINBIND
-	fr_pool_t		*wb_pool;
+	fr_trunk_conf_t		wb_trunk_conf;		//!< Limits on winbind helper threads, and
+							///< how many authentications may be in
+							///< flight on each.
 	bool			wb_retry_with_normalised_username;
+	mschap_wb_stats_t	*wb_stats;		//!< Winbind statistics.
 #endif
 #ifdef __APPLE__
 	bool			open_directory;
 #endif
 } rlm_mschap_t;
+
+/** Per-thread instance data
+ *
+ */
+typedef struct {
+	rlm_mschap_t const	*inst;		//!< Instance data.
+	fr_event_list_t		*el;		//!< This thread's event list.
+	fr_exec_helper_t	*ntlm_helper;	//!< ntlm_auth helpers, started for this thread.
+#ifdef WITH_AUTH_WINBIND
+	fr_trunk_t		*wb_trunk;	//!< Helper threads performing winbind authentications.
+#endif
+} rlm_mschap_thread_t;
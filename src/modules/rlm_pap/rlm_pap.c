@@ -29,6 +29,8 @@ USES_APPLE_DEPRECATED_API
 #include <freeradius-devel/server/base.h>
 #include <freeradius-devel/server/module.h>
 #include <freeradius-devel/server/password.h>
+#include <freeradius-devel/io/schedule.h>
+#include <freeradius-devel/unlang/module.h>
 #include <freeradius-devel/tls/base.h>
 #include <freeradius-devel/tls/log.h>
 
@@ -37,6 +39,7 @@ USES_APPLE_DEPRECATED_API
 #include <freeradius-devel/util/base16.h>
 #include <freeradius-devel/util/md5.h>
 #include <freeradius-devel/util/sha1.h>
+#include <freeradius-devel/util/stdatomic.h>
 
 #include <freeradius-devel/protocol/freeradius/freeradius.internal.password.h>
 
@@ -46,10 +49,13 @@ USES_APPLE_DEPRECATED_API
 #  include <crypt.h>
 #endif
 #include <unistd.h>	/* Contains crypt function declarations */
+#include <pthread.h>
+#include <poll.h>
 
 #ifdef HAVE_OPENSSL_EVP_H
 #  include <freeradius-devel/tls/openssl_user_macros.h>
 #  include <openssl/evp.h>
+#  include <openssl/err.h>
 #endif
 
 /*
@@ -57,10 +63,60 @@ USES_APPLE_DEPRECATED_API
  *	calls in a mutex
  */
 #ifndef HAVE_CRYPT_R
-#  include <pthread.h>
 static pthread_mutex_t fr_crypt_mutex = PTHREAD_MUTEX_INITIALIZER;
 #endif
 
+/** Password schemes expensive enough to be worth offloading
+ *
+ */
+typedef enum {
+	PAP_SCHEME_CRYPT = 0,
+	PAP_SCHEME_PBKDF2,
+	PAP_SCHEME_MAX
+} pap_scheme_t;
+
+static char const *pap_scheme_names[PAP_SCHEME_MAX] = {
+	[PAP_SCHEME_CRYPT]	= "crypt",
+	[PAP_SCHEME_PBKDF2]	= "pbkdf2"
+};
+
+/** Number of latency histogram buckets
+ *
+ * Bucket n counts hashes which took less than 2^n microseconds.
+ * The last bucket counts everything else.
+ */
+#define PAP_LATENCY_BUCKETS	24
+
+/** Statistics for offloaded hashing, and the verified credential cache
+ *
+ * Shared by all threads using a module instance.
+ */
+typedef struct {
+	atomic_uint_fast64_t	offloaded;				//!< Hashes performed by the offload pool.
+	atomic_uint_fast64_t	inline_hashed;				//!< Hashes performed by the worker thread.
+	atomic_uint_fast64_t	queue_full;				//!< Hashes performed inline because the
+									///< queue was full.
+	atomic_uint_fast64_t	cache_hits;				//!< Hashes skipped because the credentials
+									///< were recently verified.
+	atomic_uint_fast64_t	queue_wait[PAP_LATENCY_BUCKETS];	//!< Time offloaded hashes spent queued.
+	atomic_uint_fast64_t	latency[PAP_SCHEME_MAX][PAP_LATENCY_BUCKETS];	//!< Time spent hashing.
+} pap_stats_t;
+
+typedef struct pap_job_s pap_job_t;
+
+/** Pool of threads performing expensive hashes
+ *
+ */
+typedef struct {
+	pthread_mutex_t		mutex;		//!< Protects the queue.
+	pthread_cond_t		cond;		//!< Signalled when jobs are added, or on shutdown.
+	fr_dlist_head_t		queue;		//!< Jobs waiting for a thread.
+	bool			stop;		//!< Threads should exit once the queue is empty.
+
+	pthread_t		*threads;	//!< Thread handles.
+	uint32_t		num_threads;	//!< How many threads were started.
+} pap_offload_pool_t;
+
 /*
  *      Define a structure for our module configuration.
  *
@@ -71,12 +127,118 @@ static pthread_mutex_t fr_crypt_mutex = PTHREAD_MUTEX_INITIALIZER;
 typedef struct {
 	fr_dict_enum_value_t	*auth_type;
 	bool			normify;
+
+	struct {
+		uint32_t		threads;	//!< Number of hashing threads.  0 disables offloading.
+		uint32_t		max_queued;	//!< Maximum jobs waiting for a hashing thread.
+	} offload;
+
+	struct {
+		fr_time_delta_t		ttl;		//!< How long to remember verified credentials.
+		uint32_t		max_entries;	//!< Maximum credentials remembered per thread.
+	} cache;
+
+	uint8_t			cache_secret[16];	//!< Mixed into cache keys, so they can't be
+							///< used to verify guesses.
+
+	pap_offload_pool_t	*pool;			//!< Hashing threads, if offloading is enabled.
+	pap_stats_t		*stats;			//!< Offloading and cache statistics.
 } rlm_pap_t;
 
+/** Per-thread instance data
+ *
+ */
+typedef struct {
+	rlm_pap_t const		*inst;		//!< Instance data.
+	fr_event_list_t		*el;		//!< This thread's event list.
+
+	int			pipe[2];	//!< Completed jobs are written to pipe[1] by the
+						///< hashing threads, and read from pipe[0].
+	unsigned int		outstanding;	//!< Jobs submitted, and not yet returned.
+
+	fr_rb_tree_t		*cache;		//!< Recently verified credentials.
+	fr_dlist_head_t		cache_lru;	//!< Recently verified credentials, oldest first.
+} rlm_pap_thread_t;
+
+typedef void (*pap_job_func_t)(pap_job_t *job);
+
+/** An expensive hash, which may be performed by another thread
+ *
+ * Jobs aren't parented by the request, as they may outlive it if
+ * the request is cancelled whilst the job is being processed.
+ */
+struct pap_job_s {
+	fr_dlist_t		entry;		//!< Entry in the pool's queue.
+
+	pap_scheme_t		scheme;		//!< Type of hash.
+	pap_job_func_t		func;		//!< Performs the hash.  Must not access the request.
+
+	request_t		*request;	//!< Request to resume.  NULL if the request was cancelled.
+	int			fd;		//!< To write the job to when complete.
+	bool			offloaded;	//!< Whether the job was performed by the pool.
+	bool			returned;	//!< The pool has returned the job, and the request
+						///< has been marked runnable.
+
+	fr_time_t		queued;		//!< When the job was submitted.
+	fr_time_t		started;	//!< When a thread started the hash.
+	fr_time_t		finished;	//!< When the hash was complete.
+
+	bool			failed;		//!< The library couldn't perform the hash.
+	bool			match;		//!< The password matched the "known good" password.
+
+	uint8_t			key[SHA1_DIGEST_LENGTH];	//!< Verified credential cache key.
+
+	union {
+		struct {
+			char const	*password;	//!< Password to hash.
+			char const	*known_good;	//!< "known good" crypt string.
+		} crypt;
+
+#ifdef HAVE_OPENSSL_EVP_H
+		struct {
+			uint8_t const	*password;	//!< Password to hash.
+			size_t		password_len;	//!< Length of password.
+			uint8_t		*salt;		//!< Decoded salt.
+			size_t		salt_len;	//!< Length of salt.
+			uint32_t	iterations;	//!< Iterations of the hash function.
+			EVP_MD const	*md;		//!< Hash function.
+			size_t		digest_len;	//!< Length of digest.
+			uint8_t		hash[EVP_MAX_MD_SIZE];		//!< Decoded "known good" hash.
+			uint8_t		digest[EVP_MAX_MD_SIZE];	//!< Calculated hash.
+		} pbkdf2;
+#endif
+	};
+};
+
+/** Verified credential cache entry
+ *
+ */
+typedef struct {
+	fr_rb_node_t		node;		//!< Entry in the tree of cache entries.
+	fr_dlist_t		entry;		//!< Entry in the LRU list.
+	fr_time_t		expires;	//!< When the entry should no longer be used.
+	uint8_t			key[SHA1_DIGEST_LENGTH];	//!< Hash of the cache secret, and the
+								///< "known good" and supplied passwords.
+} pap_cache_entry_t;
+
 typedef unlang_action_t (*pap_auth_func_t)(rlm_rcode_t *p_result, rlm_pap_t const *inst, request_t *request, fr_pair_t const *, fr_pair_t const *);
 
+static const CONF_PARSER offload_config[] = {
+	{ FR_CONF_OFFSET("threads", FR_TYPE_UINT32, rlm_pap_t, offload.threads), .dflt = "0" },
+	{ FR_CONF_OFFSET("max_queued", FR_TYPE_UINT32, rlm_pap_t, offload.max_queued), .dflt = "1024" },
+	CONF_PARSER_TERMINATOR
+};
+
+static const CONF_PARSER cache_config[] = {
+	{ FR_CONF_OFFSET("ttl", FR_TYPE_TIME_DELTA, rlm_pap_t, cache.ttl), .dflt = "0" },
+	{ FR_CONF_OFFSET("max_entries", FR_TYPE_UINT32, rlm_pap_t, cache.max_entries), .dflt = "1024" },
+	CONF_PARSER_TERMINATOR
+};
+
 static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("normalise", FR_TYPE_BOOL, rlm_pap_t, normify), .dflt = "yes" },
+	{ FR_CONF_POINTER("offload", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) offload_config },
+	{ FR_CONF_POINTER("cache", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) cache_config },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -129,6 +291,408 @@ static size_t pbkdf2_passlib_names_len = NUM_ELEMENTS(pbkdf2_passlib_names);
 
 static fr_dict_attr_t const **pap_alloweds;
 
+/** Record how long something took in a latency histogram
+ *
+ */
+static inline CC_HINT(always_inline)
+void pap_latency_record(atomic_uint_fast64_t histogram[PAP_LATENCY_BUCKETS], fr_time_delta_t delta)
+{
+	int64_t		usec = fr_time_delta_to_usec(delta);
+	unsigned int	i;
+
+	for (i = 0; i < (PAP_LATENCY_BUCKETS - 1); i++) if (usec < ((int64_t)1 << i)) break;
+
+	atomic_fetch_add_explicit(&histogram[i], 1, memory_order_relaxed);
+}
+
+static int8_t pap_cache_cmp(void const *one, void const *two)
+{
+	pap_cache_entry_t const *a = one, *b = two;
+	int ret;
+
+	ret = memcmp(a->key, b->key, sizeof(a->key));
+	return CMP(ret, 0);
+}
+
+/** Calculate the verified credential cache key for a pair of passwords
+ *
+ */
+static void pap_cache_key(uint8_t key[static SHA1_DIGEST_LENGTH], rlm_pap_t const *inst,
+			  fr_pair_t const *known_good, fr_pair_t const *password)
+{
+	fr_sha1_ctx	sha1_context;
+	uint32_t	attr = htonl(known_good->da->attr);
+	uint32_t	len = htonl((uint32_t)known_good->vp_length);
+
+	fr_sha1_init(&sha1_context);
+	fr_sha1_update(&sha1_context, inst->cache_secret, sizeof(inst->cache_secret));
+	fr_sha1_update(&sha1_context, (uint8_t const *)&attr, sizeof(attr));
+	fr_sha1_update(&sha1_context, (uint8_t const *)&len, sizeof(len));
+	fr_sha1_update(&sha1_context, known_good->vp_octets, known_good->vp_length);
+	fr_sha1_update(&sha1_context, password->vp_octets, password->vp_length);
+	fr_sha1_final(key, &sha1_context);
+}
+
+/** Remove expired entries, and the oldest entries if there are too many
+ *
+ * All entries have the same TTL, so the LRU list is in expiry order.
+ */
+static void pap_cache_trim(rlm_pap_thread_t *t, fr_time_t now)
+{
+	pap_cache_entry_t	*entry;
+
+	while ((entry = fr_dlist_head(&t->cache_lru))) {
+		if (fr_time_lt(now, entry->expires) &&
+		    (fr_dlist_num_elements(&t->cache_lru) <= t->inst->cache.max_entries)) break;
+
+		fr_dlist_remove(&t->cache_lru, entry);
+		fr_rb_remove(t->cache, entry);
+		talloc_free(entry);
+	}
+}
+
+/** Check whether credentials were recently verified
+ *
+ */
+static bool pap_cache_find(rlm_pap_thread_t *t, uint8_t const key[static SHA1_DIGEST_LENGTH])
+{
+	pap_cache_entry_t	find;
+
+	if (!t->cache) return false;
+
+	pap_cache_trim(t, fr_time());
+
+	memcpy(find.key, key, sizeof(find.key));
+	return (fr_rb_find(t->cache, &find) != NULL);
+}
+
+/** Record that credentials were verified
+ *
+ */
+static void pap_cache_insert(rlm_pap_thread_t *t, uint8_t const key[static SHA1_DIGEST_LENGTH])
+{
+	pap_cache_entry_t	*entry, find;
+	fr_time_t		now = fr_time();
+
+	if (!t->cache) return;
+
+	memcpy(find.key, key, sizeof(find.key));
+	entry = fr_rb_find(t->cache, &find);
+	if (entry) {
+		fr_dlist_remove(&t->cache_lru, entry);
+	} else {
+		MEM(entry = talloc_zero(t->cache, pap_cache_entry_t));
+		memcpy(entry->key, key, sizeof(entry->key));
+		fr_rb_insert(t->cache, entry);
+	}
+	entry->expires = fr_time_add(now, t->inst->cache.ttl);
+	fr_dlist_insert_tail(&t->cache_lru, entry);
+
+	pap_cache_trim(t, now);
+}
+
+/** Allocate a new hashing job
+ *
+ */
+static pap_job_t *pap_job_alloc(pap_scheme_t scheme, pap_job_func_t func)
+{
+	pap_job_t	*job;
+
+	MEM(job = talloc_zero(NULL, pap_job_t));
+	job->scheme = scheme;
+	job->func = func;
+
+	return job;
+}
+
+/** Perform a job's hash, recording how long it took
+ *
+ */
+static inline CC_HINT(always_inline)
+void pap_job_exec(pap_job_t *job)
+{
+	job->started = fr_time();
+	job->func(job);
+	job->finished = fr_time();
+}
+
+/** Hashing thread
+ *
+ * Performs jobs from the queue, writing them back to the pipe of the
+ * worker which submitted them.
+ *
+ * @note We rely on writes to a pipe of less than PIPE_BUF bytes being
+ *	atomic, as many hashing threads write to each pipe.
+ */
+static void *pap_offload_thread(void *arg)
+{
+	pap_offload_pool_t	*pool = arg;
+	pap_job_t		*job;
+
+	pthread_mutex_lock(&pool->mutex);
+	for (;;) {
+		while (!(job = fr_dlist_pop_head(&pool->queue))) {
+			if (pool->stop) {
+				pthread_mutex_unlock(&pool->mutex);
+				return NULL;
+			}
+			pthread_cond_wait(&pool->cond, &pool->mutex);
+		}
+		pthread_mutex_unlock(&pool->mutex);
+
+		pap_job_exec(job);
+
+		while (write(job->fd, &job, sizeof(job)) < 0) {
+			if (errno == EINTR) continue;
+
+			/*
+			 *	Nothing can be done, the job is lost,
+			 *	and so is the request waiting on it.
+			 */
+			ERROR("Failed returning password hashing job: %s", fr_syserror(errno));
+			break;
+		}
+
+		pthread_mutex_lock(&pool->mutex);
+	}
+}
+
+/** Submit a job to the pool
+ *
+ * @return
+ *	- 0 on success.
+ *	- -1 if there's no pool, or its queue is full.
+ */
+static int pap_offload_submit(rlm_pap_thread_t *t, pap_job_t *job)
+{
+	pap_offload_pool_t	*pool = t->inst->pool;
+
+	if (!pool) return -1;
+
+	pthread_mutex_lock(&pool->mutex);
+	if (fr_dlist_num_elements(&pool->queue) >= t->inst->offload.max_queued) {
+		pthread_mutex_unlock(&pool->mutex);
+		atomic_fetch_add_explicit(&t->inst->stats->queue_full, 1, memory_order_relaxed);
+		return -1;
+	}
+
+	job->fd = t->pipe[1];
+	job->offloaded = true;
+	job->queued = fr_time();
+	fr_dlist_insert_tail(&pool->queue, job);
+
+	pthread_cond_signal(&pool->cond);
+	pthread_mutex_unlock(&pool->mutex);
+
+	t->outstanding++;
+
+	return 0;
+}
+
+/** Record statistics for a completed job
+ *
+ */
+static void pap_job_complete(rlm_pap_thread_t *t, pap_job_t *job)
+{
+	pap_stats_t	*stats = t->inst->stats;
+
+	if (job->offloaded) {
+		atomic_fetch_add_explicit(&stats->offloaded, 1, memory_order_relaxed);
+		pap_latency_record(stats->queue_wait, fr_time_sub(job->started, job->queued));
+	} else {
+		atomic_fetch_add_explicit(&stats->inline_hashed, 1, memory_order_relaxed);
+	}
+	pap_latency_record(stats->latency[job->scheme], fr_time_sub(job->finished, job->started));
+}
+
+/** Read completed jobs returned by the hashing threads
+ *
+ */
+static void _pap_offload_read(UNUSED fr_event_list_t *el, int fd, UNUSED int flags, void *uctx)
+{
+	rlm_pap_thread_t	*t = talloc_get_type_abort(uctx, rlm_pap_thread_t);
+	pap_job_t		*job;
+	ssize_t			len;
+
+	for (;;) {
+		len = read(fd, &job, sizeof(job));
+		if (len < 0) {
+			if (errno == EINTR) continue;
+			if ((errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+				ERROR("Failed reading password hashing jobs: %s", fr_syserror(errno));
+			}
+			return;
+		}
+		if (len == 0) return;
+
+		if (len != sizeof(job)) {
+			ERROR("Password hashing job pointer too short, expected %zu bytes, got %zd bytes",
+			      sizeof(job), len);
+			return;
+		}
+
+		t->outstanding--;
+		pap_job_complete(t, job);
+
+		/*
+		 *	The request was cancelled whilst
+		 *	the job was being processed.
+		 */
+		if (!job->request) {
+			talloc_free(job);
+			continue;
+		}
+
+		job->returned = true;
+		unlang_interpret_mark_runnable(job->request);
+	}
+}
+
+static void _pap_offload_error(UNUSED fr_event_list_t *el, int fd, UNUSED int flags, int fd_errno, UNUSED void *uctx)
+{
+	ERROR("Password hashing job pipe (%i) failed: %s", fd, fr_syserror(fd_errno));
+}
+
+/** Convert the result of a job into an rcode, logging any failure
+ *
+ */
+static rlm_rcode_t pap_job_result(rlm_pap_thread_t *t, request_t *request, pap_job_t *job)
+{
+	rlm_rcode_t	rcode;
+
+	if (job->failed) {
+		rcode = RLM_MODULE_INVALID;
+	} else if (job->match) {
+		rcode = RLM_MODULE_OK;
+		pap_cache_insert(t, job->key);
+	} else {
+		rcode = RLM_MODULE_REJECT;
+	}
+
+	switch (job->scheme) {
+	case PAP_SCHEME_CRYPT:
+		if (rcode == RLM_MODULE_REJECT) REDEBUG("Crypt digest does not match \"known good\" digest");
+		break;
+
+#ifdef HAVE_OPENSSL_EVP_H
+	case PAP_SCHEME_PBKDF2:
+		if (job->failed) {
+			/*
+			 *	The OpenSSL error stack belongs
+			 *	to the hashing thread.
+			 */
+			if (job->offloaded) {
+				REDEBUG("PBKDF2 digest failure");
+			} else {
+				fr_tls_log_error(request, "PBKDF2 digest failure");
+			}
+			break;
+		}
+
+		if (rcode == RLM_MODULE_REJECT) {
+			REDEBUG("PBKDF2 digest does not match \"known good\" digest");
+			REDEBUG3("Salt       : %pH", fr_box_octets(job->pbkdf2.salt, job->pbkdf2.salt_len));
+			REDEBUG3("Calculated : %pH", fr_box_octets(job->pbkdf2.digest, job->pbkdf2.digest_len));
+			REDEBUG3("Expected   : %pH", fr_box_octets(job->pbkdf2.hash, job->pbkdf2.digest_len));
+		}
+		break;
+#endif
+
+	default:
+		break;
+	}
+
+	talloc_free(job);
+
+	return rcode;
+}
+
+/** Log the final result of a PAP authentication attempt
+ *
+ */
+static unlang_action_t pap_auth_done(rlm_rcode_t *p_result, request_t *request, rlm_rcode_t rcode)
+{
+	switch (rcode) {
+	case RLM_MODULE_REJECT:
+		REDEBUG("Password incorrect");
+		break;
+
+	case RLM_MODULE_OK:
+		RDEBUG2("User authenticated successfully");
+		break;
+
+	default:
+		break;
+	}
+
+	RETURN_MODULE_RCODE(rcode);
+}
+
+static unlang_action_t pap_job_resume(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
+{
+	rlm_pap_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_pap_thread_t);
+	pap_job_t		*job = talloc_get_type_abort(mctx->rctx, pap_job_t);
+
+	return pap_auth_done(p_result, request, pap_job_result(t, request, job));
+}
+
+/** Detach a job from a cancelled request
+ *
+ * If the job has already been returned, pap_job_resume() will never
+ * run, so the job is freed here.  Otherwise it's freed by
+ * _pap_offload_read() when a hashing thread returns it.
+ */
+static void pap_job_signal(module_ctx_t const *mctx, UNUSED request_t *request, fr_state_signal_t action)
+{
+	pap_job_t		*job = talloc_get_type_abort(mctx->rctx, pap_job_t);
+
+	if (action != FR_SIGNAL_CANCEL) return;
+
+	if (job->returned) {
+		talloc_free(job);
+		return;
+	}
+
+	job->request = NULL;
+}
+
+/** Perform a job's hash, offloading it if possible
+ *
+ * If the credentials were verified recently, the hash is skipped.
+ *
+ * @return
+ *	- UNLANG_ACTION_YIELD if the job was offloaded.  pap_job_resume()
+ *	  will be called to finish the authentication.
+ *	- UNLANG_ACTION_CALCULATE_RESULT if the hash was performed inline.
+ */
+static unlang_action_t pap_job_run(rlm_rcode_t *p_result, rlm_pap_t const *inst, request_t *request,
+				   pap_job_t *job, fr_pair_t const *known_good, fr_pair_t const *password)
+{
+	rlm_pap_thread_t	*t = talloc_get_type_abort(module_thread_by_data(inst)->data, rlm_pap_thread_t);
+
+	if (t->cache) {
+		pap_cache_key(job->key, inst, known_good, password);
+
+		if (pap_cache_find(t, job->key)) {
+			RDEBUG2("Password matches recently verified credentials");
+			atomic_fetch_add_explicit(&inst->stats->cache_hits, 1, memory_order_relaxed);
+			talloc_free(job);
+			RETURN_MODULE_OK;
+		}
+	}
+
+	if (pap_offload_submit(t, job) == 0) {
+		RDEBUG2("Offloading %s hash", pap_scheme_names[job->scheme]);
+		job->request = request;
+		return unlang_module_yield(request, pap_job_resume, pap_job_signal, job);
+	}
+
+	pap_job_exec(job);
+	pap_job_complete(t, job);
+
+	RETURN_MODULE_RCODE(pap_job_result(t, request, job));
+}
+
 /*
  *	Authorize the user for PAP authentication.
  *
@@ -181,9 +745,11 @@ static unlang_action_t CC_HINT(nonnull) pap_auth_clear(rlm_rcode_t *p_result,
 }
 
 #ifdef HAVE_CRYPT
-static unlang_action_t CC_HINT(nonnull) pap_auth_crypt(rlm_rcode_t *p_result,
-						       UNUSED rlm_pap_t const *inst, request_t *request,
-						       fr_pair_t const *known_good, fr_pair_t const *password)
+/** Compare a password with a crypt string
+ *
+ * May be called by a hashing thread.
+ */
+static void pap_job_crypt(pap_job_t *job)
 {
 	char	*crypt_out;
 	int	cmp = 0;
@@ -191,33 +757,38 @@ static unlang_action_t CC_HINT(nonnull) pap_auth_crypt(rlm_rcode_t *p_result,
 #ifdef HAVE_CRYPT_R
 	struct crypt_data crypt_data = { .initialized = 0 };
 
-	crypt_out = crypt_r(password->vp_strvalue, known_good->vp_strvalue, &crypt_data);
-	if (crypt_out) cmp = strcmp(known_good->vp_strvalue, crypt_out);
+	crypt_out = crypt_r(job->crypt.password, job->crypt.known_good, &crypt_data);
+	if (crypt_out) cmp = strcmp(job->crypt.known_good, crypt_out);
 #else
 	/*
 	 *	Ensure we're thread-safe, as crypt() isn't.
 	 */
 	pthread_mutex_lock(&fr_crypt_mutex);
-	crypt_out = crypt(password->vp_strvalue, known_good->vp_strvalue);
+	crypt_out = crypt(job->crypt.password, job->crypt.known_good);
 
 	/*
 	 *	Got something, check it within the lock.  This is
 	 *	faster than copying it to a local buffer, and the
 	 *	time spent within the lock is critical.
 	 */
-	if (crypt_out) cmp = strcmp(known_good->vp_strvalue, crypt_out);
+	if (crypt_out) cmp = strcmp(job->crypt.known_good, crypt_out);
 	pthread_mutex_unlock(&fr_crypt_mutex);
 #endif
 
-	/*
-	 *	Error.
-	 */
-	if (!crypt_out || (cmp != 0)) {
-		REDEBUG("Crypt digest does not match \"known good\" digest");
-		RETURN_MODULE_REJECT;
-	}
+	job->match = (crypt_out && (cmp == 0));
+}
 
-	RETURN_MODULE_OK;
+static unlang_action_t CC_HINT(nonnull) pap_auth_crypt(rlm_rcode_t *p_result,
+						       rlm_pap_t const *inst, request_t *request,
+						       fr_pair_t const *known_good, fr_pair_t const *password)
+{
+	pap_job_t	*job;
+
+	job = pap_job_alloc(PAP_SCHEME_CRYPT, pap_job_crypt);
+	MEM(job->crypt.password = talloc_bstrndup(job, password->vp_strvalue, password->vp_length));
+	MEM(job->crypt.known_good = talloc_bstrndup(job, known_good->vp_strvalue, known_good->vp_length));
+
+	return pap_job_run(p_result, inst, request, job, known_good, password);
 }
 #endif
 
@@ -431,10 +1002,35 @@ PAP_AUTH_EVP_MD(pap_auth_evp_md_salted, pap_auth_ssha3_384, "SSHA3-384", EVP_sha
 PAP_AUTH_EVP_MD(pap_auth_evp_md_salted, pap_auth_ssha3_512, "SSHA3-512", EVP_sha3_512())
 #  endif
 
+/** Compare a password with a PBKDF2 hash
+ *
+ * May be called by a hashing thread.
+ */
+static void pap_job_pbkdf2(pap_job_t *job)
+{
+	if (PKCS5_PBKDF2_HMAC((char const *)job->pbkdf2.password, (int)job->pbkdf2.password_len,
+			      (unsigned char const *)job->pbkdf2.salt, (int)job->pbkdf2.salt_len,
+			      (int)job->pbkdf2.iterations,
+			      job->pbkdf2.md,
+			      (int)job->pbkdf2.digest_len, (unsigned char *)job->pbkdf2.digest) == 0) {
+		/*
+		 *	Errors can't be logged from here, so
+		 *	don't leave them for the next caller.
+		 */
+		if (job->offloaded) ERR_clear_error();
+		job->failed = true;
+		return;
+	}
+
+	job->match = (fr_digest_cmp(job->pbkdf2.digest, job->pbkdf2.hash, job->pbkdf2.digest_len) == 0);
+}
+
 /** Validates Crypt::PBKDF2 LDAP format strings
  *
  * @param[out] p_result		The result of comparing the pbkdf2 hash with the password.
+ * @param[in] inst		Module instance.
  * @param[in] request		The current request.
+ * @param[in] known_good	The "known good" password, used to identify verified credentials.
  * @param[in] str		Raw PBKDF2 string.
  * @param[in] len		Length of string.
  * @param[in] hash_names	Table containing valid hash names.
@@ -445,11 +1041,13 @@ PAP_AUTH_EVP_MD(pap_auth_evp_md_salted, pap_auth_ssha3_512, "SSHA3-512", EVP_sha
  * @param[in] iter_is_base64	Whether the iterations is are encoded as base64.
  * @param[in] password		to validate.
  * @return
+ *	- RLM_MODULE_INVALID
  *	- RLM_MODULE_REJECT
  *	- RLM_MODULE_OK
  */
 static inline CC_HINT(nonnull) unlang_action_t pap_auth_pbkdf2_parse(rlm_rcode_t *p_result,
-								     request_t *request, const uint8_t *str, size_t len,
+								     rlm_pap_t const *inst, request_t *request,
+								     fr_pair_t const *known_good, const uint8_t *str, size_t len,
 								     fr_table_num_sorted_t const hash_names[], size_t hash_names_len,
 								     char scheme_sep, char iter_sep, char salt_sep,
 								     bool iter_is_base64, fr_pair_t const *password)
@@ -468,7 +1066,8 @@ static inline CC_HINT(nonnull) unlang_action_t pap_auth_pbkdf2_parse(rlm_rcode_t
 	uint8_t			*salt = NULL;
 	size_t			salt_len;
 	uint8_t			hash[EVP_MAX_MD_SIZE];
-	uint8_t			digest[EVP_MAX_MD_SIZE];
+
+	pap_job_t		*job;
 
 	RDEBUG2("Comparing with \"known-good\" PBKDF2-Password");
 
@@ -646,24 +1245,17 @@ static inline CC_HINT(nonnull) unlang_action_t pap_auth_pbkdf2_parse(rlm_rcode_t
 	/*
 	 *	Hash and compare
 	 */
-	if (PKCS5_PBKDF2_HMAC((char const *)password->vp_octets, (int)password->vp_length,
-			      (unsigned char const *)salt, (int)salt_len,
-			      (int)iterations,
-			      evp_md,
-			      (int)digest_len, (unsigned char *)digest) == 0) {
-		fr_tls_log_error(request, "PBKDF2 digest failure");
-		goto finish;
-	}
-
-	if (fr_digest_cmp(digest, hash, (size_t)digest_len) != 0) {
-		REDEBUG("PBKDF2 digest does not match \"known good\" digest");
-		REDEBUG3("Salt       : %pH", fr_box_octets(salt, salt_len));
-		REDEBUG3("Calculated : %pH", fr_box_octets(digest, digest_len));
-		REDEBUG3("Expected   : %pH", fr_box_octets(hash, slen));
-		rcode = RLM_MODULE_REJECT;
-	} else {
-		rcode = RLM_MODULE_OK;
-	}
+	job = pap_job_alloc(PAP_SCHEME_PBKDF2, pap_job_pbkdf2);
+	MEM(job->pbkdf2.password = talloc_memdup(job, password->vp_octets, password->vp_length));
+	job->pbkdf2.password_len = password->vp_length;
+	job->pbkdf2.salt = talloc_steal(job, salt);
+	job->pbkdf2.salt_len = salt_len;
+	job->pbkdf2.iterations = iterations;
+	job->pbkdf2.md = evp_md;
+	job->pbkdf2.digest_len = digest_len;
+	memcpy(job->pbkdf2.hash, hash, digest_len);
+
+	return pap_job_run(p_result, inst, request, job, known_good, password);
 
 finish:
 	talloc_free(salt);
@@ -672,7 +1264,7 @@ finish:
 }
 
 static inline unlang_action_t CC_HINT(nonnull) pap_auth_pbkdf2(rlm_rcode_t *p_result,
-							       UNUSED rlm_pap_t const *inst,
+							       rlm_pap_t const *inst,
 							       request_t *request,
 							       fr_pair_t const *known_good, fr_pair_t const *password)
 {
@@ -697,7 +1289,7 @@ static inline unlang_action_t CC_HINT(nonnull) pap_auth_pbkdf2(rlm_rcode_t *p_re
 			q = memchr(p, '}', end - p);
 			p = q + 1;
 		}
-		return pap_auth_pbkdf2_parse(p_result, request, p, end - p,
+		return pap_auth_pbkdf2_parse(p_result, inst, request, known_good, p, end - p,
 					     pbkdf2_crypt_names, pbkdf2_crypt_names_len,
 					     ':', ':', ':', true, password);
 	}
@@ -709,7 +1301,7 @@ static inline unlang_action_t CC_HINT(nonnull) pap_auth_pbkdf2(rlm_rcode_t *p_re
 	 */
 	if ((size_t)(end - p) >= sizeof("$PBKDF2$") && (memcmp(p, "$PBKDF2$", sizeof("$PBKDF2$") - 1) == 0)) {
 		p += sizeof("$PBKDF2$") - 1;
-		return pap_auth_pbkdf2_parse(p_result, request, p, end - p,
+		return pap_auth_pbkdf2_parse(p_result, inst, request, known_good, p, end - p,
 					     pbkdf2_crypt_names, pbkdf2_crypt_names_len,
 					     ':', ':', '$', false, password);
 	}
@@ -723,7 +1315,7 @@ static inline unlang_action_t CC_HINT(nonnull) pap_auth_pbkdf2(rlm_rcode_t *p_re
 	 */
 	if ((size_t)(end - p) >= sizeof("$pbkdf2-") && (memcmp(p, "$pbkdf2-", sizeof("$pbkdf2-") - 1) == 0)) {
 		p += sizeof("$pbkdf2-") - 1;
-		return pap_auth_pbkdf2_parse(p_result, request, p, end - p,
+		return pap_auth_pbkdf2_parse(p_result, inst, request, known_good, p, end - p,
 					     pbkdf2_passlib_names, pbkdf2_passlib_names_len,
 					     '$', '$', '$', false, password);
 	}
@@ -926,6 +1518,7 @@ static unlang_action_t CC_HINT(nonnull) mod_authenticate(rlm_rcode_t *p_result,
 	rlm_rcode_t		rcode = RLM_MODULE_INVALID;
 	pap_auth_func_t		auth_func;
 	bool			ephemeral;
+	unlang_action_t		action;
 
 	password = fr_pair_find_by_da_idx(&request->request_pairs, attr_user, 0);
 	if (!password) {
@@ -974,28 +1567,98 @@ static unlang_action_t CC_HINT(nonnull) mod_authenticate(rlm_rcode_t *p_result,
 
 	/*
 	 *	Authenticate, and return.
+	 *
+	 *	Expensive hashes may be offloaded, in which
+	 *	case pap_job_resume() finishes up.
 	 */
-	auth_func(&rcode, inst, request, known_good, password);
+	action = auth_func(&rcode, inst, request, known_good, password);
 	if (ephemeral) TALLOC_FREE(known_good);
-	switch (rcode) {
-	case RLM_MODULE_REJECT:
-		REDEBUG("Password incorrect");
-		break;
+	if (action == UNLANG_ACTION_YIELD) return action;
 
-	case RLM_MODULE_OK:
-		RDEBUG2("User authenticated successfully");
-		break;
+	return pap_auth_done(p_result, request, rcode);
+}
 
-	default:
-		break;
+static int cmd_stats_offload(FILE *fp, UNUSED FILE *fp_err, void *ctx, UNUSED fr_cmd_info_t const *info)
+{
+	pap_stats_t	*stats = ctx;
+	unsigned int	i, j;
+
+	fprintf(fp, "offloaded			%" PRIu64 "\n", (uint64_t)atomic_load(&stats->offloaded));
+	fprintf(fp, "inline			%" PRIu64 "\n", (uint64_t)atomic_load(&stats->inline_hashed));
+	fprintf(fp, "queue_full			%" PRIu64 "\n", (uint64_t)atomic_load(&stats->queue_full));
+	fprintf(fp, "cache_hits			%" PRIu64 "\n", (uint64_t)atomic_load(&stats->cache_hits));
+
+	/*
+	 *	Empty buckets are omitted to keep the output readable
+	 */
+	for (i = 0; i < PAP_LATENCY_BUCKETS; i++) {
+		uint64_t count = atomic_load(&stats->queue_wait[i]);
+
+		if (!count) continue;
+		if (i == (PAP_LATENCY_BUCKETS - 1)) {
+			fprintf(fp, "queue_wait.inf		%" PRIu64 "\n", count);
+		} else {
+			fprintf(fp, "queue_wait.lt_%" PRIu64 "us	%" PRIu64 "\n", (uint64_t)1 << i, count);
+		}
 	}
 
-	RETURN_MODULE_RCODE(rcode);
+	for (i = 0; i < PAP_SCHEME_MAX; i++) {
+		for (j = 0; j < PAP_LATENCY_BUCKETS; j++) {
+			uint64_t count = atomic_load(&stats->latency[i][j]);
+
+			if (!count) continue;
+			if (j == (PAP_LATENCY_BUCKETS - 1)) {
+				fprintf(fp, "latency.%s.inf		%" PRIu64 "\n", pap_scheme_names[i], count);
+			} else {
+				fprintf(fp, "latency.%s.lt_%" PRIu64 "us	%" PRIu64 "\n",
+					pap_scheme_names[i], (uint64_t)1 << j, count);
+			}
+		}
+	}
+
+	return 0;
+}
+
+static fr_cmd_table_t cmd_table[] = {
+	{
+		.parent = "stats module",
+		.add_name = true,
+		.name = "offload",
+		.func = cmd_stats_offload,
+		.help = "Show statistics for offloaded password hashing, and the verified credential cache.",
+		.read_only = true
+	},
+
+	CMD_TABLE_END
+};
+
+/** Stop the hashing threads
+ *
+ * Jobs still in the queue are processed first.
+ */
+static int _pap_offload_pool_free(pap_offload_pool_t *pool)
+{
+	uint32_t	i;
+
+	pthread_mutex_lock(&pool->mutex);
+	pool->stop = true;
+	pthread_cond_broadcast(&pool->cond);
+	pthread_mutex_unlock(&pool->mutex);
+
+	for (i = 0; i < pool->num_threads; i++) pthread_join(pool->threads[i], NULL);
+
+	pthread_cond_destroy(&pool->cond);
+	pthread_mutex_destroy(&pool->mutex);
+
+	return 0;
 }
 
 static int mod_instantiate(module_inst_ctx_t const *mctx)
 {
-	rlm_pap_t	*inst = talloc_get_type_abort(mctx->inst->data, rlm_pap_t);
+	rlm_pap_t		*inst = talloc_get_type_abort(mctx->inst->data, rlm_pap_t);
+	CONF_SECTION		*conf = mctx->inst->conf;
+	pap_offload_pool_t	*pool;
+	size_t			i;
 
 	inst->auth_type = fr_dict_enum_by_name(attr_auth_type, mctx->inst->name, -1);
 	if (!inst->auth_type) {
@@ -1003,6 +1666,116 @@ static int mod_instantiate(module_inst_ctx_t const *mctx)
 		     mctx->inst->name);
 	}
 
+	MEM(inst->stats = talloc_zero(inst, pap_stats_t));
+
+	for (i = 0; i < sizeof(inst->cache_secret); i += sizeof(uint32_t)) {
+		uint32_t r = fr_rand();
+
+		memcpy(inst->cache_secret + i, &r, sizeof(r));
+	}
+
+	if (inst->offload.threads > 0) {
+		FR_INTEGER_BOUND_CHECK("offload.threads", inst->offload.threads, <=, 256);
+		FR_INTEGER_BOUND_CHECK("offload.max_queued", inst->offload.max_queued, >=, 1);
+
+		MEM(pool = talloc_zero(inst, pap_offload_pool_t));
+		pthread_mutex_init(&pool->mutex, NULL);
+		pthread_cond_init(&pool->cond, NULL);
+		fr_dlist_init(&pool->queue, pap_job_t, entry);
+		MEM(pool->threads = talloc_array(pool, pthread_t, inst->offload.threads));
+		talloc_set_destructor(pool, _pap_offload_pool_free);
+		inst->pool = pool;
+
+		for (i = 0; i < inst->offload.threads; i++) {
+			if (fr_schedule_pthread_create(&pool->threads[i], pap_offload_thread, pool) < 0) {
+				cf_log_perr(conf, "Failed starting password hashing thread");
+				return -1;
+			}
+			pool->num_threads++;
+		}
+	}
+
+	if ((inst->offload.threads > 0) || fr_time_delta_ispos(inst->cache.ttl)) {
+		if (fr_command_register_hook(NULL, mctx->inst->name, inst->stats, cmd_table) < 0) {
+			cf_log_perr(conf, "Failed registering radmin commands");
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/** Create the pipe hashing threads return jobs on, and the verified credential cache
+ *
+ */
+static int mod_thread_instantiate(module_thread_inst_ctx_t const *mctx)
+{
+	rlm_pap_t const		*inst = talloc_get_type_abort_const(mctx->inst->data, rlm_pap_t);
+	rlm_pap_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_pap_thread_t);
+
+	t->inst = inst;
+	t->el = mctx->el;
+	t->pipe[0] = t->pipe[1] = -1;
+
+	if (fr_time_delta_ispos(inst->cache.ttl) && (inst->cache.max_entries > 0)) {
+		MEM(t->cache = fr_rb_inline_talloc_alloc(t, pap_cache_entry_t, node, pap_cache_cmp, NULL));
+		fr_dlist_talloc_init(&t->cache_lru, pap_cache_entry_t, entry);
+	}
+
+	if (!inst->pool) return 0;
+
+	if (pipe(t->pipe) < 0) {
+		ERROR("Failed creating password hashing job pipe: %s", fr_syserror(errno));
+		return -1;
+	}
+
+	if (fr_nonblock(t->pipe[0]) < 0) {
+		PERROR("Failed setting password hashing job pipe to non-blocking");
+	error:
+		close(t->pipe[0]);
+		close(t->pipe[1]);
+		t->pipe[0] = t->pipe[1] = -1;
+		return -1;
+	}
+
+	if (fr_event_fd_insert(t, t->el, t->pipe[0], _pap_offload_read, NULL, _pap_offload_error, t) < 0) {
+		PERROR("Failed listening on password hashing job pipe");
+		goto error;
+	}
+
+	return 0;
+}
+
+/** Wait for outstanding jobs, and close the pipe
+ *
+ * Jobs reference the pipe, so it can't be closed until all the
+ * jobs this thread submitted have been returned.
+ */
+static int mod_thread_detach(module_thread_inst_ctx_t const *mctx)
+{
+	rlm_pap_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_pap_thread_t);
+	pap_job_t		*job;
+	ssize_t			len;
+
+	if (t->pipe[0] < 0) return 0;
+
+	(void) fr_event_fd_delete(t->el, t->pipe[0], FR_EVENT_FILTER_IO);
+
+	while (t->outstanding > 0) {
+		struct pollfd pfd = { .fd = t->pipe[0], .events = POLLIN };
+
+		if ((poll(&pfd, 1, -1) < 0) && (errno != EINTR)) break;
+
+		len = read(t->pipe[0], &job, sizeof(job));
+		if (len != sizeof(job)) continue;
+
+		t->outstanding--;
+		talloc_free(job);
+	}
+
+	close(t->pipe[0]);
+	close(t->pipe[1]);
+
 	return 0;
 }
 
@@ -1080,6 +1853,10 @@ module_t rlm_pap = {
 	.unload		= mod_unload,
 	.config		= module_config,
 	.instantiate	= mod_instantiate,
+	.thread_inst_size	= sizeof(rlm_pap_thread_t),
+	.thread_inst_type	= "rlm_pap_thread_t",
+	.thread_instantiate	= mod_thread_instantiate,
+	.thread_detach		= mod_thread_detach,
 	.methods = {
 		[MOD_AUTHENTICATE]	= mod_authenticate,
 		[MOD_AUTHORIZE]		= mod_authorize
@@ -40,6 +40,13 @@ RCSID("$Id$")
 #include <libgen.h>
 #include <dlfcn.h>
 
+/*
+ *	Python 3.12 (PEP 684) allows sub-interpreters to have their own GIL
+ */
+#if PY_VERSION_HEX >= 0x030C0000
+#  define PYTHON_HAVE_OWN_GIL 1
+#endif
+
 /** Specifies the module.function to load for processing a section
  *
  */
@@ -62,7 +69,9 @@ typedef struct {
 							///< rlm_python module config in the python path.
 	bool		python_path_include_default;	//!< Include the default python path
 							///< in the python path.
+	bool		per_thread_interpreter;	//!< Give each worker thread its own interpreter and GIL.
 	PyObject	*module;		//!< Local, interpreter specific module.
+	PyTypeObject	*pair_list_type;	//!< Type used to present request pairs to the interpreter.
 
 	python_func_def_t
 	instantiate,
@@ -81,34 +90,57 @@ typedef struct {
  *
  * Multiple instances of python create multiple interpreters and each
  * thread must have a PyThreadState per interpreter, to track execution.
+ *
+ * If per_thread_interpreter is enabled, the thread state instead belongs
+ * to an interpreter (with its own GIL) which only this thread uses, and
+ * the module, type and function references are that interpreter's copies.
+ * Otherwise they're borrowed from the instance.
  */
 typedef struct {
 	PyThreadState	*state;			//!< Module instance/thread specific state.
+	PyObject	*module;		//!< freeradius module in this thread's interpreter.
+	PyTypeObject	*pair_list_type;	//!< Type used to present request pairs to this thread's interpreter.
+
+	python_func_def_t
+	instantiate,
+	authorize,
+	authenticate,
+	preacct,
+	accounting,
+	post_auth,
+	detach;
 } rlm_python_thread_t;
 
+/** Lazily marshalled view of a request's pairs
+ *
+ * Passed to python functions in place of a tuple of (name, value) tuples.
+ * It supports the same sequence operations, but only converts the pairs
+ * a function actually looks at.
+ */
+typedef struct {
+	PyObject_HEAD
+	module_ctx_t const	*mctx;		//!< For logging marshalling errors.
+	request_t		*request;	//!< Request the pairs belong to.  NULL once the call returns.
+	fr_pair_t		**vps;		//!< Pairs in the list when the call was made.
+	PyObject		**items;	//!< (name, value) tuples built so far.
+	Py_ssize_t		len;		//!< Number of pairs.
+} python_pair_list_t;
+
 static void			*python_dlhandle;
 static PyThreadState		*global_interpreter;	//!< Our first interpreter.
 
-static module_ctx_t const	*current_mctx;		//!< Used for communication with inittab functions.
-static CONF_SECTION		*current_conf;		//!< Used for communication with inittab functions.
 static char			*default_path;		//!< The default python path.
 
 /*
- *	As of Python 3.8 the GIL will be per-interpreter
- *	If there are still issues with CEXTs,
- *	multiple interpreters and the GIL at that point
- *	users can build rlm_python against Python 3.8
- *	and the horrible hack of using a single interpreter
- *	for all instances of rlm_python will no longer be
- *	required.
+ *	Each instance of rlm_python gets its own sub-interpreter,
+ *	but all threads calling into that instance share its GIL.
  *
- *	As Python 3.x module initialisation is significantly
- *	different than Python 2.x initialisation,
- *	it'd be a pain to retain the cext_compat for
- *	Python 3 and as Python 3 users have the option of
- *	using as version of Python which fixes the underlying
- *	issue, we only support using a global interpreter
- *	for Python 2.7 and below.
+ *	With Python 3.12 and above, per_thread_interpreter gives
+ *	each worker thread a sub-interpreter with its own GIL
+ *	(PEP 684), so calls made by different threads run in
+ *	parallel.  The price is that every interpreter has its own
+ *	copy of the user's modules, and C extensions must support
+ *	multi-phase initialisation to be imported.
  */
 
 /*
@@ -132,6 +164,7 @@ static CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("python_path", FR_TYPE_STRING, rlm_python_t, python_path) },
 	{ FR_CONF_OFFSET("python_path_include_conf_dir", FR_TYPE_BOOL, rlm_python_t, python_path_include_conf_dir), .dflt = "yes" },
 	{ FR_CONF_OFFSET("python_path_include_default", FR_TYPE_BOOL, rlm_python_t, python_path_include_default), .dflt = "yes" },
+	{ FR_CONF_OFFSET("per_thread_interpreter", FR_TYPE_BOOL, rlm_python_t, per_thread_interpreter), .dflt = "no" },
 
 	CONF_PARSER_TERMINATOR
 };
@@ -467,64 +500,249 @@ static int mod_populate_vptuple(module_ctx_t const *mctx, request_t *request, Py
 	return 0;
 }
 
+/** Build the (name, value) tuple for a pair, and cache it in the list
+ *
+ * Pairs which can't be marshalled are presented as None.
+ */
+static PyObject *python_pair_list_item_build(python_pair_list_t *pl, Py_ssize_t i)
+{
+	PyObject *pp;
+
+	if (!pl->vps) {
+		PyErr_SetString(PyExc_RuntimeError, "Request pairs are no longer available");
+		return NULL;
+	}
+
+	/* The inside tuple has two only: */
+	if ((pp = PyTuple_New(2)) == NULL) return NULL;
+
+	if (mod_populate_vptuple(pl->mctx, pl->request, pp, pl->vps[i]) < 0) {
+		Py_DECREF(pp);
+		Py_INCREF(Py_None);
+		pp = Py_None;
+	}
+
+	Py_INCREF(pp);
+	pl->items[i] = pp;
+
+	return pp;
+}
+
+static Py_ssize_t python_pair_list_length(PyObject *self)
+{
+	return ((python_pair_list_t *)self)->len;
+}
+
+static PyObject *python_pair_list_item(PyObject *self, Py_ssize_t i)
+{
+	python_pair_list_t *pl = (python_pair_list_t *)self;
+
+	if ((i < 0) || (i >= pl->len)) {
+		PyErr_SetString(PyExc_IndexError, "PairList index out of range");
+		return NULL;
+	}
+
+	if (pl->items[i]) {
+		Py_INCREF(pl->items[i]);
+		return pl->items[i];
+	}
+
+	return python_pair_list_item_build(pl, i);
+}
+
+/** Support negative indexes and slices, as a tuple would
+ *
+ */
+static PyObject *python_pair_list_subscript(PyObject *self, PyObject *key)
+{
+	python_pair_list_t *pl = (python_pair_list_t *)self;
+
+	if (PyIndex_Check(key)) {
+		Py_ssize_t i;
+
+		i = PyNumber_AsSsize_t(key, PyExc_IndexError);
+		if ((i == -1) && PyErr_Occurred()) return NULL;
+		if (i < 0) i += pl->len;
+
+		return python_pair_list_item(self, i);
+	}
+
+	if (PySlice_Check(key)) {
+		Py_ssize_t	start, stop, step, slice_len, i, j;
+		PyObject	*out;
+
+		if (PySlice_Unpack(key, &start, &stop, &step) < 0) return NULL;
+		slice_len = PySlice_AdjustIndices(pl->len, &start, &stop, step);
+
+		if ((out = PyTuple_New(slice_len)) == NULL) return NULL;
+		for (i = 0, j = start; i < slice_len; i++, j += step) {
+			PyObject *item;
+
+			item = python_pair_list_item(self, j);
+			if (!item) {
+				Py_DECREF(out);
+				return NULL;
+			}
+			PyTuple_SET_ITEM(out, i, item);
+		}
+
+		return out;
+	}
+
+	PyErr_Format(PyExc_TypeError, "PairList indices must be integers or slices, not %.200s",
+		     Py_TYPE(key)->tp_name);
+	return NULL;
+}
+
+static PyObject *python_pair_list_repr(PyObject *self)
+{
+	PyObject *tuple, *repr;
+
+	if ((tuple = PySequence_Tuple(self)) == NULL) return NULL;
+	repr = PyObject_Repr(tuple);
+	Py_DECREF(tuple);
+
+	return repr;
+}
+
+static void python_pair_list_dealloc(PyObject *self)
+{
+	python_pair_list_t	*pl = (python_pair_list_t *)self;
+	PyTypeObject		*type = Py_TYPE(self);
+	Py_ssize_t		i;
+
+	if (pl->items) for (i = 0; i < pl->len; i++) Py_XDECREF(pl->items[i]);
+	PyMem_Free(pl->items);
+	PyMem_Free(pl->vps);
+
+	type->tp_free(self);
+	Py_DECREF(type);	/* Instances of heap types hold a reference to their type */
+}
+
+static PyType_Slot python_pair_list_slots[] = {
+	{ Py_tp_doc, UNCONST(char *, "Request pairs, as a sequence of (name, value) tuples") },
+	{ Py_tp_dealloc, (void *)python_pair_list_dealloc },
+	{ Py_tp_repr, (void *)python_pair_list_repr },
+	{ Py_sq_length, (void *)python_pair_list_length },
+	{ Py_sq_item, (void *)python_pair_list_item },
+	{ Py_mp_length, (void *)python_pair_list_length },
+	{ Py_mp_subscript, (void *)python_pair_list_subscript },
+	{ 0, NULL }
+};
+
+/** Template for the PairList type
+ *
+ * A type is created from this in each interpreter, as types can't be
+ * shared between interpreters with their own GIL.
+ */
+static PyType_Spec python_pair_list_spec = {
+	.name = "freeradius.PairList",
+	.basicsize = sizeof(python_pair_list_t),
+	.flags = Py_TPFLAGS_DEFAULT,
+	.slots = python_pair_list_slots
+};
+
+/** Wrap a request's pairs for passing to a python function
+ *
+ * Only pointers to the pairs are recorded here, they're converted to
+ * python objects when the function accesses them.
+ */
+static PyObject *python_pair_list_alloc(PyTypeObject *type, module_ctx_t const *mctx, request_t *request,
+					fr_pair_list_t *list, Py_ssize_t len)
+{
+	python_pair_list_t	*pl;
+	fr_pair_t		*vp;
+	Py_ssize_t		i = 0;
+
+	if ((pl = PyObject_New(python_pair_list_t, type)) == NULL) return NULL;
+	pl->mctx = mctx;
+	pl->request = request;
+	pl->len = 0;
+	pl->items = PyMem_Calloc(len, sizeof(*pl->items));
+	pl->vps = PyMem_Malloc(len * sizeof(*pl->vps));
+	if (!pl->items || !pl->vps) {
+		Py_DECREF(pl);
+		return PyErr_NoMemory();
+	}
+
+	for (vp = fr_pair_list_head(list);
+	     vp && (i < len);
+	     vp = fr_pair_list_next(list, vp)) pl->vps[i++] = vp;
+	pl->len = i;
+
+	return (PyObject *)pl;
+}
+
+/** Stop a pair list referencing the request
+ *
+ * If the function kept a reference to the list, the pairs it didn't
+ * look at are converted now, as the request may be freed once we return.
+ */
+static void python_pair_list_release(python_pair_list_t *pl)
+{
+	Py_ssize_t i;
+
+	if (Py_REFCNT(pl) > 1) for (i = 0; i < pl->len; i++) {
+		PyObject *item;
+
+		if (pl->items[i]) continue;
+
+		item = python_pair_list_item_build(pl, i);
+		if (!item) {
+			PyErr_Clear();
+			continue;
+		}
+		Py_DECREF(item);
+	}
+
+	PyMem_Free(pl->vps);
+	pl->vps = NULL;
+	pl->request = NULL;
+	pl->mctx = NULL;
+}
+
 static unlang_action_t do_python_single(rlm_rcode_t *p_result, module_ctx_t const *mctx,
-					request_t *request, PyObject *p_func, char const *funcname)
+					request_t *request, PyObject *p_func, char const *funcname,
+					PyTypeObject *pair_list_type)
 {
-	fr_pair_t	*vp;
 	PyObject	*p_ret = NULL;
 	PyObject	*p_arg = NULL;
-	int		tuple_len;
+	size_t		list_len;
 	rlm_rcode_t	rcode = RLM_MODULE_OK;
 
 	/*
-	 *	We will pass a tuple containing (name, value) tuples
-	 *	We can safely use the Python function to build up a
-	 *	tuple, since the tuple is not used elsewhere.
+	 *	We pass a sequence of (name, value) tuples, which
+	 *	are built as the function accesses them.
 	 *
-	 *	Determine the size of our tuple by walking through the packet.
-	 *	If request is NULL, pass None.
+	 *	If request is NULL, or there are no pairs, pass None.
 	 */
-	tuple_len = 0;
+	list_len = 0;
 	if (request != NULL) {
-		tuple_len = fr_pair_list_len(&request->request_pairs);
+		list_len = fr_pair_list_len(&request->request_pairs);
 	}
 
-	if (tuple_len == 0) {
+	if (list_len == 0) {
 		Py_INCREF(Py_None);
 		p_arg = Py_None;
 	} else {
-		int i = 0;
-		if ((p_arg = PyTuple_New(tuple_len)) == NULL) {
+		p_arg = python_pair_list_alloc(pair_list_type, mctx, request, &request->request_pairs, list_len);
+		if (!p_arg) {
 			rcode = RLM_MODULE_FAIL;
 			goto finish;
 		}
-
-		for (vp = fr_pair_list_head(&request->request_pairs);
-		     vp;
-		     vp = fr_pair_list_next(&request->request_pairs, vp), i++) {
-			PyObject *pp;
-
-			/* The inside tuple has two only: */
-			if ((pp = PyTuple_New(2)) == NULL) {
-				rcode = RLM_MODULE_FAIL;
-				goto finish;
-			}
-
-			if (mod_populate_vptuple(mctx, request, pp, vp) == 0) {
-				/* Put the tuple inside the container */
-				PyTuple_SET_ITEM(p_arg, i, pp);
-			} else {
-				Py_INCREF(Py_None);
-				PyTuple_SET_ITEM(p_arg, i, Py_None);
-				Py_DECREF(pp);
-			}
-		}
 	}
 
 	/* Call Python function. */
 	p_ret = PyObject_CallFunctionObjArgs(p_func, p_arg, NULL);
+	if (!p_ret) python_error_log(mctx, request); /* Needs valid thread with GIL */
+
+	/*
+	 *	Whatever the function did, it can't be allowed to
+	 *	access the request's pairs after we return.
+	 */
+	if (p_arg != Py_None) python_pair_list_release((python_pair_list_t *)p_arg);
+
 	if (!p_ret) {
-		python_error_log(mctx, request); /* Needs valid thread with GIL */
 		rcode = RLM_MODULE_FAIL;
 		goto finish;
 	}
@@ -612,7 +830,7 @@ static unlang_action_t do_python(rlm_rcode_t *p_result, module_ctx_t const *mctx
 	RDEBUG3("Using thread state %p/%p", mctx->inst->data, t->state);
 
 	PyEval_RestoreThread(t->state);	/* Swap in our local thread state */
-	do_python_single(&rcode, mctx, request, p_func, funcname);
+	do_python_single(&rcode, mctx, request, p_func, funcname, t->pair_list_type);
 	(void)fr_cond_assert(PyEval_SaveThread() == t->state);
 
 	RETURN_MODULE_RCODE(rcode);
@@ -621,8 +839,8 @@ static unlang_action_t do_python(rlm_rcode_t *p_result, module_ctx_t const *mctx
 #define MOD_FUNC(x) \
 static unlang_action_t CC_HINT(nonnull) mod_##x(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request) \
 { \
-	rlm_python_t const *inst = talloc_get_type_abort_const(mctx->inst->data, rlm_python_t); \
-	return do_python(p_result, mctx, request, inst->x.function, #x);\
+	rlm_python_thread_t *t = talloc_get_type_abort(mctx->thread, rlm_python_thread_t); \
+	return do_python(p_result, mctx, request, t->x.function, #x);\
 }
 
 MOD_FUNC(authenticate)
@@ -768,21 +986,21 @@ static int python_parse_config(module_inst_ctx_t const *mctx, CONF_SECTION *cs,
 /** Make the current instance's config available within the module we're initialising
  *
  */
-static int python_module_import_config(module_inst_ctx_t const *mctx, CONF_SECTION *conf, PyObject *module)
+static int python_module_import_config(PyObject **out, module_inst_ctx_t const *mctx,
+				       CONF_SECTION *conf, PyObject *module)
 {
-	rlm_python_t *inst = talloc_get_type_abort(mctx->inst->data, rlm_python_t);
 	CONF_SECTION *cs;
 
 	/*
 	 *	Convert a FreeRADIUS config structure into a python
 	 *	dictionary.
 	 */
-	inst->pythonconf_dict = PyDict_New();
-	if (!inst->pythonconf_dict) {
+	*out = PyDict_New();
+	if (!*out) {
 		ERROR("Unable to create python dict for config");
 	error:
-		Py_XDECREF(inst->pythonconf_dict);
-		inst->pythonconf_dict = NULL;
+		Py_XDECREF(*out);
+		*out = NULL;
 		python_error_log(MODULE_CTX_FROM_INST(mctx), NULL);
 		return -1;
 	}
@@ -790,13 +1008,13 @@ static int python_module_import_config(module_inst_ctx_t const *mctx, CONF_SECTI
 	cs = cf_section_find(conf, "config", NULL);
 	if (cs) {
 		DEBUG("Inserting \"config\" section into python environment as radiusd.config");
-		if (python_parse_config(mctx, cs, 0, inst->pythonconf_dict) < 0) goto error;
+		if (python_parse_config(mctx, cs, 0, *out) < 0) goto error;
 	}
 
 	/*
 	 *	Add module configuration as a dict
 	 */
-	if (PyModule_AddObject(module, "config", inst->pythonconf_dict) < 0) goto error;
+	if (PyModule_AddObject(module, "config", *out) < 0) goto error;
 
 	return 0;
 }
@@ -828,7 +1046,16 @@ static char *python_path_build(TALLOC_CTX *ctx, rlm_python_t *inst, CONF_SECTION
 		MEM(path = talloc_asprintf_append_buffer(path, "%s:", inst->python_path));
 	}
 	if (inst->python_path_include_conf_dir) {
-		MEM(path = talloc_asprintf_append_buffer(path, "%s:", dirname(UNCONST(char *, cf_filename(conf)))));
+		char *filename;
+
+		/*
+		 *	dirname() may modify its argument, and with
+		 *	per_thread_interpreter this is called once
+		 *	per thread.
+		 */
+		MEM(filename = talloc_strdup(NULL, cf_filename(conf)));
+		MEM(path = talloc_asprintf_append_buffer(path, "%s:", dirname(filename)));
+		talloc_free(filename);
 	}
 	if (inst->python_path_include_default) {
 		MEM(path = talloc_asprintf_append_buffer(path, "%s:", default_path));
@@ -843,45 +1070,95 @@ static char *python_path_build(TALLOC_CTX *ctx, rlm_python_t *inst, CONF_SECTION
 /*
  *	Python 3 interpreter initialisation and destruction
  */
+static PyModuleDef_Slot python_module_slots[] = {
+#ifdef PYTHON_HAVE_OWN_GIL
+	{ Py_mod_multiple_interpreters, Py_MOD_PER_INTERPRETER_GIL_SUPPORTED },
+#endif
+	{ 0, NULL }
+};
+
+static struct PyModuleDef py_module_def = {
+	PyModuleDef_HEAD_INIT,
+	.m_name = "freeradius",
+	.m_doc = "freeRADIUS python module",
+	.m_size = 0,
+	.m_methods = module_methods,
+	.m_slots = python_module_slots
+};
+
+/** Called via the inittab when an interpreter first imports freeradius
+ *
+ * Uses multi-phase initialisation, so every interpreter (including ones
+ * with their own GIL) gets a separate module object.  The config and
+ * constants are added after the module is imported.
+ */
 static PyObject *python_module_init(void)
 {
-	PyObject		*module;
-
-	static struct PyModuleDef py_module_def = {
-		PyModuleDef_HEAD_INIT,
-		.m_name = "freeradius",
-		.m_doc = "freeRADIUS python module",
-		.m_size = -1,
-		.m_methods = module_methods
-	};
+	return PyModuleDef_Init(&py_module_def);
+}
 
-	fr_assert(current_mctx);
+/** Set the path, and import the freeradius module into the current interpreter
+ *
+ * Each interpreter gets its own copy of the module, which it can mutate
+ * as much as it wants.
+ *
+ * Must be called with the interpreter's thread state set.
+ */
+static int python_interpreter_setup(PyObject **module_out, PyObject **conf_dict_out, PyTypeObject **pair_list_type_out,
+				    module_inst_ctx_t const *mctx)
+{
+	rlm_python_t	*inst = talloc_get_type_abort(mctx->inst->data, rlm_python_t);
+	CONF_SECTION	*conf = mctx->inst->conf;
+	char		*path;
+	PyObject	*module;
+	PyTypeObject	*pair_list_type;
+	wchar_t	        *wide_path;
+
+	path = python_path_build(NULL, inst, conf);
+	DEBUG3("Setting python path to \"%s\"", path);
+	wide_path = Py_DecodeLocale(path, NULL);
+	talloc_free(path);
+	PySys_SetPath(wide_path);
+	PyMem_RawFree(wide_path);
 
-	module = PyModule_Create(&py_module_def);
+	module = PyImport_ImportModule("freeradius");
 	if (!module) {
-		python_error_log(current_mctx, NULL);
-		Py_RETURN_NONE;
+		ERROR("Failed importing \"freeradius\" module into interpreter %p", PyThreadState_Get());
+		python_error_log(MODULE_CTX_FROM_INST(mctx), NULL);
+		return -1;
+	}
+	if ((python_module_import_config(conf_dict_out, mctx, conf, module) < 0) ||
+	    (python_module_import_constants(mctx, module) < 0)) {
+	error:
+		Py_DECREF(module);
+		return -1;
 	}
 
-	return module;
+	pair_list_type = (PyTypeObject *)PyType_FromSpec(&python_pair_list_spec);
+	if (!pair_list_type) {
+		ERROR("Failed creating PairList type");
+		python_error_log(MODULE_CTX_FROM_INST(mctx), NULL);
+		goto error;
+	}
+
+	Py_INCREF(pair_list_type);	/* PyModule_AddObject steals a reference on success */
+	if (PyModule_AddObject(module, "PairList", (PyObject *)pair_list_type) < 0) {
+		ERROR("Failed adding PairList type to module");
+		python_error_log(MODULE_CTX_FROM_INST(mctx), NULL);
+		Py_DECREF(pair_list_type);
+		Py_DECREF(pair_list_type);
+		goto error;
+	}
+
+	*module_out = module;
+	*pair_list_type_out = pair_list_type;
+
+	return 0;
 }
 
 static int python_interpreter_init(module_inst_ctx_t const *mctx)
 {
 	rlm_python_t	*inst = talloc_get_type_abort(mctx->inst->data, rlm_python_t);
-	CONF_SECTION	*conf = mctx->inst->conf;
-	char		*path;
-	PyObject	*module;
-	wchar_t	        *wide_path;
-
-	/*
-	 *	python_module_init takes no args, so we need
-	 *	to set these globals so that when it's
-	 *	called during interpreter initialisation
-	 *	it can get at the current instance config.
-	 */
-	current_mctx = MODULE_CTX_FROM_INST(mctx);
-	current_conf = conf;
 
 	PyEval_RestoreThread(global_interpreter);
 	LSAN_DISABLE(inst->interpreter = Py_NewInterpreter());
@@ -893,31 +1170,10 @@ static int python_interpreter_init(module_inst_ctx_t const *mctx)
 	PyEval_SaveThread();		/* Unlock GIL */
 
 	PyEval_RestoreThread(inst->interpreter);
-
-	path = python_path_build(inst, inst, conf);
-	DEBUG3("Setting python path to \"%s\"", path);
-	wide_path = Py_DecodeLocale(path, NULL);
-	talloc_free(path);
-	PySys_SetPath(wide_path);
-	PyMem_RawFree(wide_path);
-
-	/*
-	 *	Import the radiusd module into this python
-	 *	environment.  Each interpreter gets its
-	 *	own copy which it can mutate as much as
-	 *      it wants.
-	 */
- 	module = PyImport_ImportModule("freeradius");
- 	if (!module) {
- 		ERROR("Failed importing \"freeradius\" module into interpreter %p", inst->interpreter);
- 		return -1;
- 	}
-	if ((python_module_import_config(mctx, conf, module) < 0) ||
-	    (python_module_import_constants(mctx, module) < 0)) {
-		Py_DECREF(module);
+	if (python_interpreter_setup(&inst->module, &inst->pythonconf_dict, &inst->pair_list_type, mctx) < 0) {
+		PyEval_SaveThread();
 		return -1;
 	}
-	inst->module = module;
 	PyEval_SaveThread();
 
 	return 0;
@@ -952,6 +1208,14 @@ static int mod_instantiate(module_inst_ctx_t const *mctx)
 {
 	rlm_python_t	*inst = talloc_get_type_abort(mctx->inst->data, rlm_python_t);
 
+#ifndef PYTHON_HAVE_OWN_GIL
+	if (inst->per_thread_interpreter) {
+		cf_log_warn(mctx->inst->conf, "per_thread_interpreter requires Python >= 3.12, "
+			    "all threads will share the instance's interpreter");
+		inst->per_thread_interpreter = false;
+	}
+#endif
+
 	if (python_interpreter_init(mctx) < 0) return -1;
 
 	/*
@@ -972,12 +1236,14 @@ static int mod_instantiate(module_inst_ctx_t const *mctx)
 	PYTHON_FUNC_LOAD(detach);
 
 	/*
-	 *	Call the instantiate function.
+	 *	Call the instantiate function.  With per-thread
+	 *	interpreters it's called in each of those instead,
+	 *	the functions are only loaded here to check they exist.
 	 */
-	if (inst->instantiate.function) {
+	if (inst->instantiate.function && !inst->per_thread_interpreter) {
 		rlm_rcode_t rcode;
 
-		do_python_single(&rcode, MODULE_CTX_FROM_INST(mctx), NULL, inst->instantiate.function, "instantiate");
+		do_python_single(&rcode, MODULE_CTX_FROM_INST(mctx), NULL, inst->instantiate.function, "instantiate", NULL);
 		switch (rcode) {
 		case RLM_MODULE_FAIL:
 		case RLM_MODULE_REJECT:
@@ -1018,10 +1284,10 @@ static int mod_detach(module_detach_ctx_t const *mctx)
 	/*
 	 *	We don't care if this fails.
 	 */
-	if (inst->detach.function) {
+	if (inst->detach.function && !inst->per_thread_interpreter) {
 		rlm_rcode_t rcode;
 
-		(void)do_python_single(&rcode, MODULE_CTX_FROM_INST(mctx), NULL, inst->detach.function, "detach");
+		(void)do_python_single(&rcode, MODULE_CTX_FROM_INST(mctx), NULL, inst->detach.function, "detach", NULL);
 	}
 
 #define PYTHON_FUNC_DESTROY(_x) python_function_destroy(&inst->_x)
@@ -1034,6 +1300,7 @@ static int mod_detach(module_detach_ctx_t const *mctx)
 	PYTHON_FUNC_DESTROY(detach);
 
 	Py_XDECREF(inst->pythonconf_dict);
+	Py_XDECREF(inst->pair_list_type);
 	PyEval_SaveThread();
 
 	/*
@@ -1044,12 +1311,138 @@ static int mod_detach(module_detach_ctx_t const *mctx)
 	return 0;
 }
 
+#ifdef PYTHON_HAVE_OWN_GIL
+/** Release everything the thread holds in its own interpreter, then destroy the interpreter
+ *
+ * Must be called with the thread's interpreter state set.
+ */
+static void python_thread_interpreter_free(rlm_python_thread_t *t)
+{
+#define PYTHON_THREAD_FUNC_DESTROY(_x) python_function_destroy(&t->_x)
+	PYTHON_THREAD_FUNC_DESTROY(instantiate);
+	PYTHON_THREAD_FUNC_DESTROY(authorize);
+	PYTHON_THREAD_FUNC_DESTROY(authenticate);
+	PYTHON_THREAD_FUNC_DESTROY(preacct);
+	PYTHON_THREAD_FUNC_DESTROY(accounting);
+	PYTHON_THREAD_FUNC_DESTROY(post_auth);
+	PYTHON_THREAD_FUNC_DESTROY(detach);
+
+	Py_XDECREF(t->pair_list_type);
+	t->pair_list_type = NULL;
+	python_obj_destroy(&t->module);
+
+	Py_EndInterpreter(t->state);	/* Destroys the interpreter and its GIL - sets thread state to NULL */
+	t->state = NULL;
+}
+
+/** Create an interpreter, with its own GIL, for the current thread
+ *
+ * The freeradius module, config, and the user's functions are loaded
+ * into it, in the same way as for the instance's interpreter.
+ */
+static int python_thread_interpreter_init(module_thread_inst_ctx_t const *mctx)
+{
+	rlm_python_t		*inst = talloc_get_type_abort(mctx->inst->data, rlm_python_t);
+	rlm_python_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_python_thread_t);
+	module_inst_ctx_t const	*imctx = MODULE_INST_CTX(mctx->inst);
+	PyThreadState		*boot;
+	PyObject		*conf_dict;
+	PyStatus		status;
+	PyInterpreterConfig	config = {
+		.use_main_obmalloc = 0,
+		.allow_fork = 0,
+		.allow_exec = 0,
+		.allow_threads = 1,
+		.allow_daemon_threads = 0,
+		.check_multi_interp_extensions = 1,
+		.gil = PyInterpreterConfig_OWN_GIL,
+	};
+
+	/*
+	 *	A thread state must be current when creating an
+	 *	interpreter, so borrow one from the main interpreter.
+	 */
+	boot = PyThreadState_New(global_interpreter->interp);
+	if (!boot) {
+		ERROR("Failed initialising local PyThreadState");
+		return -1;
+	}
+	PyEval_RestoreThread(boot);
+
+	/*
+	 *	On success this releases the main interpreter's
+	 *	GIL, and leaves us holding the new interpreter's.
+	 */
+	LSAN_DISABLE(status = Py_NewInterpreterFromConfig(&t->state, &config));
+	if (PyStatus_Exception(status)) {
+		ERROR("Failed creating per-thread interpreter: %s", status.err_msg ? status.err_msg : "unknown error");
+		t->state = NULL;
+		goto done;
+	}
+	DEBUG3("Created new interpreter %p for thread", t->state);
+
+	if (python_interpreter_setup(&t->module, &conf_dict, &t->pair_list_type, imctx) < 0) {
+	error:
+		python_thread_interpreter_free(t);
+		PyEval_RestoreThread(boot);
+		goto done;
+	}
+
+#define PYTHON_THREAD_FUNC_LOAD(_x) \
+	t->_x = (python_func_def_t){ .module_name = inst->_x.module_name, .function_name = inst->_x.function_name }; \
+	if (python_function_load(imctx, &t->_x) < 0) goto error
+	PYTHON_THREAD_FUNC_LOAD(instantiate);
+	PYTHON_THREAD_FUNC_LOAD(authenticate);
+	PYTHON_THREAD_FUNC_LOAD(authorize);
+	PYTHON_THREAD_FUNC_LOAD(preacct);
+	PYTHON_THREAD_FUNC_LOAD(accounting);
+	PYTHON_THREAD_FUNC_LOAD(post_auth);
+	PYTHON_THREAD_FUNC_LOAD(detach);
+
+	/*
+	 *	Module level state is per-interpreter, so the
+	 *	instantiate function is called for every thread.
+	 */
+	if (t->instantiate.function) {
+		rlm_rcode_t rcode;
+
+		do_python_single(&rcode, MODULE_CTX_FROM_THREAD_INST(mctx), NULL,
+				 t->instantiate.function, "instantiate", NULL);
+		switch (rcode) {
+		case RLM_MODULE_FAIL:
+		case RLM_MODULE_REJECT:
+			goto error;
+
+		default:
+			break;
+		}
+	}
+
+	PyEval_SaveThread();		/* Unlock our GIL */
+	PyEval_RestoreThread(boot);
+
+done:
+	/*
+	 *	Dispose of the borrowed thread state,
+	 *	this also unlocks the main GIL.
+	 */
+	PyThreadState_Clear(boot);
+	PyThreadState_DeleteCurrent();
+
+	return t->state ? 0 : -1;
+}
+#endif
+
 static int mod_thread_instantiate(module_thread_inst_ctx_t const *mctx)
 {
 	PyThreadState		*state;
 	rlm_python_t		*inst = talloc_get_type_abort(mctx->inst->data, rlm_python_t);
 	rlm_python_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_python_thread_t);
 
+#ifdef PYTHON_HAVE_OWN_GIL
+	if (inst->per_thread_interpreter) return python_thread_interpreter_init(mctx);
+#endif
+
 	state = PyThreadState_New(inst->interpreter->interp);
 	if (!state) {
 		ERROR("Failed initialising local PyThreadState");
@@ -1059,6 +1452,20 @@ static int mod_thread_instantiate(module_thread_inst_ctx_t const *mctx)
 	DEBUG3("Initialised new thread state %p", state);
 	t->state = state;
 
+	/*
+	 *	Borrow the instance's references, they're
+	 *	released when the instance is detached.
+	 */
+	t->module = inst->module;
+	t->pair_list_type = inst->pair_list_type;
+	t->instantiate = inst->instantiate;
+	t->authorize = inst->authorize;
+	t->authenticate = inst->authenticate;
+	t->preacct = inst->preacct;
+	t->accounting = inst->accounting;
+	t->post_auth = inst->post_auth;
+	t->detach = inst->detach;
+
 	return 0;
 }
 
@@ -1066,6 +1473,28 @@ static int mod_thread_detach(module_thread_inst_ctx_t const *mctx)
 {
 	rlm_python_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_python_thread_t);
 
+	if (!t->state) return 0;
+
+#ifdef PYTHON_HAVE_OWN_GIL
+	if (talloc_get_type_abort(mctx->inst->data, rlm_python_t)->per_thread_interpreter) {
+		PyEval_RestoreThread(t->state);	/* Swap in our interpreter, and lock its GIL */
+
+		/*
+		 *	We don't care if this fails.
+		 */
+		if (t->detach.function) {
+			rlm_rcode_t rcode;
+
+			(void)do_python_single(&rcode, MODULE_CTX_FROM_THREAD_INST(mctx), NULL,
+					       t->detach.function, "detach", NULL);
+		}
+
+		python_thread_interpreter_free(t);
+
+		return 0;
+	}
+#endif
+
 	PyEval_RestoreThread(t->state);	/* Swap in our local thread state */
 	PyThreadState_Clear(t->state);
 	PyEval_SaveThread();
@@ -42,6 +42,8 @@ static CONF_PARSER submodule_config[] = {
 			 strip_permanent_identity_hint ), .dflt = "yes" },
 	{ FR_CONF_OFFSET("ephemeral_id_length", FR_TYPE_SIZE, eap_aka_sim_process_conf_t, ephemeral_id_length ), .dflt = "14" },	/* 14 for compatibility */
 	{ FR_CONF_OFFSET("protected_success", FR_TYPE_BOOL, eap_aka_sim_process_conf_t, protected_success ), .dflt = "no" },
+	{ FR_CONF_OFFSET("vector_cache", FR_TYPE_SUBSECTION, eap_aka_sim_process_conf_t, vector_cache_conf ),
+	  .subcs = (void const *) fr_aka_sim_vector_cache_config },
 
 	CONF_PARSER_TERMINATOR
 };
@@ -245,6 +247,11 @@ static int mod_instantiate(module_inst_ctx_t const *mctx)
 	 */
 	if (inst->request_identity == AKA_SIM_INIT_ID_REQ) inst->request_identity = AKA_SIM_NO_ID_REQ;
 
+	if (fr_aka_sim_vector_cache_alloc(inst, &inst->vector_cache, &inst->vector_cache_conf) < 0) {
+		cf_log_perr(mctx->inst->conf, "Failed allocating vector cache");
+		return -1;
+	}
+
 	return 0;
 }
 
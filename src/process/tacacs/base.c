@@ -592,6 +592,12 @@ static int mod_instantiate(module_inst_ctx_t const *mctx)
 	inst->state_tree = fr_state_tree_init(inst, attr_tacacs_state, main_config->spawn_workers, inst->max_session,
 					      inst->session_timeout, inst->state_server_id,
 					      fr_hash_string(cf_section_name2(inst->server_cs)));
+	if (!inst->state_tree) return -1;
+
+	if (fr_command_register_hook(NULL, cf_section_name2(inst->server_cs), inst->state_tree, cmd_state_table) < 0) {
+		cf_log_perr(inst->server_cs, "Failed registering radmin commands");
+		return -1;
+	}
 
 	return 0;
 }
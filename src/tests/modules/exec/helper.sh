@@ -0,0 +1,44 @@
+#!/bin/sh
+#
+#  A persistent helper for rlm_exec.  Requests are the input pairs, one
+#  per line, terminated by a line containing only ".".  Each response is
+#  a status line, then User-Name in Tmp-String-0, and our PID in
+#  Tmp-Integer-0, terminated by a line containing only ".".
+#
+#  Some User-Names change our behaviour:
+#
+#  - "split" writes the response in two parts.
+#  - "sleep" doesn't respond in time.
+#  - "exit" exits without responding.
+#
+name=
+while read -r line; do
+	case "$line" in
+	.)
+		case "$name" in
+		sleep)
+			sleep 5
+			;;
+
+		exit)
+			exit 0
+			;;
+		esac
+
+		echo 0
+		echo "Tmp-String-0 := \"$name\""
+		if [ "$name" = "split" ]; then
+			sleep 0.2
+		fi
+		echo "Tmp-Integer-0 := $$"
+		echo .
+		name=
+		;;
+
+	'User-Name = '*)
+		name=${line#User-Name = }
+		name=${name#\"}
+		name=${name%\"}
+		;;
+	esac
+done
@@ -0,0 +1,15 @@
+import freeradius
+
+
+def authorize(p):
+    if not isinstance(p, freeradius.PairList):
+        return freeradius.RLM_MODULE_FAIL
+
+    pairs = tuple(p)
+    if len(p) != len(pairs) or p[-1] != pairs[-1] or p[1:] != pairs[1:]:
+        return freeradius.RLM_MODULE_FAIL
+
+    if dict(p).get("User-Name") != "bob":
+        return freeradius.RLM_MODULE_FAIL
+
+    return freeradius.RLM_MODULE_OK
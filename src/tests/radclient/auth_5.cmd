@@ -0,0 +1,24 @@
+#!/bin/sh
+#
+#	All of the batched requests must get their own reply
+#
+
+test_in="build/tests/radclient/auth_5.out"
+sent=$(grep "Sent Access-Request" ${test_in} | wc -l)
+accept=$(grep "Received Access-Accept" ${test_in} | wc -l)
+reject=$(grep "Received Access-Reject" ${test_in} | wc -l)
+
+if [ $sent -ne 8 ]; then
+	echo "ERROR: We expected 8 'Sent Access-Request' in '${test_in}', got ${sent}"
+	exit 1
+fi
+
+if [ $accept -ne 6 ]; then
+	echo "ERROR: We expected 6 'Received Access-Accept' in '${test_in}', got ${accept}"
+	exit 1
+fi
+
+if [ $reject -ne 2 ]; then
+	echo "ERROR: We expected 2 'Received Access-Reject' in '${test_in}', got ${reject}"
+	exit 1
+fi
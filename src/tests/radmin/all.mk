@@ -15,6 +15,14 @@ ifeq "$(AC_HAVE_GPERFTOOLS_PROFILER_H)" ""
 FILES := $(filter-out set-profile-status-yes.txt show-profile-status.txt,$(FILES))
 endif
 
+ifeq "$(AC_WITH_PERF)" ""
+FILES := $(filter-out set-unlang-profile-reset.txt show-unlang-profile.txt show-unlang-profile-folded.txt,$(FILES))
+endif
+
+ifeq "$(OPENSSL_LIBS)" ""
+FILES := $(filter-out stats-tls.txt,$(FILES))
+endif
+
 $(eval $(call TEST_BOOTSTRAP))
 
 #